@@ -1,4 +1,5 @@
 include(CheckIncludeFile)
+include(CheckIncludeFiles)
 include(CheckSymbolExists)
 include(CheckFunctionExists)
 include(CheckLibraryExists)
@@ -51,6 +52,15 @@ check_include_file(sys/filio.h HAVE_SYS_FILIO_H)
 check_include_file(sys/signalfd.h HAVE_SYS_SIGNALFD_H)
 check_include_file(sys/eventfd.h HAVE_SYS_EVENTFD_H)
 check_include_file(sys/timerfd.h HAVE_SYS_TIMERFD_H)
+check_include_file(sys/sendfile.h HAVE_SYS_SENDFILE_H)
+check_include_file(sys/syscall.h HAVE_SYS_SYSCALL_H)
+check_include_file(linux/futex.h HAVE_LINUX_FUTEX_H)
+check_include_file(linux/unix_diag.h HAVE_LINUX_UNIX_DIAG_H)
+check_include_file(linux/sockios.h HAVE_LINUX_SOCKIOS_H)
+check_include_file(linux/tcp.h HAVE_LINUX_TCP_H)
+check_include_file(linux/net_tstamp.h HAVE_LINUX_NET_TSTAMP_H)
+# linux/errqueue.h needs struct timespec
+check_include_files("time.h;linux/errqueue.h" HAVE_LINUX_ERRQUEUE_H)
 check_include_file(gnu/lib-names.h HAVE_GNU_LIB_NAMES_H)
 check_include_file(rpc/rpc.h HAVE_RPC_RPC_H)
 
@@ -63,6 +73,12 @@ check_function_exists(eventfd HAVE_EVENTFD)
 check_function_exists(timerfd_create HAVE_TIMERFD_CREATE)
 check_function_exists(bindresvport HAVE_BINDRESVPORT)
 check_function_exists(accept4 HAVE_ACCEPT4)
+check_function_exists(sendfile HAVE_SENDFILE)
+check_function_exists(sendfile64 HAVE_SENDFILE64)
+check_function_exists(splice HAVE_SPLICE)
+check_function_exists(tee HAVE_TEE)
+check_function_exists(syscall HAVE_SYSCALL)
+check_function_exists(memfd_create HAVE_MEMFD_CREATE)
 
 check_function_exists(pledge HAVE_PLEDGE)
 
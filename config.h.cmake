@@ -18,6 +18,14 @@
 #cmakedefine HAVE_SYS_SIGNALFD_H 1
 #cmakedefine HAVE_SYS_EVENTFD_H 1
 #cmakedefine HAVE_SYS_TIMERFD_H 1
+#cmakedefine HAVE_SYS_SENDFILE_H 1
+#cmakedefine HAVE_SYS_SYSCALL_H 1
+#cmakedefine HAVE_LINUX_FUTEX_H 1
+#cmakedefine HAVE_LINUX_UNIX_DIAG_H 1
+#cmakedefine HAVE_LINUX_SOCKIOS_H 1
+#cmakedefine HAVE_LINUX_TCP_H 1
+#cmakedefine HAVE_LINUX_NET_TSTAMP_H 1
+#cmakedefine HAVE_LINUX_ERRQUEUE_H 1
 #cmakedefine HAVE_GNU_LIB_NAMES_H 1
 #cmakedefine HAVE_RPC_RPC_H 1
 
@@ -40,6 +48,12 @@
 #cmakedefine HAVE_TIMERFD_CREATE 1
 #cmakedefine HAVE_BINDRESVPORT 1
 #cmakedefine HAVE_ACCEPT4 1
+#cmakedefine HAVE_SENDFILE 1
+#cmakedefine HAVE_SENDFILE64 1
+#cmakedefine HAVE_SPLICE 1
+#cmakedefine HAVE_TEE 1
+#cmakedefine HAVE_SYSCALL 1
+#cmakedefine HAVE_MEMFD_CREATE 1
 #cmakedefine HAVE_PLEDGE 1
 
 #cmakedefine HAVE_ACCEPT_PSOCKLEN_T 1
@@ -41,6 +41,7 @@
 */
 
 #include "config.h"
+#include "swrap_shm.h"
 
 #include <sys/types.h>
 #include <sys/time.h>
@@ -59,7 +60,33 @@
 #ifdef HAVE_SYS_TIMERFD_H
 #include <sys/timerfd.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#endif
+#ifdef HAVE_LINUX_SOCKIOS_H
+#include <linux/sockios.h>
+#endif
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/unix_diag.h>
+#endif
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+#include <linux/net_tstamp.h>
+#endif
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#endif
+#include <sys/mman.h>
 #include <sys/uio.h>
+#include <poll.h>
 #include <errno.h>
 #include <sys/un.h>
 #include <netinet/in.h>
@@ -70,9 +97,12 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <signal.h>
+#include <time.h>
 #ifdef HAVE_GNU_LIB_NAMES_H
 #include <gnu/lib-names.h>
 #endif
@@ -80,6 +110,7 @@
 #include <rpc/rpc.h>
 #endif
 #include <pthread.h>
+#include <sched.h>
 #include <dirent.h>
 
 enum swrap_dbglvl_e {
@@ -124,6 +155,10 @@ enum swrap_dbglvl_e {
 #define MIN(a,b) ((a)<(b)?(a):(b))
 #endif
 
+#ifndef MAX
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
+
 #ifndef ZERO_STRUCT
 #define ZERO_STRUCT(x) memset((char *)&(x), 0, sizeof(x))
 #endif
@@ -173,10 +208,28 @@ enum swrap_dbglvl_e {
 
 /* Add new global locks here please */
 # define SWRAP_LOCK_ALL \
+	SWRAP_LOCK(unix_diag); \
+	SWRAP_LOCK(rcvq); \
+	SWRAP_LOCK(oneway); \
+	SWRAP_LOCK(flow); \
+	SWRAP_LOCK(control); \
+	SWRAP_LOCK(profile); \
+	SWRAP_LOCK(stats); \
+	SWRAP_LOCK(partition); \
+	SWRAP_LOCK(delay_queue); \
 	SWRAP_LOCK(libc_symbol_binding); \
 
 # define SWRAP_UNLOCK_ALL \
 	SWRAP_UNLOCK(libc_symbol_binding); \
+	SWRAP_UNLOCK(delay_queue); \
+	SWRAP_UNLOCK(partition); \
+	SWRAP_UNLOCK(stats); \
+	SWRAP_UNLOCK(profile); \
+	SWRAP_UNLOCK(control); \
+	SWRAP_UNLOCK(flow); \
+	SWRAP_UNLOCK(oneway); \
+	SWRAP_UNLOCK(rcvq); \
+	SWRAP_UNLOCK(unix_diag); \
 
 
 #define SWRAP_DLIST_ADD(list,item) do { \
@@ -230,27 +283,6 @@ do { \
 #define swrapGetTimeOfDay(tval)	gettimeofday(tval)
 #endif
 
-/* we need to use a very terse format here as IRIX 6.4 silently
-   truncates names to 16 chars, so if we use a longer name then we
-   can't tell which port a packet came from with recvfrom()
-
-   with this format we have 8 chars left for the directory name
-*/
-#define SOCKET_FORMAT "%c%02X%04X"
-#define SOCKET_TYPE_CHAR_TCP		'T'
-#define SOCKET_TYPE_CHAR_UDP		'U'
-#define SOCKET_TYPE_CHAR_TCP_V6		'X'
-#define SOCKET_TYPE_CHAR_UDP_V6		'Y'
-
-
-#define SOCKET_FORMAT_LONG "%c%08X%04X"
-#define SOCKET_FORMAT_V6_LONG "%c%08X%08X%08X%08X%04X"
-
-#define SOCKET_TYPE_CHAR_TCP_LONG	'Q'
-#define SOCKET_TYPE_CHAR_UDP_LONG	'W'
-#define SOCKET_TYPE_CHAR_TCP_V6_LONG	'E'
-#define SOCKET_TYPE_CHAR_UDP_V6_LONG	'R'
-
 /*
  * Set the packet MTU to 1500 bytes for stream sockets to make it it easier to
  * format PCAP capture files (as the caller will simply continue from here).
@@ -271,10 +303,11 @@ do { \
 
 #define SOCKET_WRAPPER_MAX_SOCKETS_LIMIT 256000
 
-/* This limit is to avoid broadcast sendto() needing to stat too many
- * files.  It may be raised (with a performance cost) to up to 254
- * without changing the format above */
-#define MAX_WRAPPED_INTERFACES 40
+/*
+ * Interfaces are 24 bit ids, the lower bits of 127.X.Y.Z and of the
+ * addresses built by swrap_iface_ipv6(). 127.255.255.255 is the broadcast.
+ */
+#define SWRAP_IFACE_MAX 0xFFFFFE
 
 struct swrap_address {
 	socklen_t sa_socklen;
@@ -302,6 +335,9 @@ struct socket_info_fd {
 
 int first_free;
 
+struct swrap_delay_chan;
+struct swrap_tstamp_queue;
+
 struct socket_info
 {
 	unsigned int refcount;
@@ -318,6 +354,9 @@ struct socket_info
 	int defer_connect;
 	int pktinfo;
 	int tcp_nodelay;
+	int listening;
+	int reuseaddr;
+	int reuseport;
 
 	/* The unix path so we can unlink it on close() */
 	struct sockaddr_un un_addr;
@@ -326,6 +365,71 @@ struct socket_info
 	struct swrap_address myname;
 	struct swrap_address peername;
 
+	/* The name of the sockets accepted on a listener */
+	struct swrap_address acceptname;
+
+	/* The address in the index of bound addresses */
+	struct swrap_address boundname;
+	bool bind_hashed;
+	int bind_next;
+
+	/* State of the link emulation */
+	uint64_t rng_state;
+	struct swrap_delay_chan *delay_chan;
+	bool loss_bad;
+	unsigned int impaired;
+
+	/* State of the stream faults, per direction */
+	struct {
+		uint64_t bytes[2];
+		uint64_t stall_until[2];
+		unsigned int eagain[2];
+		bool reset;
+	} fault;
+
+	/* The segments of a stream for TCP_INFO, per direction */
+	struct {
+		uint32_t segs[2];
+		uint64_t last_usec[2];
+	} tcp;
+
+	/*
+	 * The inode of the peer of the unix stream, for the queue depths, and
+	 * its cookie in case the inode gets reused.
+	 */
+	uint32_t unix_peer_ino;
+	uint32_t unix_peer_cookie[2];
+
+	/* SO_SNDBUF and SO_RCVBUF like the kernel reports them, 0 if unset */
+	int sndbuf;
+	int rcvbuf;
+
+	/*
+	 * The receive queue of the bound datagram socket, the one of the
+	 * connected peer, each with the generation of the slot, and the one
+	 * the send in progress got charged to.
+	 */
+	struct swrap_rcvq *rcvq;
+	uint32_t rcvq_gen;
+	struct swrap_rcvq *rcvq_peer;
+	uint32_t rcvq_peer_gen;
+	struct swrap_rcvq *rcvq_charged;
+	size_t rcvq_charge;
+
+	/*
+	 * The shm ring size we offer the peer and the ring in use. An
+	 * accepted socket waits for the hello of the client while pending.
+	 */
+	size_t ring_size;
+	struct swrap_ring_conn *ring;
+	bool ring_pending;
+
+	/* SO_TIMESTAMP or SO_TIMESTAMPNS and the SO_TIMESTAMPING flags */
+	int timestamp;
+	int timestamping;
+	uint32_t tskey;
+	struct swrap_tstamp_queue *errqueue;
+
 	struct {
 		unsigned long pck_snd;
 		unsigned long pck_rcv;
@@ -342,12 +446,43 @@ static size_t max_sockets = 0;
  */
 static struct socket_info_fd *socket_fds;
 
+/* Entries of closed file descriptors, ready to be reused, chained by prev */
+static struct socket_info_fd *socket_fds_free;
+
 /* The mutex for accessing the global libc.symbols */
 static pthread_mutex_t libc_symbol_binding_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* The mutex for the delay queue of the link emulation */
+static pthread_mutex_t delay_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The mutex for mapping the partition table */
+static pthread_mutex_t partition_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The mutex for creating the statistics file */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The mutex for the list of profiled threads */
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The mutex for starting the control socket thread */
+static pthread_mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The mutex for allocating the flow table */
+static pthread_mutex_t flow_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The mutex for mapping the shared send times */
+static pthread_mutex_t oneway_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The mutex for mapping the shared receive queues */
+static pthread_mutex_t rcvq_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The mutex for the netlink socket asking about unix sockets */
+static pthread_mutex_t unix_diag_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* Function prototypes */
 
 bool socket_wrapper_enabled(void);
+void socket_wrapper_profile_dump(void);
 
 void swrap_constructor(void) CONSTRUCTOR_ATTRIBUTE;
 void swrap_destructor(void) DESTRUCTOR_ATTRIBUTE;
@@ -450,6 +585,7 @@ typedef int (*__libc_listen)(int sockfd, int backlog);
 typedef int (*__libc_open)(const char *pathname, int flags, mode_t mode);
 typedef int (*__libc_openat)(int dirfd, const char *path, int flags, ...);
 typedef int (*__libc_pipe)(int pipefd[2]);
+typedef int (*__libc_poll)(struct pollfd *fds, nfds_t nfds, int timeout);
 typedef int (*__libc_read)(int fd, void *buf, size_t count);
 typedef ssize_t (*__libc_readv)(int fd, const struct iovec *iov, int iovcnt);
 typedef int (*__libc_recv)(int sockfd, void *buf, size_t len, int flags);
@@ -462,6 +598,18 @@ typedef int (*__libc_recvfrom)(int sockfd,
 typedef int (*__libc_recvmsg)(int sockfd, const struct msghdr *msg, int flags);
 typedef int (*__libc_send)(int sockfd, const void *buf, size_t len, int flags);
 typedef int (*__libc_sendmsg)(int sockfd, const struct msghdr *msg, int flags);
+#ifdef HAVE_SENDFILE
+typedef ssize_t (*__libc_sendfile)(int out_fd,
+				   int in_fd,
+				   off_t *offset,
+				   size_t count);
+#endif
+#if defined(HAVE_SENDFILE64) && !defined(__USE_FILE_OFFSET64)
+typedef ssize_t (*__libc_sendfile64)(int out_fd,
+				     int in_fd,
+				     off64_t *offset,
+				     size_t count);
+#endif
 typedef int (*__libc_sendto)(int sockfd,
 			   const void *buf,
 			   size_t len,
@@ -473,11 +621,26 @@ typedef int (*__libc_setsockopt)(int sockfd,
 			       int optname,
 			       const void *optval,
 			       socklen_t optlen);
+typedef int (*__libc_shutdown)(int sockfd, int how);
 #ifdef HAVE_SIGNALFD
 typedef int (*__libc_signalfd)(int fd, const sigset_t *mask, int flags);
 #endif
 typedef int (*__libc_socket)(int domain, int type, int protocol);
 typedef int (*__libc_socketpair)(int domain, int type, int protocol, int sv[2]);
+#ifdef HAVE_SPLICE
+typedef ssize_t (*__libc_splice)(int fd_in,
+				 loff_t *off_in,
+				 int fd_out,
+				 loff_t *off_out,
+				 size_t len,
+				 unsigned int flags);
+#endif
+#ifdef HAVE_TEE
+typedef ssize_t (*__libc_tee)(int fd_in,
+			      int fd_out,
+			      size_t len,
+			      unsigned int flags);
+#endif
 #ifdef HAVE_TIMERFD_CREATE
 typedef int (*__libc_timerfd_create)(int clockid, int flags);
 #endif
@@ -514,6 +677,7 @@ struct swrap_libc_symbols {
 	SWRAP_SYMBOL_ENTRY(open);
 	SWRAP_SYMBOL_ENTRY(openat);
 	SWRAP_SYMBOL_ENTRY(pipe);
+	SWRAP_SYMBOL_ENTRY(poll);
 	SWRAP_SYMBOL_ENTRY(read);
 	SWRAP_SYMBOL_ENTRY(readv);
 	SWRAP_SYMBOL_ENTRY(recv);
@@ -521,13 +685,26 @@ struct swrap_libc_symbols {
 	SWRAP_SYMBOL_ENTRY(recvmsg);
 	SWRAP_SYMBOL_ENTRY(send);
 	SWRAP_SYMBOL_ENTRY(sendmsg);
+#ifdef HAVE_SENDFILE
+	SWRAP_SYMBOL_ENTRY(sendfile);
+#endif
+#if defined(HAVE_SENDFILE64) && !defined(__USE_FILE_OFFSET64)
+	SWRAP_SYMBOL_ENTRY(sendfile64);
+#endif
 	SWRAP_SYMBOL_ENTRY(sendto);
 	SWRAP_SYMBOL_ENTRY(setsockopt);
+	SWRAP_SYMBOL_ENTRY(shutdown);
 #ifdef HAVE_SIGNALFD
 	SWRAP_SYMBOL_ENTRY(signalfd);
 #endif
 	SWRAP_SYMBOL_ENTRY(socket);
 	SWRAP_SYMBOL_ENTRY(socketpair);
+#ifdef HAVE_SPLICE
+	SWRAP_SYMBOL_ENTRY(splice);
+#endif
+#ifdef HAVE_TEE
+	SWRAP_SYMBOL_ENTRY(tee);
+#endif
 #ifdef HAVE_TIMERFD_CREATE
 	SWRAP_SYMBOL_ENTRY(timerfd_create);
 #endif
@@ -547,6 +724,7 @@ static struct swrap swrap;
 
 /* prototypes */
 static const char *socket_wrapper_dir(void);
+static unsigned int swrap_topo_host_iface(const char *name);
 
 #define LIBC_NAME "libc.so"
 
@@ -692,6 +870,356 @@ static void *_swrap_bind_symbol(enum swrap_lib lib, const char *fn_name)
 	} \
 	SWRAP_UNLOCK(libc_symbol_binding)
 
+/****************************************************************************
+ *   PROFILING
+ ***************************************************************************/
+
+/*
+ * With SOCKET_WRAPPER_PROFILE set, every thread records the time of the
+ * wrapped functions in histograms, split into the time spent in
+ * socket_wrapper and in the libc functions it calls. The buckets are
+ * log-linear like HDR histograms: 8 sub-buckets per power of two, so a
+ * value is off by at most 12.5%. The histograms of all threads are merged
+ * into a report of percentiles when the process exits, or when
+ * socket_wrapper_profile_dump() gets called. When a thread exits its
+ * histograms are merged into the retired ones and the memory is freed.
+ */
+enum swrap_prof_func {
+	SWRAP_PROF_ACCEPT,
+	SWRAP_PROF_BIND,
+	SWRAP_PROF_CLOSE,
+	SWRAP_PROF_CONNECT,
+	SWRAP_PROF_GETSOCKOPT,
+	SWRAP_PROF_IOCTL,
+	SWRAP_PROF_LISTEN,
+	SWRAP_PROF_POLL,
+	SWRAP_PROF_READ,
+	SWRAP_PROF_READV,
+	SWRAP_PROF_RECV,
+	SWRAP_PROF_RECVFROM,
+	SWRAP_PROF_RECVMSG,
+	SWRAP_PROF_SEND,
+	SWRAP_PROF_SENDMSG,
+	SWRAP_PROF_SENDTO,
+	SWRAP_PROF_SETSOCKOPT,
+	SWRAP_PROF_SOCKET,
+	SWRAP_PROF_WRITE,
+	SWRAP_PROF_WRITEV,
+
+	SWRAP_PROF_NUM
+};
+
+static const char *swrap_prof_names[SWRAP_PROF_NUM] = {
+	[SWRAP_PROF_ACCEPT] = "accept",
+	[SWRAP_PROF_BIND] = "bind",
+	[SWRAP_PROF_CLOSE] = "close",
+	[SWRAP_PROF_CONNECT] = "connect",
+	[SWRAP_PROF_GETSOCKOPT] = "getsockopt",
+	[SWRAP_PROF_IOCTL] = "ioctl",
+	[SWRAP_PROF_LISTEN] = "listen",
+	[SWRAP_PROF_POLL] = "poll",
+	[SWRAP_PROF_READ] = "read",
+	[SWRAP_PROF_READV] = "readv",
+	[SWRAP_PROF_RECV] = "recv",
+	[SWRAP_PROF_RECVFROM] = "recvfrom",
+	[SWRAP_PROF_RECVMSG] = "recvmsg",
+	[SWRAP_PROF_SEND] = "send",
+	[SWRAP_PROF_SENDMSG] = "sendmsg",
+	[SWRAP_PROF_SENDTO] = "sendto",
+	[SWRAP_PROF_SETSOCKOPT] = "setsockopt",
+	[SWRAP_PROF_SOCKET] = "socket",
+	[SWRAP_PROF_WRITE] = "write",
+	[SWRAP_PROF_WRITEV] = "writev",
+};
+
+#define SWRAP_PROF_WRAPPER 0
+#define SWRAP_PROF_LIBC_TIME 1
+
+#define SWRAP_PROF_SUB_BITS 3
+#define SWRAP_PROF_SUB (1 << SWRAP_PROF_SUB_BITS)
+#define SWRAP_PROF_MAX_EXP 47
+#define SWRAP_PROF_BUCKETS \
+	((SWRAP_PROF_MAX_EXP - SWRAP_PROF_SUB_BITS + 2) * SWRAP_PROF_SUB)
+
+struct swrap_prof_hist {
+	uint64_t count;
+	uint64_t max;
+	uint32_t buckets[SWRAP_PROF_BUCKETS];
+};
+
+struct swrap_prof_thread {
+	struct swrap_prof_thread *next;
+	struct swrap_prof_hist hist[SWRAP_PROF_NUM][2];
+};
+
+#define SWRAP_PROF_UNKNOWN 0
+#define SWRAP_PROF_OFF 1
+#define SWRAP_PROF_ON 2
+
+static struct {
+	int state;
+	uint64_t start_ticks;
+	uint64_t start_nsec;
+	struct swrap_prof_thread *threads;
+	struct swrap_prof_hist retired[SWRAP_PROF_NUM][2];
+	pthread_key_t key;
+	bool key_valid;
+} swrap_prof;
+
+static SWRAP_THREAD struct swrap_prof_thread *swrap_prof_self;
+static SWRAP_THREAD unsigned int swrap_prof_depth;
+static SWRAP_THREAD uint64_t swrap_prof_libc_ticks;
+
+struct swrap_prof_frame {
+	bool active;
+	uint64_t start;
+	uint64_t libc;
+};
+
+static uint64_t swrap_prof_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The TSC where we have one, it is converted when we print the report */
+static inline uint64_t swrap_prof_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return swrap_prof_nsec();
+#endif
+}
+
+static void swrap_prof_thread_exit(void *arg);
+
+static void swrap_prof_init(void)
+{
+	const char *s = getenv("SOCKET_WRAPPER_PROFILE");
+	int state = SWRAP_PROF_OFF;
+
+	SWRAP_LOCK(profile);
+	if (swrap_prof.state == SWRAP_PROF_UNKNOWN) {
+		if (s != NULL && s[0] != '\0') {
+			swrap_prof.start_ticks = swrap_prof_ticks();
+			swrap_prof.start_nsec = swrap_prof_nsec();
+			swrap_prof.key_valid =
+				pthread_key_create(&swrap_prof.key,
+						   swrap_prof_thread_exit) == 0;
+			state = SWRAP_PROF_ON;
+		}
+		__atomic_store_n(&swrap_prof.state, state, __ATOMIC_RELEASE);
+	}
+	SWRAP_UNLOCK(profile);
+}
+
+static inline bool swrap_prof_enabled(void)
+{
+	int state = __atomic_load_n(&swrap_prof.state, __ATOMIC_ACQUIRE);
+
+	if (state == SWRAP_PROF_UNKNOWN) {
+		swrap_prof_init();
+		state = __atomic_load_n(&swrap_prof.state, __ATOMIC_ACQUIRE);
+	}
+
+	return state == SWRAP_PROF_ON;
+}
+
+static unsigned int swrap_prof_bucket(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < SWRAP_PROF_SUB) {
+		return v;
+	}
+
+	e = 63 - __builtin_clzll(v);
+	if (e > SWRAP_PROF_MAX_EXP) {
+		return SWRAP_PROF_BUCKETS - 1;
+	}
+
+	return (e - SWRAP_PROF_SUB_BITS + 1) * SWRAP_PROF_SUB +
+	       ((v >> (e - SWRAP_PROF_SUB_BITS)) & (SWRAP_PROF_SUB - 1));
+}
+
+/* The highest value which ends up in the bucket */
+static uint64_t swrap_prof_bucket_max(unsigned int b)
+{
+	unsigned int e;
+
+	if (b < SWRAP_PROF_SUB) {
+		return b;
+	}
+
+	e = b / SWRAP_PROF_SUB + SWRAP_PROF_SUB_BITS - 1;
+
+	return ((uint64_t)(SWRAP_PROF_SUB + b % SWRAP_PROF_SUB + 1) <<
+		(e - SWRAP_PROF_SUB_BITS)) - 1;
+}
+
+static void swrap_prof_hist_add(struct swrap_prof_hist *h, uint64_t v)
+{
+	uint32_t *c = &h->buckets[swrap_prof_bucket(v)];
+
+	/* Only this thread writes, the report may read at the same time */
+	__atomic_store_n(c, *c + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+	if (v > h->max) {
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+	}
+}
+
+/* Adds the histogram h to m, h may be written at the same time */
+static void swrap_prof_hist_merge(struct swrap_prof_hist *m,
+				  const struct swrap_prof_hist *h)
+{
+	unsigned int b;
+
+	m->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	m->max = MAX(m->max, __atomic_load_n(&h->max, __ATOMIC_RELAXED));
+	for (b = 0; b < SWRAP_PROF_BUCKETS; b++) {
+		m->buckets[b] += __atomic_load_n(&h->buckets[b],
+						 __ATOMIC_RELAXED);
+	}
+}
+
+/* Adds the histograms of all the functions of src to dst */
+static void swrap_prof_merge(struct swrap_prof_hist *dst,
+			     const struct swrap_prof_hist *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < SWRAP_PROF_NUM * 2; i++) {
+		swrap_prof_hist_merge(&dst[i], &src[i]);
+	}
+}
+
+/* The destructor of the thread key, runs when a recording thread exits */
+static void swrap_prof_thread_exit(void *arg)
+{
+	struct swrap_prof_thread *t = (struct swrap_prof_thread *)arg;
+	struct swrap_prof_thread **pp;
+
+	SWRAP_LOCK(profile);
+	for (pp = &swrap_prof.threads; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == t) {
+			*pp = t->next;
+			break;
+		}
+	}
+	swrap_prof_merge(&swrap_prof.retired[0][0], &t->hist[0][0]);
+	SWRAP_UNLOCK(profile);
+
+	if (swrap_prof_self == t) {
+		swrap_prof_self = NULL;
+	}
+	free(t);
+}
+
+static void swrap_prof_record(unsigned int func,
+			      uint64_t wrapper,
+			      uint64_t libc)
+{
+	struct swrap_prof_thread *t = swrap_prof_self;
+
+	if (t == NULL) {
+		int saved_errno = errno;
+
+		t = (struct swrap_prof_thread *)calloc(1, sizeof(*t));
+		errno = saved_errno;
+		if (t == NULL) {
+			return;
+		}
+
+		SWRAP_LOCK(profile);
+		t->next = swrap_prof.threads;
+		swrap_prof.threads = t;
+		SWRAP_UNLOCK(profile);
+
+		swrap_prof_self = t;
+		if (swrap_prof.key_valid) {
+			pthread_setspecific(swrap_prof.key, t);
+		}
+		errno = saved_errno;
+	}
+
+	swrap_prof_hist_add(&t->hist[func][SWRAP_PROF_WRAPPER], wrapper);
+	swrap_prof_hist_add(&t->hist[func][SWRAP_PROF_LIBC_TIME], libc);
+}
+
+/* Only the outermost wrapped function of a thread gets recorded */
+static inline void swrap_prof_begin(struct swrap_prof_frame *f)
+{
+	f->active = false;
+	f->start = 0;
+
+	if (!swrap_prof_enabled()) {
+		return;
+	}
+
+	f->active = true;
+	if (swrap_prof_depth++ == 0) {
+		f->libc = swrap_prof_libc_ticks;
+		f->start = swrap_prof_ticks();
+	}
+}
+
+static inline void swrap_prof_end(struct swrap_prof_frame *f,
+				  unsigned int func)
+{
+	uint64_t total, libc;
+
+	if (!f->active) {
+		return;
+	}
+
+	swrap_prof_depth--;
+	if (f->start == 0) {
+		return;
+	}
+
+	total = swrap_prof_ticks() - f->start;
+	libc = swrap_prof_libc_ticks - f->libc;
+
+	swrap_prof_record(func, total > libc ? total - libc : 0, libc);
+}
+
+static inline uint64_t swrap_prof_libc_begin(void)
+{
+	if (swrap_prof_depth == 0) {
+		return 0;
+	}
+
+	return swrap_prof_ticks();
+}
+
+static inline void swrap_prof_libc_end(uint64_t start)
+{
+	if (start != 0) {
+		swrap_prof_libc_ticks += swrap_prof_ticks() - start;
+	}
+}
+
+#define SWRAP_PROF(func, call) ({ \
+	struct swrap_prof_frame _swrap_frame; \
+	__typeof__(call) _swrap_ret; \
+	swrap_prof_begin(&_swrap_frame); \
+	_swrap_ret = (call); \
+	swrap_prof_end(&_swrap_frame, SWRAP_PROF_ ## func); \
+	_swrap_ret; \
+})
+
+#define SWRAP_PROF_LIBC(call) ({ \
+	uint64_t _swrap_start = swrap_prof_libc_begin(); \
+	__typeof__(call) _swrap_ret = (call); \
+	swrap_prof_libc_end(_swrap_start); \
+	_swrap_ret; \
+})
+
 /*
  * IMPORTANT
  *
@@ -708,7 +1236,10 @@ static int libc_accept4(int sockfd,
 {
 	swrap_bind_symbol_libsocket(accept4);
 
-	return swrap.libc.symbols._libc_accept4.f(sockfd, addr, addrlen, flags);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_accept4.f(sockfd,
+								  addr,
+								  addrlen,
+								  flags));
 }
 
 #else /* HAVE_ACCEPT4 */
@@ -717,7 +1248,9 @@ static int libc_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 {
 	swrap_bind_symbol_libsocket(accept);
 
-	return swrap.libc.symbols._libc_accept.f(sockfd, addr, addrlen);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_accept.f(sockfd,
+								 addr,
+								 addrlen));
 }
 #endif /* HAVE_ACCEPT4 */
 
@@ -727,14 +1260,16 @@ static int libc_bind(int sockfd,
 {
 	swrap_bind_symbol_libsocket(bind);
 
-	return swrap.libc.symbols._libc_bind.f(sockfd, addr, addrlen);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_bind.f(sockfd,
+							       addr,
+							       addrlen));
 }
 
 static int libc_close(int fd)
 {
 	swrap_bind_symbol_libc(close);
 
-	return swrap.libc.symbols._libc_close.f(fd);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_close.f(fd));
 }
 
 static int libc_connect(int sockfd,
@@ -743,21 +1278,23 @@ static int libc_connect(int sockfd,
 {
 	swrap_bind_symbol_libsocket(connect);
 
-	return swrap.libc.symbols._libc_connect.f(sockfd, addr, addrlen);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_connect.f(sockfd,
+								  addr,
+								  addrlen));
 }
 
 static int libc_dup(int fd)
 {
 	swrap_bind_symbol_libc(dup);
 
-	return swrap.libc.symbols._libc_dup.f(fd);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_dup.f(fd));
 }
 
 static int libc_dup2(int oldfd, int newfd)
 {
 	swrap_bind_symbol_libc(dup2);
 
-	return swrap.libc.symbols._libc_dup2.f(oldfd, newfd);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_dup2.f(oldfd, newfd));
 }
 
 #ifdef HAVE_EVENTFD
@@ -765,7 +1302,8 @@ static int libc_eventfd(int count, int flags)
 {
 	swrap_bind_symbol_libc(eventfd);
 
-	return swrap.libc.symbols._libc_eventfd.f(count, flags);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_eventfd.f(count,
+								  flags));
 }
 #endif
 
@@ -782,12 +1320,24 @@ static int libc_vfcntl(int fd, int cmd, va_list ap)
 		args[i] = va_arg(ap, long int);
 	}
 
-	rc = swrap.libc.symbols._libc_fcntl.f(fd,
-					      cmd,
-					      args[0],
-					      args[1],
-					      args[2],
-					      args[3]);
+	rc = SWRAP_PROF_LIBC(swrap.libc.symbols._libc_fcntl.f(fd,
+							      cmd,
+							      args[0],
+							      args[1],
+							      args[2],
+							      args[3]));
+
+	return rc;
+}
+
+static int libc_fcntl(int fd, int cmd, ...)
+{
+	va_list ap;
+	int rc;
+
+	va_start(ap, cmd);
+	rc = libc_vfcntl(fd, cmd, ap);
+	va_end(ap);
 
 	return rc;
 }
@@ -798,7 +1348,9 @@ static int libc_getpeername(int sockfd,
 {
 	swrap_bind_symbol_libsocket(getpeername);
 
-	return swrap.libc.symbols._libc_getpeername.f(sockfd, addr, addrlen);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_getpeername.f(sockfd,
+								      addr,
+								      addrlen));
 }
 
 static int libc_getsockname(int sockfd,
@@ -807,7 +1359,9 @@ static int libc_getsockname(int sockfd,
 {
 	swrap_bind_symbol_libsocket(getsockname);
 
-	return swrap.libc.symbols._libc_getsockname.f(sockfd, addr, addrlen);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_getsockname.f(sockfd,
+								      addr,
+								      addrlen));
 }
 
 static int libc_getsockopt(int sockfd,
@@ -818,11 +1372,11 @@ static int libc_getsockopt(int sockfd,
 {
 	swrap_bind_symbol_libsocket(getsockopt);
 
-	return swrap.libc.symbols._libc_getsockopt.f(sockfd,
-						     level,
-						     optname,
-						     optval,
-						     optlen);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_getsockopt.f(sockfd,
+								     level,
+								     optname,
+								     optval,
+								     optlen));
 }
 
 DO_NOT_SANITIZE_ADDRESS_ATTRIBUTE
@@ -838,12 +1392,12 @@ static int libc_vioctl(int d, unsigned long int request, va_list ap)
 		args[i] = va_arg(ap, long int);
 	}
 
-	rc = swrap.libc.symbols._libc_ioctl.f(d,
-					      request,
-					      args[0],
-					      args[1],
-					      args[2],
-					      args[3]);
+	rc = SWRAP_PROF_LIBC(swrap.libc.symbols._libc_ioctl.f(d,
+							      request,
+							      args[0],
+							      args[1],
+							      args[2],
+							      args[3]));
 
 	return rc;
 }
@@ -852,14 +1406,15 @@ static int libc_listen(int sockfd, int backlog)
 {
 	swrap_bind_symbol_libsocket(listen);
 
-	return swrap.libc.symbols._libc_listen.f(sockfd, backlog);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_listen.f(sockfd,
+								 backlog));
 }
 
 static FILE *libc_fopen(const char *name, const char *mode)
 {
 	swrap_bind_symbol_libc(fopen);
 
-	return swrap.libc.symbols._libc_fopen.f(name, mode);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_fopen.f(name, mode));
 }
 
 static int libc_vopen(const char *pathname, int flags, va_list ap)
@@ -871,7 +1426,9 @@ static int libc_vopen(const char *pathname, int flags, va_list ap)
 
 	mode = va_arg(ap, long int);
 
-	fd = swrap.libc.symbols._libc_open.f(pathname, flags, (mode_t)mode);
+	fd = SWRAP_PROF_LIBC(swrap.libc.symbols._libc_open.f(pathname,
+							     flags,
+							     (mode_t)mode));
 
 	return fd;
 }
@@ -897,7 +1454,10 @@ static int libc_vopenat(int dirfd, const char *path, int flags, va_list ap)
 
 	mode = va_arg(ap, long int);
 
-	fd = swrap.libc.symbols._libc_openat.f(dirfd, path, flags, (mode_t)mode);
+	fd = SWRAP_PROF_LIBC(swrap.libc.symbols._libc_openat.f(dirfd,
+							       path,
+							       flags,
+							       (mode_t)mode));
 
 	return fd;
 }
@@ -920,28 +1480,42 @@ static int libc_pipe(int pipefd[2])
 {
 	swrap_bind_symbol_libsocket(pipe);
 
-	return swrap.libc.symbols._libc_pipe.f(pipefd);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_pipe.f(pipefd));
+}
+
+static int libc_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	swrap_bind_symbol_libc(poll);
+
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_poll.f(fds,
+							       nfds,
+							       timeout));
 }
 
 static int libc_read(int fd, void *buf, size_t count)
 {
 	swrap_bind_symbol_libc(read);
 
-	return swrap.libc.symbols._libc_read.f(fd, buf, count);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_read.f(fd, buf, count));
 }
 
 static ssize_t libc_readv(int fd, const struct iovec *iov, int iovcnt)
 {
 	swrap_bind_symbol_libsocket(readv);
 
-	return swrap.libc.symbols._libc_readv.f(fd, iov, iovcnt);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_readv.f(fd,
+								iov,
+								iovcnt));
 }
 
 static int libc_recv(int sockfd, void *buf, size_t len, int flags)
 {
 	swrap_bind_symbol_libsocket(recv);
 
-	return swrap.libc.symbols._libc_recv.f(sockfd, buf, len, flags);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_recv.f(sockfd,
+							       buf,
+							       len,
+							       flags));
 }
 
 static int libc_recvfrom(int sockfd,
@@ -953,34 +1527,71 @@ static int libc_recvfrom(int sockfd,
 {
 	swrap_bind_symbol_libsocket(recvfrom);
 
-	return swrap.libc.symbols._libc_recvfrom.f(sockfd,
-						   buf,
-						   len,
-						   flags,
-						   src_addr,
-						   addrlen);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_recvfrom.f(sockfd,
+								   buf,
+								   len,
+								   flags,
+								   src_addr,
+								   addrlen));
 }
 
 static int libc_recvmsg(int sockfd, struct msghdr *msg, int flags)
 {
 	swrap_bind_symbol_libsocket(recvmsg);
 
-	return swrap.libc.symbols._libc_recvmsg.f(sockfd, msg, flags);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_recvmsg.f(sockfd,
+								  msg,
+								  flags));
 }
 
 static int libc_send(int sockfd, const void *buf, size_t len, int flags)
 {
 	swrap_bind_symbol_libsocket(send);
 
-	return swrap.libc.symbols._libc_send.f(sockfd, buf, len, flags);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_send.f(sockfd,
+							       buf,
+							       len,
+							       flags));
 }
 
 static int libc_sendmsg(int sockfd, const struct msghdr *msg, int flags)
 {
 	swrap_bind_symbol_libsocket(sendmsg);
 
-	return swrap.libc.symbols._libc_sendmsg.f(sockfd, msg, flags);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_sendmsg.f(sockfd,
+								  msg,
+								  flags));
+}
+
+#ifdef HAVE_SENDFILE
+static ssize_t libc_sendfile(int out_fd,
+			     int in_fd,
+			     off_t *offset,
+			     size_t count)
+{
+	swrap_bind_symbol_libc(sendfile);
+
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_sendfile.f(out_fd,
+								   in_fd,
+								   offset,
+								   count));
+}
+#endif
+
+#if defined(HAVE_SENDFILE64) && !defined(__USE_FILE_OFFSET64)
+static ssize_t libc_sendfile64(int out_fd,
+			       int in_fd,
+			       off64_t *offset,
+			       size_t count)
+{
+	swrap_bind_symbol_libc(sendfile64);
+
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_sendfile64.f(out_fd,
+								     in_fd,
+								     offset,
+								     count));
 }
+#endif
 
 static int libc_sendto(int sockfd,
 		       const void *buf,
@@ -991,12 +1602,12 @@ static int libc_sendto(int sockfd,
 {
 	swrap_bind_symbol_libsocket(sendto);
 
-	return swrap.libc.symbols._libc_sendto.f(sockfd,
-						 buf,
-						 len,
-						 flags,
-						 dst_addr,
-						 addrlen);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_sendto.f(sockfd,
+								 buf,
+								 len,
+								 flags,
+								 dst_addr,
+								 addrlen));
 }
 
 static int libc_setsockopt(int sockfd,
@@ -1007,11 +1618,19 @@ static int libc_setsockopt(int sockfd,
 {
 	swrap_bind_symbol_libsocket(setsockopt);
 
-	return swrap.libc.symbols._libc_setsockopt.f(sockfd,
-						     level,
-						     optname,
-						     optval,
-						     optlen);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_setsockopt.f(sockfd,
+								     level,
+								     optname,
+								     optval,
+								     optlen));
+}
+
+static int libc_shutdown(int sockfd, int how)
+{
+	swrap_bind_symbol_libsocket(shutdown);
+
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_shutdown.f(sockfd,
+								   how));
 }
 
 #ifdef HAVE_SIGNALFD
@@ -1019,7 +1638,9 @@ static int libc_signalfd(int fd, const sigset_t *mask, int flags)
 {
 	swrap_bind_symbol_libsocket(signalfd);
 
-	return swrap.libc.symbols._libc_signalfd.f(fd, mask, flags);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_signalfd.f(fd,
+								   mask,
+								   flags));
 }
 #endif
 
@@ -1027,22 +1648,59 @@ static int libc_socket(int domain, int type, int protocol)
 {
 	swrap_bind_symbol_libsocket(socket);
 
-	return swrap.libc.symbols._libc_socket.f(domain, type, protocol);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_socket.f(domain,
+								 type,
+								 protocol));
 }
 
 static int libc_socketpair(int domain, int type, int protocol, int sv[2])
 {
 	swrap_bind_symbol_libsocket(socketpair);
 
-	return swrap.libc.symbols._libc_socketpair.f(domain, type, protocol, sv);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_socketpair.f(domain,
+								     type,
+								     protocol,
+								     sv));
+}
+
+#ifdef HAVE_SPLICE
+static ssize_t libc_splice(int fd_in,
+			   loff_t *off_in,
+			   int fd_out,
+			   loff_t *off_out,
+			   size_t len,
+			   unsigned int flags)
+{
+	swrap_bind_symbol_libc(splice);
+
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_splice.f(fd_in,
+								 off_in,
+								 fd_out,
+								 off_out,
+								 len,
+								 flags));
+}
+#endif
+
+#ifdef HAVE_TEE
+static ssize_t libc_tee(int fd_in, int fd_out, size_t len, unsigned int flags)
+{
+	swrap_bind_symbol_libc(tee);
+
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_tee.f(fd_in,
+							      fd_out,
+							      len,
+							      flags));
 }
+#endif
 
 #ifdef HAVE_TIMERFD_CREATE
 static int libc_timerfd_create(int clockid, int flags)
 {
 	swrap_bind_symbol_libc(timerfd_create);
 
-	return swrap.libc.symbols._libc_timerfd_create.f(clockid, flags);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_timerfd_create.f(clockid,
+									 flags));
 }
 #endif
 
@@ -1050,14 +1708,18 @@ static ssize_t libc_write(int fd, const void *buf, size_t count)
 {
 	swrap_bind_symbol_libc(write);
 
-	return swrap.libc.symbols._libc_write.f(fd, buf, count);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_write.f(fd,
+								buf,
+								count));
 }
 
 static ssize_t libc_writev(int fd, const struct iovec *iov, int iovcnt)
 {
 	swrap_bind_symbol_libsocket(writev);
 
-	return swrap.libc.symbols._libc_writev.f(fd, iov, iovcnt);
+	return SWRAP_PROF_LIBC(swrap.libc.symbols._libc_writev.f(fd,
+								 iov,
+								 iovcnt));
 }
 
 /*********************************************************
@@ -1086,6 +1748,32 @@ static const struct in6_addr *swrap_ipv6(void)
 
 	return &v;
 }
+
+/*
+ * FD00::YYYY:5357:5FXX, the lower byte of the interface goes into XX as
+ * always, the upper ones into YYYY.
+ */
+static void swrap_iface_ipv6(unsigned int iface, struct in6_addr *addr)
+{
+	*addr = *swrap_ipv6();
+	addr->s6_addr[10] = (iface >> 16) & 0xFF;
+	addr->s6_addr[11] = (iface >> 8) & 0xFF;
+	addr->s6_addr[15] = iface & 0xFF;
+}
+
+static unsigned int swrap_ipv6_iface(const struct in6_addr *addr)
+{
+	const uint8_t *prefix = swrap_ipv6()->s6_addr;
+
+	if (memcmp(addr->s6_addr, prefix, 10) != 0 ||
+	    memcmp(addr->s6_addr + 12, prefix + 12, 3) != 0) {
+		return 0;
+	}
+
+	return ((unsigned int)addr->s6_addr[10] << 16) |
+	       ((unsigned int)addr->s6_addr[11] << 8) |
+	       addr->s6_addr[15];
+}
 static struct in6_addr swrap_make_ipv6(unsigned int a0, unsigned int a1, 
 						unsigned int a2, unsigned int a3)
 {
@@ -1281,11 +1969,18 @@ static unsigned int socket_wrapper_default_iface(void)
 {
 	const char *s = getenv("SOCKET_WRAPPER_DEFAULT_IFACE");
 	if (s) {
-		unsigned int iface;
-		if (sscanf(s, "%u", &iface) == 1) {
-			if (iface >= 1 && iface <= MAX_WRAPPED_INTERFACES) {
-				return iface;
-			}
+		unsigned long iface;
+		char *end = NULL;
+
+		iface = strtoul(s, &end, 10);
+		if (end != s && iface >= 1 && iface <= SWRAP_IFACE_MAX) {
+			return iface;
+		}
+
+		/* A host of the topology file */
+		iface = swrap_topo_host_iface(s);
+		if (iface != 0) {
+			return iface;
 		}
 	}
 
@@ -1313,16 +2008,7 @@ static int socket_wrapper_first_free_index(void)
 
 static unsigned int socket_wrapper_default_addr(void)
 {
-	const char *s = getenv("SOCKET_WRAPPER_DEFAULT_IFACE");
-	if (s) {
-		unsigned int iface;
-		if (sscanf(s, "%u", &iface) == 1) {
-			if (iface >= 1 && iface <= MAX_WRAPPED_INTERFACES) {
-				return (127<<24) | iface;
-			}
-		}
-	}
-	return (127<<24) | 0x00000001; /* 127.0.0.1 */
+	return (127<<24) | socket_wrapper_default_iface();
 }
 
 static int convert_un_in(const struct sockaddr_un *un, struct sockaddr *in, socklen_t *len)
@@ -1348,7 +2034,8 @@ static int convert_un_in(const struct sockaddr_un *un, struct sockaddr *in, sock
 		    return -1;
 		}
 
-		if (sscanf(p, SOCKET_FORMAT_LONG, &type, &in4_addr, &prt) != 3) {
+		if (!swrap_parse_hex(p + 1, 8, &in4_addr) ||
+		    !swrap_parse_hex(p + 9, 4, &prt)) {
 			errno = EINVAL;
 			return -1;
 		}
@@ -1372,8 +2059,11 @@ static int convert_un_in(const struct sockaddr_un *un, struct sockaddr *in, sock
 		unsigned int in6_a0, in6_a1, in6_a2, in6_a3;
 		struct sockaddr_in6 *in2 = (struct sockaddr_in6 *)(void *)in;
 
-		if (sscanf(p, SOCKET_FORMAT_V6_LONG, &type, 
-				&in6_a0, &in6_a1, &in6_a2, &in6_a3, &prt) != 6) {
+		if (!swrap_parse_hex(p + 1, 8, &in6_a0) ||
+		    !swrap_parse_hex(p + 9, 8, &in6_a1) ||
+		    !swrap_parse_hex(p + 17, 8, &in6_a2) ||
+		    !swrap_parse_hex(p + 25, 8, &in6_a3) ||
+		    !swrap_parse_hex(p + 33, 4, &prt)) {
 			errno = EINVAL;
 			return -1;
 		}
@@ -1400,153 +2090,359 @@ static int convert_un_in(const struct sockaddr_un *un, struct sockaddr *in, sock
 	return 0;
 }
 
-static int convert_in_un_remote(struct socket_info *si, const struct sockaddr *inaddr, struct sockaddr_un *un,
-				int *bcast)
+static void swrap_put_hex(char *p, size_t width, unsigned int v)
 {
-	char type = '\0';
-	unsigned int prt;
-	unsigned int in4_addr, in6_a0, in6_a1, in6_a2, in6_a3;
-	int is_bcast = 0;
+	static const char hex[] = "0123456789ABCDEF";
 
-	if (bcast) *bcast = 0;
+	while (width > 0) {
+		width--;
+		p[width] = hex[v & 0xF];
+		v >>= 4;
+	}
+}
 
-	switch (inaddr->sa_family) {
-	case AF_INET: {
-		const struct sockaddr_in *in =
-		    (const struct sockaddr_in *)(const void *)inaddr;
-		unsigned int addr = ntohl(in->sin_addr.s_addr);
-		char u_type = '\0';
-		char b_type = '\0';
-		char a_type = '\0';
+/*
+ * With SOCKET_WRAPPER_DIR_LAYOUT=sharded the sockets are spread over
+ * subdirectories named after the type and address and the upper byte of the
+ * port, like Q7F00000A/1B/Q7F00000A1B8D. The file name stays the same.
+ */
+static bool socket_wrapper_dir_sharded(void)
+{
+	const char *s = getenv("SOCKET_WRAPPER_DIR_LAYOUT");
 
-		switch (si->type) {
-		case SOCK_STREAM:
-			u_type = SOCKET_TYPE_CHAR_TCP_LONG;
-			break;
-		case SOCK_DGRAM:
-			u_type = SOCKET_TYPE_CHAR_UDP_LONG;
-			a_type = SOCKET_TYPE_CHAR_UDP_LONG;
-			b_type = SOCKET_TYPE_CHAR_UDP_LONG;
-			break;
-		default:
-			SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown socket type!\n");
-			errno = ESOCKTNOSUPPORT;
+	return s != NULL && strcmp(s, "sharded") == 0;
+}
+
+/*
+ * The unix path of a socket is made of the directory, the type and the
+ * address, followed by the port. Only the port differs between the sockets
+ * of an interface, so keep the prefix of the last path we built.
+ */
+struct swrap_un_template {
+	char type;
+	bool sharded;
+	unsigned int addr[4];
+	size_t dir_len;
+	size_t len;
+	size_t name_len;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	char name[1 + 4 * 8];
+};
+
+static SWRAP_THREAD struct swrap_un_template swrap_remote_template;
+static SWRAP_THREAD struct swrap_un_template swrap_autobind_template;
+static SWRAP_THREAD struct swrap_un_template swrap_bind_template;
+
+static int swrap_un_path(struct swrap_un_template *t,
+			 struct sockaddr_un *un,
+			 char type,
+			 const unsigned int *addr,
+			 size_t naddr,
+			 unsigned int prt)
+{
+	const char *dir = socket_wrapper_dir();
+	bool sharded = socket_wrapper_dir_sharded();
+	size_t dir_len;
+	size_t len;
+	size_t i;
+
+	if (dir == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	dir_len = strlen(dir);
+
+	if (t->name_len != 1 + naddr * 8 ||
+	    t->dir_len != dir_len ||
+	    t->type != type ||
+	    t->sharded != sharded ||
+	    memcmp(t->addr, addr, naddr * sizeof(*addr)) != 0 ||
+	    memcmp(t->path, dir, dir_len) != 0) {
+		/* The shard is the type and the last word of the address */
+		if (dir_len + 2 + 8 + 1 >= sizeof(t->path)) {
+			t->name_len = 0;
+			errno = ENAMETOOLONG;
 			return -1;
 		}
 
-		prt = ntohs(in->sin_port);
-		if (a_type && addr == 0xFFFFFFFF) {
-			/* 255.255.255.255 only udp */
-			is_bcast = 2;
-			type = a_type;
-			in4_addr = socket_wrapper_default_addr();
-		} else if (b_type && addr == 0x7FFFFFFF) {
-			/* 127.255.255.255 only udp */
-			is_bcast = 1;
-			type = b_type;
-			in4_addr = socket_wrapper_default_addr();
-		} else {
-			is_bcast = 0;
-			type = u_type;
-			in4_addr = addr;
+		t->name[0] = type;
+		for (i = 0; i < naddr; i++) {
+			swrap_put_hex(t->name + 1 + i * 8, 8, addr[i]);
 		}
-		if (bcast) *bcast = is_bcast;
-		break;
+		t->name_len = 1 + naddr * 8;
+
+		memcpy(t->path, dir, dir_len);
+		t->path[dir_len] = '/';
+		t->len = dir_len + 1;
+		if (sharded) {
+			t->path[t->len] = type;
+			swrap_put_hex(t->path + t->len + 1, 8, addr[naddr - 1]);
+			t->path[t->len + 9] = '/';
+			t->len += 10;
+		}
+
+		memcpy(t->addr, addr, naddr * sizeof(*addr));
+		t->dir_len = dir_len;
+		t->type = type;
+		t->sharded = sharded;
 	}
-#ifdef HAVE_IPV6
-	case AF_INET6: {
-		const struct sockaddr_in6 *in =
-		    (const struct sockaddr_in6 *)(const void *)inaddr;
 
-		switch (si->type) {
-		case SOCK_STREAM:
-			type = SOCKET_TYPE_CHAR_TCP_V6_LONG;
-			break;
-		case SOCK_DGRAM:
-			type = SOCKET_TYPE_CHAR_UDP_V6_LONG;
-			break;
-		default:
-			SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown socket type!\n");
-			errno = ESOCKTNOSUPPORT;
-			return -1;
-		}
+	len = t->len + (t->sharded ? 3 : 0) + t->name_len + 4;
+	if (len >= sizeof(un->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
 
-		/* XXX no multicast/broadcast */
+	memcpy(un->sun_path, t->path, t->len);
+	len = t->len;
+	if (t->sharded) {
+		swrap_put_hex(un->sun_path + len, 2, prt >> 8);
+		un->sun_path[len + 2] = '/';
+		len += 3;
+	}
+	memcpy(un->sun_path + len, t->name, t->name_len);
+	len += t->name_len;
+	swrap_put_hex(un->sun_path + len, 4, prt);
+	un->sun_path[len + 4] = '\0';
 
-		prt = ntohs(in->sin6_port);
+	return 0;
+}
 
-		/* TODO - More checks */
+/* Create the subdirectories of a sharded path */
+static int swrap_un_mkdir(const char *path)
+{
+	char tmp[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	char *port_dir;
+	char *shard_dir;
+	int ret;
 
-		swrap_make_ipv6_ints(in->sin6_addr.s6_addr,&in6_a0,&in6_a1,&in6_a2,&in6_a3);
-		break;
-	}
-#endif
-	default:
-		SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown address family!\n");
-		errno = ENETUNREACH;
+	snprintf(tmp, sizeof(tmp), "%s", path);
+
+	port_dir = strrchr(tmp, '/');
+	if (port_dir == NULL) {
+		errno = ENOENT;
 		return -1;
 	}
+	*port_dir = '\0';
 
-	if (prt == 0) {
-		SWRAP_LOG(SWRAP_LOG_WARN, "Port not set\n");
-		errno = EINVAL;
+	shard_dir = strrchr(tmp, '/');
+	if (shard_dir == NULL) {
+		errno = ENOENT;
 		return -1;
 	}
+	*shard_dir = '\0';
 
-	if (is_bcast) {
-		snprintf(un->sun_path, sizeof(un->sun_path), "%s/EINVAL",
-			 socket_wrapper_dir());
-		SWRAP_LOG(SWRAP_LOG_DEBUG, "un path [%s]", un->sun_path);
-		/* the caller need to do more processing */
-		return 0;
+	ret = mkdir(tmp, 0777);
+	if (ret == -1 && errno != EEXIST) {
+		return -1;
 	}
+	*shard_dir = '/';
 
-	switch (inaddr->sa_family) {
-	case AF_INET:
-		snprintf(un->sun_path, sizeof(un->sun_path), "%s/"SOCKET_FORMAT_LONG,
-			 socket_wrapper_dir(), type, in4_addr, prt);
-		break;
-	case AF_INET6:
-		snprintf(un->sun_path, sizeof(un->sun_path), "%s/"SOCKET_FORMAT_V6_LONG,
-			 socket_wrapper_dir(), type, in6_a0, in6_a1, in6_a2, in6_a3, prt);
-		break;
+	ret = mkdir(tmp, 0777);
+	if (ret == -1 && errno != EEXIST) {
+		return -1;
 	}
-	SWRAP_LOG(SWRAP_LOG_DEBUG, "un path [%s]", un->sun_path);
 
 	return 0;
 }
 
-static int convert_in_un_alloc(struct socket_info *si, const struct sockaddr *inaddr, struct sockaddr_un *un,
-			       int *bcast)
+static int swrap_un_bind(int fd, const struct swrap_address *un_addr)
+{
+	int ret;
+
+	ret = libc_bind(fd, &un_addr->sa.s, un_addr->sa_socklen);
+	if (ret == -1 && errno == ENOENT && socket_wrapper_dir_sharded()) {
+		ret = swrap_un_mkdir(un_addr->sa.un.sun_path);
+		if (ret == 0) {
+			ret = libc_bind(fd, &un_addr->sa.s, un_addr->sa_socklen);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Broadcasts go to the datagram sockets of all interfaces bound to a port.
+ * Every IPv4 datagram socket gets a hard link in the directory B<port>, so
+ * a broadcast only reads the sockets it is sent to, no matter how many
+ * interfaces there are.
+ */
+static bool swrap_bcast_name(const char *un_path,
+			     const char **pname,
+			     unsigned int *pprt)
+{
+	const char *name = strrchr(un_path, '/');
+
+	name = name != NULL ? name + 1 : un_path;
+	if (name[0] != SOCKET_TYPE_CHAR_UDP_LONG || strlen(name) != 1 + 8 + 4) {
+		return false;
+	}
+
+	if (!swrap_parse_hex(name + 1 + 8, 4, pprt)) {
+		return false;
+	}
+
+	*pname = name;
+	return true;
+}
+
+static void swrap_bcast_link(const char *un_path)
+{
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	const char *name;
+	unsigned int prt;
+	int ret;
+
+	if (!swrap_bcast_name(un_path, &name, &prt)) {
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s/B%04X", socket_wrapper_dir(), prt);
+	ret = mkdir(path, 0777);
+	if (ret == -1 && errno != EEXIST) {
+		return;
+	}
+
+	ret = snprintf(path, sizeof(path), "%s/B%04X/%s",
+		       socket_wrapper_dir(), prt, name);
+	if (ret < 0 || (size_t)ret >= sizeof(path)) {
+		return;
+	}
+
+	ret = link(un_path, path);
+	if (ret == -1 && errno == EEXIST) {
+		/* Left behind by a killed process */
+		unlink(path);
+		ret = link(un_path, path);
+	}
+	if (ret == -1) {
+		SWRAP_LOG(SWRAP_LOG_WARN,
+			  "Failed to link %s to %s: %s",
+			  un_path, path, strerror(errno));
+	}
+}
+
+static void swrap_bcast_unlink(const char *un_path)
+{
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	const char *name;
+	unsigned int prt;
+
+	if (!swrap_bcast_name(un_path, &name, &prt)) {
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s/B%04X/%s",
+		 socket_wrapper_dir(), prt, name);
+	unlink(path);
+}
+
+/* A broadcast got refused, remove the link and the socket it points to */
+static void swrap_bcast_stale(const char *link_path)
+{
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct stat link_st, st;
+	const char *name;
+	unsigned int prt;
+	int ret;
+
+	if (!swrap_bcast_name(link_path, &name, &prt)) {
+		return;
+	}
+
+	ret = lstat(link_path, &link_st);
+	unlink(link_path);
+	if (ret == -1) {
+		return;
+	}
+
+	if (socket_wrapper_dir_sharded()) {
+		snprintf(path, sizeof(path), "%s/%.9s/%02X/%s",
+			 socket_wrapper_dir(), name, prt >> 8, name);
+	} else {
+		snprintf(path, sizeof(path), "%s/%s", socket_wrapper_dir(), name);
+	}
+
+	/* Don't remove the socket of someone who took over the path */
+	ret = lstat(path, &st);
+	if (ret == 0 && st.st_ino == link_st.st_ino) {
+		unlink(path);
+	}
+}
+
+struct swrap_bcast_iter {
+	DIR *d;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+};
+
+static void swrap_bcast_start(struct swrap_bcast_iter *it, unsigned int prt)
+{
+	const char *dir = socket_wrapper_dir();
+
+	it->d = NULL;
+	if (dir == NULL) {
+		return;
+	}
+
+	snprintf(it->path, sizeof(it->path), "%s/B%04X", dir, prt);
+	it->d = opendir(it->path);
+}
+
+static bool swrap_bcast_next(struct swrap_bcast_iter *it,
+			     struct sockaddr_un *un)
+{
+	struct dirent *de;
+
+	if (it->d == NULL) {
+		return false;
+	}
+
+	while ((de = readdir(it->d)) != NULL) {
+		if (de->d_name[0] != SOCKET_TYPE_CHAR_UDP_LONG) {
+			continue;
+		}
+
+		snprintf(un->sun_path, sizeof(un->sun_path),
+			 "%s/%s", it->path, de->d_name);
+		return true;
+	}
+
+	return false;
+}
+
+static void swrap_bcast_end(struct swrap_bcast_iter *it)
+{
+	if (it->d != NULL) {
+		closedir(it->d);
+	}
+}
+
+static int convert_in_un_remote(struct socket_info *si, const struct sockaddr *inaddr, struct sockaddr_un *un,
+				int *bcast)
 {
 	char type = '\0';
 	unsigned int prt;
 	unsigned int in4_addr, in6_a0, in6_a1, in6_a2, in6_a3;
-	struct stat st;
 	int is_bcast = 0;
+	int ret = -1;
 
 	if (bcast) *bcast = 0;
 
-	switch (si->family) {
+	switch (inaddr->sa_family) {
 	case AF_INET: {
 		const struct sockaddr_in *in =
 		    (const struct sockaddr_in *)(const void *)inaddr;
 		unsigned int addr = ntohl(in->sin_addr.s_addr);
 		char u_type = '\0';
-		char d_type = '\0';
 		char b_type = '\0';
 		char a_type = '\0';
 
-		prt = ntohs(in->sin_port);
-
 		switch (si->type) {
 		case SOCK_STREAM:
 			u_type = SOCKET_TYPE_CHAR_TCP_LONG;
-			d_type = SOCKET_TYPE_CHAR_TCP_LONG;
 			break;
 		case SOCK_DGRAM:
 			u_type = SOCKET_TYPE_CHAR_UDP_LONG;
-			d_type = SOCKET_TYPE_CHAR_UDP_LONG;
 			a_type = SOCKET_TYPE_CHAR_UDP_LONG;
 			b_type = SOCKET_TYPE_CHAR_UDP_LONG;
 			break;
@@ -1556,12 +2452,8 @@ static int convert_in_un_alloc(struct socket_info *si, const struct sockaddr *in
 			return -1;
 		}
 
-		if (addr == 0) {
-			/* 0.0.0.0 */
-		 	is_bcast = 0;
-			type = d_type;
-			in4_addr = socket_wrapper_default_addr();
-		} else if (a_type && addr == 0xFFFFFFFF) {
+		prt = ntohs(in->sin_port);
+		if (a_type && addr == 0xFFFFFFFF) {
 			/* 255.255.255.255 only udp */
 			is_bcast = 2;
 			type = a_type;
@@ -1572,33 +2464,17 @@ static int convert_in_un_alloc(struct socket_info *si, const struct sockaddr *in
 			type = b_type;
 			in4_addr = socket_wrapper_default_addr();
 		} else {
-			/* 127.0.0.X */
 			is_bcast = 0;
 			type = u_type;
 			in4_addr = addr;
-		} 
-
-		/* Store the bind address for connect() */
-		if (si->bindname.sa_socklen == 0) {
-			struct sockaddr_in bind_in;
-			socklen_t blen = sizeof(struct sockaddr_in);
-
-			ZERO_STRUCT(bind_in);
-			bind_in.sin_family = in->sin_family;
-			bind_in.sin_port = in->sin_port;
-			bind_in.sin_addr.s_addr = htonl(in4_addr);
-
-			si->bindname.sa_socklen = blen;
-			memcpy(&si->bindname.sa.in, &bind_in, blen);
 		}
-
+		if (bcast) *bcast = is_bcast;
 		break;
 	}
 #ifdef HAVE_IPV6
 	case AF_INET6: {
 		const struct sockaddr_in6 *in =
 		    (const struct sockaddr_in6 *)(const void *)inaddr;
-		struct sockaddr_in6 in6_addr = *in;
 
 		switch (si->type) {
 		case SOCK_STREAM:
@@ -1619,3352 +2495,13007 @@ static int convert_in_un_alloc(struct socket_info *si, const struct sockaddr *in
 
 		/* TODO - More checks */
 
-		if (IN6_IS_ADDR_UNSPECIFIED(&in->sin6_addr)) {
-			in6_addr.sin6_addr     = *swrap_ipv6();
-			in6_addr.sin6_addr.s6_addr[15] = socket_wrapper_default_iface();
-		}
-
-		swrap_make_ipv6_ints(in6_addr.sin6_addr.s6_addr,&in6_a0,&in6_a1,&in6_a2,&in6_a3);
-
-		/* Store the bind address for connect() */
-		if (si->bindname.sa_socklen == 0) {
-			struct sockaddr_in6 bind_in;
-			socklen_t blen = sizeof(struct sockaddr_in6);
-
-			ZERO_STRUCT(bind_in);
-			bind_in.sin6_family = in6_addr.sin6_family;
-			bind_in.sin6_port = in6_addr.sin6_port;
-
-			bind_in.sin6_addr = in6_addr.sin6_addr;
-
-			memcpy(&si->bindname.sa.in6, &bind_in, blen);
-			si->bindname.sa_socklen = blen;
-		}
-
+		swrap_make_ipv6_ints(in->sin6_addr.s6_addr,&in6_a0,&in6_a1,&in6_a2,&in6_a3);
 		break;
 	}
 #endif
 	default:
-		SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown address family\n");
-		errno = EADDRNOTAVAIL;
+		SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown address family!\n");
+		errno = ENETUNREACH;
 		return -1;
 	}
 
-
-	if (bcast) *bcast = is_bcast;
-
-
 	if (prt == 0) {
-		/* handle auto-allocation of ephemeral ports */
-		for (prt = 5001; prt < 10000; prt++) {
-			if (si->family == AF_INET)
-				snprintf(un->sun_path, sizeof(un->sun_path), "%s/"SOCKET_FORMAT_LONG,
-					 socket_wrapper_dir(), type, in4_addr, prt);
-			else
-				snprintf(un->sun_path, sizeof(un->sun_path), "%s/"SOCKET_FORMAT_V6_LONG,
-					 socket_wrapper_dir(), type, in6_a0,in6_a1, in6_a2, in6_a3, prt);
+		SWRAP_LOG(SWRAP_LOG_WARN, "Port not set\n");
+		errno = EINVAL;
+		return -1;
+	}
 
-			if (stat(un->sun_path, &st) == 0) continue;
+	if (is_bcast) {
+		snprintf(un->sun_path, sizeof(un->sun_path), "%s/EINVAL",
+			 socket_wrapper_dir());
+		SWRAP_LOG(SWRAP_LOG_DEBUG, "un path [%s]", un->sun_path);
+		/* the caller need to do more processing */
+		return 0;
+	}
 
-			set_port(si->family, prt, &si->myname);
-			set_port(si->family, prt, &si->bindname);
+	switch (inaddr->sa_family) {
+	case AF_INET: {
+		unsigned int addr[1] = { in4_addr };
 
-			break;
-		}
-		if (prt == 10000) {
-			errno = ENFILE;
-			return -1;
-		}
+		ret = swrap_un_path(&swrap_remote_template, un,
+				    type, addr, 1, prt);
+		break;
 	}
+	case AF_INET6: {
+		unsigned int addr[4] = { in6_a0, in6_a1, in6_a2, in6_a3 };
 
-	if (si->family == AF_INET)
-		snprintf(un->sun_path, sizeof(un->sun_path), "%s/"SOCKET_FORMAT_LONG,
-			 socket_wrapper_dir(), type, in4_addr, prt);
-	else
-		snprintf(un->sun_path, sizeof(un->sun_path), "%s/"SOCKET_FORMAT_V6_LONG,
-			 socket_wrapper_dir(), type, in6_a0,in6_a1, in6_a2, in6_a3, prt);
+		ret = swrap_un_path(&swrap_remote_template, un,
+				    type, addr, 4, prt);
+		break;
+	}
+	}
+	if (ret == -1) {
+		return -1;
+	}
 	SWRAP_LOG(SWRAP_LOG_DEBUG, "un path [%s]", un->sun_path);
+
 	return 0;
 }
 
-static struct socket_info_fd *find_socket_info_fd(int fd)
-{
-	struct socket_info_fd *f;
-
-	for (f = socket_fds; f; f = f->next) {
-		if (f->fd == fd) {
-			return f;
-		}
-	}
+/*
+ * Sockets of killed processes leave their unix path behind and every port
+ * allocation has to skip them. Once an allocation skipped that many ports,
+ * reclaim the paths nobody is bound to any longer.
+ */
+#define SWRAP_RECLAIM_THRESHOLD 16
+#define SWRAP_RECLAIM_BATCH 1024
 
-	return NULL;
-}
+struct swrap_socket_name {
+	char name[64];
+	ino_t ino;
+};
 
-static int find_socket_info_index(int fd)
+static int swrap_socket_name_cmp(const void *a, const void *b)
 {
-	struct socket_info_fd *fi = find_socket_info_fd(fd);
-
-	if (fi == NULL) {
-		return -1;
-	}
+	const struct swrap_socket_name *na = (const struct swrap_socket_name *)a;
+	const struct swrap_socket_name *nb = (const struct swrap_socket_name *)b;
 
-	return fi->si_index;
+	return strcmp(na->name, nb->name);
 }
 
-static struct socket_info *find_socket_info(int fd)
+/* Names are relative to the socket directory, they contain the shards */
+static bool swrap_socket_name_valid(const char *name)
 {
-	int idx = find_socket_info_index(fd);
+	const char *base = strrchr(name, '/');
+	size_t len;
 
-	if (idx == -1) {
-		return NULL;
+	if (base != NULL) {
+		name = base + 1;
 	}
+	len = strlen(name);
 
-	return &sockets[idx];
+	switch (name[0]) {
+	case SOCKET_TYPE_CHAR_TCP_LONG:
+	case SOCKET_TYPE_CHAR_UDP_LONG:
+		return len == 1 + 8 + 4;
+	case SOCKET_TYPE_CHAR_TCP_V6_LONG:
+	case SOCKET_TYPE_CHAR_UDP_V6_LONG:
+		return len == 1 + 4 * 8 + 4;
+	default:
+		break;
+	}
+
+	return false;
 }
 
-#if 0 /* FIXME */
-static bool check_addr_port_in_use(const struct sockaddr *sa, socklen_t len)
+/*
+ * A stream socket which isn't listening refuses connections just like a
+ * dead one, so get the names of the sockets in dir which are still bound
+ * from the kernel. A name missing there only tells which ones to probe.
+ */
+static ssize_t swrap_bound_names(const char *dir,
+				 struct swrap_socket_name **pnames)
 {
-	struct socket_info_fd *f;
-	const struct socket_info *last_s = NULL;
+	struct swrap_socket_name *names = NULL;
+	size_t dir_len = strlen(dir);
+	size_t count = 0;
+	size_t alloc = 0;
+	char line[512];
+	FILE *fp;
 
-	/* first catch invalid input */
-	switch (sa->sa_family) {
-	case AF_INET:
-		if (len < sizeof(struct sockaddr_in)) {
-			return false;
-		}
-		break;
-#if HAVE_IPV6
-	case AF_INET6:
-		if (len < sizeof(struct sockaddr_in6)) {
-			return false;
-		}
-		break;
-#endif
-	default:
-		return false;
-		break;
+	fp = libc_fopen("/proc/net/unix", "r");
+	if (fp == NULL) {
+		return -1;
 	}
 
-	for (f = socket_fds; f; f = f->next) {
-		struct socket_info *s = &sockets[f->si_index];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *p = line;
+		int i;
 
-		if (s == last_s) {
-			continue;
+		/* Num RefCount Protocol Flags Type St Inode Path */
+		for (i = 0; i < 7; i++) {
+			p += strspn(p, " ");
+			p += strcspn(p, " \n");
 		}
-		last_s = s;
+		p += strspn(p, " ");
+		p[strcspn(p, "\n")] = '\0';
 
-		if (s->myname == NULL) {
+		if (strncmp(p, dir, dir_len) != 0 || p[dir_len] != '/') {
 			continue;
 		}
-		if (s->myname->sa_family != sa->sa_family) {
+		p += dir_len + 1;
+
+		if (!swrap_socket_name_valid(p)) {
 			continue;
 		}
-		switch (s->myname->sa_family) {
-		case AF_INET: {
-			struct sockaddr_in *sin1, *sin2;
 
-			sin1 = (struct sockaddr_in *)s->myname;
-			sin2 = (struct sockaddr_in *)sa;
+		if (count == alloc) {
+			struct swrap_socket_name *tmp;
 
-			if (sin1->sin_addr.s_addr == htonl(INADDR_ANY)) {
-				continue;
-			}
-			if (sin1->sin_port != sin2->sin_port) {
-				continue;
-			}
-			if (sin1->sin_addr.s_addr != sin2->sin_addr.s_addr) {
-				continue;
+			alloc = alloc == 0 ? 64 : alloc * 2;
+			tmp = (struct swrap_socket_name *)realloc(names,
+					alloc * sizeof(*names));
+			if (tmp == NULL) {
+				free(names);
+				fclose(fp);
+				return -1;
 			}
+			names = tmp;
+		}
 
-			/* found */
-			return true;
-			break;
+		snprintf(names[count].name, sizeof(names[count].name), "%s", p);
+		count++;
+	}
+	fclose(fp);
+
+	if (count > 0) {
+		qsort(names, count, sizeof(*names), swrap_socket_name_cmp);
+	}
+
+	*pnames = names;
+	return (ssize_t)count;
+}
+
+/*
+ * Collect the sockets below dir, descending depth levels of subdirectories.
+ * Returns the number of names collected so far.
+ */
+static size_t swrap_socket_names(const char *dir,
+				 const char *rel,
+				 int depth,
+				 struct swrap_socket_name *names,
+				 size_t num_names)
+{
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct dirent *de;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, rel);
+	d = opendir(path);
+	if (d == NULL) {
+		return num_names;
+	}
+
+	while ((de = readdir(d)) != NULL && num_names < SWRAP_RECLAIM_BATCH) {
+		char name[sizeof(names[0].name)];
+		struct stat st;
+		int ret;
+
+		if (de->d_name[0] == '.') {
+			continue;
 		}
-#if HAVE_IPV6
-		case AF_INET6: {
-			struct sockaddr_in6 *sin1, *sin2;
 
-			sin1 = (struct sockaddr_in6 *)s->myname;
-			sin2 = (struct sockaddr_in6 *)sa;
+		ret = snprintf(name, sizeof(name), "%s%s", rel, de->d_name);
+		if (ret < 0 || (size_t)ret >= sizeof(name)) {
+			continue;
+		}
 
-			if (sin1->sin6_port != sin2->sin6_port) {
-				continue;
-			}
-			if (!IN6_ARE_ADDR_EQUAL(&sin1->sin6_addr,
-						&sin2->sin6_addr))
-			{
+		if (depth > 0) {
+			if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN) {
 				continue;
 			}
-
-			/* found */
-			return true;
-			break;
+			snprintf(name + ret, sizeof(name) - ret, "/");
+			num_names = swrap_socket_names(dir,
+						       name,
+						       depth - 1,
+						       names,
+						       num_names);
+			continue;
 		}
-#endif
-		default:
+
+		if (!swrap_socket_name_valid(de->d_name)) {
 			continue;
-			break;
+		}
 
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		ret = lstat(path, &st);
+		if (ret == -1 || !S_ISSOCK(st.st_mode)) {
+			continue;
 		}
+
+		snprintf(names[num_names].name, sizeof(names[num_names].name),
+			 "%s", name);
+		names[num_names].ino = st.st_ino;
+		num_names++;
 	}
+	closedir(d);
 
-	return false;
+	return num_names;
 }
-#endif
 
-static void swrap_remove_stale(int fd)
+/* Only a refused connect() proves that nobody is bound to the path */
+static bool swrap_stream_refused(const struct swrap_address *un_addr)
 {
-	struct socket_info_fd *fi = find_socket_info_fd(fd);
-	struct socket_info *si;
-	int si_index;
+	bool refused;
+	int probe;
+	int ret;
 
-	if (fi == NULL) {
-		return;
+	probe = libc_socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe == -1) {
+		return false;
 	}
 
-	si_index = fi->si_index;
-
-	SWRAP_LOG(SWRAP_LOG_TRACE, "remove stale wrapper for %d", fd);
-	SWRAP_DLIST_REMOVE(socket_fds, fi);
-	free(fi);
-
-	si = &sockets[si_index];
-	si->refcount--;
+	/* A listener with a full backlog must not block us */
+	libc_fcntl(probe, F_SETFL, O_NONBLOCK);
 
-	if (si->refcount > 0) {
-		return;
-	}
+	ret = libc_connect(probe, &un_addr->sa.s, un_addr->sa_socklen);
+	refused = ret == -1 && errno == ECONNREFUSED;
 
-	if (si->un_addr.sun_path[0] != '\0') {
-		unlink(si->un_addr.sun_path);
-	}
+	libc_close(probe);
 
-	si->next_free = first_free;
-	first_free = si_index;
+	return refused;
 }
 
-static int sockaddr_convert_to_un(struct socket_info *si,
-				  const struct sockaddr *in_addr,
-				  socklen_t in_len,
-				  struct sockaddr_un *out_addr,
-				  int alloc_sock,
-				  int *bcast)
+static int swrap_reclaim_stale(void)
 {
-	struct sockaddr *out = (struct sockaddr *)(void *)out_addr;
+	static time_t last_run;
+	const char *dir = socket_wrapper_dir();
+	struct swrap_socket_name *names = NULL;
+	struct swrap_socket_name *bound = NULL;
+	ssize_t num_bound;
+	size_t num_names = 0;
+	struct swrap_address un_addr = {
+		.sa_socklen = sizeof(struct sockaddr_un),
+	};
+	time_t now;
+	int reclaimed = 0;
+	int probe;
+	size_t i;
 
-	(void) in_len; /* unused */
+	/* Allocations failing in a loop shouldn't scan the directory each time */
+	now = time(NULL);
+	if (dir == NULL || now == last_run) {
+		return 0;
+	}
+	last_run = now;
 
-	if (out_addr == NULL) {
+	names = (struct swrap_socket_name *)calloc(SWRAP_RECLAIM_BATCH,
+						   sizeof(*names));
+	if (names == NULL) {
 		return 0;
 	}
 
-	out->sa_family = AF_UNIX;
-#ifdef HAVE_STRUCT_SOCKADDR_SA_LEN
-	out->sa_len = sizeof(*out_addr);
-#endif
+	num_names = swrap_socket_names(dir,
+				       "",
+				       socket_wrapper_dir_sharded() ? 2 : 0,
+				       names,
+				       num_names);
 
-	switch (in_addr->sa_family) {
-	case AF_UNSPEC: {
-		const struct sockaddr_in *sin;
-		if (si->family != AF_INET) {
+	/* Look at the bound sockets after listing them, so new ones are known */
+	num_bound = swrap_bound_names(dir, &bound);
+
+	/* A datagram socket nobody is bound to refuses a connect() */
+	probe = libc_socket(AF_UNIX, SOCK_DGRAM, 0);
+
+	un_addr.sa.un.sun_family = AF_UNIX;
+
+	for (i = 0; i < num_names; i++) {
+		bool dead = false;
+		struct stat st;
+		int ret;
+
+		snprintf(un_addr.sa.un.sun_path, sizeof(un_addr.sa.un.sun_path),
+			 "%s/%s", dir, names[i].name);
+
+		switch (names[i].name[0]) {
+		case SOCKET_TYPE_CHAR_UDP_LONG:
+		case SOCKET_TYPE_CHAR_UDP_V6_LONG:
+			if (probe == -1) {
+				continue;
+			}
+			ret = libc_connect(probe, &un_addr.sa.s, un_addr.sa_socklen);
+			dead = ret == -1 && errno == ECONNREFUSED;
 			break;
-		}
-		if (in_len < sizeof(struct sockaddr_in)) {
+		default:
+			if (num_bound == -1 ||
+			    bsearch(&names[i],
+				    bound,
+				    num_bound,
+				    sizeof(*bound),
+				    swrap_socket_name_cmp) != NULL) {
+				continue;
+			}
+			dead = swrap_stream_refused(&un_addr);
 			break;
 		}
-		sin = (const struct sockaddr_in *)(const void *)in_addr;
-		if(sin->sin_addr.s_addr != htonl(INADDR_ANY)) {
-			break;
+		if (!dead) {
+			continue;
 		}
 
-		/*
-		 * Note: in the special case of AF_UNSPEC and INADDR_ANY,
-		 * AF_UNSPEC is mapped to AF_INET and must be treated here.
-		 */
+		/* Don't remove the socket of someone who took over the path */
+		ret = lstat(un_addr.sa.un.sun_path, &st);
+		if (ret == -1 || st.st_ino != names[i].ino) {
+			continue;
+		}
 
-		/* FALL THROUGH */
+		ret = unlink(un_addr.sa.un.sun_path);
+		if (ret == 0) {
+			reclaimed++;
+		}
 	}
-	case AF_INET:
-#ifdef HAVE_IPV6
-	case AF_INET6:
-#endif
+
+	if (probe != -1) {
+		libc_close(probe);
+	}
+	free(bound);
+	free(names);
+
+	SWRAP_LOG(SWRAP_LOG_DEBUG,
+		  "Reclaimed %d stale sockets in %s",
+		  reclaimed, dir);
+
+	return reclaimed;
+}
+
+#define SWRAP_EPHEMERAL_FIRST 5001
+#define SWRAP_EPHEMERAL_LAST 9999
+
+/*
+ * The next ephemeral port to try per interface, so binding to port 0
+ * doesn't stat() all the ports used before. Interfaces sharing a slot just
+ * start at a port in use.
+ */
+#define SWRAP_PORT_HINT_SIZE 1024
+
+struct swrap_port_hint {
+	unsigned int prt;
+};
+
+static struct swrap_port_hint swrap_port_hints[SWRAP_PORT_HINT_SIZE];
+
+static struct swrap_port_hint *swrap_port_hint(char type,
+					       const unsigned int *words,
+					       size_t nwords)
+{
+	unsigned int h = (unsigned char)type;
+	size_t i;
+
+	for (i = 0; i < nwords; i++) {
+		h = h * 31 + words[i];
+	}
+
+	return &swrap_port_hints[h % SWRAP_PORT_HINT_SIZE];
+}
+
+static int convert_in_un_alloc(struct socket_info *si, const struct sockaddr *inaddr, struct sockaddr_un *un,
+			       int *bcast)
+{
+	char type = '\0';
+	unsigned int prt;
+	unsigned int in4_addr, in6_a0, in6_a1, in6_a2, in6_a3;
+	unsigned int words[4];
+	size_t nwords;
+	struct stat st;
+	int is_bcast = 0;
+	int ret;
+
+	if (bcast) *bcast = 0;
+
+	switch (si->family) {
+	case AF_INET: {
+		const struct sockaddr_in *in =
+		    (const struct sockaddr_in *)(const void *)inaddr;
+		unsigned int addr = ntohl(in->sin_addr.s_addr);
+		char u_type = '\0';
+		char d_type = '\0';
+		char b_type = '\0';
+		char a_type = '\0';
+
+		prt = ntohs(in->sin_port);
+
 		switch (si->type) {
 		case SOCK_STREAM:
+			u_type = SOCKET_TYPE_CHAR_TCP_LONG;
+			d_type = SOCKET_TYPE_CHAR_TCP_LONG;
+			break;
 		case SOCK_DGRAM:
+			u_type = SOCKET_TYPE_CHAR_UDP_LONG;
+			d_type = SOCKET_TYPE_CHAR_UDP_LONG;
+			a_type = SOCKET_TYPE_CHAR_UDP_LONG;
+			b_type = SOCKET_TYPE_CHAR_UDP_LONG;
 			break;
 		default:
 			SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown socket type!\n");
 			errno = ESOCKTNOSUPPORT;
 			return -1;
 		}
-		if (alloc_sock) {
-			return convert_in_un_alloc(si, in_addr, out_addr, bcast);
+
+		if (addr == 0) {
+			/* 0.0.0.0 */
+		 	is_bcast = 0;
+			type = d_type;
+			in4_addr = socket_wrapper_default_addr();
+		} else if (a_type && addr == 0xFFFFFFFF) {
+			/* 255.255.255.255 only udp */
+			is_bcast = 2;
+			type = a_type;
+			in4_addr = socket_wrapper_default_addr();
+		} else if (b_type && addr == 0x7FFFFFFF) {
+			/* 127.255.255.255 only udp */
+			is_bcast = 1;
+			type = b_type;
+			in4_addr = socket_wrapper_default_addr();
 		} else {
-			return convert_in_un_remote(si, in_addr, out_addr, bcast);
-		}
-	default:
-		break;
-	}
+			/* 127.0.0.X */
+			is_bcast = 0;
+			type = u_type;
+			in4_addr = addr;
+		} 
 
-	errno = EAFNOSUPPORT;
-	SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown address family\n");
-	return -1;
-}
+		/* Store the bind address for connect() */
+		if (si->bindname.sa_socklen == 0) {
+			struct sockaddr_in bind_in;
+			socklen_t blen = sizeof(struct sockaddr_in);
 
-static int sockaddr_convert_from_un(const struct socket_info *si,
-				    const struct sockaddr_un *in_addr,
-				    socklen_t un_addrlen,
-				    int family,
-				    struct sockaddr *out_addr,
-				    socklen_t *out_addrlen)
-{
-	int ret;
+			ZERO_STRUCT(bind_in);
+			bind_in.sin_family = in->sin_family;
+			bind_in.sin_port = in->sin_port;
+			bind_in.sin_addr.s_addr = htonl(in4_addr);
 
-	if (out_addr == NULL || out_addrlen == NULL)
-		return 0;
+			si->bindname.sa_socklen = blen;
+			memcpy(&si->bindname.sa.in, &bind_in, blen);
+		}
 
-	if (un_addrlen == 0) {
-		*out_addrlen = 0;
-		return 0;
+		break;
 	}
-
-	switch (family) {
-	case AF_INET:
 #ifdef HAVE_IPV6
-	case AF_INET6:
-#endif
+	case AF_INET6: {
+		const struct sockaddr_in6 *in =
+		    (const struct sockaddr_in6 *)(const void *)inaddr;
+		struct sockaddr_in6 in6_addr = *in;
+
 		switch (si->type) {
 		case SOCK_STREAM:
+			type = SOCKET_TYPE_CHAR_TCP_V6_LONG;
+			break;
 		case SOCK_DGRAM:
+			type = SOCKET_TYPE_CHAR_UDP_V6_LONG;
 			break;
 		default:
 			SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown socket type!\n");
 			errno = ESOCKTNOSUPPORT;
 			return -1;
 		}
-		ret = convert_un_in(in_addr, out_addr, out_addrlen);
-#ifdef HAVE_STRUCT_SOCKADDR_SA_LEN
-		out_addr->sa_len = *out_addrlen;
+
+		/* XXX no multicast/broadcast */
+
+		prt = ntohs(in->sin6_port);
+
+		/* TODO - More checks */
+
+		if (IN6_IS_ADDR_UNSPECIFIED(&in->sin6_addr)) {
+			swrap_iface_ipv6(socket_wrapper_default_iface(),
+					 &in6_addr.sin6_addr);
+		}
+
+		swrap_make_ipv6_ints(in6_addr.sin6_addr.s6_addr,&in6_a0,&in6_a1,&in6_a2,&in6_a3);
+
+		/* Store the bind address for connect() */
+		if (si->bindname.sa_socklen == 0) {
+			struct sockaddr_in6 bind_in;
+			socklen_t blen = sizeof(struct sockaddr_in6);
+
+			ZERO_STRUCT(bind_in);
+			bind_in.sin6_family = in6_addr.sin6_family;
+			bind_in.sin6_port = in6_addr.sin6_port;
+
+			bind_in.sin6_addr = in6_addr.sin6_addr;
+
+			memcpy(&si->bindname.sa.in6, &bind_in, blen);
+			si->bindname.sa_socklen = blen;
+		}
+
+		break;
+	}
 #endif
-		return ret;
 	default:
-		break;
+		SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown address family\n");
+		errno = EADDRNOTAVAIL;
+		return -1;
 	}
 
-	SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown address family\n");
-	errno = EAFNOSUPPORT;
-	return -1;
-}
 
-enum swrap_packet_type {
-	SWRAP_CONNECT_SEND,
-	SWRAP_CONNECT_UNREACH,
-	SWRAP_CONNECT_RECV,
-	SWRAP_CONNECT_ACK,
-	SWRAP_ACCEPT_SEND,
-	SWRAP_ACCEPT_RECV,
-	SWRAP_ACCEPT_ACK,
-	SWRAP_RECVFROM,
-	SWRAP_SENDTO,
-	SWRAP_SENDTO_UNREACH,
-	SWRAP_PENDING_RST,
-	SWRAP_RECV,
-	SWRAP_RECV_RST,
-	SWRAP_SEND,
-	SWRAP_SEND_RST,
-	SWRAP_CLOSE_SEND,
-	SWRAP_CLOSE_RECV,
-	SWRAP_CLOSE_ACK,
-};
+	if (bcast) *bcast = is_bcast;
 
-struct swrap_file_hdr {
-	uint32_t	magic;
-	uint16_t	version_major;
-	uint16_t	version_minor;
-	int32_t		timezone;
-	uint32_t	sigfigs;
-	uint32_t	frame_max_len;
-#define SWRAP_FRAME_LENGTH_MAX 0xFFFF
-	uint32_t	link_type;
-};
-#define SWRAP_FILE_HDR_SIZE 24
 
-struct swrap_packet_frame {
-	uint32_t seconds;
-	uint32_t micro_seconds;
-	uint32_t recorded_length;
-	uint32_t full_length;
-};
-#define SWRAP_PACKET_FRAME_SIZE 16
+	if (si->family == AF_INET) {
+		words[0] = in4_addr;
+		nwords = 1;
+	} else {
+		words[0] = in6_a0;
+		words[1] = in6_a1;
+		words[2] = in6_a2;
+		words[3] = in6_a3;
+		nwords = 4;
+	}
 
-union swrap_packet_ip {
-	struct {
-		uint8_t		ver_hdrlen;
-		uint8_t		tos;
-		uint16_t	packet_length;
-		uint16_t	identification;
-		uint8_t		flags;
-		uint8_t		fragment;
-		uint8_t		ttl;
-		uint8_t		protocol;
-		uint16_t	hdr_checksum;
-		uint32_t	src_addr;
-		uint32_t	dest_addr;
-	} v4;
-#define SWRAP_PACKET_IP_V4_SIZE 20
-	struct {
-		uint8_t		ver_prio;
-		uint8_t		flow_label_high;
-		uint16_t	flow_label_low;
-		uint16_t	payload_length;
-		uint8_t		next_header;
-		uint8_t		hop_limit;
-		uint8_t		src_addr[16];
-		uint8_t		dest_addr[16];
-	} v6;
-#define SWRAP_PACKET_IP_V6_SIZE 40
-};
-#define SWRAP_PACKET_IP_SIZE 40
+	if (prt == 0) {
+		struct swrap_port_hint *hint;
+		unsigned int skipped = 0;
+		unsigned int n;
+
+		/* Continue after the last port of the interface */
+		hint = swrap_port_hint(type, words, nwords);
+		prt = hint->prt;
+		if (prt < SWRAP_EPHEMERAL_FIRST || prt > SWRAP_EPHEMERAL_LAST) {
+			prt = SWRAP_EPHEMERAL_FIRST;
+		}
 
-union swrap_packet_payload {
-	struct {
-		uint16_t	source_port;
-		uint16_t	dest_port;
-		uint32_t	seq_num;
-		uint32_t	ack_num;
-		uint8_t		hdr_length;
-		uint8_t		control;
-		uint16_t	window;
-		uint16_t	checksum;
-		uint16_t	urg;
-	} tcp;
-#define SWRAP_PACKET_PAYLOAD_TCP_SIZE 20
-	struct {
-		uint16_t	source_port;
-		uint16_t	dest_port;
-		uint16_t	length;
-		uint16_t	checksum;
-	} udp;
-#define SWRAP_PACKET_PAYLOAD_UDP_SIZE 8
-	struct {
-		uint8_t		type;
-		uint8_t		code;
-		uint16_t	checksum;
-		uint32_t	unused;
-	} icmp4;
-#define SWRAP_PACKET_PAYLOAD_ICMP4_SIZE 8
-	struct {
-		uint8_t		type;
-		uint8_t		code;
-		uint16_t	checksum;
-		uint32_t	unused;
-	} icmp6;
-#define SWRAP_PACKET_PAYLOAD_ICMP6_SIZE 8
-};
-#define SWRAP_PACKET_PAYLOAD_SIZE 20
+		/* handle auto-allocation of ephemeral ports */
+		for (n = 0; n <= SWRAP_EPHEMERAL_LAST - SWRAP_EPHEMERAL_FIRST; n++) {
+			if (prt > SWRAP_EPHEMERAL_LAST) {
+				prt = SWRAP_EPHEMERAL_FIRST;
+			}
 
-#define SWRAP_PACKET_MIN_ALLOC \
-	(SWRAP_PACKET_FRAME_SIZE + \
-	 SWRAP_PACKET_IP_SIZE + \
-	 SWRAP_PACKET_PAYLOAD_SIZE)
+			ret = swrap_un_path(&swrap_bind_template, un,
+					    type, words, nwords, prt);
+			if (ret == -1) {
+				return -1;
+			}
 
-static const char *swrap_pcap_init_file(void)
-{
-	static int initialized = 0;
-	static const char *s = NULL;
-	static const struct swrap_file_hdr h;
-	static const struct swrap_packet_frame f;
-	static const union swrap_packet_ip i;
-	static const union swrap_packet_payload p;
+			if (stat(un->sun_path, &st) == 0) {
+				skipped++;
+				if (skipped == SWRAP_RECLAIM_THRESHOLD &&
+				    swrap_reclaim_stale() > 0) {
+					/* Start over, the ports might be free now */
+					n = 0;
+				}
+				prt++;
+				continue;
+			}
 
-	if (initialized == 1) {
-		return s;
+			set_port(si->family, prt, &si->myname);
+			set_port(si->family, prt, &si->bindname);
+
+			break;
+		}
+		if (n > SWRAP_EPHEMERAL_LAST - SWRAP_EPHEMERAL_FIRST) {
+			errno = ENFILE;
+			return -1;
+		}
+		hint->prt = prt + 1;
 	}
-	initialized = 1;
 
-	/*
-	 * TODO: don't use the structs use plain buffer offsets
-	 *       and PUSH_U8(), PUSH_U16() and PUSH_U32()
-	 *
-	 * for now make sure we disable PCAP support
-	 * if the struct has alignment!
-	 */
-	if (sizeof(h) != SWRAP_FILE_HDR_SIZE) {
-		return NULL;
-	}
-	if (sizeof(f) != SWRAP_PACKET_FRAME_SIZE) {
-		return NULL;
-	}
-	if (sizeof(i) != SWRAP_PACKET_IP_SIZE) {
-		return NULL;
-	}
-	if (sizeof(i.v4) != SWRAP_PACKET_IP_V4_SIZE) {
-		return NULL;
-	}
-	if (sizeof(i.v6) != SWRAP_PACKET_IP_V6_SIZE) {
-		return NULL;
+	ret = swrap_un_path(&swrap_bind_template, un, type, words, nwords, prt);
+	if (ret == -1) {
+		return -1;
 	}
-	if (sizeof(p) != SWRAP_PACKET_PAYLOAD_SIZE) {
-		return NULL;
+	SWRAP_LOG(SWRAP_LOG_DEBUG, "un path [%s]", un->sun_path);
+	return 0;
+}
+
+static struct socket_info_fd *swrap_fd_entry_alloc(void)
+{
+	struct socket_info_fd *fi = socket_fds_free;
+
+	if (fi == NULL) {
+		return (struct socket_info_fd *)calloc(1,
+				sizeof(struct socket_info_fd));
 	}
-	if (sizeof(p.tcp) != SWRAP_PACKET_PAYLOAD_TCP_SIZE) {
-		return NULL;
+
+	socket_fds_free = fi->prev;
+	ZERO_STRUCTP(fi);
+
+	return fi;
+}
+
+/*
+ * Unlinks the entry from socket_fds and puts it on the free list. The
+ * control thread may be standing on it, so next still leads back into
+ * socket_fds and the free list is chained by prev instead.
+ */
+static void swrap_fd_entry_free(struct socket_info_fd *fi)
+{
+	if (socket_fds == fi) {
+		__atomic_store_n(&socket_fds, fi->next, __ATOMIC_RELEASE);
+	} else if (fi->prev != NULL) {
+		__atomic_store_n(&fi->prev->next, fi->next, __ATOMIC_RELEASE);
 	}
-	if (sizeof(p.udp) != SWRAP_PACKET_PAYLOAD_UDP_SIZE) {
-		return NULL;
+	if (fi->next != NULL) {
+		fi->next->prev = fi->prev;
 	}
-	if (sizeof(p.icmp4) != SWRAP_PACKET_PAYLOAD_ICMP4_SIZE) {
-		return NULL;
+
+	fi->prev = socket_fds_free;
+	socket_fds_free = fi;
+}
+
+static struct socket_info_fd *find_socket_info_fd(int fd)
+{
+	struct socket_info_fd *f;
+
+	for (f = socket_fds; f; f = f->next) {
+		if (f->fd == fd) {
+			return f;
+		}
 	}
-	if (sizeof(p.icmp6) != SWRAP_PACKET_PAYLOAD_ICMP6_SIZE) {
-		return NULL;
+
+	return NULL;
+}
+
+static int find_socket_info_index(int fd)
+{
+	struct socket_info_fd *fi = find_socket_info_fd(fd);
+
+	if (fi == NULL) {
+		return -1;
 	}
 
-	s = getenv("SOCKET_WRAPPER_PCAP_FILE");
-	if (s == NULL) {
+	return fi->si_index;
+}
+
+static struct socket_info *find_socket_info(int fd)
+{
+	int idx = find_socket_info_index(fd);
+
+	if (idx == -1) {
 		return NULL;
 	}
-	if (strncmp(s, "./", 2) == 0) {
-		s += 2;
-	}
-	return s;
+
+	return &sockets[idx];
 }
 
-static uint8_t *swrap_pcap_packet_init(struct timeval *tval,
-				       const struct sockaddr *src,
-				       const struct sockaddr *dest,
-				       int socket_type,
-				       const uint8_t *payload,
-				       size_t payload_len,
-				       unsigned long tcp_seqno,
-				       unsigned long tcp_ack,
-				       unsigned char tcp_ctl,
-				       int unreachable,
-				       size_t *_packet_len)
+/*
+ * Index of the addresses bound in this process, so bind() can detect
+ * EADDRINUSE without walking all the sockets. A bucket is selected by the
+ * family, type and port, a wildcard address matches every address of the
+ * bucket.
+ */
+#define SWRAP_BIND_HASH_SIZE 4096
+
+/*
+ * The first socket of a bucket, as index into sockets + 1. The buckets are
+ * keyed by the address too, so many interfaces using the same port don't
+ * end up in one bucket.
+ */
+static int swrap_bind_hash[SWRAP_BIND_HASH_SIZE];
+
+static in_port_t swrap_addr_port(const struct swrap_address *addr)
 {
-	uint8_t *base;
-	uint8_t *buf;
-	struct swrap_packet_frame *frame;
-	union swrap_packet_ip *ip;
-	union swrap_packet_payload *pay;
-	size_t packet_len;
-	size_t alloc_len;
-	size_t nonwire_len = sizeof(*frame);
-	size_t wire_hdr_len = 0;
-	size_t wire_len = 0;
-	size_t ip_hdr_len = 0;
-	size_t icmp_hdr_len = 0;
-	size_t icmp_truncate_len = 0;
-	uint8_t protocol = 0, icmp_protocol = 0;
-	const struct sockaddr_in *src_in = NULL;
-	const struct sockaddr_in *dest_in = NULL;
+	switch (addr->sa.s.sa_family) {
+	case AF_INET:
+		return addr->sa.in.sin_port;
 #ifdef HAVE_IPV6
-	const struct sockaddr_in6 *src_in6 = NULL;
-	const struct sockaddr_in6 *dest_in6 = NULL;
+	case AF_INET6:
+		return addr->sa.in6.sin6_port;
 #endif
-	uint16_t src_port;
-	uint16_t dest_port;
+	default:
+		break;
+	}
 
-	switch (src->sa_family) {
+	return 0;
+}
+
+static bool swrap_addr_is_any(const struct swrap_address *addr)
+{
+	switch (addr->sa.s.sa_family) {
 	case AF_INET:
-		src_in = (const struct sockaddr_in *)(const void *)src;
-		dest_in = (const struct sockaddr_in *)(const void *)dest;
-		src_port = src_in->sin_port;
-		dest_port = dest_in->sin_port;
-		ip_hdr_len = sizeof(ip->v4);
-		break;
+		return addr->sa.in.sin_addr.s_addr == htonl(INADDR_ANY);
 #ifdef HAVE_IPV6
 	case AF_INET6:
-		src_in6 = (const struct sockaddr_in6 *)(const void *)src;
-		dest_in6 = (const struct sockaddr_in6 *)(const void *)dest;
-		src_port = src_in6->sin6_port;
-		dest_port = dest_in6->sin6_port;
-		ip_hdr_len = sizeof(ip->v6);
-		break;
+		return IN6_IS_ADDR_UNSPECIFIED(&addr->sa.in6.sin6_addr);
 #endif
 	default:
-		return NULL;
+		break;
 	}
 
-	switch (socket_type) {
-	case SOCK_STREAM:
-		protocol = 0x06; /* TCP */
-		wire_hdr_len = ip_hdr_len + sizeof(pay->tcp);
-		wire_len = wire_hdr_len + payload_len;
-		break;
+	return false;
+}
 
-	case SOCK_DGRAM:
-		protocol = 0x11; /* UDP */
-		wire_hdr_len = ip_hdr_len + sizeof(pay->udp);
-		wire_len = wire_hdr_len + payload_len;
-		break;
+/* The wildcard address hashes to 0 */
+static unsigned int swrap_addr_hash(const struct swrap_address *addr)
+{
+	switch (addr->sa.s.sa_family) {
+	case AF_INET:
+		return ntohl(addr->sa.in.sin_addr.s_addr);
+#ifdef HAVE_IPV6
+	case AF_INET6: {
+		unsigned int h = 0;
+		size_t i;
 
-	default:
-		return NULL;
+		for (i = 0; i < 16; i++) {
+			h = h * 31 + addr->sa.in6.sin6_addr.s6_addr[i];
+		}
+		return h;
 	}
-
-	if (unreachable) {
-		icmp_protocol = protocol;
-		switch (src->sa_family) {
-		case AF_INET:
-			protocol = 0x01; /* ICMPv4 */
-			icmp_hdr_len = ip_hdr_len + sizeof(pay->icmp4);
-			break;
-#ifdef HAVE_IPV6
-		case AF_INET6:
-			protocol = 0x3A; /* ICMPv6 */
-			icmp_hdr_len = ip_hdr_len + sizeof(pay->icmp6);
-			break;
 #endif
-		}
-		if (wire_len > 64 ) {
-			icmp_truncate_len = wire_len - 64;
-		}
-		wire_hdr_len += icmp_hdr_len;
-		wire_len += icmp_hdr_len;
+	default:
+		break;
 	}
 
-	packet_len = nonwire_len + wire_len;
-	alloc_len = packet_len;
-	if (alloc_len < SWRAP_PACKET_MIN_ALLOC) {
-		alloc_len = SWRAP_PACKET_MIN_ALLOC;
-	}
+	return 0;
+}
 
-	base = (uint8_t *)calloc(1, alloc_len);
-	if (base == NULL) {
-		return NULL;
-	}
+static unsigned int swrap_bind_bucket(int family,
+				      int type,
+				      const struct swrap_address *addr)
+{
+	unsigned int h = ntohs(swrap_addr_port(addr));
 
-	buf = base;
+	h = h * 31 + (unsigned int)family;
+	h = h * 31 + (unsigned int)type;
+	h = h * 31 + swrap_addr_hash(addr);
 
-	frame = (struct swrap_packet_frame *)(void *)buf;
-	frame->seconds		= tval->tv_sec;
-	frame->micro_seconds	= tval->tv_usec;
-	frame->recorded_length	= wire_len - icmp_truncate_len;
-	frame->full_length	= wire_len - icmp_truncate_len;
-	buf += SWRAP_PACKET_FRAME_SIZE;
+	return h % SWRAP_BIND_HASH_SIZE;
+}
 
-	ip = (union swrap_packet_ip *)(void *)buf;
-	switch (src->sa_family) {
+static bool swrap_addr_equal(const struct swrap_address *a,
+			     const struct swrap_address *b)
+{
+	if (a->sa.s.sa_family != b->sa.s.sa_family) {
+		return false;
+	}
+
+	switch (a->sa.s.sa_family) {
 	case AF_INET:
-		ip->v4.ver_hdrlen	= 0x45; /* version 4 and 5 * 32 bit words */
-		ip->v4.tos		= 0x00;
-		ip->v4.packet_length	= htons(wire_len - icmp_truncate_len);
-		ip->v4.identification	= htons(0xFFFF);
-		ip->v4.flags		= 0x40; /* BIT 1 set - means don't fragment */
-		ip->v4.fragment		= htons(0x0000);
-		ip->v4.ttl		= 0xFF;
-		ip->v4.protocol		= protocol;
-		ip->v4.hdr_checksum	= htons(0x0000);
-		ip->v4.src_addr		= src_in->sin_addr.s_addr;
-		ip->v4.dest_addr	= dest_in->sin_addr.s_addr;
-		buf += SWRAP_PACKET_IP_V4_SIZE;
-		break;
+		return a->sa.in.sin_addr.s_addr == b->sa.in.sin_addr.s_addr;
 #ifdef HAVE_IPV6
 	case AF_INET6:
-		ip->v6.ver_prio		= 0x60; /* version 4 and 5 * 32 bit words */
-		ip->v6.flow_label_high	= 0x00;
-		ip->v6.flow_label_low	= 0x0000;
-		ip->v6.payload_length	= htons(wire_len - icmp_truncate_len); /* TODO */
-		ip->v6.next_header	= protocol;
-		memcpy(ip->v6.src_addr, src_in6->sin6_addr.s6_addr, 16);
-		memcpy(ip->v6.dest_addr, dest_in6->sin6_addr.s6_addr, 16);
-		buf += SWRAP_PACKET_IP_V6_SIZE;
-		break;
+		return IN6_ARE_ADDR_EQUAL(&a->sa.in6.sin6_addr,
+					  &b->sa.in6.sin6_addr);
 #endif
+	default:
+		break;
 	}
 
-	if (unreachable) {
-		pay = (union swrap_packet_payload *)(void *)buf;
-		switch (src->sa_family) {
-		case AF_INET:
-			pay->icmp4.type		= 0x03; /* destination unreachable */
-			pay->icmp4.code		= 0x01; /* host unreachable */
-			pay->icmp4.checksum	= htons(0x0000);
-			pay->icmp4.unused	= htonl(0x00000000);
-			buf += SWRAP_PACKET_PAYLOAD_ICMP4_SIZE;
-
-			/* set the ip header in the ICMP payload */
-			ip = (union swrap_packet_ip *)(void *)buf;
-			ip->v4.ver_hdrlen	= 0x45; /* version 4 and 5 * 32 bit words */
-			ip->v4.tos		= 0x00;
-			ip->v4.packet_length	= htons(wire_len - icmp_hdr_len);
-			ip->v4.identification	= htons(0xFFFF);
-			ip->v4.flags		= 0x40; /* BIT 1 set - means don't fragment */
-			ip->v4.fragment		= htons(0x0000);
-			ip->v4.ttl		= 0xFF;
-			ip->v4.protocol		= icmp_protocol;
-			ip->v4.hdr_checksum	= htons(0x0000);
-			ip->v4.src_addr		= dest_in->sin_addr.s_addr;
-			ip->v4.dest_addr	= src_in->sin_addr.s_addr;
-			buf += SWRAP_PACKET_IP_V4_SIZE;
+	return false;
+}
 
-			src_port = dest_in->sin_port;
-			dest_port = src_in->sin_port;
-			break;
-#ifdef HAVE_IPV6
-		case AF_INET6:
-			pay->icmp6.type		= 0x01; /* destination unreachable */
-			pay->icmp6.code		= 0x03; /* address unreachable */
-			pay->icmp6.checksum	= htons(0x0000);
-			pay->icmp6.unused	= htonl(0x00000000);
-			buf += SWRAP_PACKET_PAYLOAD_ICMP6_SIZE;
-
-			/* set the ip header in the ICMP payload */
-			ip = (union swrap_packet_ip *)(void *)buf;
-			ip->v6.ver_prio		= 0x60; /* version 4 and 5 * 32 bit words */
-			ip->v6.flow_label_high	= 0x00;
-			ip->v6.flow_label_low	= 0x0000;
-			ip->v6.payload_length	= htons(wire_len - icmp_truncate_len); /* TODO */
-			ip->v6.next_header	= protocol;
-			memcpy(ip->v6.src_addr, dest_in6->sin6_addr.s6_addr, 16);
-			memcpy(ip->v6.dest_addr, src_in6->sin6_addr.s6_addr, 16);
-			buf += SWRAP_PACKET_IP_V6_SIZE;
-
-			src_port = dest_in6->sin6_port;
-			dest_port = src_in6->sin6_port;
-			break;
-#endif
-		}
+/*
+ * Follows the rules of the kernel: SO_REUSEPORT on both sockets allows
+ * sharing the address. SO_REUSEADDR on both does for datagram sockets,
+ * and for stream sockets unless the bound one is listening.
+ */
+static bool swrap_bind_conflict(const struct socket_info *si,
+				const struct swrap_address *addr,
+				const struct socket_info *other)
+{
+	if (other->family != si->family || other->type != si->type) {
+		return false;
 	}
 
-	pay = (union swrap_packet_payload *)(void *)buf;
-
-	switch (socket_type) {
-	case SOCK_STREAM:
-		pay->tcp.source_port	= src_port;
-		pay->tcp.dest_port	= dest_port;
-		pay->tcp.seq_num	= htonl(tcp_seqno);
-		pay->tcp.ack_num	= htonl(tcp_ack);
-		pay->tcp.hdr_length	= 0x50; /* 5 * 32 bit words */
-		pay->tcp.control	= tcp_ctl;
-		pay->tcp.window		= htons(0x7FFF);
-		pay->tcp.checksum	= htons(0x0000);
-		pay->tcp.urg		= htons(0x0000);
-		buf += SWRAP_PACKET_PAYLOAD_TCP_SIZE;
-
-		break;
+	if (swrap_addr_port(&other->boundname) != swrap_addr_port(addr)) {
+		return false;
+	}
 
-	case SOCK_DGRAM:
-		pay->udp.source_port	= src_port;
-		pay->udp.dest_port	= dest_port;
-		pay->udp.length		= htons(8 + payload_len);
-		pay->udp.checksum	= htons(0x0000);
-		buf += SWRAP_PACKET_PAYLOAD_UDP_SIZE;
+	if (!swrap_addr_is_any(addr) &&
+	    !swrap_addr_is_any(&other->boundname) &&
+	    !swrap_addr_equal(addr, &other->boundname)) {
+		return false;
+	}
 
-		break;
+	if (si->reuseport && other->reuseport) {
+		return false;
 	}
 
-	if (payload && payload_len > 0) {
-		memcpy(buf, payload, payload_len);
+	if (si->reuseaddr && other->reuseaddr) {
+		if (si->type == SOCK_DGRAM || !other->listening) {
+			return false;
+		}
 	}
 
-	*_packet_len = packet_len - icmp_truncate_len;
-	return base;
+	return true;
 }
 
-static int swrap_pcap_get_fd(const char *fname)
+static bool swrap_bind_bucket_conflict(const struct socket_info *si,
+				       const struct swrap_address *addr,
+				       unsigned int bucket)
 {
-	static int fd = -1;
+	int idx;
 
-	if (fd != -1) {
-		return fd;
-	}
+	for (idx = swrap_bind_hash[bucket]; idx != 0; idx = sockets[idx - 1].bind_next) {
+		const struct socket_info *other = &sockets[idx - 1];
 
-	fd = libc_open(fname, O_WRONLY|O_CREAT|O_EXCL|O_APPEND, 0644);
-	if (fd != -1) {
-		struct swrap_file_hdr file_hdr;
-		file_hdr.magic		= 0xA1B2C3D4;
-		file_hdr.version_major	= 0x0002;	
-		file_hdr.version_minor	= 0x0004;
-		file_hdr.timezone	= 0x00000000;
-		file_hdr.sigfigs	= 0x00000000;
-		file_hdr.frame_max_len	= SWRAP_FRAME_LENGTH_MAX;
-		file_hdr.link_type	= 0x0065; /* 101 RAW IP */
+		if (other == si) {
+			continue;
+		}
 
-		if (write(fd, &file_hdr, sizeof(file_hdr)) != sizeof(file_hdr)) {
-			close(fd);
-			fd = -1;
+		if (swrap_bind_conflict(si, addr, other)) {
+			return true;
 		}
-		return fd;
 	}
 
-	fd = libc_open(fname, O_WRONLY|O_APPEND, 0644);
-
-	return fd;
+	return false;
 }
 
-static uint8_t *swrap_pcap_marshall_packet(struct socket_info *si,
-					   const struct sockaddr *addr,
-					   enum swrap_packet_type type,
-					   const void *buf, size_t len,
-					   size_t *packet_len)
+static bool check_addr_port_in_use(const struct socket_info *si,
+				   const struct sockaddr *sa,
+				   socklen_t len)
 {
-	const struct sockaddr *src_addr;
-	const struct sockaddr *dest_addr;
-	unsigned long tcp_seqno = 0;
-	unsigned long tcp_ack = 0;
-	unsigned char tcp_ctl = 0;
-	int unreachable = 0;
-
-	struct timeval tv;
+	struct swrap_address addr = {
+		.sa_socklen = len,
+	};
+	struct swrap_address any;
+	unsigned int bucket;
 
-	switch (si->family) {
+	/* first catch invalid input */
+	switch (sa->sa_family) {
 	case AF_INET:
+		if (len < sizeof(struct sockaddr_in)) {
+			return false;
+		}
 		break;
 #ifdef HAVE_IPV6
 	case AF_INET6:
+		if (len < sizeof(struct sockaddr_in6)) {
+			return false;
+		}
 		break;
 #endif
 	default:
-		return NULL;
+		return false;
 	}
 
-	switch (type) {
-	case SWRAP_CONNECT_SEND:
-		if (si->type != SOCK_STREAM) {
-			return NULL;
-		}
-
-		src_addr  = &si->myname.sa.s;
-		dest_addr = addr;
-
-		tcp_seqno = si->io.pck_snd;
-		tcp_ack = si->io.pck_rcv;
-		tcp_ctl = 0x02; /* SYN */
-
-		si->io.pck_snd += 1;
+	memcpy(&addr.sa.ss, sa, len);
 
-		break;
+	/* An ephemeral port is picked when the path gets created */
+	if (swrap_addr_port(&addr) == 0) {
+		return false;
+	}
 
-	case SWRAP_CONNECT_RECV:
-		if (si->type != SOCK_STREAM) {
-			return NULL;
+	/* A wildcard address conflicts with any address */
+	if (swrap_addr_is_any(&addr)) {
+		for (bucket = 0; bucket < SWRAP_BIND_HASH_SIZE; bucket++) {
+			if (swrap_bind_bucket_conflict(si, &addr, bucket)) {
+				return true;
+			}
 		}
+		return false;
+	}
 
-		dest_addr = &si->myname.sa.s;
-		src_addr = addr;
-
-		tcp_seqno = si->io.pck_rcv;
-		tcp_ack = si->io.pck_snd;
-		tcp_ctl = 0x12; /** SYN,ACK */
-
-		si->io.pck_rcv += 1;
+	bucket = swrap_bind_bucket(si->family, si->type, &addr);
+	if (swrap_bind_bucket_conflict(si, &addr, bucket)) {
+		return true;
+	}
 
+	/* Otherwise only with itself and the wildcard address */
+	any = addr;
+	switch (any.sa.s.sa_family) {
+	case AF_INET:
+		any.sa.in.sin_addr.s_addr = htonl(INADDR_ANY);
 		break;
+#ifdef HAVE_IPV6
+	case AF_INET6:
+		any.sa.in6.sin6_addr = in6addr_any;
+		break;
+#endif
+	}
+	bucket = swrap_bind_bucket(si->family, si->type, &any);
 
-	case SWRAP_CONNECT_UNREACH:
-		if (si->type != SOCK_STREAM) {
-			return NULL;
-		}
+	return swrap_bind_bucket_conflict(si, &addr, bucket);
+}
 
-		dest_addr = &si->myname.sa.s;
-		src_addr  = addr;
+static void swrap_bind_add(struct socket_info *si,
+			   const struct swrap_address *addr)
+{
+	unsigned int bucket;
 
-		/* Unreachable: resend the data of SWRAP_CONNECT_SEND */
-		tcp_seqno = si->io.pck_snd - 1;
-		tcp_ack = si->io.pck_rcv;
-		tcp_ctl = 0x02; /* SYN */
-		unreachable = 1;
+	if (si->bind_hashed) {
+		return;
+	}
 
-		break;
+	si->boundname = *addr;
+	bucket = swrap_bind_bucket(si->family, si->type, &si->boundname);
 
-	case SWRAP_CONNECT_ACK:
-		if (si->type != SOCK_STREAM) {
-			return NULL;
-		}
+	si->bind_next = swrap_bind_hash[bucket];
+	swrap_bind_hash[bucket] = (int)(si - sockets) + 1;
+	si->bind_hashed = true;
+}
 
-		src_addr  = &si->myname.sa.s;
-		dest_addr = addr;
+static void swrap_bind_remove(struct socket_info *si)
+{
+	unsigned int bucket;
+	int *pidx;
 
-		tcp_seqno = si->io.pck_snd;
-		tcp_ack = si->io.pck_rcv;
-		tcp_ctl = 0x10; /* ACK */
+	if (!si->bind_hashed) {
+		return;
+	}
 
-		break;
+	bucket = swrap_bind_bucket(si->family, si->type, &si->boundname);
 
-	case SWRAP_ACCEPT_SEND:
-		if (si->type != SOCK_STREAM) {
-			return NULL;
+	for (pidx = &swrap_bind_hash[bucket];
+	     *pidx != 0;
+	     pidx = &sockets[*pidx - 1].bind_next) {
+		if (&sockets[*pidx - 1] == si) {
+			*pidx = si->bind_next;
+			break;
 		}
+	}
 
-		dest_addr = &si->myname.sa.s;
-		src_addr = addr;
+	si->bind_next = 0;
+	si->bind_hashed = false;
+}
 
-		tcp_seqno = si->io.pck_rcv;
-		tcp_ack = si->io.pck_snd;
-		tcp_ctl = 0x02; /* SYN */
+static void swrap_delay_release(struct socket_info *si);
+static void swrap_ring_release(struct socket_info *si);
+static void swrap_tstamp_release(struct socket_info *si);
+static void swrap_oneway_close(struct socket_info *si);
+static void swrap_rcvq_close(struct socket_info *si);
+static struct swrap_rcvq *swrap_rcvq_dest(struct socket_info *si,
+					  const struct msghdr *msg);
+static bool swrap_rcvq_charge(struct swrap_rcvq *q, size_t len);
+static void swrap_rcvq_uncharge(struct swrap_rcvq *q, size_t len);
 
-		si->io.pck_rcv += 1;
+static void swrap_remove_stale(int fd)
+{
+	struct socket_info_fd *fi = find_socket_info_fd(fd);
+	struct socket_info *si;
+	int si_index;
 
-		break;
+	if (fi == NULL) {
+		return;
+	}
 
-	case SWRAP_ACCEPT_RECV:
-		if (si->type != SOCK_STREAM) {
-			return NULL;
-		}
+	si_index = fi->si_index;
 
-		src_addr = &si->myname.sa.s;
-		dest_addr = addr;
+	SWRAP_LOG(SWRAP_LOG_TRACE, "remove stale wrapper for %d", fd);
+	swrap_fd_entry_free(fi);
 
-		tcp_seqno = si->io.pck_snd;
-		tcp_ack = si->io.pck_rcv;
-		tcp_ctl = 0x12; /* SYN,ACK */
+	si = &sockets[si_index];
+	si->refcount--;
 
-		si->io.pck_snd += 1;
+	if (si->refcount > 0) {
+		return;
+	}
 
-		break;
+	if (si->un_addr.sun_path[0] != '\0') {
+		swrap_bcast_unlink(si->un_addr.sun_path);
+		unlink(si->un_addr.sun_path);
+	}
 
-	case SWRAP_ACCEPT_ACK:
-		if (si->type != SOCK_STREAM) {
-			return NULL;
-		}
+	swrap_oneway_close(si);
+	swrap_rcvq_close(si);
+	swrap_bind_remove(si);
+	swrap_delay_release(si);
+	swrap_ring_release(si);
+	swrap_tstamp_release(si);
 
-		dest_addr = &si->myname.sa.s;
-		src_addr = addr;
+	si->next_free = first_free;
+	first_free = si_index;
+}
 
-		tcp_seqno = si->io.pck_rcv;
-		tcp_ack = si->io.pck_snd;
-		tcp_ctl = 0x10; /* ACK */
+static int sockaddr_convert_to_un(struct socket_info *si,
+				  const struct sockaddr *in_addr,
+				  socklen_t in_len,
+				  struct sockaddr_un *out_addr,
+				  int alloc_sock,
+				  int *bcast)
+{
+	struct sockaddr *out = (struct sockaddr *)(void *)out_addr;
 
-		break;
+	(void) in_len; /* unused */
 
-	case SWRAP_SEND:
-		src_addr  = &si->myname.sa.s;
-		dest_addr = &si->peername.sa.s;
+	if (out_addr == NULL) {
+		return 0;
+	}
 
-		tcp_seqno = si->io.pck_snd;
-		tcp_ack = si->io.pck_rcv;
-		tcp_ctl = 0x18; /* PSH,ACK */
+	out->sa_family = AF_UNIX;
+#ifdef HAVE_STRUCT_SOCKADDR_SA_LEN
+	out->sa_len = sizeof(*out_addr);
+#endif
+
+	switch (in_addr->sa_family) {
+	case AF_UNSPEC: {
+		const struct sockaddr_in *sin;
+		if (si->family != AF_INET) {
+			break;
+		}
+		if (in_len < sizeof(struct sockaddr_in)) {
+			break;
+		}
+		sin = (const struct sockaddr_in *)(const void *)in_addr;
+		if(sin->sin_addr.s_addr != htonl(INADDR_ANY)) {
+			break;
+		}
+
+		/*
+		 * Note: in the special case of AF_UNSPEC and INADDR_ANY,
+		 * AF_UNSPEC is mapped to AF_INET and must be treated here.
+		 */
+
+		/* FALL THROUGH */
+	}
+	case AF_INET:
+#ifdef HAVE_IPV6
+	case AF_INET6:
+#endif
+		switch (si->type) {
+		case SOCK_STREAM:
+		case SOCK_DGRAM:
+			break;
+		default:
+			SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown socket type!\n");
+			errno = ESOCKTNOSUPPORT;
+			return -1;
+		}
+		if (alloc_sock) {
+			return convert_in_un_alloc(si, in_addr, out_addr, bcast);
+		} else {
+			return convert_in_un_remote(si, in_addr, out_addr, bcast);
+		}
+	default:
+		break;
+	}
+
+	errno = EAFNOSUPPORT;
+	SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown address family\n");
+	return -1;
+}
+
+static int sockaddr_convert_from_un(const struct socket_info *si,
+				    const struct sockaddr_un *in_addr,
+				    socklen_t un_addrlen,
+				    int family,
+				    struct sockaddr *out_addr,
+				    socklen_t *out_addrlen)
+{
+	int ret;
+
+	if (out_addr == NULL || out_addrlen == NULL)
+		return 0;
+
+	if (un_addrlen == 0) {
+		*out_addrlen = 0;
+		return 0;
+	}
+
+	switch (family) {
+	case AF_INET:
+#ifdef HAVE_IPV6
+	case AF_INET6:
+#endif
+		switch (si->type) {
+		case SOCK_STREAM:
+		case SOCK_DGRAM:
+			break;
+		default:
+			SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown socket type!\n");
+			errno = ESOCKTNOSUPPORT;
+			return -1;
+		}
+		ret = convert_un_in(in_addr, out_addr, out_addrlen);
+#ifdef HAVE_STRUCT_SOCKADDR_SA_LEN
+		out_addr->sa_len = *out_addrlen;
+#endif
+		return ret;
+	default:
+		break;
+	}
+
+	SWRAP_LOG(SWRAP_LOG_ERROR, "Unknown address family\n");
+	errno = EAFNOSUPPORT;
+	return -1;
+}
+
+enum swrap_packet_type {
+	SWRAP_CONNECT_SEND,
+	SWRAP_CONNECT_UNREACH,
+	SWRAP_CONNECT_RECV,
+	SWRAP_CONNECT_ACK,
+	SWRAP_ACCEPT_SEND,
+	SWRAP_ACCEPT_RECV,
+	SWRAP_ACCEPT_ACK,
+	SWRAP_RECVFROM,
+	SWRAP_SENDTO,
+	SWRAP_SENDTO_UNREACH,
+	SWRAP_SENDTO_DROP,
+	SWRAP_PENDING_RST,
+	SWRAP_RECV,
+	SWRAP_RECV_RST,
+	SWRAP_SEND,
+	SWRAP_SEND_RST,
+	SWRAP_CLOSE_SEND,
+	SWRAP_CLOSE_RECV,
+	SWRAP_CLOSE_ACK,
+};
+
+struct swrap_file_hdr {
+	uint32_t	magic;
+	uint16_t	version_major;
+	uint16_t	version_minor;
+	int32_t		timezone;
+	uint32_t	sigfigs;
+	uint32_t	frame_max_len;
+#define SWRAP_FRAME_LENGTH_MAX 0xFFFF
+	uint32_t	link_type;
+};
+#define SWRAP_FILE_HDR_SIZE 24
+
+struct swrap_packet_frame {
+	uint32_t seconds;
+	uint32_t micro_seconds;
+	uint32_t recorded_length;
+	uint32_t full_length;
+};
+#define SWRAP_PACKET_FRAME_SIZE 16
+
+union swrap_packet_ip {
+	struct {
+		uint8_t		ver_hdrlen;
+		uint8_t		tos;
+		uint16_t	packet_length;
+		uint16_t	identification;
+		uint8_t		flags;
+		uint8_t		fragment;
+		uint8_t		ttl;
+		uint8_t		protocol;
+		uint16_t	hdr_checksum;
+		uint32_t	src_addr;
+		uint32_t	dest_addr;
+	} v4;
+#define SWRAP_PACKET_IP_V4_SIZE 20
+	struct {
+		uint8_t		ver_prio;
+		uint8_t		flow_label_high;
+		uint16_t	flow_label_low;
+		uint16_t	payload_length;
+		uint8_t		next_header;
+		uint8_t		hop_limit;
+		uint8_t		src_addr[16];
+		uint8_t		dest_addr[16];
+	} v6;
+#define SWRAP_PACKET_IP_V6_SIZE 40
+};
+#define SWRAP_PACKET_IP_SIZE 40
+
+union swrap_packet_payload {
+	struct {
+		uint16_t	source_port;
+		uint16_t	dest_port;
+		uint32_t	seq_num;
+		uint32_t	ack_num;
+		uint8_t		hdr_length;
+		uint8_t		control;
+		uint16_t	window;
+		uint16_t	checksum;
+		uint16_t	urg;
+	} tcp;
+#define SWRAP_PACKET_PAYLOAD_TCP_SIZE 20
+	struct {
+		uint16_t	source_port;
+		uint16_t	dest_port;
+		uint16_t	length;
+		uint16_t	checksum;
+	} udp;
+#define SWRAP_PACKET_PAYLOAD_UDP_SIZE 8
+	struct {
+		uint8_t		type;
+		uint8_t		code;
+		uint16_t	checksum;
+		uint32_t	unused;
+	} icmp4;
+#define SWRAP_PACKET_PAYLOAD_ICMP4_SIZE 8
+	struct {
+		uint8_t		type;
+		uint8_t		code;
+		uint16_t	checksum;
+		uint32_t	unused;
+	} icmp6;
+#define SWRAP_PACKET_PAYLOAD_ICMP6_SIZE 8
+};
+#define SWRAP_PACKET_PAYLOAD_SIZE 20
+
+#define SWRAP_PACKET_MIN_ALLOC \
+	(SWRAP_PACKET_FRAME_SIZE + \
+	 SWRAP_PACKET_IP_SIZE + \
+	 SWRAP_PACKET_PAYLOAD_SIZE)
+
+static const char *swrap_pcap_init_file(void)
+{
+	static int initialized = 0;
+	static const char *s = NULL;
+	static const struct swrap_file_hdr h;
+	static const struct swrap_packet_frame f;
+	static const union swrap_packet_ip i;
+	static const union swrap_packet_payload p;
+
+	if (initialized == 1) {
+		return s;
+	}
+	initialized = 1;
+
+	/*
+	 * TODO: don't use the structs use plain buffer offsets
+	 *       and PUSH_U8(), PUSH_U16() and PUSH_U32()
+	 *
+	 * for now make sure we disable PCAP support
+	 * if the struct has alignment!
+	 */
+	if (sizeof(h) != SWRAP_FILE_HDR_SIZE) {
+		return NULL;
+	}
+	if (sizeof(f) != SWRAP_PACKET_FRAME_SIZE) {
+		return NULL;
+	}
+	if (sizeof(i) != SWRAP_PACKET_IP_SIZE) {
+		return NULL;
+	}
+	if (sizeof(i.v4) != SWRAP_PACKET_IP_V4_SIZE) {
+		return NULL;
+	}
+	if (sizeof(i.v6) != SWRAP_PACKET_IP_V6_SIZE) {
+		return NULL;
+	}
+	if (sizeof(p) != SWRAP_PACKET_PAYLOAD_SIZE) {
+		return NULL;
+	}
+	if (sizeof(p.tcp) != SWRAP_PACKET_PAYLOAD_TCP_SIZE) {
+		return NULL;
+	}
+	if (sizeof(p.udp) != SWRAP_PACKET_PAYLOAD_UDP_SIZE) {
+		return NULL;
+	}
+	if (sizeof(p.icmp4) != SWRAP_PACKET_PAYLOAD_ICMP4_SIZE) {
+		return NULL;
+	}
+	if (sizeof(p.icmp6) != SWRAP_PACKET_PAYLOAD_ICMP6_SIZE) {
+		return NULL;
+	}
+
+	s = getenv("SOCKET_WRAPPER_PCAP_FILE");
+	if (s == NULL) {
+		return NULL;
+	}
+	if (strncmp(s, "./", 2) == 0) {
+		s += 2;
+	}
+	return s;
+}
+
+static uint8_t *swrap_pcap_packet_init(struct timeval *tval,
+				       const struct sockaddr *src,
+				       const struct sockaddr *dest,
+				       int socket_type,
+				       const uint8_t *payload,
+				       size_t payload_len,
+				       unsigned long tcp_seqno,
+				       unsigned long tcp_ack,
+				       unsigned char tcp_ctl,
+				       int unreachable,
+				       size_t *_packet_len)
+{
+	uint8_t *base;
+	uint8_t *buf;
+	struct swrap_packet_frame *frame;
+	union swrap_packet_ip *ip;
+	union swrap_packet_payload *pay;
+	size_t packet_len;
+	size_t alloc_len;
+	size_t nonwire_len = sizeof(*frame);
+	size_t wire_hdr_len = 0;
+	size_t wire_len = 0;
+	size_t ip_hdr_len = 0;
+	size_t icmp_hdr_len = 0;
+	size_t icmp_truncate_len = 0;
+	uint8_t protocol = 0, icmp_protocol = 0;
+	const struct sockaddr_in *src_in = NULL;
+	const struct sockaddr_in *dest_in = NULL;
+#ifdef HAVE_IPV6
+	const struct sockaddr_in6 *src_in6 = NULL;
+	const struct sockaddr_in6 *dest_in6 = NULL;
+#endif
+	uint16_t src_port;
+	uint16_t dest_port;
+
+	switch (src->sa_family) {
+	case AF_INET:
+		src_in = (const struct sockaddr_in *)(const void *)src;
+		dest_in = (const struct sockaddr_in *)(const void *)dest;
+		src_port = src_in->sin_port;
+		dest_port = dest_in->sin_port;
+		ip_hdr_len = sizeof(ip->v4);
+		break;
+#ifdef HAVE_IPV6
+	case AF_INET6:
+		src_in6 = (const struct sockaddr_in6 *)(const void *)src;
+		dest_in6 = (const struct sockaddr_in6 *)(const void *)dest;
+		src_port = src_in6->sin6_port;
+		dest_port = dest_in6->sin6_port;
+		ip_hdr_len = sizeof(ip->v6);
+		break;
+#endif
+	default:
+		return NULL;
+	}
+
+	switch (socket_type) {
+	case SOCK_STREAM:
+		protocol = 0x06; /* TCP */
+		wire_hdr_len = ip_hdr_len + sizeof(pay->tcp);
+		wire_len = wire_hdr_len + payload_len;
+		break;
+
+	case SOCK_DGRAM:
+		protocol = 0x11; /* UDP */
+		wire_hdr_len = ip_hdr_len + sizeof(pay->udp);
+		wire_len = wire_hdr_len + payload_len;
+		break;
+
+	default:
+		return NULL;
+	}
+
+	if (unreachable) {
+		icmp_protocol = protocol;
+		switch (src->sa_family) {
+		case AF_INET:
+			protocol = 0x01; /* ICMPv4 */
+			icmp_hdr_len = ip_hdr_len + sizeof(pay->icmp4);
+			break;
+#ifdef HAVE_IPV6
+		case AF_INET6:
+			protocol = 0x3A; /* ICMPv6 */
+			icmp_hdr_len = ip_hdr_len + sizeof(pay->icmp6);
+			break;
+#endif
+		}
+		if (wire_len > 64 ) {
+			icmp_truncate_len = wire_len - 64;
+		}
+		wire_hdr_len += icmp_hdr_len;
+		wire_len += icmp_hdr_len;
+	}
+
+	packet_len = nonwire_len + wire_len;
+	alloc_len = packet_len;
+	if (alloc_len < SWRAP_PACKET_MIN_ALLOC) {
+		alloc_len = SWRAP_PACKET_MIN_ALLOC;
+	}
+
+	base = (uint8_t *)calloc(1, alloc_len);
+	if (base == NULL) {
+		return NULL;
+	}
+
+	buf = base;
+
+	frame = (struct swrap_packet_frame *)(void *)buf;
+	frame->seconds		= tval->tv_sec;
+	frame->micro_seconds	= tval->tv_usec;
+	frame->recorded_length	= wire_len - icmp_truncate_len;
+	frame->full_length	= wire_len - icmp_truncate_len;
+	buf += SWRAP_PACKET_FRAME_SIZE;
+
+	ip = (union swrap_packet_ip *)(void *)buf;
+	switch (src->sa_family) {
+	case AF_INET:
+		ip->v4.ver_hdrlen	= 0x45; /* version 4 and 5 * 32 bit words */
+		ip->v4.tos		= 0x00;
+		ip->v4.packet_length	= htons(wire_len - icmp_truncate_len);
+		ip->v4.identification	= htons(0xFFFF);
+		ip->v4.flags		= 0x40; /* BIT 1 set - means don't fragment */
+		ip->v4.fragment		= htons(0x0000);
+		ip->v4.ttl		= 0xFF;
+		ip->v4.protocol		= protocol;
+		ip->v4.hdr_checksum	= htons(0x0000);
+		ip->v4.src_addr		= src_in->sin_addr.s_addr;
+		ip->v4.dest_addr	= dest_in->sin_addr.s_addr;
+		buf += SWRAP_PACKET_IP_V4_SIZE;
+		break;
+#ifdef HAVE_IPV6
+	case AF_INET6:
+		ip->v6.ver_prio		= 0x60; /* version 4 and 5 * 32 bit words */
+		ip->v6.flow_label_high	= 0x00;
+		ip->v6.flow_label_low	= 0x0000;
+		ip->v6.payload_length	= htons(wire_len - icmp_truncate_len); /* TODO */
+		ip->v6.next_header	= protocol;
+		memcpy(ip->v6.src_addr, src_in6->sin6_addr.s6_addr, 16);
+		memcpy(ip->v6.dest_addr, dest_in6->sin6_addr.s6_addr, 16);
+		buf += SWRAP_PACKET_IP_V6_SIZE;
+		break;
+#endif
+	}
+
+	if (unreachable) {
+		pay = (union swrap_packet_payload *)(void *)buf;
+		switch (src->sa_family) {
+		case AF_INET:
+			pay->icmp4.type		= 0x03; /* destination unreachable */
+			pay->icmp4.code		= 0x01; /* host unreachable */
+			if (unreachable == 2) {
+				pay->icmp4.code	= 0x0D; /* administratively prohibited */
+			}
+			pay->icmp4.checksum	= htons(0x0000);
+			pay->icmp4.unused	= htonl(0x00000000);
+			buf += SWRAP_PACKET_PAYLOAD_ICMP4_SIZE;
+
+			/* set the ip header in the ICMP payload */
+			ip = (union swrap_packet_ip *)(void *)buf;
+			ip->v4.ver_hdrlen	= 0x45; /* version 4 and 5 * 32 bit words */
+			ip->v4.tos		= 0x00;
+			ip->v4.packet_length	= htons(wire_len - icmp_hdr_len);
+			ip->v4.identification	= htons(0xFFFF);
+			ip->v4.flags		= 0x40; /* BIT 1 set - means don't fragment */
+			ip->v4.fragment		= htons(0x0000);
+			ip->v4.ttl		= 0xFF;
+			ip->v4.protocol		= icmp_protocol;
+			ip->v4.hdr_checksum	= htons(0x0000);
+			ip->v4.src_addr		= dest_in->sin_addr.s_addr;
+			ip->v4.dest_addr	= src_in->sin_addr.s_addr;
+			buf += SWRAP_PACKET_IP_V4_SIZE;
+
+			src_port = dest_in->sin_port;
+			dest_port = src_in->sin_port;
+			break;
+#ifdef HAVE_IPV6
+		case AF_INET6:
+			pay->icmp6.type		= 0x01; /* destination unreachable */
+			pay->icmp6.code		= 0x03; /* address unreachable */
+			if (unreachable == 2) {
+				pay->icmp6.code	= 0x01; /* administratively prohibited */
+			}
+			pay->icmp6.checksum	= htons(0x0000);
+			pay->icmp6.unused	= htonl(0x00000000);
+			buf += SWRAP_PACKET_PAYLOAD_ICMP6_SIZE;
+
+			/* set the ip header in the ICMP payload */
+			ip = (union swrap_packet_ip *)(void *)buf;
+			ip->v6.ver_prio		= 0x60; /* version 4 and 5 * 32 bit words */
+			ip->v6.flow_label_high	= 0x00;
+			ip->v6.flow_label_low	= 0x0000;
+			ip->v6.payload_length	= htons(wire_len - icmp_truncate_len); /* TODO */
+			ip->v6.next_header	= protocol;
+			memcpy(ip->v6.src_addr, dest_in6->sin6_addr.s6_addr, 16);
+			memcpy(ip->v6.dest_addr, src_in6->sin6_addr.s6_addr, 16);
+			buf += SWRAP_PACKET_IP_V6_SIZE;
+
+			src_port = dest_in6->sin6_port;
+			dest_port = src_in6->sin6_port;
+			break;
+#endif
+		}
+	}
+
+	pay = (union swrap_packet_payload *)(void *)buf;
+
+	switch (socket_type) {
+	case SOCK_STREAM:
+		pay->tcp.source_port	= src_port;
+		pay->tcp.dest_port	= dest_port;
+		pay->tcp.seq_num	= htonl(tcp_seqno);
+		pay->tcp.ack_num	= htonl(tcp_ack);
+		pay->tcp.hdr_length	= 0x50; /* 5 * 32 bit words */
+		pay->tcp.control	= tcp_ctl;
+		pay->tcp.window		= htons(0x7FFF);
+		pay->tcp.checksum	= htons(0x0000);
+		pay->tcp.urg		= htons(0x0000);
+		buf += SWRAP_PACKET_PAYLOAD_TCP_SIZE;
+
+		break;
+
+	case SOCK_DGRAM:
+		pay->udp.source_port	= src_port;
+		pay->udp.dest_port	= dest_port;
+		pay->udp.length		= htons(8 + payload_len);
+		pay->udp.checksum	= htons(0x0000);
+		buf += SWRAP_PACKET_PAYLOAD_UDP_SIZE;
+
+		break;
+	}
+
+	if (payload && payload_len > 0) {
+		memcpy(buf, payload, payload_len);
+	}
+
+	*_packet_len = packet_len - icmp_truncate_len;
+	return base;
+}
+
+/* The pcap file, kept open for the whole process */
+static int swrap_pcap_fd = -1;
+
+static int swrap_pcap_get_fd(const char *fname)
+{
+	int fd = swrap_pcap_fd;
+
+	if (fd != -1) {
+		return fd;
+	}
+
+	fd = libc_open(fname, O_WRONLY|O_CREAT|O_EXCL|O_APPEND, 0644);
+	if (fd != -1) {
+		struct swrap_file_hdr file_hdr;
+		file_hdr.magic		= 0xA1B2C3D4;
+		file_hdr.version_major	= 0x0002;	
+		file_hdr.version_minor	= 0x0004;
+		file_hdr.timezone	= 0x00000000;
+		file_hdr.sigfigs	= 0x00000000;
+		file_hdr.frame_max_len	= SWRAP_FRAME_LENGTH_MAX;
+		file_hdr.link_type	= 0x0065; /* 101 RAW IP */
+
+		if (write(fd, &file_hdr, sizeof(file_hdr)) != sizeof(file_hdr)) {
+			close(fd);
+			fd = -1;
+		}
+		__atomic_store_n(&swrap_pcap_fd, fd, __ATOMIC_RELEASE);
+		return fd;
+	}
+
+	fd = libc_open(fname, O_WRONLY|O_APPEND, 0644);
+	__atomic_store_n(&swrap_pcap_fd, fd, __ATOMIC_RELEASE);
+
+	return fd;
+}
+
+static uint8_t *swrap_pcap_marshall_packet(struct socket_info *si,
+					   const struct sockaddr *addr,
+					   enum swrap_packet_type type,
+					   const void *buf, size_t len,
+					   size_t *packet_len)
+{
+	const struct sockaddr *src_addr;
+	const struct sockaddr *dest_addr;
+	unsigned long tcp_seqno = 0;
+	unsigned long tcp_ack = 0;
+	unsigned char tcp_ctl = 0;
+	int unreachable = 0;
+
+	struct timeval tv;
+
+	switch (si->family) {
+	case AF_INET:
+		break;
+#ifdef HAVE_IPV6
+	case AF_INET6:
+		break;
+#endif
+	default:
+		return NULL;
+	}
+
+	switch (type) {
+	case SWRAP_CONNECT_SEND:
+		if (si->type != SOCK_STREAM) {
+			return NULL;
+		}
+
+		src_addr  = &si->myname.sa.s;
+		dest_addr = addr;
+
+		tcp_seqno = si->io.pck_snd;
+		tcp_ack = si->io.pck_rcv;
+		tcp_ctl = 0x02; /* SYN */
+
+		si->io.pck_snd += 1;
+
+		break;
+
+	case SWRAP_CONNECT_RECV:
+		if (si->type != SOCK_STREAM) {
+			return NULL;
+		}
+
+		dest_addr = &si->myname.sa.s;
+		src_addr = addr;
+
+		tcp_seqno = si->io.pck_rcv;
+		tcp_ack = si->io.pck_snd;
+		tcp_ctl = 0x12; /** SYN,ACK */
+
+		si->io.pck_rcv += 1;
+
+		break;
+
+	case SWRAP_CONNECT_UNREACH:
+		if (si->type != SOCK_STREAM) {
+			return NULL;
+		}
+
+		dest_addr = &si->myname.sa.s;
+		src_addr  = addr;
+
+		/* Unreachable: resend the data of SWRAP_CONNECT_SEND */
+		tcp_seqno = si->io.pck_snd - 1;
+		tcp_ack = si->io.pck_rcv;
+		tcp_ctl = 0x02; /* SYN */
+		unreachable = 1;
+
+		break;
+
+	case SWRAP_CONNECT_ACK:
+		if (si->type != SOCK_STREAM) {
+			return NULL;
+		}
+
+		src_addr  = &si->myname.sa.s;
+		dest_addr = addr;
+
+		tcp_seqno = si->io.pck_snd;
+		tcp_ack = si->io.pck_rcv;
+		tcp_ctl = 0x10; /* ACK */
+
+		break;
+
+	case SWRAP_ACCEPT_SEND:
+		if (si->type != SOCK_STREAM) {
+			return NULL;
+		}
+
+		dest_addr = &si->myname.sa.s;
+		src_addr = addr;
+
+		tcp_seqno = si->io.pck_rcv;
+		tcp_ack = si->io.pck_snd;
+		tcp_ctl = 0x02; /* SYN */
+
+		si->io.pck_rcv += 1;
+
+		break;
+
+	case SWRAP_ACCEPT_RECV:
+		if (si->type != SOCK_STREAM) {
+			return NULL;
+		}
+
+		src_addr = &si->myname.sa.s;
+		dest_addr = addr;
+
+		tcp_seqno = si->io.pck_snd;
+		tcp_ack = si->io.pck_rcv;
+		tcp_ctl = 0x12; /* SYN,ACK */
+
+		si->io.pck_snd += 1;
+
+		break;
+
+	case SWRAP_ACCEPT_ACK:
+		if (si->type != SOCK_STREAM) {
+			return NULL;
+		}
+
+		dest_addr = &si->myname.sa.s;
+		src_addr = addr;
+
+		tcp_seqno = si->io.pck_rcv;
+		tcp_ack = si->io.pck_snd;
+		tcp_ctl = 0x10; /* ACK */
+
+		break;
+
+	case SWRAP_SEND:
+		src_addr  = &si->myname.sa.s;
+		dest_addr = &si->peername.sa.s;
+
+		tcp_seqno = si->io.pck_snd;
+		tcp_ack = si->io.pck_rcv;
+		tcp_ctl = 0x18; /* PSH,ACK */
+
+		si->io.pck_snd += len;
+
+		break;
+
+	case SWRAP_SEND_RST:
+		dest_addr = &si->myname.sa.s;
+		src_addr  = &si->peername.sa.s;
+
+		if (si->type == SOCK_DGRAM) {
+			return swrap_pcap_marshall_packet(si,
+							  &si->peername.sa.s,
+							  SWRAP_SENDTO_UNREACH,
+							  buf,
+							  len,
+							  packet_len);
+		}
+
+		tcp_seqno = si->io.pck_rcv;
+		tcp_ack = si->io.pck_snd;
+		tcp_ctl = 0x14; /** RST,ACK */
+
+		break;
+
+	case SWRAP_PENDING_RST:
+		dest_addr = &si->myname.sa.s;
+		src_addr  = &si->peername.sa.s;
+
+		if (si->type == SOCK_DGRAM) {
+			return NULL;
+		}
+
+		tcp_seqno = si->io.pck_rcv;
+		tcp_ack = si->io.pck_snd;
+		tcp_ctl = 0x14; /* RST,ACK */
+
+		break;
+
+	case SWRAP_RECV:
+		dest_addr = &si->myname.sa.s;
+		src_addr  = &si->peername.sa.s;
+
+		tcp_seqno = si->io.pck_rcv;
+		tcp_ack = si->io.pck_snd;
+		tcp_ctl = 0x18; /* PSH,ACK */
+
+		si->io.pck_rcv += len;
+
+		break;
+
+	case SWRAP_RECV_RST:
+		dest_addr = &si->myname.sa.s;
+		src_addr  = &si->peername.sa.s;
+
+		if (si->type == SOCK_DGRAM) {
+			return NULL;
+		}
+
+		tcp_seqno = si->io.pck_rcv;
+		tcp_ack = si->io.pck_snd;
+		tcp_ctl = 0x14; /* RST,ACK */
+
+		break;
+
+	case SWRAP_SENDTO:
+		src_addr = &si->myname.sa.s;
+		dest_addr = addr;
+
+		si->io.pck_snd += len;
+
+		break;
+
+	case SWRAP_SENDTO_UNREACH:
+		dest_addr = &si->myname.sa.s;
+		src_addr = addr;
+
+		unreachable = 1;
+
+		break;
+
+	case SWRAP_SENDTO_DROP:
+		dest_addr = &si->myname.sa.s;
+		src_addr = addr;
+
+		/* Dropped by the link emulation */
+		unreachable = 2;
+
+		break;
+
+	case SWRAP_RECVFROM:
+		dest_addr = &si->myname.sa.s;
+		src_addr = addr;
+
+		si->io.pck_rcv += len;
+
+		break;
+
+	case SWRAP_CLOSE_SEND:
+		if (si->type != SOCK_STREAM) {
+			return NULL;
+		}
+
+		src_addr  = &si->myname.sa.s;
+		dest_addr = &si->peername.sa.s;
+
+		tcp_seqno = si->io.pck_snd;
+		tcp_ack = si->io.pck_rcv;
+		tcp_ctl = 0x11; /* FIN, ACK */
+
+		si->io.pck_snd += 1;
+
+		break;
+
+	case SWRAP_CLOSE_RECV:
+		if (si->type != SOCK_STREAM) {
+			return NULL;
+		}
+
+		dest_addr = &si->myname.sa.s;
+		src_addr  = &si->peername.sa.s;
+
+		tcp_seqno = si->io.pck_rcv;
+		tcp_ack = si->io.pck_snd;
+		tcp_ctl = 0x11; /* FIN,ACK */
+
+		si->io.pck_rcv += 1;
+
+		break;
+
+	case SWRAP_CLOSE_ACK:
+		if (si->type != SOCK_STREAM) {
+			return NULL;
+		}
+
+		src_addr  = &si->myname.sa.s;
+		dest_addr = &si->peername.sa.s;
+
+		tcp_seqno = si->io.pck_snd;
+		tcp_ack = si->io.pck_rcv;
+		tcp_ctl = 0x10; /* ACK */
+
+		break;
+	default:
+		return NULL;
+	}
+
+	swrapGetTimeOfDay(&tv);
+
+	return swrap_pcap_packet_init(&tv,
+				      src_addr,
+				      dest_addr,
+				      si->type,
+				      (const uint8_t *)buf,
+				      len,
+				      tcp_seqno,
+				      tcp_ack,
+				      tcp_ctl,
+				      unreachable,
+				      packet_len);
+}
+
+static void swrap_pcap_dump_packet(struct socket_info *si,
+				   const struct sockaddr *addr,
+				   enum swrap_packet_type type,
+				   const void *buf, size_t len)
+{
+	const char *file_name;
+	uint8_t *packet;
+	size_t packet_len = 0;
+	int fd;
+
+	file_name = swrap_pcap_init_file();
+	if (!file_name) {
+		return;
+	}
+
+	packet = swrap_pcap_marshall_packet(si,
+					    addr,
+					    type,
+					    buf,
+					    len,
+					    &packet_len);
+	if (packet == NULL) {
+		return;
+	}
+
+	fd = swrap_pcap_get_fd(file_name);
+	if (fd != -1) {
+		if (write(fd, packet, packet_len) != (ssize_t)packet_len) {
+			free(packet);
+			return;
+		}
+	}
+
+	free(packet);
+}
+
+/****************************************************************************
+ *   LINK EMULATION
+ ***************************************************************************/
+
+/*
+ * The unix sockets deliver everything within microseconds. To make the
+ * timeout and retry logic of applications see some real network behaviour,
+ * properties can be configured for the links between two addresses.
+ *
+ * A rule has the form SRC-DST=VALUE. SRC and DST are an IPv4 or IPv6
+ * address, an interface id (matching 127.0.0.X and fd00::5357:5fXX) or '*'
+ * for any address. If more than one rule matches a packet, the most
+ * specific one wins, a matching source counts more than a matching
+ * destination.
+ *
+ * The rules can also come from a topology file naming the hosts and
+ * subnets, see swrap_topo_load().
+ */
+
+enum swrap_link_ep_type {
+	SWRAP_LINK_EP_ANY = 0,
+	SWRAP_LINK_EP_IFACE,
+	SWRAP_LINK_EP_ADDR,
+	SWRAP_LINK_EP_SUBNET, /* iface holds the id of the subnet */
+};
+
+struct swrap_link_ep {
+	enum swrap_link_ep_type type;
+	int family;
+	unsigned int iface;
+	uint8_t addr[16];
+};
+
+/* The properties a link rule configures */
+#define SWRAP_LINK_LATENCY	0x0001
+#define SWRAP_LINK_BANDWIDTH	0x0002
+#define SWRAP_LINK_LOSS		0x0004
+#define SWRAP_LINK_DUPLICATE	0x0008
+#define SWRAP_LINK_REORDER	0x0010
+#define SWRAP_LINK_FAULT	0x0020
+#define SWRAP_LINK_ACL		0x0040
+
+#define SWRAP_LINK_NUM 7
+
+/* The properties which only apply to datagrams */
+#define SWRAP_LINK_IMPAIR \
+	(SWRAP_LINK_LOSS | SWRAP_LINK_DUPLICATE | SWRAP_LINK_REORDER)
+
+/* What happened to the last datagram sent, for the pcap file */
+#define SWRAP_IMPAIR_DROPPED	0x0001
+#define SWRAP_IMPAIR_DUPLICATED	0x0002
+
+enum swrap_delay_dist {
+	SWRAP_DELAY_DIST_UNIFORM = 0,
+	SWRAP_DELAY_DIST_NORMAL,
+};
+
+struct swrap_link {
+	struct swrap_link_ep src;
+	struct swrap_link_ep dst;
+	unsigned int flags;
+
+	struct {
+		uint64_t delay_usec;
+		uint64_t jitter_usec;
+		enum swrap_delay_dist dist;
+	} latency;
+
+	struct {
+		uint64_t rate; /* bytes per second */
+		uint64_t burst;
+		bool per_flow;
+	} bandwidth;
+
+	/*
+	 * Gilbert-Elliott: p and r are the probabilities to change from the
+	 * good to the bad state and back, bad and good the loss probability
+	 * in the state. Bernoulli loss is a good state never left.
+	 */
+	struct {
+		double p;
+		double r;
+		double bad;
+		double good;
+	} loss;
+
+	double duplicate;
+
+	struct {
+		double p;
+		uint64_t delay_usec;
+	} reorder;
+
+	struct {
+		double short_p;
+		double stall_p;
+		uint64_t stall_usec;
+		uint64_t reset_bytes;
+		double eagain_p;
+		unsigned int eagain_count;
+	} fault;
+
+	/* For SWRAP_LINK_ACL, if the destination can be reached */
+	bool allow;
+};
+
+typedef bool (*swrap_link_parse_fn)(const char *value, struct swrap_link *l);
+
+/*
+ * With a rule per pair of hosts there are thousands of rules, so the rules
+ * between interfaces are looked up in a hash table. Only rules with an
+ * address outside of the wrapped networks are matched one by one.
+ */
+struct swrap_link_slot {
+	uint64_t src;
+	uint64_t dst;
+	unsigned int flag;
+	size_t rule; /* index into rules + 1, 0 for an empty slot */
+};
+
+struct swrap_link_table {
+	size_t count;
+	const struct swrap_link *rules;
+
+	size_t index_size;
+	const struct swrap_link_slot *index;
+	size_t num_unindexed;
+	const size_t *unindexed;
+};
+
+static struct {
+	pthread_once_t once;
+	unsigned int flags;
+	uint64_t seed;
+
+	/* The rules of the environment win over the ones of the topology */
+	struct swrap_link_table env;
+	struct swrap_link_table topo;
+} swrap_links = {
+	.once = PTHREAD_ONCE_INIT,
+};
+
+/*
+ * The rules which apply between two addresses, indexed by the bit of the
+ * property. The last lookups of a thread are cached, so a send only needs
+ * a single hash lookup once the link is known.
+ */
+#define SWRAP_LINK_POLICY_CACHE 64
+
+struct swrap_link_policy {
+	uint64_t src;
+	uint64_t dst;
+	const struct swrap_link *rule[SWRAP_LINK_NUM];
+};
+
+static SWRAP_THREAD struct swrap_link_policy
+	swrap_link_policies[SWRAP_LINK_POLICY_CACHE + 1];
+
+/*
+ * A compiled topology file. It only holds offsets, no pointers, so it is
+ * written to the socket directory once and mapped read-only by all the
+ * processes using the same file. The header is followed by the names
+ * sorted for a binary search, the hash of the subnet members, the rules,
+ * and their index.
+ */
+#define SWRAP_TOPO_MAGIC "SWTOPO\0\0"
+#define SWRAP_TOPO_VERSION 2
+#define SWRAP_TOPO_NAME_MAX 32
+
+struct swrap_topo_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t link_size;
+
+	/* The file the image was compiled from */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_sec;
+	uint64_t mtime_nsec;
+	uint64_t ctime_sec;
+	uint64_t ctime_nsec;
+
+	uint64_t image_size;
+	uint64_t flags;
+	uint64_t num_names;
+	uint64_t members_size;
+	uint64_t count;
+	uint64_t index_size;
+	uint64_t num_unindexed;
+};
+
+struct swrap_topo_name {
+	char name[SWRAP_TOPO_NAME_MAX];
+	uint32_t type; /* SWRAP_LINK_EP_IFACE or SWRAP_LINK_EP_SUBNET */
+	uint32_t id;
+};
+
+struct swrap_topo_member {
+	uint32_t iface; /* 0 for an empty slot */
+	uint32_t subnet;
+};
+
+static struct {
+	const struct swrap_topo_header *hdr;
+	bool mapped;
+
+	const struct swrap_topo_name *names;
+	size_t num_names;
+	const struct swrap_topo_member *members;
+	size_t members_size;
+} swrap_topo;
+
+/*
+ * The tick of the timer wheel holding the delayed packets. Delays are
+ * rounded up to a full tick, packets further away than one round of the
+ * wheel just stay in their slot for another round.
+ */
+#define SWRAP_DELAY_TICK_USEC 250
+#define SWRAP_DELAY_WHEEL_SLOTS 4096
+
+/* The amount of data a socket can have in flight before a send blocks */
+#define SWRAP_DELAY_QUEUE_MAX (256 * 1024)
+
+/*
+ * When exiting we wait for the queued packets until the last one is due,
+ * and at most this much longer for a receiver which isn't reading.
+ */
+#define SWRAP_DELAY_DRAIN_USEC (100 * 1000)
+
+/* The number of chains in the hash of the shared token buckets */
+#define SWRAP_BUCKET_HASH_SIZE 64
+
+/*
+ * A token bucket, implemented as virtual scheduling clock (GCRA): tat is
+ * the time at which the bucket would be full again. A packet may leave when
+ * tat is at most one burst ahead of the current time.
+ */
+struct swrap_bucket {
+	struct swrap_bucket *next;
+
+	/* The rule and the address pair, for shared buckets only */
+	const struct swrap_link *rule;
+	uint8_t key[33];
+
+	uint64_t rate;
+	uint64_t burst;
+	uint64_t tat_nsec;
+};
+
+/*
+ * The delayed packets of a socket. They are delivered using a duplicate of
+ * the file descriptor, so the application is free to close the socket with
+ * packets still in flight, like with a real network stack.
+ */
+struct swrap_delay_chan {
+	struct swrap_delay_chan *prev, *next;
+
+	int fd;
+	int type;
+	bool closed;
+	int error;
+
+	size_t queued;
+	size_t npkts;
+
+	/* Stream segments need to be delivered in order */
+	uint64_t last_tick;
+	uint64_t next_seq;
+	uint64_t deliver_seq;
+	size_t batch_count;
+	bool batch_stalled;
+
+	/* For bandwidth rules applied per flow */
+	struct swrap_bucket bucket;
+};
+
+enum swrap_delay_state {
+	SWRAP_DELAY_DONE = 0,
+	SWRAP_DELAY_DROPPED,
+	SWRAP_DELAY_STALLED,
+	SWRAP_DELAY_DEFERRED,
+	SWRAP_DELAY_FAILED,
+};
+
+struct swrap_delay_pkt {
+	struct swrap_delay_pkt *next;
+	struct swrap_delay_chan *chan;
+
+	uint64_t tick;
+	uint64_t seq;
+	enum swrap_delay_state state;
+	int error;
+	int flags;
+
+	struct swrap_address to;
+	struct swrap_rcvq *rcvq;
+
+	size_t ofs;
+	size_t len;
+	uint8_t buf[];
+};
+
+static struct {
+	bool running;
+	bool stopping;
+	pthread_t thread;
+	pthread_cond_t wakeup;
+	pthread_cond_t space;
+
+	/* The next tick the delivery thread looks at */
+	uint64_t tick;
+	/* The tick the last queued packet is due */
+	uint64_t last_tick;
+	size_t npkts;
+
+	struct swrap_delay_chan *chans;
+	struct swrap_bucket *buckets[SWRAP_BUCKET_HASH_SIZE];
+
+	struct {
+		struct swrap_delay_pkt *head;
+		struct swrap_delay_pkt *tail;
+	} wheel[SWRAP_DELAY_WHEEL_SLOTS];
+} swrap_delay;
+
+static uint64_t swrap_monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void swrap_usec_to_timespec(uint64_t usec, struct timespec *ts)
+{
+	ts->tv_sec = usec / 1000000;
+	ts->tv_nsec = (usec % 1000000) * 1000;
+}
+
+static unsigned int swrap_sockaddr_iface(const struct sockaddr *sa)
+{
+	switch (sa->sa_family) {
+	case AF_INET: {
+		const struct sockaddr_in *sin =
+			(const struct sockaddr_in *)(const void *)sa;
+		uint32_t addr = ntohl(sin->sin_addr.s_addr);
+
+		if ((addr >> 24) == 127) {
+			return addr & 0xFFFFFF;
+		}
+		break;
+	}
+#ifdef HAVE_IPV6
+	case AF_INET6: {
+		const struct sockaddr_in6 *sin6 =
+			(const struct sockaddr_in6 *)(const void *)sa;
+
+		return swrap_ipv6_iface(&sin6->sin6_addr);
+	}
+#endif
+	}
+
+	return 0;
+}
+
+static int swrap_topo_name_cmp(const void *key, const void *elem)
+{
+	const struct swrap_topo_name *n = (const struct swrap_topo_name *)elem;
+
+	return strcmp((const char *)key, n->name);
+}
+
+static const struct swrap_topo_name *swrap_topo_name_find(const char *name)
+{
+	if (swrap_topo.num_names == 0) {
+		return NULL;
+	}
+
+	return (const struct swrap_topo_name *)bsearch(name,
+						       swrap_topo.names,
+						       swrap_topo.num_names,
+						       sizeof(struct swrap_topo_name),
+						       swrap_topo_name_cmp);
+}
+
+static uint32_t swrap_topo_member_hash(uint32_t iface, size_t size)
+{
+	return (iface * 0x9E3779B1U) & (size - 1);
+}
+
+/* The subnet an interface belongs to, 0 if none */
+static unsigned int swrap_topo_subnet(unsigned int iface)
+{
+	size_t i;
+
+	if (swrap_topo.members_size == 0 || iface == 0) {
+		return 0;
+	}
+
+	for (i = swrap_topo_member_hash(iface, swrap_topo.members_size);
+	     swrap_topo.members[i].iface != 0;
+	     i = (i + 1) & (swrap_topo.members_size - 1)) {
+		if (swrap_topo.members[i].iface == iface) {
+			return swrap_topo.members[i].subnet;
+		}
+	}
+
+	return 0;
+}
+
+static bool swrap_link_parse_ep(const char *str,
+				size_t len,
+				struct swrap_link_ep *ep)
+{
+	const struct swrap_topo_name *name;
+	char buf[64];
+	char *end = NULL;
+	unsigned long iface;
+
+	ZERO_STRUCTP(ep);
+
+	if (len == 0 || len >= sizeof(buf)) {
+		return false;
+	}
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+
+	if (strcmp(buf, "*") == 0) {
+		ep->type = SWRAP_LINK_EP_ANY;
+		return true;
+	}
+
+	if (inet_pton(AF_INET, buf, ep->addr) == 1) {
+		ep->type = SWRAP_LINK_EP_ADDR;
+		ep->family = AF_INET;
+		return true;
+	}
+#ifdef HAVE_IPV6
+	if (inet_pton(AF_INET6, buf, ep->addr) == 1) {
+		ep->type = SWRAP_LINK_EP_ADDR;
+		ep->family = AF_INET6;
+		return true;
+	}
+#endif
+
+	iface = strtoul(buf, &end, 10);
+	if (end != buf && *end == '\0' && iface >= 1 && iface <= SWRAP_IFACE_MAX) {
+		ep->type = SWRAP_LINK_EP_IFACE;
+		ep->iface = iface;
+		return true;
+	}
+
+	/* A host or subnet of the topology file */
+	name = swrap_topo_name_find(buf);
+	if (name != NULL) {
+		ep->type = (enum swrap_link_ep_type)name->type;
+		ep->iface = name->id;
+		return true;
+	}
+
+	return false;
+}
+
+static bool swrap_link_ep_match(const struct swrap_link_ep *ep,
+				const struct sockaddr *sa)
+{
+	switch (ep->type) {
+	case SWRAP_LINK_EP_ANY:
+		return true;
+	case SWRAP_LINK_EP_IFACE:
+		return swrap_sockaddr_iface(sa) == ep->iface;
+	case SWRAP_LINK_EP_SUBNET:
+		return swrap_topo_subnet(swrap_sockaddr_iface(sa)) == ep->iface;
+	case SWRAP_LINK_EP_ADDR:
+		if (sa->sa_family != ep->family) {
+			return false;
+		}
+		switch (sa->sa_family) {
+		case AF_INET: {
+			const struct sockaddr_in *sin =
+				(const struct sockaddr_in *)(const void *)sa;
+
+			return memcmp(&sin->sin_addr, ep->addr, 4) == 0;
+		}
+#ifdef HAVE_IPV6
+		case AF_INET6: {
+			const struct sockaddr_in6 *sin6 =
+				(const struct sockaddr_in6 *)(const void *)sa;
+
+			return memcmp(&sin6->sin6_addr, ep->addr, 16) == 0;
+		}
+#endif
+		}
+		break;
+	}
+
+	return false;
+}
+
+/*
+ * Parse a time value like '20ms', '500us' or '1.5s'. Without a unit the
+ * value is taken as milliseconds.
+ */
+static bool swrap_link_parse_usec(const char *str,
+				  const char **endp,
+				  uint64_t *usec)
+{
+	char *end = NULL;
+	double v;
+
+	v = strtod(str, &end);
+	if (end == str || v < 0) {
+		return false;
+	}
+
+	if (strncmp(end, "us", 2) == 0) {
+		end += 2;
+	} else if (strncmp(end, "ms", 2) == 0) {
+		v *= 1000;
+		end += 2;
+	} else if (end[0] == 's') {
+		v *= 1000000;
+		end += 1;
+	} else {
+		v *= 1000;
+	}
+
+	*usec = (uint64_t)v;
+	*endp = end;
+
+	return true;
+}
+
+/* DELAY[~JITTER][/uniform|/normal] */
+static bool swrap_link_parse_latency(const char *value, struct swrap_link *l)
+{
+	const char *p = value;
+
+	if (!swrap_link_parse_usec(p, &p, &l->latency.delay_usec)) {
+		return false;
+	}
+
+	if (p[0] == '~') {
+		if (!swrap_link_parse_usec(p + 1,
+					   &p,
+					   &l->latency.jitter_usec)) {
+			return false;
+		}
+	}
+
+	if (p[0] == '/') {
+		p++;
+		if (strcmp(p, "uniform") == 0) {
+			l->latency.dist = SWRAP_DELAY_DIST_UNIFORM;
+		} else if (strcmp(p, "normal") == 0) {
+			l->latency.dist = SWRAP_DELAY_DIST_NORMAL;
+		} else {
+			return false;
+		}
+		return true;
+	}
+
+	return p[0] == '\0';
+}
+
+/*
+ * RATE[@BURST][/flow]. The rate is given in bit, kbit, mbit or gbit per
+ * second, the burst in bytes with an optional k or m suffix.
+ */
+static bool swrap_link_parse_bandwidth(const char *value, struct swrap_link *l)
+{
+	char *end = NULL;
+	double v;
+
+	v = strtod(value, &end);
+	if (end == value || v <= 0) {
+		return false;
+	}
+
+	if (strncmp(end, "gbit", 4) == 0) {
+		v *= 1000 * 1000 * 1000;
+		end += 4;
+	} else if (strncmp(end, "mbit", 4) == 0) {
+		v *= 1000 * 1000;
+		end += 4;
+	} else if (strncmp(end, "kbit", 4) == 0) {
+		v *= 1000;
+		end += 4;
+	} else if (strncmp(end, "bit", 3) == 0) {
+		end += 3;
+	}
+
+	l->bandwidth.rate = (uint64_t)(v / 8);
+	if (l->bandwidth.rate == 0) {
+		return false;
+	}
+
+	/* Allow 10ms worth of data in a burst by default */
+	l->bandwidth.burst = MAX(l->bandwidth.rate / 100,
+				 2 * socket_wrapper_mtu());
+
+	if (end[0] == '@') {
+		const char *p = end + 1;
+
+		v = strtod(p, &end);
+		if (end == p || v <= 0) {
+			return false;
+		}
+		if (end[0] == 'k') {
+			v *= 1024;
+			end++;
+		} else if (end[0] == 'm') {
+			v *= 1024 * 1024;
+			end++;
+		}
+		l->bandwidth.burst = (uint64_t)v;
+	}
+
+	if (strcmp(end, "/flow") == 0) {
+		l->bandwidth.per_flow = true;
+		return true;
+	}
+
+	return end[0] == '\0';
+}
+
+/* A probability in percent, the '%' is optional */
+static bool swrap_link_parse_prob(const char *str,
+				  const char **endp,
+				  double *prob)
+{
+	char *end = NULL;
+	double v;
+
+	v = strtod(str, &end);
+	if (end == str || v < 0 || v > 100) {
+		return false;
+	}
+	if (end[0] == '%') {
+		end++;
+	}
+
+	*prob = v / 100;
+	*endp = end;
+
+	return true;
+}
+
+/* P% for random loss or ge:P%:R%[:BAD%[:GOOD%]] for Gilbert-Elliott */
+static bool swrap_link_parse_loss(const char *value, struct swrap_link *l)
+{
+	const char *p = value;
+
+	if (strncmp(p, "ge:", 3) != 0) {
+		if (!swrap_link_parse_prob(p, &p, &l->loss.good)) {
+			return false;
+		}
+		return p[0] == '\0';
+	}
+
+	l->loss.bad = 1;
+
+	if (!swrap_link_parse_prob(p + 3, &p, &l->loss.p) ||
+	    p[0] != ':' ||
+	    !swrap_link_parse_prob(p + 1, &p, &l->loss.r)) {
+		return false;
+	}
+	if (p[0] == ':' && !swrap_link_parse_prob(p + 1, &p, &l->loss.bad)) {
+		return false;
+	}
+	if (p[0] == ':' && !swrap_link_parse_prob(p + 1, &p, &l->loss.good)) {
+		return false;
+	}
+
+	return p[0] == '\0';
+}
+
+/* P% */
+static bool swrap_link_parse_duplicate(const char *value, struct swrap_link *l)
+{
+	const char *p = value;
+
+	if (!swrap_link_parse_prob(p, &p, &l->duplicate)) {
+		return false;
+	}
+
+	return p[0] == '\0';
+}
+
+/* P%[@DELAY], the held back datagrams are delayed by 5ms by default */
+static bool swrap_link_parse_reorder(const char *value, struct swrap_link *l)
+{
+	const char *p = value;
+
+	if (!swrap_link_parse_prob(p, &p, &l->reorder.p)) {
+		return false;
+	}
+
+	l->reorder.delay_usec = 5000;
+	if (p[0] == '@') {
+		if (!swrap_link_parse_usec(p + 1,
+					   &p,
+					   &l->reorder.delay_usec)) {
+			return false;
+		}
+	}
+
+	return p[0] == '\0';
+}
+
+/*
+ * FAULT[/FAULT...] with FAULT being short:P%, stall:P%@TIME,
+ * reset:BYTES[k|m] or eagain:P%[xCOUNT].
+ */
+static bool swrap_link_parse_fault(const char *value, struct swrap_link *l)
+{
+	const char *p = value;
+
+	for (;;) {
+		if (strncmp(p, "short:", 6) == 0) {
+			if (!swrap_link_parse_prob(p + 6, &p, &l->fault.short_p)) {
+				return false;
+			}
+		} else if (strncmp(p, "stall:", 6) == 0) {
+			if (!swrap_link_parse_prob(p + 6, &p, &l->fault.stall_p) ||
+			    p[0] != '@' ||
+			    !swrap_link_parse_usec(p + 1,
+						   &p,
+						   &l->fault.stall_usec)) {
+				return false;
+			}
+		} else if (strncmp(p, "reset:", 6) == 0) {
+			char *end = NULL;
+			unsigned long long v;
+
+			v = strtoull(p + 6, &end, 10);
+			if (end == p + 6 || v == 0) {
+				return false;
+			}
+			if (end[0] == 'k') {
+				v *= 1024;
+				end++;
+			} else if (end[0] == 'm') {
+				v *= 1024 * 1024;
+				end++;
+			}
+			l->fault.reset_bytes = v;
+			p = end;
+		} else if (strncmp(p, "eagain:", 7) == 0) {
+			if (!swrap_link_parse_prob(p + 7, &p, &l->fault.eagain_p)) {
+				return false;
+			}
+			l->fault.eagain_count = 1;
+			if (p[0] == 'x') {
+				char *end = NULL;
+				unsigned long v;
+
+				v = strtoul(p + 1, &end, 10);
+				if (end == p + 1 || v == 0) {
+					return false;
+				}
+				l->fault.eagain_count = v;
+				p = end;
+			}
+		} else {
+			return false;
+		}
+
+		if (p[0] == '\0') {
+			return true;
+		}
+		if (p[0] != '/') {
+			return false;
+		}
+		p++;
+	}
+}
+
+/* The properties, with their variable and their key in the topology file */
+static const struct {
+	const char *env_name;
+	const char *key;
+	unsigned int flag;
+	swrap_link_parse_fn parse;
+} swrap_link_props[] = {
+	{
+		.env_name = "SOCKET_WRAPPER_LATENCY",
+		.key = "latency",
+		.flag = SWRAP_LINK_LATENCY,
+		.parse = swrap_link_parse_latency,
+	}, {
+		.env_name = "SOCKET_WRAPPER_BANDWIDTH",
+		.key = "bandwidth",
+		.flag = SWRAP_LINK_BANDWIDTH,
+		.parse = swrap_link_parse_bandwidth,
+	}, {
+		.env_name = "SOCKET_WRAPPER_LOSS",
+		.key = "loss",
+		.flag = SWRAP_LINK_LOSS,
+		.parse = swrap_link_parse_loss,
+	}, {
+		.env_name = "SOCKET_WRAPPER_DUPLICATE",
+		.key = "duplicate",
+		.flag = SWRAP_LINK_DUPLICATE,
+		.parse = swrap_link_parse_duplicate,
+	}, {
+		.env_name = "SOCKET_WRAPPER_REORDER",
+		.key = "reorder",
+		.flag = SWRAP_LINK_REORDER,
+		.parse = swrap_link_parse_reorder,
+	}, {
+		.env_name = "SOCKET_WRAPPER_FAULTS",
+		.key = "faults",
+		.flag = SWRAP_LINK_FAULT,
+		.parse = swrap_link_parse_fault,
+	},
+};
+
+#define SWRAP_LINK_NUM_PROPS \
+	(sizeof(swrap_link_props) / sizeof(swrap_link_props[0]))
+
+/* The rules while they get loaded */
+struct swrap_link_list {
+	size_t count;
+	struct swrap_link *rules;
+};
+
+static bool swrap_link_list_add(struct swrap_link_list *list,
+				const struct swrap_link *l)
+{
+	struct swrap_link *tmp;
+
+	tmp = (struct swrap_link *)realloc(list->rules,
+		(list->count + 1) * sizeof(struct swrap_link));
+	if (tmp == NULL) {
+		return false;
+	}
+	list->rules = tmp;
+	list->rules[list->count] = *l;
+	list->count++;
+
+	return true;
+}
+
+static void swrap_link_load_rules(struct swrap_link_list *list,
+				  const char *env_name,
+				  unsigned int flag,
+				  swrap_link_parse_fn parse)
+{
+	const char *env = getenv(env_name);
+	char *saveptr = NULL;
+	char *rules;
+	char *r;
+
+	if (env == NULL || env[0] == '\0') {
+		return;
+	}
+
+	rules = strdup(env);
+	if (rules == NULL) {
+		return;
+	}
+
+	for (r = strtok_r(rules, ", \t", &saveptr);
+	     r != NULL;
+	     r = strtok_r(NULL, ", \t", &saveptr)) {
+		struct swrap_link l;
+		char *eq = strchr(r, '=');
+		char *sep = strchr(r, '-');
+
+		ZERO_STRUCT(l);
+
+		if (eq == NULL || sep == NULL || sep > eq ||
+		    !swrap_link_parse_ep(r, sep - r, &l.src) ||
+		    !swrap_link_parse_ep(sep + 1, eq - sep - 1, &l.dst) ||
+		    !parse(eq + 1, &l)) {
+			SWRAP_LOG(SWRAP_LOG_ERROR,
+				  "Ignoring invalid %s rule '%s'",
+				  env_name, r);
+			continue;
+		}
+		l.flags = flag;
+
+		if (!swrap_link_list_add(list, &l)) {
+			break;
+		}
+		swrap_links.flags |= flag;
+
+		SWRAP_LOG(SWRAP_LOG_DEBUG, "%s rule '%s'", env_name, r);
+	}
+
+	free(rules);
+}
+
+#define SWRAP_LINK_KEY_IFACE	(1ULL << 32)
+#define SWRAP_LINK_KEY_ADDR4	(2ULL << 32)
+#define SWRAP_LINK_KEY_ADDR6	(3ULL << 32)
+#define SWRAP_LINK_KEY_SUBNET	(4ULL << 32)
+
+static bool swrap_link_ep_key(const struct swrap_link_ep *ep, uint64_t *key)
+{
+	switch (ep->type) {
+	case SWRAP_LINK_EP_ANY:
+		*key = 0;
+		return true;
+	case SWRAP_LINK_EP_IFACE:
+		*key = SWRAP_LINK_KEY_IFACE | ep->iface;
+		return true;
+	case SWRAP_LINK_EP_SUBNET:
+		*key = SWRAP_LINK_KEY_SUBNET | ep->iface;
+		return true;
+	case SWRAP_LINK_EP_ADDR:
+		break;
+	}
+
+	if (ep->family == AF_INET) {
+		uint32_t addr;
+
+		memcpy(&addr, ep->addr, sizeof(addr));
+		addr = ntohl(addr);
+		if ((addr >> 24) == 127 && (addr & 0xFFFFFF) != 0) {
+			*key = SWRAP_LINK_KEY_ADDR4 | (addr & 0xFFFFFF);
+			return true;
+		}
+	}
+#ifdef HAVE_IPV6
+	if (ep->family == AF_INET6) {
+		struct in6_addr addr;
+		unsigned int iface;
+
+		memcpy(&addr, ep->addr, sizeof(addr));
+		iface = swrap_ipv6_iface(&addr);
+		if (iface != 0) {
+			*key = SWRAP_LINK_KEY_ADDR6 | iface;
+			return true;
+		}
+	}
+#endif
+
+	return false;
+}
+
+/* The keys of the rules which might match an address, the most specific first */
+static size_t swrap_link_sa_keys(const struct sockaddr *sa, uint64_t keys[4])
+{
+	unsigned int iface = swrap_sockaddr_iface(sa);
+	unsigned int subnet;
+	size_t n = 0;
+
+	if (iface != 0) {
+		keys[n++] = SWRAP_LINK_KEY_IFACE | iface;
+		keys[n++] = (sa->sa_family == AF_INET ?
+			     SWRAP_LINK_KEY_ADDR4 : SWRAP_LINK_KEY_ADDR6) | iface;
+
+		subnet = swrap_topo_subnet(iface);
+		if (subnet != 0) {
+			keys[n++] = SWRAP_LINK_KEY_SUBNET | subnet;
+		}
+	}
+	keys[n++] = 0;
+
+	return n;
+}
+
+/* An address is more specific than a subnet, which beats any address */
+static int swrap_link_key_level(uint64_t key)
+{
+	if (key == 0) {
+		return 0;
+	}
+	if ((key & ~0xFFFFFFFFULL) == SWRAP_LINK_KEY_SUBNET) {
+		return 1;
+	}
+
+	return 2;
+}
+
+static int swrap_link_ep_level(const struct swrap_link_ep *ep)
+{
+	switch (ep->type) {
+	case SWRAP_LINK_EP_ANY:
+		return 0;
+	case SWRAP_LINK_EP_SUBNET:
+		return 1;
+	default:
+		break;
+	}
+
+	return 2;
+}
+
+static size_t swrap_link_slot_hash(uint64_t src, uint64_t dst,
+				   unsigned int flag, size_t size)
+{
+	uint64_t h = src * 0x9E3779B97F4A7C15ULL;
+
+	h ^= dst + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+	h ^= flag;
+	h *= 0xFF51AFD7ED558CCDULL;
+
+	return (size_t)(h ^ (h >> 32)) & (size - 1);
+}
+
+static size_t swrap_link_index_get(const struct swrap_link_table *t,
+				   uint64_t src, uint64_t dst,
+				   unsigned int flag)
+{
+	size_t i;
+
+	if (t->index_size == 0) {
+		return 0;
+	}
+
+	for (i = swrap_link_slot_hash(src, dst, flag, t->index_size);
+	     t->index[i].rule != 0;
+	     i = (i + 1) & (t->index_size - 1)) {
+		const struct swrap_link_slot *slot = &t->index[i];
+
+		if (slot->src == src && slot->dst == dst && slot->flag == flag) {
+			return slot->rule;
+		}
+	}
+
+	return 0;
+}
+
+static size_t swrap_link_index_size(size_t count)
+{
+	size_t size = 16;
+
+	while (size < count * 2) {
+		size *= 2;
+	}
+
+	return size;
+}
+
+/*
+ * Fill the zeroed index with the rules, the ones which can't be indexed are
+ * added to unindexed. Returns the number of unindexed rules.
+ */
+static size_t swrap_link_build_index(const struct swrap_link *rules,
+				     size_t count,
+				     struct swrap_link_slot *index,
+				     size_t index_size,
+				     size_t *unindexed)
+{
+	struct swrap_link_table t = {
+		.count = count,
+		.rules = rules,
+		.index_size = index_size,
+		.index = index,
+	};
+	size_t num_unindexed = 0;
+	size_t r;
+
+	for (r = 0; r < count; r++) {
+		const struct swrap_link *l = &rules[r];
+		uint64_t src, dst;
+		size_t i;
+
+		if (!swrap_link_ep_key(&l->src, &src) ||
+		    !swrap_link_ep_key(&l->dst, &dst)) {
+			unindexed[num_unindexed++] = r;
+			continue;
+		}
+
+		/* Like the linear search, the first of equal rules wins */
+		if (swrap_link_index_get(&t, src, dst, l->flags) != 0) {
+			continue;
+		}
+
+		for (i = swrap_link_slot_hash(src, dst, l->flags, index_size);
+		     index[i].rule != 0;
+		     i = (i + 1) & (index_size - 1)) {
+		}
+		index[i] = (struct swrap_link_slot) {
+			.src = src,
+			.dst = dst,
+			.flag = l->flags,
+			.rule = r + 1,
+		};
+	}
+
+	return num_unindexed;
+}
+
+static void swrap_link_load_env(void)
+{
+	struct swrap_link_list list = {
+		.count = 0,
+	};
+	struct swrap_link_slot *index;
+	size_t *unindexed;
+	size_t index_size;
+	size_t i;
+
+	for (i = 0; i < SWRAP_LINK_NUM_PROPS; i++) {
+		swrap_link_load_rules(&list,
+				      swrap_link_props[i].env_name,
+				      swrap_link_props[i].flag,
+				      swrap_link_props[i].parse);
+	}
+	if (list.count == 0) {
+		return;
+	}
+
+	index_size = swrap_link_index_size(list.count);
+	index = (struct swrap_link_slot *)calloc(index_size,
+			sizeof(struct swrap_link_slot));
+	unindexed = (size_t *)calloc(list.count, sizeof(size_t));
+	if (index == NULL || unindexed == NULL) {
+		free(index);
+		free(unindexed);
+		free(list.rules);
+		return;
+	}
+
+	swrap_links.env = (struct swrap_link_table) {
+		.count = list.count,
+		.rules = list.rules,
+		.index_size = index_size,
+		.index = index,
+		.num_unindexed = swrap_link_build_index(list.rules,
+							list.count,
+							index,
+							index_size,
+							unindexed),
+		.unindexed = unindexed,
+	};
+}
+
+/****************************************************************************
+ *   TOPOLOGY FILE
+ ***************************************************************************/
+
+/*
+ * SOCKET_WRAPPER_TOPOLOGY names a file describing the virtual network, one
+ * statement per line:
+ *
+ *   host NAME ID|ADDRESS
+ *   subnet NAME MEMBER...
+ *   link A [>] B PROPERTY=VALUE...
+ *   deny A [>] B
+ *   allow A [>] B
+ *
+ * Links and ACLs apply to both directions, unless written as A > B. The
+ * endpoints are anything a rule in the environment accepts, or the name of
+ * a host or subnet defined before.
+ */
+#define SWRAP_TOPO_MAX_ARGS 256
+
+struct swrap_topo_builder {
+	struct swrap_topo_name *names;
+	size_t num_names;
+	struct swrap_topo_member *members;
+	size_t num_members;
+	uint32_t num_subnets;
+	struct swrap_link_list rules;
+	unsigned int flags;
+};
+
+static bool swrap_topo_add_name(struct swrap_topo_builder *b,
+				const char *name,
+				uint32_t type,
+				uint32_t id)
+{
+	struct swrap_topo_name *tmp;
+	size_t len = strlen(name);
+	size_t lo = 0;
+	size_t hi = b->num_names;
+
+	if (len >= SWRAP_TOPO_NAME_MAX) {
+		return false;
+	}
+
+	/* Keep the names sorted for the binary search */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		int cmp = strcmp(name, b->names[mid].name);
+
+		if (cmp == 0) {
+			return false;
+		}
+		if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	tmp = (struct swrap_topo_name *)realloc(b->names,
+		(b->num_names + 1) * sizeof(struct swrap_topo_name));
+	if (tmp == NULL) {
+		return false;
+	}
+	b->names = tmp;
+
+	memmove(&b->names[lo + 1], &b->names[lo],
+		(b->num_names - lo) * sizeof(struct swrap_topo_name));
+	ZERO_STRUCT(b->names[lo]);
+	memcpy(b->names[lo].name, name, len + 1);
+	b->names[lo].type = type;
+	b->names[lo].id = id;
+	b->num_names++;
+
+	/* The following lines can use the name */
+	swrap_topo.names = b->names;
+	swrap_topo.num_names = b->num_names;
+
+	return true;
+}
+
+/* The interface of an endpoint naming a single host, 0 otherwise */
+static uint32_t swrap_topo_ep_iface(const struct swrap_link_ep *ep)
+{
+	uint64_t key;
+
+	switch (ep->type) {
+	case SWRAP_LINK_EP_IFACE:
+		return ep->iface;
+	case SWRAP_LINK_EP_ADDR:
+		if (swrap_link_ep_key(ep, &key)) {
+			return key & 0xFFFFFFFF;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/* host NAME ID|ADDRESS */
+static bool swrap_topo_parse_host(struct swrap_topo_builder *b,
+				  char **argv,
+				  int argc)
+{
+	struct swrap_link_ep ep;
+	uint32_t iface;
+
+	if (argc != 3) {
+		return false;
+	}
+
+	/* The name must not be taken, or look like an address */
+	if (swrap_link_parse_ep(argv[1], strlen(argv[1]), &ep) ||
+	    !swrap_link_parse_ep(argv[2], strlen(argv[2]), &ep)) {
+		return false;
+	}
+
+	iface = swrap_topo_ep_iface(&ep);
+	if (iface == 0) {
+		return false;
+	}
+
+	return swrap_topo_add_name(b, argv[1], SWRAP_LINK_EP_IFACE, iface);
+}
+
+/* subnet NAME MEMBER..., the members can be spread over several lines */
+static bool swrap_topo_parse_subnet(struct swrap_topo_builder *b,
+				    char **argv,
+				    int argc)
+{
+	const struct swrap_topo_name *name;
+	struct swrap_link_ep ep;
+	uint32_t subnet;
+	int i;
+
+	if (argc < 2) {
+		return false;
+	}
+
+	name = swrap_topo_name_find(argv[1]);
+	if (name != NULL) {
+		if (name->type != SWRAP_LINK_EP_SUBNET) {
+			return false;
+		}
+		subnet = name->id;
+	} else {
+		if (swrap_link_parse_ep(argv[1], strlen(argv[1]), &ep)) {
+			return false;
+		}
+
+		subnet = b->num_subnets + 1;
+		if (!swrap_topo_add_name(b, argv[1],
+					 SWRAP_LINK_EP_SUBNET, subnet)) {
+			return false;
+		}
+		b->num_subnets = subnet;
+	}
+
+	for (i = 2; i < argc; i++) {
+		struct swrap_topo_member *tmp;
+		uint32_t iface = 0;
+
+		if (swrap_link_parse_ep(argv[i], strlen(argv[i]), &ep)) {
+			iface = swrap_topo_ep_iface(&ep);
+		}
+		if (iface == 0) {
+			return false;
+		}
+
+		tmp = (struct swrap_topo_member *)realloc(b->members,
+			(b->num_members + 1) * sizeof(struct swrap_topo_member));
+		if (tmp == NULL) {
+			return false;
+		}
+		b->members = tmp;
+		b->members[b->num_members++] = (struct swrap_topo_member) {
+			.iface = iface,
+			.subnet = subnet,
+		};
+	}
+
+	return true;
+}
+
+static bool swrap_topo_add_rule(struct swrap_topo_builder *b,
+				const struct swrap_link *l,
+				bool both)
+{
+	struct swrap_link back = *l;
+
+	if (!swrap_link_list_add(&b->rules, l)) {
+		return false;
+	}
+	b->flags |= l->flags;
+
+	if (!both) {
+		return true;
+	}
+
+	back.src = l->dst;
+	back.dst = l->src;
+
+	return swrap_link_list_add(&b->rules, &back);
+}
+
+/* link A [>] B PROPERTY=VALUE..., deny A [>] B and allow A [>] B */
+static bool swrap_topo_parse_link(struct swrap_topo_builder *b,
+				  char **argv,
+				  int argc)
+{
+	struct swrap_link props[SWRAP_LINK_NUM];
+	struct swrap_link l;
+	size_t num_props = 0;
+	bool both = true;
+	int i = 1;
+	size_t j;
+
+	ZERO_STRUCT(l);
+
+	if (argc < 3 ||
+	    !swrap_link_parse_ep(argv[i], strlen(argv[i]), &l.src)) {
+		return false;
+	}
+	i++;
+
+	if (strcmp(argv[i], ">") == 0) {
+		both = false;
+		i++;
+	}
+	if (i >= argc ||
+	    !swrap_link_parse_ep(argv[i], strlen(argv[i]), &l.dst)) {
+		return false;
+	}
+	i++;
+
+	if (strcmp(argv[0], "link") != 0) {
+		if (i != argc) {
+			return false;
+		}
+		l.flags = SWRAP_LINK_ACL;
+		l.allow = strcmp(argv[0], "allow") == 0;
+
+		return swrap_topo_add_rule(b, &l, both);
+	}
+
+	/* Only add the link if all properties are valid */
+	if (i == argc || argc - i > SWRAP_LINK_NUM) {
+		return false;
+	}
+	for (; i < argc; i++) {
+		char *eq = strchr(argv[i], '=');
+
+		if (eq == NULL) {
+			return false;
+		}
+		*eq = '\0';
+
+		for (j = 0; j < SWRAP_LINK_NUM_PROPS; j++) {
+			if (strcmp(argv[i], swrap_link_props[j].key) == 0) {
+				break;
+			}
+		}
+		if (j == SWRAP_LINK_NUM_PROPS) {
+			return false;
+		}
+
+		props[num_props] = l;
+		if (!swrap_link_props[j].parse(eq + 1, &props[num_props])) {
+			return false;
+		}
+		props[num_props].flags = swrap_link_props[j].flag;
+		num_props++;
+	}
+
+	for (j = 0; j < num_props; j++) {
+		if (!swrap_topo_add_rule(b, &props[j], both)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void swrap_topo_parse(struct swrap_topo_builder *b,
+			     FILE *fp,
+			     const char *path)
+{
+	char line[4096];
+	unsigned int lineno = 0;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *argv[SWRAP_TOPO_MAX_ARGS];
+		char *saveptr = NULL;
+		char *comment;
+		char *a;
+		int argc = 0;
+		bool ok = false;
+
+		lineno++;
+
+		comment = strchr(line, '#');
+		if (comment != NULL) {
+			*comment = '\0';
+		}
+
+		for (a = strtok_r(line, " \t\r\n", &saveptr);
+		     a != NULL && argc < SWRAP_TOPO_MAX_ARGS;
+		     a = strtok_r(NULL, " \t\r\n", &saveptr)) {
+			argv[argc++] = a;
+		}
+		if (argc == 0) {
+			continue;
+		}
+
+		if (a != NULL) {
+			ok = false;
+		} else if (strcmp(argv[0], "host") == 0) {
+			ok = swrap_topo_parse_host(b, argv, argc);
+		} else if (strcmp(argv[0], "subnet") == 0) {
+			ok = swrap_topo_parse_subnet(b, argv, argc);
+		} else if (strcmp(argv[0], "link") == 0 ||
+			   strcmp(argv[0], "deny") == 0 ||
+			   strcmp(argv[0], "allow") == 0) {
+			ok = swrap_topo_parse_link(b, argv, argc);
+		}
+
+		if (!ok) {
+			SWRAP_LOG(SWRAP_LOG_ERROR,
+				  "Ignoring invalid line %u of %s",
+				  lineno, path);
+		}
+	}
+}
+
+static size_t swrap_topo_image_size(uint64_t num_names,
+				    uint64_t members_size,
+				    uint64_t count,
+				    uint64_t index_size)
+{
+	return sizeof(struct swrap_topo_header) +
+	       num_names * sizeof(struct swrap_topo_name) +
+	       members_size * sizeof(struct swrap_topo_member) +
+	       count * sizeof(struct swrap_link) +
+	       index_size * sizeof(struct swrap_link_slot) +
+	       count * sizeof(size_t);
+}
+
+static struct swrap_topo_header *swrap_topo_compile(
+					const struct swrap_topo_builder *b,
+					const struct stat *st)
+{
+	struct swrap_topo_header *hdr;
+	struct swrap_topo_member *members;
+	struct swrap_link *rules;
+	struct swrap_link_slot *index;
+	size_t *unindexed;
+	size_t members_size = 0;
+	size_t index_size = 0;
+	size_t image_size;
+	uint8_t *p;
+	size_t i;
+
+	if (b->num_members > 0) {
+		members_size = swrap_link_index_size(b->num_members);
+	}
+	if (b->rules.count > 0) {
+		index_size = swrap_link_index_size(b->rules.count);
+	}
+
+	image_size = swrap_topo_image_size(b->num_names,
+					   members_size,
+					   b->rules.count,
+					   index_size);
+	hdr = (struct swrap_topo_header *)calloc(1, image_size);
+	if (hdr == NULL) {
+		return NULL;
+	}
+
+	memcpy(hdr->magic, SWRAP_TOPO_MAGIC, sizeof(hdr->magic));
+	hdr->version = SWRAP_TOPO_VERSION;
+	hdr->link_size = sizeof(struct swrap_link);
+	hdr->dev = st->st_dev;
+	hdr->ino = st->st_ino;
+	hdr->size = st->st_size;
+	hdr->mtime_sec = st->st_mtim.tv_sec;
+	hdr->mtime_nsec = st->st_mtim.tv_nsec;
+	hdr->ctime_sec = st->st_ctim.tv_sec;
+	hdr->ctime_nsec = st->st_ctim.tv_nsec;
+	hdr->image_size = image_size;
+	hdr->flags = b->flags;
+	hdr->num_names = b->num_names;
+	hdr->members_size = members_size;
+	hdr->count = b->rules.count;
+	hdr->index_size = index_size;
+
+	p = (uint8_t *)(hdr + 1);
+	if (b->num_names > 0) {
+		memcpy(p, b->names, b->num_names * sizeof(struct swrap_topo_name));
+	}
+	p += b->num_names * sizeof(struct swrap_topo_name);
+	members = (struct swrap_topo_member *)(void *)p;
+	p += members_size * sizeof(struct swrap_topo_member);
+	rules = (struct swrap_link *)(void *)p;
+	p += b->rules.count * sizeof(struct swrap_link);
+	index = (struct swrap_link_slot *)(void *)p;
+	p += index_size * sizeof(struct swrap_link_slot);
+	unindexed = (size_t *)(void *)p;
+
+	for (i = 0; i < b->num_members; i++) {
+		const struct swrap_topo_member *m = &b->members[i];
+		size_t j;
+
+		for (j = swrap_topo_member_hash(m->iface, members_size);
+		     members[j].iface != 0 && members[j].iface != m->iface;
+		     j = (j + 1) & (members_size - 1)) {
+		}
+		if (members[j].iface != 0 && members[j].subnet != m->subnet) {
+			SWRAP_LOG(SWRAP_LOG_ERROR,
+				  "Interface %u is in more than one subnet, "
+				  "ignoring all but the first",
+				  (unsigned int)m->iface);
+			continue;
+		}
+		members[j] = *m;
+	}
+
+	if (b->rules.count > 0) {
+		memcpy(rules, b->rules.rules,
+		       b->rules.count * sizeof(struct swrap_link));
+		hdr->num_unindexed = swrap_link_build_index(rules,
+							    b->rules.count,
+							    index,
+							    index_size,
+							    unindexed);
+	}
+
+	return hdr;
+}
+
+static bool swrap_topo_pow2(uint64_t x)
+{
+	return (x & (x - 1)) == 0;
+}
+
+/*
+ * The lookups follow the slots until an empty one, and the rule indexes
+ * of a broken image must not point past the rules.
+ */
+static bool swrap_topo_tables_valid(const struct swrap_topo_header *hdr,
+				    const struct swrap_topo_member *members,
+				    const struct swrap_link_slot *index,
+				    const size_t *unindexed)
+{
+	bool empty;
+	size_t i;
+
+	empty = hdr->members_size == 0;
+	for (i = 0; i < hdr->members_size; i++) {
+		if (members[i].iface == 0) {
+			empty = true;
+		}
+	}
+	if (!empty) {
+		return false;
+	}
+
+	empty = hdr->index_size == 0;
+	for (i = 0; i < hdr->index_size; i++) {
+		if (index[i].rule > hdr->count) {
+			return false;
+		}
+		if (index[i].rule == 0) {
+			empty = true;
+		}
+	}
+	if (!empty) {
+		return false;
+	}
+
+	for (i = 0; i < hdr->num_unindexed; i++) {
+		if (unindexed[i] >= hdr->count) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool swrap_topo_attach(const struct swrap_topo_header *hdr,
+			      size_t len,
+			      const struct stat *st)
+{
+	const uint8_t *p = (const uint8_t *)(hdr + 1);
+	const struct swrap_topo_name *names;
+	const struct swrap_topo_member *members;
+	const struct swrap_link *rules;
+	const struct swrap_link_slot *index;
+	const size_t *unindexed;
+
+	/*
+	 * An image of another file or another build is compiled again. The
+	 * file can change within the same second, so compare the nanoseconds
+	 * and the ctime, which can't be set back.
+	 */
+	if (len < sizeof(struct swrap_topo_header) ||
+	    memcmp(hdr->magic, SWRAP_TOPO_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != SWRAP_TOPO_VERSION ||
+	    hdr->link_size != sizeof(struct swrap_link) ||
+	    hdr->dev != (uint64_t)st->st_dev ||
+	    hdr->ino != (uint64_t)st->st_ino ||
+	    hdr->size != (uint64_t)st->st_size ||
+	    hdr->mtime_sec != (uint64_t)st->st_mtim.tv_sec ||
+	    hdr->mtime_nsec != (uint64_t)st->st_mtim.tv_nsec ||
+	    hdr->ctime_sec != (uint64_t)st->st_ctim.tv_sec ||
+	    hdr->ctime_nsec != (uint64_t)st->st_ctim.tv_nsec) {
+		return false;
+	}
+
+	if (hdr->image_size != len ||
+	    hdr->num_names > len ||
+	    hdr->members_size > len ||
+	    hdr->count > len ||
+	    hdr->index_size > len ||
+	    hdr->num_unindexed > hdr->count ||
+	    !swrap_topo_pow2(hdr->members_size) ||
+	    !swrap_topo_pow2(hdr->index_size) ||
+	    (hdr->count > 0 && hdr->index_size == 0) ||
+	    swrap_topo_image_size(hdr->num_names,
+				  hdr->members_size,
+				  hdr->count,
+				  hdr->index_size) != len) {
+		return false;
+	}
+
+	names = (const struct swrap_topo_name *)(const void *)p;
+	p += hdr->num_names * sizeof(struct swrap_topo_name);
+	members = (const struct swrap_topo_member *)(const void *)p;
+	p += hdr->members_size * sizeof(struct swrap_topo_member);
+	rules = (const struct swrap_link *)(const void *)p;
+	p += hdr->count * sizeof(struct swrap_link);
+	index = (const struct swrap_link_slot *)(const void *)p;
+	p += hdr->index_size * sizeof(struct swrap_link_slot);
+	unindexed = (const size_t *)(const void *)p;
+
+	if (!swrap_topo_tables_valid(hdr, members, index, unindexed)) {
+		SWRAP_LOG(SWRAP_LOG_ERROR, "Ignoring a corrupt topology image");
+		return false;
+	}
+
+	swrap_topo.hdr = hdr;
+	swrap_topo.names = names;
+	swrap_topo.num_names = hdr->num_names;
+	swrap_topo.members = members;
+	swrap_topo.members_size = hdr->members_size;
+
+	swrap_links.topo.count = hdr->count;
+	swrap_links.topo.rules = rules;
+	swrap_links.topo.index_size = hdr->index_size;
+	swrap_links.topo.index = index;
+	swrap_links.topo.num_unindexed = hdr->num_unindexed;
+	swrap_links.topo.unindexed = unindexed;
+
+	swrap_links.flags |= hdr->flags;
+
+	return true;
+}
+
+static bool swrap_topo_cache_path(const struct stat *st,
+				  char *path,
+				  size_t size)
+{
+	const char *dir = socket_wrapper_dir();
+	int ret;
+
+	if (dir == NULL) {
+		return false;
+	}
+
+	ret = snprintf(path, size,
+		       "%s/.topology-%llx-%llx-%llx-%llx.%lx-%llx.%lx",
+		       dir,
+		       (unsigned long long)st->st_dev,
+		       (unsigned long long)st->st_ino,
+		       (unsigned long long)st->st_size,
+		       (unsigned long long)st->st_mtim.tv_sec,
+		       (unsigned long)st->st_mtim.tv_nsec,
+		       (unsigned long long)st->st_ctim.tv_sec,
+		       (unsigned long)st->st_ctim.tv_nsec);
+
+	return ret > 0 && (size_t)ret < size;
+}
+
+static bool swrap_topo_map(const char *path, const struct stat *st)
+{
+	struct stat mst;
+	void *p;
+	int fd;
+	int rc;
+
+	fd = libc_open(path, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+
+	rc = fstat(fd, &mst);
+	if (rc == -1 || mst.st_size < (off_t)sizeof(struct swrap_topo_header)) {
+		libc_close(fd);
+		return false;
+	}
+
+	p = mmap(NULL, mst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	libc_close(fd);
+	if (p == MAP_FAILED) {
+		return false;
+	}
+
+	if (!swrap_topo_attach((const struct swrap_topo_header *)p,
+			       mst.st_size, st)) {
+		munmap(p, mst.st_size);
+		return false;
+	}
+	swrap_topo.mapped = true;
+
+	return true;
+}
+
+/* Write the image under a temporary name, the first rename wins */
+static bool swrap_topo_write(const char *path,
+			     const struct swrap_topo_header *hdr)
+{
+	const uint8_t *p = (const uint8_t *)hdr;
+	size_t left = hdr->image_size;
+	char tmp[1024];
+	int fd;
+	int ret;
+
+	ret = snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	if (ret <= 0 || (size_t)ret >= sizeof(tmp)) {
+		return false;
+	}
+
+	fd = libc_open(tmp, O_WRONLY|O_CREAT|O_EXCL, 0644);
+	if (fd == -1) {
+		return false;
+	}
+
+	while (left > 0) {
+		ssize_t n = libc_write(fd, p, left);
+
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		p += n;
+		left -= n;
+	}
+	libc_close(fd);
+
+	if (left != 0 || rename(tmp, path) == -1) {
+		unlink(tmp);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * The file is parsed by the first process using it, and compiled into an
+ * image in the socket directory. Everybody else maps the image.
+ */
+static void swrap_topo_load(void)
+{
+	const char *path = getenv("SOCKET_WRAPPER_TOPOLOGY");
+	struct swrap_topo_builder b;
+	struct swrap_topo_header *hdr;
+	char cache[1024];
+	bool have_cache;
+	struct stat st;
+	FILE *fp;
+	int rc;
+
+	if (path == NULL || path[0] == '\0') {
+		return;
+	}
+
+	fp = libc_fopen(path, "r");
+	if (fp == NULL) {
+		SWRAP_LOG(SWRAP_LOG_ERROR,
+			  "Failed to open topology file %s: %s",
+			  path, strerror(errno));
+		return;
+	}
+
+	rc = fstat(fileno(fp), &st);
+	if (rc == -1) {
+		fclose(fp);
+		return;
+	}
+
+	have_cache = swrap_topo_cache_path(&st, cache, sizeof(cache));
+	if (have_cache && swrap_topo_map(cache, &st)) {
+		fclose(fp);
+		SWRAP_LOG(SWRAP_LOG_DEBUG, "Mapped topology %s", cache);
+		return;
+	}
+
+	ZERO_STRUCT(b);
+	swrap_topo_parse(&b, fp, path);
+	fclose(fp);
+
+	hdr = swrap_topo_compile(&b, &st);
+
+	swrap_topo.names = NULL;
+	swrap_topo.num_names = 0;
+	free(b.names);
+	free(b.members);
+	free(b.rules.rules);
+
+	if (hdr == NULL) {
+		return;
+	}
+
+	SWRAP_LOG(SWRAP_LOG_DEBUG,
+		  "Compiled topology %s: %llu names, %llu rules",
+		  path,
+		  (unsigned long long)hdr->num_names,
+		  (unsigned long long)hdr->count);
+
+	if (have_cache &&
+	    swrap_topo_write(cache, hdr) &&
+	    swrap_topo_map(cache, &st)) {
+		free(hdr);
+		return;
+	}
+
+	if (!swrap_topo_attach(hdr, hdr->image_size, &st)) {
+		free(hdr);
+	}
+}
+
+static void swrap_delay_init_conds(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&swrap_delay.wakeup, &attr);
+	pthread_cond_init(&swrap_delay.space, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void swrap_link_init(void)
+{
+	const char *s = getenv("SOCKET_WRAPPER_SEED");
+
+	if (s != NULL && s[0] != '\0') {
+		swrap_links.seed = strtoull(s, NULL, 0);
+	} else {
+		swrap_links.seed = (uint64_t)time(NULL) ^
+				   ((uint64_t)getpid() << 32);
+	}
+
+	/* First the topology, the rules can use its names */
+	swrap_topo_load();
+	swrap_link_load_env();
+
+	if (swrap_links.flags != 0) {
+		SWRAP_LOG(SWRAP_LOG_DEBUG,
+			  "Link emulation enabled, seed %llu",
+			  (unsigned long long)swrap_links.seed);
+	}
+
+	swrap_delay_init_conds();
+}
+
+static unsigned int swrap_link_flags(void)
+{
+	pthread_once(&swrap_links.once, swrap_link_init);
+
+	return swrap_links.flags;
+}
+
+/* The interface of a host of the topology file, 0 if there is none */
+static unsigned int swrap_topo_host_iface(const char *name)
+{
+	const struct swrap_topo_name *n;
+
+	swrap_link_flags();
+
+	n = swrap_topo_name_find(name);
+	if (n == NULL || n->type != SWRAP_LINK_EP_IFACE) {
+		return 0;
+	}
+
+	return n->id;
+}
+
+/* The addresses of a packet and their keys */
+struct swrap_link_keys {
+	const struct sockaddr *src;
+	const struct sockaddr *dst;
+	uint64_t src_keys[4];
+	uint64_t dst_keys[4];
+	size_t num_src;
+	size_t num_dst;
+};
+
+static const struct swrap_link *swrap_link_table_find(
+					const struct swrap_link_table *t,
+					const struct swrap_link_keys *k,
+					unsigned int flag,
+					int *prio)
+{
+	size_t best = 0;
+	int best_prio = -1;
+	size_t i, j;
+
+	if (t->index_size == 0) {
+		*prio = -1;
+		return NULL;
+	}
+
+	for (i = 0; i < k->num_src; i++) {
+		for (j = 0; j < k->num_dst; j++) {
+			size_t r = swrap_link_index_get(t,
+							k->src_keys[i],
+							k->dst_keys[j],
+							flag);
+			int p;
+
+			if (r == 0) {
+				continue;
+			}
+
+			p = swrap_link_key_level(k->src_keys[i]) * 3 +
+			    swrap_link_key_level(k->dst_keys[j]);
+			if (p > best_prio || (p == best_prio && r < best)) {
+				best = r;
+				best_prio = p;
+			}
+		}
+	}
+
+	for (i = 0; i < t->num_unindexed; i++) {
+		size_t r = t->unindexed[i] + 1;
+		const struct swrap_link *l = &t->rules[r - 1];
+		int p;
+
+		if ((l->flags & flag) == 0) {
+			continue;
+		}
+		if (!swrap_link_ep_match(&l->src, k->src) ||
+		    !swrap_link_ep_match(&l->dst, k->dst)) {
+			continue;
+		}
+
+		p = swrap_link_ep_level(&l->src) * 3 +
+		    swrap_link_ep_level(&l->dst);
+		if (p > best_prio || (p == best_prio && r < best)) {
+			best = r;
+			best_prio = p;
+		}
+	}
+
+	*prio = best_prio;
+	if (best == 0) {
+		return NULL;
+	}
+
+	return &t->rules[best - 1];
+}
+
+static const struct swrap_link *swrap_link_find(const struct swrap_link_keys *k,
+						unsigned int flag)
+{
+	const struct swrap_link *env;
+	const struct swrap_link *topo;
+	int env_prio, topo_prio;
+
+	/* If more than one rule matches, the most specific one is used */
+	env = swrap_link_table_find(&swrap_links.env, k, flag, &env_prio);
+	topo = swrap_link_table_find(&swrap_links.topo, k, flag, &topo_prio);
+
+	if (topo_prio > env_prio) {
+		return topo;
+	}
+
+	return env;
+}
+
+static const struct swrap_link_policy *swrap_link_policy(
+					const struct sockaddr *src,
+					const struct sockaddr *dst)
+{
+	struct swrap_link_keys k = {
+		.src = src,
+		.dst = dst,
+	};
+	struct swrap_link_policy *p;
+	size_t i;
+
+	k.num_src = swrap_link_sa_keys(src, k.src_keys);
+	k.num_dst = swrap_link_sa_keys(dst, k.dst_keys);
+
+	/*
+	 * The second key is unique for an address of a wrapped interface,
+	 * other addresses are looked up every time.
+	 */
+	if (k.num_src > 1 && k.num_dst > 1) {
+		uint64_t h = k.src_keys[1] * 0x9E3779B97F4A7C15ULL;
+
+		h = (h ^ k.dst_keys[1]) * 0xFF51AFD7ED558CCDULL;
+		p = &swrap_link_policies[(h >> 32) % SWRAP_LINK_POLICY_CACHE];
+		if (p->src == k.src_keys[1] && p->dst == k.dst_keys[1]) {
+			return p;
+		}
+		p->src = k.src_keys[1];
+		p->dst = k.dst_keys[1];
+	} else {
+		p = &swrap_link_policies[SWRAP_LINK_POLICY_CACHE];
+	}
+
+	for (i = 0; i < SWRAP_LINK_NUM; i++) {
+		unsigned int flag = 1U << i;
+
+		p->rule[i] = NULL;
+		if (swrap_links.flags & flag) {
+			p->rule[i] = swrap_link_find(&k, flag);
+		}
+	}
+
+	return p;
+}
+
+static const struct swrap_link *swrap_link_rule(
+					const struct swrap_link_policy *p,
+					unsigned int flag)
+{
+	return p->rule[__builtin_ctz(flag)];
+}
+
+/****************************************************************************
+ *   PARTITIONS
+ ***************************************************************************/
+
+/*
+ * swrap_partition blocks the traffic between interfaces at runtime, by
+ * changing the table shared by all processes using the socket directory.
+ * Datagrams across a partition are dropped, a connect() times out and
+ * established streams stall until the partition is healed.
+ *
+ * This is only done with SOCKET_WRAPPER_PARTITIONS set. The table is
+ * created by the tool, until then we look for it every so often. Tests
+ * change SOCKET_WRAPPER_DIR on the way, so the table of every directory
+ * gets mapped once and is kept.
+ */
+#define SWRAP_PARTITION_POLL_USEC 1000
+#define SWRAP_PARTITION_RETRY_USEC (100 * 1000)
+
+struct swrap_partition_map {
+	struct swrap_partition_map *next;
+	const struct swrap_partition_shm *shm;
+	uint64_t retry_usec;
+	char dir[];
+};
+
+static struct {
+	pthread_once_t once;
+	bool enabled;
+	struct swrap_partition_map *maps;
+} swrap_partition = {
+	.once = PTHREAD_ONCE_INIT,
+};
+
+static void swrap_partition_init(void)
+{
+	const char *s = getenv("SOCKET_WRAPPER_PARTITIONS");
+
+	swrap_partition.enabled = s != NULL && strcmp(s, "1") == 0;
+}
+
+static const struct swrap_partition_shm *swrap_partition_open(const char *dir)
+{
+	const struct swrap_partition_shm *shm;
+	char path[1024];
+	struct stat st;
+	void *p;
+	int fd;
+	int rc;
+
+	rc = snprintf(path, sizeof(path), "%s/%s", dir, SWRAP_PARTITION_FILE);
+	if (rc <= 0 || (size_t)rc >= sizeof(path)) {
+		return NULL;
+	}
+
+	fd = libc_open(path, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	/* The tool sizes the file before it marks it */
+	rc = fstat(fd, &st);
+	if (rc == -1 || st.st_size < (off_t)sizeof(struct swrap_partition_shm)) {
+		libc_close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, sizeof(struct swrap_partition_shm),
+		 PROT_READ, MAP_SHARED, fd, 0);
+	libc_close(fd);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+	shm = (const struct swrap_partition_shm *)p;
+
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) !=
+	    SWRAP_PARTITION_MAGIC) {
+		munmap(p, sizeof(struct swrap_partition_shm));
+		return NULL;
+	}
+
+	return shm;
+}
+
+static const struct swrap_partition_shm *swrap_partition_get(void)
+{
+	const struct swrap_partition_shm *shm;
+	const char *dir;
+	struct swrap_partition_map *m;
+	uint64_t now;
+	size_t len;
+
+	pthread_once(&swrap_partition.once, swrap_partition_init);
+	if (!swrap_partition.enabled) {
+		return NULL;
+	}
+
+	dir = socket_wrapper_dir();
+	if (dir == NULL) {
+		return NULL;
+	}
+
+	for (m = __atomic_load_n(&swrap_partition.maps, __ATOMIC_ACQUIRE);
+	     m != NULL;
+	     m = m->next) {
+		if (strcmp(m->dir, dir) == 0) {
+			break;
+		}
+	}
+
+	if (m != NULL) {
+		shm = __atomic_load_n(&m->shm, __ATOMIC_ACQUIRE);
+		if (shm != NULL) {
+			return shm;
+		}
+		now = swrap_monotonic_usec();
+		if (now < __atomic_load_n(&m->retry_usec, __ATOMIC_RELAXED)) {
+			return NULL;
+		}
+	}
+
+	SWRAP_LOCK(partition);
+
+	for (m = swrap_partition.maps; m != NULL; m = m->next) {
+		if (strcmp(m->dir, dir) == 0) {
+			break;
+		}
+	}
+	if (m == NULL) {
+		len = strlen(dir);
+		m = (struct swrap_partition_map *)calloc(1, sizeof(*m) + len + 1);
+		if (m != NULL) {
+			memcpy(m->dir, dir, len + 1);
+			m->next = swrap_partition.maps;
+			__atomic_store_n(&swrap_partition.maps, m,
+					 __ATOMIC_RELEASE);
+		}
+	}
+
+	shm = NULL;
+	if (m != NULL) {
+		shm = m->shm;
+		if (shm == NULL) {
+			shm = swrap_partition_open(dir);
+			__atomic_store_n(&m->retry_usec,
+					 swrap_monotonic_usec() +
+					 SWRAP_PARTITION_RETRY_USEC,
+					 __ATOMIC_RELAXED);
+			__atomic_store_n(&m->shm, shm, __ATOMIC_RELEASE);
+		}
+	}
+
+	SWRAP_UNLOCK(partition);
+
+	return shm;
+}
+
+static bool swrap_partition_blocked(const struct sockaddr *from,
+				    const struct sockaddr *to)
+{
+	const struct swrap_partition_shm *shm = swrap_partition_get();
+	unsigned int src, dst;
+	uint32_t seq;
+	bool blocked;
+
+	if (shm == NULL || __atomic_load_n(&shm->count, __ATOMIC_RELAXED) == 0) {
+		return false;
+	}
+
+	src = swrap_sockaddr_iface(from);
+	dst = swrap_sockaddr_iface(to);
+	if (src == 0 || dst == 0) {
+		return false;
+	}
+
+	do {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		blocked = swrap_partition_lookup(shm, src, dst);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+		 seq != __atomic_load_n(&shm->seq, __ATOMIC_RELAXED));
+
+	return blocked;
+}
+
+/* If the partition table has any entries, for the fast paths */
+static bool swrap_partition_active(void)
+{
+	const struct swrap_partition_shm *shm = swrap_partition_get();
+
+	return shm != NULL && __atomic_load_n(&shm->count, __ATOMIC_RELAXED) > 0;
+}
+
+/*
+ * For a socket bound to the wildcard address the bind name holds the
+ * address of the default interface we are really using.
+ */
+static const struct sockaddr *swrap_link_local_addr(struct socket_info *si)
+{
+	const struct sockaddr *sa = &si->myname.sa.s;
+	bool any = false;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		any = si->myname.sa.in.sin_addr.s_addr == htonl(INADDR_ANY);
+		break;
+#ifdef HAVE_IPV6
+	case AF_INET6:
+		any = IN6_IS_ADDR_UNSPECIFIED(&si->myname.sa.in6.sin6_addr);
+		break;
+#endif
+	}
+
+	if (any && si->bindname.sa_socklen > 0) {
+		return &si->bindname.sa.s;
+	}
+
+	return sa;
+}
+
+/* If the ACLs of the topology don't let the socket reach the address */
+static bool swrap_link_denied(struct socket_info *si,
+			      const struct sockaddr *to)
+{
+	const struct swrap_link *acl;
+
+	if ((swrap_link_flags() & SWRAP_LINK_ACL) == 0) {
+		return false;
+	}
+
+	acl = swrap_link_rule(swrap_link_policy(swrap_link_local_addr(si), to),
+			      SWRAP_LINK_ACL);
+
+	return acl != NULL && !acl->allow;
+}
+
+/*
+ * A xorshift64* generator per socket. It is seeded from SOCKET_WRAPPER_SEED
+ * and the socket slot, so a run can be repeated with the same seed.
+ */
+static uint64_t swrap_link_random(struct socket_info *si)
+{
+	uint64_t x = si->rng_state;
+
+	if (x == 0) {
+		x = swrap_links.seed +
+		    (uint64_t)(si - sockets + 1) * 0x9E3779B97F4A7C15ULL;
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+		x ^= x >> 31;
+		if (x == 0) {
+			x = 1;
+		}
+	}
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	si->rng_state = x;
+
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* A uniform random number in [0, 1) */
+static double swrap_link_uniform(struct socket_info *si)
+{
+	return (swrap_link_random(si) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t swrap_link_delay_usec(struct socket_info *si,
+				      const struct swrap_link *l)
+{
+	double d = (double)l->latency.delay_usec;
+	double j = (double)l->latency.jitter_usec;
+
+	if (j > 0) {
+		switch (l->latency.dist) {
+		case SWRAP_DELAY_DIST_UNIFORM:
+			d += (2 * swrap_link_uniform(si) - 1) * j;
+			break;
+		case SWRAP_DELAY_DIST_NORMAL: {
+			/* Irwin-Hall, good enough and no need for libm */
+			double n = -6;
+			int i;
+
+			for (i = 0; i < 12; i++) {
+				n += swrap_link_uniform(si);
+			}
+			d += n * j;
+			break;
+		}
+		}
+	}
+
+	if (d < 0) {
+		d = 0;
+	}
+
+	return (uint64_t)d;
+}
+
+static bool swrap_link_chance(struct socket_info *si, double prob)
+{
+	if (prob <= 0) {
+		return false;
+	}
+
+	return swrap_link_uniform(si) < prob;
+}
+
+/* Advance the Gilbert-Elliott chain of the socket and roll the dice */
+static bool swrap_link_lost(struct socket_info *si, const struct swrap_link *l)
+{
+	if (si->loss_bad) {
+		if (swrap_link_chance(si, l->loss.r)) {
+			si->loss_bad = false;
+		}
+	} else {
+		if (swrap_link_chance(si, l->loss.p)) {
+			si->loss_bad = true;
+		}
+	}
+
+	return swrap_link_chance(si, si->loss_bad ? l->loss.bad : l->loss.good);
+}
+
+static void swrap_bucket_init(struct swrap_bucket *b,
+			      const struct swrap_link *rule)
+{
+	b->rate = rule->bandwidth.rate;
+	b->burst = rule->bandwidth.burst;
+	b->tat_nsec = 0;
+}
+
+static void swrap_bucket_key(const struct sockaddr *sa, uint8_t key[16])
+{
+	memset(key, 0, 16);
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		memcpy(key,
+		       &((const struct sockaddr_in *)(const void *)sa)->sin_addr,
+		       4);
+		break;
+#ifdef HAVE_IPV6
+	case AF_INET6:
+		memcpy(key,
+		       &((const struct sockaddr_in6 *)(const void *)sa)->sin6_addr,
+		       16);
+		break;
+#endif
+	}
+}
+
+/*
+ * The bucket shared by all sockets sending from src to dst. A rule with
+ * wildcards still gets a bucket for each address pair.
+ */
+static struct swrap_bucket *swrap_bucket_get(const struct swrap_link *rule,
+					     const struct sockaddr *src,
+					     const struct sockaddr *dst)
+{
+	struct swrap_bucket *b;
+	uint8_t key[33];
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	key[0] = (uint8_t)src->sa_family;
+	swrap_bucket_key(src, key + 1);
+	swrap_bucket_key(dst, key + 17);
+
+	for (i = 0; i < sizeof(key); i++) {
+		h = (h ^ key[i]) * 16777619U;
+	}
+	h %= SWRAP_BUCKET_HASH_SIZE;
+
+	SWRAP_LOCK(delay_queue);
+
+	for (b = swrap_delay.buckets[h]; b != NULL; b = b->next) {
+		if (b->rule == rule && memcmp(b->key, key, sizeof(key)) == 0) {
+			break;
+		}
+	}
+
+	if (b == NULL) {
+		b = (struct swrap_bucket *)calloc(1, sizeof(*b));
+		if (b != NULL) {
+			b->rule = rule;
+			memcpy(b->key, key, sizeof(key));
+			swrap_bucket_init(b, rule);
+			b->next = swrap_delay.buckets[h];
+			swrap_delay.buckets[h] = b;
+		}
+	}
+
+	SWRAP_UNLOCK(delay_queue);
+
+	return b;
+}
+
+/*
+ * Take len bytes from the bucket and return how long the packet has to wait
+ * for them. Needs to be called with the delay_queue lock held.
+ */
+static uint64_t swrap_bucket_take(struct swrap_bucket *b,
+				  uint64_t now_usec,
+				  size_t len)
+{
+	uint64_t now = now_usec * 1000;
+	uint64_t tau = b->burst * 1000000000ULL / b->rate;
+	uint64_t wait = 0;
+
+	if (b->tat_nsec < now) {
+		b->tat_nsec = now;
+	}
+	if (b->tat_nsec > now + tau) {
+		wait = b->tat_nsec - tau - now;
+	}
+
+	b->tat_nsec += (uint64_t)len * 1000000000ULL / b->rate;
+
+	return wait / 1000;
+}
+
+static void swrap_delay_drain(struct socket_info *si);
+
+struct swrap_delay_params {
+	uint64_t delay_usec;
+	const struct swrap_link *shaper;
+	struct swrap_bucket *bucket;
+	bool drop;
+	bool duplicate;
+	/* The receive queue the datagram gets charged to on arrival */
+	struct swrap_rcvq *rcvq;
+};
+
+/*
+ * Check if a packet from the socket to the given destination needs to go
+ * through the delay queue. If to is NULL, the peer of the socket is the
+ * destination.
+ */
+static bool swrap_delay_link_lookup(struct socket_info *si,
+				    const struct msghdr *msg,
+				    const struct sockaddr *to,
+				    struct swrap_delay_params *dp)
+{
+	const struct swrap_link *latency = NULL;
+	const struct swrap_link *loss = NULL;
+	const struct swrap_link *dup = NULL;
+	const struct swrap_link *reorder = NULL;
+	const struct swrap_link_policy *policy;
+	const struct sockaddr *from;
+	unsigned int flags = swrap_link_flags();
+
+	ZERO_STRUCTP(dp);
+
+	/* The stream faults and the ACLs are applied before */
+	flags &= ~(SWRAP_LINK_FAULT | SWRAP_LINK_ACL);
+	if (si->type != SOCK_DGRAM) {
+		flags &= ~SWRAP_LINK_IMPAIR;
+	}
+
+	if (to == NULL) {
+		if (si->peername.sa_socklen == 0) {
+			return false;
+		}
+		to = &si->peername.sa.s;
+	}
+	from = swrap_link_local_addr(si);
+
+	/* Datagrams vanish in a partition, streams stall before */
+	if (si->type == SOCK_DGRAM && swrap_partition_blocked(from, to)) {
+		dp->drop = true;
+		return true;
+	}
+
+	if (flags == 0) {
+		return false;
+	}
+	policy = swrap_link_policy(from, to);
+
+	if (flags & SWRAP_LINK_LATENCY) {
+		latency = swrap_link_rule(policy, SWRAP_LINK_LATENCY);
+	}
+	if (flags & SWRAP_LINK_BANDWIDTH) {
+		dp->shaper = swrap_link_rule(policy, SWRAP_LINK_BANDWIDTH);
+	}
+	if (flags & SWRAP_LINK_LOSS) {
+		loss = swrap_link_rule(policy, SWRAP_LINK_LOSS);
+	}
+	if (flags & SWRAP_LINK_DUPLICATE) {
+		dup = swrap_link_rule(policy, SWRAP_LINK_DUPLICATE);
+	}
+	if (flags & SWRAP_LINK_REORDER) {
+		reorder = swrap_link_rule(policy, SWRAP_LINK_REORDER);
+	}
+	if (latency == NULL && dp->shaper == NULL &&
+	    loss == NULL && dup == NULL && reorder == NULL) {
+		return false;
+	}
+
+#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	if (msg->msg_controllen > 0) {
+		/*
+		 * We can't hold back file descriptors, send them directly
+		 * after everything queued before has been delivered.
+		 */
+		swrap_delay_drain(si);
+		return false;
+	}
+#else
+	(void)msg; /* unused */
+#endif
+
+	/* Always roll the dice in the same order to keep runs repeatable */
+	if (loss != NULL) {
+		dp->drop = swrap_link_lost(si, loss);
+	}
+	if (dup != NULL) {
+		dp->duplicate = swrap_link_chance(si, dup->duplicate);
+	}
+	if (reorder != NULL &&
+	    swrap_link_chance(si, reorder->reorder.p)) {
+		/* Everything sent until it is due overtakes the datagram */
+		dp->delay_usec += reorder->reorder.delay_usec;
+	} else if (latency == NULL && dp->shaper == NULL &&
+		   !dp->drop && !dp->duplicate) {
+		return false;
+	}
+
+	if (latency != NULL) {
+		dp->delay_usec += swrap_link_delay_usec(si, latency);
+	}
+	if (dp->shaper != NULL && !dp->shaper->bandwidth.per_flow) {
+		dp->bucket = swrap_bucket_get(dp->shaper, from, to);
+		if (dp->bucket == NULL) {
+			dp->shaper = NULL;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * A datagram which doesn't fit into the receive buffer of the destination
+ * gets dropped like UDP does. One which is sent directly is charged now,
+ * swrap_sendmsg_after() takes it back if the send fails.
+ */
+static bool swrap_delay_lookup(struct socket_info *si,
+			       const struct msghdr *msg,
+			       const struct sockaddr *to,
+			       struct swrap_delay_params *dp)
+{
+	struct swrap_rcvq *q = NULL;
+	size_t i, len = 0;
+
+	if (si->type == SOCK_DGRAM) {
+		q = swrap_rcvq_dest(si, msg);
+	}
+
+	if (swrap_delay_link_lookup(si, msg, to, dp)) {
+		dp->rcvq = q;
+		return true;
+	}
+	if (q == NULL) {
+		return false;
+	}
+
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		len += msg->msg_iov[i].iov_len;
+	}
+
+	if (!swrap_rcvq_charge(q, len)) {
+		dp->drop = true;
+		return true;
+	}
+	si->rcvq_charged = q;
+	si->rcvq_charge = len;
+
+	return false;
+}
+
+/* Needs to be called with the delay_queue lock held */
+static void swrap_delay_insert(struct swrap_delay_pkt *pkt)
+{
+	size_t slot = pkt->tick % SWRAP_DELAY_WHEEL_SLOTS;
+
+	if (pkt->tick > swrap_delay.last_tick) {
+		swrap_delay.last_tick = pkt->tick;
+	}
+
+	pkt->next = NULL;
+	if (swrap_delay.wheel[slot].tail != NULL) {
+		swrap_delay.wheel[slot].tail->next = pkt;
+	} else {
+		swrap_delay.wheel[slot].head = pkt;
+	}
+	swrap_delay.wheel[slot].tail = pkt;
+}
+
+/*
+ * Needs to be called with the delay_queue lock held. A closed channel
+ * without packets is moved to the dead list, the caller closes the file
+ * descriptor after dropping the lock.
+ */
+static void swrap_delay_pkt_free(struct swrap_delay_pkt *pkt,
+				 struct swrap_delay_chan **dead)
+{
+	struct swrap_delay_chan *chan = pkt->chan;
+
+	/* The part which got delivered is already off the queue */
+	chan->queued -= pkt->len - pkt->ofs;
+	chan->npkts--;
+	swrap_delay.npkts--;
+	free(pkt);
+
+	if (chan->closed && chan->npkts == 0) {
+		SWRAP_DLIST_REMOVE(swrap_delay.chans, chan);
+		chan->next = *dead;
+		*dead = chan;
+	}
+}
+
+static void swrap_delay_chan_free_list(struct swrap_delay_chan *dead)
+{
+	while (dead != NULL) {
+		struct swrap_delay_chan *next = dead->next;
+
+		libc_close(dead->fd);
+		free(dead);
+		dead = next;
+	}
+}
+
+static void swrap_delay_deliver(struct swrap_delay_pkt *pkt)
+{
+	struct swrap_delay_chan *chan = pkt->chan;
+	int flags = pkt->flags | MSG_DONTWAIT;
+	ssize_t ret;
+
+#ifdef MSG_NOSIGNAL
+	/* SIGPIPE is raised for the sender when it sees the error */
+	flags |= MSG_NOSIGNAL;
+#endif
+
+	if (chan->type == SOCK_STREAM && chan->batch_stalled) {
+		pkt->state = SWRAP_DELAY_DEFERRED;
+		return;
+	}
+
+	if (pkt->rcvq != NULL && !swrap_rcvq_charge(pkt->rcvq, pkt->len)) {
+		SWRAP_LOG(SWRAP_LOG_TRACE,
+			  "Dropped delayed datagram: receive buffer full");
+		pkt->state = SWRAP_DELAY_DROPPED;
+		return;
+	}
+
+	/*
+	 * SIOCOUTQ counts the queue and what the peer didn't read, take the
+	 * bytes off the queue before the peer can read them.
+	 */
+	SWRAP_LOCK(delay_queue);
+	chan->queued -= pkt->len - pkt->ofs;
+	SWRAP_UNLOCK(delay_queue);
+
+	if (pkt->to.sa_socklen > 0) {
+		ret = libc_sendto(chan->fd,
+				  pkt->buf + pkt->ofs,
+				  pkt->len - pkt->ofs,
+				  flags,
+				  &pkt->to.sa.s,
+				  pkt->to.sa_socklen);
+	} else {
+		ret = libc_send(chan->fd,
+				pkt->buf + pkt->ofs,
+				pkt->len - pkt->ofs,
+				flags);
+	}
+
+	SWRAP_LOCK(delay_queue);
+	chan->queued += pkt->len - pkt->ofs - MAX(ret, 0);
+	SWRAP_UNLOCK(delay_queue);
+
+	if (chan->type != SOCK_STREAM) {
+		if (ret == -1) {
+			SWRAP_LOG(SWRAP_LOG_TRACE,
+				  "Dropped delayed datagram: %s",
+				  strerror(errno));
+			if (pkt->rcvq != NULL) {
+				swrap_rcvq_uncharge(pkt->rcvq, pkt->len);
+			}
+			pkt->state = SWRAP_DELAY_DROPPED;
+		} else {
+			pkt->ofs = pkt->len;
+			pkt->state = SWRAP_DELAY_DONE;
+		}
+		return;
+	}
+
+	if (ret == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			pkt->state = SWRAP_DELAY_STALLED;
+		} else {
+			pkt->error = errno;
+			pkt->state = SWRAP_DELAY_FAILED;
+		}
+		chan->batch_stalled = true;
+		return;
+	}
+
+	pkt->ofs += ret;
+	if (pkt->ofs < pkt->len) {
+		/* The receiver is not reading, retry on the next tick */
+		pkt->state = SWRAP_DELAY_STALLED;
+		chan->batch_stalled = true;
+		return;
+	}
+
+	pkt->state = SWRAP_DELAY_DONE;
+}
+
+/* Needs to be called with the delay_queue lock held */
+static struct swrap_delay_pkt *swrap_delay_collect(uint64_t now_tick,
+					struct swrap_delay_chan **dead)
+{
+	struct swrap_delay_pkt *batch = NULL;
+	struct swrap_delay_pkt **batch_tail = &batch;
+
+	if (swrap_delay.npkts == 0) {
+		swrap_delay.tick = now_tick + 1;
+		return NULL;
+	}
+
+	while (swrap_delay.tick <= now_tick) {
+		size_t slot = swrap_delay.tick % SWRAP_DELAY_WHEEL_SLOTS;
+		struct swrap_delay_pkt *pkt = swrap_delay.wheel[slot].head;
+
+		swrap_delay.wheel[slot].head = NULL;
+		swrap_delay.wheel[slot].tail = NULL;
+
+		while (pkt != NULL) {
+			struct swrap_delay_pkt *next = pkt->next;
+			struct swrap_delay_chan *chan = pkt->chan;
+
+			if (pkt->tick > swrap_delay.tick) {
+				/* Not due in this round of the wheel */
+				swrap_delay_insert(pkt);
+			} else if (chan->error != 0) {
+				swrap_delay_pkt_free(pkt, dead);
+			} else if (chan->type == SOCK_STREAM &&
+				   pkt->seq != chan->deliver_seq +
+					       chan->batch_count) {
+				/* An earlier segment is still waiting */
+				pkt->tick = swrap_delay.tick + 1;
+				swrap_delay_insert(pkt);
+			} else {
+				if (chan->type == SOCK_STREAM) {
+					chan->batch_count++;
+				}
+				pkt->next = NULL;
+				*batch_tail = pkt;
+				batch_tail = &pkt->next;
+			}
+
+			pkt = next;
+		}
+
+		swrap_delay.tick++;
+	}
+
+	return batch;
+}
+
+/* Needs to be called with the delay_queue lock held */
+static void swrap_delay_finish(struct swrap_delay_pkt *batch,
+			       struct swrap_delay_chan **dead)
+{
+	while (batch != NULL) {
+		struct swrap_delay_pkt *pkt = batch;
+		struct swrap_delay_chan *chan = pkt->chan;
+
+		batch = pkt->next;
+
+		chan->batch_count = 0;
+		chan->batch_stalled = false;
+
+		switch (pkt->state) {
+		case SWRAP_DELAY_STALLED:
+		case SWRAP_DELAY_DEFERRED:
+			pkt->tick = swrap_delay.tick;
+			swrap_delay_insert(pkt);
+			break;
+		case SWRAP_DELAY_FAILED:
+			chan->error = pkt->error;
+			/* FALL THROUGH */
+		case SWRAP_DELAY_DONE:
+		case SWRAP_DELAY_DROPPED:
+			if (chan->type == SOCK_STREAM) {
+				chan->deliver_seq++;
+			}
+			swrap_delay_pkt_free(pkt, dead);
+			break;
+		}
+	}
+
+	pthread_cond_broadcast(&swrap_delay.space);
+}
+
+static void *swrap_delay_thread(void *arg)
+{
+	(void)arg; /* unused */
+
+	SWRAP_LOCK(delay_queue);
+
+	while (!swrap_delay.stopping) {
+		struct swrap_delay_chan *dead = NULL;
+		struct swrap_delay_pkt *batch;
+		struct swrap_delay_pkt *pkt;
+		uint64_t now_tick;
+
+		now_tick = swrap_monotonic_usec() / SWRAP_DELAY_TICK_USEC;
+
+		batch = swrap_delay_collect(now_tick, &dead);
+		if (batch != NULL) {
+			SWRAP_UNLOCK(delay_queue);
+
+			for (pkt = batch; pkt != NULL; pkt = pkt->next) {
+				swrap_delay_deliver(pkt);
+			}
+
+			SWRAP_LOCK(delay_queue);
+
+			swrap_delay_finish(batch, &dead);
+		}
+
+		if (dead != NULL) {
+			SWRAP_UNLOCK(delay_queue);
+			swrap_delay_chan_free_list(dead);
+			SWRAP_LOCK(delay_queue);
+		}
+
+		if (batch != NULL || swrap_delay.stopping) {
+			continue;
+		}
+
+		if (swrap_delay.npkts == 0) {
+			pthread_cond_wait(&swrap_delay.wakeup,
+					  &delay_queue_mutex);
+		} else {
+			struct timespec ts;
+			uint64_t t;
+
+			for (t = swrap_delay.tick;
+			     t < swrap_delay.tick + SWRAP_DELAY_WHEEL_SLOTS;
+			     t++) {
+				size_t slot = t % SWRAP_DELAY_WHEEL_SLOTS;
+
+				if (swrap_delay.wheel[slot].head != NULL) {
+					break;
+				}
+			}
+
+			swrap_usec_to_timespec(t * SWRAP_DELAY_TICK_USEC, &ts);
+			pthread_cond_timedwait(&swrap_delay.wakeup,
+					       &delay_queue_mutex,
+					       &ts);
+		}
+	}
+
+	SWRAP_UNLOCK(delay_queue);
+
+	return NULL;
+}
+
+/* Needs to be called with the delay_queue lock held */
+static int swrap_delay_start_thread(void)
+{
+	sigset_t all, old;
+	int rc;
+
+	/* Signals are for the application threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	rc = pthread_create(&swrap_delay.thread,
+			    NULL,
+			    swrap_delay_thread,
+			    NULL);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (rc != 0) {
+		SWRAP_LOG(SWRAP_LOG_ERROR,
+			  "Failed to start the delay thread: %s",
+			  strerror(rc));
+		return rc;
+	}
+
+	swrap_delay.running = true;
+
+	return 0;
+}
+
+static struct swrap_delay_chan *swrap_delay_chan_get(int fd,
+						     struct socket_info *si)
+{
+	struct swrap_delay_chan *chan;
+	int dup_fd;
+
+	if (si->delay_chan != NULL) {
+		return si->delay_chan;
+	}
+
+	chan = (struct swrap_delay_chan *)calloc(1, sizeof(*chan));
+	if (chan == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	dup_fd = libc_fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dup_fd == -1) {
+		free(chan);
+		return NULL;
+	}
+
+	chan->fd = dup_fd;
+	chan->type = si->type;
+
+	SWRAP_LOCK(delay_queue);
+	SWRAP_DLIST_ADD(swrap_delay.chans, chan);
+	SWRAP_UNLOCK(delay_queue);
+
+	si->delay_chan = chan;
+
+	return chan;
+}
+
+static ssize_t swrap_delay_sendmsg(int fd,
+				   struct socket_info *si,
+				   const struct msghdr *msg,
+				   int flags,
+				   const struct swrap_delay_params *dp)
+{
+	struct swrap_delay_chan *chan;
+	struct swrap_delay_pkt *pkt;
+	struct swrap_delay_pkt *dup = NULL;
+	bool nonblock = (flags & MSG_DONTWAIT) != 0;
+	bool checked = nonblock;
+	size_t i, len = 0;
+	uint64_t delay_usec = dp->delay_usec;
+	uint64_t shape_usec = 0;
+	uint64_t now;
+	int err = 0;
+
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		len += msg->msg_iov[i].iov_len;
+	}
+
+	if (dp->drop) {
+		SWRAP_LOG(SWRAP_LOG_TRACE,
+			  "Dropping %zu bytes on fd %d", len, fd);
+		si->impaired = SWRAP_IMPAIR_DROPPED;
+		return len;
+	}
+
+	chan = swrap_delay_chan_get(fd, si);
+	if (chan == NULL) {
+		return -1;
+	}
+
+	pkt = (struct swrap_delay_pkt *)malloc(sizeof(*pkt) + len);
+	if (pkt == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ZERO_STRUCTP(pkt);
+
+	if (dp->duplicate) {
+		dup = (struct swrap_delay_pkt *)malloc(sizeof(*dup) + len);
+	}
+
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		memcpy(pkt->buf + pkt->len,
+		       msg->msg_iov[i].iov_base,
+		       msg->msg_iov[i].iov_len);
+		pkt->len += msg->msg_iov[i].iov_len;
+	}
+
+	if (msg->msg_name != NULL &&
+	    msg->msg_namelen <= sizeof(pkt->to.sa)) {
+		memcpy(&pkt->to.sa.ss, msg->msg_name, msg->msg_namelen);
+		pkt->to.sa_socklen = msg->msg_namelen;
+	}
+	pkt->rcvq = dp->rcvq;
+	pkt->chan = chan;
+	pkt->flags = flags & ~MSG_DONTWAIT;
+
+	SWRAP_LOCK(delay_queue);
+
+	for (;;) {
+		if (chan->error != 0) {
+			err = chan->error;
+			break;
+		}
+		if (chan->queued == 0 ||
+		    chan->queued + len <= SWRAP_DELAY_QUEUE_MAX) {
+			break;
+		}
+		if (!checked) {
+			int fl;
+
+			SWRAP_UNLOCK(delay_queue);
+			fl = libc_fcntl(fd, F_GETFL);
+			SWRAP_LOCK(delay_queue);
+
+			nonblock = fl != -1 && (fl & O_NONBLOCK);
+			checked = true;
+			continue;
+		}
+		if (nonblock) {
+			err = EAGAIN;
+			break;
+		}
+		pthread_cond_wait(&swrap_delay.space, &delay_queue_mutex);
+	}
+
+	if (err == 0 && !swrap_delay.running) {
+		err = swrap_delay_start_thread();
+	}
+
+	if (err != 0) {
+		SWRAP_UNLOCK(delay_queue);
+		free(pkt);
+		free(dup);
+#ifdef MSG_NOSIGNAL
+		if (err == EPIPE && !(flags & MSG_NOSIGNAL)) {
+			raise(SIGPIPE);
+		}
+#endif
+		errno = err;
+		return -1;
+	}
+
+	now = swrap_monotonic_usec();
+	if (swrap_delay.npkts == 0) {
+		swrap_delay.tick = now / SWRAP_DELAY_TICK_USEC;
+	}
+
+	if (dp->shaper != NULL) {
+		struct swrap_bucket *b = dp->bucket;
+
+		if (b == NULL) {
+			b = &chan->bucket;
+			if (b->rate == 0) {
+				swrap_bucket_init(b, dp->shaper);
+			}
+		}
+		shape_usec = swrap_bucket_take(b, now, len);
+		delay_usec += shape_usec;
+	}
+
+	pkt->tick = (now + delay_usec + SWRAP_DELAY_TICK_USEC - 1) /
+		    SWRAP_DELAY_TICK_USEC;
+	if (pkt->tick < swrap_delay.tick) {
+		pkt->tick = swrap_delay.tick;
+	}
+	if (chan->type == SOCK_STREAM) {
+		/* A segment can't overtake the one sent before */
+		if (pkt->tick < chan->last_tick) {
+			pkt->tick = chan->last_tick;
+		}
+		chan->last_tick = pkt->tick;
+		pkt->seq = chan->next_seq++;
+	}
+
+	swrap_delay_insert(pkt);
+	chan->queued += len;
+	chan->npkts++;
+	swrap_delay.npkts++;
+
+	if (dup != NULL) {
+		memcpy(dup, pkt, sizeof(*pkt) + len);
+		swrap_delay_insert(dup);
+		chan->queued += len;
+		chan->npkts++;
+		swrap_delay.npkts++;
+		si->impaired = SWRAP_IMPAIR_DUPLICATED;
+	}
+
+	pthread_cond_signal(&swrap_delay.wakeup);
+
+	SWRAP_UNLOCK(delay_queue);
+
+	SWRAP_LOG(SWRAP_LOG_TRACE,
+		  "Delaying %zu bytes on fd %d by %lluus",
+		  len, fd, (unsigned long long)delay_usec);
+
+	if (shape_usec > 0 && !checked) {
+		int fl = libc_fcntl(fd, F_GETFL);
+
+		nonblock = fl != -1 && (fl & O_NONBLOCK);
+	}
+
+	/*
+	 * A blocking sender is paced by the bucket, it returns once the
+	 * data passed it. A signal ends the wait, the data is queued.
+	 */
+	if (shape_usec > 0 && !nonblock) {
+		struct timespec ts = {
+			.tv_sec = shape_usec / 1000000,
+			.tv_nsec = (shape_usec % 1000000) * 1000,
+		};
+
+		nanosleep(&ts, NULL);
+	}
+
+	return len;
+}
+
+/* Wait until everything queued on the socket has been delivered */
+static void swrap_delay_drain(struct socket_info *si)
+{
+	struct swrap_delay_chan *chan = si->delay_chan;
+
+	if (chan == NULL) {
+		return;
+	}
+
+	SWRAP_LOCK(delay_queue);
+	while (chan->npkts > 0 && chan->error == 0) {
+		pthread_cond_wait(&swrap_delay.space, &delay_queue_mutex);
+	}
+	SWRAP_UNLOCK(delay_queue);
+}
+
+/* If a send of len bytes doesn't have to wait for the delay queue */
+static bool swrap_delay_room(struct socket_info *si, size_t len)
+{
+	struct swrap_delay_chan *chan = si->delay_chan;
+	bool room;
+
+	if (chan == NULL) {
+		return true;
+	}
+
+	SWRAP_LOCK(delay_queue);
+	room = chan->error != 0 ||
+	       chan->queued == 0 ||
+	       chan->queued + len <= SWRAP_DELAY_QUEUE_MAX;
+	SWRAP_UNLOCK(delay_queue);
+
+	return room;
+}
+
+/* Called when the last reference to a socket is closed */
+static void swrap_delay_release(struct socket_info *si)
+{
+	struct swrap_delay_chan *chan = si->delay_chan;
+	bool idle;
+
+	si->loss_bad = false;
+	si->impaired = 0;
+	ZERO_STRUCT(si->fault);
+
+	if (chan == NULL) {
+		return;
+	}
+	si->delay_chan = NULL;
+
+	SWRAP_LOCK(delay_queue);
+	chan->closed = true;
+	idle = chan->npkts == 0;
+	if (idle) {
+		SWRAP_DLIST_REMOVE(swrap_delay.chans, chan);
+	}
+	SWRAP_UNLOCK(delay_queue);
+
+	/* Otherwise the delivery thread frees it with the last packet */
+	if (idle) {
+		chan->next = NULL;
+		swrap_delay_chan_free_list(chan);
+	}
+}
+
+/* The bytes of the socket held in the delay queue */
+static size_t swrap_delay_queued(struct socket_info *si)
+{
+	size_t queued = 0;
+
+	if (si->delay_chan != NULL) {
+		SWRAP_LOCK(delay_queue);
+		queued = si->delay_chan->queued;
+		SWRAP_UNLOCK(delay_queue);
+	}
+
+	return queued;
+}
+
+/*
+ * The child doesn't have the delivery thread, the packets in flight are
+ * delivered by the parent.
+ */
+static void swrap_delay_atfork_child(void)
+{
+	struct swrap_delay_chan *dead = swrap_delay.chans;
+	size_t i;
+
+	for (i = 0; i < SWRAP_DELAY_WHEEL_SLOTS; i++) {
+		struct swrap_delay_pkt *pkt = swrap_delay.wheel[i].head;
+
+		while (pkt != NULL) {
+			struct swrap_delay_pkt *next = pkt->next;
+
+			free(pkt);
+			pkt = next;
+		}
+		swrap_delay.wheel[i].head = NULL;
+		swrap_delay.wheel[i].tail = NULL;
+	}
+
+	swrap_delay.chans = NULL;
+	swrap_delay.npkts = 0;
+	swrap_delay.running = false;
+	swrap_delay.stopping = false;
+
+	swrap_delay_chan_free_list(dead);
+
+	if (sockets != NULL) {
+		for (i = 0; i < max_sockets; i++) {
+			sockets[i].delay_chan = NULL;
+		}
+	}
+
+	swrap_delay_init_conds();
+}
+
+static void swrap_delay_destructor(void)
+{
+	uint64_t deadline;
+
+	SWRAP_LOCK(delay_queue);
+
+	if (!swrap_delay.running) {
+		SWRAP_UNLOCK(delay_queue);
+		return;
+	}
+
+	deadline = swrap_monotonic_usec();
+	if (swrap_delay.last_tick * SWRAP_DELAY_TICK_USEC > deadline) {
+		deadline = swrap_delay.last_tick * SWRAP_DELAY_TICK_USEC;
+	}
+	deadline += SWRAP_DELAY_DRAIN_USEC;
+	while (swrap_delay.npkts > 0 && swrap_monotonic_usec() < deadline) {
+		struct timespec ts;
+
+		swrap_usec_to_timespec(deadline, &ts);
+		pthread_cond_timedwait(&swrap_delay.space,
+				       &delay_queue_mutex,
+				       &ts);
+	}
+
+	swrap_delay.stopping = true;
+	pthread_cond_signal(&swrap_delay.wakeup);
+
+	SWRAP_UNLOCK(delay_queue);
+
+	pthread_join(swrap_delay.thread, NULL);
+	swrap_delay.running = false;
+}
+
+/*
+ * Stream faults. A rule applies to the data flowing from SRC to DST, so
+ * the sender checks it for its writes and the receiver for its reads. Both
+ * count the bytes of the connection, a reset after N bytes hits both ends
+ * at the same position of the stream.
+ */
+#define SWRAP_FAULT_SEND 0
+#define SWRAP_FAULT_RECV 1
+
+static const struct swrap_link *swrap_fault_find(struct socket_info *si,
+						 int dir)
+{
+	const struct sockaddr *local;
+	const struct sockaddr *peer;
+
+	if ((swrap_link_flags() & SWRAP_LINK_FAULT) == 0 ||
+	    si->type != SOCK_STREAM ||
+	    si->peername.sa_socklen == 0) {
+		return NULL;
+	}
+
+	local = swrap_link_local_addr(si);
+	peer = &si->peername.sa.s;
+
+	if (dir == SWRAP_FAULT_SEND) {
+		return swrap_link_rule(swrap_link_policy(local, peer),
+				       SWRAP_LINK_FAULT);
+	}
+
+	return swrap_link_rule(swrap_link_policy(peer, local), SWRAP_LINK_FAULT);
+}
+
+static int swrap_ring_timeout(int fd, int optname);
+
+static bool swrap_fault_nonblock(int fd)
+{
+	int fl = libc_fcntl(fd, F_GETFL);
+
+	return fl != -1 && (fl & O_NONBLOCK);
+}
+
+static bool swrap_fault_stalled(struct socket_info *si, int dir)
+{
+	return si->fault.stall_until[dir] > swrap_monotonic_usec();
+}
+
+/* If the stream can't move data in the direction due to a partition */
+static bool swrap_fault_partitioned(struct socket_info *si, int dir)
+{
+	const struct sockaddr *local;
+	const struct sockaddr *peer;
+
+	if (si->type != SOCK_STREAM || si->peername.sa_socklen == 0) {
+		return false;
+	}
+
+	local = swrap_link_local_addr(si);
+	peer = &si->peername.sa.s;
+
+	if (dir == SWRAP_FAULT_SEND) {
+		return swrap_partition_blocked(local, peer);
+	}
+
+	return swrap_partition_blocked(peer, local);
+}
+
+static void swrap_fault_reset(int fd, struct socket_info *si, int dir)
+{
+	SWRAP_LOG(SWRAP_LOG_TRACE,
+		  "Resetting fd %d after %llu bytes",
+		  fd, (unsigned long long)si->fault.bytes[dir]);
+
+	si->fault.reset = true;
+
+	/* Wake up the peer, it sees the end of the stream */
+	libc_shutdown(fd, SHUT_RDWR);
+
+	if (dir == SWRAP_FAULT_SEND) {
+		swrap_pcap_dump_packet(si, NULL, SWRAP_SEND_RST, NULL, 0);
+	} else {
+		swrap_pcap_dump_packet(si, NULL, SWRAP_RECV_RST, NULL, 0);
+	}
+}
+
+/*
+ * Cut the message down to max bytes. Like for the MTU we can only shorten
+ * the first iovec, otherwise the message ends at an iovec boundary.
+ */
+static void swrap_fault_trim(struct msghdr *msg,
+			     struct iovec *tmp_iov,
+			     size_t max)
+{
+	size_t i, len = 0;
+
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		if (len + msg->msg_iov[i].iov_len > max) {
+			break;
+		}
+		len += msg->msg_iov[i].iov_len;
+	}
+
+	if (i == (size_t)msg->msg_iovlen) {
+		return;
+	}
+	if (i > 0) {
+		msg->msg_iovlen = i;
+		return;
+	}
+
+	*tmp_iov = msg->msg_iov[0];
+	tmp_iov->iov_len = max;
+	msg->msg_iov = tmp_iov;
+	msg->msg_iovlen = 1;
+}
+
+/* Called before a stream socket sends or receives data */
+static int swrap_fault_before(int fd,
+			      struct socket_info *si,
+			      struct msghdr *msg,
+			      struct iovec *tmp_iov,
+			      int dir)
+{
+	const struct swrap_link *l;
+	size_t i, len = 0;
+	size_t max;
+	uint64_t now;
+
+	if (si->fault.reset) {
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	/*
+	 * Wait for the partition to heal, like TCP retransmitting. The
+	 * timeout of the socket ends the wait, and so does a signal.
+	 */
+	if (swrap_fault_partitioned(si, dir)) {
+		uint64_t deadline = 0;
+		struct timespec ts;
+		int timeout;
+
+		if (swrap_fault_nonblock(fd)) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		timeout = swrap_ring_timeout(fd,
+					     dir == SWRAP_FAULT_SEND ?
+					     SO_SNDTIMEO : SO_RCVTIMEO);
+		if (timeout >= 0) {
+			deadline = swrap_monotonic_usec() +
+				   (uint64_t)timeout * 1000;
+		}
+
+		do {
+			if (deadline != 0 && swrap_monotonic_usec() >= deadline) {
+				errno = EAGAIN;
+				return -1;
+			}
+
+			swrap_usec_to_timespec(SWRAP_PARTITION_POLL_USEC, &ts);
+			if (nanosleep(&ts, NULL) == -1 && errno == EINTR) {
+				return -1;
+			}
+		} while (swrap_fault_partitioned(si, dir));
+	}
+
+	l = swrap_fault_find(si, dir);
+	if (l == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		len += msg->msg_iov[i].iov_len;
+	}
+	max = len;
+
+	if (l->fault.reset_bytes > 0) {
+		uint64_t left = 0;
+
+		if (si->fault.bytes[dir] < l->fault.reset_bytes) {
+			left = l->fault.reset_bytes - si->fault.bytes[dir];
+		}
+		if (left == 0) {
+			swrap_fault_reset(fd, si, dir);
+			errno = ECONNRESET;
+			return -1;
+		}
+		max = MIN(max, left);
+	}
+
+	/* A call which waited for a stall to end is not stalled again */
+	now = swrap_monotonic_usec();
+	if (si->fault.stall_until[dir] == 0 &&
+	    swrap_link_chance(si, l->fault.stall_p)) {
+		si->fault.stall_until[dir] = now + l->fault.stall_usec;
+	}
+	if (si->fault.stall_until[dir] > now) {
+		struct timespec ts;
+
+		if (swrap_fault_nonblock(fd)) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		swrap_usec_to_timespec(si->fault.stall_until[dir] - now, &ts);
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+	}
+	si->fault.stall_until[dir] = 0;
+
+	if (si->fault.eagain[dir] > 0) {
+		si->fault.eagain[dir]--;
+		errno = EAGAIN;
+		return -1;
+	}
+	if (swrap_link_chance(si, l->fault.eagain_p) &&
+	    swrap_fault_nonblock(fd)) {
+		si->fault.eagain[dir] = l->fault.eagain_count - 1;
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (max > 1 && swrap_link_chance(si, l->fault.short_p)) {
+		max = 1 + swrap_link_random(si) % (max - 1);
+	}
+
+	if (max < len) {
+		swrap_fault_trim(msg, tmp_iov, max);
+	}
+
+	return 0;
+}
+
+/****************************************************************************
+ *   PROFILING REPORT
+ ***************************************************************************/
+
+#define SWRAP_PROF_REPORT_SIZE 8192
+
+static uint64_t swrap_prof_percentile(const struct swrap_prof_hist *h,
+				      unsigned int permille)
+{
+	uint64_t rank = (h->count * permille + 999) / 1000;
+	uint64_t n = 0;
+	unsigned int b;
+
+	for (b = 0; b < SWRAP_PROF_BUCKETS; b++) {
+		n += h->buckets[b];
+		if (n >= rank) {
+			break;
+		}
+	}
+
+	return MIN(swrap_prof_bucket_max(b), h->max);
+}
+
+static int swrap_prof_format(char *buf,
+			     size_t size,
+			     const char *what,
+			     const struct swrap_prof_hist *h,
+			     double nsec_per_tick)
+{
+	return snprintf(buf, size,
+			" %s p50 %.0f p90 %.0f p99 %.0f p99.9 %.0f max %.0f",
+			what,
+			swrap_prof_percentile(h, 500) * nsec_per_tick,
+			swrap_prof_percentile(h, 900) * nsec_per_tick,
+			swrap_prof_percentile(h, 990) * nsec_per_tick,
+			swrap_prof_percentile(h, 999) * nsec_per_tick,
+			h->max * nsec_per_tick);
+}
+
+/*
+ * Appends the merged histograms of all threads to the file of
+ * SOCKET_WRAPPER_PROFILE, in a single write so the reports of several
+ * processes don't get mixed up. The times are in nanoseconds.
+ */
+void socket_wrapper_profile_dump(void)
+{
+	struct swrap_prof_hist *merged;
+	struct swrap_prof_thread *t;
+	const char *path = getenv("SOCKET_WRAPPER_PROFILE");
+	char buf[SWRAP_PROF_REPORT_SIZE];
+	double nsec_per_tick = 1.0;
+	uint64_t ticks, nsec;
+	size_t len = 0;
+	unsigned int f;
+	int saved_errno = errno;
+	int fd;
+
+	if (!swrap_prof_enabled() || path == NULL || path[0] == '\0') {
+		return;
+	}
+
+	merged = (struct swrap_prof_hist *)calloc(SWRAP_PROF_NUM * 2,
+						  sizeof(*merged));
+	if (merged == NULL) {
+		errno = saved_errno;
+		return;
+	}
+
+	SWRAP_LOCK(profile);
+	swrap_prof_merge(merged, &swrap_prof.retired[0][0]);
+	for (t = swrap_prof.threads; t != NULL; t = t->next) {
+		swrap_prof_merge(merged, &t->hist[0][0]);
+	}
+	SWRAP_UNLOCK(profile);
+
+	ticks = swrap_prof_ticks() - swrap_prof.start_ticks;
+	nsec = swrap_prof_nsec() - swrap_prof.start_nsec;
+	if (ticks > 0 && ticks != nsec) {
+		nsec_per_tick = (double)nsec / ticks;
+	}
+
+	len += snprintf(buf + len, sizeof(buf) - len,
+			"socket_wrapper profile of pid %d, times in ns\n",
+			(int)getpid());
+
+	for (f = 0; f < SWRAP_PROF_NUM; f++) {
+		const struct swrap_prof_hist *w = &merged[f * 2];
+
+		if (w->count == 0 || len >= sizeof(buf)) {
+			continue;
+		}
+
+		len += snprintf(buf + len, sizeof(buf) - len,
+				"%-10s calls %llu",
+				swrap_prof_names[f],
+				(unsigned long long)w->count);
+		if (len < sizeof(buf)) {
+			len += swrap_prof_format(buf + len, sizeof(buf) - len,
+						 "wrapper", w, nsec_per_tick);
+		}
+		if (len < sizeof(buf)) {
+			len += swrap_prof_format(buf + len, sizeof(buf) - len,
+						 "libc", &merged[f * 2 + 1],
+						 nsec_per_tick);
+		}
+		if (len < sizeof(buf)) {
+			len += snprintf(buf + len, sizeof(buf) - len, "\n");
+		}
+	}
+	len = MIN(len, sizeof(buf) - 1);
+
+	free(merged);
+
+	fd = libc_open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		SWRAP_LOG(SWRAP_LOG_ERROR,
+			  "Failed to open the profile file %s",
+			  path);
+		errno = saved_errno;
+		return;
+	}
+
+	if (libc_write(fd, buf, len) != (ssize_t)len) {
+		SWRAP_LOG(SWRAP_LOG_ERROR, "Failed to write the profile");
+	}
+	libc_close(fd);
+
+	errno = saved_errno;
+}
+
+/* Only the thread calling fork() lives on, it starts from zero */
+static void swrap_prof_atfork_child(void)
+{
+	struct swrap_prof_thread *t = swrap_prof.threads;
+
+	while (t != NULL) {
+		struct swrap_prof_thread *next = t->next;
+
+		if (t != swrap_prof_self) {
+			free(t);
+		}
+		t = next;
+	}
+
+	swrap_prof.threads = NULL;
+	memset(swrap_prof.retired, 0, sizeof(swrap_prof.retired));
+	if (swrap_prof_self != NULL) {
+		memset(swrap_prof_self->hist, 0, sizeof(swrap_prof_self->hist));
+		swrap_prof_self->next = NULL;
+		swrap_prof.threads = swrap_prof_self;
+	}
+}
+
+static void swrap_prof_destructor(void)
+{
+	if (__atomic_load_n(&swrap_prof.state, __ATOMIC_ACQUIRE) !=
+	    SWRAP_PROF_ON) {
+		return;
+	}
+
+	socket_wrapper_profile_dump();
+}
+
+/****************************************************************************
+ *   STATISTICS
+ ***************************************************************************/
+
+/*
+ * The counters of the process in the file .stats-<pid> of the socket
+ * directory, see swrap_shm.h for the layout. The file gets created in the
+ * directory of the first socket call and removed when the process exits.
+ * swrap_stats prints them while the test is running.
+ */
+static struct {
+	struct swrap_stats_header *hdr;
+	size_t size;
+	bool disabled;
+	char path[1024];
+} swrap_stats;
+
+static void swrap_stats_init(void)
+{
+	struct swrap_stats_header *hdr;
+	size_t num_sockets = socket_wrapper_max_sockets();
+	const char *dir;
+	const char *s;
+	size_t size;
+	void *p;
+	int rc;
+	int fd;
+
+	swrap_stats.disabled = true;
+
+	s = getenv("SOCKET_WRAPPER_STATS");
+	if (s == NULL || strcmp(s, "1") != 0) {
+		return;
+	}
+	dir = socket_wrapper_dir();
+	if (dir == NULL) {
+		return;
+	}
+
+	rc = snprintf(swrap_stats.path, sizeof(swrap_stats.path), "%s/%s%d",
+		      dir, SWRAP_STATS_FILE_PREFIX, (int)getpid());
+	if (rc <= 0 || (size_t)rc >= sizeof(swrap_stats.path)) {
+		swrap_stats.path[0] = '\0';
+		return;
+	}
+
+	/* A file left behind by a process with the same pid starts over */
+	fd = libc_open(swrap_stats.path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (fd == -1) {
+		SWRAP_LOG(SWRAP_LOG_ERROR,
+			  "Failed to create %s: %s",
+			  swrap_stats.path, strerror(errno));
+		swrap_stats.path[0] = '\0';
+		return;
+	}
+
+	size = swrap_stats_size(num_sockets);
+	rc = ftruncate(fd, size);
+	if (rc == -1) {
+		libc_close(fd);
+		unlink(swrap_stats.path);
+		swrap_stats.path[0] = '\0';
+		return;
+	}
+
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	libc_close(fd);
+	if (p == MAP_FAILED) {
+		unlink(swrap_stats.path);
+		swrap_stats.path[0] = '\0';
+		return;
+	}
+	hdr = (struct swrap_stats_header *)p;
+
+	hdr->version = SWRAP_STATS_VERSION;
+	hdr->pid = getpid();
+	hdr->num_ifaces = SWRAP_STATS_IFACES;
+	hdr->num_sockets = num_sockets;
+	hdr->num_counters = SWRAP_STATS_NUM;
+	hdr->ifaces_offset = sizeof(struct swrap_stats_header);
+	hdr->sockets_offset = hdr->ifaces_offset +
+		SWRAP_STATS_IFACES * sizeof(struct swrap_stats_iface);
+	__atomic_store_n(&hdr->magic, SWRAP_STATS_MAGIC, __ATOMIC_RELEASE);
+
+	SWRAP_LOG(SWRAP_LOG_TRACE, "Publishing statistics in %s", swrap_stats.path);
+
+	swrap_stats.size = size;
+	swrap_stats.disabled = false;
+	__atomic_store_n(&swrap_stats.hdr, hdr, __ATOMIC_RELEASE);
+}
+
+static struct swrap_stats_header *swrap_stats_get(void)
+{
+	struct swrap_stats_header *hdr;
+
+	hdr = __atomic_load_n(&swrap_stats.hdr, __ATOMIC_ACQUIRE);
+	if (hdr != NULL || __atomic_load_n(&swrap_stats.disabled,
+					   __ATOMIC_RELAXED)) {
+		return hdr;
+	}
+
+	SWRAP_LOCK(stats);
+	if (swrap_stats.hdr == NULL && !swrap_stats.disabled) {
+		int saved_errno = errno;
+
+		swrap_stats_init();
+		errno = saved_errno;
+	}
+	SWRAP_UNLOCK(stats);
+
+	return swrap_stats.hdr;
+}
+
+/* The child publishes its own counters */
+static void swrap_stats_atfork_child(void)
+{
+	if (swrap_stats.hdr != NULL) {
+		munmap(swrap_stats.hdr, swrap_stats.size);
+	}
+	swrap_stats.hdr = NULL;
+	swrap_stats.disabled = false;
+	swrap_stats.path[0] = '\0';
+}
+
+static void swrap_stats_destructor(void)
+{
+	if (swrap_stats.hdr == NULL) {
+		return;
+	}
+
+	unlink(swrap_stats.path);
+	munmap(swrap_stats.hdr, swrap_stats.size);
+	swrap_stats.hdr = NULL;
+}
+
+/* Announce a change of the fields besides the counters to the readers */
+static void swrap_stats_change_begin(uint32_t *seq)
+{
+	__atomic_fetch_add(seq, SWRAP_STATS_SEQ_BUSY, __ATOMIC_ACQ_REL);
+
+	/* The fields must not change before the readers can notice */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void swrap_stats_change_end(uint32_t *seq)
+{
+	__atomic_fetch_add(seq, SWRAP_STATS_SEQ_DONE, __ATOMIC_RELEASE);
+}
+
+static struct swrap_stats_iface *swrap_stats_iface_row(
+		struct swrap_stats_header *hdr,
+		unsigned int iface)
+{
+	struct swrap_stats_iface *rows = (struct swrap_stats_iface *)
+		(void *)((uint8_t *)hdr + hdr->ifaces_offset);
+	uint32_t key = iface + 1;
+	size_t i = (key * 2654435761U) & (SWRAP_STATS_IFACES - 1);
+	size_t n;
+
+	for (n = 0; n < SWRAP_STATS_IFACES; n++) {
+		uint32_t k = __atomic_load_n(&rows[i].key, __ATOMIC_ACQUIRE);
+
+		if (k == 0 &&
+		    __atomic_compare_exchange_n(&rows[i].key, &k, key, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			return &rows[i];
+		}
+		if (k == key) {
+			return &rows[i];
+		}
+		i = (i + 1) & (SWRAP_STATS_IFACES - 1);
+	}
+
+	return NULL;
+}
+
+struct swrap_stats_rows {
+	struct swrap_stats_sock *sock;
+	struct swrap_stats_iface *iface;
+};
+
+#define SWRAP_STATS_SET(row, field, value) \
+	__atomic_store_n(&(row)->field, (value), __ATOMIC_RELAXED)
+#define SWRAP_STATS_GET(row, field) \
+	__atomic_load_n(&(row)->field, __ATOMIC_RELAXED)
+
+/* What the row of the socket should say, besides the counters */
+static void swrap_stats_describe(int fd,
+				 struct socket_info *si,
+				 struct swrap_stats_sock *d)
+{
+	const struct swrap_address *local = &si->myname;
+
+	d->state = SWRAP_STATS_SOCK_OPEN;
+	d->fd = fd;
+	d->family = si->family;
+	d->type = si->type;
+
+	if (swrap_addr_is_any(local) && si->bindname.sa_socklen > 0) {
+		local = &si->bindname;
+	}
+
+	d->local_iface = swrap_sockaddr_iface(&local->sa.s);
+	d->local_port = ntohs(swrap_addr_port(local));
+	d->peer_iface = 0;
+	d->peer_port = 0;
+	if (si->peername.sa_socklen > 0) {
+		d->peer_iface = swrap_sockaddr_iface(&si->peername.sa.s);
+		d->peer_port = ntohs(swrap_addr_port(&si->peername));
+	}
+}
+
+static bool swrap_stats_described(const struct swrap_stats_sock *row,
+				  const struct swrap_stats_sock *d)
+{
+	return SWRAP_STATS_GET(row, state) == d->state &&
+	       SWRAP_STATS_GET(row, fd) == d->fd &&
+	       SWRAP_STATS_GET(row, family) == d->family &&
+	       SWRAP_STATS_GET(row, type) == d->type &&
+	       SWRAP_STATS_GET(row, local_iface) == d->local_iface &&
+	       SWRAP_STATS_GET(row, peer_iface) == d->peer_iface &&
+	       SWRAP_STATS_GET(row, local_port) == d->local_port &&
+	       SWRAP_STATS_GET(row, peer_port) == d->peer_port;
+}
+
+/* The counters start over for a new socket in the slot */
+static void swrap_stats_set(struct swrap_stats_sock *row,
+			    const struct swrap_stats_sock *d,
+			    bool reset)
+{
+	size_t i;
+
+	swrap_stats_change_begin(&row->seq);
+
+	SWRAP_STATS_SET(row, state, d->state);
+	SWRAP_STATS_SET(row, fd, d->fd);
+	SWRAP_STATS_SET(row, family, d->family);
+	SWRAP_STATS_SET(row, type, d->type);
+	SWRAP_STATS_SET(row, local_iface, d->local_iface);
+	SWRAP_STATS_SET(row, peer_iface, d->peer_iface);
+	SWRAP_STATS_SET(row, local_port, d->local_port);
+	SWRAP_STATS_SET(row, peer_port, d->peer_port);
+
+	if (reset) {
+		for (i = 0; i < SWRAP_STATS_NUM; i++) {
+			SWRAP_STATS_SET(row, counters[i], 0);
+		}
+	}
+
+	swrap_stats_change_end(&row->seq);
+}
+
+/* Finds the rows of the socket and its interface, and updates the names */
+static bool swrap_stats_begin(int fd,
+			      struct socket_info *si,
+			      struct swrap_stats_rows *rows,
+			      bool reset)
+{
+	struct swrap_stats_header *hdr = swrap_stats_get();
+	struct swrap_stats_sock *sock_rows;
+	struct swrap_stats_sock d;
+	size_t idx = si - sockets;
+
+	if (hdr == NULL || idx >= hdr->num_sockets) {
+		return false;
+	}
+
+	sock_rows = (struct swrap_stats_sock *)
+		(void *)((uint8_t *)hdr + hdr->sockets_offset);
+	rows->sock = &sock_rows[idx];
+	rows->iface = swrap_stats_iface_row(hdr,
+			swrap_sockaddr_iface(swrap_link_local_addr(si)));
+
+	swrap_stats_describe(fd, si, &d);
+	if (reset || !swrap_stats_described(rows->sock, &d)) {
+		swrap_stats_set(rows->sock, &d, reset);
+	}
+
+	return true;
+}
+
+static void swrap_stats_inc(struct swrap_stats_rows *rows,
+			    unsigned int counter,
+			    uint64_t n)
+{
+	__atomic_fetch_add(&rows->sock->counters[counter], n, __ATOMIC_RELAXED);
+
+	if (rows->iface != NULL) {
+		__atomic_fetch_add(&rows->iface->counters[counter],
+				   n,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+/* A new socket in the slot, the counters start over */
+static void swrap_stats_open(int fd, struct socket_info *si)
+{
+	struct swrap_stats_rows rows;
+
+	swrap_stats_begin(fd, si, &rows, true);
+}
+
+static void swrap_stats_count(int fd,
+			      struct socket_info *si,
+			      unsigned int counter,
+			      uint64_t n)
+{
+	struct swrap_stats_rows rows;
+
+	if (!swrap_stats_begin(fd, si, &rows, false)) {
+		return;
+	}
+
+	swrap_stats_inc(&rows, counter, n);
+}
+
+/* Counts a call, with the data it moved or the EAGAIN it failed with */
+static void swrap_stats_call(int fd,
+			     struct socket_info *si,
+			     unsigned int call,
+			     ssize_t ret,
+			     int err)
+{
+	struct swrap_stats_rows rows;
+
+	if (!swrap_stats_begin(fd, si, &rows, false)) {
+		return;
+	}
+
+	swrap_stats_inc(&rows, call, 1);
+
+	if (ret == -1 && (err == EAGAIN || err == EWOULDBLOCK)) {
+		swrap_stats_inc(&rows, SWRAP_STATS_EAGAIN, 1);
+	} else if (ret > 0 && call == SWRAP_STATS_SEND) {
+		swrap_stats_inc(&rows, SWRAP_STATS_BYTES_OUT, ret);
+		swrap_stats_inc(&rows, SWRAP_STATS_PACKETS_OUT, 1);
+	} else if (ret > 0 && call == SWRAP_STATS_RECV) {
+		swrap_stats_inc(&rows, SWRAP_STATS_BYTES_IN, ret);
+		swrap_stats_inc(&rows, SWRAP_STATS_PACKETS_IN, 1);
+	}
+
+	if (call == SWRAP_STATS_CLOSE && si->refcount == 0) {
+		struct swrap_stats_sock d;
+
+		swrap_stats_describe(-1, si, &d);
+		d.state = SWRAP_STATS_SOCK_CLOSED;
+		swrap_stats_set(rows.sock, &d, false);
+	}
+}
+
+/****************************************************************************
+ *   CONTROL SOCKET
+ ***************************************************************************/
+
+/*
+ * With SOCKET_WRAPPER_CONTROL=1 every process listens on the unix socket
+ * .control-<pid> of the socket directory, served by a thread of its own,
+ * so a hanging test can be looked at without a debugger. A client writes
+ * one command per line, the answer ends with a line "ok" or "error ...":
+ *
+ *   list             a line per socket: names, state and counters
+ *   flush pcap       syncs the pcap file to the disk
+ *   dump histograms  appends the profile to SOCKET_WRAPPER_PROFILE
+ *
+ * The thread doesn't take any lock of the wrapped functions. It walks the
+ * list of file descriptors while the application changes it: the entries
+ * and the socket_info array are only freed by the destructor after the
+ * thread is stopped, and a closed entry still points into the list, so
+ * at worst a socket opened or closed at the same time is missing or shows
+ * a half updated state. The counters come from the statistics rows, so
+ * they are only there with SOCKET_WRAPPER_STATS, but always consistent.
+ */
+#define SWRAP_CONTROL_FILE_PREFIX ".control-"
+#define SWRAP_CONTROL_LINE_MAX 256
+
+static struct {
+	bool started;
+	bool running;
+	bool stopping;
+	pthread_t thread;
+	pid_t pid;
+	int fd;
+	int client_fd;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} swrap_control = {
+	.fd = -1,
+	.client_fd = -1,
+};
+
+static void swrap_control_printf(int fd, const char *format, ...)
+	PRINTF_ATTRIBUTE(2, 3);
+
+static void swrap_control_printf(int fd, const char *format, ...)
+{
+	char buf[1024];
+	va_list va;
+	int len;
+
+	va_start(va, format);
+	len = vsnprintf(buf, sizeof(buf), format, va);
+	va_end(va);
+
+	if (len < 0) {
+		return;
+	}
+	len = MIN((size_t)len, sizeof(buf) - 1);
+
+	/* A client going away is not our problem */
+	if (libc_write(fd, buf, len) != len) {
+		return;
+	}
+}
+
+static const char *swrap_control_addr(const struct swrap_address *addr,
+				      char *buf,
+				      size_t size)
+{
+	char ip[INET6_ADDRSTRLEN];
+
+	switch (addr->sa_socklen > 0 ? addr->sa.s.sa_family : AF_UNSPEC) {
+	case AF_INET:
+		inet_ntop(AF_INET, &addr->sa.in.sin_addr, ip, sizeof(ip));
+		snprintf(buf, size, "%s:%u", ip, ntohs(addr->sa.in.sin_port));
+		break;
+#ifdef HAVE_IPV6
+	case AF_INET6:
+		inet_ntop(AF_INET6, &addr->sa.in6.sin6_addr, ip, sizeof(ip));
+		snprintf(buf, size, "[%s]:%u", ip, ntohs(addr->sa.in6.sin6_port));
+		break;
+#endif
+	default:
+		snprintf(buf, size, "-");
+		break;
+	}
+
+	return buf;
+}
+
+static const char *swrap_control_state(const struct socket_info *si)
+{
+	if (si->listening) {
+		return "listening";
+	}
+	if (si->connected) {
+		return "connected";
+	}
+	if (si->bound) {
+		return "bound";
+	}
+
+	return "unbound";
+}
+
+static void swrap_control_list(int cfd)
+{
+	struct swrap_stats_header *hdr;
+	struct socket_info_fd *fi;
+	size_t n;
+
+	hdr = __atomic_load_n(&swrap_stats.hdr, __ATOMIC_ACQUIRE);
+
+	fi = __atomic_load_n(&socket_fds, __ATOMIC_ACQUIRE);
+	for (n = 0; fi != NULL && n < 4 * max_sockets; n++) {
+		struct socket_info si;
+		struct swrap_stats_sock row;
+		char myname[INET6_ADDRSTRLEN + 8];
+		char peername[INET6_ADDRSTRLEN + 8];
+		int fd = __atomic_load_n(&fi->fd, __ATOMIC_RELAXED);
+		int idx = __atomic_load_n(&fi->si_index, __ATOMIC_RELAXED);
+
+		fi = __atomic_load_n(&fi->next, __ATOMIC_ACQUIRE);
+
+		if (idx < 0 || (size_t)idx >= max_sockets) {
+			continue;
+		}
+
+		memcpy(&si, &sockets[idx], sizeof(si));
+		if (si.refcount == 0) {
+			continue;
+		}
+
+		swrap_control_printf(cfd,
+				     "fd %d %s %s myname %s peername %s %s",
+				     fd,
+				     si.family == AF_INET ? "inet" : "inet6",
+				     si.type == SOCK_DGRAM ? "dgram" : "stream",
+				     swrap_control_addr(&si.myname,
+							myname,
+							sizeof(myname)),
+				     swrap_control_addr(&si.peername,
+							peername,
+							sizeof(peername)),
+				     swrap_control_state(&si));
+
+		if (hdr != NULL && (size_t)idx < hdr->num_sockets) {
+			const struct swrap_stats_sock *rows =
+				(const struct swrap_stats_sock *)
+				(const void *)((const uint8_t *)hdr +
+					       hdr->sockets_offset);
+
+			swrap_stats_read(&rows[idx], &row, sizeof(row));
+		} else {
+			row.state = SWRAP_STATS_SOCK_UNUSED;
+		}
+
+		if (row.state == SWRAP_STATS_SOCK_OPEN && row.fd == fd) {
+			swrap_control_printf(cfd,
+				" bytes_out %llu bytes_in %llu"
+				" packets_out %llu packets_in %llu eagain %llu",
+				(unsigned long long)
+				row.counters[SWRAP_STATS_BYTES_OUT],
+				(unsigned long long)
+				row.counters[SWRAP_STATS_BYTES_IN],
+				(unsigned long long)
+				row.counters[SWRAP_STATS_PACKETS_OUT],
+				(unsigned long long)
+				row.counters[SWRAP_STATS_PACKETS_IN],
+				(unsigned long long)
+				row.counters[SWRAP_STATS_EAGAIN]);
+		}
+
+		swrap_control_printf(cfd, "\n");
+	}
+
+	swrap_control_printf(cfd, "ok\n");
+}
+
+static void swrap_control_command(int cfd, const char *cmd)
+{
+	if (strcmp(cmd, "list") == 0) {
+		swrap_control_list(cfd);
+	} else if (strcmp(cmd, "flush pcap") == 0) {
+		int fd = __atomic_load_n(&swrap_pcap_fd, __ATOMIC_ACQUIRE);
+
+		if (fd == -1) {
+			swrap_control_printf(cfd, "error no pcap file\n");
+		} else if (fsync(fd) == -1) {
+			swrap_control_printf(cfd, "error %s\n", strerror(errno));
+		} else {
+			swrap_control_printf(cfd, "ok\n");
+		}
+	} else if (strcmp(cmd, "dump histograms") == 0) {
+		if (!swrap_prof_enabled()) {
+			swrap_control_printf(cfd,
+					     "error SOCKET_WRAPPER_PROFILE is "
+					     "not set\n");
+		} else {
+			socket_wrapper_profile_dump();
+			swrap_control_printf(cfd, "ok\n");
+		}
+	} else if (strcmp(cmd, "help") == 0) {
+		swrap_control_printf(cfd,
+				     "list\nflush pcap\ndump histograms\nok\n");
+	} else {
+		swrap_control_printf(cfd, "error unknown command\n");
+	}
+}
+
+/* Answers the commands of a client until it closes the connection */
+static void swrap_control_serve(int cfd)
+{
+	char line[SWRAP_CONTROL_LINE_MAX];
+	size_t len = 0;
+
+	for (;;) {
+		char *nl;
+		int ret;
+
+		ret = libc_read(cfd, line + len, sizeof(line) - 1 - len);
+		if (ret <= 0) {
+			return;
+		}
+		len += ret;
+		line[len] = '\0';
+
+		while ((nl = strchr(line, '\n')) != NULL) {
+			size_t used = nl - line + 1;
+
+			*nl = '\0';
+			if (nl > line && nl[-1] == '\r') {
+				nl[-1] = '\0';
+			}
+			swrap_control_command(cfd, line);
+
+			len -= used;
+			memmove(line, line + used, len + 1);
+		}
+
+		if (len == sizeof(line) - 1) {
+			swrap_control_printf(cfd, "error line too long\n");
+			return;
+		}
+	}
+}
+
+static void *swrap_control_thread(void *arg)
+{
+	int lfd = (int)(intptr_t)arg;
+
+	for (;;) {
+		int cfd;
+
+#ifdef HAVE_ACCEPT4
+		cfd = libc_accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+#else
+		cfd = libc_accept(lfd, NULL, NULL);
+#endif
+		if (cfd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			return NULL;
+		}
+
+		/* The destructor shuts the client down to stop the thread */
+		SWRAP_LOCK(control);
+		if (swrap_control.stopping) {
+			SWRAP_UNLOCK(control);
+			libc_close(cfd);
+			return NULL;
+		}
+		swrap_control.client_fd = cfd;
+		SWRAP_UNLOCK(control);
+
+		swrap_control_serve(cfd);
+
+		SWRAP_LOCK(control);
+		swrap_control.client_fd = -1;
+		SWRAP_UNLOCK(control);
+		libc_close(cfd);
+	}
+
+	return NULL;
+}
+
+static void swrap_control_init(void)
+{
+	struct swrap_address un = {
+		.sa_socklen = sizeof(struct sockaddr_un),
+	};
+	sigset_t all, old;
+	const char *dir;
+	const char *s;
+	int rc;
+	int fd;
+
+	un.sa.un.sun_family = AF_UNIX;
+
+	s = getenv("SOCKET_WRAPPER_CONTROL");
+	if (s == NULL || strcmp(s, "1") != 0) {
+		return;
+	}
+	dir = socket_wrapper_dir();
+	if (dir == NULL) {
+		return;
+	}
+
+	rc = snprintf(un.sa.un.sun_path, sizeof(un.sa.un.sun_path), "%s/%s%d",
+		      dir, SWRAP_CONTROL_FILE_PREFIX, (int)getpid());
+	if (rc <= 0 || (size_t)rc >= sizeof(un.sa.un.sun_path)) {
+		SWRAP_LOG(SWRAP_LOG_ERROR,
+			  "The path of the control socket in %s is too long",
+			  dir);
+		return;
+	}
+
+	fd = libc_socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		return;
+	}
+
+	/* A socket left behind by a process with the same pid */
+	unlink(un.sa.un.sun_path);
+
+	rc = libc_bind(fd, &un.sa.s, un.sa_socklen);
+	if (rc == 0) {
+		rc = libc_listen(fd, 4);
+	}
+	if (rc == -1) {
+		SWRAP_LOG(SWRAP_LOG_ERROR,
+			  "Failed to listen on %s: %s",
+			  un.sa.un.sun_path, strerror(errno));
+		libc_close(fd);
+		unlink(un.sa.un.sun_path);
+		return;
+	}
+
+	/* The signals of the application are none of our business */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	rc = pthread_create(&swrap_control.thread, NULL,
+			    swrap_control_thread, (void *)(intptr_t)fd);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (rc != 0) {
+		libc_close(fd);
+		unlink(un.sa.un.sun_path);
+		return;
+	}
+
+	SWRAP_LOG(SWRAP_LOG_TRACE, "Control socket on %s", un.sa.un.sun_path);
+
+	memcpy(swrap_control.path, un.sa.un.sun_path, sizeof(swrap_control.path));
+	swrap_control.pid = getpid();
+	swrap_control.fd = fd;
+	swrap_control.running = true;
+}
+
+/* Started with the first socket, SOCKET_WRAPPER_DIR may be set late */
+static void swrap_control_start(void)
+{
+	if (__atomic_load_n(&swrap_control.started, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	SWRAP_LOCK(control);
+	if (!swrap_control.started) {
+		int saved_errno = errno;
+
+		swrap_control_init();
+		errno = saved_errno;
+
+		__atomic_store_n(&swrap_control.started, true, __ATOMIC_RELEASE);
+	}
+	SWRAP_UNLOCK(control);
+}
+
+/* The thread is gone in the child, it starts its own */
+static void swrap_control_atfork_child(void)
+{
+	if (swrap_control.fd != -1) {
+		libc_close(swrap_control.fd);
+	}
+	swrap_control.fd = -1;
+	swrap_control.client_fd = -1;
+	swrap_control.path[0] = '\0';
+	swrap_control.running = false;
+	swrap_control.stopping = false;
+	swrap_control.started = false;
+}
+
+/*
+ * Runs before the sockets get closed and freed: shutting down the sockets
+ * wakes the thread up in accept() or read(), then it gets joined.
+ */
+static void swrap_control_destructor(void)
+{
+	if (swrap_control.path[0] == '\0' || swrap_control.pid != getpid()) {
+		return;
+	}
+
+	if (swrap_control.running) {
+		SWRAP_LOCK(control);
+		swrap_control.stopping = true;
+		libc_shutdown(swrap_control.fd, SHUT_RDWR);
+		if (swrap_control.client_fd != -1) {
+			libc_shutdown(swrap_control.client_fd, SHUT_RDWR);
+		}
+		SWRAP_UNLOCK(control);
+
+		pthread_join(swrap_control.thread, NULL);
+		swrap_control.running = false;
+	}
+
+	libc_close(swrap_control.fd);
+	swrap_control.fd = -1;
+	unlink(swrap_control.path);
+	swrap_control.path[0] = '\0';
+}
+
+/****************************************************************************
+ *   FLOWS
+ ***************************************************************************/
+
+/*
+ * With SOCKET_WRAPPER_FLOWS=/path the process counts its traffic per flow,
+ * the protocol with the local and the peer address, and appends one JSON
+ * line per flow to the file when it exits. The counters are taken in the
+ * epilogues of the send and receive calls: bytes and packets per direction,
+ * the first and the last time the flow was used in microseconds since the
+ * epoch, and the errors a real network would have retransmitted on:
+ * unreachable peers and reset connections.
+ *
+ * The table has a fixed size and takes no lock, a flow claims a slot the
+ * first time it shows up and keeps it. The traffic of flows which don't fit
+ * anymore is only counted as dropped. A datagram read without asking for
+ * the address on an unconnected socket has no known peer, it is counted on
+ * the flow with a null peer.
+ */
+#define SWRAP_FLOW_SLOTS 4096
+#define SWRAP_FLOW_REPORT_SIZE 8192
+#define SWRAP_FLOW_LINE_MAX 512
+
+#define SWRAP_FLOW_FREE 0
+#define SWRAP_FLOW_CLAIMED 1
+#define SWRAP_FLOW_READY 2
+/* A freed slot of a shared table, lookups go on past it */
+#define SWRAP_FLOW_DELETED 3
+
+/* How often to yield while waiting for a slot somebody else fills in */
+#define SWRAP_FLOW_CLAIM_TRIES 1000
+
+#define SWRAP_FLOW_OUT 0
+#define SWRAP_FLOW_IN 1
+
+/* Compared with memcmp(), so without padding */
+struct swrap_flow_key {
+	uint16_t family;
+	uint16_t type;
+	uint16_t local_port;
+	uint16_t peer_port;
+	uint8_t local_addr[16];
+	uint8_t peer_addr[16];
+};
+
+struct swrap_flow {
+	uint32_t state;
+	uint32_t hash;
+	struct swrap_flow_key key;
+	uint64_t bytes[2];
+	uint64_t packets[2];
+	uint64_t first_usec;
+	uint64_t last_usec;
+	uint64_t unreach;
+	uint64_t reset;
+};
+
+static struct {
+	struct swrap_flow *table;
+	bool disabled;
+	uint64_t dropped;
+} swrap_flows;
+
+static struct swrap_flow *swrap_flow_table(void)
+{
+	struct swrap_flow *table;
+
+	table = __atomic_load_n(&swrap_flows.table, __ATOMIC_ACQUIRE);
+	if (table != NULL || __atomic_load_n(&swrap_flows.disabled,
+					     __ATOMIC_RELAXED)) {
+		return table;
+	}
+
+	SWRAP_LOCK(flow);
+	if (swrap_flows.table == NULL && !swrap_flows.disabled) {
+		const char *s = getenv("SOCKET_WRAPPER_FLOWS");
+		int saved_errno = errno;
+
+		if (s != NULL && s[0] != '\0') {
+			table = (struct swrap_flow *)calloc(SWRAP_FLOW_SLOTS,
+							    sizeof(*table));
+		}
+		errno = saved_errno;
+
+		if (table == NULL) {
+			swrap_flows.disabled = true;
+		}
+		__atomic_store_n(&swrap_flows.table, table, __ATOMIC_RELEASE);
+	}
+	SWRAP_UNLOCK(flow);
+
+	return swrap_flows.table;
+}
+
+static uint64_t swrap_flow_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static bool swrap_flow_addr(int family,
+			    const struct sockaddr *sa,
+			    socklen_t len,
+			    uint8_t addr[16],
+			    uint16_t *port)
+{
+	struct swrap_address a;
+
+	if (sa == NULL || sa->sa_family != family) {
+		return false;
+	}
+
+	switch (family) {
+	case AF_INET:
+		if (len < sizeof(struct sockaddr_in)) {
+			return false;
+		}
+		memcpy(&a.sa.in, sa, sizeof(struct sockaddr_in));
+		memcpy(addr, &a.sa.in.sin_addr, sizeof(a.sa.in.sin_addr));
+		*port = ntohs(a.sa.in.sin_port);
+		return true;
+#ifdef HAVE_IPV6
+	case AF_INET6:
+		if (len < sizeof(struct sockaddr_in6)) {
+			return false;
+		}
+		memcpy(&a.sa.in6, sa, sizeof(struct sockaddr_in6));
+		memcpy(addr, &a.sa.in6.sin6_addr, sizeof(a.sa.in6.sin6_addr));
+		*port = ntohs(a.sa.in6.sin6_port);
+		return true;
+#endif
+	default:
+		break;
+	}
+
+	return false;
+}
+
+/* FNV-1a */
+static uint32_t swrap_flow_hash(const struct swrap_flow_key *key)
+{
+	const uint8_t *p = (const uint8_t *)key;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < sizeof(*key); i++) {
+		h = (h ^ p[i]) * 16777619U;
+	}
+
+	return h;
+}
+
+/*
+ * Waits until the slot isn't claimed anymore. The owner may have been
+ * killed or interrupted by a signal handler which wants the same slot, so
+ * give up after a while, the slot then stays claimed and is skipped.
+ */
+static uint32_t swrap_flow_claim_wait(uint32_t *state)
+{
+	uint32_t s = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+	unsigned int n;
+
+	for (n = 0; s == SWRAP_FLOW_CLAIMED && n < SWRAP_FLOW_CLAIM_TRIES; n++) {
+		sched_yield();
+		s = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+	}
+
+	return s;
+}
+
+static struct swrap_flow *swrap_flow_slot(struct swrap_flow *table,
+					  const struct swrap_flow_key *key,
+					  uint64_t now)
+{
+	uint32_t hash = swrap_flow_hash(key);
+	size_t i = hash & (SWRAP_FLOW_SLOTS - 1);
+	size_t n;
+
+	for (n = 0; n < SWRAP_FLOW_SLOTS; n++) {
+		struct swrap_flow *f = &table[i];
+		uint32_t state = __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+
+		if (state == SWRAP_FLOW_FREE &&
+		    __atomic_compare_exchange_n(&f->state,
+						&state,
+						SWRAP_FLOW_CLAIMED,
+						false,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_ACQUIRE)) {
+			f->hash = hash;
+			f->key = *key;
+			f->first_usec = now;
+			__atomic_store_n(&f->state,
+					 SWRAP_FLOW_READY,
+					 __ATOMIC_RELEASE);
+			return f;
+		}
+
+		/* Another thread is filling in the key */
+		if (state == SWRAP_FLOW_CLAIMED) {
+			state = swrap_flow_claim_wait(&f->state);
+		}
+
+		if (state == SWRAP_FLOW_READY &&
+		    f->hash == hash &&
+		    memcmp(&f->key, key, sizeof(*key)) == 0) {
+			return f;
+		}
+
+		i = (i + 1) & (SWRAP_FLOW_SLOTS - 1);
+	}
+
+	return NULL;
+}
+
+static void swrap_flow_count(struct socket_info *si,
+			     const struct sockaddr *peer,
+			     socklen_t peer_len,
+			     unsigned int dir,
+			     ssize_t ret,
+			     int err)
+{
+	struct swrap_flow *table = swrap_flow_table();
+	struct swrap_flow_key key;
+	struct swrap_flow *f;
+	bool unreach = false;
+	bool reset = false;
+	uint64_t now;
+
+	if (table == NULL) {
+		return;
+	}
+
+	if (ret == -1) {
+		unreach = err == EHOSTUNREACH ||
+			  err == ENETUNREACH ||
+			  err == ECONNREFUSED;
+		reset = err == ECONNRESET || err == EPIPE;
+		if (!unreach && !reset) {
+			return;
+		}
+	} else if (ret == 0 && si->type == SOCK_STREAM) {
+		/* The end of the stream is not a segment */
+		return;
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.family = si->family;
+	key.type = si->type;
+	if (!swrap_flow_addr(si->family,
+			     &si->myname.sa.s,
+			     si->myname.sa_socklen,
+			     key.local_addr,
+			     &key.local_port)) {
+		return;
+	}
+	if (!swrap_flow_addr(si->family,
+			     peer,
+			     peer_len,
+			     key.peer_addr,
+			     &key.peer_port)) {
+		memset(key.peer_addr, 0, sizeof(key.peer_addr));
+		key.peer_port = 0;
+	}
+
+	now = swrap_flow_usec();
+
+	f = swrap_flow_slot(table, &key, now);
+	if (f == NULL) {
+		__atomic_fetch_add(&swrap_flows.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (unreach) {
+		__atomic_fetch_add(&f->unreach, 1, __ATOMIC_RELAXED);
+	} else if (reset) {
+		__atomic_fetch_add(&f->reset, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&f->bytes[dir], ret, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&f->packets[dir], 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&f->last_usec, now, __ATOMIC_RELAXED);
+}
+
+/* The peer a send went to */
+static const struct sockaddr *swrap_flow_dest(struct socket_info *si,
+					      const struct sockaddr *to,
+					      socklen_t *len)
+{
+	if (si->type == SOCK_DGRAM && !si->connected && to != NULL) {
+		/* Already checked by swrap_sendmsg_before() */
+		*len = sizeof(struct sockaddr_storage);
+		return to;
+	}
+
+	*len = si->peername.sa_socklen;
+	return &si->peername.sa.s;
+}
+
+/* The peer a receive came from, msg_name holds the converted address */
+static const struct sockaddr *swrap_flow_source(struct socket_info *si,
+						const struct msghdr *msg,
+						bool converted,
+						socklen_t *len)
+{
+	if (si->type == SOCK_DGRAM && !si->connected) {
+		*len = converted ? msg->msg_namelen : 0;
+		return converted ? (const struct sockaddr *)msg->msg_name : NULL;
+	}
+
+	*len = si->peername.sa_socklen;
+	return &si->peername.sa.s;
+}
+
+static void swrap_flow_send(struct socket_info *si,
+			    const struct sockaddr *to,
+			    ssize_t ret,
+			    int err)
+{
+	const struct sockaddr *peer;
+	socklen_t len;
+
+	peer = swrap_flow_dest(si, to, &len);
+	swrap_flow_count(si, peer, len, SWRAP_FLOW_OUT, ret, err);
+}
+
+static void swrap_flow_recv(struct socket_info *si,
+			    const struct msghdr *msg,
+			    bool converted,
+			    ssize_t ret,
+			    int err)
+{
+	const struct sockaddr *peer;
+	socklen_t len;
+
+	peer = swrap_flow_source(si, msg, converted, &len);
+	swrap_flow_count(si, peer, len, SWRAP_FLOW_IN, ret, err);
+}
+
+/* Returns false for the unknown peer */
+static bool swrap_flow_name(const struct swrap_flow_key *key,
+			    bool peer,
+			    char *buf,
+			    size_t size)
+{
+	const uint8_t *addr = peer ? key->peer_addr : key->local_addr;
+	uint16_t port = peer ? key->peer_port : key->local_port;
+	struct swrap_address a = {
+		.sa_socklen = 0,
+	};
+
+	switch (key->family) {
+	case AF_INET:
+		a.sa_socklen = sizeof(struct sockaddr_in);
+		a.sa.in.sin_family = AF_INET;
+		a.sa.in.sin_port = htons(port);
+		memcpy(&a.sa.in.sin_addr, addr, sizeof(a.sa.in.sin_addr));
+		break;
+#ifdef HAVE_IPV6
+	case AF_INET6:
+		a.sa_socklen = sizeof(struct sockaddr_in6);
+		a.sa.in6.sin6_family = AF_INET6;
+		a.sa.in6.sin6_port = htons(port);
+		memcpy(&a.sa.in6.sin6_addr, addr, sizeof(a.sa.in6.sin6_addr));
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if (port == 0 || a.sa_socklen == 0) {
+		snprintf(buf, size, "-");
+		return false;
+	}
+
+	swrap_control_addr(&a, buf, size);
+
+	return true;
+}
+
+static void swrap_flow_flush(int fd, char *buf, size_t *len)
+{
+	if (*len > 0 && libc_write(fd, buf, *len) != (ssize_t)*len) {
+		SWRAP_LOG(SWRAP_LOG_ERROR,
+			  "Failed to write the flow report: %s",
+			  strerror(errno));
+	}
+	*len = 0;
+}
+
+static void swrap_flow_report(const char *path)
+{
+	char buf[SWRAP_FLOW_REPORT_SIZE];
+	char name[64];
+	char local[80];
+	char peer[80];
+	uint64_t dropped;
+	size_t len = 0;
+	size_t i;
+	int fd;
+
+	fd = libc_open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0666);
+	if (fd == -1) {
+		SWRAP_LOG(SWRAP_LOG_ERROR,
+			  "Failed to open %s: %s",
+			  path, strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < SWRAP_FLOW_SLOTS; i++) {
+		const struct swrap_flow *f = &swrap_flows.table[i];
+		uint64_t avg[2];
+		unsigned int d;
+
+		if (__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) !=
+		    SWRAP_FLOW_READY) {
+			continue;
+		}
+
+		for (d = 0; d < 2; d++) {
+			avg[d] = f->packets[d] > 0 ? f->bytes[d] / f->packets[d] : 0;
+		}
+		swrap_flow_name(&f->key, false, name, sizeof(name));
+		snprintf(local, sizeof(local), "\"%s\"", name);
+		if (swrap_flow_name(&f->key, true, name, sizeof(name))) {
+			snprintf(peer, sizeof(peer), "\"%s\"", name);
+		} else {
+			snprintf(peer, sizeof(peer), "null");
+		}
+
+		/* Whole lines only, the file is shared by all processes */
+		if (len + SWRAP_FLOW_LINE_MAX > sizeof(buf)) {
+			swrap_flow_flush(fd, buf, &len);
+		}
+		len += snprintf(buf + len, SWRAP_FLOW_LINE_MAX,
+				"{\"pid\":%d,\"proto\":\"%s\","
+				"\"local\":%s,\"peer\":%s,"
+				"\"bytes_out\":%llu,\"bytes_in\":%llu,"
+				"\"packets_out\":%llu,\"packets_in\":%llu,"
+				"\"avg_segment_out\":%llu,"
+				"\"avg_segment_in\":%llu,"
+				"\"first_usec\":%llu,\"last_usec\":%llu,"
+				"\"unreach\":%llu,\"reset\":%llu}\n",
+				(int)getpid(),
+				f->key.type == SOCK_STREAM ? "tcp" : "udp",
+				local,
+				peer,
+				(unsigned long long)f->bytes[SWRAP_FLOW_OUT],
+				(unsigned long long)f->bytes[SWRAP_FLOW_IN],
+				(unsigned long long)f->packets[SWRAP_FLOW_OUT],
+				(unsigned long long)f->packets[SWRAP_FLOW_IN],
+				(unsigned long long)avg[SWRAP_FLOW_OUT],
+				(unsigned long long)avg[SWRAP_FLOW_IN],
+				(unsigned long long)f->first_usec,
+				(unsigned long long)f->last_usec,
+				(unsigned long long)f->unreach,
+				(unsigned long long)f->reset);
+		len = MIN(len, sizeof(buf) - 1);
+	}
+
+	dropped = __atomic_load_n(&swrap_flows.dropped, __ATOMIC_RELAXED);
+	if (dropped > 0) {
+		if (len + SWRAP_FLOW_LINE_MAX > sizeof(buf)) {
+			swrap_flow_flush(fd, buf, &len);
+		}
+		len += snprintf(buf + len, SWRAP_FLOW_LINE_MAX,
+				"{\"pid\":%d,\"dropped\":%llu}\n",
+				(int)getpid(),
+				(unsigned long long)dropped);
+		len = MIN(len, sizeof(buf) - 1);
+	}
+
+	swrap_flow_flush(fd, buf, &len);
+	libc_close(fd);
+}
+
+/* The child reports its own traffic */
+static void swrap_flow_atfork_child(void)
+{
+	if (swrap_flows.table != NULL) {
+		memset(swrap_flows.table,
+		       0,
+		       SWRAP_FLOW_SLOTS * sizeof(*swrap_flows.table));
+	}
+	swrap_flows.dropped = 0;
+}
+
+static void swrap_flow_destructor(void)
+{
+	const char *path = getenv("SOCKET_WRAPPER_FLOWS");
+
+	if (swrap_flows.table == NULL) {
+		return;
+	}
+
+	if (path != NULL && path[0] != '\0') {
+		swrap_flow_report(path);
+	}
+
+	free(swrap_flows.table);
+	swrap_flows.table = NULL;
+	swrap_flows.disabled = true;
+}
+
+/****************************************************************************
+ *   ONE-WAY LATENCY
+ ***************************************************************************/
+
+/*
+ * All the processes run on the same host, so they share the clock and can
+ * measure the one-way latency of their messages: the time from the send
+ * until the receiver got the data out of the socket, including the queue
+ * of the unix socket, the emulated link and the event loop of the receiver.
+ *
+ * With SOCKET_WRAPPER_ONEWAY=/path the processes share the table of flows
+ * in the file .oneway of the socket directory. A flow counts what went
+ * through it, in bytes for a stream and in datagrams otherwise, so both
+ * ends agree on the offset of every message without touching the payload.
+ * The sender publishes the offset where each send ends with the time it
+ * started in a ring of the flow. The receiver notes the offset and the time
+ * of every receive and matches the sends which are complete. A stream send
+ * split at the MTU is a send of its own, a receive which only gets a part
+ * of a send doesn't complete it.
+ *
+ * The receiver keeps its own receive times around, because the sender may
+ * publish a send only after the data has already been read. The send ring
+ * has one reader, the receiving socket. A slot is only written by the
+ * process which claims it, and it starts zeroed. The receiving socket
+ * frees the flows to its address when it gets closed and keeps their
+ * histograms. A new socket also frees the flows left behind by a process
+ * which is gone, on bind() for datagrams and on connect() for both
+ * directions of a stream. Each process appends the histograms of the flows
+ * it received on to the file when it exits.
+ *
+ * A datagram read with recv() or read() on an unconnected socket has no
+ * known sender and is not measured.
+ */
+#define SWRAP_ONEWAY_FILE ".oneway"
+#define SWRAP_ONEWAY_FLOWS 256
+#define SWRAP_ONEWAY_RING 256
+
+struct swrap_oneway_stamp {
+	uint64_t end;
+	uint64_t nsec;
+};
+
+struct swrap_oneway_flow {
+	uint32_t state;
+	uint32_t hash;
+	/* The local address is the sender, the peer the receiver */
+	struct swrap_flow_key key;
+	int32_t receiver;
+	uint32_t unused;
+	uint64_t sent;
+	uint64_t received;
+	/* Written by the sender, read and freed by the receiver */
+	uint64_t head;
+	uint64_t tail;
+	/* Only used by the receiver */
+	uint64_t rhead;
+	uint64_t rtail;
+	uint64_t missed;
+	struct swrap_prof_hist hist;
+	struct swrap_oneway_stamp sends[SWRAP_ONEWAY_RING];
+	struct swrap_oneway_stamp recvs[SWRAP_ONEWAY_RING];
+};
+
+/* The histogram of a freed flow, kept by the receiving process */
+struct swrap_oneway_result {
+	struct swrap_oneway_result *next;
+	struct swrap_flow_key key;
+	uint64_t missed;
+	struct swrap_prof_hist hist;
+};
+
+static struct {
+	struct swrap_oneway_flow *flows;
+	struct swrap_oneway_result *results;
+	bool disabled;
+} swrap_oneway;
+
+/* The start of the send in progress of the thread */
+static SWRAP_THREAD uint64_t swrap_oneway_send_nsec;
+
+static void swrap_oneway_init(void)
+{
+	size_t size = SWRAP_ONEWAY_FLOWS * sizeof(struct swrap_oneway_flow);
+	const char *dir;
+	const char *s;
+	char path[1024];
+	struct stat st;
+	void *p;
+	int rc;
+	int fd;
+
+	swrap_oneway.disabled = true;
+
+	s = getenv("SOCKET_WRAPPER_ONEWAY");
+	if (s == NULL || s[0] == '\0') {
+		return;
+	}
+	dir = socket_wrapper_dir();
+	if (dir == NULL) {
+		return;
+	}
+
+	rc = snprintf(path, sizeof(path), "%s/%s", dir, SWRAP_ONEWAY_FILE);
+	if (rc <= 0 || (size_t)rc >= sizeof(path)) {
+		return;
+	}
+
+	fd = libc_open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+	if (fd == -1) {
+		SWRAP_LOG(SWRAP_LOG_ERROR,
+			  "Failed to open %s: %s",
+			  path, strerror(errno));
+		return;
+	}
+
+	/* The first process creates it, the table starts zeroed */
+	rc = fstat(fd, &st);
+	if (rc == 0 && (size_t)st.st_size < size) {
+		rc = ftruncate(fd, size);
+	}
+	if (rc == -1) {
+		libc_close(fd);
+		return;
+	}
+
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	libc_close(fd);
+	if (p == MAP_FAILED) {
+		return;
+	}
+
+	SWRAP_LOG(SWRAP_LOG_TRACE, "Sharing the send times in %s", path);
+
+	swrap_oneway.disabled = false;
+	__atomic_store_n(&swrap_oneway.flows,
+			 (struct swrap_oneway_flow *)p,
+			 __ATOMIC_RELEASE);
+}
+
+static struct swrap_oneway_flow *swrap_oneway_get(void)
+{
+	struct swrap_oneway_flow *flows;
+
+	flows = __atomic_load_n(&swrap_oneway.flows, __ATOMIC_ACQUIRE);
+	if (flows != NULL || __atomic_load_n(&swrap_oneway.disabled,
+					     __ATOMIC_RELAXED)) {
+		return flows;
+	}
+
+	SWRAP_LOCK(oneway);
+	if (swrap_oneway.flows == NULL && !swrap_oneway.disabled) {
+		int saved_errno = errno;
+
+		swrap_oneway_init();
+		errno = saved_errno;
+	}
+	SWRAP_UNLOCK(oneway);
+
+	return swrap_oneway.flows;
+}
+
+static uint64_t swrap_oneway_nsec(void)
+{
+	struct timespec ts;
+
+	/* The same clock in every process */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static bool swrap_oneway_key(struct socket_info *si,
+			     const struct sockaddr *peer,
+			     socklen_t peer_len,
+			     bool sending,
+			     struct swrap_flow_key *key)
+{
+	uint8_t *me_addr = sending ? key->local_addr : key->peer_addr;
+	uint16_t *me_port = sending ? &key->local_port : &key->peer_port;
+	uint8_t *peer_addr = sending ? key->peer_addr : key->local_addr;
+	uint16_t *peer_port = sending ? &key->peer_port : &key->local_port;
+
+	memset(key, 0, sizeof(*key));
+	key->family = si->family;
+	key->type = si->type;
+
+	/* The address the other end sees, not the wildcard */
+	return swrap_flow_addr(si->family,
+			       swrap_link_local_addr(si),
+			       sizeof(struct sockaddr_storage),
+			       me_addr,
+			       me_port) &&
+	       swrap_flow_addr(si->family,
+			       peer,
+			       peer_len,
+			       peer_addr,
+			       peer_port);
+}
+
+static struct swrap_oneway_flow *swrap_oneway_slot(
+		struct swrap_oneway_flow *flows,
+		const struct swrap_flow_key *key,
+		bool create)
+{
+	uint32_t hash = swrap_flow_hash(key);
+	struct swrap_oneway_flow *f = NULL;
+	size_t i = hash & (SWRAP_ONEWAY_FLOWS - 1);
+	uint32_t state;
+	size_t n;
+
+	for (n = 0; n < SWRAP_ONEWAY_FLOWS; n++) {
+		struct swrap_oneway_flow *cur = &flows[i];
+
+		/* Another process is filling in the key */
+		state = swrap_flow_claim_wait(&cur->state);
+
+		if (state == SWRAP_FLOW_READY &&
+		    cur->hash == hash &&
+		    memcmp(&cur->key, key, sizeof(*key)) == 0) {
+			return cur;
+		}
+		if (state == SWRAP_FLOW_DELETED && f == NULL) {
+			f = cur;
+		}
+		if (state == SWRAP_FLOW_FREE) {
+			if (f == NULL) {
+				f = cur;
+			}
+			break;
+		}
+
+		i = (i + 1) & (SWRAP_ONEWAY_FLOWS - 1);
+	}
+
+	if (!create || f == NULL) {
+		return NULL;
+	}
+
+	state = __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+	if ((state != SWRAP_FLOW_FREE && state != SWRAP_FLOW_DELETED) ||
+	    !__atomic_compare_exchange_n(&f->state,
+					 &state,
+					 SWRAP_FLOW_CLAIMED,
+					 false,
+					 __ATOMIC_ACQUIRE,
+					 __ATOMIC_ACQUIRE)) {
+		/* Somebody else was faster, maybe with the same flow */
+		return swrap_oneway_slot(flows, key, false);
+	}
+
+	/* Whatever a freed flow left behind */
+	memset(&f->hash, 0,
+	       sizeof(*f) - offsetof(struct swrap_oneway_flow, hash));
+	f->hash = hash;
+	f->key = *key;
+	__atomic_store_n(&f->state, SWRAP_FLOW_READY, __ATOMIC_RELEASE);
+
+	return f;
+}
+
+static void swrap_oneway_drain(struct swrap_oneway_flow *f);
+
+/* Adds the histogram of the flow to the results of the process */
+static void swrap_oneway_keep(struct swrap_oneway_flow *f)
+{
+	struct swrap_oneway_result *r;
+
+	swrap_oneway_drain(f);
+	if (f->hist.count == 0 && f->missed == 0) {
+		return;
+	}
+
+	SWRAP_LOCK(oneway);
+	for (r = swrap_oneway.results; r != NULL; r = r->next) {
+		if (memcmp(&r->key, &f->key, sizeof(r->key)) == 0) {
+			break;
+		}
+	}
+	if (r == NULL) {
+		r = (struct swrap_oneway_result *)calloc(1, sizeof(*r));
+		if (r != NULL) {
+			r->key = f->key;
+			r->next = swrap_oneway.results;
+			swrap_oneway.results = r;
+		}
+	}
+	if (r != NULL) {
+		swrap_prof_hist_merge(&r->hist, &f->hist);
+		r->missed += __atomic_load_n(&f->missed, __ATOMIC_RELAXED);
+	}
+	SWRAP_UNLOCK(oneway);
+}
+
+/*
+ * Frees the flow if its receiver is this process, nobody yet, or a process
+ * which is gone. Another process may still receive on it, after a fork().
+ */
+static void swrap_oneway_free(struct swrap_oneway_flow *f)
+{
+	uint32_t state = SWRAP_FLOW_READY;
+	pid_t receiver = f->receiver;
+
+	if (receiver != 0 && receiver != getpid() &&
+	    (kill(receiver, 0) == 0 || errno != ESRCH)) {
+		return;
+	}
+
+	if (!__atomic_compare_exchange_n(&f->state,
+					 &state,
+					 SWRAP_FLOW_CLAIMED,
+					 false,
+					 __ATOMIC_ACQUIRE,
+					 __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	if (receiver == getpid()) {
+		swrap_oneway_keep(f);
+	}
+
+	__atomic_store_n(&f->state, SWRAP_FLOW_DELETED, __ATOMIC_RELEASE);
+}
+
+/*
+ * Frees the flows the socket receives on: from the peer of a stream, or
+ * from anybody to the address of a datagram socket. With sending set the
+ * flow of a stream to the peer instead.
+ */
+static void swrap_oneway_release(struct socket_info *si,
+				 const struct sockaddr *peer,
+				 socklen_t peer_len,
+				 bool sending)
+{
+	struct swrap_oneway_flow *flows = swrap_oneway_get();
+	struct swrap_oneway_flow *f;
+	struct swrap_flow_key key;
+	int saved_errno = errno;
+	size_t i;
+
+	if (flows == NULL) {
+		return;
+	}
+
+	if (peer != NULL) {
+		if (swrap_oneway_key(si, peer, peer_len, sending, &key)) {
+			f = swrap_oneway_slot(flows, &key, false);
+			if (f != NULL) {
+				swrap_oneway_free(f);
+			}
+		}
+		errno = saved_errno;
+		return;
+	}
+
+	memset(&key, 0, sizeof(key));
+	if (!swrap_flow_addr(si->family,
+			     swrap_link_local_addr(si),
+			     sizeof(struct sockaddr_storage),
+			     key.peer_addr,
+			     &key.peer_port)) {
+		return;
+	}
+
+	for (i = 0; i < SWRAP_ONEWAY_FLOWS; i++) {
+		f = &flows[i];
+
+		if (__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) ==
+		    SWRAP_FLOW_READY &&
+		    f->key.type == si->type &&
+		    f->key.family == si->family &&
+		    f->key.peer_port == key.peer_port &&
+		    memcmp(f->key.peer_addr,
+			   key.peer_addr,
+			   sizeof(key.peer_addr)) == 0) {
+			swrap_oneway_free(f);
+		}
+	}
+	errno = saved_errno;
+}
+
+/* The socket gets closed, its address may be used by the next one */
+static void swrap_oneway_close(struct socket_info *si)
+{
+	if (si->type == SOCK_STREAM) {
+		if (si->connected && si->peername.sa_socklen > 0) {
+			swrap_oneway_release(si,
+					     &si->peername.sa.s,
+					     si->peername.sa_socklen,
+					     false);
+		}
+		return;
+	}
+
+	if (si->bound) {
+		swrap_oneway_release(si, NULL, 0, false);
+	}
+}
+
+/* Called before the data goes anywhere */
+static void swrap_oneway_send_start(void)
+{
+	if (swrap_oneway_get() != NULL) {
+		swrap_oneway_send_nsec = swrap_oneway_nsec();
+	}
+}
+
+static void swrap_oneway_send(struct socket_info *si,
+			      const struct sockaddr *to,
+			      ssize_t ret)
+{
+	struct swrap_oneway_flow *flows = swrap_oneway_get();
+	uint64_t start = swrap_oneway_send_nsec;
+	const struct sockaddr *peer;
+	struct swrap_oneway_flow *f;
+	struct swrap_flow_key key;
+	unsigned int copies = 1;
+	unsigned int c;
+	socklen_t len;
+
+	swrap_oneway_send_nsec = 0;
+
+	if (flows == NULL || ret < 0 || (ret == 0 && si->type == SOCK_STREAM)) {
+		return;
+	}
+	if (si->type == SOCK_DGRAM) {
+		if (si->impaired & SWRAP_IMPAIR_DROPPED) {
+			return;
+		}
+		if (si->impaired & SWRAP_IMPAIR_DUPLICATED) {
+			copies = 2;
+		}
+	}
+
+	peer = swrap_flow_dest(si, to, &len);
+	if (!swrap_oneway_key(si, peer, len, true, &key)) {
+		return;
+	}
+	f = swrap_oneway_slot(flows, &key, true);
+	if (f == NULL) {
+		return;
+	}
+
+	/* Not every path into sendmsg_after() went through sendmsg_before() */
+	if (start == 0) {
+		start = swrap_oneway_nsec();
+	}
+
+	for (c = 0; c < copies; c++) {
+		uint64_t amount = si->type == SOCK_STREAM ? (uint64_t)ret : 1;
+		uint64_t end = __atomic_add_fetch(&f->sent,
+						  amount,
+						  __ATOMIC_RELAXED);
+		uint64_t head = __atomic_load_n(&f->head, __ATOMIC_RELAXED);
+		uint64_t tail = __atomic_load_n(&f->tail, __ATOMIC_ACQUIRE);
+		struct swrap_oneway_stamp *stamp;
+
+		if (head - tail >= SWRAP_ONEWAY_RING ||
+		    !__atomic_compare_exchange_n(&f->head,
+						 &head,
+						 head + 1,
+						 false,
+						 __ATOMIC_ACQUIRE,
+						 __ATOMIC_RELAXED)) {
+			/* The receiver is too far behind */
+			__atomic_fetch_add(&f->missed, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		stamp = &f->sends[head % SWRAP_ONEWAY_RING];
+		stamp->nsec = start;
+		__atomic_store_n(&stamp->end, end, __ATOMIC_RELEASE);
+	}
+}
+
+/* Matches the complete sends with the receive which completed them */
+static void swrap_oneway_drain(struct swrap_oneway_flow *f)
+{
+	uint64_t received = f->received;
+
+	for (;;) {
+		uint64_t tail = __atomic_load_n(&f->tail, __ATOMIC_RELAXED);
+		struct swrap_oneway_stamp *stamp;
+		const struct swrap_oneway_stamp *r;
+		uint64_t end;
+
+		if (tail == __atomic_load_n(&f->head, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		stamp = &f->sends[tail % SWRAP_ONEWAY_RING];
+		end = __atomic_load_n(&stamp->end, __ATOMIC_ACQUIRE);
+		if (end == 0 || end > received) {
+			/* Not published yet or not complete */
+			break;
+		}
+
+		while (f->rtail != f->rhead &&
+		       f->recvs[f->rtail % SWRAP_ONEWAY_RING].end < end) {
+			f->rtail++;
+		}
+
+		if (f->rtail != f->rhead) {
+			r = &f->recvs[f->rtail % SWRAP_ONEWAY_RING];
+			swrap_prof_hist_add(&f->hist,
+					    r->nsec > stamp->nsec ?
+					    r->nsec - stamp->nsec : 0);
+		} else {
+			/* The receive fell out of the ring */
+			__atomic_fetch_add(&f->missed, 1, __ATOMIC_RELAXED);
+		}
+
+		__atomic_store_n(&stamp->end, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&f->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void swrap_oneway_recv(struct socket_info *si,
+			      const struct msghdr *msg,
+			      bool converted,
+			      ssize_t ret,
+			      int flags)
+{
+	struct swrap_oneway_flow *flows = swrap_oneway_get();
+	const struct sockaddr *peer;
+	struct swrap_oneway_flow *f;
+	struct swrap_oneway_stamp *r;
+	struct swrap_flow_key key;
+	socklen_t len;
+	uint64_t now;
+
+	if (flows == NULL ||
+	    (flags & MSG_PEEK) ||
+	    ret < 0 ||
+	    (ret == 0 && si->type == SOCK_STREAM)) {
+		return;
+	}
+
+	now = swrap_oneway_nsec();
+
+	peer = swrap_flow_source(si, msg, converted, &len);
+	if (!swrap_oneway_key(si, peer, len, false, &key)) {
+		return;
+	}
+	f = swrap_oneway_slot(flows, &key, true);
+	if (f == NULL) {
+		return;
+	}
+
+	f->receiver = getpid();
+	f->received += si->type == SOCK_STREAM ? (uint64_t)ret : 1;
+
+	if (f->rhead - f->rtail == SWRAP_ONEWAY_RING) {
+		f->rtail++;
+	}
+	r = &f->recvs[f->rhead % SWRAP_ONEWAY_RING];
+	r->end = f->received;
+	r->nsec = now;
+	f->rhead++;
+
+	swrap_oneway_drain(f);
+}
+
+static void swrap_oneway_report(const char *path)
+{
+	char buf[SWRAP_PROF_REPORT_SIZE];
+	struct swrap_oneway_result *r;
+	char local[64];
+	char peer[64];
+	size_t len = 0;
+	size_t i;
+	int fd;
+
+	/* The flows of sockets which are still open */
+	for (i = 0; i < SWRAP_ONEWAY_FLOWS; i++) {
+		struct swrap_oneway_flow *f = &swrap_oneway.flows[i];
+
+		if (__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) ==
+		    SWRAP_FLOW_READY && f->receiver == getpid()) {
+			swrap_oneway_free(f);
+		}
+	}
+
+	len += snprintf(buf + len, sizeof(buf) - len,
+			"socket_wrapper one-way latency of pid %d, "
+			"times in ns\n",
+			(int)getpid());
+
+	for (r = swrap_oneway.results;
+	     r != NULL && len < sizeof(buf);
+	     r = r->next) {
+		if (r->hist.count == 0) {
+			continue;
+		}
+
+		swrap_flow_name(&r->key, false, local, sizeof(local));
+		swrap_flow_name(&r->key, true, peer, sizeof(peer));
+
+		len += snprintf(buf + len, sizeof(buf) - len,
+				"%s %s > %s samples %llu missed %llu",
+				r->key.type == SOCK_STREAM ? "tcp" : "udp",
+				local,
+				peer,
+				(unsigned long long)r->hist.count,
+				(unsigned long long)r->missed);
+		if (len < sizeof(buf)) {
+			len += swrap_prof_format(buf + len, sizeof(buf) - len,
+						 "latency", &r->hist, 1.0);
+		}
+		if (len < sizeof(buf)) {
+			len += snprintf(buf + len, sizeof(buf) - len, "\n");
+		}
+	}
+	len = MIN(len, sizeof(buf) - 1);
+
+	fd = libc_open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0666);
+	if (fd == -1) {
+		SWRAP_LOG(SWRAP_LOG_ERROR,
+			  "Failed to open %s: %s",
+			  path, strerror(errno));
+		return;
+	}
+	if (libc_write(fd, buf, len) != (ssize_t)len) {
+		SWRAP_LOG(SWRAP_LOG_ERROR,
+			  "Failed to write the one-way latency report: %s",
+			  strerror(errno));
+	}
+	libc_close(fd);
+}
+
+/* The results of the parent are reported by the parent */
+static void swrap_oneway_atfork_child(void)
+{
+	while (swrap_oneway.results != NULL) {
+		struct swrap_oneway_result *r = swrap_oneway.results;
+
+		swrap_oneway.results = r->next;
+		free(r);
+	}
+}
+
+static void swrap_oneway_destructor(void)
+{
+	const char *path = getenv("SOCKET_WRAPPER_ONEWAY");
+
+	if (swrap_oneway.flows == NULL) {
+		return;
+	}
+
+	if (path != NULL && path[0] != '\0') {
+		swrap_oneway_report(path);
+	}
+	swrap_oneway_atfork_child();
+
+	munmap(swrap_oneway.flows,
+	       SWRAP_ONEWAY_FLOWS * sizeof(struct swrap_oneway_flow));
+	swrap_oneway.flows = NULL;
+	swrap_oneway.disabled = true;
+}
+
+/****************************************************************************
+ *   SOCKET BUFFERS
+ ***************************************************************************/
+
+/*
+ * SO_SNDBUF and SO_RCVBUF follow the rules of the kernel for inet sockets:
+ * the value is limited by wmem_max or rmem_max, unless forced, and doubled
+ * for the overhead of the sk_buffs. Without a value set the defaults of
+ * TCP or UDP are reported, TCP doesn't grow them like the kernel does.
+ *
+ * A unix stream waits for the reader once its send buffer is full, so the
+ * send buffer is given to the unix socket. A unix datagram socket counts
+ * the datagrams the receivers didn't read against its send buffer, UDP
+ * doesn't, so it never gets less than the default there.
+ *
+ * The receive buffer of a unix socket is not used at all. UDP drops what
+ * arrives while the datagrams in the receive queue take more than the
+ * receive buffer. With SOCKET_WRAPPER_RCVBUF=1 the receive queues of the
+ * bound datagram sockets are in the file .rcvq of the socket directory,
+ * keyed by the unix path, so every process can charge the datagrams it
+ * sends. The receiver reads with MSG_TRUNC, a unix datagram socket then
+ * returns the whole size of the datagram even if the buffer was short. A
+ * datagram on the delay queue is charged when it arrives. The slot of a
+ * queue is freed when its socket gets closed, the generation tells the
+ * senders which cached it that it belongs to another socket now.
+ *
+ * The unix socket still only queues max_dgram_qlen datagrams before the
+ * sender has to wait.
+ */
+#define SWRAP_RCVQ_FILE ".rcvq"
+#define SWRAP_RCVQ_SLOTS 4096
+
+/* About what the kernel charges for the sk_buff of a datagram on top */
+#define SWRAP_SKB_OVERHEAD 768
+
+/* SOCK_MIN_SNDBUF and SOCK_MIN_RCVBUF of the kernel */
+#define SWRAP_MIN_SNDBUF 4608
+#define SWRAP_MIN_RCVBUF 2304
+
+struct swrap_rcvq {
+	uint32_t state;
+	/* Bumped by every socket which gets the slot */
+	uint32_t gen;
+	uint32_t hash;
+	/* The receive buffer of the socket, 0 for the default */
+	int32_t rcvbuf;
+	/* The truesize of the datagrams in the queue */
+	uint64_t rmem;
+	char path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+};
+
+static struct {
+	struct swrap_rcvq *slots;
+	bool disabled;
+} swrap_rcvqs;
+
+static struct {
+	pthread_once_t once;
+	int wmem_max;
+	int rmem_max;
+	int wmem_default;
+	int rmem_default;
+	int tcp_wmem;
+	int tcp_rmem;
+} swrap_sysctl = {
+	.once = PTHREAD_ONCE_INIT,
+};
+
+/* The value with the given index of the sysctl file */
+static int swrap_sysctl_read(const char *path, unsigned int idx, int def)
+{
+	char buf[128];
+	const char *p = buf;
+	char *endp;
+	unsigned int i;
+	ssize_t ret;
+	long val;
+	int fd;
+
+	fd = libc_open(path, O_RDONLY|O_CLOEXEC, 0);
+	if (fd == -1) {
+		return def;
+	}
+	ret = libc_read(fd, buf, sizeof(buf) - 1);
+	libc_close(fd);
+	if (ret <= 0) {
+		return def;
+	}
+	buf[ret] = '\0';
+
+	for (i = 0; ; i++) {
+		val = strtol(p, &endp, 10);
+		if (endp == p) {
+			return def;
+		}
+		if (i == idx) {
+			break;
+		}
+		p = endp;
+	}
+
+	if (val <= 0 || val > INT_MAX) {
+		return def;
+	}
+
+	return (int)val;
+}
+
+static void swrap_sysctl_init(void)
+{
+	swrap_sysctl.wmem_max =
+		swrap_sysctl_read("/proc/sys/net/core/wmem_max", 0, 212992);
+	swrap_sysctl.rmem_max =
+		swrap_sysctl_read("/proc/sys/net/core/rmem_max", 0, 212992);
+	swrap_sysctl.wmem_default =
+		swrap_sysctl_read("/proc/sys/net/core/wmem_default", 0, 212992);
+	swrap_sysctl.rmem_default =
+		swrap_sysctl_read("/proc/sys/net/core/rmem_default", 0, 212992);
+	swrap_sysctl.tcp_wmem =
+		swrap_sysctl_read("/proc/sys/net/ipv4/tcp_wmem", 1, 16384);
+	swrap_sysctl.tcp_rmem =
+		swrap_sysctl_read("/proc/sys/net/ipv4/tcp_rmem", 1, 131072);
+}
+
+static bool swrap_sockbuf_option(int optname)
+{
+	switch (optname) {
+	case SO_SNDBUF:
+	case SO_RCVBUF:
+#ifdef SO_SNDBUFFORCE
+	case SO_SNDBUFFORCE:
+#endif
+#ifdef SO_RCVBUFFORCE
+	case SO_RCVBUFFORCE:
+#endif
+		return true;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+static bool swrap_sockbuf_is_snd(int optname)
+{
+#ifdef SO_SNDBUFFORCE
+	if (optname == SO_SNDBUFFORCE) {
+		return true;
+	}
+#endif
+	return optname == SO_SNDBUF;
+}
+
+/* What the kernel reports for the socket */
+static int swrap_sockbuf_get(const struct socket_info *si, bool snd)
+{
+	pthread_once(&swrap_sysctl.once, swrap_sysctl_init);
+
+	if (snd && si->sndbuf != 0) {
+		return si->sndbuf;
+	}
+	if (!snd && si->rcvbuf != 0) {
+		return si->rcvbuf;
+	}
+
+	if (si->type == SOCK_STREAM) {
+		return snd ? swrap_sysctl.tcp_wmem : swrap_sysctl.tcp_rmem;
+	}
+
+	return snd ? swrap_sysctl.wmem_default : swrap_sysctl.rmem_default;
+}
+
+static void swrap_rcvq_init(void)
+{
+	size_t size = SWRAP_RCVQ_SLOTS * sizeof(struct swrap_rcvq);
+	const char *dir;
+	const char *s;
+	char path[1024];
+	struct stat st;
+	void *p;
+	int rc;
+	int fd;
+
+	swrap_rcvqs.disabled = true;
+
+	s = getenv("SOCKET_WRAPPER_RCVBUF");
+	if (s == NULL || strcmp(s, "1") != 0) {
+		return;
+	}
+
+	dir = socket_wrapper_dir();
+	if (dir == NULL) {
+		return;
+	}
+
+	rc = snprintf(path, sizeof(path), "%s/%s", dir, SWRAP_RCVQ_FILE);
+	if (rc <= 0 || (size_t)rc >= sizeof(path)) {
+		return;
+	}
+
+	fd = libc_open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+	if (fd == -1) {
+		SWRAP_LOG(SWRAP_LOG_ERROR,
+			  "Failed to open %s: %s",
+			  path, strerror(errno));
+		return;
+	}
+
+	/* The first process creates it, the table starts zeroed */
+	rc = fstat(fd, &st);
+	if (rc == 0 && (size_t)st.st_size < size) {
+		rc = ftruncate(fd, size);
+	}
+	if (rc == -1) {
+		libc_close(fd);
+		return;
+	}
+
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	libc_close(fd);
+	if (p == MAP_FAILED) {
+		return;
+	}
+
+	SWRAP_LOG(SWRAP_LOG_TRACE, "Sharing the receive queues in %s", path);
+
+	swrap_rcvqs.disabled = false;
+	__atomic_store_n(&swrap_rcvqs.slots,
+			 (struct swrap_rcvq *)p,
+			 __ATOMIC_RELEASE);
+}
+
+static struct swrap_rcvq *swrap_rcvq_get(void)
+{
+	struct swrap_rcvq *slots;
+
+	slots = __atomic_load_n(&swrap_rcvqs.slots, __ATOMIC_ACQUIRE);
+	if (slots != NULL || __atomic_load_n(&swrap_rcvqs.disabled,
+					     __ATOMIC_RELAXED)) {
+		return slots;
+	}
+
+	SWRAP_LOCK(rcvq);
+	if (swrap_rcvqs.slots == NULL && !swrap_rcvqs.disabled) {
+		int saved_errno = errno;
+
+		swrap_rcvq_init();
+		errno = saved_errno;
+	}
+	SWRAP_UNLOCK(rcvq);
+
+	return swrap_rcvqs.slots;
+}
+
+static struct swrap_rcvq *swrap_rcvq_slot(const char *path, bool create)
+{
+	struct swrap_rcvq *slots = swrap_rcvq_get();
+	size_t len = strnlen(path, sizeof(slots->path));
+	struct swrap_rcvq *q = NULL;
+	uint32_t hash = 2166136261U;
+	uint32_t state;
+	size_t i;
+	size_t n;
+
+	if (slots == NULL || len == sizeof(slots->path)) {
+		return NULL;
+	}
+
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (uint8_t)path[i]) * 16777619U;
+	}
+
+	i = hash & (SWRAP_RCVQ_SLOTS - 1);
+	for (n = 0; n < SWRAP_RCVQ_SLOTS; n++) {
+		struct swrap_rcvq *cur = &slots[i];
+
+		/* Another process is filling in the path */
+		state = swrap_flow_claim_wait(&cur->state);
+
+		if (state == SWRAP_FLOW_READY &&
+		    cur->hash == hash &&
+		    strcmp(cur->path, path) == 0) {
+			return cur;
+		}
+		if (state == SWRAP_FLOW_DELETED && q == NULL) {
+			q = cur;
+		}
+		if (state == SWRAP_FLOW_FREE) {
+			if (q == NULL) {
+				q = cur;
+			}
+			break;
+		}
+
+		i = (i + 1) & (SWRAP_RCVQ_SLOTS - 1);
+	}
+
+	if (!create || q == NULL) {
+		return NULL;
+	}
+
+	state = __atomic_load_n(&q->state, __ATOMIC_ACQUIRE);
+	if ((state != SWRAP_FLOW_FREE && state != SWRAP_FLOW_DELETED) ||
+	    !__atomic_compare_exchange_n(&q->state,
+					 &state,
+					 SWRAP_FLOW_CLAIMED,
+					 false,
+					 __ATOMIC_ACQUIRE,
+					 __ATOMIC_ACQUIRE)) {
+		/* Somebody else was faster, maybe with the same path */
+		return swrap_rcvq_slot(path, false);
+	}
+
+	/* Whatever the socket which had it left behind */
+	memset(&q->hash, 0, sizeof(*q) - offsetof(struct swrap_rcvq, hash));
+	q->hash = hash;
+	memcpy(q->path, path, len + 1);
+	__atomic_store_n(&q->state, SWRAP_FLOW_READY, __ATOMIC_RELEASE);
+
+	return q;
+}
+
+/* A datagram socket got bound to the unix path, its queue starts empty */
+static void swrap_rcvq_bind(struct socket_info *si, const char *path)
+{
+	struct swrap_rcvq *q;
+
+	if (si->type != SOCK_DGRAM) {
+		return;
+	}
+
+	q = swrap_rcvq_slot(path, true);
+	if (q == NULL) {
+		return;
+	}
+
+	__atomic_store_n(&q->rmem, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->rcvbuf, si->rcvbuf, __ATOMIC_RELEASE);
+	/* A slot left by a socket which still has the path is ours now */
+	si->rcvq_gen = __atomic_add_fetch(&q->gen, 1, __ATOMIC_RELEASE);
+	si->rcvq = q;
+}
+
+/* The socket gets closed, the slot is free for the next path */
+static void swrap_rcvq_close(struct socket_info *si)
+{
+	struct swrap_rcvq *q = si->rcvq;
+	uint32_t state = SWRAP_FLOW_READY;
+
+	si->rcvq = NULL;
+	si->rcvq_peer = NULL;
+
+	if (q == NULL ||
+	    __atomic_load_n(&q->gen, __ATOMIC_ACQUIRE) != si->rcvq_gen) {
+		return;
+	}
+
+	__atomic_compare_exchange_n(&q->state,
+				    &state,
+				    SWRAP_FLOW_DELETED,
+				    false,
+				    __ATOMIC_RELEASE,
+				    __ATOMIC_RELAXED);
+}
+
+/* The queue a datagram gets sent to, NULL if it isn't known */
+static struct swrap_rcvq *swrap_rcvq_dest(struct socket_info *si,
+					  const struct msghdr *msg)
+{
+	const struct sockaddr_un *un;
+	struct sockaddr_un tmp_un;
+	struct swrap_rcvq *q;
+	int ret;
+
+	if (msg->msg_name != NULL) {
+		un = (const struct sockaddr_un *)msg->msg_name;
+		return swrap_rcvq_slot(un->sun_path, false);
+	}
+
+	if (!si->connected) {
+		return NULL;
+	}
+
+	/* The peer may have been closed and the slot taken by another one */
+	q = si->rcvq_peer;
+	if (q != NULL &&
+	    __atomic_load_n(&q->state, __ATOMIC_ACQUIRE) == SWRAP_FLOW_READY &&
+	    __atomic_load_n(&q->gen, __ATOMIC_ACQUIRE) == si->rcvq_peer_gen) {
+		return q;
+	}
+
+	ret = sockaddr_convert_to_un(si,
+				     &si->peername.sa.s,
+				     si->peername.sa_socklen,
+				     &tmp_un,
+				     0,
+				     NULL);
+	if (ret == -1) {
+		return NULL;
+	}
+	q = swrap_rcvq_slot(tmp_un.sun_path, false);
+	if (q != NULL) {
+		si->rcvq_peer_gen = __atomic_load_n(&q->gen, __ATOMIC_ACQUIRE);
+	}
+	si->rcvq_peer = q;
+
+	return q;
+}
+
+/* Charges a datagram to the queue, false if UDP would drop it */
+static bool swrap_rcvq_charge(struct swrap_rcvq *q, size_t len)
+{
+	uint64_t size = len + SWRAP_SKB_OVERHEAD;
+	uint64_t rmem;
+	int rcvbuf;
+
+	/* The receiver got closed, nobody counts the queue anymore */
+	if (__atomic_load_n(&q->state, __ATOMIC_ACQUIRE) != SWRAP_FLOW_READY) {
+		return true;
+	}
+
+	rcvbuf = __atomic_load_n(&q->rcvbuf, __ATOMIC_ACQUIRE);
+	if (rcvbuf == 0) {
+		pthread_once(&swrap_sysctl.once, swrap_sysctl_init);
+		rcvbuf = swrap_sysctl.rmem_default;
+	}
+
+	/* Like the kernel, it only has to be below the limit before */
+	rmem = __atomic_fetch_add(&q->rmem, size, __ATOMIC_RELAXED);
+	if (rmem > (uint64_t)rcvbuf) {
+		__atomic_fetch_sub(&q->rmem, size, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	return true;
+}
+
+static void swrap_rcvq_uncharge(struct swrap_rcvq *q, size_t len)
+{
+	uint64_t size = len + SWRAP_SKB_OVERHEAD;
+	uint64_t rmem = __atomic_load_n(&q->rmem, __ATOMIC_RELAXED);
+
+	/* Don't wrap if we got the size of a datagram wrong */
+	while (!__atomic_compare_exchange_n(&q->rmem,
+					    &rmem,
+					    rmem > size ? rmem - size : 0,
+					    true,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED)) {
+	}
+}
+
+/* The flags to read with, MSG_TRUNC tells the size of the whole datagram */
+static int swrap_rcvq_recv_flags(const struct socket_info *si, int flags)
+{
+	if (si->type != SOCK_DGRAM || si->rcvq == NULL) {
+		return flags;
+	}
+
+	return flags | MSG_TRUNC;
+}
+
+/*
+ * Takes the datagram read with swrap_rcvq_recv_flags() off the queue and
+ * returns the length the caller asked for.
+ */
+static ssize_t swrap_rcvq_recv(struct socket_info *si,
+			       const struct msghdr *msg,
+			       ssize_t ret,
+			       int flags)
+{
+	size_t avail = 0;
+	size_t i;
+
+	if (si->type != SOCK_DGRAM || ret == -1) {
+		return ret;
+	}
+
+	if (si->rcvq != NULL && !(flags & MSG_PEEK)) {
+		swrap_rcvq_uncharge(si->rcvq, ret);
+	}
+
+	if (flags & MSG_TRUNC) {
+		return ret;
+	}
+
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		avail += msg->msg_iov[i].iov_len;
+	}
+
+	return MIN((size_t)ret, avail);
+}
+
+static int swrap_sockbuf_getsockopt(struct socket_info *si,
+				    int optname,
+				    void *optval,
+				    socklen_t *optlen)
+{
+	if (optval == NULL || optlen == NULL ||
+	    *optlen < (socklen_t)sizeof(int)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*optlen = sizeof(int);
+	*(int *)optval = swrap_sockbuf_get(si, swrap_sockbuf_is_snd(optname));
+
+	return 0;
+}
+
+static int swrap_sockbuf_setsockopt(int fd,
+				    struct socket_info *si,
+				    int optname,
+				    const void *optval,
+				    socklen_t optlen)
+{
+	bool snd = swrap_sockbuf_is_snd(optname);
+	bool force = optname != SO_SNDBUF && optname != SO_RCVBUF;
+	unsigned int val;
+	int unix_val;
+	int size;
+	int ret;
+
+	if (optval == NULL || optlen < (socklen_t)sizeof(int)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_once(&swrap_sysctl.once, swrap_sysctl_init);
+
+	unix_val = *(const int *)optval;
+	if (si->type == SOCK_DGRAM && snd) {
+		unix_val = MAX(unix_val, swrap_sysctl.wmem_default / 2);
+	}
+
+	/* The unix socket checks the permission to force it */
+	ret = libc_setsockopt(fd, SOL_SOCKET, optname,
+			      &unix_val, sizeof(unix_val));
+	if (ret == -1) {
+		return -1;
+	}
+
+	val = *(const unsigned int *)optval;
+	if (force) {
+		if (*(const int *)optval < 0) {
+			val = 0;
+		}
+	} else if (snd) {
+		val = MIN(val, (unsigned int)swrap_sysctl.wmem_max);
+	} else {
+		val = MIN(val, (unsigned int)swrap_sysctl.rmem_max);
+	}
+	val = MIN(val, (unsigned int)INT_MAX / 2);
+
+	/* The kernel doubles it for the overhead of the sk_buffs */
+	if (snd) {
+		size = MAX((int)val * 2, SWRAP_MIN_SNDBUF);
+		si->sndbuf = size;
+	} else {
+		size = MAX((int)val * 2, SWRAP_MIN_RCVBUF);
+		si->rcvbuf = size;
+		if (si->rcvq != NULL) {
+			__atomic_store_n(&si->rcvq->rcvbuf,
+					 size,
+					 __ATOMIC_RELEASE);
+		}
+	}
+
+	return 0;
+}
+
+static void swrap_rcvq_destructor(void)
+{
+	if (swrap_rcvqs.slots == NULL) {
+		return;
+	}
+
+	munmap(swrap_rcvqs.slots,
+	       SWRAP_RCVQ_SLOTS * sizeof(struct swrap_rcvq));
+	swrap_rcvqs.slots = NULL;
+	swrap_rcvqs.disabled = true;
+}
+
+/****************************************************************************
+ *   SHM RING
+ ***************************************************************************/
+
+/*
+ * With SOCKET_WRAPPER_SHM_RING set, the data of a connected stream socket
+ * between two wrapped processes is copied through a shared memory ring per
+ * direction instead of the unix socket. The client creates the memory on
+ * connect() and passes it with the first message on the socket, accept()
+ * picks it up.
+ *
+ * Both ends need to agree on the ring without a round trip. A process
+ * willing to use it marks the socket files of its stream sockets with the
+ * sticky bit. The client only offers the ring if the file of the server is
+ * marked, the server only expects the offer if the file of the client is.
+ * An unwrapped peer never marks its file and gets the plain unix socket.
+ *
+ * The unix socket stays connected and carries the readiness. The writer
+ * sends a token byte when the ring goes from empty to non-empty, the reader
+ * consumes it when it empties the ring. So the socket is readable exactly
+ * while the ring holds data and poll(), select() and epoll work unchanged.
+ * The end of the stream is the EOF of the socket.
+ */
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_LINUX_FUTEX_H) && \
+    defined(HAVE_SYSCALL) && defined(SYS_futex)
+#define HAVE_SWRAP_SHM_RING 1
+#endif
+
+#define SWRAP_RING_MAGIC 0x53575247 /* SWRG */
+#define SWRAP_RING_VERSION 1
+#define SWRAP_RING_SIZE_MIN (4 * 1024)
+#define SWRAP_RING_SIZE_MAX (64 * 1024 * 1024)
+#define SWRAP_RING_WAIT_MSEC 100
+#define SWRAP_RING_HELLO_MSEC 1000
+
+/* One direction, the writer and the reader share the cache line */
+struct swrap_ring {
+	uint64_t count;		/* bytes in the ring */
+	uint64_t head;		/* only moved by the reader */
+	uint64_t tail;		/* only moved by the writer */
+	uint32_t space;		/* the futex a writer sleeps on */
+	uint32_t waiting;	/* a writer sleeps */
+	uint32_t closed;	/* the reader is gone */
+	uint8_t pad[28];
+};
+
+struct swrap_ring_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint8_t pad[48];
+	/* The client writes to the first ring, the server to the second */
+	struct swrap_ring ring[2];
+	/* followed by the data of both rings */
+};
+
+struct swrap_ring_hello {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size; /* 0 if the client failed to set up the ring */
+};
+
+/* The number of rings mapped by this process, for the poll() fast path */
+static unsigned int swrap_ring_active;
+
+struct swrap_ring_conn {
+	struct swrap_ring_shm *shm;
+	size_t maplen;
+	size_t size;
+	struct swrap_ring *tx;
+	struct swrap_ring *rx;
+	uint8_t *tx_data;
+	uint8_t *rx_data;
+	bool shut_wr;
+	pthread_mutex_t tx_mutex;
+	pthread_mutex_t rx_mutex;
+};
+
+/* The ring size from the environment, read when a socket gets bound */
+static size_t swrap_ring_size(void)
+{
+#ifdef HAVE_SWRAP_SHM_RING
+	unsigned long long v;
+	char *end = NULL;
+	const char *s;
+
+	s = getenv("SOCKET_WRAPPER_SHM_RING");
+	if (s == NULL) {
+		return 0;
+	}
+
+	v = strtoull(s, &end, 10);
+	if (end == s || v == 0) {
+		return 0;
+	}
+	if (end[0] == 'k') {
+		v *= 1024;
+		end++;
+	} else if (end[0] == 'm') {
+		v *= 1024 * 1024;
+		end++;
+	}
+	if (end[0] != '\0') {
+		return 0;
+	}
+
+	/* Delayed data has to go through the delay queue */
+	if (swrap_link_flags() & (SWRAP_LINK_LATENCY | SWRAP_LINK_BANDWIDTH)) {
+		return 0;
+	}
+
+	return MIN(MAX(v, SWRAP_RING_SIZE_MIN), SWRAP_RING_SIZE_MAX);
+#else
+	return 0;
+#endif
+}
+
+/* Mark the socket file, so a wrapped peer knows we can use the ring */
+static void swrap_ring_mark(struct socket_info *si, const char *path)
+{
+	struct stat st;
+	size_t size;
+	int rc;
+
+	si->ring_size = 0;
+
+	if (si->type != SOCK_STREAM) {
+		return;
+	}
+
+	size = swrap_ring_size();
+	if (size == 0) {
+		return;
+	}
+
+	rc = stat(path, &st);
+	if (rc == -1) {
+		return;
+	}
+	rc = chmod(path, (st.st_mode & 07777) | S_ISVTX);
+	if (rc == -1) {
+		return;
+	}
+
+	si->ring_size = size;
+}
+
+static bool swrap_ring_marked(const char *path)
+{
+	struct stat st;
+	int rc;
+
+	if (path[0] == '\0') {
+		return false;
+	}
+
+	rc = stat(path, &st);
+	if (rc == -1) {
+		return false;
+	}
+
+	return (st.st_mode & S_ISVTX) != 0;
+}
+
+static struct swrap_ring_conn *swrap_ring_map(int memfd,
+					      size_t size,
+					      bool client)
+{
+	struct swrap_ring_conn *rc;
+	uint8_t *data;
+	void *p;
+
+	rc = (struct swrap_ring_conn *)calloc(1, sizeof(struct swrap_ring_conn));
+	if (rc == NULL) {
+		return NULL;
+	}
+
+	rc->size = size;
+	rc->maplen = sizeof(struct swrap_ring_shm) + 2 * size;
+
+	p = mmap(NULL, rc->maplen, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (p == MAP_FAILED) {
+		free(rc);
+		return NULL;
+	}
+	rc->shm = (struct swrap_ring_shm *)p;
+	data = (uint8_t *)p + sizeof(struct swrap_ring_shm);
+
+	if (client) {
+		rc->tx = &rc->shm->ring[0];
+		rc->tx_data = data;
+		rc->rx = &rc->shm->ring[1];
+		rc->rx_data = data + size;
+	} else {
+		rc->tx = &rc->shm->ring[1];
+		rc->tx_data = data + size;
+		rc->rx = &rc->shm->ring[0];
+		rc->rx_data = data;
+	}
+
+	pthread_mutex_init(&rc->tx_mutex, NULL);
+	pthread_mutex_init(&rc->rx_mutex, NULL);
+
+	__atomic_add_fetch(&swrap_ring_active, 1, __ATOMIC_RELAXED);
+
+	return rc;
+}
+
+static void swrap_ring_unmap(struct swrap_ring_conn *rc)
+{
+	munmap(rc->shm, rc->maplen);
+	pthread_mutex_destroy(&rc->tx_mutex);
+	pthread_mutex_destroy(&rc->rx_mutex);
+	free(rc);
+
+	__atomic_sub_fetch(&swrap_ring_active, 1, __ATOMIC_RELAXED);
+}
+
+/* Wake up a writer waiting for space */
+static void swrap_ring_wake(struct swrap_ring *r, bool force)
+{
+	if (!force && __atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST) == 0) {
+		return;
+	}
+
+	__atomic_store_n(&r->waiting, 0, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&r->space, 1, __ATOMIC_SEQ_CST);
+#ifdef HAVE_SWRAP_SHM_RING
+	syscall(SYS_futex, &r->space, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* Sleep until the reader made room or is gone, at most msec */
+static void swrap_ring_wait_space(struct swrap_ring_conn *rc, int msec)
+{
+	struct swrap_ring *r = rc->tx;
+	uint32_t seq;
+
+	__atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+	seq = __atomic_load_n(&r->space, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&r->count, __ATOMIC_SEQ_CST) < rc->size ||
+	    __atomic_load_n(&r->closed, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+
+#ifdef HAVE_SWRAP_SHM_RING
+	{
+		struct timespec ts;
+
+		swrap_usec_to_timespec((uint64_t)msec * 1000, &ts);
+		syscall(SYS_futex, &r->space, FUTEX_WAIT, seq, &ts, NULL, 0);
+	}
+#else
+	(void)seq;
+	libc_poll(NULL, 0, msec);
+#endif
+}
+
+static int swrap_ring_poll(int fd, short events, int timeout)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = events,
+	};
+
+	return libc_poll(&pfd, 1, timeout);
+}
+
+/* A reader which died didn't mark the ring closed, but the socket tells */
+static bool swrap_ring_hangup(int fd)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+	};
+	int ret;
+
+	ret = libc_poll(&pfd, 1, 0);
+
+	return ret == 1 && (pfd.revents & (POLLHUP|POLLERR));
+}
+
+/* SO_RCVTIMEO and SO_SNDTIMEO in ms, -1 for none */
+static int swrap_ring_timeout(int fd, int optname)
+{
+	struct timeval tv;
+	socklen_t len = sizeof(tv);
+	int rc;
+
+	rc = libc_getsockopt(fd, SOL_SOCKET, optname, &tv, &len);
+	if (rc == -1 || (tv.tv_sec == 0 && tv.tv_usec == 0)) {
+		return -1;
+	}
+
+	return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+/* Announce that the ring is no longer empty */
+static void swrap_ring_signal(int fd)
+{
+	uint8_t token = 0;
+	int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+
+	for (;;) {
+		ssize_t ret;
+
+		ret = libc_send(fd, &token, 1, flags);
+		if (ret == 1) {
+			return;
+		}
+		if (errno == EAGAIN) {
+			swrap_ring_poll(fd, POLLOUT, -1);
+		} else if (errno != EINTR) {
+			/* The reader is gone */
+			return;
+		}
+	}
+}
+
+/* Consume the announcement after emptying the ring */
+static void swrap_ring_unsignal(int fd)
+{
+	uint8_t token;
+
+	for (;;) {
+		ssize_t ret;
+
+		/* The writer might not have sent it yet */
+		ret = libc_recv(fd, &token, 1, MSG_DONTWAIT);
+		if (ret != -1) {
+			return;
+		}
+		if (errno == EAGAIN) {
+			swrap_ring_poll(fd, POLLIN, -1);
+		} else if (errno != EINTR) {
+			return;
+		}
+	}
+}
+
+/*
+ * Copy n bytes between the ring at pos and the iovecs, starting skip bytes
+ * into the iovecs.
+ */
+static void swrap_ring_copy(uint8_t *data,
+			    size_t size,
+			    uint64_t pos,
+			    const struct iovec *iov,
+			    size_t iovcnt,
+			    size_t skip,
+			    size_t n,
+			    bool to_ring)
+{
+	size_t ofs = pos % size;
+	size_t i;
+
+	for (i = 0; i < iovcnt && n > 0; i++) {
+		uint8_t *p = (uint8_t *)iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		p += skip;
+		len = MIN(len - skip, n);
+		skip = 0;
+		n -= len;
+
+		while (len > 0) {
+			size_t chunk = MIN(len, size - ofs);
+
+			if (to_ring) {
+				memcpy(data + ofs, p, chunk);
+			} else {
+				memcpy(p, data + ofs, chunk);
+			}
+			p += chunk;
+			len -= chunk;
+			ofs += chunk;
+			if (ofs == size) {
+				ofs = 0;
+			}
+		}
+	}
+}
+
+static ssize_t swrap_ring_sendmsg(int fd,
+				  struct socket_info *si,
+				  const struct msghdr *msg,
+				  int flags)
+{
+	struct swrap_ring_conn *rc = si->ring;
+	struct swrap_ring *r = rc->tx;
+	size_t i, len = 0, total = 0;
+	int timeout = -2;
+	uint64_t deadline = 0;
+	int err = 0;
+
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		len += msg->msg_iov[i].iov_len;
+	}
+
+	pthread_mutex_lock(&rc->tx_mutex);
+	while (total < len) {
+		uint64_t count;
+		size_t n;
+
+		if (rc->shut_wr || __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+			err = EPIPE;
+			break;
+		}
+
+		count = __atomic_load_n(&r->count, __ATOMIC_ACQUIRE);
+		if (count == rc->size) {
+			uint64_t now;
+
+			if ((flags & MSG_DONTWAIT) || swrap_fault_nonblock(fd)) {
+				err = EAGAIN;
+				break;
+			}
+
+			if (timeout == -2) {
+				timeout = swrap_ring_timeout(fd, SO_SNDTIMEO);
+				deadline = swrap_monotonic_usec() +
+					   (uint64_t)timeout * 1000;
+			}
+			now = swrap_monotonic_usec();
+			if (timeout != -1 && now >= deadline) {
+				err = EAGAIN;
+				break;
+			}
+
+			swrap_ring_wait_space(rc, SWRAP_RING_WAIT_MSEC);
+			if (swrap_ring_hangup(fd)) {
+				err = EPIPE;
+				break;
+			}
+			continue;
+		}
+
+		n = MIN(len - total, rc->size - count);
+		swrap_ring_copy(rc->tx_data,
+				rc->size,
+				r->tail,
+				msg->msg_iov,
+				msg->msg_iovlen,
+				total,
+				n,
+				true);
+		r->tail += n;
+		total += n;
+
+		if (__atomic_fetch_add(&r->count, n, __ATOMIC_SEQ_CST) == 0) {
+			swrap_ring_signal(fd);
+		}
+	}
+	pthread_mutex_unlock(&rc->tx_mutex);
+
+	if (total > 0) {
+		return total;
+	}
+
+#ifdef MSG_NOSIGNAL
+	if (err == EPIPE && (flags & MSG_NOSIGNAL) == 0) {
+		raise(SIGPIPE);
+	}
+#else
+	if (err == EPIPE) {
+		raise(SIGPIPE);
+	}
+#endif
+
+	errno = err;
+	return -1;
+}
+
+static ssize_t swrap_ring_recvmsg(int fd,
+				  struct socket_info *si,
+				  struct msghdr *msg,
+				  int flags)
+{
+	struct swrap_ring_conn *rc = si->ring;
+	struct swrap_ring *r = rc->rx;
+	size_t i, len = 0, total = 0;
+	int timeout = -2;
+	int err = 0;
+
+	msg->msg_namelen = 0;
+#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	msg->msg_controllen = 0;
+	msg->msg_flags = 0;
+#endif
+
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		len += msg->msg_iov[i].iov_len;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&rc->rx_mutex);
+	for (;;) {
+		uint64_t count;
+		size_t n;
+
+		count = __atomic_load_n(&r->count, __ATOMIC_ACQUIRE);
+		if (count == 0) {
+			uint8_t token;
+			ssize_t ret;
+
+			/* Only MSG_WAITALL waits for more */
+			ret = libc_recv(fd, &token, 1, MSG_PEEK|MSG_DONTWAIT);
+			if (ret == 1) {
+				/* The writer just filled the ring */
+				continue;
+			}
+			if (ret == 0) {
+				/* EOF */
+				break;
+			}
+			if (errno != EAGAIN) {
+				err = errno;
+				break;
+			}
+
+			if ((flags & MSG_DONTWAIT) || swrap_fault_nonblock(fd)) {
+				err = EAGAIN;
+				break;
+			}
+
+			if (timeout == -2) {
+				timeout = swrap_ring_timeout(fd, SO_RCVTIMEO);
+			}
+			ret = swrap_ring_poll(fd, POLLIN, timeout);
+			if (ret == 0) {
+				err = EAGAIN;
+				break;
+			}
+			if (ret == -1) {
+				err = errno;
+				break;
+			}
+			continue;
+		}
+
+		n = MIN(len - total, count);
+		swrap_ring_copy(rc->rx_data,
+				rc->size,
+				r->head,
+				msg->msg_iov,
+				msg->msg_iovlen,
+				total,
+				n,
+				false);
+		total += n;
+
+		if (flags & MSG_PEEK) {
+			break;
+		}
+
+		r->head += n;
+		if (__atomic_fetch_sub(&r->count, n, __ATOMIC_SEQ_CST) == n) {
+			swrap_ring_unsignal(fd);
+		}
+		swrap_ring_wake(r, false);
+
+		if ((flags & MSG_WAITALL) == 0 || total == len) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rc->rx_mutex);
+
+	if (total > 0 || err == 0) {
+		return total;
+	}
+
+	errno = err;
+	return -1;
+}
+
+/* The number of bytes ready to be read, for FIONREAD */
+static int swrap_ring_pending(struct socket_info *si)
+{
+	uint64_t count = __atomic_load_n(&si->ring->rx->count, __ATOMIC_ACQUIRE);
+
+	return MIN(count, (uint64_t)INT_MAX);
+}
+
+/* A full ring isn't writable, but the socket is */
+static bool swrap_ring_full(struct socket_info *si)
+{
+	struct swrap_ring_conn *rc = si->ring;
+
+	if (rc == NULL) {
+		return false;
+	}
+
+	return __atomic_load_n(&rc->tx->count, __ATOMIC_ACQUIRE) == rc->size;
+}
+
+/* The client side, called after the unix socket got connected */
+static void swrap_ring_connect(int fd,
+			       struct socket_info *si,
+			       const char *path)
+{
+	struct swrap_ring_hello hello = {
+		.magic = SWRAP_RING_MAGIC,
+		.version = SWRAP_RING_VERSION,
+	};
+	union {
+		struct cmsghdr cm;
+		uint8_t buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct swrap_ring_conn *rc = NULL;
+	struct msghdr msg;
+	struct iovec iov;
+	int memfd = -1;
+	ssize_t ret;
+
+	if (si->ring_size == 0 || !swrap_ring_marked(path)) {
+		return;
+	}
+
+	ZERO_STRUCT(msg);
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+#ifdef HAVE_SWRAP_SHM_RING
+	memfd = memfd_create("socket_wrapper_ring", MFD_CLOEXEC);
+#endif
+	if (memfd != -1 &&
+	    ftruncate(memfd,
+		      sizeof(struct swrap_ring_shm) + 2 * si->ring_size) == 0) {
+		rc = swrap_ring_map(memfd, si->ring_size, true);
+	}
+
+	if (rc != NULL) {
+		struct cmsghdr *cm;
+
+		rc->shm->magic = SWRAP_RING_MAGIC;
+		rc->shm->version = SWRAP_RING_VERSION;
+		rc->shm->size = rc->size;
+		hello.size = rc->size;
+
+		memset(&cmsg, 0, sizeof(cmsg));
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = sizeof(cmsg.buf);
+
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &memfd, sizeof(int));
+	}
+
+	/* The server waits for the hello, also if we failed */
+	do {
+		ret = libc_sendmsg(fd, &msg, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (memfd != -1) {
+		libc_close(memfd);
+	}
+
+	if (ret != sizeof(hello) || rc == NULL) {
+		SWRAP_LOG(SWRAP_LOG_WARN, "Failed to offer the shm ring on fd %d", fd);
+		if (rc != NULL) {
+			swrap_ring_unmap(rc);
+		}
+		return;
+	}
+
+	SWRAP_LOG(SWRAP_LOG_TRACE,
+		  "Using a shm ring of %zu bytes on fd %d",
+		  rc->size, fd);
+	si->ring = rc;
+}
+
+/*
+ * Receive the hello of the client within timeout ms. Fails with EAGAIN if
+ * it didn't arrive yet, the socket stays pending. Nothing can be read or
+ * written before, the client sends the hello ahead of any data.
+ */
+static int swrap_ring_hello(int fd, struct socket_info *si, int timeout)
+{
+	struct swrap_ring_hello hello;
+	union {
+		struct cmsghdr cm;
+		uint8_t buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	struct iovec iov;
+	struct stat st;
+	int memfd = -1;
+	int flags = MSG_DONTWAIT;
+	ssize_t ret;
+	int rc;
+
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+	rc = swrap_ring_poll(fd, POLLIN, timeout);
+	if (rc == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (rc == -1) {
+		return -1;
+	}
+
+	ZERO_STRUCT(msg);
+	memset(&cmsg, 0, sizeof(cmsg));
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+
+	do {
+		ret = libc_recvmsg(fd, &msg, flags);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == -1 && errno == EAGAIN) {
+		return -1;
+	}
+
+	si->ring_pending = false;
+	__atomic_sub_fetch(&swrap_ring_active, 1, __ATOMIC_RELAXED);
+
+	for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET &&
+		    cm->cmsg_type == SCM_RIGHTS &&
+		    cm->cmsg_len == CMSG_LEN(sizeof(int))) {
+			memcpy(&memfd, CMSG_DATA(cm), sizeof(int));
+		}
+	}
+
+	if (ret == 0) {
+		/* The client is gone, the socket reports the EOF */
+		return 0;
+	}
+
+	if (ret != sizeof(hello) ||
+	    hello.magic != SWRAP_RING_MAGIC ||
+	    hello.version != SWRAP_RING_VERSION) {
+		goto fail;
+	}
+
+	if (hello.size == 0) {
+		/* The client wasn't able to set up the ring */
+		if (memfd != -1) {
+			libc_close(memfd);
+		}
+		return 0;
+	}
+
+	if (memfd == -1 ||
+	    hello.size < SWRAP_RING_SIZE_MIN ||
+	    hello.size > SWRAP_RING_SIZE_MAX) {
+		goto fail;
+	}
+
+	rc = fstat(memfd, &st);
+	if (rc == -1 ||
+	    (size_t)st.st_size < sizeof(struct swrap_ring_shm) + 2 * hello.size) {
+		goto fail;
+	}
+
+	si->ring = swrap_ring_map(memfd, hello.size, false);
+	if (si->ring == NULL) {
+		goto fail;
+	}
+	libc_close(memfd);
+
+	SWRAP_LOG(SWRAP_LOG_TRACE,
+		  "Using a shm ring of %zu bytes on fd %d",
+		  si->ring->size, fd);
+
+	return 0;
+
+fail:
+	SWRAP_LOG(SWRAP_LOG_ERROR, "Invalid shm ring hello on fd %d", fd);
+	if (memfd != -1) {
+		libc_close(memfd);
+	}
+	errno = ECONNABORTED;
+	return -1;
+}
+
+/*
+ * The server side, called for the accepted socket. The client sends the
+ * hello right after connect() returned, a blocking listener waits a moment
+ * for it. Otherwise the socket stays pending, the first read, write or
+ * poll picks the hello up.
+ */
+static int swrap_ring_accept(int fd,
+			     int listen_fd,
+			     struct socket_info *si,
+			     struct socket_info *parent_si,
+			     const char *path)
+{
+	int timeout = SWRAP_RING_HELLO_MSEC;
+	int rc;
+
+	if (parent_si->ring_size == 0 || !swrap_ring_marked(path)) {
+		return 0;
+	}
+
+	if (swrap_fault_nonblock(listen_fd)) {
+		timeout = 0;
+	}
+
+	si->ring_pending = true;
+	__atomic_add_fetch(&swrap_ring_active, 1, __ATOMIC_RELAXED);
+
+	rc = swrap_ring_hello(fd, si, timeout);
+	if (rc == -1 && errno == EAGAIN) {
+		SWRAP_LOG(SWRAP_LOG_TRACE,
+			  "No shm ring hello yet on fd %d", fd);
+		return 0;
+	}
+
+	return rc;
+}
+
+/*
+ * Pick up a hello still pending before the data moves. A blocking socket
+ * waits up to the timeout of the direction, the client sends the hello
+ * right after connecting.
+ */
+static int swrap_ring_pending_wait(int fd, struct socket_info *si, int optname)
+{
+	int timeout = 0;
+
+	if (!si->ring_pending) {
+		return 0;
+	}
+
+	if (!swrap_fault_nonblock(fd)) {
+		timeout = swrap_ring_timeout(fd, optname);
+	}
+
+	return swrap_ring_hello(fd, si, timeout);
+}
+
+/* Called when the last reference to a socket is closed */
+static void swrap_ring_release(struct socket_info *si)
+{
+	struct swrap_ring_conn *rc = si->ring;
+
+	si->ring_size = 0;
+
+	if (si->ring_pending) {
+		si->ring_pending = false;
+		__atomic_sub_fetch(&swrap_ring_active, 1, __ATOMIC_RELAXED);
+	}
+
+	if (rc == NULL) {
+		return;
+	}
+	si->ring = NULL;
+
+	/* Don't let the writer wait for space which never comes */
+	__atomic_store_n(&rc->rx->closed, 1, __ATOMIC_SEQ_CST);
+	swrap_ring_wake(rc->rx, true);
+
+	swrap_ring_unmap(rc);
+}
+
+/****************************************************************************
+ *   SIGNALFD
+ ***************************************************************************/
+
+#ifdef HAVE_SIGNALFD
+static int swrap_signalfd(int fd, const sigset_t *mask, int flags)
+{
+	int rc;
+
+	rc = libc_signalfd(fd, mask, flags);
+	if (rc != -1) {
+		swrap_remove_stale(fd);
+	}
+
+	return rc;
+}
+
+int signalfd(int fd, const sigset_t *mask, int flags)
+{
+	return swrap_signalfd(fd, mask, flags);
+}
+#endif
+
+/****************************************************************************
+ *   SOCKET
+ ***************************************************************************/
+
+static int swrap_socket(int family, int type, int protocol)
+{
+	struct socket_info *si;
+	struct socket_info_fd *fi;
+	int fd;
+	int idx;
+	int real_type = type;
+
+	/*
+	 * Remove possible addition flags passed to socket() so
+	 * do not fail checking the type.
+	 * See https://lwn.net/Articles/281965/
+	 */
+#ifdef SOCK_CLOEXEC
+	real_type &= ~SOCK_CLOEXEC;
+#endif
+#ifdef SOCK_NONBLOCK
+	real_type &= ~SOCK_NONBLOCK;
+#endif
+
+	if (!socket_wrapper_enabled()) {
+		return libc_socket(family, type, protocol);
+	}
+
+	switch (family) {
+	case AF_INET:
+#ifdef HAVE_IPV6
+	case AF_INET6:
+#endif
+		break;
+#ifdef AF_NETLINK
+	case AF_NETLINK:
+#endif /* AF_NETLINK */
+#ifdef AF_PACKET
+	case AF_PACKET:
+#endif /* AF_PACKET */
+	case AF_UNIX:
+		return libc_socket(family, type, protocol);
+	default:
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+
+	switch (real_type) {
+	case SOCK_STREAM:
+		break;
+	case SOCK_DGRAM:
+		break;
+	default:
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+
+	switch (protocol) {
+	case 0:
+		break;
+	case 6:
+		if (real_type == SOCK_STREAM) {
+			break;
+		}
+		/*fall through*/
+	case 17:
+		if (real_type == SOCK_DGRAM) {
+			break;
+		}
+		/*fall through*/
+	default:
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+
+	/*
+	 * We must call libc_socket with type, from the caller, not the version
+	 * we removed SOCK_CLOEXEC and SOCK_NONBLOCK from
+	 */
+	fd = libc_socket(AF_UNIX, type, 0);
+
+	if (fd == -1) {
+		return -1;
+	}
+
+	/* Check if we have a stale fd and remove it */
+	swrap_remove_stale(fd);
+
+	idx = socket_wrapper_first_free_index();
+	if (idx == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	si = &sockets[idx];
+
+	si->family = family;
+
+	/* however, the rest of the socket_wrapper code expects just
+	 * the type, not the flags */
+	si->type = real_type;
+	si->protocol = protocol;
+
+	/*
+	 * Setup myname so getsockname() can succeed to find out the socket
+	 * type.
+	 */
+	switch(si->family) {
+	case AF_INET: {
+		struct sockaddr_in sin = {
+			.sin_family = AF_INET,
+		};
+
+		si->myname.sa_socklen = sizeof(struct sockaddr_in);
+		memcpy(&si->myname.sa.in, &sin, si->myname.sa_socklen);
+		break;
+	}
+	case AF_INET6: {
+		struct sockaddr_in6 sin6 = {
+			.sin6_family = AF_INET6,
+		};
+
+		si->myname.sa_socklen = sizeof(struct sockaddr_in6);
+		memcpy(&si->myname.sa.in6, &sin6, si->myname.sa_socklen);
+		break;
+	}
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	fi = swrap_fd_entry_alloc();
+	if (fi == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	si->refcount = 1;
+	first_free = si->next_free;
+	si->next_free = 0;
+
+	fi->fd = fd;
+	fi->si_index = idx;
+
+	SWRAP_DLIST_ADD(socket_fds, fi);
+
+	SWRAP_LOG(SWRAP_LOG_TRACE,
+		  "Created %s socket for protocol %s",
+		  si->family == AF_INET ? "IPv4" : "IPv6",
+		  si->type == SOCK_DGRAM ? "UDP" : "TCP");
+
+	swrap_stats_open(fd, si);
+	swrap_stats_call(fd, si, SWRAP_STATS_SOCKET, fd, 0);
+	swrap_control_start();
+
+	return fd;
+}
+
+int socket(int family, int type, int protocol)
+{
+	return SWRAP_PROF(SOCKET, swrap_socket(family, type, protocol));
+}
+
+/****************************************************************************
+ *   SOCKETPAIR
+ ***************************************************************************/
+
+static int swrap_socketpair(int family, int type, int protocol, int sv[2])
+{
+	int rc;
+
+	rc = libc_socketpair(family, type, protocol, sv);
+	if (rc != -1) {
+		swrap_remove_stale(sv[0]);
+		swrap_remove_stale(sv[1]);
+	}
+
+	return rc;
+}
+
+int socketpair(int family, int type, int protocol, int sv[2])
+{
+	return swrap_socketpair(family, type, protocol, sv);
+}
+
+/****************************************************************************
+ *   SOCKETPAIR
+ ***************************************************************************/
+
+#ifdef HAVE_TIMERFD_CREATE
+static int swrap_timerfd_create(int clockid, int flags)
+{
+	int fd;
+
+	fd = libc_timerfd_create(clockid, flags);
+	if (fd != -1) {
+		swrap_remove_stale(fd);
+	}
+
+	return fd;
+}
+
+int timerfd_create(int clockid, int flags)
+{
+	return swrap_timerfd_create(clockid, flags);
+}
+#endif
+
+/****************************************************************************
+ *   PIPE
+ ***************************************************************************/
+
+static int swrap_pipe(int pipefd[2])
+{
+	int rc;
+
+	rc = libc_pipe(pipefd);
+	if (rc != -1) {
+		swrap_remove_stale(pipefd[0]);
+		swrap_remove_stale(pipefd[1]);
+	}
+
+	return rc;
+}
+
+int pipe(int pipefd[2])
+{
+	return swrap_pipe(pipefd);
+}
+
+/****************************************************************************
+ *   ACCEPT
+ ***************************************************************************/
+
+/*
+ * All the sockets accepted on a listener share its unix path, translate it
+ * once and keep the result with the listener.
+ */
+static int swrap_accept_name(int fd, struct socket_info *parent_si)
+{
+	struct swrap_address un_my_addr = {
+		.sa_socklen = sizeof(struct sockaddr_un),
+	};
+	struct swrap_address in_my_addr = {
+		.sa_socklen = sizeof(struct sockaddr_storage),
+	};
+	int ret;
+
+	if (parent_si->acceptname.sa_socklen > 0) {
+		return 0;
+	}
+
+	ret = libc_getsockname(fd,
+			       &un_my_addr.sa.s,
+			       &un_my_addr.sa_socklen);
+	if (ret == -1) {
+		return ret;
+	}
+
+	ret = sockaddr_convert_from_un(parent_si,
+				       &un_my_addr.sa.un,
+				       un_my_addr.sa_socklen,
+				       parent_si->family,
+				       &in_my_addr.sa.s,
+				       &in_my_addr.sa_socklen);
+	if (ret == -1) {
+		return ret;
+	}
+
+	parent_si->acceptname = in_my_addr;
+
+	return 0;
+}
+
+static int swrap_accept(int s,
+			struct sockaddr *addr,
+			socklen_t *addrlen,
+			int flags)
+{
+	struct socket_info *parent_si, *child_si;
+	struct socket_info_fd *child_fi;
+	int fd;
+	int idx;
+	struct swrap_address un_addr = {
+		.sa_socklen = sizeof(struct sockaddr_un),
+	};
+	struct swrap_address in_addr = {
+		.sa_socklen = sizeof(struct sockaddr_storage),
+	};
+	int ret;
+
+	parent_si = find_socket_info(s);
+	if (!parent_si) {
+#ifdef HAVE_ACCEPT4
+		return libc_accept4(s, addr, addrlen, flags);
+#else
+		UNUSED(flags);
+		return libc_accept(s, addr, addrlen);
+#endif
+	}
+
+	/*
+	 * assume out sockaddr have the same size as the in parent
+	 * socket family
+	 */
+	in_addr.sa_socklen = socket_length(parent_si->family);
+	if (in_addr.sa_socklen <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+#ifdef HAVE_ACCEPT4
+	ret = libc_accept4(s, &un_addr.sa.s, &un_addr.sa_socklen, flags);
+#else
+	UNUSED(flags);
+	ret = libc_accept(s, &un_addr.sa.s, &un_addr.sa_socklen);
+#endif
+	if (ret == -1) {
+		if (errno == ENOTSOCK) {
+			/* Remove stale fds */
+			swrap_remove_stale(s);
+		} else {
+			swrap_stats_call(s, parent_si, SWRAP_STATS_ACCEPT,
+					 ret, errno);
+		}
+		return ret;
+	}
+
+	fd = ret;
+
+	ret = sockaddr_convert_from_un(parent_si,
+				       &un_addr.sa.un,
+				       un_addr.sa_socklen,
+				       parent_si->family,
+				       &in_addr.sa.s,
+				       &in_addr.sa_socklen);
+	if (ret == -1) {
+		close(fd);
+		return ret;
+	}
+
+	idx = socket_wrapper_first_free_index();
+	if (idx == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	child_si = &sockets[idx];
+
+	child_fi = swrap_fd_entry_alloc();
+	if (child_fi == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	child_fi->fd = fd;
+
+	child_si->family = parent_si->family;
+	child_si->type = parent_si->type;
+	child_si->protocol = parent_si->protocol;
+	child_si->bound = 1;
+	child_si->is_server = 1;
+	child_si->connected = 1;
+
+	child_si->peername = (struct swrap_address) {
+		.sa_socklen = in_addr.sa_socklen,
+	};
+	memcpy(&child_si->peername.sa.ss, &in_addr.sa.ss, in_addr.sa_socklen);
+
+	if (addr != NULL && addrlen != NULL) {
+		size_t copy_len = MIN(*addrlen, in_addr.sa_socklen);
+		if (copy_len > 0) {
+			memcpy(addr, &in_addr.sa.ss, copy_len);
+		}
+		*addrlen = in_addr.sa_socklen;
+	}
+
+	ret = swrap_accept_name(fd, parent_si);
+	if (ret == -1) {
+		swrap_fd_entry_free(child_fi);
+		close(fd);
+		return ret;
+	}
+
+	ret = swrap_ring_accept(fd,
+				s,
+				child_si,
+				parent_si,
+				un_addr.sa.un.sun_path);
+	if (ret == -1) {
+		swrap_ring_release(child_si);
+		swrap_fd_entry_free(child_fi);
+		close(fd);
+		return -1;
+	}
+
+	SWRAP_LOG(SWRAP_LOG_TRACE,
+		  "accept() peer path=%s, fd=%d",
+		  un_addr.sa.un.sun_path, s);
+
+	child_si->myname = parent_si->acceptname;
+
+	/* Accepted sockets keep the port of the listener in use */
+	child_si->reuseaddr = parent_si->reuseaddr;
+	child_si->reuseport = parent_si->reuseport;
+
+	/* Like the socket options the kernel copies to the new socket */
+	child_si->timestamp = parent_si->timestamp;
+	child_si->timestamping = parent_si->timestamping;
+	child_si->sndbuf = parent_si->sndbuf;
+	child_si->rcvbuf = parent_si->rcvbuf;
+	if (child_si->sndbuf != 0) {
+		int val = child_si->sndbuf / 2;
+
+		libc_setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val));
+	}
+	swrap_bind_add(child_si, &child_si->myname);
+
+	child_si->refcount = 1;
+	first_free = child_si->next_free;
+	child_si->next_free = 0;
+
+	child_fi->si_index = idx;
+
+	SWRAP_DLIST_ADD(socket_fds, child_fi);
+
+	if (addr != NULL) {
+		swrap_pcap_dump_packet(child_si, addr, SWRAP_ACCEPT_SEND, NULL, 0);
+		swrap_pcap_dump_packet(child_si, addr, SWRAP_ACCEPT_RECV, NULL, 0);
+		swrap_pcap_dump_packet(child_si, addr, SWRAP_ACCEPT_ACK, NULL, 0);
+	}
+
+	swrap_stats_open(fd, child_si);
+	swrap_stats_call(s, parent_si, SWRAP_STATS_ACCEPT, fd, 0);
+
+	return fd;
+}
+
+#ifdef HAVE_ACCEPT4
+int accept4(int s, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+	return SWRAP_PROF(ACCEPT,
+			  swrap_accept(s, addr, (socklen_t *)addrlen, flags));
+}
+#endif
+
+#ifdef HAVE_ACCEPT_PSOCKLEN_T
+int accept(int s, struct sockaddr *addr, Psocklen_t addrlen)
+#else
+int accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+#endif
+{
+	return SWRAP_PROF(ACCEPT,
+			  swrap_accept(s, addr, (socklen_t *)addrlen, 0));
+}
+
+static int autobind_start_init;
+static int autobind_start;
+
+/* using sendto() or connect() on an unbound socket would give the
+   recipient no way to reply, as unlike UDP and TCP, a unix domain
+   socket can't auto-assign ephemeral port numbers, so we need to
+   assign it here.
+   Note: this might change the family from ipv6 to ipv4
+*/
+static int swrap_auto_bind(int fd, struct socket_info *si, int family)
+{
+	struct swrap_address un_addr = {
+		.sa_socklen = sizeof(struct sockaddr_un),
+	};
+	int i;
+	char type;
+	int ret;
+	int port;
+	unsigned int addr[4];
+	size_t naddr;
+	uint64_t probes = 0;
+
+	if (autobind_start_init != 1) {
+		autobind_start_init = 1;
+		autobind_start = getpid();
+		autobind_start %= 50000;
+		autobind_start += 10000;
+	}
+
+	un_addr.sa.un.sun_family = AF_UNIX;
+
+	switch (family) {
+	case AF_INET: {
+		struct sockaddr_in in;
+
+		switch (si->type) {
+		case SOCK_STREAM:
+			type = SOCKET_TYPE_CHAR_TCP_LONG;
+			break;
+		case SOCK_DGRAM:
+			type = SOCKET_TYPE_CHAR_UDP_LONG;
+			break;
+		default:
+		    errno = ESOCKTNOSUPPORT;
+		    return -1;
+		}
+
+		memset(&in, 0, sizeof(in));
+		in.sin_family = AF_INET;
+		addr[0] = socket_wrapper_default_addr();
+		naddr = 1;
+		in.sin_addr.s_addr = htonl(addr[0]);
+
+		si->myname = (struct swrap_address) {
+			.sa_socklen = sizeof(in),
+		};
+		memcpy(&si->myname.sa.in, &in, si->myname.sa_socklen);
+		break;
+	}
+#ifdef HAVE_IPV6
+	case AF_INET6: {
+		struct sockaddr_in6 in6;
+
+		if (si->family != family) {
+			errno = ENETUNREACH;
+			return -1;
+		}
+
+		switch (si->type) {
+		case SOCK_STREAM:
+			type = SOCKET_TYPE_CHAR_TCP_V6_LONG;
+			break;
+		case SOCK_DGRAM:
+			type = SOCKET_TYPE_CHAR_UDP_V6_LONG;
+			break;
+		default:
+			errno = ESOCKTNOSUPPORT;
+			return -1;
+		}
+
+		memset(&in6, 0, sizeof(in6));
+		in6.sin6_family = AF_INET6;
+		swrap_iface_ipv6(socket_wrapper_default_iface(), &in6.sin6_addr);
+
+		si->myname = (struct swrap_address) {
+			.sa_socklen = sizeof(in6),
+		};
+		memcpy(&si->myname.sa.in6, &in6, si->myname.sa_socklen);
+		swrap_make_ipv6_ints(in6.sin6_addr.s6_addr,
+				     &addr[0], &addr[1], &addr[2], &addr[3]);
+		naddr = 4;
+		break;
+	}
+#endif
+	default:
+		errno = ESOCKTNOSUPPORT;
+		return -1;
+	}
+
+	if (autobind_start > 60000) {
+		autobind_start = 10000;
+	}
+
+	for (i = 0; i < SOCKET_MAX_SOCKETS; i++) {
+		bool in_use;
+
+		if (i == SWRAP_RECLAIM_THRESHOLD && swrap_reclaim_stale() > 0) {
+			/* Start over, the ports might be free now */
+			i = 0;
+		}
+
+		port = autobind_start + i;
+		probes++;
+
+		/* Accepted sockets keep the port after the listener is gone */
+		set_port(family, port, &si->myname);
+		in_use = check_addr_port_in_use(si,
+						&si->myname.sa.s,
+						si->myname.sa_socklen);
+		if (in_use) {
+			continue;
+		}
+
+		ret = swrap_un_path(&swrap_autobind_template,
+				    &un_addr.sa.un,
+				    type,
+				    addr,
+				    naddr,
+				    port);
+		if (ret == -1) {
+			return ret;
+		}
+
+		/* The kernel tells us if the port is taken, no need to stat() */
+		ret = swrap_un_bind(fd, &un_addr);
+		if (ret == -1) {
+			if (errno == EADDRINUSE) {
+				continue;
+			}
+			return ret;
+		}
+
+		si->un_addr = un_addr.sa.un;
+		swrap_ring_mark(si, un_addr.sa.un.sun_path);
+		swrap_bcast_link(un_addr.sa.un.sun_path);
+		swrap_rcvq_bind(si, un_addr.sa.un.sun_path);
+
+		si->bound = 1;
+		autobind_start = port + 1;
+		SWRAP_LOG(SWRAP_LOG_TRACE, "bound to: %s", un_addr.sa.un.sun_path);
+		break;
+	}
+	swrap_stats_count(fd, si, SWRAP_STATS_AUTOBIND_PROBES, probes);
+	if (i == SOCKET_MAX_SOCKETS) {
+		SWRAP_LOG(SWRAP_LOG_ERROR, "Too many open unix sockets (%u) for "
+					   "interface "SOCKET_FORMAT,
+					   SOCKET_MAX_SOCKETS,
+					   type,
+					   socket_wrapper_default_addr(),
+					   0);
+		errno = ENFILE;
+		return -1;
+	}
 
-		si->io.pck_snd += len;
+	si->family = family;
+	set_port(si->family, port, &si->myname);
+	swrap_bind_add(si, &si->myname);
+	if (si->type == SOCK_DGRAM) {
+		swrap_oneway_release(si, NULL, 0, false);
+	}
+
+	return 0;
+}
+
+/****************************************************************************
+ *   CONNECT
+ ***************************************************************************/
+
+static int swrap_connect(int s, const struct sockaddr *serv_addr,
+			 socklen_t addrlen)
+{
+	int ret;
+	struct swrap_address un_addr = {
+		.sa_socklen = sizeof(struct sockaddr_un),
+	};
+	struct socket_info *si = find_socket_info(s);
+	int bcast = 0;
+
+	if (!si) {
+		return libc_connect(s, serv_addr, addrlen);
+	}
+
+	swrap_stats_call(s, si, SWRAP_STATS_CONNECT, 0, 0);
+
+	if (si->bound == 0) {
+		ret = swrap_auto_bind(s, si, serv_addr->sa_family);
+		if (ret == -1) {
+			return -1;
+		}
+	}
+
+	if (si->family != serv_addr->sa_family) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ret = sockaddr_convert_to_un(si, serv_addr,
+				     addrlen, &un_addr.sa.un, 0, &bcast);
+	if (ret == -1) {
+		return -1;
+	}
+
+	if (bcast) {
+		errno = ENETUNREACH;
+		return -1;
+	}
+
+	if (swrap_link_denied(si, serv_addr)) {
+		errno = ENETUNREACH;
+		return -1;
+	}
+
+	if (si->type == SOCK_DGRAM) {
+		si->defer_connect = 1;
+		si->rcvq_peer = NULL;
+		ret = 0;
+	} else {
+		swrap_pcap_dump_packet(si, serv_addr, SWRAP_CONNECT_SEND, NULL, 0);
+
+		/* The SYN gets lost in the partition */
+		if (swrap_partition_blocked(swrap_link_local_addr(si),
+					    serv_addr)) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		/* Left behind by a process which is gone */
+		swrap_oneway_release(si, serv_addr, addrlen, true);
+		swrap_oneway_release(si, serv_addr, addrlen, false);
+
+		ret = libc_connect(s,
+				   &un_addr.sa.s,
+				   un_addr.sa_socklen);
+	}
+
+	SWRAP_LOG(SWRAP_LOG_TRACE,
+		  "connect() path=%s, fd=%d",
+		  un_addr.sa.un.sun_path, s);
+
+
+	/* to give better errors */
+	if (ret == -1 && errno == ENOENT) {
+		errno = EHOSTUNREACH;
+	}
+
+	if (ret == 0) {
+		si->peername = (struct swrap_address) {
+			.sa_socklen = addrlen,
+		};
+
+		memcpy(&si->peername.sa.ss, serv_addr, addrlen);
+		si->connected = 1;
+
+		/*
+		 * When we connect() on a socket than we have to bind the
+		 * outgoing connection on the interface we use for the
+		 * transport. We already bound it on the right interface
+		 * but here we have to update the name so getsockname()
+		 * returns correct information.
+		 */
+		if (si->bindname.sa_socklen > 0) {
+			si->myname = (struct swrap_address) {
+				.sa_socklen = si->bindname.sa_socklen,
+			};
+
+			memcpy(&si->myname.sa.ss,
+			       &si->bindname.sa.ss,
+			       si->bindname.sa_socklen);
+
+			/* Cleanup bindname */
+			si->bindname = (struct swrap_address) {
+				.sa_socklen = 0,
+			};
+		}
+
+		swrap_pcap_dump_packet(si, serv_addr, SWRAP_CONNECT_RECV, NULL, 0);
+		swrap_pcap_dump_packet(si, serv_addr, SWRAP_CONNECT_ACK, NULL, 0);
+
+		swrap_ring_connect(s, si, un_addr.sa.un.sun_path);
+	} else {
+		swrap_pcap_dump_packet(si, serv_addr, SWRAP_CONNECT_UNREACH, NULL, 0);
+	}
+
+	return ret;
+}
+
+int connect(int s, const struct sockaddr *serv_addr, socklen_t addrlen)
+{
+	return SWRAP_PROF(CONNECT, swrap_connect(s, serv_addr, addrlen));
+}
+
+/****************************************************************************
+ *   BIND
+ ***************************************************************************/
+
+static int swrap_bind(int s, const struct sockaddr *myaddr, socklen_t addrlen)
+{
+	int ret;
+	struct swrap_address un_addr = {
+		.sa_socklen = sizeof(struct sockaddr_un),
+	};
+	struct socket_info *si = find_socket_info(s);
+	int bind_error = 0;
+	bool in_use;
+
+	if (!si) {
+		return libc_bind(s, myaddr, addrlen);
+	}
+
+	swrap_stats_call(s, si, SWRAP_STATS_BIND, 0, 0);
+
+	switch (si->family) {
+	case AF_INET: {
+		const struct sockaddr_in *sin;
+		if (addrlen < sizeof(struct sockaddr_in)) {
+			bind_error = EINVAL;
+			break;
+		}
+
+		sin = (const struct sockaddr_in *)(const void *)myaddr;
+
+		if (sin->sin_family != AF_INET) {
+			bind_error = EAFNOSUPPORT;
+		}
+
+		/* special case for AF_UNSPEC */
+		if (sin->sin_family == AF_UNSPEC &&
+		    (sin->sin_addr.s_addr == htonl(INADDR_ANY)))
+		{
+			bind_error = 0;
+		}
 
 		break;
+	}
+#ifdef HAVE_IPV6
+	case AF_INET6: {
+		const struct sockaddr_in6 *sin6;
+		if (addrlen < sizeof(struct sockaddr_in6)) {
+			bind_error = EINVAL;
+			break;
+		}
 
-	case SWRAP_SEND_RST:
-		dest_addr = &si->myname.sa.s;
-		src_addr  = &si->peername.sa.s;
+		sin6 = (const struct sockaddr_in6 *)(const void *)myaddr;
+
+		if (sin6->sin6_family != AF_INET6) {
+			bind_error = EAFNOSUPPORT;
+		}
+
+		break;
+	}
+#endif
+	default:
+		bind_error = EINVAL;
+		break;
+	}
+
+	if (bind_error != 0) {
+		errno = bind_error;
+		return -1;
+	}
+
+	in_use = check_addr_port_in_use(si, myaddr, addrlen);
+	if (in_use) {
+		errno = EADDRINUSE;
+		return -1;
+	}
+
+	si->myname.sa_socklen = addrlen;
+	memcpy(&si->myname.sa.ss, myaddr, addrlen);
+
+	ret = sockaddr_convert_to_un(si,
+				     myaddr,
+				     addrlen,
+				     &un_addr.sa.un,
+				     1,
+				     &si->bcast);
+	if (ret == -1) {
+		return -1;
+	}
+
+	unlink(un_addr.sa.un.sun_path);
+
+	ret = swrap_un_bind(s, &un_addr);
+
+	SWRAP_LOG(SWRAP_LOG_TRACE,
+		  "bind() path=%s, fd=%d",
+		  un_addr.sa.un.sun_path, s);
 
+	if (ret == 0) {
+		si->bound = 1;
+		swrap_bind_add(si, &si->myname);
+		swrap_ring_mark(si, un_addr.sa.un.sun_path);
+		swrap_bcast_link(un_addr.sa.un.sun_path);
+		swrap_rcvq_bind(si, un_addr.sa.un.sun_path);
 		if (si->type == SOCK_DGRAM) {
-			return swrap_pcap_marshall_packet(si,
-							  &si->peername.sa.s,
-							  SWRAP_SENDTO_UNREACH,
-							  buf,
-							  len,
-							  packet_len);
+			swrap_oneway_release(si, NULL, 0, false);
 		}
+	}
+
+	return ret;
+}
+
+int bind(int s, const struct sockaddr *myaddr, socklen_t addrlen)
+{
+	return SWRAP_PROF(BIND, swrap_bind(s, myaddr, addrlen));
+}
+
+/****************************************************************************
+ *   BINDRESVPORT
+ ***************************************************************************/
+
+#ifdef HAVE_BINDRESVPORT
+static int swrap_getsockname(int s, struct sockaddr *name, socklen_t *addrlen);
+
+static int swrap_bindresvport_sa(int sd, struct sockaddr *sa)
+{
+	struct swrap_address myaddr = {
+		.sa_socklen = sizeof(struct sockaddr_storage),
+	};
+	socklen_t salen;
+	static uint16_t port;
+	uint16_t i;
+	int rc = -1;
+	int af;
 
-		tcp_seqno = si->io.pck_rcv;
-		tcp_ack = si->io.pck_snd;
-		tcp_ctl = 0x14; /** RST,ACK */
+#define SWRAP_STARTPORT 600
+#define SWRAP_ENDPORT (IPPORT_RESERVED - 1)
+#define SWRAP_NPORTS (SWRAP_ENDPORT - SWRAP_STARTPORT + 1)
 
-		break;
+	if (port == 0) {
+		port = (getpid() % SWRAP_NPORTS) + SWRAP_STARTPORT;
+	}
 
-	case SWRAP_PENDING_RST:
-		dest_addr = &si->myname.sa.s;
-		src_addr  = &si->peername.sa.s;
+	if (sa == NULL) {
+		salen = myaddr.sa_socklen;
+		sa = &myaddr.sa.s;
 
-		if (si->type == SOCK_DGRAM) {
-			return NULL;
+		rc = swrap_getsockname(sd, &myaddr.sa.s, &salen);
+		if (rc < 0) {
+			return -1;
 		}
 
-		tcp_seqno = si->io.pck_rcv;
-		tcp_ack = si->io.pck_snd;
-		tcp_ctl = 0x14; /* RST,ACK */
-
-		break;
-
-	case SWRAP_RECV:
-		dest_addr = &si->myname.sa.s;
-		src_addr  = &si->peername.sa.s;
+		af = sa->sa_family;
+		memset(&myaddr.sa.ss, 0, salen);
+	} else {
+		af = sa->sa_family;
+	}
 
-		tcp_seqno = si->io.pck_rcv;
-		tcp_ack = si->io.pck_snd;
-		tcp_ctl = 0x18; /* PSH,ACK */
+	for (i = 0; i < SWRAP_NPORTS; i++, port++) {
+		switch(af) {
+		case AF_INET: {
+			struct sockaddr_in *sinp = (struct sockaddr_in *)(void *)sa;
 
-		si->io.pck_rcv += len;
+			salen = sizeof(struct sockaddr_in);
+			sinp->sin_port = htons(port);
+			break;
+		}
+		case AF_INET6: {
+			struct sockaddr_in6 *sin6p = (struct sockaddr_in6 *)(void *)sa;
 
-		break;
+			salen = sizeof(struct sockaddr_in6);
+			sin6p->sin6_port = htons(port);
+			break;
+		}
+		default:
+			errno = EAFNOSUPPORT;
+			return -1;
+		}
+		sa->sa_family = af;
 
-	case SWRAP_RECV_RST:
-		dest_addr = &si->myname.sa.s;
-		src_addr  = &si->peername.sa.s;
+		if (port > SWRAP_ENDPORT) {
+			port = SWRAP_STARTPORT;
+		}
 
-		if (si->type == SOCK_DGRAM) {
-			return NULL;
+		rc = swrap_bind(sd, (struct sockaddr *)sa, salen);
+		if (rc == 0 || errno != EADDRINUSE) {
+			break;
 		}
+	}
 
-		tcp_seqno = si->io.pck_rcv;
-		tcp_ack = si->io.pck_snd;
-		tcp_ctl = 0x14; /* RST,ACK */
+	return rc;
+}
 
-		break;
+int bindresvport(int sockfd, struct sockaddr_in *sinp)
+{
+	return swrap_bindresvport_sa(sockfd, (struct sockaddr *)sinp);
+}
+#endif
 
-	case SWRAP_SENDTO:
-		src_addr = &si->myname.sa.s;
-		dest_addr = addr;
+/****************************************************************************
+ *   LISTEN
+ ***************************************************************************/
 
-		si->io.pck_snd += len;
+static int swrap_listen(int s, int backlog)
+{
+	int ret;
+	struct socket_info *si = find_socket_info(s);
 
-		break;
+	if (!si) {
+		return libc_listen(s, backlog);
+	}
 
-	case SWRAP_SENDTO_UNREACH:
-		dest_addr = &si->myname.sa.s;
-		src_addr = addr;
+	swrap_stats_call(s, si, SWRAP_STATS_LISTEN, 0, 0);
 
-		unreachable = 1;
+	if (si->bound == 0) {
+		ret = swrap_auto_bind(s, si, si->family);
+		if (ret == -1) {
+			errno = EADDRINUSE;
+			return ret;
+		}
+	}
 
-		break;
+	ret = libc_listen(s, backlog);
+	if (ret == 0) {
+		si->listening = 1;
+	}
 
-	case SWRAP_RECVFROM:
-		dest_addr = &si->myname.sa.s;
-		src_addr = addr;
+	return ret;
+}
 
-		si->io.pck_rcv += len;
+int listen(int s, int backlog)
+{
+	return SWRAP_PROF(LISTEN, swrap_listen(s, backlog));
+}
 
-		break;
+/****************************************************************************
+ *   FOPEN
+ ***************************************************************************/
 
-	case SWRAP_CLOSE_SEND:
-		if (si->type != SOCK_STREAM) {
-			return NULL;
-		}
+static FILE *swrap_fopen(const char *name, const char *mode)
+{
+	FILE *fp;
 
-		src_addr  = &si->myname.sa.s;
-		dest_addr = &si->peername.sa.s;
+	fp = libc_fopen(name, mode);
+	if (fp != NULL) {
+		int fd = fileno(fp);
 
-		tcp_seqno = si->io.pck_snd;
-		tcp_ack = si->io.pck_rcv;
-		tcp_ctl = 0x11; /* FIN, ACK */
+		swrap_remove_stale(fd);
+	}
 
-		si->io.pck_snd += 1;
+	return fp;
+}
 
-		break;
+FILE *fopen(const char *name, const char *mode)
+{
+	return swrap_fopen(name, mode);
+}
 
-	case SWRAP_CLOSE_RECV:
-		if (si->type != SOCK_STREAM) {
-			return NULL;
-		}
+/****************************************************************************
+ *   OPEN
+ ***************************************************************************/
 
-		dest_addr = &si->myname.sa.s;
-		src_addr  = &si->peername.sa.s;
+static int swrap_vopen(const char *pathname, int flags, va_list ap)
+{
+	int ret;
 
-		tcp_seqno = si->io.pck_rcv;
-		tcp_ack = si->io.pck_snd;
-		tcp_ctl = 0x11; /* FIN,ACK */
+	ret = libc_vopen(pathname, flags, ap);
+	if (ret != -1) {
+		/*
+		 * There are methods for closing descriptors (libc-internal code
+		 * paths, direct syscalls) which close descriptors in ways that
+		 * we can't intercept, so try to recover when we notice that
+		 * that's happened
+		 */
+		swrap_remove_stale(ret);
+	}
+	return ret;
+}
 
-		si->io.pck_rcv += 1;
+int open(const char *pathname, int flags, ...)
+{
+	va_list ap;
+	int fd;
 
-		break;
+	va_start(ap, flags);
+	fd = swrap_vopen(pathname, flags, ap);
+	va_end(ap);
 
-	case SWRAP_CLOSE_ACK:
-		if (si->type != SOCK_STREAM) {
-			return NULL;
-		}
+	return fd;
+}
 
-		src_addr  = &si->myname.sa.s;
-		dest_addr = &si->peername.sa.s;
+/****************************************************************************
+ *   OPENAT
+ ***************************************************************************/
 
-		tcp_seqno = si->io.pck_snd;
-		tcp_ack = si->io.pck_rcv;
-		tcp_ctl = 0x10; /* ACK */
+static int swrap_vopenat(int dirfd, const char *path, int flags, va_list ap)
+{
+	int ret;
 
-		break;
-	default:
-		return NULL;
+	ret = libc_vopenat(dirfd, path, flags, ap);
+	if (ret != -1) {
+		/*
+		 * There are methods for closing descriptors (libc-internal code
+		 * paths, direct syscalls) which close descriptors in ways that
+		 * we can't intercept, so try to recover when we notice that
+		 * that's happened
+		 */
+		swrap_remove_stale(ret);
 	}
 
-	swrapGetTimeOfDay(&tv);
-
-	return swrap_pcap_packet_init(&tv,
-				      src_addr,
-				      dest_addr,
-				      si->type,
-				      (const uint8_t *)buf,
-				      len,
-				      tcp_seqno,
-				      tcp_ack,
-				      tcp_ctl,
-				      unreachable,
-				      packet_len);
+	return ret;
 }
 
-static void swrap_pcap_dump_packet(struct socket_info *si,
-				   const struct sockaddr *addr,
-				   enum swrap_packet_type type,
-				   const void *buf, size_t len)
+int openat(int dirfd, const char *path, int flags, ...)
 {
-	const char *file_name;
-	uint8_t *packet;
-	size_t packet_len = 0;
+	va_list ap;
 	int fd;
 
-	file_name = swrap_pcap_init_file();
-	if (!file_name) {
-		return;
+	va_start(ap, flags);
+	fd = swrap_vopenat(dirfd, path, flags, ap);
+	va_end(ap);
+
+	return fd;
+}
+
+/****************************************************************************
+ *   GETPEERNAME
+ ***************************************************************************/
+
+static int swrap_getpeername(int s, struct sockaddr *name, socklen_t *addrlen)
+{
+	struct socket_info *si = find_socket_info(s);
+	socklen_t len;
+
+	if (!si) {
+		return libc_getpeername(s, name, addrlen);
 	}
 
-	packet = swrap_pcap_marshall_packet(si,
-					    addr,
-					    type,
-					    buf,
-					    len,
-					    &packet_len);
-	if (packet == NULL) {
-		return;
+	if (si->peername.sa_socklen == 0)
+	{
+		errno = ENOTCONN;
+		return -1;
 	}
 
-	fd = swrap_pcap_get_fd(file_name);
-	if (fd != -1) {
-		if (write(fd, packet, packet_len) != (ssize_t)packet_len) {
-			free(packet);
-			return;
-		}
+	len = MIN(*addrlen, si->peername.sa_socklen);
+	if (len == 0) {
+		return 0;
 	}
 
-	free(packet);
+	memcpy(name, &si->peername.sa.ss, len);
+	*addrlen = si->peername.sa_socklen;
+
+	return 0;
+}
+
+#ifdef HAVE_ACCEPT_PSOCKLEN_T
+int getpeername(int s, struct sockaddr *name, Psocklen_t addrlen)
+#else
+int getpeername(int s, struct sockaddr *name, socklen_t *addrlen)
+#endif
+{
+	return swrap_getpeername(s, name, (socklen_t *)addrlen);
 }
 
 /****************************************************************************
- *   SIGNALFD
+ *   GETSOCKNAME
  ***************************************************************************/
 
-#ifdef HAVE_SIGNALFD
-static int swrap_signalfd(int fd, const sigset_t *mask, int flags)
+static int swrap_getsockname(int s, struct sockaddr *name, socklen_t *addrlen)
 {
-	int rc;
+	struct socket_info *si = find_socket_info(s);
+	socklen_t len;
 
-	rc = libc_signalfd(fd, mask, flags);
-	if (rc != -1) {
-		swrap_remove_stale(fd);
+	if (!si) {
+		return libc_getsockname(s, name, addrlen);
 	}
 
-	return rc;
+	len = MIN(*addrlen, si->myname.sa_socklen);
+	if (len == 0) {
+		return 0;
+	}
+
+	memcpy(name, &si->myname.sa.ss, len);
+	*addrlen = si->myname.sa_socklen;
+
+	return 0;
 }
 
-int signalfd(int fd, const sigset_t *mask, int flags)
+#ifdef HAVE_ACCEPT_PSOCKLEN_T
+int getsockname(int s, struct sockaddr *name, Psocklen_t addrlen)
+#else
+int getsockname(int s, struct sockaddr *name, socklen_t *addrlen)
+#endif
 {
-	return swrap_signalfd(fd, mask, flags);
+	return swrap_getsockname(s, name, (socklen_t *)addrlen);
 }
-#endif
 
 /****************************************************************************
- *   SOCKET
+ *   QUEUE DEPTHS
  ***************************************************************************/
 
-static int swrap_socket(int family, int type, int protocol)
-{
-	struct socket_info *si;
-	struct socket_info_fd *fi;
+/*
+ * A unix stream has no send queue, the data the peer didn't read yet waits
+ * in its receive queue. We take that as the data TCP holds back because
+ * the receive window of the peer is closed, so it's the part of SIOCOUTQ
+ * which is not sent yet. The bytes in the delay queue are in flight on
+ * the emulated link.
+ *
+ * The unix socket reports the truesize of its buffers for SIOCOUTQ, the
+ * bytes the peer didn't read are in the shm ring or get asked from the
+ * kernel with unix_diag.
+ */
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+struct swrap_unix_diag_info {
+	uint32_t cookie[2];
+	uint32_t peer_ino;
+	uint32_t rqueue;
+};
+
+/*
+ * The netlink socket is kept open, it's needed for every SIOCOUTQ and
+ * TCP_INFO. The application may close or reuse the file descriptor, so
+ * its inode tells us if it is still ours.
+ */
+static struct {
 	int fd;
-	int idx;
-	int real_type = type;
+	ino_t ino;
+	uint32_t seq;
+} swrap_unix_diag_sock = {
+	.fd = -1,
+};
 
-	/*
-	 * Remove possible addition flags passed to socket() so
-	 * do not fail checking the type.
-	 * See https://lwn.net/Articles/281965/
-	 */
-#ifdef SOCK_CLOEXEC
-	real_type &= ~SOCK_CLOEXEC;
-#endif
-#ifdef SOCK_NONBLOCK
-	real_type &= ~SOCK_NONBLOCK;
-#endif
+static void swrap_unix_diag_close(void)
+{
+	struct stat st;
 
-	if (!socket_wrapper_enabled()) {
-		return libc_socket(family, type, protocol);
+	if (swrap_unix_diag_sock.fd != -1 &&
+	    fstat(swrap_unix_diag_sock.fd, &st) == 0 &&
+	    st.st_ino == swrap_unix_diag_sock.ino) {
+		libc_close(swrap_unix_diag_sock.fd);
 	}
+	swrap_unix_diag_sock.fd = -1;
+}
 
-	switch (family) {
-	case AF_INET:
-#ifdef HAVE_IPV6
-	case AF_INET6:
-#endif
-		break;
-#ifdef AF_NETLINK
-	case AF_NETLINK:
-#endif /* AF_NETLINK */
-#ifdef AF_PACKET
-	case AF_PACKET:
-#endif /* AF_PACKET */
-	case AF_UNIX:
-		return libc_socket(family, type, protocol);
-	default:
-		errno = EAFNOSUPPORT;
-		return -1;
+static int swrap_unix_diag_fd(void)
+{
+	struct stat st;
+	int fd = swrap_unix_diag_sock.fd;
+
+	if (fd != -1 &&
+	    fstat(fd, &st) == 0 &&
+	    S_ISSOCK(st.st_mode) &&
+	    st.st_ino == swrap_unix_diag_sock.ino) {
+		return fd;
 	}
 
-	switch (real_type) {
-	case SOCK_STREAM:
-		break;
-	case SOCK_DGRAM:
-		break;
-	default:
-		errno = EPROTONOSUPPORT;
+	fd = libc_socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (fd == -1) {
+		swrap_unix_diag_sock.fd = -1;
 		return -1;
 	}
-
-	switch (protocol) {
-	case 0:
-		break;
-	case 6:
-		if (real_type == SOCK_STREAM) {
-			break;
-		}
-		/*fall through*/
-	case 17:
-		if (real_type == SOCK_DGRAM) {
-			break;
-		}
-		/*fall through*/
-	default:
-		errno = EPROTONOSUPPORT;
+	if (fstat(fd, &st) == -1) {
+		libc_close(fd);
+		swrap_unix_diag_sock.fd = -1;
 		return -1;
 	}
 
-	/*
-	 * We must call libc_socket with type, from the caller, not the version
-	 * we removed SOCK_CLOEXEC and SOCK_NONBLOCK from
-	 */
-	fd = libc_socket(AF_UNIX, type, 0);
+	swrap_unix_diag_sock.fd = fd;
+	swrap_unix_diag_sock.ino = st.st_ino;
 
-	if (fd == -1) {
-		return -1;
+	return fd;
+}
+
+/*
+ * One request about the unix socket with the given inode. With a cookie
+ * the kernel refuses the request if the inode belongs to another socket.
+ */
+static bool swrap_unix_diag(uint32_t ino,
+			    const uint32_t *cookie,
+			    uint32_t show,
+			    struct swrap_unix_diag_info *info)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct unix_diag_req req;
+	} msg = {
+		.nlh = {
+			.nlmsg_len = sizeof(msg),
+			.nlmsg_type = SOCK_DIAG_BY_FAMILY,
+			.nlmsg_flags = NLM_F_REQUEST,
+		},
+		.req = {
+			.sdiag_family = AF_UNIX,
+			.udiag_states = -1,
+			.udiag_ino = ino,
+			.udiag_show = show,
+			/* No cookie to check */
+			.udiag_cookie = { -1U, -1U },
+		},
+	};
+	union {
+		struct nlmsghdr nlh;
+		char data[1024];
+	} buf;
+	struct unix_diag_msg *m;
+	struct rtattr *rta;
+	bool found = false;
+	ssize_t ret = -1;
+	int len;
+	int fd;
+
+	if (cookie != NULL) {
+		msg.req.udiag_cookie[0] = cookie[0];
+		msg.req.udiag_cookie[1] = cookie[1];
 	}
 
-	/* Check if we have a stale fd and remove it */
-	swrap_remove_stale(fd);
+	SWRAP_LOCK(unix_diag);
+	fd = swrap_unix_diag_fd();
+	if (fd != -1) {
+		msg.nlh.nlmsg_seq = ++swrap_unix_diag_sock.seq;
+		ret = libc_send(fd, &msg, sizeof(msg), 0);
+	}
+	if (ret == sizeof(msg)) {
+		/* Skip the answers of requests which failed half way */
+		do {
+			ret = libc_recv(fd, &buf, sizeof(buf), 0);
+		} while (ret > 0 &&
+			 NLMSG_OK(&buf.nlh, (size_t)ret) &&
+			 buf.nlh.nlmsg_seq != msg.nlh.nlmsg_seq);
+	} else {
+		ret = -1;
+	}
+	if (ret <= 0) {
+		swrap_unix_diag_close();
+	}
+	SWRAP_UNLOCK(unix_diag);
 
-	idx = socket_wrapper_first_free_index();
-	if (idx == -1) {
-		errno = ENOMEM;
-		return -1;
+	if (ret <= 0 ||
+	    !NLMSG_OK(&buf.nlh, (size_t)ret) ||
+	    buf.nlh.nlmsg_type != SOCK_DIAG_BY_FAMILY) {
+		/* ENOENT or ESTALE if the socket is gone */
+		return false;
 	}
 
-	si = &sockets[idx];
+	m = (struct unix_diag_msg *)NLMSG_DATA(&buf.nlh);
+	info->cookie[0] = m->udiag_cookie[0];
+	info->cookie[1] = m->udiag_cookie[1];
+	rta = (struct rtattr *)(m + 1);
+	len = buf.nlh.nlmsg_len - NLMSG_LENGTH(sizeof(*m));
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case UNIX_DIAG_PEER:
+			memcpy(&info->peer_ino,
+			       RTA_DATA(rta),
+			       sizeof(info->peer_ino));
+			found = true;
+			break;
+		case UNIX_DIAG_RQLEN: {
+			struct unix_diag_rqlen rq;
 
-	si->family = family;
+			memcpy(&rq, RTA_DATA(rta), sizeof(rq));
+			info->rqueue = rq.udiag_rqueue;
+			found = true;
+			break;
+		}
+		default:
+			break;
+		}
+	}
 
-	/* however, the rest of the socket_wrapper code expects just
-	 * the type, not the flags */
-	si->type = real_type;
-	si->protocol = protocol;
+	return found;
+}
+#endif /* HAVE_LINUX_UNIX_DIAG_H */
 
-	/*
-	 * Setup myname so getsockname() can succeed to find out the socket
-	 * type.
-	 */
-	switch(si->family) {
-	case AF_INET: {
-		struct sockaddr_in sin = {
-			.sin_family = AF_INET,
-		};
+/* The bytes of a stream the peer didn't read yet, 0 if we can't tell */
+static size_t swrap_stream_unread(int fd, struct socket_info *si)
+{
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+	struct swrap_unix_diag_info info = {
+		.peer_ino = 0,
+	};
+	struct stat st;
+	int rc;
+#endif
 
-		si->myname.sa_socklen = sizeof(struct sockaddr_in);
-		memcpy(&si->myname.sa.in, &sin, si->myname.sa_socklen);
-		break;
+	if (si->type != SOCK_STREAM || si->peername.sa_socklen == 0) {
+		return 0;
 	}
-	case AF_INET6: {
-		struct sockaddr_in6 sin6 = {
-			.sin6_family = AF_INET6,
-		};
 
-		si->myname.sa_socklen = sizeof(struct sockaddr_in6);
-		memcpy(&si->myname.sa.in6, &sin6, si->myname.sa_socklen);
-		break;
+	if (si->ring != NULL) {
+		return __atomic_load_n(&si->ring->tx->count, __ATOMIC_ACQUIRE);
 	}
-	default:
-		errno = EINVAL;
-		return -1;
+
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+	/* The peer doesn't change, only look it up once */
+	if (si->unix_peer_ino == 0) {
+		rc = fstat(fd, &st);
+		if (rc == -1 ||
+		    !swrap_unix_diag(st.st_ino, NULL, UDIAG_SHOW_PEER, &info) ||
+		    info.peer_ino == 0) {
+			return 0;
+		}
+
+		/* The queue of the peer and its cookie */
+		if (!swrap_unix_diag(info.peer_ino,
+				     NULL,
+				     UDIAG_SHOW_RQLEN,
+				     &info)) {
+			return 0;
+		}
+		si->unix_peer_ino = info.peer_ino;
+		si->unix_peer_cookie[0] = info.cookie[0];
+		si->unix_peer_cookie[1] = info.cookie[1];
+
+		return info.rqueue;
 	}
 
-	fi = (struct socket_info_fd *)calloc(1, sizeof(struct socket_info_fd));
-	if (fi == NULL) {
-		errno = ENOMEM;
-		return -1;
+	if (!swrap_unix_diag(si->unix_peer_ino,
+			     si->unix_peer_cookie,
+			     UDIAG_SHOW_RQLEN,
+			     &info)) {
+		/* The peer is gone and its data with it */
+		si->unix_peer_ino = 0;
+		return 0;
 	}
 
-	si->refcount = 1;
-	first_free = si->next_free;
-	si->next_free = 0;
+	return info.rqueue;
+#else
+	(void) fd; /* unused */
+
+	return 0;
+#endif
+}
+
+/* The send queue of the emulated socket, the part not sent yet as well */
+static void swrap_outq(int fd,
+		       struct socket_info *si,
+		       size_t *in_flight,
+		       size_t *notsent)
+{
+	*in_flight = swrap_delay_queued(si);
+	*notsent = swrap_stream_unread(fd, si);
+}
+
+/****************************************************************************
+ *   TCP_INFO
+ ***************************************************************************/
+
+/*
+ * TCP_INFO of a wrapped stream, from what the wrapper knows about it. The
+ * queues are the ones of SIOCOUTQ, what the peer read counts as
+ * acknowledged. The RTT is the configured latency of both directions and
+ * a bandwidth rule gives the pacing rate and a congestion window of the
+ * bandwidth-delay product.
+ *
+ * glibc only knows the first part of struct tcp_info, the rest has the
+ * layout of the kernel.
+ */
+#ifdef TCP_INFO
+struct swrap_tcp_info {
+	struct tcp_info info;
+
+	uint64_t tcpi_pacing_rate;
+	uint64_t tcpi_max_pacing_rate;
+	uint64_t tcpi_bytes_acked;
+	uint64_t tcpi_bytes_received;
+	uint32_t tcpi_segs_out;
+	uint32_t tcpi_segs_in;
+
+	uint32_t tcpi_notsent_bytes;
+	uint32_t tcpi_min_rtt;
+	uint32_t tcpi_data_segs_in;
+	uint32_t tcpi_data_segs_out;
+
+	uint64_t tcpi_delivery_rate;
+
+	uint64_t tcpi_busy_time;
+	uint64_t tcpi_rwnd_limited;
+	uint64_t tcpi_sndbuf_limited;
+
+	uint32_t tcpi_delivered;
+	uint32_t tcpi_delivered_ce;
+
+	uint64_t tcpi_bytes_sent;
+	uint64_t tcpi_bytes_retrans;
+	uint32_t tcpi_dsack_dups;
+	uint32_t tcpi_reord_seen;
 
-	fi->fd = fd;
-	fi->si_index = idx;
+	uint32_t tcpi_rcv_ooopack;
 
-	SWRAP_DLIST_ADD(socket_fds, fi);
+	uint32_t tcpi_snd_wnd;
+};
+#endif /* TCP_INFO */
 
-	SWRAP_LOG(SWRAP_LOG_TRACE,
-		  "Created %s socket for protocol %s",
-		  si->family == AF_INET ? "IPv4" : "IPv6",
-		  si->type == SOCK_DGRAM ? "UDP" : "TCP");
+#define SWRAP_TCP_INIT_CWND 10
+#define SWRAP_TCP_RTO_MIN_USEC 200000
+#define SWRAP_TCP_INFINITE_SSTHRESH 0x7fffffff
 
-	return fd;
+/* Counts the segments of a stream, sends are split at the MTU */
+static void swrap_tcp_count(struct socket_info *si, int dir, ssize_t ret)
+{
+	size_t mtu = socket_wrapper_mtu();
+
+	si->tcp.segs[dir] += ((size_t)ret + mtu - 1) / mtu;
+	si->tcp.last_usec[dir] = swrap_monotonic_usec();
 }
 
-int socket(int family, int type, int protocol)
+#ifdef TCP_INFO
+/* The emulated path to the peer, all zero without rules */
+static void swrap_tcp_path(struct socket_info *si,
+			   uint64_t *rtt_usec,
+			   uint64_t *rttvar_usec,
+			   uint64_t *rate)
 {
-	return swrap_socket(family, type, protocol);
-}
+	const struct sockaddr *local = swrap_link_local_addr(si);
+	const struct sockaddr *peer = &si->peername.sa.s;
+	unsigned int flags = swrap_link_flags();
+	const struct swrap_link *l;
 
-/****************************************************************************
- *   SOCKETPAIR
- ***************************************************************************/
+	*rtt_usec = 0;
+	*rttvar_usec = 0;
+	*rate = 0;
 
-static int swrap_socketpair(int family, int type, int protocol, int sv[2])
-{
-	int rc;
+	if (si->peername.sa_socklen == 0) {
+		return;
+	}
 
-	rc = libc_socketpair(family, type, protocol, sv);
-	if (rc != -1) {
-		swrap_remove_stale(sv[0]);
-		swrap_remove_stale(sv[1]);
+	if (flags & SWRAP_LINK_LATENCY) {
+		l = swrap_link_rule(swrap_link_policy(local, peer),
+				    SWRAP_LINK_LATENCY);
+		if (l != NULL) {
+			*rtt_usec += l->latency.delay_usec;
+			*rttvar_usec += l->latency.jitter_usec;
+		}
+		l = swrap_link_rule(swrap_link_policy(peer, local),
+				    SWRAP_LINK_LATENCY);
+		if (l != NULL) {
+			*rtt_usec += l->latency.delay_usec;
+			*rttvar_usec += l->latency.jitter_usec;
+		}
 	}
 
-	return rc;
+	if (flags & SWRAP_LINK_BANDWIDTH) {
+		l = swrap_link_rule(swrap_link_policy(local, peer),
+				    SWRAP_LINK_BANDWIDTH);
+		if (l != NULL) {
+			*rate = l->bandwidth.rate;
+		}
+	}
 }
 
-int socketpair(int family, int type, int protocol, int sv[2])
+static uint32_t swrap_tcp_msec_since(uint64_t usec, uint64_t now)
 {
-	return swrap_socketpair(family, type, protocol, sv);
-}
+	if (usec == 0) {
+		return 0;
+	}
 
-/****************************************************************************
- *   SOCKETPAIR
- ***************************************************************************/
+	return (now - usec) / 1000;
+}
 
-#ifdef HAVE_TIMERFD_CREATE
-static int swrap_timerfd_create(int clockid, int flags)
+static int swrap_tcp_info(int fd,
+			  struct socket_info *si,
+			  void *optval,
+			  socklen_t *optlen)
 {
-	int fd;
+	struct swrap_tcp_info ti;
+	struct tcp_info *i = &ti.info;
+	uint32_t mss = socket_wrapper_mtu();
+	uint64_t rtt, rttvar, rate, cwnd;
+	uint64_t sent = si->fault.bytes[SWRAP_FAULT_SEND];
+	size_t in_flight, notsent;
+	uint64_t now;
+	socklen_t len;
 
-	fd = libc_timerfd_create(clockid, flags);
-	if (fd != -1) {
-		swrap_remove_stale(fd);
+	if (optval == NULL || optlen == NULL) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	return fd;
-}
+	ZERO_STRUCT(ti);
 
-int timerfd_create(int clockid, int flags)
-{
-	return swrap_timerfd_create(clockid, flags);
-}
-#endif
+	if (si->listening) {
+		i->tcpi_state = TCP_LISTEN;
+	} else if (si->connected && !si->fault.reset) {
+		i->tcpi_state = TCP_ESTABLISHED;
+	} else {
+		i->tcpi_state = TCP_CLOSE;
+	}
 
-/****************************************************************************
- *   PIPE
- ***************************************************************************/
+	swrap_tcp_path(si, &rtt, &rttvar, &rate);
+	if (i->tcpi_state == TCP_ESTABLISHED && rtt == 0) {
+		/* The kernel never reports less */
+		rtt = 1;
+	}
 
-static int swrap_pipe(int pipefd[2])
-{
-	int rc;
+	swrap_outq(fd, si, &in_flight, &notsent);
+	in_flight = MIN(in_flight, sent);
+	notsent = MIN(notsent, sent - in_flight);
 
-	rc = libc_pipe(pipefd);
-	if (rc != -1) {
-		swrap_remove_stale(pipefd[0]);
-		swrap_remove_stale(pipefd[1]);
+	cwnd = SWRAP_TCP_INIT_CWND;
+	if (rate > 0 && rtt * rate / 1000000 / mss > cwnd) {
+		cwnd = rtt * rate / 1000000 / mss;
 	}
 
-	return rc;
-}
+	now = swrap_monotonic_usec();
+
+	i->tcpi_options = TCPI_OPT_TIMESTAMPS | TCPI_OPT_SACK | TCPI_OPT_WSCALE;
+	i->tcpi_snd_wscale = 7;
+	i->tcpi_rcv_wscale = 7;
+	i->tcpi_rto = MAX(SWRAP_TCP_RTO_MIN_USEC, rtt + 4 * rttvar);
+	i->tcpi_snd_mss = mss;
+	i->tcpi_rcv_mss = mss;
+	i->tcpi_unacked = (in_flight + mss - 1) / mss;
+	i->tcpi_last_data_sent =
+		swrap_tcp_msec_since(si->tcp.last_usec[SWRAP_FAULT_SEND], now);
+	i->tcpi_last_data_recv =
+		swrap_tcp_msec_since(si->tcp.last_usec[SWRAP_FAULT_RECV], now);
+	i->tcpi_pmtu = mss;
+	i->tcpi_rtt = rtt;
+	i->tcpi_rttvar = rttvar;
+	i->tcpi_snd_ssthresh = SWRAP_TCP_INFINITE_SSTHRESH;
+	i->tcpi_snd_cwnd = MIN(cwnd, UINT32_MAX);
+	i->tcpi_advmss = mss;
+	i->tcpi_reordering = 3;
+
+	ti.tcpi_pacing_rate = rate > 0 ? rate : UINT64_MAX;
+	ti.tcpi_max_pacing_rate = ti.tcpi_pacing_rate;
+	ti.tcpi_bytes_acked = sent - in_flight - notsent;
+	ti.tcpi_bytes_received = si->fault.bytes[SWRAP_FAULT_RECV];
+	ti.tcpi_segs_out = si->tcp.segs[SWRAP_FAULT_SEND];
+	ti.tcpi_segs_in = si->tcp.segs[SWRAP_FAULT_RECV];
+	ti.tcpi_notsent_bytes = MIN(notsent, UINT32_MAX);
+	ti.tcpi_min_rtt = rtt;
+	ti.tcpi_data_segs_out = ti.tcpi_segs_out;
+	ti.tcpi_data_segs_in = ti.tcpi_segs_in;
+	ti.tcpi_delivery_rate = rate;
+	ti.tcpi_delivered = ti.tcpi_segs_out - i->tcpi_unacked;
+	ti.tcpi_bytes_sent = sent;
+
+	/* Like the kernel, a shorter buffer gets the start */
+	len = MIN(*optlen, (socklen_t)sizeof(ti));
+	memcpy(optval, &ti, len);
+	*optlen = len;
 
-int pipe(int pipefd[2])
-{
-	return swrap_pipe(pipefd);
+	return 0;
 }
+#endif /* TCP_INFO */
 
 /****************************************************************************
- *   ACCEPT
+ *   TIMESTAMPS
  ***************************************************************************/
 
-static int swrap_accept(int s,
-			struct sockaddr *addr,
-			socklen_t *addrlen,
-			int flags)
-{
-	struct socket_info *parent_si, *child_si;
-	struct socket_info_fd *child_fi;
-	int fd;
-	int idx;
-	struct swrap_address un_addr = {
-		.sa_socklen = sizeof(struct sockaddr_un),
-	};
-	struct swrap_address un_my_addr = {
-		.sa_socklen = sizeof(struct sockaddr_un),
-	};
-	struct swrap_address in_addr = {
-		.sa_socklen = sizeof(struct sockaddr_storage),
-	};
-	struct swrap_address in_my_addr = {
-		.sa_socklen = sizeof(struct sockaddr_storage),
-	};
-	int ret;
+/*
+ * SO_TIMESTAMP, SO_TIMESTAMPNS and the software stamps of SO_TIMESTAMPING.
+ *
+ * The options are not passed to the unix socket, the cmsgs need to be in
+ * the format of the socket type we emulate. A datagram is stamped by the
+ * kernel when it gets queued on the unix socket of the receiver, which is
+ * after the delivery thread held it back for the emulated latency. The
+ * kernel doesn't stamp unix streams, these are stamped right after the
+ * read.
+ *
+ * Transmit stamps are taken right after the send and queued on the socket.
+ * recvmsg(MSG_ERRQUEUE) returns them without the payload, as if
+ * SOF_TIMESTAMPING_OPT_TSONLY was set.
+ */
+#if defined(SO_TIMESTAMPING) && defined(HAVE_LINUX_NET_TSTAMP_H) && \
+    defined(HAVE_LINUX_ERRQUEUE_H)
+#define HAVE_SWRAP_TIMESTAMPING 1
+#endif
 
-	parent_si = find_socket_info(s);
-	if (!parent_si) {
-#ifdef HAVE_ACCEPT4
-		return libc_accept4(s, addr, addrlen, flags);
-#else
-		UNUSED(flags);
-		return libc_accept(s, addr, addrlen);
+#define SWRAP_TSTAMP_QUEUE_SIZE 64
+
+struct swrap_tstamp {
+	struct timespec ts;
+	uint32_t key;
+};
+
+struct swrap_tstamp_queue {
+	unsigned int head;
+	unsigned int count;
+	struct swrap_tstamp stamps[SWRAP_TSTAMP_QUEUE_SIZE];
+};
+
+/* The stamp of the last recvmsg() of this thread, zero for none */
+static SWRAP_THREAD struct timespec swrap_tstamp_recv_ts;
+
+static bool swrap_tstamp_option(int optname)
+{
+	switch (optname) {
+#ifdef SO_TIMESTAMP
+	case SO_TIMESTAMP:
+		return true;
+#endif
+#ifdef SO_TIMESTAMPNS
+	case SO_TIMESTAMPNS:
+		return true;
 #endif
+#ifdef HAVE_SWRAP_TIMESTAMPING
+	case SO_TIMESTAMPING:
+		return true;
+#endif
+	default:
+		return false;
 	}
+}
 
-	/*
-	 * assume out sockaddr have the same size as the in parent
-	 * socket family
-	 */
-	in_addr.sa_socklen = socket_length(parent_si->family);
-	if (in_addr.sa_socklen <= 0) {
-		errno = EINVAL;
-		return -1;
+static bool swrap_tstamp_rx(struct socket_info *si)
+{
+	if (si->timestamp != 0) {
+		return true;
 	}
-
-#ifdef HAVE_ACCEPT4
-	ret = libc_accept4(s, &un_addr.sa.s, &un_addr.sa_socklen, flags);
-#else
-	UNUSED(flags);
-	ret = libc_accept(s, &un_addr.sa.s, &un_addr.sa_socklen);
-#endif
-	if (ret == -1) {
-		if (errno == ENOTSOCK) {
-			/* Remove stale fds */
-			swrap_remove_stale(s);
-		}
-		return ret;
+#ifdef HAVE_SWRAP_TIMESTAMPING
+	if ((si->timestamping & SOF_TIMESTAMPING_RX_SOFTWARE) &&
+	    (si->timestamping & SOF_TIMESTAMPING_SOFTWARE)) {
+		return true;
 	}
+#endif
 
-	fd = ret;
+	return false;
+}
 
-	ret = sockaddr_convert_from_un(parent_si,
-				       &un_addr.sa.un,
-				       un_addr.sa_socklen,
-				       parent_si->family,
-				       &in_addr.sa.s,
-				       &in_addr.sa_socklen);
-	if (ret == -1) {
-		close(fd);
-		return ret;
-	}
+static int swrap_tstamp_setsockopt(int fd,
+				   struct socket_info *si,
+				   int optname,
+				   const void *optval,
+				   socklen_t optlen)
+{
+	int value;
 
-	idx = socket_wrapper_first_free_index();
-	if (idx == -1) {
-		errno = ENOMEM;
+	if (optval == NULL || optlen < (socklen_t)sizeof(int)) {
+		errno = EINVAL;
 		return -1;
 	}
+	value = *(const int *)optval;
 
-	child_si = &sockets[idx];
-
-	child_fi = (struct socket_info_fd *)calloc(1, sizeof(struct socket_info_fd));
-	if (child_fi == NULL) {
-		close(fd);
-		errno = ENOMEM;
-		return -1;
+	switch (optname) {
+#ifdef HAVE_SWRAP_TIMESTAMPING
+	case SO_TIMESTAMPING:
+		if (value & ~SOF_TIMESTAMPING_MASK) {
+			errno = EINVAL;
+			return -1;
+		}
+		/* The keys count from the time the option gets set */
+		if ((value & SOF_TIMESTAMPING_OPT_ID) &&
+		    !(si->timestamping & SOF_TIMESTAMPING_OPT_ID)) {
+			si->tskey = 0;
+		}
+		si->timestamping = value;
+		break;
+#endif
+	default:
+		/* One of them, like the kernel does */
+		si->timestamp = value != 0 ? optname : 0;
+		break;
 	}
 
-	child_fi->fd = fd;
+#ifdef SO_TIMESTAMPNS
+	/* Let the kernel stamp datagrams when they arrive */
+	if (si->type == SOCK_DGRAM) {
+		value = swrap_tstamp_rx(si) ? 1 : 0;
 
-	child_si->family = parent_si->family;
-	child_si->type = parent_si->type;
-	child_si->protocol = parent_si->protocol;
-	child_si->bound = 1;
-	child_si->is_server = 1;
-	child_si->connected = 1;
+		return libc_setsockopt(fd,
+				       SOL_SOCKET,
+				       SO_TIMESTAMPNS,
+				       &value,
+				       sizeof(value));
+	}
+#else
+	(void) fd; /* unused */
+#endif
 
-	child_si->peername = (struct swrap_address) {
-		.sa_socklen = in_addr.sa_socklen,
-	};
-	memcpy(&child_si->peername.sa.ss, &in_addr.sa.ss, in_addr.sa_socklen);
+	return 0;
+}
 
-	if (addr != NULL && addrlen != NULL) {
-		size_t copy_len = MIN(*addrlen, in_addr.sa_socklen);
-		if (copy_len > 0) {
-			memcpy(addr, &in_addr.sa.ss, copy_len);
-		}
-		*addrlen = in_addr.sa_socklen;
-	}
+static int swrap_tstamp_getsockopt(struct socket_info *si,
+				   int optname,
+				   void *optval,
+				   socklen_t *optlen)
+{
+	int value;
 
-	ret = libc_getsockname(fd,
-			       &un_my_addr.sa.s,
-			       &un_my_addr.sa_socklen);
-	if (ret == -1) {
-		free(child_fi);
-		close(fd);
-		return ret;
+	if (optval == NULL || optlen == NULL ||
+	    *optlen < (socklen_t)sizeof(int)) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	ret = sockaddr_convert_from_un(child_si,
-				       &un_my_addr.sa.un,
-				       un_my_addr.sa_socklen,
-				       child_si->family,
-				       &in_my_addr.sa.s,
-				       &in_my_addr.sa_socklen);
-	if (ret == -1) {
-		free(child_fi);
-		close(fd);
-		return ret;
+	switch (optname) {
+#ifdef HAVE_SWRAP_TIMESTAMPING
+	case SO_TIMESTAMPING:
+		value = si->timestamping;
+		break;
+#endif
+	default:
+		value = si->timestamp == optname ? 1 : 0;
+		break;
 	}
 
-	SWRAP_LOG(SWRAP_LOG_TRACE,
-		  "accept() path=%s, fd=%d",
-		  un_my_addr.sa.un.sun_path, s);
-
-	child_si->myname = (struct swrap_address) {
-		.sa_socklen = in_my_addr.sa_socklen,
-	};
-	memcpy(&child_si->myname.sa.ss, &in_my_addr.sa.ss, in_my_addr.sa_socklen);
+	*optlen = sizeof(int);
+	*(int *)optval = value;
 
-	child_si->refcount = 1;
-	first_free = child_si->next_free;
-	child_si->next_free = 0;
+	return 0;
+}
 
-	child_fi->si_index = idx;
+/*
+ * Receives a datagram with the stamp of the kernel. The unix socket of an
+ * emulated socket has no other cmsgs for the caller, we add our own ones
+ * in swrap_recvmsg_after().
+ */
+static ssize_t swrap_tstamp_recvmsg(int fd,
+				    struct msghdr *msg,
+				    int flags,
+				    struct timespec *ts)
+{
+#if defined(SO_TIMESTAMPNS) && defined(HAVE_STRUCT_MSGHDR_MSG_CONTROL)
+	union {
+		struct cmsghdr cm;
+		uint8_t buf[CMSG_SPACE(sizeof(struct timespec))];
+	} control;
+	void *msg_control = msg->msg_control;
+	struct cmsghdr *cm;
+	ssize_t ret;
 
-	SWRAP_DLIST_ADD(socket_fds, child_fi);
+	msg->msg_control = control.buf;
+	msg->msg_controllen = sizeof(control.buf);
 
-	if (addr != NULL) {
-		swrap_pcap_dump_packet(child_si, addr, SWRAP_ACCEPT_SEND, NULL, 0);
-		swrap_pcap_dump_packet(child_si, addr, SWRAP_ACCEPT_RECV, NULL, 0);
-		swrap_pcap_dump_packet(child_si, addr, SWRAP_ACCEPT_ACK, NULL, 0);
+	ret = libc_recvmsg(fd, msg, flags);
+	if (ret != -1) {
+		for (cm = CMSG_FIRSTHDR(msg);
+		     cm != NULL;
+		     cm = CMSG_NXTHDR(msg, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET &&
+			    cm->cmsg_type == SCM_TIMESTAMPNS &&
+			    cm->cmsg_len >= CMSG_LEN(sizeof(*ts))) {
+				memcpy(ts, CMSG_DATA(cm), sizeof(*ts));
+			}
+		}
+		msg->msg_flags &= ~MSG_CTRUNC;
 	}
 
-	return fd;
-}
-
-#ifdef HAVE_ACCEPT4
-int accept4(int s, struct sockaddr *addr, socklen_t *addrlen, int flags)
-{
-	return swrap_accept(s, addr, (socklen_t *)addrlen, flags);
-}
-#endif
+	msg->msg_control = msg_control;
+	msg->msg_controllen = 0;
 
-#ifdef HAVE_ACCEPT_PSOCKLEN_T
-int accept(int s, struct sockaddr *addr, Psocklen_t addrlen)
+	return ret;
 #else
-int accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+	(void) ts; /* unused */
+
+	return libc_recvmsg(fd, msg, flags);
 #endif
-{
-	return swrap_accept(s, addr, (socklen_t *)addrlen, 0);
 }
 
-static int autobind_start_init;
-static int autobind_start;
-
-/* using sendto() or connect() on an unbound socket would give the
-   recipient no way to reply, as unlike UDP and TCP, a unix domain
-   socket can't auto-assign ephemeral port numbers, so we need to
-   assign it here.
-   Note: this might change the family from ipv6 to ipv4
-*/
-static int swrap_auto_bind(int fd, struct socket_info *si, int family)
+/* Remembers the stamp of a receive for swrap_msghdr_add_socket_info() */
+static void swrap_tstamp_recv(struct socket_info *si,
+			      ssize_t ret,
+			      const struct timespec *ts)
 {
-	struct swrap_address un_addr = {
-		.sa_socklen = sizeof(struct sockaddr_un),
-	};
-	int i;
-	char type;
-	int ret;
-	int port;
-	unsigned int in4_addr, in6_a0, in6_a1, in6_a2, in6_a3;
-	struct stat st;
-
-	if (autobind_start_init != 1) {
-		autobind_start_init = 1;
-		autobind_start = getpid();
-		autobind_start %= 50000;
-		autobind_start += 10000;
+	if (ret == -1 || !swrap_tstamp_rx(si)) {
+		swrap_tstamp_recv_ts = (struct timespec) { .tv_sec = 0, };
+		return;
 	}
 
-	un_addr.sa.un.sun_family = AF_UNIX;
-
-	switch (family) {
-	case AF_INET: {
-		struct sockaddr_in in;
+	if (ts->tv_sec != 0) {
+		swrap_tstamp_recv_ts = *ts;
+		return;
+	}
 
-		switch (si->type) {
-		case SOCK_STREAM:
-			type = SOCKET_TYPE_CHAR_TCP_LONG;
-			break;
-		case SOCK_DGRAM:
-			type = SOCKET_TYPE_CHAR_UDP_LONG;
-			break;
-		default:
-		    errno = ESOCKTNOSUPPORT;
-		    return -1;
-		}
+	clock_gettime(CLOCK_REALTIME, &swrap_tstamp_recv_ts);
+}
 
-		memset(&in, 0, sizeof(in));
-		in.sin_family = AF_INET;
-		in4_addr = socket_wrapper_default_addr();
-		in.sin_addr.s_addr = htonl(in4_addr);
+static void swrap_tstamp_send(struct socket_info *si, ssize_t ret)
+{
+#ifdef HAVE_SWRAP_TIMESTAMPING
+	struct swrap_tstamp_queue *q = si->errqueue;
+	struct swrap_tstamp *t;
 
-		si->myname = (struct swrap_address) {
-			.sa_socklen = sizeof(in),
-		};
-		memcpy(&si->myname.sa.in, &in, si->myname.sa_socklen);
-		break;
+	if (!(si->timestamping & SOF_TIMESTAMPING_TX_SOFTWARE) || ret < 0) {
+		return;
+	}
+	if (si->type == SOCK_STREAM && ret == 0) {
+		return;
 	}
-#ifdef HAVE_IPV6
-	case AF_INET6: {
-		struct sockaddr_in6 in6;
-
-		if (si->family != family) {
-			errno = ENETUNREACH;
-			return -1;
-		}
 
-		switch (si->type) {
-		case SOCK_STREAM:
-			type = SOCKET_TYPE_CHAR_TCP_V6_LONG;
-			break;
-		case SOCK_DGRAM:
-			type = SOCKET_TYPE_CHAR_UDP_V6_LONG;
-			break;
-		default:
-			errno = ESOCKTNOSUPPORT;
-			return -1;
+	if (q == NULL) {
+		q = calloc(1, sizeof(*q));
+		if (q == NULL) {
+			return;
 		}
+		si->errqueue = q;
+	}
 
-		memset(&in6, 0, sizeof(in6));
-		in6.sin6_family = AF_INET6;
-		in6.sin6_addr = *swrap_ipv6();
-		in6.sin6_addr.s6_addr[15] = socket_wrapper_default_iface();
+	/* The key of a stream is the offset of the last byte */
+	if (si->type == SOCK_STREAM) {
+		si->tskey += ret;
+	} else {
+		si->tskey++;
+	}
 
-		si->myname = (struct swrap_address) {
-			.sa_socklen = sizeof(in6),
-		};
-		memcpy(&si->myname.sa.in6, &in6, si->myname.sa_socklen);
-		swrap_make_ipv6_ints(in6.sin6_addr.s6_addr,&in6_a0,&in6_a1,&in6_a2,&in6_a3);
-		break;
+	/* The kernel drops them when the receive buffer is full */
+	if (q->count == SWRAP_TSTAMP_QUEUE_SIZE) {
+		return;
 	}
+
+	t = &q->stamps[(q->head + q->count) % SWRAP_TSTAMP_QUEUE_SIZE];
+	clock_gettime(CLOCK_REALTIME, &t->ts);
+	t->key = si->tskey - 1;
+	q->count++;
+#else
+	(void) si; /* unused */
+	(void) ret; /* unused */
 #endif
-	default:
-		errno = ESOCKTNOSUPPORT;
-		return -1;
-	}
+}
 
-	if (autobind_start > 60000) {
-		autobind_start = 10000;
+#if defined(HAVE_SWRAP_TIMESTAMPING) && defined(HAVE_STRUCT_MSGHDR_MSG_CONTROL)
+static void swrap_msghdr_add_cmsghdr(struct msghdr *msg,
+				     int level,
+				     int type,
+				     const void *data,
+				     size_t len);
+#endif
+
+/* recvmsg(MSG_ERRQUEUE), only the transmit stamps are queued */
+static ssize_t swrap_tstamp_errqueue(struct socket_info *si,
+				     struct msghdr *msg)
+{
+#if defined(HAVE_SWRAP_TIMESTAMPING) && defined(HAVE_STRUCT_MSGHDR_MSG_CONTROL)
+	struct swrap_tstamp_queue *q = si->errqueue;
+	struct scm_timestamping tss;
+	struct {
+		struct sock_extended_err ee;
+		struct sockaddr_in6 offender;
+	} err;
+	struct swrap_tstamp *t;
+	struct msghdr cmsg;
+	size_t err_len;
+	int level, type;
+
+	if (q == NULL || q->count == 0) {
+		errno = EAGAIN;
+		return -1;
 	}
 
-	for (i = 0; i < SOCKET_MAX_SOCKETS; i++) {
-		port = autobind_start + i;
+	t = &q->stamps[q->head];
+	q->head = (q->head + 1) % SWRAP_TSTAMP_QUEUE_SIZE;
+	q->count--;
 
-		if (family == AF_INET)
-			snprintf(un_addr.sa.un.sun_path, sizeof(un_addr.sa.un.sun_path),
-				"%s/"SOCKET_FORMAT_LONG, socket_wrapper_dir(),
-				type, in4_addr, port);
-		else
-			snprintf(un_addr.sa.un.sun_path, sizeof(un_addr.sa.un.sun_path),
-				"%s/"SOCKET_FORMAT_V6_LONG, socket_wrapper_dir(),
-				type, in6_a0,in6_a1, in6_a2, in6_a3, port);
+	ZERO_STRUCT(tss);
+	if (si->timestamping & SOF_TIMESTAMPING_SOFTWARE) {
+		tss.ts[0] = t->ts;
+	}
 
-		if (stat(un_addr.sa.un.sun_path, &st) == 0) continue;
+	ZERO_STRUCT(err);
+	err.ee.ee_errno = ENOMSG;
+	err.ee.ee_origin = SO_EE_ORIGIN_TIMESTAMPING;
+	err.ee.ee_info = SCM_TSTAMP_SND;
+	if (si->timestamping & SOF_TIMESTAMPING_OPT_ID) {
+		err.ee.ee_data = t->key;
+	}
 
-		ret = libc_bind(fd, &un_addr.sa.s, un_addr.sa_socklen);
-		if (ret == -1) {
-			return ret;
-		}
+	if (si->family == AF_INET6) {
+		level = IPPROTO_IPV6;
+		type = IPV6_RECVERR;
+		err_len = sizeof(err.ee) + sizeof(struct sockaddr_in6);
+	} else {
+		level = IPPROTO_IP;
+		type = IP_RECVERR;
+		err_len = sizeof(err.ee) + sizeof(struct sockaddr_in);
+	}
 
-		si->un_addr = un_addr.sa.un;
+	/* Like SOF_TIMESTAMPING_OPT_TSONLY */
+	msg->msg_namelen = 0;
+	msg->msg_flags = MSG_ERRQUEUE;
 
-		si->bound = 1;
-		autobind_start = port + 1;
-		SWRAP_LOG(SWRAP_LOG_TRACE, "bound to: %s", un_addr.sa.un.sun_path);
-		break;
-	}
-	if (i == SOCKET_MAX_SOCKETS) {
-		SWRAP_LOG(SWRAP_LOG_ERROR, "Too many open unix sockets (%u) for "
-					   "interface "SOCKET_FORMAT,
-					   SOCKET_MAX_SOCKETS,
-					   type,
-					   socket_wrapper_default_addr(),
-					   0);
-		errno = ENFILE;
-		return -1;
+	if (msg->msg_control == NULL) {
+		msg->msg_controllen = 0;
+		return 0;
 	}
 
-	si->family = family;
-	set_port(si->family, port, &si->myname);
+	cmsg = (struct msghdr) {
+		.msg_control = msg->msg_control,
+		.msg_controllen = msg->msg_controllen,
+	};
+	swrap_msghdr_add_cmsghdr(&cmsg, SOL_SOCKET, SCM_TIMESTAMPING,
+				 &tss, sizeof(tss));
+	swrap_msghdr_add_cmsghdr(&cmsg, level, type, &err, err_len);
+
+	msg->msg_controllen -= cmsg.msg_controllen;
+	msg->msg_flags |= cmsg.msg_flags;
 
 	return 0;
+#else
+	(void) si; /* unused */
+	(void) msg; /* unused */
+
+	errno = EAGAIN;
+	return -1;
+#endif
+}
+
+/* Called when the last reference to a socket is closed */
+static void swrap_tstamp_release(struct socket_info *si)
+{
+	free(si->errqueue);
+	si->errqueue = NULL;
 }
 
 /****************************************************************************
- *   CONNECT
+ *   GETSOCKOPT
  ***************************************************************************/
 
-static int swrap_connect(int s, const struct sockaddr *serv_addr,
-			 socklen_t addrlen)
+#ifndef SO_PROTOCOL
+# ifdef SO_PROTOTYPE /* The Solaris name */
+#  define SO_PROTOCOL SO_PROTOTYPE
+# endif /* SO_PROTOTYPE */
+#endif /* SO_PROTOCOL */
+
+static int swrap_getsockopt(int s, int level, int optname,
+			    void *optval, socklen_t *optlen)
 {
-	int ret;
-	struct swrap_address un_addr = {
-		.sa_socklen = sizeof(struct sockaddr_un),
-	};
 	struct socket_info *si = find_socket_info(s);
-	int bcast = 0;
 
 	if (!si) {
-		return libc_connect(s, serv_addr, addrlen);
-	}
-
-	if (si->bound == 0) {
-		ret = swrap_auto_bind(s, si, serv_addr->sa_family);
-		if (ret == -1) {
-			return -1;
-		}
-	}
-
-	if (si->family != serv_addr->sa_family) {
-		errno = EINVAL;
-		return -1;
+		return libc_getsockopt(s,
+				       level,
+				       optname,
+				       optval,
+				       optlen);
 	}
 
-	ret = sockaddr_convert_to_un(si, serv_addr,
-				     addrlen, &un_addr.sa.un, 0, &bcast);
-	if (ret == -1) {
-		return -1;
-	}
+	swrap_stats_call(s, si, SWRAP_STATS_SOCKOPT, 0, 0);
 
-	if (bcast) {
-		errno = ENETUNREACH;
-		return -1;
+	if (level == SOL_SOCKET && swrap_tstamp_option(optname)) {
+		return swrap_tstamp_getsockopt(si, optname, optval, optlen);
 	}
 
-	if (si->type == SOCK_DGRAM) {
-		si->defer_connect = 1;
-		ret = 0;
-	} else {
-		swrap_pcap_dump_packet(si, serv_addr, SWRAP_CONNECT_SEND, NULL, 0);
-
-		ret = libc_connect(s,
-				   &un_addr.sa.s,
-				   un_addr.sa_socklen);
+	/* The kernel has no getsockopt() for the forced ones */
+	if (level == SOL_SOCKET &&
+	    (optname == SO_SNDBUF || optname == SO_RCVBUF)) {
+		return swrap_sockbuf_getsockopt(si, optname, optval, optlen);
 	}
 
-	SWRAP_LOG(SWRAP_LOG_TRACE,
-		  "connect() path=%s, fd=%d",
-		  un_addr.sa.un.sun_path, s);
+	if (level == SOL_SOCKET) {
+		switch (optname) {
+#ifdef SO_DOMAIN
+		case SO_DOMAIN:
+			if (optval == NULL || optlen == NULL ||
+			    *optlen < (socklen_t)sizeof(int)) {
+				errno = EINVAL;
+				return -1;
+			}
 
+			*optlen = sizeof(int);
+			*(int *)optval = si->family;
+			return 0;
+#endif /* SO_DOMAIN */
 
-	/* to give better errors */
-	if (ret == -1 && errno == ENOENT) {
-		errno = EHOSTUNREACH;
-	}
+#ifdef SO_PROTOCOL
+		case SO_PROTOCOL:
+			if (optval == NULL || optlen == NULL ||
+			    *optlen < (socklen_t)sizeof(int)) {
+				errno = EINVAL;
+				return -1;
+			}
 
-	if (ret == 0) {
-		si->peername = (struct swrap_address) {
-			.sa_socklen = addrlen,
-		};
+			*optlen = sizeof(int);
+			*(int *)optval = si->protocol;
+			return 0;
+#endif /* SO_PROTOCOL */
+		case SO_TYPE:
+			if (optval == NULL || optlen == NULL ||
+			    *optlen < (socklen_t)sizeof(int)) {
+				errno = EINVAL;
+				return -1;
+			}
 
-		memcpy(&si->peername.sa.ss, serv_addr, addrlen);
-		si->connected = 1;
+			*optlen = sizeof(int);
+			*(int *)optval = si->type;
+			return 0;
+		default:
+			return libc_getsockopt(s,
+					       level,
+					       optname,
+					       optval,
+					       optlen);
+		}
+	} else if (level == IPPROTO_TCP) {
+		switch (optname) {
+#ifdef TCP_NODELAY
+		case TCP_NODELAY:
+			/*
+			 * This enables sending packets directly out over TCP.
+			 * As a unix socket is doing that any way, report it as
+			 * enabled.
+			 */
+			if (optval == NULL || optlen == NULL ||
+			    *optlen < (socklen_t)sizeof(int)) {
+				errno = EINVAL;
+				return -1;
+			}
 
-		/*
-		 * When we connect() on a socket than we have to bind the
-		 * outgoing connection on the interface we use for the
-		 * transport. We already bound it on the right interface
-		 * but here we have to update the name so getsockname()
-		 * returns correct information.
-		 */
-		if (si->bindname.sa_socklen > 0) {
-			si->myname = (struct swrap_address) {
-				.sa_socklen = si->bindname.sa_socklen,
-			};
+			*optlen = sizeof(int);
+			*(int *)optval = si->tcp_nodelay;
 
-			memcpy(&si->myname.sa.ss,
-			       &si->bindname.sa.ss,
-			       si->bindname.sa_socklen);
+			return 0;
+#endif /* TCP_NODELAY */
+#ifdef TCP_INFO
+		case TCP_INFO:
+			if (si->type != SOCK_STREAM) {
+				break;
+			}
 
-			/* Cleanup bindname */
-			si->bindname = (struct swrap_address) {
-				.sa_socklen = 0,
-			};
+			return swrap_tcp_info(s, si, optval, optlen);
+#endif /* TCP_INFO */
+		default:
+			break;
 		}
-
-		swrap_pcap_dump_packet(si, serv_addr, SWRAP_CONNECT_RECV, NULL, 0);
-		swrap_pcap_dump_packet(si, serv_addr, SWRAP_CONNECT_ACK, NULL, 0);
-	} else {
-		swrap_pcap_dump_packet(si, serv_addr, SWRAP_CONNECT_UNREACH, NULL, 0);
 	}
 
-	return ret;
+	errno = ENOPROTOOPT;
+	return -1;
 }
 
-int connect(int s, const struct sockaddr *serv_addr, socklen_t addrlen)
+#ifdef HAVE_ACCEPT_PSOCKLEN_T
+int getsockopt(int s, int level, int optname, void *optval, Psocklen_t optlen)
+#else
+int getsockopt(int s, int level, int optname, void *optval, socklen_t *optlen)
+#endif
 {
-	return swrap_connect(s, serv_addr, addrlen);
+	return SWRAP_PROF(GETSOCKOPT,
+			  swrap_getsockopt(s, level, optname,
+					   optval, (socklen_t *)optlen));
 }
 
 /****************************************************************************
- *   BIND
+ *   SETSOCKOPT
  ***************************************************************************/
 
-static int swrap_bind(int s, const struct sockaddr *myaddr, socklen_t addrlen)
+static int swrap_setsockopt(int s, int level, int optname,
+			    const void *optval, socklen_t optlen)
 {
-	int ret;
-	struct swrap_address un_addr = {
-		.sa_socklen = sizeof(struct sockaddr_un),
-	};
 	struct socket_info *si = find_socket_info(s);
-	int bind_error = 0;
-#if 0 /* FIXME */
-	bool in_use;
-#endif
 
 	if (!si) {
-		return libc_bind(s, myaddr, addrlen);
+		return libc_setsockopt(s,
+				       level,
+				       optname,
+				       optval,
+				       optlen);
 	}
 
-	switch (si->family) {
-	case AF_INET: {
-		const struct sockaddr_in *sin;
-		if (addrlen < sizeof(struct sockaddr_in)) {
-			bind_error = EINVAL;
-			break;
-		}
+	swrap_stats_call(s, si, SWRAP_STATS_SOCKOPT, 0, 0);
 
-		sin = (const struct sockaddr_in *)(const void *)myaddr;
+	if (level == SOL_SOCKET && swrap_tstamp_option(optname)) {
+		return swrap_tstamp_setsockopt(s, si, optname, optval, optlen);
+	}
 
-		if (sin->sin_family != AF_INET) {
-			bind_error = EAFNOSUPPORT;
-		}
+	if (level == SOL_SOCKET && swrap_sockbuf_option(optname)) {
+		return swrap_sockbuf_setsockopt(s, si, optname, optval, optlen);
+	}
 
-		/* special case for AF_UNSPEC */
-		if (sin->sin_family == AF_UNSPEC &&
-		    (sin->sin_addr.s_addr == htonl(INADDR_ANY)))
-		{
-			bind_error = 0;
+	if (level == SOL_SOCKET) {
+		int ret;
+
+		ret = libc_setsockopt(s,
+				      level,
+				      optname,
+				      optval,
+				      optlen);
+		if (ret == -1 || optval == NULL ||
+		    optlen < (socklen_t)sizeof(int)) {
+			return ret;
 		}
 
-		break;
-	}
-#ifdef HAVE_IPV6
-	case AF_INET6: {
-		const struct sockaddr_in6 *sin6;
-		if (addrlen < sizeof(struct sockaddr_in6)) {
-			bind_error = EINVAL;
+		/* Needed to detect EADDRINUSE on bind() */
+		switch (optname) {
+		case SO_REUSEADDR:
+			si->reuseaddr = *(const int *)optval != 0;
+			break;
+#ifdef SO_REUSEPORT
+		case SO_REUSEPORT:
+			si->reuseport = *(const int *)optval != 0;
+			break;
+#endif
+		default:
 			break;
 		}
 
-		sin6 = (const struct sockaddr_in6 *)(const void *)myaddr;
+		return ret;
+	} else if (level == IPPROTO_TCP) {
+		switch (optname) {
+#ifdef TCP_NODELAY
+		case TCP_NODELAY: {
+			int i;
 
-		if (sin6->sin6_family != AF_INET6) {
-			bind_error = EAFNOSUPPORT;
-		}
+			/*
+			 * This enables sending packets directly out over TCP.
+			 * A unix socket is doing that any way.
+			 */
+			if (optval == NULL || optlen == 0 ||
+			    optlen < (socklen_t)sizeof(int)) {
+				errno = EINVAL;
+				return -1;
+			}
 
-		break;
+			i = *discard_const_p(int, optval);
+			if (i != 0 && i != 1) {
+				errno = EINVAL;
+				return -1;
+			}
+			si->tcp_nodelay = i;
+
+			return 0;
+		}
+#endif /* TCP_NODELAY */
+		default:
+			break;
+		}
 	}
+
+	switch (si->family) {
+	case AF_INET:
+		if (level == IPPROTO_IP) {
+#ifdef IP_PKTINFO
+			if (optname == IP_PKTINFO) {
+				si->pktinfo = AF_INET;
+			}
+#endif /* IP_PKTINFO */
+		}
+		return 0;
+#ifdef HAVE_IPV6
+	case AF_INET6:
+		if (level == IPPROTO_IPV6) {
+#ifdef IPV6_RECVPKTINFO
+			if (optname == IPV6_RECVPKTINFO) {
+				si->pktinfo = AF_INET6;
+			}
+#endif /* IPV6_PKTINFO */
+		}
+		return 0;
 #endif
 	default:
-		bind_error = EINVAL;
-		break;
-	}
-
-	if (bind_error != 0) {
-		errno = bind_error;
+		errno = ENOPROTOOPT;
 		return -1;
 	}
+}
 
-#if 0 /* FIXME */
-	in_use = check_addr_port_in_use(myaddr, addrlen);
-	if (in_use) {
-		errno = EADDRINUSE;
-		return -1;
-	}
-#endif
+int setsockopt(int s, int level, int optname,
+	       const void *optval, socklen_t optlen)
+{
+	return SWRAP_PROF(SETSOCKOPT,
+			  swrap_setsockopt(s, level, optname, optval, optlen));
+}
 
-	si->myname.sa_socklen = addrlen;
-	memcpy(&si->myname.sa.ss, myaddr, addrlen);
+/****************************************************************************
+ *   IOCTL
+ ***************************************************************************/
 
-	ret = sockaddr_convert_to_un(si,
-				     myaddr,
-				     addrlen,
-				     &un_addr.sa.un,
-				     1,
-				     &si->bcast);
-	if (ret == -1) {
+#if defined(SIOCOUTQ) && defined(SIOCOUTQNSD)
+static int swrap_ioctl_outq(int fd,
+			    struct socket_info *si,
+			    unsigned long int r,
+			    int *value)
+{
+	size_t in_flight, notsent;
+	size_t outq;
+
+	if (si->listening) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	unlink(un_addr.sa.un.sun_path);
-
-	ret = libc_bind(s, &un_addr.sa.s, un_addr.sa_socklen);
-
-	SWRAP_LOG(SWRAP_LOG_TRACE,
-		  "bind() path=%s, fd=%d",
-		  un_addr.sa.un.sun_path, s);
+	swrap_outq(fd, si, &in_flight, &notsent);
 
-	if (ret == 0) {
-		si->bound = 1;
+	if (r == SIOCOUTQNSD) {
+		outq = notsent;
+	} else {
+		outq = in_flight + notsent;
 	}
+	*value = MIN(outq, (size_t)INT_MAX);
 
-	return ret;
+	return 0;
 }
+#endif /* SIOCOUTQ && SIOCOUTQNSD */
 
-int bind(int s, const struct sockaddr *myaddr, socklen_t addrlen)
+static int swrap_vioctl(int s, unsigned long int r, va_list va)
 {
-	return swrap_bind(s, myaddr, addrlen);
-}
-
-/****************************************************************************
- *   BINDRESVPORT
- ***************************************************************************/
+	struct socket_info *si = find_socket_info(s);
+	va_list ap;
+	int value;
+	int rc;
 
-#ifdef HAVE_BINDRESVPORT
-static int swrap_getsockname(int s, struct sockaddr *name, socklen_t *addrlen);
+	if (!si) {
+		return libc_vioctl(s, r, va);
+	}
 
-static int swrap_bindresvport_sa(int sd, struct sockaddr *sa)
-{
-	struct swrap_address myaddr = {
-		.sa_socklen = sizeof(struct sockaddr_storage),
-	};
-	socklen_t salen;
-	static uint16_t port;
-	uint16_t i;
-	int rc = -1;
-	int af;
+	swrap_stats_call(s, si, SWRAP_STATS_IOCTL, 0, 0);
 
-#define SWRAP_STARTPORT 600
-#define SWRAP_ENDPORT (IPPORT_RESERVED - 1)
-#define SWRAP_NPORTS (SWRAP_ENDPORT - SWRAP_STARTPORT + 1)
+	/* Without the hello, nothing else arrived yet */
+	if (si->ring_pending && r == FIONREAD &&
+	    swrap_ring_hello(s, si, 0) == -1 && errno == EAGAIN) {
+		int *pending = va_arg(va, int *);
 
-	if (port == 0) {
-		port = (getpid() % SWRAP_NPORTS) + SWRAP_STARTPORT;
+		*pending = 0;
+		return 0;
 	}
 
-	if (sa == NULL) {
-		salen = myaddr.sa_socklen;
-		sa = &myaddr.sa.s;
-
-		rc = swrap_getsockname(sd, &myaddr.sa.s, &salen);
-		if (rc < 0) {
-			return -1;
-		}
+	/* The socket only holds the token, the data is in the ring */
+	if (si->ring != NULL && r == FIONREAD) {
+		int *pending = va_arg(va, int *);
 
-		af = sa->sa_family;
-		memset(&myaddr.sa.ss, 0, salen);
-	} else {
-		af = sa->sa_family;
+		*pending = swrap_ring_pending(si);
+		return 0;
 	}
 
-	for (i = 0; i < SWRAP_NPORTS; i++, port++) {
-		switch(af) {
-		case AF_INET: {
-			struct sockaddr_in *sinp = (struct sockaddr_in *)(void *)sa;
-
-			salen = sizeof(struct sockaddr_in);
-			sinp->sin_port = htons(port);
-			break;
-		}
-		case AF_INET6: {
-			struct sockaddr_in6 *sin6p = (struct sockaddr_in6 *)(void *)sa;
+#if defined(SIOCOUTQ) && defined(SIOCOUTQNSD)
+	/*
+	 * The unix socket reports the truesize of its buffers and knows no
+	 * SIOCOUTQNSD, which UDP doesn't know either.
+	 */
+	if (r == SIOCOUTQ || (r == SIOCOUTQNSD && si->type == SOCK_STREAM)) {
+		return swrap_ioctl_outq(s, si, r, va_arg(va, int *));
+	}
+#endif
 
-			salen = sizeof(struct sockaddr_in6);
-			sin6p->sin6_port = htons(port);
-			break;
-		}
-		default:
-			errno = EAFNOSUPPORT;
-			return -1;
-		}
-		sa->sa_family = af;
+	va_copy(ap, va);
 
-		if (port > SWRAP_ENDPORT) {
-			port = SWRAP_STARTPORT;
-		}
+	rc = libc_vioctl(s, r, va);
 
-		rc = swrap_bind(sd, (struct sockaddr *)sa, salen);
-		if (rc == 0 || errno != EADDRINUSE) {
-			break;
+	switch (r) {
+	case FIONREAD:
+		value = *((int *)va_arg(ap, int *));
+
+		if (rc == -1 && errno != EAGAIN && errno != ENOBUFS) {
+			swrap_pcap_dump_packet(si, NULL, SWRAP_PENDING_RST, NULL, 0);
+		} else if (value == 0) { /* END OF FILE */
+			swrap_pcap_dump_packet(si, NULL, SWRAP_PENDING_RST, NULL, 0);
 		}
+		break;
 	}
 
+	va_end(ap);
+
 	return rc;
 }
 
-int bindresvport(int sockfd, struct sockaddr_in *sinp)
+#ifdef HAVE_IOCTL_INT
+int ioctl(int s, int r, ...)
+#else
+int ioctl(int s, unsigned long int r, ...)
+#endif
 {
-	return swrap_bindresvport_sa(sockfd, (struct sockaddr *)sinp);
+	va_list va;
+	int rc;
+
+	va_start(va, r);
+
+	rc = SWRAP_PROF(IOCTL, swrap_vioctl(s, (unsigned long int) r, va));
+
+	va_end(va);
+
+	return rc;
 }
-#endif
 
-/****************************************************************************
- *   LISTEN
- ***************************************************************************/
+/*****************
+ * CMSG
+ *****************/
 
-static int swrap_listen(int s, int backlog)
+#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+
+#ifndef CMSG_ALIGN
+# ifdef _ALIGN /* BSD */
+#define CMSG_ALIGN _ALIGN
+# else
+#define CMSG_ALIGN(len) (((len) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1))
+# endif /* _ALIGN */
+#endif /* CMSG_ALIGN */
+
+/**
+ * @brief Add a cmsghdr to a msghdr.
+ *
+ * This is an function to add any type of cmsghdr. It will operate on the
+ * msg->msg_control and msg->msg_controllen you pass in by adapting them to
+ * the buffer position after the added cmsg element. Hence, this function is
+ * intended to be used with an intermediate msghdr and not on the original
+ * one handed in by the client.
+ *
+ * @param[in]  msg      The msghdr to which to add the cmsg.
+ *
+ * @param[in]  level    The cmsg level to set.
+ *
+ * @param[in]  type     The cmsg type to set.
+ *
+ * @param[in]  data     The cmsg data to set.
+ *
+ * @param[in]  len      the length of the data to set.
+ */
+static void swrap_msghdr_add_cmsghdr(struct msghdr *msg,
+				     int level,
+				     int type,
+				     const void *data,
+				     size_t len)
 {
-	int ret;
-	struct socket_info *si = find_socket_info(s);
+	size_t cmlen = CMSG_LEN(len);
+	size_t cmspace = CMSG_SPACE(len);
+	uint8_t cmbuf[cmspace];
+	void *cast_ptr = (void *)cmbuf;
+	struct cmsghdr *cm = (struct cmsghdr *)cast_ptr;
+	uint8_t *p;
 
-	if (!si) {
-		return libc_listen(s, backlog);
+	memset(cmbuf, 0, cmspace);
+
+	if (msg->msg_controllen < cmlen) {
+		cmlen = msg->msg_controllen;
+		msg->msg_flags |= MSG_CTRUNC;
 	}
 
-	if (si->bound == 0) {
-		ret = swrap_auto_bind(s, si, si->family);
-		if (ret == -1) {
-			errno = EADDRINUSE;
-			return ret;
-		}
+	if (msg->msg_controllen < cmspace) {
+		cmspace = msg->msg_controllen;
 	}
 
-	ret = libc_listen(s, backlog);
+	/*
+	 * We copy the full input data into an intermediate cmsghdr first
+	 * in order to more easily cope with truncation.
+	 */
+	cm->cmsg_len = cmlen;
+	cm->cmsg_level = level;
+	cm->cmsg_type = type;
+	memcpy(CMSG_DATA(cm), data, len);
 
-	return ret;
+	/*
+	 * We now copy the possibly truncated buffer.
+	 * We copy cmlen bytes, but consume cmspace bytes,
+	 * leaving the possible padding uninitialiazed.
+	 */
+	p = (uint8_t *)msg->msg_control;
+	memcpy(p, cm, cmlen);
+	p += cmspace;
+	msg->msg_control = p;
+	msg->msg_controllen -= cmspace;
+
+	return;
 }
 
-int listen(int s, int backlog)
+static int swrap_msghdr_add_pktinfo(struct socket_info *si,
+				    struct msghdr *msg)
 {
-	return swrap_listen(s, backlog);
-}
+	/* Add packet info */
+	switch (si->pktinfo) {
+#if defined(IP_PKTINFO) && (defined(HAVE_STRUCT_IN_PKTINFO) || defined(IP_RECVDSTADDR))
+	case AF_INET: {
+		struct sockaddr_in *sin;
+#if defined(HAVE_STRUCT_IN_PKTINFO)
+		struct in_pktinfo pkt;
+#elif defined(IP_RECVDSTADDR)
+		struct in_addr pkt;
+#endif
 
-/****************************************************************************
- *   FOPEN
- ***************************************************************************/
+		if (si->bindname.sa_socklen == sizeof(struct sockaddr_in)) {
+			sin = &si->bindname.sa.in;
+		} else {
+			if (si->myname.sa_socklen != sizeof(struct sockaddr_in)) {
+				return 0;
+			}
+			sin = &si->myname.sa.in;
+		}
 
-static FILE *swrap_fopen(const char *name, const char *mode)
-{
-	FILE *fp;
+		ZERO_STRUCT(pkt);
 
-	fp = libc_fopen(name, mode);
-	if (fp != NULL) {
-		int fd = fileno(fp);
+#if defined(HAVE_STRUCT_IN_PKTINFO)
+		pkt.ipi_ifindex = socket_wrapper_default_iface();
+		pkt.ipi_addr.s_addr = sin->sin_addr.s_addr;
+#elif defined(IP_RECVDSTADDR)
+		pkt = sin->sin_addr;
+#endif
 
-		swrap_remove_stale(fd);
+		swrap_msghdr_add_cmsghdr(msg, IPPROTO_IP, IP_PKTINFO,
+					 &pkt, sizeof(pkt));
+
+		break;
 	}
+#endif /* IP_PKTINFO */
+#if defined(HAVE_IPV6)
+	case AF_INET6: {
+#if defined(IPV6_PKTINFO) && defined(HAVE_STRUCT_IN6_PKTINFO)
+		struct sockaddr_in6 *sin6;
+		struct in6_pktinfo pkt6;
 
-	return fp;
-}
+		if (si->bindname.sa_socklen == sizeof(struct sockaddr_in6)) {
+			sin6 = &si->bindname.sa.in6;
+		} else {
+			if (si->myname.sa_socklen != sizeof(struct sockaddr_in6)) {
+				return 0;
+			}
+			sin6 = &si->myname.sa.in6;
+		}
 
-FILE *fopen(const char *name, const char *mode)
-{
-	return swrap_fopen(name, mode);
-}
+		ZERO_STRUCT(pkt6);
 
-/****************************************************************************
- *   OPEN
- ***************************************************************************/
+		pkt6.ipi6_ifindex = socket_wrapper_default_iface();
+		pkt6.ipi6_addr = sin6->sin6_addr;
 
-static int swrap_vopen(const char *pathname, int flags, va_list ap)
-{
-	int ret;
+		swrap_msghdr_add_cmsghdr(msg, IPPROTO_IPV6, IPV6_PKTINFO,
+					&pkt6, sizeof(pkt6));
+#endif /* HAVE_STRUCT_IN6_PKTINFO */
 
-	ret = libc_vopen(pathname, flags, ap);
-	if (ret != -1) {
-		/*
-		 * There are methods for closing descriptors (libc-internal code
-		 * paths, direct syscalls) which close descriptors in ways that
-		 * we can't intercept, so try to recover when we notice that
-		 * that's happened
-		 */
-		swrap_remove_stale(ret);
+		break;
 	}
-	return ret;
+#endif /* IPV6_PKTINFO */
+	default:
+		return -1;
+	}
+
+	return 0;
 }
 
-int open(const char *pathname, int flags, ...)
+static void swrap_msghdr_add_timestamp(struct socket_info *si,
+				       struct msghdr *msg,
+				       const struct timespec *ts)
 {
-	va_list ap;
-	int fd;
-
-	va_start(ap, flags);
-	fd = swrap_vopen(pathname, flags, ap);
-	va_end(ap);
+#ifdef SO_TIMESTAMP
+	if (si->timestamp == SO_TIMESTAMP) {
+		struct timeval tv = {
+			.tv_sec = ts->tv_sec,
+			.tv_usec = ts->tv_nsec / 1000,
+		};
 
-	return fd;
+		swrap_msghdr_add_cmsghdr(msg, SOL_SOCKET, SCM_TIMESTAMP,
+					 &tv, sizeof(tv));
+	}
+#endif /* SO_TIMESTAMP */
+#ifdef SO_TIMESTAMPNS
+	if (si->timestamp == SO_TIMESTAMPNS) {
+		swrap_msghdr_add_cmsghdr(msg, SOL_SOCKET, SCM_TIMESTAMPNS,
+					 ts, sizeof(*ts));
+	}
+#endif /* SO_TIMESTAMPNS */
+#ifdef HAVE_SWRAP_TIMESTAMPING
+	if ((si->timestamping & SOF_TIMESTAMPING_RX_SOFTWARE) &&
+	    (si->timestamping & SOF_TIMESTAMPING_SOFTWARE)) {
+		struct scm_timestamping tss;
+
+		/* Only the software stamp */
+		ZERO_STRUCT(tss);
+		tss.ts[0] = *ts;
+
+		swrap_msghdr_add_cmsghdr(msg, SOL_SOCKET, SCM_TIMESTAMPING,
+					 &tss, sizeof(tss));
+	}
+#endif /* HAVE_SWRAP_TIMESTAMPING */
 }
 
-/****************************************************************************
- *   OPENAT
- ***************************************************************************/
-
-static int swrap_vopenat(int dirfd, const char *path, int flags, va_list ap)
+static int swrap_msghdr_add_socket_info(struct socket_info *si,
+					struct msghdr *omsg)
 {
-	int ret;
+	int rc = 0;
 
-	ret = libc_vopenat(dirfd, path, flags, ap);
-	if (ret != -1) {
-		/*
-		 * There are methods for closing descriptors (libc-internal code
-		 * paths, direct syscalls) which close descriptors in ways that
-		 * we can't intercept, so try to recover when we notice that
-		 * that's happened
-		 */
-		swrap_remove_stale(ret);
+	if (si->pktinfo > 0) {
+		rc = swrap_msghdr_add_pktinfo(si, omsg);
 	}
 
-	return ret;
+	if (rc == 0 && swrap_tstamp_recv_ts.tv_sec != 0) {
+		swrap_msghdr_add_timestamp(si, omsg, &swrap_tstamp_recv_ts);
+	}
+
+	return rc;
 }
 
-int openat(int dirfd, const char *path, int flags, ...)
-{
-	va_list ap;
-	int fd;
+static int swrap_sendmsg_copy_cmsg(struct cmsghdr *cmsg,
+				   uint8_t **cm_data,
+				   size_t *cm_data_space);
+static int swrap_sendmsg_filter_cmsg_socket(struct cmsghdr *cmsg,
+					    uint8_t **cm_data,
+					    size_t *cm_data_space);
 
-	va_start(ap, flags);
-	fd = swrap_vopenat(dirfd, path, flags, ap);
-	va_end(ap);
+static int swrap_sendmsg_filter_cmsghdr(struct msghdr *msg,
+					uint8_t **cm_data,
+					size_t *cm_data_space) {
+	struct cmsghdr *cmsg;
+	int rc = -1;
 
-	return fd;
-}
+	/* Nothing to do */
+	if (msg->msg_controllen == 0 || msg->msg_control == NULL) {
+		return 0;
+	}
 
-/****************************************************************************
- *   GETPEERNAME
- ***************************************************************************/
+	for (cmsg = CMSG_FIRSTHDR(msg);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		switch (cmsg->cmsg_level) {
+		case IPPROTO_IP:
+			rc = swrap_sendmsg_filter_cmsg_socket(cmsg,
+							      cm_data,
+							      cm_data_space);
+			break;
+		default:
+			rc = swrap_sendmsg_copy_cmsg(cmsg,
+						     cm_data,
+						     cm_data_space);
+			break;
+		}
+	}
 
-static int swrap_getpeername(int s, struct sockaddr *name, socklen_t *addrlen)
+	return rc;
+}
+
+static int swrap_sendmsg_copy_cmsg(struct cmsghdr *cmsg,
+				   uint8_t **cm_data,
+				   size_t *cm_data_space)
 {
-	struct socket_info *si = find_socket_info(s);
-	socklen_t len;
+	size_t cmspace;
+	uint8_t *p;
 
-	if (!si) {
-		return libc_getpeername(s, name, addrlen);
-	}
+	cmspace = *cm_data_space + CMSG_ALIGN(cmsg->cmsg_len);
 
-	if (si->peername.sa_socklen == 0)
-	{
-		errno = ENOTCONN;
+	p = realloc((*cm_data), cmspace);
+	if (p == NULL) {
 		return -1;
 	}
+	(*cm_data) = p;
 
-	len = MIN(*addrlen, si->peername.sa_socklen);
-	if (len == 0) {
-		return 0;
-	}
+	p = (*cm_data) + (*cm_data_space);
+	*cm_data_space = cmspace;
 
-	memcpy(name, &si->peername.sa.ss, len);
-	*addrlen = si->peername.sa_socklen;
+	memcpy(p, cmsg, cmsg->cmsg_len);
 
 	return 0;
 }
 
-#ifdef HAVE_ACCEPT_PSOCKLEN_T
-int getpeername(int s, struct sockaddr *name, Psocklen_t addrlen)
-#else
-int getpeername(int s, struct sockaddr *name, socklen_t *addrlen)
-#endif
-{
-	return swrap_getpeername(s, name, (socklen_t *)addrlen);
-}
+static int swrap_sendmsg_filter_cmsg_pktinfo(struct cmsghdr *cmsg,
+					    uint8_t **cm_data,
+					    size_t *cm_data_space);
 
-/****************************************************************************
- *   GETSOCKNAME
- ***************************************************************************/
 
-static int swrap_getsockname(int s, struct sockaddr *name, socklen_t *addrlen)
+static int swrap_sendmsg_filter_cmsg_socket(struct cmsghdr *cmsg,
+					    uint8_t **cm_data,
+					    size_t *cm_data_space)
 {
-	struct socket_info *si = find_socket_info(s);
-	socklen_t len;
+	int rc = -1;
 
-	if (!si) {
-		return libc_getsockname(s, name, addrlen);
+	switch(cmsg->cmsg_type) {
+#ifdef IP_PKTINFO
+	case IP_PKTINFO:
+		rc = swrap_sendmsg_filter_cmsg_pktinfo(cmsg,
+						       cm_data,
+						       cm_data_space);
+		break;
+#endif
+#ifdef IPV6_PKTINFO
+	case IPV6_PKTINFO:
+		rc = swrap_sendmsg_filter_cmsg_pktinfo(cmsg,
+						       cm_data,
+						       cm_data_space);
+		break;
+#endif
+	default:
+		break;
 	}
 
-	len = MIN(*addrlen, si->myname.sa_socklen);
-	if (len == 0) {
-		return 0;
-	}
+	return rc;
+}
 
-	memcpy(name, &si->myname.sa.ss, len);
-	*addrlen = si->myname.sa_socklen;
+static int swrap_sendmsg_filter_cmsg_pktinfo(struct cmsghdr *cmsg,
+					     uint8_t **cm_data,
+					     size_t *cm_data_space)
+{
+	(void)cmsg; /* unused */
+	(void)cm_data; /* unused */
+	(void)cm_data_space; /* unused */
 
+	/*
+	 * Passing a IP pktinfo to a unix socket might be rejected by the
+	 * Kernel, at least on FreeBSD. So skip this cmsg.
+	 */
 	return 0;
 }
+#endif /* HAVE_STRUCT_MSGHDR_MSG_CONTROL */
 
-#ifdef HAVE_ACCEPT_PSOCKLEN_T
-int getsockname(int s, struct sockaddr *name, Psocklen_t addrlen)
-#else
-int getsockname(int s, struct sockaddr *name, socklen_t *addrlen)
-#endif
+static ssize_t swrap_sendmsg_before(int fd,
+				    struct socket_info *si,
+				    struct msghdr *msg,
+				    struct iovec *tmp_iov,
+				    struct sockaddr_un *tmp_un,
+				    const struct sockaddr_un **to_un,
+				    const struct sockaddr **to,
+				    int *bcast)
 {
-	return swrap_getsockname(s, name, (socklen_t *)addrlen);
-}
+	const struct sockaddr *peer = NULL;
+	size_t i, len = 0;
+	ssize_t ret;
 
-/****************************************************************************
- *   GETSOCKOPT
- ***************************************************************************/
+	if (to_un) {
+		*to_un = NULL;
+	}
+	if (to) {
+		*to = NULL;
+	}
+	if (bcast) {
+		*bcast = 0;
+	}
 
-#ifndef SO_PROTOCOL
-# ifdef SO_PROTOTYPE /* The Solaris name */
-#  define SO_PROTOCOL SO_PROTOTYPE
-# endif /* SO_PROTOTYPE */
-#endif /* SO_PROTOCOL */
+	swrap_oneway_send_start();
 
-static int swrap_getsockopt(int s, int level, int optname,
-			    void *optval, socklen_t *optlen)
-{
-	struct socket_info *si = find_socket_info(s);
+	switch (si->type) {
+	case SOCK_STREAM: {
+		unsigned long mtu;
 
-	if (!si) {
-		return libc_getsockopt(s,
-				       level,
-				       optname,
-				       optval,
-				       optlen);
-	}
+		if (!si->connected) {
+			errno = ENOTCONN;
+			return -1;
+		}
 
-	if (level == SOL_SOCKET) {
-		switch (optname) {
-#ifdef SO_DOMAIN
-		case SO_DOMAIN:
-			if (optval == NULL || optlen == NULL ||
-			    *optlen < (socklen_t)sizeof(int)) {
-				errno = EINVAL;
-				return -1;
-			}
+		ret = swrap_ring_pending_wait(fd, si, SO_SNDTIMEO);
+		if (ret == -1) {
+			return -1;
+		}
 
-			*optlen = sizeof(int);
-			*(int *)optval = si->family;
-			return 0;
-#endif /* SO_DOMAIN */
+		ret = swrap_fault_before(fd, si, msg, tmp_iov, SWRAP_FAULT_SEND);
+		if (ret == -1) {
+			return -1;
+		}
 
-#ifdef SO_PROTOCOL
-		case SO_PROTOCOL:
-			if (optval == NULL || optlen == NULL ||
-			    *optlen < (socklen_t)sizeof(int)) {
-				errno = EINVAL;
+		if (msg->msg_iovlen == 0) {
+			break;
+		}
+
+		/* The ring needs no MTU split, unless we capture packets */
+		if (si->ring != NULL && swrap_pcap_init_file() == NULL) {
+			break;
+		}
+
+		mtu = socket_wrapper_mtu();
+		for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+			size_t nlen;
+			nlen = len + msg->msg_iov[i].iov_len;
+			if (nlen > mtu) {
+				break;
+			}
+		}
+		if (i < (size_t)msg->msg_iovlen) {
+			swrap_stats_count(fd, si, SWRAP_STATS_MTU_SPLITS, 1);
+		}
+		msg->msg_iovlen = i;
+		if (msg->msg_iovlen == 0) {
+			*tmp_iov = msg->msg_iov[0];
+			tmp_iov->iov_len = MIN((size_t)tmp_iov->iov_len,
+					       (size_t)mtu);
+			msg->msg_iov = tmp_iov;
+			msg->msg_iovlen = 1;
+		}
+		break;
+	}
+	case SOCK_DGRAM:
+		if (si->connected) {
+			if (msg->msg_name != NULL) {
+				/*
+				 * We are dealing with unix sockets and if we
+				 * are connected, we should only talk to the
+				 * connected unix path. Using the fd to send
+				 * to another server would be hard to achieve.
+				 */
+				msg->msg_name = NULL;
+				msg->msg_namelen = 0;
+			}
+			peer = &si->peername.sa.s;
+		} else {
+			const struct sockaddr *msg_name;
+			msg_name = (const struct sockaddr *)msg->msg_name;
+
+			if (msg_name == NULL) {
+				errno = ENOTCONN;
 				return -1;
 			}
 
-			*optlen = sizeof(int);
-			*(int *)optval = si->protocol;
-			return 0;
-#endif /* SO_PROTOCOL */
-		case SO_TYPE:
-			if (optval == NULL || optlen == NULL ||
-			    *optlen < (socklen_t)sizeof(int)) {
-				errno = EINVAL;
+
+			ret = sockaddr_convert_to_un(si, msg_name, msg->msg_namelen,
+						     tmp_un, 0, bcast);
+			if (ret == -1) {
 				return -1;
 			}
 
-			*optlen = sizeof(int);
-			*(int *)optval = si->type;
-			return 0;
-		default:
-			return libc_getsockopt(s,
-					       level,
-					       optname,
-					       optval,
-					       optlen);
+			if (to_un) {
+				*to_un = tmp_un;
+			}
+			if (to) {
+				*to = msg_name;
+			}
+			peer = msg_name;
+			msg->msg_name = tmp_un;
+			msg->msg_namelen = sizeof(*tmp_un);
 		}
-	} else if (level == IPPROTO_TCP) {
-		switch (optname) {
-#ifdef TCP_NODELAY
-		case TCP_NODELAY:
-			/*
-			 * This enables sending packets directly out over TCP.
-			 * As a unix socket is doing that any way, report it as
-			 * enabled.
-			 */
-			if (optval == NULL || optlen == NULL ||
-			    *optlen < (socklen_t)sizeof(int)) {
-				errno = EINVAL;
-				return -1;
+
+		if (si->bound == 0) {
+			ret = swrap_auto_bind(fd, si, si->family);
+			if (ret == -1) {
+				if (errno == ENOTSOCK) {
+					swrap_remove_stale(fd);
+					return -ENOTSOCK;
+				} else {
+					SWRAP_LOG(SWRAP_LOG_ERROR, "swrap_sendmsg_before failed");
+					return -1;
+				}
 			}
+		}
 
-			*optlen = sizeof(int);
-			*(int *)optval = si->tcp_nodelay;
+		if (swrap_link_denied(si, peer)) {
+			errno = ENETUNREACH;
+			return -1;
+		}
 
-			return 0;
-#endif /* TCP_NODELAY */
-		default:
+		if (!si->defer_connect) {
 			break;
 		}
-	}
 
-	errno = ENOPROTOOPT;
-	return -1;
-}
+		ret = sockaddr_convert_to_un(si,
+					     &si->peername.sa.s,
+					     si->peername.sa_socklen,
+					     tmp_un,
+					     0,
+					     NULL);
+		if (ret == -1) {
+			return -1;
+		}
 
-#ifdef HAVE_ACCEPT_PSOCKLEN_T
-int getsockopt(int s, int level, int optname, void *optval, Psocklen_t optlen)
-#else
-int getsockopt(int s, int level, int optname, void *optval, socklen_t *optlen)
-#endif
-{
-	return swrap_getsockopt(s, level, optname, optval, (socklen_t *)optlen);
-}
+		ret = libc_connect(fd,
+				   (struct sockaddr *)(void *)tmp_un,
+				   sizeof(*tmp_un));
 
-/****************************************************************************
- *   SETSOCKOPT
- ***************************************************************************/
+		/* to give better errors */
+		if (ret == -1 && errno == ENOENT) {
+			errno = EHOSTUNREACH;
+		}
 
-static int swrap_setsockopt(int s, int level, int optname,
-			    const void *optval, socklen_t optlen)
-{
-	struct socket_info *si = find_socket_info(s);
+		if (ret == -1) {
+			return ret;
+		}
 
-	if (!si) {
-		return libc_setsockopt(s,
-				       level,
-				       optname,
-				       optval,
-				       optlen);
+		si->defer_connect = 0;
+		break;
+	default:
+		errno = EHOSTUNREACH;
+		return -1;
 	}
 
-	if (level == SOL_SOCKET) {
-		return libc_setsockopt(s,
-				       level,
-				       optname,
-				       optval,
-				       optlen);
-	} else if (level == IPPROTO_TCP) {
-		switch (optname) {
-#ifdef TCP_NODELAY
-		case TCP_NODELAY: {
-			int i;
-
-			/*
-			 * This enables sending packets directly out over TCP.
-			 * A unix socket is doing that any way.
-			 */
-			if (optval == NULL || optlen == 0 ||
-			    optlen < (socklen_t)sizeof(int)) {
-				errno = EINVAL;
-				return -1;
-			}
-
-			i = *discard_const_p(int, optval);
-			if (i != 0 && i != 1) {
-				errno = EINVAL;
-				return -1;
-			}
-			si->tcp_nodelay = i;
+#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	if (msg->msg_controllen > 0 && msg->msg_control != NULL) {
+		uint8_t *cmbuf = NULL;
+		size_t cmlen = 0;
 
-			return 0;
+		ret = swrap_sendmsg_filter_cmsghdr(msg, &cmbuf, &cmlen);
+		if (ret < 0) {
+			free(cmbuf);
+			return -1;
 		}
-#endif /* TCP_NODELAY */
-		default:
-			break;
+
+		if (cmlen == 0) {
+			msg->msg_controllen = 0;
+			msg->msg_control = NULL;
+		} else if (cmlen < msg->msg_controllen && cmbuf != NULL) {
+			memcpy(msg->msg_control, cmbuf, cmlen);
+			msg->msg_controllen = cmlen;
 		}
+		free(cmbuf);
 	}
+#endif
 
-	switch (si->family) {
-	case AF_INET:
-		if (level == IPPROTO_IP) {
-#ifdef IP_PKTINFO
-			if (optname == IP_PKTINFO) {
-				si->pktinfo = AF_INET;
-			}
-#endif /* IP_PKTINFO */
+	return 0;
+}
+
+/*
+ * The bookkeeping of a send which doesn't need the payload, returns the
+ * errno to leave to the caller.
+ */
+static int swrap_sendmsg_count(int fd,
+			       struct socket_info *si,
+			       const struct sockaddr *to,
+			       ssize_t ret)
+{
+	int saved_errno = errno;
+
+	/* to give better errors */
+	if (ret == -1) {
+		if (saved_errno == ENOENT) {
+			saved_errno = EHOSTUNREACH;
+		} else if (saved_errno == ENOTSOCK) {
+			/* If the fd is not a socket, remove it */
+			swrap_remove_stale(fd);
 		}
-		return 0;
-#ifdef HAVE_IPV6
-	case AF_INET6:
-		if (level == IPPROTO_IPV6) {
-#ifdef IPV6_RECVPKTINFO
-			if (optname == IPV6_RECVPKTINFO) {
-				si->pktinfo = AF_INET6;
-			}
-#endif /* IPV6_PKTINFO */
+	}
+
+	if (si->type == SOCK_STREAM && ret > 0) {
+		si->fault.bytes[SWRAP_FAULT_SEND] += ret;
+		swrap_tcp_count(si, SWRAP_FAULT_SEND, ret);
+	}
+
+	/* The datagram never made it into the receive queue */
+	if (si->rcvq_charged != NULL) {
+		if (ret == -1) {
+			swrap_rcvq_uncharge(si->rcvq_charged, si->rcvq_charge);
 		}
-		return 0;
-#endif
-	default:
-		errno = ENOPROTOOPT;
-		return -1;
+		si->rcvq_charged = NULL;
 	}
+
+	swrap_stats_call(fd, si, SWRAP_STATS_SEND, ret, saved_errno);
+	swrap_flow_send(si, to, ret, saved_errno);
+	swrap_oneway_send(si, to, ret);
+	swrap_tstamp_send(si, ret);
+
+	return saved_errno;
 }
 
-int setsockopt(int s, int level, int optname,
-	       const void *optval, socklen_t optlen)
+static void swrap_sendmsg_after(int fd,
+				struct socket_info *si,
+				struct msghdr *msg,
+				const struct sockaddr *to,
+				ssize_t ret)
 {
-	return swrap_setsockopt(s, level, optname, optval, optlen);
-}
+	int saved_errno = swrap_sendmsg_count(fd, si, to, ret);
+	size_t i, len = 0;
+	uint8_t *buf;
+	off_t ofs = 0;
+	size_t avail = 0;
+	size_t remain;
 
-/****************************************************************************
- *   IOCTL
- ***************************************************************************/
+	/* Nothing to capture, don't copy the payload */
+	if (swrap_pcap_init_file() == NULL) {
+		si->impaired = 0;
+		errno = saved_errno;
+		return;
+	}
 
-static int swrap_vioctl(int s, unsigned long int r, va_list va)
-{
-	struct socket_info *si = find_socket_info(s);
-	va_list ap;
-	int value;
-	int rc;
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		avail += msg->msg_iov[i].iov_len;
+	}
 
-	if (!si) {
-		return libc_vioctl(s, r, va);
+	if (ret == -1) {
+		remain = MIN(80, avail);
+	} else {
+		remain = ret;
 	}
 
-	va_copy(ap, va);
+	/* we capture it as one single packet */
+	buf = (uint8_t *)malloc(remain);
+	if (!buf) {
+		/* we just not capture the packet */
+		si->impaired = 0;
+		errno = saved_errno;
+		return;
+	}
 
-	rc = libc_vioctl(s, r, va);
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		size_t this_time = MIN(remain, (size_t)msg->msg_iov[i].iov_len);
+		memcpy(buf + ofs,
+		       msg->msg_iov[i].iov_base,
+		       this_time);
+		ofs += this_time;
+		remain -= this_time;
+	}
+	len = ofs;
 
-	switch (r) {
-	case FIONREAD:
-		value = *((int *)va_arg(ap, int *));
+	switch (si->type) {
+	case SOCK_STREAM:
+		if (ret == -1) {
+			swrap_pcap_dump_packet(si, NULL, SWRAP_SEND, buf, len);
+			swrap_pcap_dump_packet(si, NULL, SWRAP_SEND_RST, NULL, 0);
+		} else {
+			swrap_pcap_dump_packet(si, NULL, SWRAP_SEND, buf, len);
+		}
+		break;
 
-		if (rc == -1 && errno != EAGAIN && errno != ENOBUFS) {
-			swrap_pcap_dump_packet(si, NULL, SWRAP_PENDING_RST, NULL, 0);
-		} else if (value == 0) { /* END OF FILE */
-			swrap_pcap_dump_packet(si, NULL, SWRAP_PENDING_RST, NULL, 0);
+	case SOCK_DGRAM:
+		if (si->connected) {
+			to = &si->peername.sa.s;
+		}
+		if (ret == -1) {
+			swrap_pcap_dump_packet(si, to, SWRAP_SENDTO, buf, len);
+			swrap_pcap_dump_packet(si, to, SWRAP_SENDTO_UNREACH, buf, len);
+		} else {
+			swrap_pcap_dump_packet(si, to, SWRAP_SENDTO, buf, len);
+		}
+		if (si->impaired & SWRAP_IMPAIR_DROPPED) {
+			swrap_pcap_dump_packet(si, to, SWRAP_SENDTO_DROP, buf, len);
+		}
+		if (si->impaired & SWRAP_IMPAIR_DUPLICATED) {
+			swrap_pcap_dump_packet(si, to, SWRAP_SENDTO, buf, len);
 		}
 		break;
 	}
 
-	va_end(ap);
+	si->impaired = 0;
 
-	return rc;
+	free(buf);
+	errno = saved_errno;
 }
 
-#ifdef HAVE_IOCTL_INT
-int ioctl(int s, int r, ...)
-#else
-int ioctl(int s, unsigned long int r, ...)
-#endif
+static int swrap_recvmsg_before(int fd,
+				struct socket_info *si,
+				struct msghdr *msg,
+				struct iovec *tmp_iov)
 {
-	va_list va;
-	int rc;
-
-	va_start(va, r);
-
-	rc = swrap_vioctl(s, (unsigned long int) r, va);
-
-	va_end(va);
-
-	return rc;
-}
+	size_t i, len = 0;
+	ssize_t ret;
 
-/*****************
- * CMSG
- *****************/
+	(void)fd; /* unused */
 
-#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	switch (si->type) {
+	case SOCK_STREAM: {
+		unsigned int mtu;
+		if (!si->connected) {
+			errno = ENOTCONN;
+			return -1;
+		}
 
-#ifndef CMSG_ALIGN
-# ifdef _ALIGN /* BSD */
-#define CMSG_ALIGN _ALIGN
-# else
-#define CMSG_ALIGN(len) (((len) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1))
-# endif /* _ALIGN */
-#endif /* CMSG_ALIGN */
+		ret = swrap_ring_pending_wait(fd, si, SO_RCVTIMEO);
+		if (ret == -1) {
+			return -1;
+		}
 
-/**
- * @brief Add a cmsghdr to a msghdr.
- *
- * This is an function to add any type of cmsghdr. It will operate on the
- * msg->msg_control and msg->msg_controllen you pass in by adapting them to
- * the buffer position after the added cmsg element. Hence, this function is
- * intended to be used with an intermediate msghdr and not on the original
- * one handed in by the client.
- *
- * @param[in]  msg      The msghdr to which to add the cmsg.
- *
- * @param[in]  level    The cmsg level to set.
- *
- * @param[in]  type     The cmsg type to set.
- *
- * @param[in]  data     The cmsg data to set.
- *
- * @param[in]  len      the length of the data to set.
- */
-static void swrap_msghdr_add_cmsghdr(struct msghdr *msg,
-				     int level,
-				     int type,
-				     const void *data,
-				     size_t len)
-{
-	size_t cmlen = CMSG_LEN(len);
-	size_t cmspace = CMSG_SPACE(len);
-	uint8_t cmbuf[cmspace];
-	void *cast_ptr = (void *)cmbuf;
-	struct cmsghdr *cm = (struct cmsghdr *)cast_ptr;
-	uint8_t *p;
+		ret = swrap_fault_before(fd, si, msg, tmp_iov, SWRAP_FAULT_RECV);
+		if (ret == -1) {
+			return -1;
+		}
 
-	memset(cmbuf, 0, cmspace);
+		if (msg->msg_iovlen == 0) {
+			break;
+		}
 
-	if (msg->msg_controllen < cmlen) {
-		cmlen = msg->msg_controllen;
-		msg->msg_flags |= MSG_CTRUNC;
-	}
+		/* The ring needs no MTU split, unless we capture packets */
+		if (si->ring != NULL && swrap_pcap_init_file() == NULL) {
+			break;
+		}
 
-	if (msg->msg_controllen < cmspace) {
-		cmspace = msg->msg_controllen;
+		mtu = socket_wrapper_mtu();
+		for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+			size_t nlen;
+			nlen = len + msg->msg_iov[i].iov_len;
+			if (nlen > mtu) {
+				break;
+			}
+		}
+		msg->msg_iovlen = i;
+		if (msg->msg_iovlen == 0) {
+			*tmp_iov = msg->msg_iov[0];
+			tmp_iov->iov_len = MIN((size_t)tmp_iov->iov_len,
+					       (size_t)mtu);
+			msg->msg_iov = tmp_iov;
+			msg->msg_iovlen = 1;
+		}
+		break;
 	}
+	case SOCK_DGRAM:
+		if (msg->msg_name == NULL) {
+			errno = EINVAL;
+			return -1;
+		}
 
-	/*
-	 * We copy the full input data into an intermediate cmsghdr first
-	 * in order to more easily cope with truncation.
-	 */
-	cm->cmsg_len = cmlen;
-	cm->cmsg_level = level;
-	cm->cmsg_type = type;
-	memcpy(CMSG_DATA(cm), data, len);
-
-	/*
-	 * We now copy the possibly truncated buffer.
-	 * We copy cmlen bytes, but consume cmspace bytes,
-	 * leaving the possible padding uninitialiazed.
-	 */
-	p = (uint8_t *)msg->msg_control;
-	memcpy(p, cm, cmlen);
-	p += cmspace;
-	msg->msg_control = p;
-	msg->msg_controllen -= cmspace;
-
-	return;
-}
-
-static int swrap_msghdr_add_pktinfo(struct socket_info *si,
-				    struct msghdr *msg)
-{
-	/* Add packet info */
-	switch (si->pktinfo) {
-#if defined(IP_PKTINFO) && (defined(HAVE_STRUCT_IN_PKTINFO) || defined(IP_RECVDSTADDR))
-	case AF_INET: {
-		struct sockaddr_in *sin;
-#if defined(HAVE_STRUCT_IN_PKTINFO)
-		struct in_pktinfo pkt;
-#elif defined(IP_RECVDSTADDR)
-		struct in_addr pkt;
-#endif
+		if (msg->msg_iovlen == 0) {
+			break;
+		}
 
-		if (si->bindname.sa_socklen == sizeof(struct sockaddr_in)) {
-			sin = &si->bindname.sa.in;
-		} else {
-			if (si->myname.sa_socklen != sizeof(struct sockaddr_in)) {
-				return 0;
+		if (si->bound == 0) {
+			ret = swrap_auto_bind(fd, si, si->family);
+			if (ret == -1) {
+				/*
+				 * When attempting to read or write to a
+				 * descriptor, if an underlying autobind fails
+				 * because it's not a socket, stop intercepting
+				 * uses of that descriptor.
+				 */
+				if (errno == ENOTSOCK) {
+					swrap_remove_stale(fd);
+					return -ENOTSOCK;
+				} else {
+					SWRAP_LOG(SWRAP_LOG_ERROR,
+						  "swrap_recvmsg_before failed");
+					return -1;
+				}
 			}
-			sin = &si->myname.sa.in;
 		}
 
-		ZERO_STRUCT(pkt);
-
-#if defined(HAVE_STRUCT_IN_PKTINFO)
-		pkt.ipi_ifindex = socket_wrapper_default_iface();
-		pkt.ipi_addr.s_addr = sin->sin_addr.s_addr;
-#elif defined(IP_RECVDSTADDR)
-		pkt = sin->sin_addr;
-#endif
-
-		swrap_msghdr_add_cmsghdr(msg, IPPROTO_IP, IP_PKTINFO,
-					 &pkt, sizeof(pkt));
-
 		break;
+	default:
+		errno = EHOSTUNREACH;
+		return -1;
 	}
-#endif /* IP_PKTINFO */
-#if defined(HAVE_IPV6)
-	case AF_INET6: {
-#if defined(IPV6_PKTINFO) && defined(HAVE_STRUCT_IN6_PKTINFO)
-		struct sockaddr_in6 *sin6;
-		struct in6_pktinfo pkt6;
 
-		if (si->bindname.sa_socklen == sizeof(struct sockaddr_in6)) {
-			sin6 = &si->bindname.sa.in6;
-		} else {
-			if (si->myname.sa_socklen != sizeof(struct sockaddr_in6)) {
-				return 0;
-			}
-			sin6 = &si->myname.sa.in6;
+	return 0;
+}
+
+static int swrap_recvmsg_after(int fd,
+			       struct socket_info *si,
+			       struct msghdr *msg,
+			       const struct sockaddr_un *un_addr,
+			       socklen_t un_addrlen,
+			       ssize_t ret,
+			       int flags)
+{
+	int saved_errno = errno;
+	size_t i;
+	uint8_t *buf = NULL;
+	off_t ofs = 0;
+	size_t avail = 0;
+	size_t remain;
+	int rc;
+
+	/* to give better errors */
+	if (ret == -1) {
+		if (saved_errno == ENOENT) {
+			saved_errno = EHOSTUNREACH;
+		} else if (saved_errno == ENOTSOCK) {
+			/* If the fd is not a socket, remove it */
+			swrap_remove_stale(fd);
 		}
+	}
 
-		ZERO_STRUCT(pkt6);
+	if (si->type == SOCK_STREAM && ret > 0) {
+		si->fault.bytes[SWRAP_FAULT_RECV] += ret;
+		swrap_tcp_count(si, SWRAP_FAULT_RECV, ret);
+	}
 
-		pkt6.ipi6_ifindex = socket_wrapper_default_iface();
-		pkt6.ipi6_addr = sin6->sin6_addr;
+	swrap_stats_call(fd, si, SWRAP_STATS_RECV, ret, saved_errno);
 
-		swrap_msghdr_add_cmsghdr(msg, IPPROTO_IPV6, IPV6_PKTINFO,
-					&pkt6, sizeof(pkt6));
-#endif /* HAVE_STRUCT_IN6_PKTINFO */
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		avail += msg->msg_iov[i].iov_len;
+	}
 
-		break;
+	/* Convert the socket address before we leave */
+	if (si->type == SOCK_DGRAM && un_addr != NULL) {
+		rc = sockaddr_convert_from_un(si,
+					      un_addr,
+					      un_addrlen,
+					      si->family,
+					      msg->msg_name,
+					      &msg->msg_namelen);
+		if (rc == -1) {
+			goto done;
+		}
 	}
-#endif /* IPV6_PKTINFO */
-	default:
-		return -1;
+
+	swrap_flow_recv(si, msg, un_addr != NULL, ret, saved_errno);
+	swrap_oneway_recv(si, msg, un_addr != NULL, ret, flags);
+
+	/* Nothing to capture, don't copy the payload */
+	if (avail == 0 || swrap_pcap_init_file() == NULL) {
+		rc = 0;
+		goto done;
 	}
 
-	return 0;
-}
+	if (ret == -1) {
+		remain = MIN(80, avail);
+	} else {
+		remain = ret;
+	}
 
-static int swrap_msghdr_add_socket_info(struct socket_info *si,
-					struct msghdr *omsg)
-{
-	int rc = 0;
+	/* we capture it as one single packet */
+	buf = (uint8_t *)malloc(remain);
+	if (buf == NULL) {
+		/* we just not capture the packet */
+		errno = saved_errno;
+		return -1;
+	}
 
-	if (si->pktinfo > 0) {
-		rc = swrap_msghdr_add_pktinfo(si, omsg);
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		size_t this_time = MIN(remain, (size_t)msg->msg_iov[i].iov_len);
+		memcpy(buf + ofs,
+		       msg->msg_iov[i].iov_base,
+		       this_time);
+		ofs += this_time;
+		remain -= this_time;
 	}
 
-	return rc;
-}
+	switch (si->type) {
+	case SOCK_STREAM:
+		if (ret == -1 && saved_errno != EAGAIN && saved_errno != ENOBUFS) {
+			swrap_pcap_dump_packet(si, NULL, SWRAP_RECV_RST, NULL, 0);
+		} else if (ret == 0) { /* END OF FILE */
+			swrap_pcap_dump_packet(si, NULL, SWRAP_RECV_RST, NULL, 0);
+		} else if (ret > 0) {
+			swrap_pcap_dump_packet(si, NULL, SWRAP_RECV, buf, ret);
+		}
+		break;
 
-static int swrap_sendmsg_copy_cmsg(struct cmsghdr *cmsg,
-				   uint8_t **cm_data,
-				   size_t *cm_data_space);
-static int swrap_sendmsg_filter_cmsg_socket(struct cmsghdr *cmsg,
-					    uint8_t **cm_data,
-					    size_t *cm_data_space);
+	case SOCK_DGRAM:
+		if (ret == -1) {
+			break;
+		}
 
-static int swrap_sendmsg_filter_cmsghdr(struct msghdr *msg,
-					uint8_t **cm_data,
-					size_t *cm_data_space) {
-	struct cmsghdr *cmsg;
-	int rc = -1;
+		if (un_addr != NULL) {
+			swrap_pcap_dump_packet(si,
+					  msg->msg_name,
+					  SWRAP_RECVFROM,
+					  buf,
+					  ret);
+		} else {
+			swrap_pcap_dump_packet(si,
+					  msg->msg_name,
+					  SWRAP_RECV,
+					  buf,
+					  ret);
+		}
 
-	/* Nothing to do */
-	if (msg->msg_controllen == 0 || msg->msg_control == NULL) {
-		return 0;
+		break;
 	}
 
-	for (cmsg = CMSG_FIRSTHDR(msg);
-	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR(msg, cmsg)) {
-		switch (cmsg->cmsg_level) {
-		case IPPROTO_IP:
-			rc = swrap_sendmsg_filter_cmsg_socket(cmsg,
-							      cm_data,
-							      cm_data_space);
-			break;
-		default:
-			rc = swrap_sendmsg_copy_cmsg(cmsg,
-						     cm_data,
-						     cm_data_space);
-			break;
+	rc = 0;
+done:
+	free(buf);
+	errno = saved_errno;
+
+#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	if (rc == 0 &&
+	    msg->msg_controllen > 0 &&
+	    msg->msg_control != NULL) {
+		rc = swrap_msghdr_add_socket_info(si, msg);
+		if (rc < 0) {
+			return -1;
 		}
 	}
+#endif
 
 	return rc;
 }
 
-static int swrap_sendmsg_copy_cmsg(struct cmsghdr *cmsg,
-				   uint8_t **cm_data,
-				   size_t *cm_data_space)
-{
-	size_t cmspace;
-	uint8_t *p;
+/****************************************************************************
+ *   RECVFROM
+ ***************************************************************************/
 
-	cmspace = *cm_data_space + CMSG_ALIGN(cmsg->cmsg_len);
+static ssize_t swrap_recvfrom(int s, void *buf, size_t len, int flags,
+			      struct sockaddr *from, socklen_t *fromlen)
+{
+	struct swrap_address from_addr = {
+		.sa_socklen = sizeof(struct sockaddr_un),
+	};
+	ssize_t ret;
+	struct socket_info *si = find_socket_info(s);
+	struct swrap_address saddr = {
+		.sa_socklen = sizeof(struct sockaddr_storage),
+	};
+	struct msghdr msg;
+	struct iovec tmp;
+	int tret;
 
-	p = realloc((*cm_data), cmspace);
-	if (p == NULL) {
-		return -1;
+	if (!si) {
+		return libc_recvfrom(s,
+				     buf,
+				     len,
+				     flags,
+				     from,
+				     fromlen);
 	}
-	(*cm_data) = p;
 
-	p = (*cm_data) + (*cm_data_space);
-	*cm_data_space = cmspace;
+	tmp.iov_base = buf;
+	tmp.iov_len = len;
 
-	memcpy(p, cmsg, cmsg->cmsg_len);
+	ZERO_STRUCT(msg);
+	if (from != NULL && fromlen != NULL) {
+		msg.msg_name = from;   /* optional address */
+		msg.msg_namelen = *fromlen; /* size of address */
+	} else {
+		msg.msg_name = &saddr.sa.s; /* optional address */
+		msg.msg_namelen = saddr.sa_socklen; /* size of address */
+	}
+	msg.msg_iov = &tmp;            /* scatter/gather array */
+	msg.msg_iovlen = 1;            /* # elements in msg_iov */
+#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	msg.msg_control = NULL;        /* ancillary data, see below */
+	msg.msg_controllen = 0;        /* ancillary data buffer len */
+	msg.msg_flags = 0;             /* flags on received message */
+#endif
 
-	return 0;
-}
+	tret = swrap_recvmsg_before(s, si, &msg, &tmp);
+	if (tret < 0) {
+		return -1;
+	}
 
-static int swrap_sendmsg_filter_cmsg_pktinfo(struct cmsghdr *cmsg,
-					    uint8_t **cm_data,
-					    size_t *cm_data_space);
+	buf = msg.msg_iov[0].iov_base;
+	len = msg.msg_iov[0].iov_len;
 
+	if (si->ring != NULL) {
+		ret = swrap_ring_recvmsg(s, si, &msg, flags);
+		from_addr.sa_socklen = 0;
+	} else {
+		ret = libc_recvfrom(s,
+				    buf,
+				    len,
+				    swrap_rcvq_recv_flags(si, flags),
+				    &from_addr.sa.s,
+				    &from_addr.sa_socklen);
+		ret = swrap_rcvq_recv(si, &msg, ret, flags);
+	}
+	if (ret == -1) {
+		return ret;
+	}
 
-static int swrap_sendmsg_filter_cmsg_socket(struct cmsghdr *cmsg,
-					    uint8_t **cm_data,
-					    size_t *cm_data_space)
-{
-	int rc = -1;
+	tret = swrap_recvmsg_after(s,
+				   si,
+				   &msg,
+				   &from_addr.sa.un,
+				   from_addr.sa_socklen,
+				   ret,
+				   flags);
+	if (tret != 0) {
+		return tret;
+	}
 
-	switch(cmsg->cmsg_type) {
-#ifdef IP_PKTINFO
-	case IP_PKTINFO:
-		rc = swrap_sendmsg_filter_cmsg_pktinfo(cmsg,
-						       cm_data,
-						       cm_data_space);
-		break;
-#endif
-#ifdef IPV6_PKTINFO
-	case IPV6_PKTINFO:
-		rc = swrap_sendmsg_filter_cmsg_pktinfo(cmsg,
-						       cm_data,
-						       cm_data_space);
-		break;
-#endif
-	default:
-		break;
+	if (from != NULL && fromlen != NULL) {
+		*fromlen = msg.msg_namelen;
 	}
 
-	return rc;
+	return ret;
 }
 
-static int swrap_sendmsg_filter_cmsg_pktinfo(struct cmsghdr *cmsg,
-					     uint8_t **cm_data,
-					     size_t *cm_data_space)
-{
-	(void)cmsg; /* unused */
-	(void)cm_data; /* unused */
-	(void)cm_data_space; /* unused */
-
-	/*
-	 * Passing a IP pktinfo to a unix socket might be rejected by the
-	 * Kernel, at least on FreeBSD. So skip this cmsg.
-	 */
-	return 0;
+#ifdef HAVE_ACCEPT_PSOCKLEN_T
+ssize_t recvfrom(int s, void *buf, size_t len, int flags,
+		 struct sockaddr *from, Psocklen_t fromlen)
+#else
+ssize_t recvfrom(int s, void *buf, size_t len, int flags,
+		 struct sockaddr *from, socklen_t *fromlen)
+#endif
+{
+	return SWRAP_PROF(RECVFROM,
+			  swrap_recvfrom(s, buf, len, flags,
+					 from, (socklen_t *)fromlen));
 }
-#endif /* HAVE_STRUCT_MSGHDR_MSG_CONTROL */
 
-static ssize_t swrap_sendmsg_before(int fd,
-				    struct socket_info *si,
-				    struct msghdr *msg,
-				    struct iovec *tmp_iov,
-				    struct sockaddr_un *tmp_un,
-				    const struct sockaddr_un **to_un,
-				    const struct sockaddr **to,
-				    int *bcast)
+/****************************************************************************
+ *   SENDTO
+ ***************************************************************************/
+
+static ssize_t swrap_sendto(int s, const void *buf, size_t len, int flags,
+			    const struct sockaddr *to, socklen_t tolen)
 {
-	size_t i, len = 0;
+	struct msghdr msg;
+	struct iovec tmp;
+	struct swrap_address un_addr = {
+		.sa_socklen = sizeof(struct sockaddr_un),
+	};
+	const struct sockaddr_un *to_un = NULL;
+	struct swrap_delay_params dp;
 	ssize_t ret;
+	int rc;
+	struct socket_info *si = find_socket_info(s);
+	int bcast = 0;
 
-	if (to_un) {
-		*to_un = NULL;
-	}
-	if (to) {
-		*to = NULL;
-	}
-	if (bcast) {
-		*bcast = 0;
+	if (!si) {
+		return libc_sendto(s, buf, len, flags, to, tolen);
 	}
 
-	switch (si->type) {
-	case SOCK_STREAM: {
-		unsigned long mtu;
-
-		if (!si->connected) {
-			errno = ENOTCONN;
-			return -1;
-		}
+	tmp.iov_base = discard_const_p(char, buf);
+	tmp.iov_len = len;
 
-		if (msg->msg_iovlen == 0) {
-			break;
-		}
+	ZERO_STRUCT(msg);
+	msg.msg_name = discard_const_p(struct sockaddr, to); /* optional address */
+	msg.msg_namelen = tolen;       /* size of address */
+	msg.msg_iov = &tmp;            /* scatter/gather array */
+	msg.msg_iovlen = 1;            /* # elements in msg_iov */
+#if HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	msg.msg_control = NULL;        /* ancillary data, see below */
+	msg.msg_controllen = 0;        /* ancillary data buffer len */
+	msg.msg_flags = 0;             /* flags on received message */
+#endif
 
-		mtu = socket_wrapper_mtu();
-		for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
-			size_t nlen;
-			nlen = len + msg->msg_iov[i].iov_len;
-			if (nlen > mtu) {
-				break;
-			}
-		}
-		msg->msg_iovlen = i;
-		if (msg->msg_iovlen == 0) {
-			*tmp_iov = msg->msg_iov[0];
-			tmp_iov->iov_len = MIN((size_t)tmp_iov->iov_len,
-					       (size_t)mtu);
-			msg->msg_iov = tmp_iov;
-			msg->msg_iovlen = 1;
-		}
-		break;
+	rc = swrap_sendmsg_before(s,
+				  si,
+				  &msg,
+				  &tmp,
+				  &un_addr.sa.un,
+				  &to_un,
+				  &to,
+				  &bcast);
+	if (rc < 0) {
+		return -1;
 	}
-	case SOCK_DGRAM:
-		if (si->connected) {
-			if (msg->msg_name != NULL) {
-				/*
-				 * We are dealing with unix sockets and if we
-				 * are connected, we should only talk to the
-				 * connected unix path. Using the fd to send
-				 * to another server would be hard to achieve.
-				 */
-				msg->msg_name = NULL;
-				msg->msg_namelen = 0;
-			}
-		} else {
-			const struct sockaddr *msg_name;
-			msg_name = (const struct sockaddr *)msg->msg_name;
 
-			if (msg_name == NULL) {
-				errno = ENOTCONN;
-				return -1;
-			}
-
-
-			ret = sockaddr_convert_to_un(si, msg_name, msg->msg_namelen,
-						     tmp_un, 0, bcast);
-			if (ret == -1) {
-				return -1;
-			}
+	buf = msg.msg_iov[0].iov_base;
+	len = msg.msg_iov[0].iov_len;
 
-			if (to_un) {
-				*to_un = tmp_un;
-			}
-			if (to) {
-				*to = msg_name;
-			}
-			msg->msg_name = tmp_un;
-			msg->msg_namelen = sizeof(*tmp_un);
-		}
+	if (bcast) {
+/*		struct stat st; 
+		unsigned int iface;  */
+		unsigned int prt = ntohs(((const struct sockaddr_in *)(const void *)to)->sin_port); 
+		struct swrap_bcast_iter it;
 
-		if (si->bound == 0) {
-			ret = swrap_auto_bind(fd, si, si->family);
-			if (ret == -1) {
-				if (errno == ENOTSOCK) {
-					swrap_remove_stale(fd);
-					return -ENOTSOCK;
-				} else {
-					SWRAP_LOG(SWRAP_LOG_ERROR, "swrap_sendmsg_before failed");
-					return -1;
-				}
-			}
-		}
+/*
+		type = SOCKET_TYPE_CHAR_UDP;
 
-		if (!si->defer_connect) {
-			break;
-		}
+		for(iface=0; iface <= MAX_WRAPPED_INTERFACES; iface++) {
+			snprintf(un_addr.sa.un.sun_path,
+				 sizeof(un_addr.sa.un.sun_path),
+				 "%s/"SOCKET_FORMAT,
+				 socket_wrapper_dir(), type, iface, prt);
+			if (stat(un_addr.sa.un.sun_path, &st) != 0) continue;
 
-		ret = sockaddr_convert_to_un(si,
-					     &si->peername.sa.s,
-					     si->peername.sa_socklen,
-					     tmp_un,
-					     0,
-					     NULL);
-		if (ret == -1) {
-			return -1;
+			/ * ignore the any errors in broadcast sends * /
+			libc_sendto(s,
+				    buf,
+				    len,
+				    flags,
+				    &un_addr.sa.s,
+				    un_addr.sa_socklen);
 		}
+*/
 
-		ret = libc_connect(fd,
-				   (struct sockaddr *)(void *)tmp_un,
-				   sizeof(*tmp_un));
-
-		/* to give better errors */
-		if (ret == -1 && errno == ENOENT) {
-			errno = EHOSTUNREACH;
+		swrap_bcast_start(&it, prt);
+		while (swrap_bcast_next(&it, &un_addr.sa.un)) {
+			ret = libc_sendto(s,
+					  buf,
+					  len,
+					  flags,
+					  &un_addr.sa.s,
+					  un_addr.sa_socklen);
+			if (ret == -1 && errno == ECONNREFUSED) {
+				/* left behind by a killed process */
+				swrap_bcast_stale(un_addr.sa.un.sun_path);
+			}
+			SWRAP_LOG(SWRAP_LOG_DEBUG,
+				  "send bcast packet to %s",
+				  un_addr.sa.un.sun_path);
 		}
+		swrap_bcast_end(&it);
 
-		if (ret == -1) {
-			return ret;
-		}
+		swrap_pcap_dump_packet(si, to, SWRAP_SENDTO, buf, len);
+		swrap_stats_call(s, si, SWRAP_STATS_SEND, len, 0);
+		swrap_flow_send(si, to, len, 0);
 
-		si->defer_connect = 0;
-		break;
-	default:
-		errno = EHOSTUNREACH;
-		return -1;
+		return len;
 	}
 
-#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	if (msg->msg_controllen > 0 && msg->msg_control != NULL) {
-		uint8_t *cmbuf = NULL;
-		size_t cmlen = 0;
+	/*
+	 * If it is a dgram socket and we are connected, don't include the
+	 * 'to' address.
+	 */
+	if (si->ring != NULL) {
+		ret = swrap_ring_sendmsg(s, si, &msg, flags);
+	} else if (swrap_delay_lookup(si, &msg, to, &dp)) {
+		ret = swrap_delay_sendmsg(s, si, &msg, flags, &dp);
+	} else if (si->type == SOCK_DGRAM && si->connected) {
+		ret = libc_sendto(s,
+				  buf,
+				  len,
+				  flags,
+				  NULL,
+				  0);
+	} else {
+		ret = libc_sendto(s,
+				  buf,
+				  len,
+				  flags,
+				  (struct sockaddr *)msg.msg_name,
+				  msg.msg_namelen);
+	}
 
-		ret = swrap_sendmsg_filter_cmsghdr(msg, &cmbuf, &cmlen);
-		if (ret < 0) {
-			free(cmbuf);
-			return -1;
-		}
+	swrap_sendmsg_after(s, si, &msg, to, ret);
 
-		if (cmlen == 0) {
-			msg->msg_controllen = 0;
-			msg->msg_control = NULL;
-		} else if (cmlen < msg->msg_controllen && cmbuf != NULL) {
-			memcpy(msg->msg_control, cmbuf, cmlen);
-			msg->msg_controllen = cmlen;
-		}
-		free(cmbuf);
-	}
-#endif
+	return ret;
+}
 
-	return 0;
+ssize_t sendto(int s, const void *buf, size_t len, int flags,
+	       const struct sockaddr *to, socklen_t tolen)
+{
+	return SWRAP_PROF(SENDTO, swrap_sendto(s, buf, len, flags, to, tolen));
 }
 
-static void swrap_sendmsg_after(int fd,
-				struct socket_info *si,
-				struct msghdr *msg,
-				const struct sockaddr *to,
-				ssize_t ret)
+/****************************************************************************
+ *   READV
+ ***************************************************************************/
+
+static ssize_t swrap_recv(int s, void *buf, size_t len, int flags)
 {
-	int saved_errno = errno;
-	size_t i, len = 0;
-	uint8_t *buf;
-	off_t ofs = 0;
-	size_t avail = 0;
-	size_t remain;
+	struct socket_info *si;
+	struct msghdr msg;
+	struct swrap_address saddr = {
+		.sa_socklen = sizeof(struct sockaddr_storage),
+	};
+	struct iovec tmp;
+	ssize_t ret;
+	int tret;
 
-	/* to give better errors */
-	if (ret == -1) {
-		if (saved_errno == ENOENT) {
-			saved_errno = EHOSTUNREACH;
-		} else if (saved_errno == ENOTSOCK) {
-			/* If the fd is not a socket, remove it */
-			swrap_remove_stale(fd);
-		}
+	si = find_socket_info(s);
+	if (si == NULL) {
+		return libc_recv(s, buf, len, flags);
 	}
 
-	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
-		avail += msg->msg_iov[i].iov_len;
-	}
+	tmp.iov_base = buf;
+	tmp.iov_len = len;
 
-	if (ret == -1) {
-		remain = MIN(80, avail);
-	} else {
-		remain = ret;
-	}
+	ZERO_STRUCT(msg);
+	msg.msg_name = &saddr.sa.s;    /* optional address */
+	msg.msg_namelen = saddr.sa_socklen; /* size of address */
+	msg.msg_iov = &tmp;            /* scatter/gather array */
+	msg.msg_iovlen = 1;            /* # elements in msg_iov */
+#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	msg.msg_control = NULL;        /* ancillary data, see below */
+	msg.msg_controllen = 0;        /* ancillary data buffer len */
+	msg.msg_flags = 0;             /* flags on received message */
+#endif
 
-	/* we capture it as one single packet */
-	buf = (uint8_t *)malloc(remain);
-	if (!buf) {
-		/* we just not capture the packet */
-		errno = saved_errno;
-		return;
+	tret = swrap_recvmsg_before(s, si, &msg, &tmp);
+	if (tret < 0) {
+		return -1;
 	}
 
-	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
-		size_t this_time = MIN(remain, (size_t)msg->msg_iov[i].iov_len);
-		memcpy(buf + ofs,
-		       msg->msg_iov[i].iov_base,
-		       this_time);
-		ofs += this_time;
-		remain -= this_time;
-	}
-	len = ofs;
+	buf = msg.msg_iov[0].iov_base;
+	len = msg.msg_iov[0].iov_len;
 
-	switch (si->type) {
-	case SOCK_STREAM:
-		if (ret == -1) {
-			swrap_pcap_dump_packet(si, NULL, SWRAP_SEND, buf, len);
-			swrap_pcap_dump_packet(si, NULL, SWRAP_SEND_RST, NULL, 0);
-		} else {
-			swrap_pcap_dump_packet(si, NULL, SWRAP_SEND, buf, len);
-		}
-		break;
+	if (si->ring != NULL) {
+		ret = swrap_ring_recvmsg(s, si, &msg, flags);
+	} else {
+		ret = libc_recv(s, buf, len, swrap_rcvq_recv_flags(si, flags));
+		ret = swrap_rcvq_recv(si, &msg, ret, flags);
+	}
 
-	case SOCK_DGRAM:
-		if (si->connected) {
-			to = &si->peername.sa.s;
-		}
-		if (ret == -1) {
-			swrap_pcap_dump_packet(si, to, SWRAP_SENDTO, buf, len);
-			swrap_pcap_dump_packet(si, to, SWRAP_SENDTO_UNREACH, buf, len);
-		} else {
-			swrap_pcap_dump_packet(si, to, SWRAP_SENDTO, buf, len);
-		}
-		break;
+	tret = swrap_recvmsg_after(s, si, &msg, NULL, 0, ret, flags);
+	if (tret != 0) {
+		return tret;
 	}
 
-	free(buf);
-	errno = saved_errno;
+	return ret;
 }
 
-static int swrap_recvmsg_before(int fd,
-				struct socket_info *si,
-				struct msghdr *msg,
-				struct iovec *tmp_iov)
+ssize_t recv(int s, void *buf, size_t len, int flags)
 {
-	size_t i, len = 0;
+	return SWRAP_PROF(RECV, swrap_recv(s, buf, len, flags));
+}
+
+/****************************************************************************
+ *   READ
+ ***************************************************************************/
+
+static ssize_t swrap_read(int s, void *buf, size_t len)
+{
+	struct socket_info *si;
+	struct msghdr msg;
+	struct iovec tmp;
+	struct swrap_address saddr = {
+		.sa_socklen = sizeof(struct sockaddr_storage),
+	};
 	ssize_t ret;
+	int tret;
 
-	(void)fd; /* unused */
+	si = find_socket_info(s);
+	if (si == NULL) {
+		return libc_read(s, buf, len);
+	}
 
-	switch (si->type) {
-	case SOCK_STREAM: {
-		unsigned int mtu;
-		if (!si->connected) {
-			errno = ENOTCONN;
-			return -1;
-		}
+	tmp.iov_base = buf;
+	tmp.iov_len = len;
 
-		if (msg->msg_iovlen == 0) {
-			break;
-		}
+	ZERO_STRUCT(msg);
+	msg.msg_name = &saddr.sa.ss;   /* optional address */
+	msg.msg_namelen = saddr.sa_socklen; /* size of address */
+	msg.msg_iov = &tmp;            /* scatter/gather array */
+	msg.msg_iovlen = 1;            /* # elements in msg_iov */
+#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	msg.msg_control = NULL;        /* ancillary data, see below */
+	msg.msg_controllen = 0;        /* ancillary data buffer len */
+	msg.msg_flags = 0;             /* flags on received message */
+#endif
 
-		mtu = socket_wrapper_mtu();
-		for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
-			size_t nlen;
-			nlen = len + msg->msg_iov[i].iov_len;
-			if (nlen > mtu) {
-				break;
-			}
-		}
-		msg->msg_iovlen = i;
-		if (msg->msg_iovlen == 0) {
-			*tmp_iov = msg->msg_iov[0];
-			tmp_iov->iov_len = MIN((size_t)tmp_iov->iov_len,
-					       (size_t)mtu);
-			msg->msg_iov = tmp_iov;
-			msg->msg_iovlen = 1;
+	tret = swrap_recvmsg_before(s, si, &msg, &tmp);
+	if (tret < 0) {
+		if (tret == -ENOTSOCK) {
+			return libc_read(s, buf, len);
 		}
-		break;
+		return -1;
 	}
-	case SOCK_DGRAM:
-		if (msg->msg_name == NULL) {
-			errno = EINVAL;
-			return -1;
-		}
 
-		if (msg->msg_iovlen == 0) {
-			break;
-		}
+	buf = msg.msg_iov[0].iov_base;
+	len = msg.msg_iov[0].iov_len;
 
-		if (si->bound == 0) {
-			ret = swrap_auto_bind(fd, si, si->family);
-			if (ret == -1) {
-				/*
-				 * When attempting to read or write to a
-				 * descriptor, if an underlying autobind fails
-				 * because it's not a socket, stop intercepting
-				 * uses of that descriptor.
-				 */
-				if (errno == ENOTSOCK) {
-					swrap_remove_stale(fd);
-					return -ENOTSOCK;
-				} else {
-					SWRAP_LOG(SWRAP_LOG_ERROR,
-						  "swrap_recvmsg_before failed");
-					return -1;
-				}
-			}
-		}
-		break;
-	default:
-		errno = EHOSTUNREACH;
-		return -1;
+	if (si->ring != NULL) {
+		ret = swrap_ring_recvmsg(s, si, &msg, 0);
+	} else if (si->type == SOCK_DGRAM && si->rcvq != NULL) {
+		/* Like read(), but with the size of the whole datagram */
+		ret = libc_recv(s, buf, len, swrap_rcvq_recv_flags(si, 0));
+		ret = swrap_rcvq_recv(si, &msg, ret, 0);
+	} else {
+		ret = libc_read(s, buf, len);
 	}
 
-	return 0;
+	tret = swrap_recvmsg_after(s, si, &msg, NULL, 0, ret, 0);
+	if (tret != 0) {
+		return tret;
+	}
+
+	return ret;
 }
 
-static int swrap_recvmsg_after(int fd,
-			       struct socket_info *si,
-			       struct msghdr *msg,
-			       const struct sockaddr_un *un_addr,
-			       socklen_t un_addrlen,
-			       ssize_t ret)
+ssize_t read(int s, void *buf, size_t len)
 {
-	int saved_errno = errno;
-	size_t i;
-	uint8_t *buf = NULL;
-	off_t ofs = 0;
-	size_t avail = 0;
-	size_t remain;
+	return SWRAP_PROF(READ, swrap_read(s, buf, len));
+}
+
+/****************************************************************************
+ *   WRITE
+ ***************************************************************************/
+
+static ssize_t swrap_write(int s, const void *buf, size_t len)
+{
+	struct msghdr msg;
+	struct iovec tmp;
+	struct sockaddr_un un_addr;
+	struct swrap_delay_params dp;
+	ssize_t ret;
 	int rc;
+	struct socket_info *si;
 
-	/* to give better errors */
-	if (ret == -1) {
-		if (saved_errno == ENOENT) {
-			saved_errno = EHOSTUNREACH;
-		} else if (saved_errno == ENOTSOCK) {
-			/* If the fd is not a socket, remove it */
-			swrap_remove_stale(fd);
-		}
+	si = find_socket_info(s);
+	if (si == NULL) {
+		return libc_write(s, buf, len);
 	}
 
-	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
-		avail += msg->msg_iov[i].iov_len;
-	}
+	tmp.iov_base = discard_const_p(char, buf);
+	tmp.iov_len = len;
 
-	/* Convert the socket address before we leave */
-	if (si->type == SOCK_DGRAM && un_addr != NULL) {
-		rc = sockaddr_convert_from_un(si,
-					      un_addr,
-					      un_addrlen,
-					      si->family,
-					      msg->msg_name,
-					      &msg->msg_namelen);
-		if (rc == -1) {
-			goto done;
-		}
-	}
+	ZERO_STRUCT(msg);
+	msg.msg_name = NULL;           /* optional address */
+	msg.msg_namelen = 0;           /* size of address */
+	msg.msg_iov = &tmp;            /* scatter/gather array */
+	msg.msg_iovlen = 1;            /* # elements in msg_iov */
+#if HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	msg.msg_control = NULL;        /* ancillary data, see below */
+	msg.msg_controllen = 0;        /* ancillary data buffer len */
+	msg.msg_flags = 0;             /* flags on received message */
+#endif
 
-	if (avail == 0) {
-		rc = 0;
-		goto done;
+	rc = swrap_sendmsg_before(s, si, &msg, &tmp, &un_addr, NULL, NULL, NULL);
+	if (rc < 0) {
+		return -1;
 	}
 
-	if (ret == -1) {
-		remain = MIN(80, avail);
+	buf = msg.msg_iov[0].iov_base;
+	len = msg.msg_iov[0].iov_len;
+
+	if (si->ring != NULL) {
+		ret = swrap_ring_sendmsg(s, si, &msg, 0);
+	} else if (swrap_delay_lookup(si, &msg, NULL, &dp)) {
+		ret = swrap_delay_sendmsg(s, si, &msg, 0, &dp);
 	} else {
-		remain = ret;
+		ret = libc_write(s, buf, len);
 	}
 
-	/* we capture it as one single packet */
-	buf = (uint8_t *)malloc(remain);
-	if (buf == NULL) {
-		/* we just not capture the packet */
-		errno = saved_errno;
-		return -1;
-	}
+	swrap_sendmsg_after(s, si, &msg, NULL, ret);
 
-	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
-		size_t this_time = MIN(remain, (size_t)msg->msg_iov[i].iov_len);
-		memcpy(buf + ofs,
-		       msg->msg_iov[i].iov_base,
-		       this_time);
-		ofs += this_time;
-		remain -= this_time;
-	}
+	return ret;
+}
 
-	switch (si->type) {
-	case SOCK_STREAM:
-		if (ret == -1 && saved_errno != EAGAIN && saved_errno != ENOBUFS) {
-			swrap_pcap_dump_packet(si, NULL, SWRAP_RECV_RST, NULL, 0);
-		} else if (ret == 0) { /* END OF FILE */
-			swrap_pcap_dump_packet(si, NULL, SWRAP_RECV_RST, NULL, 0);
-		} else if (ret > 0) {
-			swrap_pcap_dump_packet(si, NULL, SWRAP_RECV, buf, ret);
-		}
-		break;
+ssize_t write(int s, const void *buf, size_t len)
+{
+	return SWRAP_PROF(WRITE, swrap_write(s, buf, len));
+}
 
-	case SOCK_DGRAM:
-		if (ret == -1) {
-			break;
-		}
+/****************************************************************************
+ *   SEND
+ ***************************************************************************/
 
-		if (un_addr != NULL) {
-			swrap_pcap_dump_packet(si,
-					  msg->msg_name,
-					  SWRAP_RECVFROM,
-					  buf,
-					  ret);
-		} else {
-			swrap_pcap_dump_packet(si,
-					  msg->msg_name,
-					  SWRAP_RECV,
-					  buf,
-					  ret);
-		}
+static ssize_t swrap_send(int s, const void *buf, size_t len, int flags)
+{
+	struct msghdr msg;
+	struct iovec tmp;
+	struct sockaddr_un un_addr;
+	struct swrap_delay_params dp;
+	ssize_t ret;
+	int rc;
+	struct socket_info *si = find_socket_info(s);
 
-		break;
+	if (!si) {
+		return libc_send(s, buf, len, flags);
 	}
 
-	rc = 0;
-done:
-	free(buf);
-	errno = saved_errno;
+	tmp.iov_base = discard_const_p(char, buf);
+	tmp.iov_len = len;
 
-#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	if (rc == 0 &&
-	    msg->msg_controllen > 0 &&
-	    msg->msg_control != NULL) {
-		rc = swrap_msghdr_add_socket_info(si, msg);
-		if (rc < 0) {
-			return -1;
-		}
-	}
+	ZERO_STRUCT(msg);
+	msg.msg_name = NULL;           /* optional address */
+	msg.msg_namelen = 0;           /* size of address */
+	msg.msg_iov = &tmp;            /* scatter/gather array */
+	msg.msg_iovlen = 1;            /* # elements in msg_iov */
+#if HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	msg.msg_control = NULL;        /* ancillary data, see below */
+	msg.msg_controllen = 0;        /* ancillary data buffer len */
+	msg.msg_flags = 0;             /* flags on received message */
 #endif
 
-	return rc;
+	rc = swrap_sendmsg_before(s, si, &msg, &tmp, &un_addr, NULL, NULL, NULL);
+	if (rc < 0) {
+		return -1;
+	}
+
+	buf = msg.msg_iov[0].iov_base;
+	len = msg.msg_iov[0].iov_len;
+
+	if (si->ring != NULL) {
+		ret = swrap_ring_sendmsg(s, si, &msg, flags);
+	} else if (swrap_delay_lookup(si, &msg, NULL, &dp)) {
+		ret = swrap_delay_sendmsg(s, si, &msg, flags, &dp);
+	} else {
+		ret = libc_send(s, buf, len, flags);
+	}
+
+	swrap_sendmsg_after(s, si, &msg, NULL, ret);
+
+	return ret;
+}
+
+ssize_t send(int s, const void *buf, size_t len, int flags)
+{
+	return SWRAP_PROF(SEND, swrap_send(s, buf, len, flags));
 }
 
 /****************************************************************************
- *   RECVFROM
+ *   RECVMSG
  ***************************************************************************/
 
-static ssize_t swrap_recvfrom(int s, void *buf, size_t len, int flags,
-			      struct sockaddr *from, socklen_t *fromlen)
+static ssize_t swrap_recvmsg(int s, struct msghdr *omsg, int flags)
 {
 	struct swrap_address from_addr = {
 		.sa_socklen = sizeof(struct sockaddr_un),
 	};
-	ssize_t ret;
-	struct socket_info *si = find_socket_info(s);
-	struct swrap_address saddr = {
+	struct swrap_address convert_addr = {
 		.sa_socklen = sizeof(struct sockaddr_storage),
 	};
+	struct socket_info *si;
 	struct msghdr msg;
 	struct iovec tmp;
-	int tret;
+	struct timespec ts = {
+		.tv_sec = 0,
+	};
+#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	size_t msg_ctrllen_filled;
+	size_t msg_ctrllen_left;
+#endif
 
-	if (!si) {
-		return libc_recvfrom(s,
-				     buf,
-				     len,
-				     flags,
-				     from,
-				     fromlen);
+	ssize_t ret;
+	int rc;
+
+	si = find_socket_info(s);
+	if (si == NULL) {
+		return libc_recvmsg(s, omsg, flags);
 	}
 
-	tmp.iov_base = buf;
-	tmp.iov_len = len;
+#ifdef MSG_ERRQUEUE
+	/* The unix socket has nothing in its error queue */
+	if (flags & MSG_ERRQUEUE) {
+		return swrap_tstamp_errqueue(si, omsg);
+	}
+#endif
+
+	tmp.iov_base = NULL;
+	tmp.iov_len = 0;
 
 	ZERO_STRUCT(msg);
-	if (from != NULL && fromlen != NULL) {
-		msg.msg_name = from;   /* optional address */
-		msg.msg_namelen = *fromlen; /* size of address */
-	} else {
-		msg.msg_name = &saddr.sa.s; /* optional address */
-		msg.msg_namelen = saddr.sa_socklen; /* size of address */
-	}
-	msg.msg_iov = &tmp;            /* scatter/gather array */
-	msg.msg_iovlen = 1;            /* # elements in msg_iov */
+	msg.msg_name = &from_addr.sa;              /* optional address */
+	msg.msg_namelen = from_addr.sa_socklen;    /* size of address */
+	msg.msg_iov = omsg->msg_iov;               /* scatter/gather array */
+	msg.msg_iovlen = omsg->msg_iovlen;         /* # elements in msg_iov */
 #ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	msg.msg_control = NULL;        /* ancillary data, see below */
-	msg.msg_controllen = 0;        /* ancillary data buffer len */
-	msg.msg_flags = 0;             /* flags on received message */
+	msg_ctrllen_filled = 0;
+	msg_ctrllen_left = omsg->msg_controllen;
+
+	msg.msg_control = omsg->msg_control;       /* ancillary data, see below */
+	msg.msg_controllen = omsg->msg_controllen; /* ancillary data buffer len */
+	msg.msg_flags = omsg->msg_flags;           /* flags on received message */
 #endif
 
-	tret = swrap_recvmsg_before(s, si, &msg, &tmp);
-	if (tret < 0) {
+	rc = swrap_recvmsg_before(s, si, &msg, &tmp);
+	if (rc < 0) {
 		return -1;
 	}
 
-	buf = msg.msg_iov[0].iov_base;
-	len = msg.msg_iov[0].iov_len;
+	if (si->ring != NULL) {
+		ret = swrap_ring_recvmsg(s, si, &msg, flags);
+	} else if (si->type == SOCK_DGRAM && swrap_tstamp_rx(si)) {
+		ret = swrap_tstamp_recvmsg(s,
+					   &msg,
+					   swrap_rcvq_recv_flags(si, flags),
+					   &ts);
+		ret = swrap_rcvq_recv(si, &msg, ret, flags);
+	} else {
+		ret = libc_recvmsg(s, &msg, swrap_rcvq_recv_flags(si, flags));
+		ret = swrap_rcvq_recv(si, &msg, ret, flags);
+	}
+	swrap_tstamp_recv(si, ret, &ts);
 
-	ret = libc_recvfrom(s,
-			    buf,
-			    len,
-			    flags,
-			    &from_addr.sa.s,
-			    &from_addr.sa_socklen);
-	if (ret == -1) {
-		return ret;
+#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	msg_ctrllen_filled += msg.msg_controllen;
+	msg_ctrllen_left -= msg.msg_controllen;
+
+	if (omsg->msg_control != NULL) {
+		uint8_t *p;
+
+		p = omsg->msg_control;
+		p += msg_ctrllen_filled;
+
+		msg.msg_control = p;
+		msg.msg_controllen = msg_ctrllen_left;
+	} else {
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
 	}
+#endif
 
-	tret = swrap_recvmsg_after(s,
-				   si,
-				   &msg,
-				   &from_addr.sa.un,
-				   from_addr.sa_socklen,
-				   ret);
-	if (tret != 0) {
-		return tret;
+	/*
+	 * We convert the unix address to a IP address so we need a buffer
+	 * which can store the address in case of SOCK_DGRAM, see below.
+	 */
+	msg.msg_name = &convert_addr.sa;
+	msg.msg_namelen = convert_addr.sa_socklen;
+
+	rc = swrap_recvmsg_after(s,
+				 si,
+				 &msg,
+				 &from_addr.sa.un,
+				 from_addr.sa_socklen,
+				 ret,
+				 flags);
+	if (rc != 0) {
+		return rc;
 	}
 
-	if (from != NULL && fromlen != NULL) {
-		*fromlen = msg.msg_namelen;
+#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	if (omsg->msg_control != NULL) {
+		/* msg.msg_controllen = space left */
+		msg_ctrllen_left = msg.msg_controllen;
+		msg_ctrllen_filled = omsg->msg_controllen - msg_ctrllen_left;
+	}
+
+	/* Update the original message length */
+	omsg->msg_controllen = msg_ctrllen_filled;
+	omsg->msg_flags = msg.msg_flags;
+#endif
+	omsg->msg_iovlen = msg.msg_iovlen;
+
+	/*
+	 * From the manpage:
+	 *
+	 * The  msg_name  field  points  to a caller-allocated buffer that is
+	 * used to return the source address if the socket is unconnected.  The
+	 * caller should set msg_namelen to the size of this buffer before this
+	 * call; upon return from a successful call, msg_name will contain the
+	 * length of the returned address.  If the application  does  not  need
+	 * to know the source address, msg_name can be specified as NULL.
+	 */
+	if (si->type == SOCK_STREAM) {
+		omsg->msg_namelen = 0;
+	} else if (omsg->msg_name != NULL &&
+	           omsg->msg_namelen != 0 &&
+	           omsg->msg_namelen >= msg.msg_namelen) {
+		memcpy(omsg->msg_name, msg.msg_name, msg.msg_namelen);
+		omsg->msg_namelen = msg.msg_namelen;
 	}
 
 	return ret;
 }
 
-#ifdef HAVE_ACCEPT_PSOCKLEN_T
-ssize_t recvfrom(int s, void *buf, size_t len, int flags,
-		 struct sockaddr *from, Psocklen_t fromlen)
-#else
-ssize_t recvfrom(int s, void *buf, size_t len, int flags,
-		 struct sockaddr *from, socklen_t *fromlen)
-#endif
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
 {
-	return swrap_recvfrom(s, buf, len, flags, from, (socklen_t *)fromlen);
+	return SWRAP_PROF(RECVMSG, swrap_recvmsg(sockfd, msg, flags));
 }
 
 /****************************************************************************
- *   SENDTO
+ *   SENDMSG
  ***************************************************************************/
 
-static ssize_t swrap_sendto(int s, const void *buf, size_t len, int flags,
-			    const struct sockaddr *to, socklen_t tolen)
+static ssize_t swrap_sendmsg(int s, const struct msghdr *omsg, int flags)
 {
 	struct msghdr msg;
 	struct iovec tmp;
-	struct swrap_address un_addr = {
-		.sa_socklen = sizeof(struct sockaddr_un),
-	};
+	struct sockaddr_un un_addr;
 	const struct sockaddr_un *to_un = NULL;
+	const struct sockaddr *to = NULL;
+	struct swrap_delay_params dp;
 	ssize_t ret;
 	int rc;
 	struct socket_info *si = find_socket_info(s);
 	int bcast = 0;
 
 	if (!si) {
-		return libc_sendto(s, buf, len, flags, to, tolen);
+		return libc_sendmsg(s, omsg, flags);
 	}
 
-	tmp.iov_base = discard_const_p(char, buf);
-	tmp.iov_len = len;
+	ZERO_STRUCT(un_addr);
+
+	tmp.iov_base = NULL;
+	tmp.iov_len = 0;
 
 	ZERO_STRUCT(msg);
-	msg.msg_name = discard_const_p(struct sockaddr, to); /* optional address */
-	msg.msg_namelen = tolen;       /* size of address */
-	msg.msg_iov = &tmp;            /* scatter/gather array */
-	msg.msg_iovlen = 1;            /* # elements in msg_iov */
-#if HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	msg.msg_control = NULL;        /* ancillary data, see below */
-	msg.msg_controllen = 0;        /* ancillary data buffer len */
-	msg.msg_flags = 0;             /* flags on received message */
+
+	if (si->connected == 0) {
+		msg.msg_name = omsg->msg_name;             /* optional address */
+		msg.msg_namelen = omsg->msg_namelen;       /* size of address */
+	}
+	msg.msg_iov = omsg->msg_iov;               /* scatter/gather array */
+	msg.msg_iovlen = omsg->msg_iovlen;         /* # elements in msg_iov */
+#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	if (msg.msg_controllen > 0 && msg.msg_control != NULL) {
+		/* omsg is a const so use a local buffer for modifications */
+		uint8_t cmbuf[omsg->msg_controllen];
+
+		memcpy(cmbuf, omsg->msg_control, omsg->msg_controllen);
+
+		msg.msg_control = cmbuf;       /* ancillary data, see below */
+		msg.msg_controllen = omsg->msg_controllen; /* ancillary data buffer len */
+	}
+	msg.msg_flags = omsg->msg_flags;           /* flags on received message */
 #endif
 
-	rc = swrap_sendmsg_before(s,
-				  si,
-				  &msg,
-				  &tmp,
-				  &un_addr.sa.un,
-				  &to_un,
-				  &to,
-				  &bcast);
+	rc = swrap_sendmsg_before(s, si, &msg, &tmp, &un_addr, &to_un, &to, &bcast);
 	if (rc < 0) {
 		return -1;
 	}
 
-	buf = msg.msg_iov[0].iov_base;
-	len = msg.msg_iov[0].iov_len;
-
 	if (bcast) {
-/*		struct stat st; 
-		unsigned int iface;  */
-		unsigned int prt = ntohs(((const struct sockaddr_in *)(const void *)to)->sin_port); 
-		unsigned int remote_prt;
-		unsigned int in4_addr;
-		char type;
-		DIR *d;
-		struct dirent *dir;
+//		struct stat st;
+//		unsigned int iface;
+		unsigned int prt = ntohs(((const struct sockaddr_in *)(const void *)to)->sin_port);
+		size_t i, len = 0;
+		uint8_t *buf;
+		off_t ofs = 0;
+		size_t avail = 0;
+		size_t remain;
+		struct swrap_bcast_iter it;
 
-/*
+
+		for (i = 0; i < (size_t)msg.msg_iovlen; i++) {
+			avail += msg.msg_iov[i].iov_len;
+		}
+
+		len = avail;
+		remain = avail;
+
+		/* we capture it as one single packet */
+		buf = (uint8_t *)malloc(remain);
+		if (!buf) {
+			return -1;
+		}
+
+		for (i = 0; i < (size_t)msg.msg_iovlen; i++) {
+			size_t this_time = MIN(remain, (size_t)msg.msg_iov[i].iov_len);
+			memcpy(buf + ofs,
+			       msg.msg_iov[i].iov_base,
+			       this_time);
+			ofs += this_time;
+			remain -= this_time;
+		}
+		
+		/*
 		type = SOCKET_TYPE_CHAR_UDP;
 
 		for(iface=0; iface <= MAX_WRAPPED_INTERFACES; iface++) {
-			snprintf(un_addr.sa.un.sun_path,
-				 sizeof(un_addr.sa.un.sun_path),
-				 "%s/"SOCKET_FORMAT,
+			snprintf(un_addr.sun_path, sizeof(un_addr.sun_path), "%s/"SOCKET_FORMAT,
 				 socket_wrapper_dir(), type, iface, prt);
-			if (stat(un_addr.sa.un.sun_path, &st) != 0) continue;
+			if (stat(un_addr.sun_path, &st) != 0) continue;
+
+			msg.msg_name = &un_addr;           / * optional address * /
+			msg.msg_namelen = sizeof(un_addr); / * size of address * /
 
 			/ * ignore the any errors in broadcast sends * /
-			libc_sendto(s,
-				    buf,
-				    len,
-				    flags,
-				    &un_addr.sa.s,
-				    un_addr.sa_socklen);
+			libc_sendmsg(s, &msg, flags);
 		}
-*/
+		*/
 
-		d = opendir(socket_wrapper_dir());
-		if (d) {
-			while ((dir = readdir(d)) != NULL) {
-				if (dir->d_name[0] == SOCKET_TYPE_CHAR_UDP_LONG)
-					/* TODO - use S_ISSOCK ? */
-					if (sscanf(dir->d_name, SOCKET_FORMAT_LONG, &type, &in4_addr, &remote_prt) == 3) 
-						if (prt == remote_prt) {
-							snprintf(un_addr.sa.un.sun_path,
-								sizeof(un_addr.sa.un.sun_path),
-								"%s/%s",
-								socket_wrapper_dir(),dir->d_name);
-							libc_sendto(s,
-								buf,
-						    		len,
-						    		flags,
-						    		&un_addr.sa.s,
-						    		un_addr.sa_socklen);
-							SWRAP_LOG(SWRAP_LOG_DEBUG,"send bcast packet to %s", dir->d_name);
-						}
+
+		swrap_bcast_start(&it, prt);
+		while (swrap_bcast_next(&it, &un_addr)) {
+			ret = libc_sendmsg(s, &msg, flags);
+			if (ret == -1 && errno == ECONNREFUSED) {
+				/* left behind by a killed process */
+				swrap_bcast_stale(un_addr.sun_path);
 			}
-			closedir(d);
+			SWRAP_LOG(SWRAP_LOG_DEBUG,
+				  "send bcast packet to %s",
+				  un_addr.sun_path);
 		}
+		swrap_bcast_end(&it);
 
 		swrap_pcap_dump_packet(si, to, SWRAP_SENDTO, buf, len);
+		swrap_stats_call(s, si, SWRAP_STATS_SEND, len, 0);
+		swrap_flow_send(si, to, len, 0);
+		free(buf);
 
 		return len;
 	}
 
-	/*
-	 * If it is a dgram socket and we are connected, don't include the
-	 * 'to' address.
-	 */
-	if (si->type == SOCK_DGRAM && si->connected) {
-		ret = libc_sendto(s,
-				  buf,
-				  len,
-				  flags,
-				  NULL,
-				  0);
+	if (si->ring != NULL) {
+		ret = swrap_ring_sendmsg(s, si, &msg, flags);
+	} else if (swrap_delay_lookup(si, &msg, to, &dp)) {
+		ret = swrap_delay_sendmsg(s, si, &msg, flags, &dp);
 	} else {
-		ret = libc_sendto(s,
-				  buf,
-				  len,
-				  flags,
-				  (struct sockaddr *)msg.msg_name,
-				  msg.msg_namelen);
+		ret = libc_sendmsg(s, &msg, flags);
 	}
 
 	swrap_sendmsg_after(s, si, &msg, to, ret);
@@ -4972,608 +15503,909 @@ static ssize_t swrap_sendto(int s, const void *buf, size_t len, int flags,
 	return ret;
 }
 
-ssize_t sendto(int s, const void *buf, size_t len, int flags,
-	       const struct sockaddr *to, socklen_t tolen)
+ssize_t sendmsg(int s, const struct msghdr *omsg, int flags)
 {
-	return swrap_sendto(s, buf, len, flags, to, tolen);
+	return SWRAP_PROF(SENDMSG, swrap_sendmsg(s, omsg, flags));
 }
 
 /****************************************************************************
  *   READV
  ***************************************************************************/
 
-static ssize_t swrap_recv(int s, void *buf, size_t len, int flags)
+static ssize_t swrap_readv(int s, const struct iovec *vector, int count)
 {
 	struct socket_info *si;
 	struct msghdr msg;
+	struct iovec tmp;
 	struct swrap_address saddr = {
-		.sa_socklen = sizeof(struct sockaddr_storage),
+		.sa_socklen = sizeof(struct sockaddr_storage)
 	};
-	struct iovec tmp;
 	ssize_t ret;
-	int tret;
+	int rc;
 
 	si = find_socket_info(s);
 	if (si == NULL) {
-		return libc_recv(s, buf, len, flags);
+		return libc_readv(s, vector, count);
 	}
 
-	tmp.iov_base = buf;
-	tmp.iov_len = len;
+	tmp.iov_base = NULL;
+	tmp.iov_len = 0;
 
 	ZERO_STRUCT(msg);
-	msg.msg_name = &saddr.sa.s;    /* optional address */
-	msg.msg_namelen = saddr.sa_socklen; /* size of address */
-	msg.msg_iov = &tmp;            /* scatter/gather array */
-	msg.msg_iovlen = 1;            /* # elements in msg_iov */
+	msg.msg_name = &saddr.sa.s; /* optional address */
+	msg.msg_namelen = saddr.sa_socklen;      /* size of address */
+	msg.msg_iov = discard_const_p(struct iovec, vector); /* scatter/gather array */
+	msg.msg_iovlen = count;        /* # elements in msg_iov */
 #ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
 	msg.msg_control = NULL;        /* ancillary data, see below */
 	msg.msg_controllen = 0;        /* ancillary data buffer len */
 	msg.msg_flags = 0;             /* flags on received message */
 #endif
 
-	tret = swrap_recvmsg_before(s, si, &msg, &tmp);
-	if (tret < 0) {
+	rc = swrap_recvmsg_before(s, si, &msg, &tmp);
+	if (rc < 0) {
+		if (rc == -ENOTSOCK) {
+			return libc_readv(s, vector, count);
+		}
 		return -1;
 	}
 
-	buf = msg.msg_iov[0].iov_base;
-	len = msg.msg_iov[0].iov_len;
-
-	ret = libc_recv(s, buf, len, flags);
+	if (si->ring != NULL) {
+		ret = swrap_ring_recvmsg(s, si, &msg, 0);
+	} else if (si->type == SOCK_DGRAM && si->rcvq != NULL) {
+		/* Like readv(), but with the size of the whole datagram */
+		ret = libc_recvmsg(s, &msg, swrap_rcvq_recv_flags(si, 0));
+		ret = swrap_rcvq_recv(si, &msg, ret, 0);
+	} else {
+		ret = libc_readv(s, msg.msg_iov, msg.msg_iovlen);
+	}
 
-	tret = swrap_recvmsg_after(s, si, &msg, NULL, 0, ret);
-	if (tret != 0) {
-		return tret;
+	rc = swrap_recvmsg_after(s, si, &msg, NULL, 0, ret, 0);
+	if (rc != 0) {
+		return rc;
 	}
 
 	return ret;
 }
 
-ssize_t recv(int s, void *buf, size_t len, int flags)
+ssize_t readv(int s, const struct iovec *vector, int count)
 {
-	return swrap_recv(s, buf, len, flags);
+	return SWRAP_PROF(READV, swrap_readv(s, vector, count));
 }
 
 /****************************************************************************
- *   READ
+ *   WRITEV
  ***************************************************************************/
 
-static ssize_t swrap_read(int s, void *buf, size_t len)
+static ssize_t swrap_writev(int s, const struct iovec *vector, int count)
 {
-	struct socket_info *si;
 	struct msghdr msg;
 	struct iovec tmp;
-	struct swrap_address saddr = {
-		.sa_socklen = sizeof(struct sockaddr_storage),
-	};
+	struct sockaddr_un un_addr;
+	struct swrap_delay_params dp;
 	ssize_t ret;
-	int tret;
+	int rc;
+	struct socket_info *si = find_socket_info(s);
 
-	si = find_socket_info(s);
-	if (si == NULL) {
-		return libc_read(s, buf, len);
+	if (!si) {
+		return libc_writev(s, vector, count);
 	}
 
-	tmp.iov_base = buf;
-	tmp.iov_len = len;
+	tmp.iov_base = NULL;
+	tmp.iov_len = 0;
 
 	ZERO_STRUCT(msg);
-	msg.msg_name = &saddr.sa.ss;   /* optional address */
-	msg.msg_namelen = saddr.sa_socklen; /* size of address */
-	msg.msg_iov = &tmp;            /* scatter/gather array */
-	msg.msg_iovlen = 1;            /* # elements in msg_iov */
-#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
+	msg.msg_name = NULL;           /* optional address */
+	msg.msg_namelen = 0;           /* size of address */
+	msg.msg_iov = discard_const_p(struct iovec, vector); /* scatter/gather array */
+	msg.msg_iovlen = count;        /* # elements in msg_iov */
+#if HAVE_STRUCT_MSGHDR_MSG_CONTROL
 	msg.msg_control = NULL;        /* ancillary data, see below */
 	msg.msg_controllen = 0;        /* ancillary data buffer len */
 	msg.msg_flags = 0;             /* flags on received message */
 #endif
 
-	tret = swrap_recvmsg_before(s, si, &msg, &tmp);
-	if (tret < 0) {
-		if (tret == -ENOTSOCK) {
-			return libc_read(s, buf, len);
+	rc = swrap_sendmsg_before(s, si, &msg, &tmp, &un_addr, NULL, NULL, NULL);
+	if (rc < 0) {
+		if (rc == -ENOTSOCK) {
+			return libc_readv(s, vector, count);
 		}
 		return -1;
 	}
 
-	buf = msg.msg_iov[0].iov_base;
-	len = msg.msg_iov[0].iov_len;
+	if (si->ring != NULL) {
+		ret = swrap_ring_sendmsg(s, si, &msg, 0);
+	} else if (swrap_delay_lookup(si, &msg, NULL, &dp)) {
+		ret = swrap_delay_sendmsg(s, si, &msg, 0, &dp);
+	} else {
+		ret = libc_writev(s, msg.msg_iov, msg.msg_iovlen);
+	}
+
+	swrap_sendmsg_after(s, si, &msg, NULL, ret);
+
+	return ret;
+}
+
+ssize_t writev(int s, const struct iovec *vector, int count)
+{
+	return SWRAP_PROF(WRITEV, swrap_writev(s, vector, count));
+}
+
+/****************************************************************************
+ *   SENDFILE
+ ***************************************************************************/
+
+#if defined(HAVE_SENDFILE) || defined(HAVE_SPLICE)
+/*
+ * The zero-copy calls hand the payload to the kernel directly, so it never
+ * passes through swrap_sendmsg_after(). If we capture, read the transmitted
+ * range back from the source in MTU sized chunks. This is a bounded side
+ * read which never touches the file position of the caller.
+ */
+static void swrap_pcap_dump_fd_range(struct socket_info *si,
+				     int in_fd,
+				     off_t offset,
+				     size_t len,
+				     bool use_pread)
+{
+	const struct sockaddr *to = NULL;
+	enum swrap_packet_type type = SWRAP_SEND;
+	size_t mtu = socket_wrapper_mtu();
+	uint8_t *buf;
+
+	if (si->type == SOCK_DGRAM) {
+		to = &si->peername.sa.s;
+		type = SWRAP_SENDTO;
+	}
+
+	buf = (uint8_t *)malloc(mtu);
+	if (buf == NULL) {
+		/* we just not capture the packet */
+		return;
+	}
+
+	while (len > 0) {
+		size_t this_time = MIN(len, mtu);
+		ssize_t nread;
+
+		if (use_pread) {
+			nread = pread(in_fd, buf, this_time, offset);
+		} else {
+			nread = libc_read(in_fd, buf, this_time);
+		}
+		if (nread <= 0) {
+			break;
+		}
+
+		swrap_pcap_dump_packet(si, to, type, buf, nread);
+
+		offset += nread;
+		len -= nread;
+	}
+
+	free(buf);
+}
+
+static void swrap_pcap_dump_fd_error(struct socket_info *si, int err)
+{
+	if (err == EAGAIN || err == EINTR) {
+		return;
+	}
+
+	switch (si->type) {
+	case SOCK_STREAM:
+		swrap_pcap_dump_packet(si, NULL, SWRAP_SEND_RST, NULL, 0);
+		break;
+	case SOCK_DGRAM:
+		swrap_pcap_dump_packet(si,
+				       &si->peername.sa.s,
+				       SWRAP_SENDTO_UNREACH,
+				       NULL,
+				       0);
+		break;
+	}
+}
 
-	ret = libc_read(s, buf, len);
+/*
+ * Run the same checks as for a write(): the socket needs to be connected, a
+ * datagram socket might need to be bound or its deferred connect done.
+ */
+static int swrap_sendfile_before(int fd, struct socket_info *si)
+{
+	struct msghdr msg;
+	struct iovec tmp;
+	struct sockaddr_un un_addr;
 
-	tret = swrap_recvmsg_after(s, si, &msg, NULL, 0, ret);
-	if (tret != 0) {
-		return tret;
-	}
+	ZERO_STRUCT(msg);
+	tmp.iov_base = NULL;
+	tmp.iov_len = 0;
 
-	return ret;
+	return swrap_sendmsg_before(fd, si, &msg, &tmp, &un_addr, NULL, NULL, NULL);
 }
 
-ssize_t read(int s, void *buf, size_t len)
+/*
+ * If the data can't go to the unix socket directly: a socket using the shm
+ * ring has no kernel buffer to put it in. A link with latency or a rate
+ * holds it back in the delay queue, or it would get ahead of what is
+ * queued there, and a datagram might get lost or charged to the receive
+ * queue of the peer.
+ */
+static bool swrap_send_fd_bounce(struct socket_info *si)
 {
-	return swrap_read(s, buf, len);
-}
+	unsigned int flags = swrap_link_flags();
 
-/****************************************************************************
- *   WRITE
- ***************************************************************************/
+	if (si->ring != NULL) {
+		return true;
+	}
 
-static ssize_t swrap_write(int s, const void *buf, size_t len)
+	flags &= ~(SWRAP_LINK_FAULT | SWRAP_LINK_ACL);
+	if (si->type != SOCK_DGRAM) {
+		return (flags & ~SWRAP_LINK_IMPAIR) != 0;
+	}
+
+	return flags != 0 ||
+	       swrap_partition_get() != NULL ||
+	       swrap_rcvq_get() != NULL;
+}
+
+/*
+ * Copy the data through a bounce buffer, at most a ring worth for the shm
+ * ring, a segment of the MTU for a stream or the whole datagram otherwise.
+ * Only read what can be sent, a non-blocking call must not lose the data.
+ */
+static ssize_t swrap_send_fd(int out_fd,
+			     struct socket_info *si,
+			     int in_fd,
+			     off_t *offset,
+			     size_t count,
+			     bool nonblock)
 {
+	struct swrap_ring_conn *rc = si->ring;
+	struct swrap_delay_params dp;
 	struct msghdr msg;
-	struct iovec tmp;
-	struct sockaddr_un un_addr;
+	struct iovec iov;
+	ssize_t nread;
 	ssize_t ret;
-	int rc;
-	struct socket_info *si;
+	uint8_t *buf;
+	size_t len;
+
+	nonblock = nonblock || swrap_fault_nonblock(out_fd);
+	if (rc != NULL) {
+		len = MIN(count, rc->size);
+		if (nonblock) {
+			len = MIN(len, rc->size - __atomic_load_n(
+						&rc->tx->count,
+						__ATOMIC_ACQUIRE));
+		}
+	} else if (si->type == SOCK_STREAM) {
+		len = MIN(count, socket_wrapper_mtu());
+	} else {
+		len = MIN(count, SWRAP_DELAY_QUEUE_MAX);
+	}
+	if (nonblock && (len == 0 || !swrap_delay_room(si, len))) {
+		errno = EAGAIN;
+		return -1;
+	}
 
-	si = find_socket_info(s);
-	if (si == NULL) {
-		return libc_write(s, buf, len);
+	buf = (uint8_t *)malloc(MAX(len, 1));
+	if (buf == NULL) {
+		errno = ENOMEM;
+		return -1;
 	}
 
-	tmp.iov_base = discard_const_p(char, buf);
-	tmp.iov_len = len;
+	if (offset != NULL) {
+		nread = pread(in_fd, buf, len, *offset);
+	} else {
+		nread = libc_read(in_fd, buf, len);
+	}
+	if (nread <= 0) {
+		free(buf);
+		return nread;
+	}
 
 	ZERO_STRUCT(msg);
-	msg.msg_name = NULL;           /* optional address */
-	msg.msg_namelen = 0;           /* size of address */
-	msg.msg_iov = &tmp;            /* scatter/gather array */
-	msg.msg_iovlen = 1;            /* # elements in msg_iov */
-#if HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	msg.msg_control = NULL;        /* ancillary data, see below */
-	msg.msg_controllen = 0;        /* ancillary data buffer len */
-	msg.msg_flags = 0;             /* flags on received message */
-#endif
-
-	rc = swrap_sendmsg_before(s, si, &msg, &tmp, &un_addr, NULL, NULL, NULL);
-	if (rc < 0) {
-		return -1;
+	iov.iov_base = buf;
+	iov.iov_len = nread;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (rc != NULL) {
+		ret = swrap_ring_sendmsg(out_fd,
+					 si,
+					 &msg,
+					 nonblock ? MSG_DONTWAIT : 0);
+	} else if (swrap_delay_lookup(si, &msg, NULL, &dp)) {
+		ret = swrap_delay_sendmsg(out_fd,
+					  si,
+					  &msg,
+					  nonblock ? MSG_DONTWAIT : 0,
+					  &dp);
+	} else {
+		ret = libc_send(out_fd,
+				buf,
+				nread,
+				nonblock ? MSG_DONTWAIT : 0);
 	}
 
-	buf = msg.msg_iov[0].iov_base;
-	len = msg.msg_iov[0].iov_len;
+	if (ret > 0 && offset != NULL) {
+		*offset += ret;
+	} else if (ret < nread && offset == NULL) {
+		int saved_errno = errno;
 
-	ret = libc_write(s, buf, len);
+		/* Give back what didn't go out, unless it came from a pipe */
+		lseek(in_fd, MAX(ret, 0) - nread, SEEK_CUR);
+		errno = saved_errno;
+	}
 
-	swrap_sendmsg_after(s, si, &msg, NULL, ret);
+	swrap_sendmsg_after(out_fd, si, &msg, NULL, ret);
+	free(buf);
 
 	return ret;
 }
+#endif /* HAVE_SENDFILE || HAVE_SPLICE */
 
-ssize_t write(int s, const void *buf, size_t len)
-{
-	return swrap_write(s, buf, len);
-}
-
-/****************************************************************************
- *   SEND
- ***************************************************************************/
-
-static ssize_t swrap_send(int s, const void *buf, size_t len, int flags)
+#ifdef HAVE_SENDFILE
+static ssize_t swrap_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
 {
-	struct msghdr msg;
-	struct iovec tmp;
-	struct sockaddr_un un_addr;
+	struct socket_info *si;
+	off_t start;
 	ssize_t ret;
 	int rc;
-	struct socket_info *si = find_socket_info(s);
 
-	if (!si) {
-		return libc_send(s, buf, len, flags);
+	si = find_socket_info(out_fd);
+	if (si == NULL) {
+		return libc_sendfile(out_fd, in_fd, offset, count);
 	}
 
-	tmp.iov_base = discard_const_p(char, buf);
-	tmp.iov_len = len;
-
-	ZERO_STRUCT(msg);
-	msg.msg_name = NULL;           /* optional address */
-	msg.msg_namelen = 0;           /* size of address */
-	msg.msg_iov = &tmp;            /* scatter/gather array */
-	msg.msg_iovlen = 1;            /* # elements in msg_iov */
-#if HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	msg.msg_control = NULL;        /* ancillary data, see below */
-	msg.msg_controllen = 0;        /* ancillary data buffer len */
-	msg.msg_flags = 0;             /* flags on received message */
-#endif
-
-	rc = swrap_sendmsg_before(s, si, &msg, &tmp, &un_addr, NULL, NULL, NULL);
+	rc = swrap_sendfile_before(out_fd, si);
 	if (rc < 0) {
+		if (rc == -ENOTSOCK) {
+			return libc_sendfile(out_fd, in_fd, offset, count);
+		}
 		return -1;
 	}
 
-	buf = msg.msg_iov[0].iov_base;
-	len = msg.msg_iov[0].iov_len;
+	if (swrap_send_fd_bounce(si)) {
+		return swrap_send_fd(out_fd, si, in_fd, offset, count, false);
+	}
+
+	/* Nothing to capture, so keep the zero-copy path */
+	if (swrap_pcap_init_file() == NULL) {
+		ret = libc_sendfile(out_fd, in_fd, offset, count);
+		errno = swrap_sendmsg_count(out_fd, si, NULL, ret);
+		return ret;
+	}
 
-	ret = libc_send(s, buf, len, flags);
+	if (offset != NULL) {
+		start = *offset;
+	} else {
+		start = lseek(in_fd, 0, SEEK_CUR);
+	}
 
-	swrap_sendmsg_after(s, si, &msg, NULL, ret);
+	ret = libc_sendfile(out_fd, in_fd, offset, count);
+	errno = swrap_sendmsg_count(out_fd, si, NULL, ret);
+	if (ret == -1) {
+		int saved_errno = errno;
+
+		swrap_pcap_dump_fd_error(si, saved_errno);
+		errno = saved_errno;
+	} else if (ret > 0 && start != -1) {
+		swrap_pcap_dump_fd_range(si, in_fd, start, ret, true);
+	}
 
 	return ret;
 }
 
-ssize_t send(int s, const void *buf, size_t len, int flags)
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
 {
-	return swrap_send(s, buf, len, flags);
+	return swrap_sendfile(out_fd, in_fd, offset, count);
 }
+#endif /* HAVE_SENDFILE */
 
-/****************************************************************************
- *   RECVMSG
- ***************************************************************************/
-
-static ssize_t swrap_recvmsg(int s, struct msghdr *omsg, int flags)
+#if defined(HAVE_SENDFILE64) && !defined(__USE_FILE_OFFSET64)
+static ssize_t swrap_sendfile64(int out_fd,
+				int in_fd,
+				off64_t *offset,
+				size_t count)
 {
-	struct swrap_address from_addr = {
-		.sa_socklen = sizeof(struct sockaddr_un),
-	};
-	struct swrap_address convert_addr = {
-		.sa_socklen = sizeof(struct sockaddr_storage),
-	};
 	struct socket_info *si;
-	struct msghdr msg;
-	struct iovec tmp;
-#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	size_t msg_ctrllen_filled;
-	size_t msg_ctrllen_left;
-#endif
-
+	off64_t start;
 	ssize_t ret;
 	int rc;
 
-	si = find_socket_info(s);
+	si = find_socket_info(out_fd);
 	if (si == NULL) {
-		return libc_recvmsg(s, omsg, flags);
+		return libc_sendfile64(out_fd, in_fd, offset, count);
 	}
 
-	tmp.iov_base = NULL;
-	tmp.iov_len = 0;
-
-	ZERO_STRUCT(msg);
-	msg.msg_name = &from_addr.sa;              /* optional address */
-	msg.msg_namelen = from_addr.sa_socklen;    /* size of address */
-	msg.msg_iov = omsg->msg_iov;               /* scatter/gather array */
-	msg.msg_iovlen = omsg->msg_iovlen;         /* # elements in msg_iov */
-#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	msg_ctrllen_filled = 0;
-	msg_ctrllen_left = omsg->msg_controllen;
-
-	msg.msg_control = omsg->msg_control;       /* ancillary data, see below */
-	msg.msg_controllen = omsg->msg_controllen; /* ancillary data buffer len */
-	msg.msg_flags = omsg->msg_flags;           /* flags on received message */
-#endif
-
-	rc = swrap_recvmsg_before(s, si, &msg, &tmp);
+	rc = swrap_sendfile_before(out_fd, si);
 	if (rc < 0) {
+		if (rc == -ENOTSOCK) {
+			return libc_sendfile64(out_fd, in_fd, offset, count);
+		}
 		return -1;
 	}
 
-	ret = libc_recvmsg(s, &msg, flags);
-
-#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	msg_ctrllen_filled += msg.msg_controllen;
-	msg_ctrllen_left -= msg.msg_controllen;
+	if (swrap_send_fd_bounce(si)) {
+		off_t ofs;
 
-	if (omsg->msg_control != NULL) {
-		uint8_t *p;
+		if (offset == NULL) {
+			return swrap_send_fd(out_fd,
+					     si,
+					     in_fd,
+					     NULL,
+					     count,
+					     false);
+		}
 
-		p = omsg->msg_control;
-		p += msg_ctrllen_filled;
+		ofs = *offset;
+		ret = swrap_send_fd(out_fd, si, in_fd, &ofs, count, false);
+		*offset = ofs;
 
-		msg.msg_control = p;
-		msg.msg_controllen = msg_ctrllen_left;
-	} else {
-		msg.msg_control = NULL;
-		msg.msg_controllen = 0;
+		return ret;
 	}
-#endif
-
-	/*
-	 * We convert the unix address to a IP address so we need a buffer
-	 * which can store the address in case of SOCK_DGRAM, see below.
-	 */
-	msg.msg_name = &convert_addr.sa;
-	msg.msg_namelen = convert_addr.sa_socklen;
 
-	rc = swrap_recvmsg_after(s,
-				 si,
-				 &msg,
-				 &from_addr.sa.un,
-				 from_addr.sa_socklen,
-				 ret);
-	if (rc != 0) {
-		return rc;
+	/* Nothing to capture, so keep the zero-copy path */
+	if (swrap_pcap_init_file() == NULL) {
+		ret = libc_sendfile64(out_fd, in_fd, offset, count);
+		errno = swrap_sendmsg_count(out_fd, si, NULL, ret);
+		return ret;
 	}
 
-#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	if (omsg->msg_control != NULL) {
-		/* msg.msg_controllen = space left */
-		msg_ctrllen_left = msg.msg_controllen;
-		msg_ctrllen_filled = omsg->msg_controllen - msg_ctrllen_left;
+	if (offset != NULL) {
+		start = *offset;
+	} else {
+		start = lseek64(in_fd, 0, SEEK_CUR);
 	}
 
-	/* Update the original message length */
-	omsg->msg_controllen = msg_ctrllen_filled;
-	omsg->msg_flags = msg.msg_flags;
-#endif
-	omsg->msg_iovlen = msg.msg_iovlen;
+	ret = libc_sendfile64(out_fd, in_fd, offset, count);
+	errno = swrap_sendmsg_count(out_fd, si, NULL, ret);
+	if (ret == -1) {
+		int saved_errno = errno;
 
-	/*
-	 * From the manpage:
-	 *
-	 * The  msg_name  field  points  to a caller-allocated buffer that is
-	 * used to return the source address if the socket is unconnected.  The
-	 * caller should set msg_namelen to the size of this buffer before this
-	 * call; upon return from a successful call, msg_name will contain the
-	 * length of the returned address.  If the application  does  not  need
-	 * to know the source address, msg_name can be specified as NULL.
-	 */
-	if (si->type == SOCK_STREAM) {
-		omsg->msg_namelen = 0;
-	} else if (omsg->msg_name != NULL &&
-	           omsg->msg_namelen != 0 &&
-	           omsg->msg_namelen >= msg.msg_namelen) {
-		memcpy(omsg->msg_name, msg.msg_name, msg.msg_namelen);
-		omsg->msg_namelen = msg.msg_namelen;
+		swrap_pcap_dump_fd_error(si, saved_errno);
+		errno = saved_errno;
+	} else if (ret > 0 && start != -1) {
+		swrap_pcap_dump_fd_range(si, in_fd, start, ret, true);
 	}
 
 	return ret;
 }
 
-ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
+ssize_t sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count)
 {
-	return swrap_recvmsg(sockfd, msg, flags);
+	return swrap_sendfile64(out_fd, in_fd, offset, count);
 }
+#endif /* HAVE_SENDFILE64 */
 
 /****************************************************************************
- *   SENDMSG
+ *   SPLICE
  ***************************************************************************/
 
-static ssize_t swrap_sendmsg(int s, const struct msghdr *omsg, int flags)
+#ifdef HAVE_SPLICE
+#ifdef HAVE_TEE
+/*
+ * splice() to a socket always reads from a pipe. To capture the payload we
+ * duplicate the pipe content with tee() into a private pipe first and only
+ * splice what we were able to duplicate. The private pipe is bounded by the
+ * pipe capacity, so this never buffers more than a pipe worth of data.
+ */
+static ssize_t swrap_splice_capture(struct socket_info *si,
+				    int fd_in,
+				    loff_t *off_in,
+				    int fd_out,
+				    loff_t *off_out,
+				    size_t len,
+				    unsigned int flags)
 {
-	struct msghdr msg;
-	struct iovec tmp;
-	struct sockaddr_un un_addr;
-	const struct sockaddr_un *to_un = NULL;
-	const struct sockaddr *to = NULL;
+	int side[2];
+	ssize_t teed;
 	ssize_t ret;
 	int rc;
-	struct socket_info *si = find_socket_info(s);
-	int bcast = 0;
 
-	if (!si) {
-		return libc_sendmsg(s, omsg, flags);
+	rc = libc_pipe(side);
+	if (rc == -1) {
+		return libc_splice(fd_in, off_in, fd_out, off_out, len, flags);
+	}
+
+	teed = libc_tee(fd_in, side[1], len, flags & SPLICE_F_NONBLOCK);
+	if (teed == -1) {
+		int saved_errno = errno;
+
+		libc_close(side[0]);
+		libc_close(side[1]);
+
+		if (saved_errno != EINVAL) {
+			errno = saved_errno;
+			return -1;
+		}
+
+		/* The input is not a pipe, the kernel will tell the caller */
+		return libc_splice(fd_in, off_in, fd_out, off_out, len, flags);
+	}
+
+	if (teed > 0) {
+		len = MIN(len, (size_t)teed);
+	}
+
+	ret = libc_splice(fd_in, off_in, fd_out, off_out, len, flags);
+	if (ret == -1) {
+		int saved_errno = errno;
+
+		swrap_pcap_dump_fd_error(si, saved_errno);
+		errno = saved_errno;
+	} else if (ret > 0) {
+		swrap_pcap_dump_fd_range(si, side[0], 0, MIN(ret, teed), false);
 	}
 
-	ZERO_STRUCT(un_addr);
+	libc_close(side[0]);
+	libc_close(side[1]);
 
-	tmp.iov_base = NULL;
-	tmp.iov_len = 0;
+	return ret;
+}
+#endif /* HAVE_TEE */
 
-	ZERO_STRUCT(msg);
+/*
+ * Move data from the shm ring into a pipe. Peek first and only consume
+ * what the pipe took.
+ */
+static ssize_t swrap_ring_splice_out(int fd_in,
+				     struct socket_info *si,
+				     int fd_out,
+				     size_t len,
+				     unsigned int flags)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t written;
+	ssize_t ret;
+	uint8_t *buf;
 
-	if (si->connected == 0) {
-		msg.msg_name = omsg->msg_name;             /* optional address */
-		msg.msg_namelen = omsg->msg_namelen;       /* size of address */
+	len = MIN(len, si->ring->size);
+
+	buf = (uint8_t *)malloc(len);
+	if (buf == NULL) {
+		errno = ENOMEM;
+		return -1;
 	}
-	msg.msg_iov = omsg->msg_iov;               /* scatter/gather array */
-	msg.msg_iovlen = omsg->msg_iovlen;         /* # elements in msg_iov */
-#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	if (msg.msg_controllen > 0 && msg.msg_control != NULL) {
-		/* omsg is a const so use a local buffer for modifications */
-		uint8_t cmbuf[omsg->msg_controllen];
 
-		memcpy(cmbuf, omsg->msg_control, omsg->msg_controllen);
+	ZERO_STRUCT(msg);
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
 
-		msg.msg_control = cmbuf;       /* ancillary data, see below */
-		msg.msg_controllen = omsg->msg_controllen; /* ancillary data buffer len */
+	ret = swrap_ring_recvmsg(fd_in,
+				 si,
+				 &msg,
+				 MSG_PEEK |
+				 ((flags & SPLICE_F_NONBLOCK) ? MSG_DONTWAIT : 0));
+	if (ret <= 0) {
+		free(buf);
+		return ret;
 	}
-	msg.msg_flags = omsg->msg_flags;           /* flags on received message */
-#endif
 
-	rc = swrap_sendmsg_before(s, si, &msg, &tmp, &un_addr, &to_un, &to, &bcast);
-	if (rc < 0) {
-		return -1;
+	written = libc_write(fd_out, buf, ret);
+	if (written > 0) {
+		iov.iov_len = written;
+		swrap_ring_recvmsg(fd_in, si, &msg, 0);
+		swrap_recvmsg_after(fd_in, si, &msg, NULL, 0, written, 0);
 	}
 
-	if (bcast) {
-//		struct stat st;
-//		unsigned int iface;
-		unsigned int prt = ntohs(((const struct sockaddr_in *)(const void *)to)->sin_port);
-		char type;
-		size_t i, len = 0;
-		uint8_t *buf;
-		off_t ofs = 0;
-		size_t avail = 0;
-		size_t remain;
+	free(buf);
 
-		unsigned int remote_prt;
-		unsigned int in4_addr;
-		DIR *d;
-		struct dirent *dir;
+	return written;
+}
 
+static ssize_t swrap_splice(int fd_in,
+			    loff_t *off_in,
+			    int fd_out,
+			    loff_t *off_out,
+			    size_t len,
+			    unsigned int flags)
+{
+	struct socket_info *si;
+	ssize_t ret;
+	int rc;
 
-		for (i = 0; i < (size_t)msg.msg_iovlen; i++) {
-			avail += msg.msg_iov[i].iov_len;
-		}
+	si = find_socket_info(fd_in);
+	if (si != NULL) {
+		struct msghdr msg;
+		struct iovec tmp;
+		struct swrap_address saddr = {
+			.sa_socklen = sizeof(struct sockaddr_storage),
+		};
 
-		len = avail;
-		remain = avail;
+		/*
+		 * Reading into a pipe: the payload ends up at the tail of the
+		 * pipe where we can't look at it, so only apply the checks.
+		 */
+		ZERO_STRUCT(msg);
+		msg.msg_name = &saddr.sa.s;
+		msg.msg_namelen = saddr.sa_socklen;
 
-		/* we capture it as one single packet */
-		buf = (uint8_t *)malloc(remain);
-		if (!buf) {
+		rc = swrap_recvmsg_before(fd_in, si, &msg, &tmp);
+		if (rc < 0 && rc != -ENOTSOCK) {
 			return -1;
 		}
 
-		for (i = 0; i < (size_t)msg.msg_iovlen; i++) {
-			size_t this_time = MIN(remain, (size_t)msg.msg_iov[i].iov_len);
-			memcpy(buf + ofs,
-			       msg.msg_iov[i].iov_base,
-			       this_time);
-			ofs += this_time;
-			remain -= this_time;
+		if (si->ring != NULL) {
+			if (off_in != NULL || off_out != NULL) {
+				errno = ESPIPE;
+				return -1;
+			}
+			return swrap_ring_splice_out(fd_in, si, fd_out, len, flags);
 		}
-		
-		/*
-		type = SOCKET_TYPE_CHAR_UDP;
 
-		for(iface=0; iface <= MAX_WRAPPED_INTERFACES; iface++) {
-			snprintf(un_addr.sun_path, sizeof(un_addr.sun_path), "%s/"SOCKET_FORMAT,
-				 socket_wrapper_dir(), type, iface, prt);
-			if (stat(un_addr.sun_path, &st) != 0) continue;
+		return libc_splice(fd_in, off_in, fd_out, off_out, len, flags);
+	}
 
-			msg.msg_name = &un_addr;           / * optional address * /
-			msg.msg_namelen = sizeof(un_addr); / * size of address * /
+	si = find_socket_info(fd_out);
+	if (si == NULL) {
+		return libc_splice(fd_in, off_in, fd_out, off_out, len, flags);
+	}
 
-			/ * ignore the any errors in broadcast sends * /
-			libc_sendmsg(s, &msg, flags);
+	rc = swrap_sendfile_before(fd_out, si);
+	if (rc < 0) {
+		if (rc == -ENOTSOCK) {
+			return libc_splice(fd_in,
+					   off_in,
+					   fd_out,
+					   off_out,
+					   len,
+					   flags);
 		}
-		*/
-
+		return -1;
+	}
 
-		d = opendir(socket_wrapper_dir());
-		if (d) {
-			while ((dir = readdir(d)) != NULL) {
-				if (dir->d_name[0] == SOCKET_TYPE_CHAR_UDP_LONG)
-					/* TODO - use S_ISSOCK ? */
-					if (sscanf(dir->d_name, SOCKET_FORMAT_LONG, &type, &in4_addr, &remote_prt) == 3) 
-						if (prt == remote_prt) {
-							snprintf(un_addr.sun_path,
-								sizeof(un_addr.sun_path),
-								"%s/%s",
-								socket_wrapper_dir(),dir->d_name);
-							libc_sendmsg(s, &msg, flags);
-							SWRAP_LOG(SWRAP_LOG_DEBUG,"send bcast packet to %s", dir->d_name);
-						}
-			}
-			closedir(d);
+	if (swrap_send_fd_bounce(si)) {
+		if (off_in != NULL || off_out != NULL) {
+			errno = ESPIPE;
+			return -1;
 		}
-
-		swrap_pcap_dump_packet(si, to, SWRAP_SENDTO, buf, len);
-		free(buf);
-
-		return len;
+		return swrap_send_fd(fd_out,
+				     si,
+				     fd_in,
+				     NULL,
+				     len,
+				     flags & SPLICE_F_NONBLOCK);
 	}
 
-	ret = libc_sendmsg(s, &msg, flags);
+#ifdef HAVE_TEE
+	if (swrap_pcap_init_file() != NULL) {
+		ret = swrap_splice_capture(si,
+					   fd_in,
+					   off_in,
+					   fd_out,
+					   off_out,
+					   len,
+					   flags);
+		errno = swrap_sendmsg_count(fd_out, si, NULL, ret);
+		return ret;
+	}
+#endif
 
-	swrap_sendmsg_after(s, si, &msg, to, ret);
+	/* Nothing to capture, so keep the zero-copy path */
+	ret = libc_splice(fd_in, off_in, fd_out, off_out, len, flags);
+	errno = swrap_sendmsg_count(fd_out, si, NULL, ret);
 
 	return ret;
 }
 
-ssize_t sendmsg(int s, const struct msghdr *omsg, int flags)
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+	       size_t len, unsigned int flags)
 {
-	return swrap_sendmsg(s, omsg, flags);
+	return swrap_splice(fd_in, off_in, fd_out, off_out, len, flags);
 }
+#endif /* HAVE_SPLICE */
 
 /****************************************************************************
- *   READV
+ *   POLL
  ***************************************************************************/
 
-static ssize_t swrap_readv(int s, const struct iovec *vector, int count)
+/*
+ * The kernel doesn't know about the data we hold back in the delay queue.
+ * A socket with a full queue would be reported as writable, but a send
+ * fails with EAGAIN. The same is true for a stalled or partitioned stream
+ * or a full shm ring. Hide the events for these sockets and poll in short
+ * intervals until the delivery thread or the reader made room or the stall
+ * is over.
+ */
+#define SWRAP_POLL_THROTTLE_MSEC 1
+
+#ifdef POLLWRNORM
+#define SWRAP_POLL_OUT (POLLOUT | POLLWRNORM)
+#else
+#define SWRAP_POLL_OUT POLLOUT
+#endif
+
+#ifdef POLLRDNORM
+#define SWRAP_POLL_IN (POLLIN | POLLRDNORM)
+#else
+#define SWRAP_POLL_IN POLLIN
+#endif
+
+/* The events we must not report for the socket at the moment */
+static short swrap_poll_held(int fd)
 {
-	struct socket_info *si;
-	struct msghdr msg;
-	struct iovec tmp;
-	struct swrap_address saddr = {
-		.sa_socklen = sizeof(struct sockaddr_storage)
-	};
-	ssize_t ret;
-	int rc;
+	struct socket_info *si = find_socket_info(fd);
+	short held = 0;
 
-	si = find_socket_info(s);
 	if (si == NULL) {
-		return libc_readv(s, vector, count);
+		return 0;
 	}
 
-	tmp.iov_base = NULL;
-	tmp.iov_len = 0;
-
-	ZERO_STRUCT(msg);
-	msg.msg_name = &saddr.sa.s; /* optional address */
-	msg.msg_namelen = saddr.sa_socklen;      /* size of address */
-	msg.msg_iov = discard_const_p(struct iovec, vector); /* scatter/gather array */
-	msg.msg_iovlen = count;        /* # elements in msg_iov */
-#ifdef HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	msg.msg_control = NULL;        /* ancillary data, see below */
-	msg.msg_controllen = 0;        /* ancillary data buffer len */
-	msg.msg_flags = 0;             /* flags on received message */
-#endif
+	if (swrap_fault_stalled(si, SWRAP_FAULT_SEND)) {
+		held |= SWRAP_POLL_OUT;
+	}
+	if (swrap_fault_stalled(si, SWRAP_FAULT_RECV)) {
+		held |= SWRAP_POLL_IN;
+	}
+	if (swrap_fault_partitioned(si, SWRAP_FAULT_SEND)) {
+		held |= SWRAP_POLL_OUT;
+	}
+	if (swrap_fault_partitioned(si, SWRAP_FAULT_RECV)) {
+		held |= SWRAP_POLL_IN;
+	}
+	if (swrap_ring_full(si)) {
+		held |= SWRAP_POLL_OUT;
+	}
+	/* We can't write before we know if the client uses a ring */
+	if (si->ring_pending &&
+	    swrap_ring_hello(fd, si, 0) == -1 && errno == EAGAIN) {
+		held |= SWRAP_POLL_OUT;
+	}
 
-	rc = swrap_recvmsg_before(s, si, &msg, &tmp);
-	if (rc < 0) {
-		if (rc == -ENOTSOCK) {
-			return libc_readv(s, vector, count);
+	if (si->delay_chan != NULL) {
+		SWRAP_LOCK(delay_queue);
+		if (si->delay_chan->queued + SOCKET_WRAPPER_MTU_MAX >
+		    SWRAP_DELAY_QUEUE_MAX) {
+			held |= SWRAP_POLL_OUT;
 		}
-		return -1;
+		SWRAP_UNLOCK(delay_queue);
 	}
 
-	ret = libc_readv(s, msg.msg_iov, msg.msg_iovlen);
+	return held;
+}
 
-	rc = swrap_recvmsg_after(s, si, &msg, NULL, 0, ret);
-	if (rc != 0) {
-		return rc;
+static int swrap_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	short *events = NULL;
+	uint64_t deadline = 0;
+	int ret;
+
+	if (swrap_delay.chans == NULL &&
+	    (swrap_link_flags() & SWRAP_LINK_FAULT) == 0 &&
+	    __atomic_load_n(&swrap_ring_active, __ATOMIC_RELAXED) == 0 &&
+	    !swrap_partition_active()) {
+		return libc_poll(fds, nfds, timeout);
+	}
+
+	if (timeout > 0) {
+		deadline = swrap_monotonic_usec() + (uint64_t)timeout * 1000;
+	}
+
+	for (;;) {
+		int wait_msec = timeout;
+		int throttled = 0;
+		nfds_t i;
+
+		if (timeout > 0) {
+			uint64_t now = swrap_monotonic_usec();
+
+			wait_msec = 0;
+			if (now < deadline) {
+				wait_msec = (deadline - now + 999) / 1000;
+			}
+		}
+
+		for (i = 0; i < nfds; i++) {
+			short held;
+
+			if (fds[i].fd < 0) {
+				continue;
+			}
+			held = fds[i].events & swrap_poll_held(fds[i].fd);
+			if (held == 0) {
+				continue;
+			}
+			if (events == NULL) {
+				events = (short *)calloc(nfds, sizeof(short));
+				if (events == NULL) {
+					break;
+				}
+			}
+			events[i] = fds[i].events;
+			fds[i].events &= ~held;
+			throttled++;
+		}
+
+		if (throttled == 0) {
+			free(events);
+			return libc_poll(fds, nfds, wait_msec);
+		}
+
+		if (wait_msec < 0 || wait_msec > SWRAP_POLL_THROTTLE_MSEC) {
+			wait_msec = SWRAP_POLL_THROTTLE_MSEC;
+		}
+
+		ret = libc_poll(fds, nfds, wait_msec);
+
+		for (i = 0; i < nfds; i++) {
+			short released;
+
+			if (events[i] == 0) {
+				continue;
+			}
+			released = events[i] & ~fds[i].events;
+			fds[i].events = events[i];
+			events[i] = 0;
+
+			if (ret == -1) {
+				continue;
+			}
+
+			/*
+			 * A socket with room is writable. If data arrived
+			 * after a stall, the next round tells.
+			 */
+			released &= SWRAP_POLL_OUT &
+				    ~swrap_poll_held(fds[i].fd);
+			if (released == 0) {
+				continue;
+			}
+			if (fds[i].revents == 0) {
+				ret++;
+			}
+			fds[i].revents |= released;
+		}
+
+		if (ret != 0) {
+			break;
+		}
+		if (timeout == 0 ||
+		    (timeout > 0 && swrap_monotonic_usec() >= deadline)) {
+			break;
+		}
 	}
 
+	free(events);
+
 	return ret;
 }
 
-ssize_t readv(int s, const struct iovec *vector, int count)
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
 {
-	return swrap_readv(s, vector, count);
+	return SWRAP_PROF(POLL, swrap_poll(fds, nfds, timeout));
 }
 
-/****************************************************************************
- *   WRITEV
- ***************************************************************************/
+/****************************
+ * SHUTDOWN
+ ***************************/
 
-static ssize_t swrap_writev(int s, const struct iovec *vector, int count)
+static int swrap_shutdown(int s, int how)
 {
-	struct msghdr msg;
-	struct iovec tmp;
-	struct sockaddr_un un_addr;
-	ssize_t ret;
-	int rc;
 	struct socket_info *si = find_socket_info(s);
 
-	if (!si) {
-		return libc_writev(s, vector, count);
+	if (si == NULL) {
+		return libc_shutdown(s, how);
 	}
 
-	tmp.iov_base = NULL;
-	tmp.iov_len = 0;
-
-	ZERO_STRUCT(msg);
-	msg.msg_name = NULL;           /* optional address */
-	msg.msg_namelen = 0;           /* size of address */
-	msg.msg_iov = discard_const_p(struct iovec, vector); /* scatter/gather array */
-	msg.msg_iovlen = count;        /* # elements in msg_iov */
-#if HAVE_STRUCT_MSGHDR_MSG_CONTROL
-	msg.msg_control = NULL;        /* ancillary data, see below */
-	msg.msg_controllen = 0;        /* ancillary data buffer len */
-	msg.msg_flags = 0;             /* flags on received message */
-#endif
+	/* Don't let the FIN overtake data still held back by the link */
+	if (how != SHUT_RD) {
+		swrap_delay_drain(si);
 
-	rc = swrap_sendmsg_before(s, si, &msg, &tmp, &un_addr, NULL, NULL, NULL);
-	if (rc < 0) {
-		if (rc == -ENOTSOCK) {
-			return libc_readv(s, vector, count);
+		if (si->ring != NULL) {
+			si->ring->shut_wr = true;
 		}
-		return -1;
 	}
 
-	ret = libc_writev(s, msg.msg_iov, msg.msg_iovlen);
-
-	swrap_sendmsg_after(s, si, &msg, NULL, ret);
-
-	return ret;
+	return libc_shutdown(s, how);
 }
 
-ssize_t writev(int s, const struct iovec *vector, int count)
+int shutdown(int s, int how)
 {
-	return swrap_writev(s, vector, count);
+	return swrap_shutdown(s, how);
 }
 
 /****************************
@@ -5593,14 +16425,15 @@ static int swrap_close(int fd)
 
 	si_index = fi->si_index;
 
-	SWRAP_DLIST_REMOVE(socket_fds, fi);
-	free(fi);
+	swrap_fd_entry_free(fi);
 
 	ret = libc_close(fd);
 
 	si = &sockets[si_index];
 	si->refcount--;
 
+	swrap_stats_call(fd, si, SWRAP_STATS_CLOSE, ret, errno);
+
 	if (si->refcount > 0) {
 		/* there are still references left */
 		return ret;
@@ -5616,9 +16449,17 @@ static int swrap_close(int fd)
 	}
 
 	if (si->un_addr.sun_path[0] != '\0') {
+		swrap_bcast_unlink(si->un_addr.sun_path);
 		unlink(si->un_addr.sun_path);
 	}
 
+	swrap_oneway_close(si);
+	swrap_rcvq_close(si);
+	swrap_bind_remove(si);
+	swrap_delay_release(si);
+	swrap_ring_release(si);
+	swrap_tstamp_release(si);
+
 	si->next_free = first_free;
 	first_free = si_index;
 
@@ -5627,7 +16468,7 @@ static int swrap_close(int fd)
 
 int close(int fd)
 {
-	return swrap_close(fd);
+	return SWRAP_PROF(CLOSE, swrap_close(fd));
 }
 
 /****************************
@@ -5646,7 +16487,7 @@ static int swrap_dup(int fd)
 
 	si = &sockets[src_fi->si_index];
 
-	fi = (struct socket_info_fd *)calloc(1, sizeof(struct socket_info_fd));
+	fi = swrap_fd_entry_alloc();
 	if (fi == NULL) {
 		errno = ENOMEM;
 		return -1;
@@ -5655,7 +16496,7 @@ static int swrap_dup(int fd)
 	fi->fd = libc_dup(fd);
 	if (fi->fd == -1) {
 		int saved_errno = errno;
-		free(fi);
+		swrap_fd_entry_free(fi);
 		errno = saved_errno;
 		return -1;
 	}
@@ -5707,7 +16548,7 @@ static int swrap_dup2(int fd, int newfd)
 		swrap_close(newfd);
 	}
 
-	fi = (struct socket_info_fd *)calloc(1, sizeof(struct socket_info_fd));
+	fi = swrap_fd_entry_alloc();
 	if (fi == NULL) {
 		errno = ENOMEM;
 		return -1;
@@ -5716,7 +16557,7 @@ static int swrap_dup2(int fd, int newfd)
 	fi->fd = libc_dup2(fd, newfd);
 	if (fi->fd == -1) {
 		int saved_errno = errno;
-		free(fi);
+		swrap_fd_entry_free(fi);
 		errno = saved_errno;
 		return -1;
 	}
@@ -5755,7 +16596,7 @@ static int swrap_vfcntl(int fd, int cmd, va_list va)
 
 	switch (cmd) {
 	case F_DUPFD:
-		fi = (struct socket_info_fd *)calloc(1, sizeof(struct socket_info_fd));
+		fi = swrap_fd_entry_alloc();
 		if (fi == NULL) {
 			errno = ENOMEM;
 			return -1;
@@ -5764,7 +16605,7 @@ static int swrap_vfcntl(int fd, int cmd, va_list va)
 		fi->fd = libc_vfcntl(fd, cmd, va);
 		if (fi->fd == -1) {
 			int saved_errno = errno;
-			free(fi);
+			swrap_fd_entry_free(fi);
 			errno = saved_errno;
 			return -1;
 		}
@@ -5851,6 +16692,17 @@ static void swrap_thread_parent(void)
 static void swrap_thread_child(void)
 {
 	SWRAP_UNLOCK_ALL;
+
+	swrap_delay_atfork_child();
+	swrap_stats_atfork_child();
+	swrap_prof_atfork_child();
+	swrap_control_atfork_child();
+	swrap_flow_atfork_child();
+	swrap_oneway_atfork_child();
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+	/* Shared with the parent, the answers would get mixed up */
+	swrap_unix_diag_close();
+#endif
 }
 
 /****************************
@@ -5880,11 +16732,27 @@ void swrap_destructor(void)
 {
 	struct socket_info_fd *s = socket_fds;
 
+	/* The control thread walks the sockets */
+	swrap_control_destructor();
+
 	while (s != NULL) {
 		swrap_close(s->fd);
 		s = socket_fds;
 	}
 
+	swrap_delay_destructor();
+	swrap_stats_destructor();
+	swrap_prof_destructor();
+	swrap_flow_destructor();
+	swrap_oneway_destructor();
+	swrap_rcvq_destructor();
+
+	while (socket_fds_free != NULL) {
+		s = socket_fds_free;
+		socket_fds_free = s->prev;
+		free(s);
+	}
+
 	free(sockets);
 
 	if (swrap.libc.handle != NULL) {
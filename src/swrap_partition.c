@@ -0,0 +1,457 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * swrap_partition - change the partitions of a running test
+ *
+ * The processes using the socket directory look at the table before
+ * every send, an update doesn't need to restart them.
+ */
+
+#include "config.h"
+#include "swrap_shm.h"
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Keep the probe sequences short */
+#define SWRAP_PARTITION_MAX (SWRAP_PARTITION_SLOTS / 4 * 3)
+
+#define SWRAP_IFACE_MAX 0xFFFFFE
+
+struct iface_range {
+	uint32_t first;
+	uint32_t last;
+};
+
+struct iface_group {
+	size_t count;
+	struct iface_range *ranges;
+};
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: swrap_partition [-d DIR] [-o] block GROUP GROUP\n"
+		"       swrap_partition [-d DIR] [-o] unblock GROUP GROUP\n"
+		"       swrap_partition [-d DIR] heal\n"
+		"       swrap_partition [-d DIR] list\n"
+		"\n"
+		"GROUP is a comma separated list of interfaces or ranges of\n"
+		"interfaces, like 10,20-29. DIR defaults to SOCKET_WRAPPER_DIR.\n"
+		"With -o only the traffic from the first to the second group\n"
+		"is blocked.\n");
+}
+
+static int parse_iface(const char *s, char **endp, uint32_t *iface)
+{
+	unsigned long v;
+
+	errno = 0;
+	v = strtoul(s, endp, 10);
+	if (errno != 0 || *endp == s || v == 0 || v > SWRAP_IFACE_MAX) {
+		return -1;
+	}
+
+	*iface = (uint32_t)v;
+
+	return 0;
+}
+
+static int parse_group(const char *s, struct iface_group *g)
+{
+	struct iface_range *r;
+	char *endp;
+	int rc;
+
+	g->count = 0;
+	g->ranges = NULL;
+
+	for (;;) {
+		r = realloc(g->ranges, (g->count + 1) * sizeof(*r));
+		if (r == NULL) {
+			return -1;
+		}
+		g->ranges = r;
+		r = &g->ranges[g->count];
+
+		rc = parse_iface(s, &endp, &r->first);
+		if (rc == -1) {
+			return -1;
+		}
+		r->last = r->first;
+
+		if (*endp == '-') {
+			rc = parse_iface(endp + 1, &endp, &r->last);
+			if (rc == -1 || r->last < r->first) {
+				return -1;
+			}
+		}
+		g->count++;
+
+		if (*endp == '\0') {
+			return 0;
+		}
+		if (*endp != ',') {
+			return -1;
+		}
+		s = endp + 1;
+	}
+}
+
+static struct swrap_partition_shm *partition_open(const char *dir, int *pfd)
+{
+	struct swrap_partition_shm *p;
+	char path[1024];
+	struct stat st;
+	void *m;
+	int rc;
+	int fd;
+
+	rc = snprintf(path, sizeof(path), "%s/%s", dir, SWRAP_PARTITION_FILE);
+	if (rc <= 0 || (size_t)rc >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	fd = open(path, O_RDWR|O_CREAT, 0666);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	rc = flock(fd, LOCK_EX);
+	if (rc == 0) {
+		rc = fstat(fd, &st);
+	}
+	if (rc == 0 && st.st_size < (off_t)sizeof(struct swrap_partition_shm)) {
+		rc = ftruncate(fd, sizeof(struct swrap_partition_shm));
+	}
+	if (rc == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	m = mmap(NULL, sizeof(struct swrap_partition_shm),
+		 PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	p = (struct swrap_partition_shm *)m;
+
+	if (p->magic == 0) {
+		__atomic_store_n(&p->magic, SWRAP_PARTITION_MAGIC, __ATOMIC_RELEASE);
+	}
+	if (p->magic != SWRAP_PARTITION_MAGIC) {
+		munmap(m, sizeof(struct swrap_partition_shm));
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* The lock is held until we exit */
+	*pfd = fd;
+
+	return p;
+}
+
+/* Readers retry while seq is odd or changed under them */
+static void partition_begin(struct swrap_partition_shm *p)
+{
+	__atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void partition_end(struct swrap_partition_shm *p)
+{
+	__atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int partition_block(struct swrap_partition_shm *p,
+			   uint32_t src,
+			   uint32_t dst)
+{
+	uint64_t key = swrap_partition_key(src, dst);
+	size_t i = swrap_partition_slot(p, key);
+
+	if (p->slots[i] == key) {
+		return 0;
+	}
+	if (p->count >= SWRAP_PARTITION_MAX) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	__atomic_store_n(&p->slots[i], key, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->count, p->count + 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static void partition_unblock(struct swrap_partition_shm *p,
+			      uint32_t src,
+			      uint32_t dst)
+{
+	uint64_t key = swrap_partition_key(src, dst);
+	size_t i = swrap_partition_slot(p, key);
+	size_t j;
+
+	if (p->slots[i] != key) {
+		return;
+	}
+
+	/* Move the following entries up, so no probe sequence breaks */
+	j = i;
+	for (;;) {
+		size_t home;
+
+		j = (j + 1) & (SWRAP_PARTITION_SLOTS - 1);
+		if (p->slots[j] == 0) {
+			break;
+		}
+
+		home = swrap_partition_hash(p->slots[j]);
+		if (((j - home) & (SWRAP_PARTITION_SLOTS - 1)) <
+		    ((j - i) & (SWRAP_PARTITION_SLOTS - 1))) {
+			continue;
+		}
+
+		__atomic_store_n(&p->slots[i], p->slots[j], __ATOMIC_RELAXED);
+		i = j;
+	}
+
+	__atomic_store_n(&p->slots[i], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->count, p->count - 1, __ATOMIC_RELAXED);
+}
+
+static int partition_update_iface(struct swrap_partition_shm *p,
+				  uint32_t x,
+				  const struct iface_group *b,
+				  bool block,
+				  bool oneway)
+{
+	size_t j;
+	uint32_t y;
+	int rc;
+
+	for (j = 0; j < b->count; j++) {
+		for (y = b->ranges[j].first; y <= b->ranges[j].last; y++) {
+			if (x == y) {
+				continue;
+			}
+
+			if (!block) {
+				partition_unblock(p, x, y);
+				if (!oneway) {
+					partition_unblock(p, y, x);
+				}
+				continue;
+			}
+
+			rc = partition_block(p, x, y);
+			if (rc == 0 && !oneway) {
+				rc = partition_block(p, y, x);
+			}
+			if (rc == -1) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int partition_update(struct swrap_partition_shm *p,
+			    const struct iface_group *a,
+			    const struct iface_group *b,
+			    bool block,
+			    bool oneway)
+{
+	size_t i;
+	uint32_t x;
+	int rc = 0;
+
+	partition_begin(p);
+
+	for (i = 0; rc == 0 && i < a->count; i++) {
+		for (x = a->ranges[i].first;
+		     rc == 0 && x <= a->ranges[i].last;
+		     x++) {
+			rc = partition_update_iface(p, x, b, block, oneway);
+		}
+	}
+
+	partition_end(p);
+
+	return rc;
+}
+
+static void partition_heal(struct swrap_partition_shm *p)
+{
+	size_t i;
+
+	partition_begin(p);
+
+	for (i = 0; i < SWRAP_PARTITION_SLOTS; i++) {
+		if (p->slots[i] != 0) {
+			__atomic_store_n(&p->slots[i], 0, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_store_n(&p->count, 0, __ATOMIC_RELAXED);
+
+	partition_end(p);
+}
+
+static int key_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int partition_list(const struct swrap_partition_shm *p)
+{
+	uint64_t *keys;
+	size_t i, n = 0;
+
+	keys = malloc((p->count + 1) * sizeof(*keys));
+	if (keys == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < SWRAP_PARTITION_SLOTS && n < p->count; i++) {
+		if (p->slots[i] != 0) {
+			keys[n++] = p->slots[i];
+		}
+	}
+	qsort(keys, n, sizeof(*keys), key_cmp);
+
+	for (i = 0; i < n; i++) {
+		printf("%u > %u\n",
+		       (unsigned int)(keys[i] >> 24),
+		       (unsigned int)(keys[i] & 0xFFFFFF));
+	}
+	free(keys);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct swrap_partition_shm *p;
+	struct iface_group a = { 0 };
+	struct iface_group b = { 0 };
+	const char *dir = getenv("SOCKET_WRAPPER_DIR");
+	const char *cmd;
+	bool oneway = false;
+	int opt;
+	int rc;
+	int fd;
+
+	while ((opt = getopt(argc, argv, "d:oh")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'o':
+			oneway = true;
+			break;
+		default:
+			usage();
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1 || dir == NULL) {
+		usage();
+		return 1;
+	}
+	cmd = argv[0];
+
+	if (strcmp(cmd, "block") == 0 || strcmp(cmd, "unblock") == 0) {
+		if (argc != 3 ||
+		    parse_group(argv[1], &a) == -1 ||
+		    parse_group(argv[2], &b) == -1) {
+			fprintf(stderr, "Invalid groups of interfaces\n");
+			usage();
+			return 1;
+		}
+	} else if ((strcmp(cmd, "heal") != 0 && strcmp(cmd, "list") != 0) ||
+		   argc != 1) {
+		usage();
+		return 1;
+	}
+
+	p = partition_open(dir, &fd);
+	if (p == NULL) {
+		fprintf(stderr, "Failed to open the partition table in %s: %s\n",
+			dir, strerror(errno));
+		return 1;
+	}
+
+	if (strcmp(cmd, "block") == 0) {
+		rc = partition_update(p, &a, &b, true, oneway);
+	} else if (strcmp(cmd, "unblock") == 0) {
+		rc = partition_update(p, &a, &b, false, oneway);
+	} else if (strcmp(cmd, "heal") == 0) {
+		partition_heal(p);
+		rc = 0;
+	} else {
+		rc = partition_list(p);
+	}
+	if (rc == -1) {
+		fprintf(stderr, "Failed to %s: %s\n", cmd, strerror(errno));
+	}
+
+	munmap(p, sizeof(struct swrap_partition_shm));
+	close(fd);
+	free(a.ranges);
+	free(b.ranges);
+
+	return rc == -1 ? 1 : 0;
+}
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The files socket_wrapper shares with the tools in the socket directory,
+ * and the names of its sockets there.
+ * Their layout is the same for the library and the tools, so a tool can
+ * look at and change the state of a running test.
+ */
+
+#ifndef _SWRAP_SHM_H
+#define _SWRAP_SHM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/****************************************************************************
+ *   SOCKET NAMES
+ ***************************************************************************/
+
+/* we need to use a very terse format here as IRIX 6.4 silently
+   truncates names to 16 chars, so if we use a longer name then we
+   can't tell which port a packet came from with recvfrom()
+
+   with this format we have 8 chars left for the directory name
+*/
+#define SOCKET_FORMAT "%c%02X%04X"
+#define SOCKET_TYPE_CHAR_TCP		'T'
+#define SOCKET_TYPE_CHAR_UDP		'U'
+#define SOCKET_TYPE_CHAR_TCP_V6		'X'
+#define SOCKET_TYPE_CHAR_UDP_V6		'Y'
+
+
+#define SOCKET_FORMAT_LONG "%c%08X%04X"
+#define SOCKET_FORMAT_V6_LONG "%c%08X%08X%08X%08X%04X"
+
+#define SOCKET_TYPE_CHAR_TCP_LONG	'Q'
+#define SOCKET_TYPE_CHAR_UDP_LONG	'W'
+#define SOCKET_TYPE_CHAR_TCP_V6_LONG	'E'
+#define SOCKET_TYPE_CHAR_UDP_V6_LONG	'R'
+
+/*
+ * The socket names are written with fixed width upper case hex digits, see
+ * SOCKET_FORMAT_LONG. This runs for every accepted connection and datagram,
+ * so don't go through sscanf().
+ */
+static inline bool swrap_parse_hex(const char *p,
+				   size_t width,
+				   unsigned int *v)
+{
+	unsigned int r = 0;
+	size_t i;
+
+	for (i = 0; i < width; i++) {
+		char c = p[i];
+
+		if (c >= '0' && c <= '9') {
+			r = (r << 4) | (unsigned int)(c - '0');
+		} else if (c >= 'A' && c <= 'F') {
+			r = (r << 4) | (unsigned int)(c - 'A' + 10);
+		} else {
+			return false;
+		}
+	}
+
+	*v = r;
+	return true;
+}
+
+/****************************************************************************
+ *   PARTITIONS
+ ***************************************************************************/
+
+/*
+ * The pairs of interfaces which can't reach each other, as an open
+ * addressing hash table with linear probing. A slot holds the source
+ * interface in the upper and the destination in the lower 24 bits.
+ *
+ * Only swrap_partition changes the table, with the file locked. It makes
+ * seq odd during an update, so the processes reading it retry if they
+ * raced with a change.
+ */
+#define SWRAP_PARTITION_FILE ".partition"
+#define SWRAP_PARTITION_MAGIC 0x53575054 /* SWPT */
+#define SWRAP_PARTITION_SLOTS 65536
+
+struct swrap_partition_shm {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t slots[SWRAP_PARTITION_SLOTS];
+};
+
+static inline uint64_t swrap_partition_key(uint32_t src, uint32_t dst)
+{
+	return ((uint64_t)src << 24) | dst;
+}
+
+static inline size_t swrap_partition_hash(uint64_t key)
+{
+	key *= 0x9E3779B97F4A7C15ULL;
+
+	return (size_t)(key >> 48) & (SWRAP_PARTITION_SLOTS - 1);
+}
+
+/* The slot of the key, or the empty slot where it belongs */
+static inline size_t swrap_partition_slot(const struct swrap_partition_shm *p,
+					  uint64_t key)
+{
+	size_t i = swrap_partition_hash(key);
+	size_t n;
+
+	for (n = 0; n < SWRAP_PARTITION_SLOTS; n++) {
+		uint64_t k = __atomic_load_n(&p->slots[i], __ATOMIC_RELAXED);
+
+		if (k == 0 || k == key) {
+			break;
+		}
+		i = (i + 1) & (SWRAP_PARTITION_SLOTS - 1);
+	}
+
+	return i;
+}
+
+static inline bool swrap_partition_lookup(const struct swrap_partition_shm *p,
+					  uint32_t src,
+					  uint32_t dst)
+{
+	uint64_t key = swrap_partition_key(src, dst);
+	size_t i = swrap_partition_slot(p, key);
+
+	return __atomic_load_n(&p->slots[i], __ATOMIC_RELAXED) == key;
+}
+
+/****************************************************************************
+ *   STATISTICS
+ ***************************************************************************/
+
+/*
+ * With SOCKET_WRAPPER_STATS set every process publishes its counters in
+ * the file .stats-<pid> of the socket directory: a header, a table of
+ * interfaces and a row per socket slot. Each row sits on its own cache
+ * lines. The counters only ever get atomic adds, no writer waits for
+ * another one, also not in a signal handler.
+ *
+ * The other fields of a socket row change together. A writer adds
+ * SWRAP_STATS_SEQ_BUSY to seq before and SWRAP_STATS_SEQ_DONE after the
+ * change, so the low bits count the writers busy with the row and the
+ * upper ones the changes. Readers copy the row and retry a few times if a
+ * writer was busy or seq changed.
+ */
+#define SWRAP_STATS_FILE_PREFIX ".stats-"
+#define SWRAP_STATS_MAGIC 0x53575354 /* SWST */
+#define SWRAP_STATS_VERSION 2
+#define SWRAP_STATS_SEQ_BUSY 0x1U
+#define SWRAP_STATS_SEQ_DONE 0xFFFFU
+#define SWRAP_STATS_SEQ_WRITERS 0xFFFFU
+#define SWRAP_STATS_READ_TRIES 1000
+#define SWRAP_STATS_IFACES 4096
+#define SWRAP_STATS_CACHELINE 64
+
+enum swrap_stats_counter {
+	SWRAP_STATS_BYTES_OUT,
+	SWRAP_STATS_BYTES_IN,
+	SWRAP_STATS_PACKETS_OUT,
+	SWRAP_STATS_PACKETS_IN,
+	SWRAP_STATS_EAGAIN,
+	SWRAP_STATS_MTU_SPLITS,
+	SWRAP_STATS_AUTOBIND_PROBES,
+
+	/* The calls by type */
+	SWRAP_STATS_SOCKET,
+	SWRAP_STATS_BIND,
+	SWRAP_STATS_CONNECT,
+	SWRAP_STATS_LISTEN,
+	SWRAP_STATS_ACCEPT,
+	SWRAP_STATS_SEND,
+	SWRAP_STATS_RECV,
+	SWRAP_STATS_SOCKOPT,
+	SWRAP_STATS_IOCTL,
+	SWRAP_STATS_CLOSE,
+
+	SWRAP_STATS_NUM
+};
+
+#define SWRAP_STATS_SOCK_UNUSED 0
+#define SWRAP_STATS_SOCK_OPEN 1
+#define SWRAP_STATS_SOCK_CLOSED 2
+
+struct swrap_stats_header {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t num_ifaces;
+	uint32_t num_sockets;
+	uint32_t num_counters;
+	uint64_t ifaces_offset;
+	uint64_t sockets_offset;
+} __attribute__((aligned(SWRAP_STATS_CACHELINE)));
+
+/*
+ * The counters of all sockets bound to the interface, key is the id + 1.
+ * Only the counters change, seq stays 0.
+ */
+struct swrap_stats_iface {
+	uint32_t seq;
+	uint32_t key;
+	uint64_t counters[SWRAP_STATS_NUM];
+} __attribute__((aligned(SWRAP_STATS_CACHELINE)));
+
+struct swrap_stats_sock {
+	uint32_t seq;
+	uint32_t state;
+	int32_t fd;
+	int32_t family;
+	int32_t type;
+	uint32_t local_iface;
+	uint32_t peer_iface;
+	uint16_t local_port;
+	uint16_t peer_port;
+	uint64_t counters[SWRAP_STATS_NUM];
+} __attribute__((aligned(SWRAP_STATS_CACHELINE)));
+
+static inline size_t swrap_stats_size(uint32_t num_sockets)
+{
+	return sizeof(struct swrap_stats_header) +
+	       SWRAP_STATS_IFACES * sizeof(struct swrap_stats_iface) +
+	       (size_t)num_sockets * sizeof(struct swrap_stats_sock);
+}
+
+/*
+ * Copies the row of the given size, retrying while a writer is busy. A
+ * writer which died in the middle of a change leaves the row busy, so
+ * this gives up after a while. Returns false if the fields besides the
+ * counters might not belong together.
+ */
+static inline bool swrap_stats_read(const void *row, void *copy, size_t size)
+{
+	const uint32_t *seqp = (const uint32_t *)row;
+	const uint64_t *src = (const uint64_t *)row;
+	uint64_t *dst = (uint64_t *)copy;
+	uint32_t seq;
+	size_t i, n;
+
+	for (n = 0; n < SWRAP_STATS_READ_TRIES; n++) {
+		seq = __atomic_load_n(seqp, __ATOMIC_ACQUIRE);
+
+		for (i = 0; i < size / sizeof(uint64_t); i++) {
+			dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if ((seq & SWRAP_STATS_SEQ_WRITERS) == 0 &&
+		    __atomic_load_n(seqp, __ATOMIC_RELAXED) == seq) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+#endif /* _SWRAP_SHM_H */
@@ -0,0 +1,647 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * swrap_ss - list the sockets of all processes using a socket directory
+ *
+ * Like ss(8), but for the sockets socket_wrapper emulates. The unix
+ * sockets backing them are taken from the kernel with a single sock_diag
+ * dump, the addresses come from their names. Nothing is stat()ed, so it
+ * stays fast with many thousands of sockets.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/unix_diag.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "swrap_shm.h"
+
+struct ss_sock {
+	uint32_t ino;
+	uint32_t peer_ino;
+	uint32_t rqueue;
+	uint32_t wqueue;
+	bool have_queues;
+	uint8_t state;
+	char type;
+	unsigned int addr[4];
+	unsigned int port;
+	int pid;
+};
+
+struct ss_table {
+	struct ss_sock *socks;
+	size_t count;
+	size_t alloc;
+
+	/* Open addressing from the inode to the index + 1 */
+	uint32_t *hash;
+	size_t hash_size;
+};
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: swrap_ss [-d DIR] [-t] [-u] [-l] [-n]\n"
+		"\n"
+		"Lists the sockets of all processes using the socket\n"
+		"directory DIR, which defaults to SOCKET_WRAPPER_DIR.\n"
+		"-t and -u only list stream or datagram sockets, -l only\n"
+		"the listening ones. -n doesn't look up the processes.\n");
+}
+
+/* Decodes the name of a socket below dir, which isn't NUL terminated */
+static bool decode_name(const char *dir,
+			size_t dir_len,
+			const char *name,
+			size_t len,
+			struct ss_sock *s)
+{
+	const char *base;
+	size_t naddr;
+	size_t i;
+
+	/* The kernel includes the NUL if the path was bound with it */
+	while (len > 0 && name[len - 1] == '\0') {
+		len--;
+	}
+
+	if (len <= dir_len + 1 ||
+	    memcmp(name, dir, dir_len) != 0 ||
+	    name[dir_len] != '/') {
+		return false;
+	}
+
+	/* The sharded layout has subdirectories */
+	base = (const char *)memrchr(name, '/', len) + 1;
+	len -= base - name;
+
+	switch (base[0]) {
+	case SOCKET_TYPE_CHAR_TCP_LONG:
+	case SOCKET_TYPE_CHAR_UDP_LONG:
+		naddr = 1;
+		break;
+	case SOCKET_TYPE_CHAR_TCP_V6_LONG:
+	case SOCKET_TYPE_CHAR_UDP_V6_LONG:
+		naddr = 4;
+		break;
+	default:
+		return false;
+	}
+
+	if (len != 1 + naddr * 8 + 4) {
+		return false;
+	}
+
+	memset(s->addr, 0, sizeof(s->addr));
+	for (i = 0; i < naddr; i++) {
+		if (!swrap_parse_hex(base + 1 + i * 8, 8, &s->addr[i])) {
+			return false;
+		}
+	}
+	if (!swrap_parse_hex(base + 1 + naddr * 8, 4, &s->port)) {
+		return false;
+	}
+	s->type = base[0];
+
+	return true;
+}
+
+static struct ss_sock *table_add(struct ss_table *t)
+{
+	if (t->count == t->alloc) {
+		struct ss_sock *tmp;
+
+		t->alloc = t->alloc == 0 ? 1024 : t->alloc * 2;
+		tmp = (struct ss_sock *)realloc(t->socks,
+						t->alloc * sizeof(*tmp));
+		if (tmp == NULL) {
+			return NULL;
+		}
+		t->socks = tmp;
+	}
+
+	return &t->socks[t->count++];
+}
+
+static int table_index(struct ss_table *t)
+{
+	size_t i;
+
+	t->hash_size = 16;
+	while (t->hash_size < 2 * t->count) {
+		t->hash_size *= 2;
+	}
+
+	t->hash = (uint32_t *)calloc(t->hash_size, sizeof(*t->hash));
+	if (t->hash == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < t->count; i++) {
+		size_t h = (t->socks[i].ino * 2654435761U) & (t->hash_size - 1);
+
+		while (t->hash[h] != 0) {
+			h = (h + 1) & (t->hash_size - 1);
+		}
+		t->hash[h] = i + 1;
+	}
+
+	return 0;
+}
+
+static struct ss_sock *table_find(const struct ss_table *t, uint32_t ino)
+{
+	size_t h = (ino * 2654435761U) & (t->hash_size - 1);
+
+	if (ino == 0) {
+		return NULL;
+	}
+
+	while (t->hash[h] != 0) {
+		struct ss_sock *s = &t->socks[t->hash[h] - 1];
+
+		if (s->ino == ino) {
+			return s;
+		}
+		h = (h + 1) & (t->hash_size - 1);
+	}
+
+	return NULL;
+}
+
+static void add_diag_msg(struct ss_table *t,
+			 const char *dir,
+			 size_t dir_len,
+			 const struct nlmsghdr *h)
+{
+	const struct unix_diag_msg *m = (const struct unix_diag_msg *)NLMSG_DATA(h);
+	const struct rtattr *rta = (const struct rtattr *)(m + 1);
+	int len = h->nlmsg_len - NLMSG_LENGTH(sizeof(*m));
+	struct ss_sock s = {
+		.ino = m->udiag_ino,
+		.state = m->udiag_state,
+	};
+	bool named = false;
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case UNIX_DIAG_NAME:
+			named = decode_name(dir, dir_len,
+					    (const char *)RTA_DATA(rta),
+					    RTA_PAYLOAD(rta),
+					    &s);
+			break;
+		case UNIX_DIAG_PEER:
+			memcpy(&s.peer_ino, RTA_DATA(rta), sizeof(s.peer_ino));
+			break;
+		case UNIX_DIAG_RQLEN: {
+			struct unix_diag_rqlen rq;
+
+			memcpy(&rq, RTA_DATA(rta), sizeof(rq));
+			s.rqueue = rq.udiag_rqueue;
+			s.wqueue = rq.udiag_wqueue;
+			s.have_queues = true;
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	if (named) {
+		struct ss_sock *p = table_add(t);
+
+		if (p != NULL) {
+			*p = s;
+		}
+	}
+}
+
+/* All unix sockets of the network namespace in one dump */
+static int load_sock_diag(struct ss_table *t, const char *dir)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct unix_diag_req req;
+	} msg = {
+		.nlh = {
+			.nlmsg_len = sizeof(msg),
+			.nlmsg_type = SOCK_DIAG_BY_FAMILY,
+			.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+		},
+		.req = {
+			.sdiag_family = AF_UNIX,
+			.udiag_states = -1,
+			.udiag_show = UDIAG_SHOW_NAME |
+				      UDIAG_SHOW_PEER |
+				      UDIAG_SHOW_RQLEN,
+		},
+	};
+	size_t dir_len = strlen(dir);
+	static union {
+		struct nlmsghdr nlh;
+		char data[65536];
+	} buf;
+	bool done = false;
+	ssize_t ret;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (fd == -1) {
+		return -1;
+	}
+
+	ret = send(fd, &msg, sizeof(msg), 0);
+	if (ret != sizeof(msg)) {
+		close(fd);
+		return -1;
+	}
+
+	while (!done) {
+		const struct nlmsghdr *h = &buf.nlh;
+		int len;
+
+		ret = recv(fd, &buf, sizeof(buf), 0);
+		if (ret <= 0) {
+			close(fd);
+			return -1;
+		}
+		len = ret;
+
+		for (; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type == NLMSG_DONE) {
+				done = true;
+				break;
+			}
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				close(fd);
+				return -1;
+			}
+			if (h->nlmsg_type == SOCK_DIAG_BY_FAMILY) {
+				add_diag_msg(t, dir, dir_len, h);
+			}
+		}
+	}
+	close(fd);
+
+	return 0;
+}
+
+/* Without the unix_diag module there are no peers and queues */
+static int load_proc_net_unix(struct ss_table *t, const char *dir)
+{
+	size_t dir_len = strlen(dir);
+	char line[512];
+	FILE *fp;
+
+	fp = fopen("/proc/net/unix", "r");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		struct ss_sock s = {
+			.ino = 0,
+		};
+		unsigned long v[7];
+		char *p = line;
+		char *end;
+		int i;
+
+		/* Num RefCount Protocol Flags Type St Inode Path */
+		for (i = 0; i < 7; i++) {
+			p += strspn(p, ": ");
+			v[i] = strtoul(p, &end, i < 6 ? 16 : 10);
+			p = end;
+		}
+		p += strspn(p, " ");
+		p[strcspn(p, "\n")] = '\0';
+
+		s.ino = v[6];
+		if (v[3] & (1 << 16)) {
+			/* __SO_ACCEPTCON */
+			s.state = TCP_LISTEN;
+		} else if (v[5] == 3) {
+			/* SS_CONNECTED */
+			s.state = TCP_ESTABLISHED;
+		} else {
+			s.state = TCP_CLOSE;
+		}
+
+		if (decode_name(dir, dir_len, p, strlen(p), &s)) {
+			struct ss_sock *n = table_add(t);
+
+			if (n != NULL) {
+				*n = s;
+			}
+		}
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+/* One pass over the file descriptors of all processes */
+static void load_pids(struct ss_table *t)
+{
+	struct dirent *pde;
+	DIR *proc;
+
+	proc = opendir("/proc");
+	if (proc == NULL) {
+		return;
+	}
+
+	while ((pde = readdir(proc)) != NULL) {
+		char path[64];
+		struct dirent *de;
+		DIR *fds;
+		int pid;
+
+		if (pde->d_name[0] < '1' || pde->d_name[0] > '9') {
+			continue;
+		}
+		pid = atoi(pde->d_name);
+
+		snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+		fds = opendir(path);
+		if (fds == NULL) {
+			continue;
+		}
+
+		while ((de = readdir(fds)) != NULL) {
+			char link[64];
+			struct ss_sock *s;
+			unsigned long ino;
+			ssize_t len;
+
+			if (de->d_name[0] == '.') {
+				continue;
+			}
+
+			len = readlinkat(dirfd(fds), de->d_name,
+					 link, sizeof(link) - 1);
+			if (len < 9 || memcmp(link, "socket:[", 8) != 0) {
+				continue;
+			}
+			link[len] = '\0';
+			ino = strtoul(link + 8, NULL, 10);
+
+			s = table_find(t, ino);
+			if (s != NULL && s->pid == 0) {
+				s->pid = pid;
+			}
+		}
+		closedir(fds);
+	}
+	closedir(proc);
+}
+
+static bool is_stream(const struct ss_sock *s)
+{
+	return s->type == SOCKET_TYPE_CHAR_TCP_LONG ||
+	       s->type == SOCKET_TYPE_CHAR_TCP_V6_LONG;
+}
+
+static bool is_ipv6(const struct ss_sock *s)
+{
+	return s->type == SOCKET_TYPE_CHAR_TCP_V6_LONG ||
+	       s->type == SOCKET_TYPE_CHAR_UDP_V6_LONG;
+}
+
+static const char *format_addr(const struct ss_sock *s, char *buf, size_t size)
+{
+	char ip[INET6_ADDRSTRLEN];
+
+	if (s == NULL) {
+		snprintf(buf, size, "*");
+		return buf;
+	}
+
+	if (is_ipv6(s)) {
+		struct in6_addr in6;
+		int i, j;
+
+		/* The byte order of swrap_make_ipv6() */
+		for (i = 0; i < 4; i++) {
+			for (j = 0; j < 4; j++) {
+				in6.s6_addr[i * 4 + j] = s->addr[i] >> (8 * j);
+			}
+		}
+		inet_ntop(AF_INET6, &in6, ip, sizeof(ip));
+		snprintf(buf, size, "[%s]:%u", ip, s->port);
+	} else {
+		struct in_addr in = {
+			.s_addr = htonl(s->addr[0]),
+		};
+
+		inet_ntop(AF_INET, &in, ip, sizeof(ip));
+		snprintf(buf, size, "%s:%u", ip, s->port);
+	}
+
+	return buf;
+}
+
+static const char *format_state(const struct ss_sock *s)
+{
+	switch (s->state) {
+	case TCP_ESTABLISHED:
+		return "ESTAB";
+	case TCP_SYN_SENT:
+		return "SYN-SENT";
+	case TCP_LISTEN:
+		return "LISTEN";
+	case TCP_CLOSE:
+		return is_stream(s) ? "CLOSE" : "UNCONN";
+	default:
+		return "UNKNOWN";
+	}
+}
+
+static void print_table(const struct ss_table *t,
+			int only_type,
+			bool listening,
+			bool pids)
+{
+	size_t i;
+
+	printf("%-5s %-8s %6s %6s %-46s %-46s %s\n",
+	       "Netid", "State", "Recv-Q", "Send-Q",
+	       "Local Address:Port", "Peer Address:Port", "Pid");
+
+	for (i = 0; i < t->count; i++) {
+		const struct ss_sock *s = &t->socks[i];
+		char local[INET6_ADDRSTRLEN + 8];
+		char peer[INET6_ADDRSTRLEN + 8];
+		char rq[16], wq[16];
+		char pid[16];
+
+		if ((only_type == SOCK_STREAM && !is_stream(s)) ||
+		    (only_type == SOCK_DGRAM && is_stream(s)) ||
+		    (listening && s->state != TCP_LISTEN)) {
+			continue;
+		}
+
+		snprintf(rq, sizeof(rq), "-");
+		snprintf(wq, sizeof(wq), "-");
+		if (s->have_queues) {
+			snprintf(rq, sizeof(rq), "%u", s->rqueue);
+			snprintf(wq, sizeof(wq), "%u", s->wqueue);
+		}
+
+		snprintf(pid, sizeof(pid), "-");
+		if (pids && s->pid != 0) {
+			snprintf(pid, sizeof(pid), "%d", s->pid);
+		}
+
+		printf("%-5s %-8s %6s %6s %-46s %-46s %s\n",
+		       is_stream(s) ?
+		       (is_ipv6(s) ? "tcp6" : "tcp") :
+		       (is_ipv6(s) ? "udp6" : "udp"),
+		       format_state(s),
+		       rq,
+		       wq,
+		       format_addr(s, local, sizeof(local)),
+		       format_addr(table_find(t, s->peer_ino),
+				   peer, sizeof(peer)),
+		       pid);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = getenv("SOCKET_WRAPPER_DIR");
+	struct ss_table t = {
+		.count = 0,
+	};
+	char *path;
+	int only_type = 0;
+	bool listening = false;
+	bool pids = true;
+	size_t len;
+	int opt;
+	int rc;
+
+	while ((opt = getopt(argc, argv, "d:tulnh")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 't':
+			only_type = SOCK_STREAM;
+			break;
+		case 'u':
+			only_type = SOCK_DGRAM;
+			break;
+		case 'l':
+			listening = true;
+			break;
+		case 'n':
+			pids = false;
+			break;
+		default:
+			usage();
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc || dir == NULL) {
+		usage();
+		return 1;
+	}
+
+	/* The names are bound the way socket_wrapper_dir() returns it */
+	if (strncmp(dir, "./", 2) == 0) {
+		dir += 2;
+	}
+	path = strdup(dir);
+	if (path == NULL) {
+		return 1;
+	}
+	len = strlen(path);
+	while (len > 1 && path[len - 1] == '/') {
+		path[--len] = '\0';
+	}
+
+	rc = load_sock_diag(&t, path);
+	if (rc == -1) {
+		t.count = 0;
+		rc = load_proc_net_unix(&t, path);
+	}
+	if (rc == -1) {
+		fprintf(stderr, "Failed to list the unix sockets: %s\n",
+			strerror(errno));
+		free(path);
+		return 1;
+	}
+
+	rc = table_index(&t);
+	if (rc == -1) {
+		free(path);
+		free(t.socks);
+		return 1;
+	}
+
+	if (pids) {
+		load_pids(&t);
+	}
+
+	print_table(&t, only_type, listening, pids);
+
+	free(t.hash);
+	free(t.socks);
+	free(path);
+
+	return 0;
+}
@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * swrap_stats - print the counters of the processes of a running test
+ *
+ * The processes publish them with SOCKET_WRAPPER_STATS=1 in the socket
+ * directory. Reading them doesn't slow the processes down.
+ */
+
+#include "config.h"
+#include "swrap_shm.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *counter_names[SWRAP_STATS_NUM] = {
+	[SWRAP_STATS_BYTES_OUT] = "bytes_out",
+	[SWRAP_STATS_BYTES_IN] = "bytes_in",
+	[SWRAP_STATS_PACKETS_OUT] = "packets_out",
+	[SWRAP_STATS_PACKETS_IN] = "packets_in",
+	[SWRAP_STATS_EAGAIN] = "eagain",
+	[SWRAP_STATS_MTU_SPLITS] = "mtu_splits",
+	[SWRAP_STATS_AUTOBIND_PROBES] = "autobind_probes",
+	[SWRAP_STATS_SOCKET] = "socket",
+	[SWRAP_STATS_BIND] = "bind",
+	[SWRAP_STATS_CONNECT] = "connect",
+	[SWRAP_STATS_LISTEN] = "listen",
+	[SWRAP_STATS_ACCEPT] = "accept",
+	[SWRAP_STATS_SEND] = "send",
+	[SWRAP_STATS_RECV] = "recv",
+	[SWRAP_STATS_SOCKOPT] = "sockopt",
+	[SWRAP_STATS_IOCTL] = "ioctl",
+	[SWRAP_STATS_CLOSE] = "close",
+};
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: swrap_stats [-d DIR] [-a] [-i SECONDS]\n"
+		"\n"
+		"Prints the counters of the interfaces and sockets of the\n"
+		"processes using the socket directory DIR, which defaults to\n"
+		"SOCKET_WRAPPER_DIR. With -a closed sockets are listed too,\n"
+		"with -i the counters are printed again every SECONDS.\n");
+}
+
+static void print_counters(const uint64_t *counters)
+{
+	size_t i;
+
+	for (i = 0; i < SWRAP_STATS_NUM; i++) {
+		if (counters[i] == 0) {
+			continue;
+		}
+		printf(" %s=%llu",
+		       counter_names[i],
+		       (unsigned long long)counters[i]);
+	}
+	printf("\n");
+}
+
+static void print_process(const struct swrap_stats_header *hdr, bool all)
+{
+	const struct swrap_stats_iface *ifaces;
+	const struct swrap_stats_sock *socks;
+	struct swrap_stats_iface iface;
+	struct swrap_stats_sock sock;
+	uint32_t i;
+
+	ifaces = (const struct swrap_stats_iface *)
+		(const void *)((const uint8_t *)hdr + hdr->ifaces_offset);
+	socks = (const struct swrap_stats_sock *)
+		(const void *)((const uint8_t *)hdr + hdr->sockets_offset);
+
+	printf("pid %d\n", (int)hdr->pid);
+
+	for (i = 0; i < hdr->num_ifaces; i++) {
+		if (__atomic_load_n(&ifaces[i].key, __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+		swrap_stats_read(&ifaces[i], &iface, sizeof(iface));
+
+		printf("  iface %u:", iface.key - 1);
+		print_counters(iface.counters);
+	}
+
+	for (i = 0; i < hdr->num_sockets; i++) {
+		uint32_t state = __atomic_load_n(&socks[i].state,
+						 __ATOMIC_RELAXED);
+
+		if (state == SWRAP_STATS_SOCK_UNUSED ||
+		    (state == SWRAP_STATS_SOCK_CLOSED && !all)) {
+			continue;
+		}
+		swrap_stats_read(&socks[i], &sock, sizeof(sock));
+
+		if (sock.state == SWRAP_STATS_SOCK_CLOSED) {
+			printf("  closed");
+		} else {
+			printf("  fd %d", (int)sock.fd);
+		}
+		printf(" %s%s %u:%u",
+		       sock.type == SOCK_STREAM ? "tcp" : "udp",
+		       sock.family == AF_INET6 ? "6" : "",
+		       sock.local_iface,
+		       sock.local_port);
+		if (sock.peer_iface != 0) {
+			printf(" -> %u:%u", sock.peer_iface, sock.peer_port);
+		}
+		printf(":");
+		print_counters(sock.counters);
+	}
+}
+
+static int print_file(const char *dir, const char *name, bool all)
+{
+	const struct swrap_stats_header *hdr;
+	char path[1024];
+	struct stat st;
+	void *p;
+	int rc;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+
+	rc = fstat(fd, &st);
+	if (rc == -1 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return -1;
+	}
+	hdr = (const struct swrap_stats_header *)p;
+
+	rc = -1;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) !=
+	    SWRAP_STATS_MAGIC ||
+	    hdr->version != SWRAP_STATS_VERSION ||
+	    hdr->num_counters != SWRAP_STATS_NUM ||
+	    hdr->num_ifaces != SWRAP_STATS_IFACES ||
+	    (size_t)st.st_size < swrap_stats_size(hdr->num_sockets)) {
+		goto done;
+	}
+
+	/* Files of killed processes are left behind */
+	if (kill(hdr->pid, 0) == -1 && errno == ESRCH) {
+		rc = 0;
+		goto done;
+	}
+
+	print_process(hdr, all);
+	rc = 0;
+
+done:
+	munmap(p, st.st_size);
+
+	return rc;
+}
+
+static int print_dir(const char *dir, bool all)
+{
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(dir);
+	if (d == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (strncmp(de->d_name,
+			    SWRAP_STATS_FILE_PREFIX,
+			    strlen(SWRAP_STATS_FILE_PREFIX)) != 0) {
+			continue;
+		}
+		if (print_file(dir, de->d_name, all) == -1) {
+			fprintf(stderr, "Skipping %s/%s\n", dir, de->d_name);
+		}
+	}
+	closedir(d);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = getenv("SOCKET_WRAPPER_DIR");
+	unsigned int interval = 0;
+	bool all = false;
+	int opt;
+	int rc;
+
+	while ((opt = getopt(argc, argv, "d:ai:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'a':
+			all = true;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		default:
+			usage();
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc || dir == NULL) {
+		usage();
+		return 1;
+	}
+
+	for (;;) {
+		rc = print_dir(dir, all);
+		if (rc == -1 || interval == 0) {
+			break;
+		}
+		fflush(stdout);
+		sleep(interval);
+		printf("\n");
+	}
+
+	return rc == -1 ? 1 : 0;
+}
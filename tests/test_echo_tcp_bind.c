@@ -174,19 +174,14 @@ static void test_bind_ipv4(void **state)
 	close(s);
 }
 
-#if 0 /* TODO */
 static void test_bind_ipv4_addr_in_use(void **state)
 {
-	struct sockaddr_in sin, sin2;
-	socklen_t slen = sizeof(struct sockaddr_in);
+	struct torture_address sin2;
 	int rc;
 	int s, s2;
 
 	(void) state; /* unused */
 
-	s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	assert_return_code(s, errno);
-
 	/*
 	 * Try to bind to the same address as already bound by a
 	 * different process.
@@ -194,46 +189,38 @@ static void test_bind_ipv4_addr_in_use(void **state)
 
 	/* Without specifying the port - success */
 
-	ZERO_STRUCT(sin);
-	sin.sin_family = AF_INET;
-	rc = inet_pton(AF_INET, torture_server_address(AF_INET), &sin.sin_addr);
-	assert_int_equal(rc, 1);
-	rc = bind(s, (struct sockaddr *)&sin, slen);
-	assert_return_code(rc, errno);
+	s = torture_bind_ipv4(SOCK_STREAM, torture_server_address(AF_INET), 0);
 
 	close(s);
 
-	s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	assert_return_code(s, errno);
+	/*
+	 * Try double binding when the firs bind is with port == 0
+	 */
 
-#if 0
-	/* specify the same port - fail with EADDRINUSE. */
+	s = torture_bind_ipv4(SOCK_STREAM, "127.0.0.20", 0);
 
-	/* Not supported by socket_wrapper yet. ==> TODO! */
+	/*
+	 * Open a second socket locally and try to bind to the same address.
+	 */
 
-	ZERO_STRUCT(sin);
-	sin.sin_family = AF_INET,
-	sin.sin_port = htons(torture_server_port());
-	rc = inet_pton(AF_INET, torture_server_address(AF_INET), &sin.sin_addr);
-	assert_int_equal(rc, 1);
+	 /* Succeeds with port == 0 */
 
-	rc = bind(s, (struct sockaddr *)&sin, slen);
-	assert_int_equal(rc, -1);
-	assert_int_equal(errno, EADDRINUSE);
-#endif
+	s2 = torture_bind_ipv4(SOCK_STREAM, "127.0.0.20", 0);
 
-	/*
-	 * Try double binding when the firs bind is with port == 0
-	 */
+	close(s2);
 
-	ZERO_STRUCT(sin);
-	sin.sin_family = AF_INET;
+	/* second bind with port != 0  - succeeds */
 
-	rc = inet_pton(AF_INET, "127.0.0.20", &sin.sin_addr);
-	assert_int_equal(rc, 1);
+	s2 = torture_bind_ipv4(SOCK_STREAM, "127.0.0.20", 12345);
 
-	rc = bind(s, (struct sockaddr *)&sin, slen);
-	assert_return_code(rc, errno);
+	close(s2);
+	close(s);
+
+	/*
+	 * Try double binding when the first bind is with port != 0
+	 */
+
+	s = torture_bind_ipv4(SOCK_STREAM, "127.0.0.20", 12345);
 
 	/*
 	 * Open a second socket locally and try to bind to the same address.
@@ -241,94 +228,147 @@ static void test_bind_ipv4_addr_in_use(void **state)
 
 	 /* Succeeds with port == 0 */
 
-	s2 = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	assert_return_code(s, errno);
+	s2 = torture_bind_ipv4(SOCK_STREAM, "127.0.0.20", 0);
 
-	ZERO_STRUCT(sin2);
-	sin2.sin_family = AF_INET;
+	close(s2);
 
-	rc = inet_pton(AF_INET, "127.0.0.20", &sin2.sin_addr);
-	assert_int_equal(rc, 1);
+	/* with same port as above - fail with EADDRINUSE */
 
-	rc = bind(s2, (struct sockaddr *)&sin2, slen);
-	assert_return_code(rc, errno);
+	s2 = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	assert_return_code(s2, errno);
+
+	torture_make_addr_ipv4(&sin2, "127.0.0.20", 12345);
+
+	rc = bind(s2, &sin2.sa.s, sin2.sa_socklen);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, EADDRINUSE);
 
 	close(s2);
+	close(s);
 
-	/* second bind with port != 0  - succeeds */
+	/* The port is free again after close() */
+
+	s = torture_bind_ipv4(SOCK_STREAM, "127.0.0.20", 12345);
+
+	close(s);
+}
+
+static void test_bind_ipv4_addr_in_use_any(void **state)
+{
+	struct torture_address addr;
+	int one = 1;
+	int rc;
+	int s, s2;
+
+	(void) state; /* unused */
+
+	/* The wildcard address overlaps with every address */
+	s = torture_bind_ipv4(SOCK_STREAM, "0.0.0.0", 12346);
 
 	s2 = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	assert_return_code(s, errno);
+	assert_return_code(s2, errno);
 
-	ZERO_STRUCT(sin2);
-	sin2.sin_family = AF_INET;
-	sin2.sin_port = htons(12345);
+	torture_make_addr_ipv4(&addr, "127.0.0.21", 12346);
+	rc = bind(s2, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, EADDRINUSE);
 
-	rc = inet_pton(AF_INET, "127.0.0.20", &sin2.sin_addr);
-	assert_int_equal(rc, 1);
+	close(s2);
 
-	rc = bind(s2, (struct sockaddr *)&sin2, slen);
-	assert_return_code(rc, errno);
+	/* Different port or type don't */
+	s2 = torture_bind_ipv4(SOCK_STREAM, "127.0.0.21", 12347);
+	close(s2);
 
+	s2 = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.21", 12346);
 	close(s2);
-	close(s);
 
-	/*
-	 * Try double binding when the first bind is with port != 0
-	 */
+	close(s);
 
-	s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	assert_return_code(s, errno);
+	s = torture_bind_ipv4(SOCK_STREAM, "127.0.0.21", 12346);
 
-	ZERO_STRUCT(sin);
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(12345);
+	s2 = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	assert_return_code(s2, errno);
 
-	rc = inet_pton(AF_INET, "127.0.0.20", &sin.sin_addr);
-	assert_int_equal(rc, 1);
+	torture_make_addr_ipv4(&addr, "0.0.0.0", 12346);
+	rc = bind(s2, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, EADDRINUSE);
 
-	rc = bind(s, (struct sockaddr *)&sin, slen);
-	assert_return_code(rc, errno);
+	close(s2);
 
-	/*
-	 * Open a second socket locally and try to bind to the same address.
-	 */
+	/* Another specific address is fine */
+	s2 = torture_bind_ipv4(SOCK_STREAM, "127.0.0.22", 12346);
+	close(s2);
 
-	 /* Succeeds with port == 0 */
+	close(s);
 
-	s2 = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	/* SO_REUSEADDR, unless the bound socket is listening */
+	s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	assert_return_code(s, errno);
 
-	ZERO_STRUCT(sin2);
-	sin2.sin_family = AF_INET;
+	rc = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	assert_return_code(rc, errno);
 
-	rc = inet_pton(AF_INET, "127.0.0.20", &sin2.sin_addr);
-	assert_int_equal(rc, 1);
+	torture_make_addr_ipv4(&addr, "0.0.0.0", 12346);
+	rc = bind(s, &addr.sa.s, addr.sa_socklen);
+	assert_return_code(rc, errno);
+
+	s2 = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	assert_return_code(s2, errno);
 
-	rc = bind(s2, (struct sockaddr *)&sin2, slen);
+	rc = setsockopt(s2, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	assert_return_code(rc, errno);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", 12346);
+	rc = bind(s2, &addr.sa.s, addr.sa_socklen);
 	assert_return_code(rc, errno);
 
 	close(s2);
 
-	/* with same port as above - fail with EADDRINUSE */
+	rc = listen(s, 1);
+	assert_return_code(rc, errno);
 
 	s2 = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	assert_return_code(s2, errno);
+
+	rc = setsockopt(s2, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	assert_return_code(rc, errno);
+
+	rc = bind(s2, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, EADDRINUSE);
+
+	close(s2);
+	close(s);
+
+	/* Datagram sockets can share the port with SO_REUSEADDR */
+	s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	assert_return_code(s, errno);
 
-	ZERO_STRUCT(sin2);
-	sin2.sin_family = AF_INET;
-	sin2.sin_port = htons(12345);
+	rc = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	assert_return_code(rc, errno);
 
-	rc = inet_pton(AF_INET, "127.0.0.20", &sin2.sin_addr);
-	assert_int_equal(rc, 1);
+	torture_make_addr_ipv4(&addr, "0.0.0.0", 12346);
+	rc = bind(s, &addr.sa.s, addr.sa_socklen);
+	assert_return_code(rc, errno);
+
+	s2 = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	assert_return_code(s2, errno);
 
-	rc = bind(s2, (struct sockaddr *)&sin2, slen);
+	torture_make_addr_ipv4(&addr, "127.0.0.21", 12346);
+	rc = bind(s2, &addr.sa.s, addr.sa_socklen);
 	assert_int_equal(rc, -1);
 	assert_int_equal(errno, EADDRINUSE);
 
+	rc = setsockopt(s2, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	assert_return_code(rc, errno);
+
+	rc = bind(s2, &addr.sa.s, addr.sa_socklen);
+	assert_return_code(rc, errno);
+
+	close(s2);
 	close(s);
 }
-#endif
 
 #ifdef HAVE_BINDRESVPORT
 static void test_bindresvport_ipv4(void **state)
@@ -502,11 +542,12 @@ int main(void) {
 		cmocka_unit_test_setup_teardown(test_bind_ipv4,
 					 setup_echo_srv_tcp_ipv4,
 					 teardown),
-#if 0 /* TODO */
 		cmocka_unit_test_setup_teardown(test_bind_ipv4_addr_in_use,
 					 setup_echo_srv_tcp_ipv4,
 					 teardown),
-#endif
+		cmocka_unit_test_setup_teardown(test_bind_ipv4_addr_in_use_any,
+					 setup_echo_srv_tcp_ipv4,
+					 teardown),
 #ifdef HAVE_BINDRESVPORT
 		cmocka_unit_test_setup_teardown(test_bindresvport_ipv4,
 					 setup_echo_srv_tcp_ipv4,
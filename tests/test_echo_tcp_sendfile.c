@@ -0,0 +1,373 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define TORTURE_SENDFILE_LEN 5000
+#define TORTURE_SENDFILE_MARKER "sendfile-capture-marker"
+#define TORTURE_SPLICE_MARKER "splice-capture-marker"
+#define TORTURE_SENDFILE_MARKER_OFS 3000
+
+static int setup_echo_srv_tcp_ipv4(void **state)
+{
+	torture_setup_echo_srv_tcp_ipv4(state);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	torture_teardown_echo_srv(state);
+
+	return 0;
+}
+
+static void fill_buffer(uint8_t *buf, size_t len, const char *marker)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = (uint8_t)(i % 251);
+	}
+
+	memcpy(buf + TORTURE_SENDFILE_MARKER_OFS, marker, strlen(marker));
+}
+
+static int connect_echo_srv_ipv4(void)
+{
+	struct torture_address addr = {
+		.sa_socklen = sizeof(struct sockaddr_in),
+	};
+	int rc;
+	int s;
+
+	s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	assert_int_not_equal(s, -1);
+
+	addr.sa.in.sin_family = AF_INET;
+	addr.sa.in.sin_port = htons(torture_server_port());
+
+	rc = inet_pton(addr.sa.in.sin_family,
+		       torture_server_address(AF_INET),
+		       &addr.sa.in.sin_addr);
+	assert_int_equal(rc, 1);
+
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	return s;
+}
+
+static void read_echo(int s, const uint8_t *expected, size_t len)
+{
+	uint8_t *recv_buf;
+	size_t nread = 0;
+
+	recv_buf = malloc(len);
+	assert_non_null(recv_buf);
+
+	while (nread < len) {
+		ssize_t ret;
+
+		ret = read(s, recv_buf + nread, len - nread);
+		assert_true(ret > 0);
+
+		nread += ret;
+	}
+
+	assert_memory_equal(recv_buf, expected, len);
+
+	free(recv_buf);
+}
+
+/*
+ * Only the first test in this process may use the pcap file, the library
+ * keeps it open. Use a file of our own to not see the echo server frames.
+ */
+static const char *setup_client_pcap_file(void **state)
+{
+	struct torture_state *s = *state;
+	static char pcap_file[1024];
+
+	snprintf(pcap_file, sizeof(pcap_file), "%s/client.pcap", s->socket_dir);
+	setenv("SOCKET_WRAPPER_PCAP_FILE", pcap_file, 1);
+
+	return pcap_file;
+}
+
+static void assert_pcap_contains_marker(const char *pcap_file,
+					const char *marker)
+{
+	char *pcap;
+	size_t len = 0;
+	FILE *fp;
+
+	fp = fopen(pcap_file, "r");
+	assert_non_null(fp);
+
+	pcap = malloc(1024 * 1024);
+	assert_non_null(pcap);
+
+	len = fread(pcap, 1, 1024 * 1024, fp);
+	fclose(fp);
+
+	assert_non_null(memmem(pcap, len, marker, strlen(marker)));
+
+	free(pcap);
+}
+
+static int create_payload_file(uint8_t *buf, size_t len)
+{
+	char path[] = "/tmp/swrap_sendfile_XXXXXX";
+	ssize_t ret;
+	int fd;
+
+	fd = mkstemp(path);
+	assert_int_not_equal(fd, -1);
+	unlink(path);
+
+	ret = write(fd, buf, len);
+	assert_int_equal(ret, len);
+
+	return fd;
+}
+
+#ifdef HAVE_SENDFILE
+static void test_zero_copy_capture_ipv4(void **state)
+{
+	uint8_t send_buf[TORTURE_SENDFILE_LEN];
+	const char *pcap_file;
+	off_t offset = 0;
+	int fd;
+	int s;
+
+	pcap_file = setup_client_pcap_file(state);
+
+	fill_buffer(send_buf, sizeof(send_buf), TORTURE_SENDFILE_MARKER);
+	fd = create_payload_file(send_buf, sizeof(send_buf));
+
+	s = connect_echo_srv_ipv4();
+
+	while (offset < (off_t)sizeof(send_buf)) {
+		ssize_t ret;
+
+		ret = sendfile(s, fd, &offset, sizeof(send_buf) - offset);
+		assert_true(ret > 0);
+	}
+
+	/* Check before reading the echo, so only the sent frames count */
+	assert_pcap_contains_marker(pcap_file, TORTURE_SENDFILE_MARKER);
+
+	read_echo(s, send_buf, sizeof(send_buf));
+	close(fd);
+
+#ifdef HAVE_SPLICE
+	{
+		size_t nsent = 0;
+		ssize_t ret;
+		int p[2];
+		int rc;
+
+		fill_buffer(send_buf, sizeof(send_buf), TORTURE_SPLICE_MARKER);
+
+		rc = pipe(p);
+		assert_int_equal(rc, 0);
+
+		ret = write(p[1], send_buf, sizeof(send_buf));
+		assert_int_equal(ret, sizeof(send_buf));
+
+		while (nsent < sizeof(send_buf)) {
+			ret = splice(p[0],
+				     NULL,
+				     s,
+				     NULL,
+				     sizeof(send_buf) - nsent,
+				     0);
+			assert_true(ret > 0);
+
+			nsent += ret;
+		}
+
+		assert_pcap_contains_marker(pcap_file, TORTURE_SPLICE_MARKER);
+
+		read_echo(s, send_buf, sizeof(send_buf));
+
+		close(p[0]);
+		close(p[1]);
+	}
+#endif /* HAVE_SPLICE */
+
+	close(s);
+}
+
+static void test_sendfile_ipv4(void **state)
+{
+	uint8_t send_buf[TORTURE_SENDFILE_LEN];
+	off_t offset = 0;
+	int fd;
+	int s;
+
+	(void) state; /* unused */
+
+	fill_buffer(send_buf, sizeof(send_buf), TORTURE_SENDFILE_MARKER);
+	fd = create_payload_file(send_buf, sizeof(send_buf));
+
+	s = connect_echo_srv_ipv4();
+
+	while (offset < (off_t)sizeof(send_buf)) {
+		ssize_t ret;
+
+		ret = sendfile(s, fd, &offset, sizeof(send_buf) - offset);
+		assert_true(ret > 0);
+	}
+	assert_int_equal(offset, sizeof(send_buf));
+
+	/* The file position must not be touched if an offset is given */
+	assert_int_equal(lseek(fd, 0, SEEK_CUR), sizeof(send_buf));
+
+	read_echo(s, send_buf, sizeof(send_buf));
+
+	close(s);
+	close(fd);
+}
+
+static void test_sendfile_file_position_ipv4(void **state)
+{
+	uint8_t send_buf[TORTURE_SENDFILE_LEN];
+	size_t nsent = 0;
+	off_t ofs;
+	int fd;
+	int s;
+
+	(void) state; /* unused */
+
+	fill_buffer(send_buf, sizeof(send_buf), TORTURE_SENDFILE_MARKER);
+	fd = create_payload_file(send_buf, sizeof(send_buf));
+
+	ofs = lseek(fd, 0, SEEK_SET);
+	assert_int_equal(ofs, 0);
+
+	s = connect_echo_srv_ipv4();
+
+	while (nsent < sizeof(send_buf)) {
+		ssize_t ret;
+
+		ret = sendfile(s, fd, NULL, sizeof(send_buf) - nsent);
+		assert_true(ret > 0);
+
+		nsent += ret;
+	}
+	assert_int_equal(lseek(fd, 0, SEEK_CUR), sizeof(send_buf));
+
+	read_echo(s, send_buf, sizeof(send_buf));
+
+	close(s);
+	close(fd);
+}
+
+static void test_sendfile_not_connected_ipv4(void **state)
+{
+	uint8_t send_buf[64] = {0};
+	off_t offset = 0;
+	ssize_t ret;
+	int fd;
+	int s;
+
+	(void) state; /* unused */
+
+	fd = create_payload_file(send_buf, sizeof(send_buf));
+
+	s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	assert_int_not_equal(s, -1);
+
+	ret = sendfile(s, fd, &offset, sizeof(send_buf));
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, ENOTCONN);
+
+	close(s);
+	close(fd);
+}
+#endif /* HAVE_SENDFILE */
+
+#ifdef HAVE_SPLICE
+static void test_splice_ipv4(void **state)
+{
+	uint8_t send_buf[TORTURE_SENDFILE_LEN];
+	size_t nsent = 0;
+	ssize_t ret;
+	int p[2];
+	int rc;
+	int s;
+
+	(void) state; /* unused */
+
+	fill_buffer(send_buf, sizeof(send_buf), TORTURE_SENDFILE_MARKER);
+
+	rc = pipe(p);
+	assert_int_equal(rc, 0);
+
+	ret = write(p[1], send_buf, sizeof(send_buf));
+	assert_int_equal(ret, sizeof(send_buf));
+
+	s = connect_echo_srv_ipv4();
+
+	while (nsent < sizeof(send_buf)) {
+		ret = splice(p[0], NULL, s, NULL, sizeof(send_buf) - nsent, 0);
+		assert_true(ret > 0);
+
+		nsent += ret;
+	}
+
+	read_echo(s, send_buf, sizeof(send_buf));
+
+	close(s);
+	close(p[0]);
+	close(p[1]);
+}
+#endif /* HAVE_SPLICE */
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest tcp_sendfile_tests[] = {
+#ifdef HAVE_SENDFILE
+		cmocka_unit_test_setup_teardown(test_zero_copy_capture_ipv4,
+						setup_echo_srv_tcp_ipv4,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_sendfile_ipv4,
+						setup_echo_srv_tcp_ipv4,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_sendfile_file_position_ipv4,
+						setup_echo_srv_tcp_ipv4,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_sendfile_not_connected_ipv4,
+						setup_echo_srv_tcp_ipv4,
+						teardown),
+#endif
+#ifdef HAVE_SPLICE
+		cmocka_unit_test_setup_teardown(test_splice_ipv4,
+						setup_echo_srv_tcp_ipv4,
+						teardown),
+#endif
+	};
+
+	rc = cmocka_run_group_tests(tcp_sendfile_tests, NULL, NULL);
+
+	return rc;
+}
@@ -0,0 +1,234 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_ACCEPT_COUNT 10
+#define TORTURE_ACCEPT_BENCH_COUNT 5000
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static int listen_ipv4(const char *ip, int port)
+{
+	int rc;
+	int s;
+
+	s = torture_bind_ipv4(SOCK_STREAM, ip, port);
+
+	rc = listen(s, 16);
+	assert_int_equal(rc, 0);
+
+	return s;
+}
+
+static int connect_ipv4(const char *cli_ip, const char *srv_ip, int port)
+{
+	struct torture_address addr;
+	int rc;
+	int s;
+
+	if (cli_ip != NULL) {
+		s = torture_bind_ipv4(SOCK_STREAM, cli_ip, 0);
+	} else {
+		s = socket(AF_INET, SOCK_STREAM, 0);
+		assert_int_not_equal(s, -1);
+	}
+
+	torture_make_addr_ipv4(&addr, srv_ip, port);
+
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	return s;
+}
+
+static void assert_name_ipv4(const struct torture_address *addr,
+			     const char *ip,
+			     int port)
+{
+	char str[INET_ADDRSTRLEN];
+
+	assert_int_equal(addr->sa_socklen, sizeof(struct sockaddr_in));
+	assert_int_equal(addr->sa.in.sin_family, AF_INET);
+
+	inet_ntop(AF_INET, &addr->sa.in.sin_addr, str, sizeof(str));
+	assert_string_equal(str, ip);
+
+	if (port != 0) {
+		assert_int_equal(ntohs(addr->sa.in.sin_port), port);
+	}
+}
+
+static void test_accept_names(void **state)
+{
+	int listener;
+	int i;
+
+	(void) state; /* unused */
+
+	listener = listen_ipv4("127.0.0.21", 7051);
+
+	/* Every accepted socket needs the right names, not only the first */
+	for (i = 0; i < TORTURE_ACCEPT_COUNT; i++) {
+		struct torture_address cli_name = {
+			.sa_socklen = sizeof(struct sockaddr_storage),
+		};
+		struct torture_address peer = {
+			.sa_socklen = sizeof(struct sockaddr_storage),
+		};
+		struct torture_address name = {
+			.sa_socklen = sizeof(struct sockaddr_storage),
+		};
+		char cli_ip[INET_ADDRSTRLEN];
+		int cli, srv;
+		int rc;
+
+		snprintf(cli_ip, sizeof(cli_ip), "127.0.0.%d", 30 + i);
+		cli = connect_ipv4(cli_ip, "127.0.0.21", 7051);
+
+		rc = getsockname(cli, &cli_name.sa.s, &cli_name.sa_socklen);
+		assert_int_equal(rc, 0);
+
+		srv = accept(listener, &peer.sa.s, &peer.sa_socklen);
+		assert_int_not_equal(srv, -1);
+
+		assert_name_ipv4(&peer, cli_ip, ntohs(cli_name.sa.in.sin_port));
+
+		rc = getsockname(srv, &name.sa.s, &name.sa_socklen);
+		assert_int_equal(rc, 0);
+		assert_name_ipv4(&name, "127.0.0.21", 7051);
+
+		peer.sa_socklen = sizeof(struct sockaddr_storage);
+		rc = getpeername(srv, &peer.sa.s, &peer.sa_socklen);
+		assert_int_equal(rc, 0);
+		assert_name_ipv4(&peer, cli_ip, ntohs(cli_name.sa.in.sin_port));
+
+		close(srv);
+		close(cli);
+	}
+
+	close(listener);
+}
+
+static void test_accept_any(void **state)
+{
+	int listener;
+	int i;
+
+	(void) state; /* unused */
+
+	/* A listener on INADDR_ANY uses the default interface */
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "23", 1);
+	listener = listen_ipv4("0.0.0.0", 7052);
+
+	for (i = 0; i < 2; i++) {
+		struct torture_address name = {
+			.sa_socklen = sizeof(struct sockaddr_storage),
+		};
+		int cli, srv;
+		int rc;
+
+		cli = connect_ipv4(NULL, "127.0.0.23", 7052);
+
+		srv = accept(listener, NULL, NULL);
+		assert_int_not_equal(srv, -1);
+
+		rc = getsockname(srv, &name.sa.s, &name.sa_socklen);
+		assert_int_equal(rc, 0);
+		assert_name_ipv4(&name, "127.0.0.23", 7052);
+
+		close(srv);
+		close(cli);
+	}
+
+	close(listener);
+}
+
+static void test_accept_benchmark(void **state)
+{
+	uint64_t start, elapsed;
+	uint64_t in_connect = 0;
+	uint64_t in_accept = 0;
+	int listener;
+	int i;
+
+	(void) state; /* unused */
+
+	listener = listen_ipv4("127.0.0.22", 7053);
+
+	start = torture_now_usec();
+	for (i = 0; i < TORTURE_ACCEPT_BENCH_COUNT; i++) {
+		uint64_t t;
+		int cli, srv;
+
+		/* An unbound socket, so connect() needs to autobind */
+		t = torture_now_usec();
+		cli = connect_ipv4(NULL, "127.0.0.22", 7053);
+		in_connect += torture_now_usec() - t;
+
+		t = torture_now_usec();
+		srv = accept(listener, NULL, NULL);
+		in_accept += torture_now_usec() - t;
+		assert_int_not_equal(srv, -1);
+
+		close(srv);
+		close(cli);
+	}
+	elapsed = torture_now_usec() - start;
+
+	printf("Accept rate: %.0f connections/s, "
+	       "%.2f us per socket() and connect(), %.2f us per accept()\n",
+	       TORTURE_ACCEPT_BENCH_COUNT * 1000000.0 / (elapsed + 1),
+	       (double)in_connect / TORTURE_ACCEPT_BENCH_COUNT,
+	       (double)in_accept / TORTURE_ACCEPT_BENCH_COUNT);
+
+	close(listener);
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest accept_tests[] = {
+		cmocka_unit_test_setup_teardown(test_accept_names,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_accept_any,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_accept_benchmark,
+						setup,
+						teardown),
+	};
+
+	rc = cmocka_run_group_tests(accept_tests, NULL, NULL);
+
+	return rc;
+}
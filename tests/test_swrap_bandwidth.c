@@ -0,0 +1,216 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_BANDWIDTH_RULES "31-32=16mbit@16k,33-34=8mbit@4k"
+
+/* 16 Mbit/s */
+#define TORTURE_TCP_RATE (16.0 * 1000 * 1000)
+#define TORTURE_TCP_TOTAL (2 * 1024 * 1024)
+#define TORTURE_TCP_CHUNK (64 * 1024)
+
+struct torture_reader {
+	int fd;
+	size_t total;
+	size_t first;
+	uint64_t first_usec;
+	uint64_t last_usec;
+};
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct torture_reader *r = (struct torture_reader *)arg;
+	uint8_t buf[TORTURE_TCP_CHUNK];
+	size_t nread = 0;
+
+	while (nread < r->total) {
+		ssize_t ret;
+
+		ret = read(r->fd, buf, sizeof(buf));
+		if (ret <= 0) {
+			break;
+		}
+
+		if (nread == 0) {
+			r->first = ret;
+			r->first_usec = torture_now_usec();
+		}
+		nread += ret;
+	}
+	r->last_usec = torture_now_usec();
+
+	return NULL;
+}
+
+/*
+ * This doubles as benchmark, the measured rate is printed to be compared
+ * with the configured one. It depends on the load of the machine, so it
+ * isn't checked.
+ */
+static void test_bandwidth_tcp_rate(void **state)
+{
+	struct torture_reader r = {
+		.total = TORTURE_TCP_TOTAL,
+	};
+	uint8_t buf[TORTURE_TCP_CHUNK];
+	int listener, cli;
+	size_t nsent = 0;
+	uint64_t start_usec;
+	uint64_t send_usec;
+	pthread_t t;
+	double rate;
+	int rc;
+
+	(void) state; /* unused */
+
+	memset(buf, 0xAA, sizeof(buf));
+
+	listener = torture_bind_ipv4(SOCK_STREAM, "127.0.0.32", 7011);
+	rc = listen(listener, 1);
+	assert_int_equal(rc, 0);
+
+	cli = torture_bind_ipv4(SOCK_STREAM, "127.0.0.31", 0);
+	torture_connect_ipv4(cli, "127.0.0.32", 7011);
+
+	r.fd = accept(listener, NULL, NULL);
+	assert_int_not_equal(r.fd, -1);
+
+	rc = pthread_create(&t, NULL, reader_thread, &r);
+	assert_int_equal(rc, 0);
+
+	start_usec = torture_now_usec();
+	while (nsent < TORTURE_TCP_TOTAL) {
+		ssize_t ret;
+
+		ret = write(cli, buf, sizeof(buf));
+		assert_true(ret > 0);
+
+		nsent += ret;
+	}
+	send_usec = torture_now_usec() - start_usec;
+
+	rc = pthread_join(t, NULL);
+	assert_int_equal(rc, 0);
+
+	rate = (double)(TORTURE_TCP_TOTAL - r.first) * 8 * 1000000 /
+	       (double)(r.last_usec - r.first_usec);
+
+	printf("tcp: %.2f Mbit/s (configured %.2f Mbit/s)\n",
+	       rate / 1000000, TORTURE_TCP_RATE / 1000000);
+
+	/*
+	 * The blocking writer is paced, only the last chunk may be early. A
+	 * loaded machine only makes it slower.
+	 */
+	assert_true((double)send_usec >=
+		    (double)(TORTURE_TCP_TOTAL - TORTURE_TCP_CHUNK - 16 * 1024) *
+		    8 * 1000000 / TORTURE_TCP_RATE * 0.8);
+
+	close(cli);
+	close(r.fd);
+	close(listener);
+}
+
+static void test_bandwidth_nonblocking(void **state)
+{
+	uint8_t buf[1000];
+	struct pollfd pfd;
+	int srv, cli;
+	int flags;
+	int count;
+	int rc;
+
+	(void) state; /* unused */
+
+	memset(buf, 0x55, sizeof(buf));
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.34", 7012);
+	cli = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.33", 7012);
+	torture_connect_ipv4(cli, "127.0.0.34", 7012);
+
+	flags = fcntl(cli, F_GETFL);
+	rc = fcntl(cli, F_SETFL, flags | O_NONBLOCK);
+	assert_int_equal(rc, 0);
+
+	/* At 1MB/s the queue fills up long before it gets drained */
+	for (count = 0; count < 10000; count++) {
+		ssize_t ret;
+
+		ret = send(cli, buf, sizeof(buf), 0);
+		if (ret == -1) {
+			assert_int_equal(errno, EAGAIN);
+			break;
+		}
+		assert_int_equal(ret, sizeof(buf));
+	}
+	assert_true(count > 0);
+	assert_true(count < 10000);
+
+	/* The socket must not be reported writable while throttled */
+	pfd.fd = cli;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+
+	rc = poll(&pfd, 1, 0);
+	assert_int_equal(rc, 0);
+
+	/* ... but as soon as the shaper made room */
+	rc = poll(&pfd, 1, 2000);
+	assert_int_equal(rc, 1);
+	assert_true(pfd.revents & POLLOUT);
+
+	rc = send(cli, buf, sizeof(buf), 0);
+	assert_int_equal(rc, sizeof(buf));
+
+	close(cli);
+	close(srv);
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest bandwidth_tests[] = {
+		cmocka_unit_test_setup_teardown(test_bandwidth_tcp_rate,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_bandwidth_nonblocking,
+						setup,
+						teardown),
+	};
+
+	setenv("SOCKET_WRAPPER_BANDWIDTH", TORTURE_BANDWIDTH_RULES, 1);
+
+	rc = cmocka_run_group_tests(bandwidth_tests, NULL, NULL);
+
+	return rc;
+}
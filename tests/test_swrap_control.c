@@ -0,0 +1,248 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_CONTROL_PORT 7141
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "20", 1);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static void control_path(char *path, size_t size, pid_t pid)
+{
+	snprintf(path, size, "%s/.control-%d",
+		 getenv("SOCKET_WRAPPER_DIR"), (int)pid);
+}
+
+/* Sends the command and returns the answer up to the ok or error line */
+static void control(pid_t pid, const char *cmd, char *answer, size_t size)
+{
+	struct torture_address un = {
+		.sa_socklen = sizeof(struct sockaddr_un),
+	};
+	size_t len = 0;
+	ssize_t ret;
+	int rc;
+	int s;
+
+	un.sa.un.sun_family = AF_UNIX;
+	control_path(un.sa.un.sun_path, sizeof(un.sa.un.sun_path), pid);
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+
+	rc = connect(s, &un.sa.s, un.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	ret = write(s, cmd, strlen(cmd));
+	assert_int_equal(ret, strlen(cmd));
+	ret = write(s, "\n", 1);
+	assert_int_equal(ret, 1);
+
+	for (;;) {
+		const char *last;
+
+		ret = read(s, answer + len, size - 1 - len);
+		assert_true(ret > 0);
+		len += ret;
+		answer[len] = '\0';
+
+		if (len < 1 || answer[len - 1] != '\n') {
+			continue;
+		}
+
+		/* The start of the last line */
+		last = answer + len - 1;
+		while (last > answer && last[-1] != '\n') {
+			last--;
+		}
+		if (strncmp(last, "ok", 2) == 0 ||
+		    strncmp(last, "error", 5) == 0) {
+			break;
+		}
+	}
+
+	close(s);
+}
+
+static void test_control_list(void **state)
+{
+	struct torture_address addr;
+	char buf[] = "control";
+	char rbuf[sizeof(buf)];
+	char answer[4096];
+	char expect[256];
+	ssize_t ret;
+	int srv, s;
+	int rc;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.21", TORTURE_CONTROL_PORT);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_CONTROL_PORT);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	ret = send(s, buf, sizeof(buf), 0);
+	assert_int_equal(ret, sizeof(buf));
+	ret = recv(srv, rbuf, sizeof(rbuf), 0);
+	assert_int_equal(ret, sizeof(buf));
+
+	control(getpid(), "list", answer, sizeof(answer));
+
+	snprintf(expect, sizeof(expect),
+		 "fd %d inet dgram myname 127.0.0.21:%d peername - bound "
+		 "bytes_out 0 bytes_in %zu packets_out 0 packets_in 1",
+		 srv, TORTURE_CONTROL_PORT, sizeof(buf));
+	assert_non_null(strstr(answer, expect));
+
+	snprintf(expect, sizeof(expect),
+		 "fd %d inet dgram myname 127.0.0.20:",
+		 s);
+	assert_non_null(strstr(answer, expect));
+	snprintf(expect, sizeof(expect),
+		 "peername 127.0.0.21:%d connected bytes_out %zu",
+		 TORTURE_CONTROL_PORT, sizeof(buf));
+	assert_non_null(strstr(answer, expect));
+
+	/* Nothing to flush or to dump in this test */
+	control(getpid(), "flush pcap", answer, sizeof(answer));
+	assert_string_equal(answer, "error no pcap file\n");
+
+	control(getpid(), "dump histograms", answer, sizeof(answer));
+	assert_string_equal(answer,
+			    "error SOCKET_WRAPPER_PROFILE is not set\n");
+
+	control(getpid(), "hello", answer, sizeof(answer));
+	assert_string_equal(answer, "error unknown command\n");
+
+	close(s);
+	close(srv);
+}
+
+static void test_control_blocked(void **state)
+{
+	struct torture_address addr;
+	char buf[] = "wake up";
+	char answer[4096];
+	char path[1024];
+	char expect[256];
+	struct stat st;
+	ssize_t ret;
+	pid_t pid;
+	int status;
+	int pfd[2];
+	int rc;
+	int s;
+
+	(void) state; /* unused */
+
+	rc = pipe(pfd);
+	assert_int_equal(rc, 0);
+
+	fflush(stdout);
+	pid = fork();
+	assert_int_not_equal(pid, -1);
+
+	if (pid == 0) {
+		char rbuf[sizeof(buf)];
+		int srv;
+
+		close(pfd[0]);
+
+		srv = torture_bind_ipv4(SOCK_DGRAM,
+					"127.0.0.22",
+					TORTURE_CONTROL_PORT);
+		ret = write(pfd[1], "x", 1);
+
+		/* Hangs until the parent sends something */
+		ret = recv(srv, rbuf, sizeof(rbuf), 0);
+		/* exit() runs the destructor */
+		exit(ret == sizeof(buf) ? 0 : 1);
+	}
+
+	close(pfd[1]);
+	ret = read(pfd[0], answer, 1);
+	assert_int_equal(ret, 1);
+	close(pfd[0]);
+
+	/* The child listens on its own control socket */
+	control_path(path, sizeof(path), pid);
+	rc = stat(path, &st);
+	assert_int_equal(rc, 0);
+	assert_true(S_ISSOCK(st.st_mode));
+
+	control(pid, "list", answer, sizeof(answer));
+	snprintf(expect, sizeof(expect),
+		 "inet dgram myname 127.0.0.22:%d peername - bound",
+		 TORTURE_CONTROL_PORT);
+	assert_non_null(strstr(answer, expect));
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+	torture_make_addr_ipv4(&addr, "127.0.0.22", TORTURE_CONTROL_PORT);
+	ret = sendto(s, buf, sizeof(buf), 0, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(ret, sizeof(buf));
+	close(s);
+
+	rc = waitpid(pid, &status, 0);
+	assert_int_equal(rc, pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+
+	/* The socket is gone with the process */
+	rc = stat(path, &st);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, ENOENT);
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest control_tests[] = {
+		cmocka_unit_test(test_control_list),
+		cmocka_unit_test(test_control_blocked),
+	};
+
+	setenv("SOCKET_WRAPPER_CONTROL", "1", 1);
+	setenv("SOCKET_WRAPPER_STATS", "1", 1);
+
+	rc = cmocka_run_group_tests(control_tests, setup, teardown);
+
+	return rc;
+}
@@ -0,0 +1,278 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_FAULT_RULES \
+	"51-52=short:50%," \
+	"53-54=reset:10000," \
+	"55-56=eagain:20%x3," \
+	"57-58=stall:100%@20ms"
+
+struct torture_conn {
+	int listener;
+	int srv;
+	int cli;
+};
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static void open_conn(struct torture_conn *c,
+		      const char *cli_ip,
+		      const char *srv_ip,
+		      int port)
+{
+	int rc;
+
+	c->listener = torture_bind_ipv4(SOCK_STREAM, srv_ip, port);
+	rc = listen(c->listener, 1);
+	assert_int_equal(rc, 0);
+
+	c->cli = torture_bind_ipv4(SOCK_STREAM, cli_ip, 0);
+	torture_connect_ipv4(c->cli, srv_ip, port);
+
+	c->srv = accept(c->listener, NULL, NULL);
+	assert_int_not_equal(c->srv, -1);
+}
+
+static void close_conn(struct torture_conn *c)
+{
+	close(c->cli);
+	close(c->srv);
+	close(c->listener);
+}
+
+static void set_nonblock(int s)
+{
+	int flags;
+	int rc;
+
+	flags = fcntl(s, F_GETFL);
+	rc = fcntl(s, F_SETFL, flags | O_NONBLOCK);
+	assert_int_equal(rc, 0);
+}
+
+static void test_fault_short(void **state)
+{
+	struct torture_conn c;
+	uint8_t out[1000];
+	uint8_t in[sizeof(out)];
+	int shorts = 0;
+	int i;
+
+	(void) state; /* unused */
+
+	open_conn(&c, "127.0.0.51", "127.0.0.52", 7031);
+
+	for (i = 0; i < 50; i++) {
+		size_t nread = 0;
+		ssize_t ret;
+
+		memset(out, i, sizeof(out));
+
+		ret = write(c.cli, out, sizeof(out));
+		assert_true(ret > 0);
+		if (ret < (ssize_t)sizeof(out)) {
+			shorts++;
+		}
+
+		/* The data needs to arrive intact, maybe in pieces */
+		while (nread < (size_t)ret) {
+			ssize_t n;
+
+			n = read(c.srv, in + nread, ret - nread);
+			assert_true(n > 0);
+			nread += n;
+		}
+		assert_memory_equal(in, out, ret);
+	}
+
+	/* 50% of the writes are cut short */
+	assert_true(shorts >= 10);
+	assert_true(shorts <= 40);
+
+	close_conn(&c);
+}
+
+static void test_fault_reset(void **state)
+{
+	struct torture_conn c;
+	uint8_t buf[4000];
+	size_t total = 0;
+	ssize_t ret;
+
+	(void) state; /* unused */
+
+	memset(buf, 0x42, sizeof(buf));
+
+	open_conn(&c, "127.0.0.53", "127.0.0.54", 7032);
+
+	for (;;) {
+		ret = write(c.cli, buf, sizeof(buf));
+		if (ret == -1) {
+			break;
+		}
+		total += ret;
+	}
+	assert_int_equal(errno, ECONNRESET);
+	assert_int_equal(total, 10000);
+
+	/* The receiver sees the reset at the same position */
+	total = 0;
+	for (;;) {
+		ret = read(c.srv, buf, sizeof(buf));
+		if (ret <= 0) {
+			break;
+		}
+		total += ret;
+	}
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, ECONNRESET);
+	assert_int_equal(total, 10000);
+
+	/* A reset connection stays dead */
+	ret = write(c.srv, buf, 1);
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, ECONNRESET);
+
+	close_conn(&c);
+}
+
+static void test_fault_eagain(void **state)
+{
+	struct torture_conn c;
+	uint8_t buf[100];
+	int eagain = 0;
+	int burst = 0;
+	int i;
+
+	(void) state; /* unused */
+
+	memset(buf, 0x23, sizeof(buf));
+
+	open_conn(&c, "127.0.0.55", "127.0.0.56", 7033);
+	set_nonblock(c.cli);
+
+	for (i = 0; i < 200; i++) {
+		ssize_t ret;
+
+		ret = write(c.cli, buf, sizeof(buf));
+		if (ret == -1) {
+			assert_int_equal(errno, EAGAIN);
+			eagain++;
+			burst++;
+			continue;
+		}
+		assert_int_equal(ret, sizeof(buf));
+
+		/* The bursts are three calls long, but might follow each other */
+		assert_int_equal(burst % 3, 0);
+		burst = 0;
+	}
+
+	assert_true(eagain > 0);
+
+	close_conn(&c);
+}
+
+static void test_fault_stall(void **state)
+{
+	struct torture_conn c;
+	struct pollfd pfd;
+	uint8_t buf[100];
+	uint64_t start;
+	ssize_t ret;
+	int rc;
+	int i;
+
+	(void) state; /* unused */
+
+	memset(buf, 0x17, sizeof(buf));
+
+	open_conn(&c, "127.0.0.57", "127.0.0.58", 7034);
+
+	/* Every write stalls for 20ms */
+	start = torture_now_usec();
+	for (i = 0; i < 5; i++) {
+		ret = write(c.cli, buf, sizeof(buf));
+		assert_int_equal(ret, sizeof(buf));
+	}
+	assert_true(torture_now_usec() - start >= 5 * 20000);
+
+	/* A non-blocking socket is not writable while stalled */
+	set_nonblock(c.cli);
+
+	ret = write(c.cli, buf, sizeof(buf));
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, EAGAIN);
+
+	pfd.fd = c.cli;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+
+	rc = poll(&pfd, 1, 0);
+	assert_int_equal(rc, 0);
+
+	start = torture_now_usec();
+	rc = poll(&pfd, 1, 1000);
+	assert_int_equal(rc, 1);
+	assert_true(pfd.revents & POLLOUT);
+	assert_true(torture_now_usec() - start >= 10000);
+
+	ret = write(c.cli, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	close_conn(&c);
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest fault_tests[] = {
+		cmocka_unit_test_setup_teardown(test_fault_short,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_fault_reset,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_fault_eagain,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_fault_stall,
+						setup,
+						teardown),
+	};
+
+	setenv("SOCKET_WRAPPER_FAULTS", TORTURE_FAULT_RULES, 1);
+	setenv("SOCKET_WRAPPER_SEED", "4711", 1);
+
+	rc = cmocka_run_group_tests(fault_tests, NULL, NULL);
+
+	return rc;
+}
@@ -0,0 +1,275 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_FLOWS_PORT 7151
+#define TORTURE_FLOWS_BENCH_COUNT 10000
+
+static char flows_path[] = "/tmp/swrap_flows_XXXXXX";
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "20", 1);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+/* The line of the process with all the given strings */
+static bool flow_line(pid_t pid,
+		      const char *a,
+		      const char *b,
+		      char *line,
+		      size_t size)
+{
+	char key[32];
+	char buf[1024];
+	bool found = false;
+	FILE *fp;
+
+	snprintf(key, sizeof(key), "{\"pid\":%d,", (int)pid);
+
+	fp = fopen(flows_path, "r");
+	assert_non_null(fp);
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if (strncmp(buf, key, strlen(key)) == 0 &&
+		    strstr(buf, a) != NULL &&
+		    strstr(buf, b) != NULL) {
+			snprintf(line, size, "%s", buf);
+			found = true;
+			break;
+		}
+	}
+	fclose(fp);
+
+	return found;
+}
+
+static void flows_child(void)
+{
+	struct torture_address addr;
+	struct torture_address from = {
+		.sa_socklen = sizeof(struct sockaddr_storage),
+	};
+	char buf[100];
+	char big[1000];
+	ssize_t ret;
+	int listener, srv, s, u;
+	int rc;
+	int i;
+
+	memset(buf, 'u', sizeof(buf));
+	memset(big, 't', sizeof(big));
+
+	/* Three datagrams and one to nobody */
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.21", TORTURE_FLOWS_PORT);
+
+	u = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(u, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_FLOWS_PORT);
+	for (i = 0; i < 3; i++) {
+		ret = sendto(u, buf, sizeof(buf), 0,
+			     &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+
+		ret = recvfrom(srv, buf, sizeof(buf), 0,
+			       &from.sa.s, &from.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+	}
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_FLOWS_PORT + 1);
+	ret = sendto(u, buf, sizeof(buf), 0, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(ret, -1);
+
+	/* Two segments on a connection */
+	listener = torture_bind_ipv4(SOCK_STREAM,
+				     "127.0.0.21",
+				     TORTURE_FLOWS_PORT);
+	rc = listen(listener, 5);
+	assert_int_equal(rc, 0);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_FLOWS_PORT);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	srv = accept(listener, NULL, NULL);
+	assert_int_not_equal(srv, -1);
+
+	for (i = 0; i < 2; i++) {
+		ret = write(s, big, sizeof(big));
+		assert_int_equal(ret, sizeof(big));
+	}
+	for (i = 0; i < 2 * (int)sizeof(big); i += ret) {
+		ret = read(srv, big, sizeof(big));
+		assert_true(ret > 0);
+	}
+}
+
+static void test_flows_exit(void **state)
+{
+	unsigned long long v;
+	char line[1024];
+	const char *p;
+	pid_t pid;
+	int status;
+	int rc;
+
+	(void) state; /* unused */
+
+	fflush(stdout);
+	pid = fork();
+	assert_int_not_equal(pid, -1);
+
+	if (pid == 0) {
+		flows_child();
+		/* exit() runs the destructor which writes the report */
+		exit(0);
+	}
+
+	rc = waitpid(pid, &status, 0);
+	assert_int_equal(rc, pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+
+	/* The client of the datagrams */
+	assert_true(flow_line(pid, "\"proto\":\"udp\"",
+			      "\"peer\":\"127.0.0.21:7151\"",
+			      line, sizeof(line)));
+	assert_non_null(strstr(line, "\"local\":\"127.0.0.20:"));
+	assert_non_null(strstr(line,
+			       "\"bytes_out\":300,\"bytes_in\":0,"
+			       "\"packets_out\":3,\"packets_in\":0,"
+			       "\"avg_segment_out\":100,"));
+	assert_non_null(strstr(line, "\"unreach\":0,\"reset\":0}"));
+
+	p = strstr(line, "\"first_usec\":");
+	assert_non_null(p);
+	rc = sscanf(p, "\"first_usec\":%llu", &v);
+	assert_int_equal(rc, 1);
+	assert_true(v > 0);
+
+	/* The server saw the same traffic */
+	assert_true(flow_line(pid, "\"proto\":\"udp\",\"local\":\"127.0.0.21:7151\"",
+			      "\"bytes_out\":0,\"bytes_in\":300,",
+			      line, sizeof(line)));
+	assert_non_null(strstr(line, "\"peer\":\"127.0.0.20:"));
+
+	/* The datagram to nobody */
+	assert_true(flow_line(pid, "\"peer\":\"127.0.0.21:7152\"",
+			      "\"unreach\":1,",
+			      line, sizeof(line)));
+
+	/* The connection in both directions */
+	assert_true(flow_line(pid, "\"proto\":\"tcp\"",
+			      "\"peer\":\"127.0.0.21:7151\"",
+			      line, sizeof(line)));
+	assert_non_null(strstr(line,
+			       "\"bytes_out\":2000,\"bytes_in\":0,"
+			       "\"packets_out\":2,"));
+	assert_non_null(strstr(line, "\"avg_segment_out\":1000,"));
+
+	assert_true(flow_line(pid, "\"proto\":\"tcp\",\"local\":\"127.0.0.21:7151\"",
+			      "\"bytes_in\":2000,",
+			      line, sizeof(line)));
+
+	/* The parent didn't report anything yet */
+	assert_false(flow_line(getpid(), "pid", "pid", line, sizeof(line)));
+}
+
+static void test_flows_benchmark(void **state)
+{
+	struct torture_address addr;
+	char buf[] = "bench";
+	char rbuf[sizeof(buf)];
+	uint64_t start, elapsed;
+	ssize_t ret;
+	int srv, s;
+	int i;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.21", TORTURE_FLOWS_PORT);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_FLOWS_PORT);
+
+	start = torture_now_usec();
+	for (i = 0; i < TORTURE_FLOWS_BENCH_COUNT; i++) {
+		ret = sendto(s, buf, sizeof(buf), 0,
+			     &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+
+		ret = recv(srv, rbuf, sizeof(rbuf), 0);
+		assert_int_equal(ret, sizeof(buf));
+	}
+	elapsed = torture_now_usec() - start;
+
+	printf("Flows: %.2f us per sendto() and recv()\n",
+	       (double)elapsed / TORTURE_FLOWS_BENCH_COUNT);
+
+	close(s);
+	close(srv);
+}
+
+int main(void) {
+	int rc;
+	int fd;
+
+	const struct CMUnitTest flows_tests[] = {
+		cmocka_unit_test_setup_teardown(test_flows_exit,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_flows_benchmark,
+						setup,
+						teardown),
+	};
+
+	fd = mkstemp(flows_path);
+	if (fd == -1) {
+		return 1;
+	}
+
+	/* Before the first call into socket_wrapper */
+	setenv("SOCKET_WRAPPER_FLOWS", flows_path, 1);
+	close(fd);
+
+	rc = cmocka_run_group_tests(flows_tests, NULL, NULL);
+
+	/* No report of this process at exit */
+	unsetenv("SOCKET_WRAPPER_FLOWS");
+	unlink(flows_path);
+
+	return rc;
+}
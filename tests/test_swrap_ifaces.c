@@ -0,0 +1,264 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_NODES 1000
+#define TORTURE_NODE_IFACE 1000
+#define TORTURE_NODE_PORT 7091
+#define TORTURE_BCAST_PORT 7092
+#define TORTURE_BCAST_NODES 100
+#define TORTURE_BCAST_COUNT 100
+#define TORTURE_SEND_COUNT 10000
+
+static int setup(void **state)
+{
+	struct rlimit rl;
+	int rc;
+
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+
+	/* A socket per node */
+	rc = getrlimit(RLIMIT_NOFILE, &rl);
+	assert_int_equal(rc, 0);
+	if (rl.rlim_cur < 2 * TORTURE_NODES && rl.rlim_max >= 2 * TORTURE_NODES) {
+		rl.rlim_cur = 2 * TORTURE_NODES;
+		rc = setrlimit(RLIMIT_NOFILE, &rl);
+		assert_int_equal(rc, 0);
+	}
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+/* 127.X.Y.Z with the interface in the lower 24 bits */
+static void make_addr_iface(struct torture_address *addr,
+			    unsigned int iface,
+			    int port)
+{
+	*addr = (struct torture_address) {
+		.sa_socklen = sizeof(struct sockaddr_in),
+	};
+
+	addr->sa.in.sin_family = AF_INET;
+	addr->sa.in.sin_port = htons(port);
+	addr->sa.in.sin_addr.s_addr = htonl((127U << 24) | iface);
+}
+
+static void test_iface_default(void **state)
+{
+	struct torture_address addr;
+	struct torture_address name = {
+		.sa_socklen = sizeof(struct sockaddr_storage),
+	};
+	char ip[INET6_ADDRSTRLEN];
+	int srv, s;
+	int rc;
+
+	(void) state; /* unused */
+
+	/* 70000 is 0x011170 */
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "70000", 1);
+
+	srv = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(srv, -1);
+
+	make_addr_iface(&addr, 0, TORTURE_NODE_PORT);
+	rc = bind(srv, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	make_addr_iface(&addr, 70000, TORTURE_NODE_PORT);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	rc = getsockname(s, &name.sa.s, &name.sa_socklen);
+	assert_int_equal(rc, 0);
+	inet_ntop(AF_INET, &name.sa.in.sin_addr, ip, sizeof(ip));
+	assert_string_equal(ip, "127.1.17.112");
+
+	close(s);
+	close(srv);
+
+#ifdef HAVE_IPV6
+	s = socket(AF_INET6, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	/* An autobind uses the default interface */
+	addr = (struct torture_address) {
+		.sa_socklen = sizeof(struct sockaddr_in6),
+	};
+	addr.sa.in6.sin6_family = AF_INET6;
+	addr.sa.in6.sin6_port = htons(TORTURE_NODE_PORT);
+	rc = inet_pton(AF_INET6, "fd00::111:5357:5f70", &addr.sa.in6.sin6_addr);
+	assert_int_equal(rc, 1);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	name.sa_socklen = sizeof(struct sockaddr_storage);
+	rc = getsockname(s, &name.sa.s, &name.sa_socklen);
+	assert_int_equal(rc, 0);
+	assert_int_equal(name.sa.in6.sin6_family, AF_INET6);
+	inet_ntop(AF_INET6, &name.sa.in6.sin6_addr, ip, sizeof(ip));
+	assert_string_equal(ip, "fd00::111:5357:5f70");
+
+	close(s);
+#endif
+}
+
+static void test_iface_nodes(void **state)
+{
+	struct torture_address addr;
+	int nodes[TORTURE_NODES];
+	int listeners[TORTURE_BCAST_NODES];
+	uint64_t start, in_bind, in_bcast, in_send;
+	char buf[] = "node";
+	char rbuf[sizeof(buf)];
+	ssize_t ret;
+	int s;
+	int rc;
+	int i, j;
+
+	(void) state; /* unused */
+
+	/* Spin up the nodes */
+	start = torture_now_usec();
+	for (i = 0; i < TORTURE_NODES; i++) {
+		nodes[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		assert_int_not_equal(nodes[i], -1);
+
+		make_addr_iface(&addr, TORTURE_NODE_IFACE + i, TORTURE_NODE_PORT);
+		rc = bind(nodes[i], &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(rc, 0);
+	}
+	in_bind = torture_now_usec() - start;
+
+	/* Some of them listen for broadcasts */
+	for (i = 0; i < TORTURE_BCAST_NODES; i++) {
+		int node = i * (TORTURE_NODES / TORTURE_BCAST_NODES);
+
+		listeners[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		assert_int_not_equal(listeners[i], -1);
+
+		make_addr_iface(&addr, TORTURE_NODE_IFACE + node, TORTURE_BCAST_PORT);
+		rc = bind(listeners[i], &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(rc, 0);
+	}
+
+	/* The address of a node is in use now */
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	make_addr_iface(&addr, TORTURE_NODE_IFACE + 500, TORTURE_NODE_PORT);
+	rc = bind(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, EADDRINUSE);
+
+	/* A broadcast only looks at the nodes listening on the port */
+	make_addr_iface(&addr, 0xFFFFFF, TORTURE_BCAST_PORT);
+
+	start = torture_now_usec();
+	for (i = 0; i < TORTURE_BCAST_COUNT; i++) {
+		ret = sendto(s, buf, sizeof(buf), 0,
+			     &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+
+		for (j = 0; j < TORTURE_BCAST_NODES; j++) {
+			ret = recv(listeners[j], rbuf, sizeof(rbuf), 0);
+			assert_int_equal(ret, sizeof(buf));
+		}
+	}
+	in_bcast = torture_now_usec() - start;
+
+	/* Unicast between the nodes, going through the link rules */
+	start = torture_now_usec();
+	for (i = 0; i < TORTURE_SEND_COUNT; i++) {
+		int from = i % TORTURE_NODES;
+		int to = (from + 1) % TORTURE_NODES;
+
+		make_addr_iface(&addr, TORTURE_NODE_IFACE + to, TORTURE_NODE_PORT);
+		ret = sendto(nodes[from], buf, sizeof(buf), 0,
+			     &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+
+		ret = recv(nodes[to], rbuf, sizeof(rbuf), 0);
+		assert_int_equal(ret, sizeof(buf));
+	}
+	in_send = torture_now_usec() - start;
+
+	printf("%d nodes: %.2f us per bind(), %.2f us per broadcast to %d "
+	       "nodes, %.2f us per sendto() and recv() between nodes\n",
+	       TORTURE_NODES,
+	       (double)in_bind / TORTURE_NODES,
+	       (double)in_bcast / TORTURE_BCAST_COUNT,
+	       TORTURE_BCAST_NODES,
+	       (double)in_send / TORTURE_SEND_COUNT);
+
+	close(s);
+	for (i = 0; i < TORTURE_BCAST_NODES; i++) {
+		close(listeners[i]);
+	}
+	for (i = 0; i < TORTURE_NODES; i++) {
+		close(nodes[i]);
+	}
+}
+
+int main(void) {
+	char *rules;
+	size_t len = 0;
+	int rc;
+	int i;
+
+	const struct CMUnitTest iface_tests[] = {
+		cmocka_unit_test_setup_teardown(test_iface_default,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_iface_nodes,
+						setup,
+						teardown),
+	};
+
+	/* A link rule between each node and the next one */
+	rules = malloc(TORTURE_NODES * 32);
+	assert_non_null(rules);
+	rules[0] = '\0';
+	for (i = 0; i < TORTURE_NODES; i++) {
+		len += snprintf(rules + len, TORTURE_NODES * 32 - len,
+				"%s%d-%d=0%%",
+				i == 0 ? "" : ",",
+				TORTURE_NODE_IFACE + i,
+				TORTURE_NODE_IFACE + (i + 1) % TORTURE_NODES);
+	}
+	setenv("SOCKET_WRAPPER_LOSS", rules, 1);
+	free(rules);
+
+	rc = cmocka_run_group_tests(iface_tests, NULL, NULL);
+
+	return rc;
+}
@@ -0,0 +1,326 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_LATENCY_RULES "21-22=20ms~5ms,22-21=2ms"
+
+#define TORTURE_LATENCY_COUNT 50
+
+struct torture_latency_pkt {
+	uint32_t seq;
+	uint64_t sent_usec;
+};
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static void read_all(int s, void *buf, size_t len)
+{
+	size_t nread = 0;
+
+	while (nread < len) {
+		struct pollfd pfd = {
+			.fd = s,
+			.events = POLLIN,
+		};
+		ssize_t ret;
+		int rc;
+
+		rc = poll(&pfd, 1, 1000);
+		assert_int_equal(rc, 1);
+
+		ret = read(s, (uint8_t *)buf + nread, len - nread);
+		assert_true(ret > 0);
+
+		nread += ret;
+	}
+}
+
+/* One way delay of a packet in usec, measured on arrival */
+static uint64_t recv_pkt(int s, struct torture_latency_pkt *pkt)
+{
+	read_all(s, pkt, sizeof(*pkt));
+
+	return torture_now_usec() - pkt->sent_usec;
+}
+
+static void send_pkt(int s, uint32_t seq)
+{
+	struct torture_latency_pkt pkt = {
+		.seq = seq,
+	};
+	ssize_t ret;
+
+	pkt.sent_usec = torture_now_usec();
+
+	ret = send(s, &pkt, sizeof(pkt), 0);
+	assert_int_equal(ret, sizeof(pkt));
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void test_latency_udp_distribution(void **state)
+{
+	uint64_t d[TORTURE_LATENCY_COUNT];
+	int srv, cli;
+	int in_range = 0;
+	int i;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.22", 7001);
+	cli = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.21", 7001);
+	torture_connect_ipv4(cli, "127.0.0.22", 7001);
+
+	for (i = 0; i < TORTURE_LATENCY_COUNT; i++) {
+		struct torture_latency_pkt pkt;
+
+		send_pkt(cli, i);
+
+		d[i] = recv_pkt(srv, &pkt);
+		assert_int_equal(pkt.seq, i);
+
+		if (d[i] <= 25000 + 1000) {
+			in_range++;
+		}
+	}
+
+	qsort(d, TORTURE_LATENCY_COUNT, sizeof(d[0]), cmp_u64);
+
+	/*
+	 * 20ms +/- 5ms. Nothing may arrive early, but on a loaded machine
+	 * packets are read late, so only check the bulk of the distribution.
+	 */
+	assert_true(d[0] >= 15000);
+	assert_true(in_range >= TORTURE_LATENCY_COUNT / 2);
+	assert_true(d[TORTURE_LATENCY_COUNT / 2] >= 17000);
+
+	/* There has to be some jitter */
+	assert_true(d[TORTURE_LATENCY_COUNT * 3 / 4] -
+		    d[TORTURE_LATENCY_COUNT / 4] >= 1000);
+
+	close(cli);
+	close(srv);
+}
+
+static void test_latency_tcp_order(void **state)
+{
+	struct torture_latency_pkt pkt;
+	int listener, srv, cli;
+	uint64_t d;
+	uint32_t i;
+	int rc;
+
+	(void) state; /* unused */
+
+	listener = torture_bind_ipv4(SOCK_STREAM, "127.0.0.22", 7002);
+	rc = listen(listener, 1);
+	assert_int_equal(rc, 0);
+
+	cli = torture_bind_ipv4(SOCK_STREAM, "127.0.0.21", 0);
+	torture_connect_ipv4(cli, "127.0.0.22", 7002);
+
+	srv = accept(listener, NULL, NULL);
+	assert_int_not_equal(srv, -1);
+
+	/* Send a burst, the jitter must not reorder the stream */
+	for (i = 0; i < TORTURE_LATENCY_COUNT; i++) {
+		send_pkt(cli, i);
+	}
+
+	for (i = 0; i < TORTURE_LATENCY_COUNT; i++) {
+		d = recv_pkt(srv, &pkt);
+		assert_int_equal(pkt.seq, i);
+		assert_true(d >= 15000);
+	}
+
+	/* The way back has its own rule */
+	send_pkt(srv, 0);
+	d = recv_pkt(cli, &pkt);
+	assert_true(d >= 2000);
+
+	/* Data still held back must arrive before the FIN */
+	send_pkt(cli, 1);
+	rc = shutdown(cli, SHUT_WR);
+	assert_int_equal(rc, 0);
+	d = recv_pkt(srv, &pkt);
+	assert_int_equal(pkt.seq, 1);
+
+	close(cli);
+	close(srv);
+	close(listener);
+}
+
+#ifdef HAVE_SENDFILE
+/* A packet in a file to send with sendfile() or splice() */
+static int pkt_file(uint32_t seq)
+{
+	char path[] = "/tmp/swrap_latency_XXXXXX";
+	struct torture_latency_pkt pkt = {
+		.seq = seq,
+	};
+	ssize_t ret;
+	int fd;
+
+	fd = mkstemp(path);
+	assert_int_not_equal(fd, -1);
+	unlink(path);
+
+	pkt.sent_usec = torture_now_usec();
+
+	ret = pwrite(fd, &pkt, sizeof(pkt), 0);
+	assert_int_equal(ret, sizeof(pkt));
+
+	return fd;
+}
+
+static void test_latency_tcp_sendfile(void **state)
+{
+	struct torture_latency_pkt pkt;
+	int listener, srv, cli;
+	off_t offset = 0;
+	uint32_t count = 3;
+	ssize_t ret;
+	uint32_t i;
+	uint64_t d;
+	int fd;
+	int rc;
+
+	(void) state; /* unused */
+
+	listener = torture_bind_ipv4(SOCK_STREAM, "127.0.0.22", 7004);
+	rc = listen(listener, 1);
+	assert_int_equal(rc, 0);
+
+	cli = torture_bind_ipv4(SOCK_STREAM, "127.0.0.21", 0);
+	torture_connect_ipv4(cli, "127.0.0.22", 7004);
+
+	srv = accept(listener, NULL, NULL);
+	assert_int_not_equal(srv, -1);
+
+	/* sendfile() must queue behind the data still held back */
+	send_pkt(cli, 0);
+	fd = pkt_file(1);
+	ret = sendfile(cli, fd, &offset, sizeof(pkt));
+	assert_int_equal(ret, sizeof(pkt));
+	close(fd);
+	send_pkt(cli, 2);
+
+#ifdef HAVE_SPLICE
+	{
+		int p[2];
+
+		rc = pipe(p);
+		assert_int_equal(rc, 0);
+
+		pkt.seq = 3;
+		pkt.sent_usec = torture_now_usec();
+		ret = write(p[1], &pkt, sizeof(pkt));
+		assert_int_equal(ret, sizeof(pkt));
+
+		ret = splice(p[0], NULL, cli, NULL, sizeof(pkt), 0);
+		assert_int_equal(ret, sizeof(pkt));
+
+		close(p[0]);
+		close(p[1]);
+	}
+	send_pkt(cli, 4);
+	count = 5;
+#endif
+
+	for (i = 0; i < count; i++) {
+		d = recv_pkt(srv, &pkt);
+		assert_int_equal(pkt.seq, i);
+		assert_true(d >= 15000);
+	}
+
+	close(cli);
+	close(srv);
+	close(listener);
+}
+#endif /* HAVE_SENDFILE */
+
+static void test_latency_no_rule(void **state)
+{
+	struct torture_latency_pkt pkt;
+	int srv, cli;
+	ssize_t ret;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.23", 7003);
+	cli = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.21", 7003);
+	torture_connect_ipv4(cli, "127.0.0.23", 7003);
+
+	/* Without a delay it is in the socket as soon as send() returns */
+	send_pkt(cli, 0);
+	ret = recv(srv, &pkt, sizeof(pkt), MSG_DONTWAIT);
+	assert_int_equal(ret, sizeof(pkt));
+	assert_int_equal(pkt.seq, 0);
+
+	close(cli);
+	close(srv);
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest latency_tests[] = {
+		cmocka_unit_test_setup_teardown(test_latency_udp_distribution,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_latency_tcp_order,
+						setup,
+						teardown),
+#ifdef HAVE_SENDFILE
+		cmocka_unit_test_setup_teardown(test_latency_tcp_sendfile,
+						setup,
+						teardown),
+#endif
+		cmocka_unit_test_setup_teardown(test_latency_no_rule,
+						setup,
+						teardown),
+	};
+
+	setenv("SOCKET_WRAPPER_LATENCY", TORTURE_LATENCY_RULES, 1);
+	setenv("SOCKET_WRAPPER_SEED", "4711", 1);
+
+	rc = cmocka_run_group_tests(latency_tests, NULL, NULL);
+
+	return rc;
+}
@@ -0,0 +1,319 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_LAYOUT_FILL_IFACES 40
+#define TORTURE_LAYOUT_FILL_PORTS 500
+#define TORTURE_LAYOUT_BENCH_COUNT 200
+
+static int setup_flat(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+	unsetenv("SOCKET_WRAPPER_DIR_LAYOUT");
+
+	return 0;
+}
+
+static int setup_sharded(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+	setenv("SOCKET_WRAPPER_DIR_LAYOUT", "sharded", 1);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DIR_LAYOUT");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static void socket_path(char *path, size_t size,
+			char type, unsigned int addr, unsigned int port,
+			bool sharded)
+{
+	const char *dir = getenv("SOCKET_WRAPPER_DIR");
+
+	if (sharded) {
+		snprintf(path, size, "%s/%c%08X/%02X/%c%08X%04X",
+			 dir, type, addr, port >> 8, type, addr, port);
+	} else {
+		snprintf(path, size, "%s/%c%08X%04X", dir, type, addr, port);
+	}
+}
+
+static void assert_socket_exists(char type, unsigned int addr,
+				 unsigned int port)
+{
+	char path[1024];
+	struct stat st;
+	int rc;
+
+	socket_path(path, sizeof(path), type, addr, port, true);
+	rc = stat(path, &st);
+	assert_int_equal(rc, 0);
+	assert_true(S_ISSOCK(st.st_mode));
+
+	socket_path(path, sizeof(path), type, addr, port, false);
+	rc = stat(path, &st);
+	assert_int_equal(rc, -1);
+}
+
+static void test_layout_sharded(void **state)
+{
+	struct torture_address addr;
+	struct torture_address name = {
+		.sa_socklen = sizeof(struct sockaddr_storage),
+	};
+	char buf[] = "sharded";
+	char rbuf[sizeof(buf)];
+	char path[1024];
+	struct stat st;
+	int listener, cli, srv;
+	int udp1, udp2, s;
+	ssize_t ret;
+	pid_t pid;
+	int status;
+	int rc;
+
+	(void) state; /* unused */
+
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "40", 1);
+
+	/* Stream sockets bind, autobind and connect through the shards */
+	listener = torture_bind_ipv4(SOCK_STREAM, "127.0.0.41", 7071);
+	rc = listen(listener, 1);
+	assert_int_equal(rc, 0);
+	assert_socket_exists('Q', 0x7F000029, 7071);
+
+	cli = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(cli, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.41", 7071);
+	rc = connect(cli, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	rc = getsockname(cli, &name.sa.s, &name.sa_socklen);
+	assert_int_equal(rc, 0);
+	assert_socket_exists('Q', 0x7F000028, ntohs(name.sa.in.sin_port));
+
+	srv = accept(listener, NULL, NULL);
+	assert_int_not_equal(srv, -1);
+
+	ret = write(cli, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+	ret = read(srv, rbuf, sizeof(rbuf));
+	assert_int_equal(ret, sizeof(buf));
+	assert_memory_equal(buf, rbuf, sizeof(buf));
+
+	close(srv);
+	close(cli);
+	close(listener);
+
+	/* A socket of a killed process in a shard */
+	pid = fork();
+	assert_int_not_equal(pid, -1);
+
+	if (pid == 0) {
+		s = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.44", 7072);
+		_exit(s == -1 ? 1 : 0);
+	}
+
+	rc = waitpid(pid, &status, 0);
+	assert_int_equal(rc, pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+	assert_socket_exists('W', 0x7F00002C, 7072);
+
+	/* Broadcasts find the datagram sockets in all shards */
+	udp1 = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.42", 7072);
+	udp2 = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.43", 7072);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.255.255.255", 7072);
+	ret = sendto(s, buf, sizeof(buf), 0, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(ret, sizeof(buf));
+
+	ret = recv(udp1, rbuf, sizeof(rbuf), 0);
+	assert_int_equal(ret, sizeof(buf));
+	ret = recv(udp2, rbuf, sizeof(rbuf), 0);
+	assert_int_equal(ret, sizeof(buf));
+
+	/* The stale socket got removed by the broadcast */
+	socket_path(path, sizeof(path), 'W', 0x7F00002C, 7072, true);
+	rc = stat(path, &st);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, ENOENT);
+
+	close(s);
+	close(udp2);
+	close(udp1);
+}
+
+/* Fill the directory with the names of sockets on other interfaces */
+static void fill_socket_dir(int first_iface, int last_iface, bool sharded)
+{
+	const char *dir = getenv("SOCKET_WRAPPER_DIR");
+	char path[1024];
+	int i, j;
+	int fd;
+
+	for (i = first_iface; i < last_iface; i++) {
+		unsigned int addr = 0x7F000064 + i;
+
+		if (sharded) {
+			snprintf(path, sizeof(path), "%s/Q%08X", dir, addr);
+			mkdir(path, 0777);
+		}
+
+		for (j = 0; j < TORTURE_LAYOUT_FILL_PORTS; j++) {
+			unsigned int port = 20000 + j;
+
+			if (sharded) {
+				snprintf(path, sizeof(path), "%s/Q%08X/%02X",
+					 dir, addr, port >> 8);
+				mkdir(path, 0777);
+			}
+
+			socket_path(path, sizeof(path), 'Q', addr, port, sharded);
+			fd = open(path, O_CREAT | O_WRONLY, 0600);
+			assert_int_not_equal(fd, -1);
+			close(fd);
+		}
+	}
+}
+
+static void run_layout_benchmark(const char *layout, bool sharded)
+{
+	struct torture_address addr;
+	uint64_t start, in_bind, in_connect, in_bcast;
+	char buf[] = "bench";
+	int ifaces = 0;
+	int udp, s;
+	ssize_t ret;
+	int rc;
+	int i;
+
+	udp = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.45", 7073);
+
+	/* Measure as the directory grows */
+	while (ifaces < TORTURE_LAYOUT_FILL_IFACES) {
+		int next = ifaces == 0 ? 1 : ifaces * 4;
+
+		if (next > TORTURE_LAYOUT_FILL_IFACES) {
+			next = TORTURE_LAYOUT_FILL_IFACES;
+		}
+		fill_socket_dir(ifaces, next, sharded);
+		ifaces = next;
+
+		start = torture_now_usec();
+		for (i = 0; i < TORTURE_LAYOUT_BENCH_COUNT; i++) {
+			s = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.45", 7074);
+			close(s);
+		}
+		in_bind = torture_now_usec() - start;
+
+		torture_make_addr_ipv4(&addr, "127.0.0.45", 7073);
+
+		start = torture_now_usec();
+		for (i = 0; i < TORTURE_LAYOUT_BENCH_COUNT; i++) {
+			s = socket(AF_INET, SOCK_DGRAM, 0);
+			assert_int_not_equal(s, -1);
+
+			/* Autobinds and looks up the remote socket */
+			rc = connect(s, &addr.sa.s, addr.sa_socklen);
+			assert_int_equal(rc, 0);
+			close(s);
+		}
+		in_connect = torture_now_usec() - start;
+
+		s = socket(AF_INET, SOCK_DGRAM, 0);
+		assert_int_not_equal(s, -1);
+
+		torture_make_addr_ipv4(&addr, "127.255.255.255", 7073);
+
+		start = torture_now_usec();
+		for (i = 0; i < TORTURE_LAYOUT_BENCH_COUNT; i++) {
+			char rbuf[sizeof(buf)];
+
+			ret = sendto(s, buf, sizeof(buf), 0,
+				     &addr.sa.s, addr.sa_socklen);
+			assert_int_equal(ret, sizeof(buf));
+
+			ret = recv(udp, rbuf, sizeof(rbuf), 0);
+			assert_int_equal(ret, sizeof(buf));
+		}
+		in_bcast = torture_now_usec() - start;
+		close(s);
+
+		printf("%s layout with %d sockets: %.2f us per bind(), "
+		       "%.2f us per connect(), %.2f us per broadcast\n",
+		       layout,
+		       ifaces * TORTURE_LAYOUT_FILL_PORTS,
+		       (double)in_bind / TORTURE_LAYOUT_BENCH_COUNT,
+		       (double)in_connect / TORTURE_LAYOUT_BENCH_COUNT,
+		       (double)in_bcast / TORTURE_LAYOUT_BENCH_COUNT);
+	}
+
+	close(udp);
+}
+
+static void test_layout_benchmark_flat(void **state)
+{
+	(void) state; /* unused */
+
+	run_layout_benchmark("Flat", false);
+}
+
+static void test_layout_benchmark_sharded(void **state)
+{
+	(void) state; /* unused */
+
+	run_layout_benchmark("Sharded", true);
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest layout_tests[] = {
+		cmocka_unit_test_setup_teardown(test_layout_sharded,
+						setup_sharded,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_layout_benchmark_flat,
+						setup_flat,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_layout_benchmark_sharded,
+						setup_sharded,
+						teardown),
+	};
+
+	rc = cmocka_run_group_tests(layout_tests, NULL, NULL);
+
+	return rc;
+}
@@ -0,0 +1,280 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_LOSS_RULES "41-42=20%,43-44=ge:5%:20%"
+#define TORTURE_DUPLICATE_RULES "45-46=50%"
+#define TORTURE_REORDER_RULES "47-48=30%@10ms"
+
+#define TORTURE_LOSS_COUNT 2000
+#define TORTURE_IMPAIR_COUNT 100
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static void send_seq(int s, uint32_t seq)
+{
+	ssize_t ret;
+
+	ret = send(s, &seq, sizeof(seq), 0);
+	assert_int_equal(ret, sizeof(seq));
+}
+
+/* Receive a datagram if one arrives within timeout ms */
+static bool recv_seq(int s, int timeout, uint32_t *seq)
+{
+	struct pollfd pfd = {
+		.fd = s,
+		.events = POLLIN,
+	};
+	ssize_t ret;
+	int rc;
+
+	rc = poll(&pfd, 1, timeout);
+	assert_int_not_equal(rc, -1);
+	if (rc == 0) {
+		return false;
+	}
+
+	ret = recv(s, seq, sizeof(*seq), 0);
+	assert_int_equal(ret, sizeof(*seq));
+
+	return true;
+}
+
+static void test_loss_random(void **state)
+{
+	int received = 0;
+	int srv, cli;
+	uint32_t i;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.42", 7021);
+	cli = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.41", 7021);
+	torture_connect_ipv4(cli, "127.0.0.42", 7021);
+
+	/* Without a delay the datagrams which are not lost arrive at once */
+	for (i = 0; i < TORTURE_LOSS_COUNT; i++) {
+		uint32_t seq;
+
+		send_seq(cli, i);
+		if (recv_seq(srv, 0, &seq)) {
+			assert_int_equal(seq, i);
+			received++;
+		}
+	}
+
+	/* 20% loss, the seed is fixed but allow for a different generator */
+	assert_true(received >= TORTURE_LOSS_COUNT * 7 / 10);
+	assert_true(received <= TORTURE_LOSS_COUNT * 9 / 10);
+
+	/* The way back has no rule */
+	torture_connect_ipv4(srv, "127.0.0.41", 7021);
+	for (i = 0; i < 10; i++) {
+		uint32_t seq;
+		bool ok;
+
+		send_seq(srv, i);
+		ok = recv_seq(cli, 0, &seq);
+		assert_true(ok);
+		assert_int_equal(seq, i);
+	}
+
+	close(cli);
+	close(srv);
+}
+
+static void test_loss_gilbert_elliott(void **state)
+{
+	int lost = 0;
+	int bursts = 0;
+	bool last_lost = false;
+	int srv, cli;
+	uint32_t i;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.44", 7022);
+	cli = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.43", 7022);
+	torture_connect_ipv4(cli, "127.0.0.44", 7022);
+
+	for (i = 0; i < TORTURE_LOSS_COUNT; i++) {
+		uint32_t seq;
+		bool ok;
+
+		send_seq(cli, i);
+		ok = recv_seq(srv, 0, &seq);
+		if (ok) {
+			assert_int_equal(seq, i);
+		} else {
+			lost++;
+			if (!last_lost) {
+				bursts++;
+			}
+		}
+		last_lost = !ok;
+	}
+
+	/* p / (p + r) = 20% of the time in the bad state */
+	assert_true(lost >= TORTURE_LOSS_COUNT / 10);
+	assert_true(lost <= TORTURE_LOSS_COUNT * 3 / 10);
+
+	/*
+	 * The bad state lasts 1 / r = 5 datagrams on average, random loss
+	 * of 20% would give bursts of 1.25.
+	 */
+	assert_true(bursts > 0);
+	assert_true(lost >= bursts * 3);
+
+	close(cli);
+	close(srv);
+}
+
+static void test_loss_duplicate(void **state)
+{
+	int count[TORTURE_IMPAIR_COUNT];
+	int received = 0;
+	int srv, cli;
+	uint32_t seq;
+	uint32_t i;
+
+	(void) state; /* unused */
+
+	memset(count, 0, sizeof(count));
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.46", 7023);
+	cli = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.45", 7023);
+	torture_connect_ipv4(cli, "127.0.0.46", 7023);
+
+	for (i = 0; i < TORTURE_IMPAIR_COUNT; i++) {
+		send_seq(cli, i);
+		while (recv_seq(srv, 1, &seq)) {
+			assert_true(seq < TORTURE_IMPAIR_COUNT);
+			count[seq]++;
+			received++;
+		}
+	}
+	while (recv_seq(srv, 200, &seq)) {
+		assert_true(seq < TORTURE_IMPAIR_COUNT);
+		count[seq]++;
+		received++;
+	}
+
+	for (i = 0; i < TORTURE_IMPAIR_COUNT; i++) {
+		assert_true(count[i] >= 1);
+		assert_true(count[i] <= 2);
+	}
+
+	/* 50% duplicates */
+	assert_true(received >= TORTURE_IMPAIR_COUNT * 13 / 10);
+	assert_true(received <= TORTURE_IMPAIR_COUNT * 17 / 10);
+
+	close(cli);
+	close(srv);
+}
+
+static void test_loss_reorder(void **state)
+{
+	int count[TORTURE_IMPAIR_COUNT];
+	int received = 0;
+	int reordered = 0;
+	uint32_t highest = 0;
+	int srv, cli;
+	uint32_t seq;
+	uint32_t i;
+
+	(void) state; /* unused */
+
+	memset(count, 0, sizeof(count));
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.48", 7024);
+	cli = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.47", 7024);
+	torture_connect_ipv4(cli, "127.0.0.48", 7024);
+
+	for (i = 0; i < TORTURE_IMPAIR_COUNT + 1; i++) {
+		if (i < TORTURE_IMPAIR_COUNT) {
+			send_seq(cli, i);
+		}
+		while (recv_seq(srv,
+				i < TORTURE_IMPAIR_COUNT ? 1 : 200,
+				&seq)) {
+			assert_true(seq < TORTURE_IMPAIR_COUNT);
+			count[seq]++;
+			received++;
+
+			if (seq < highest) {
+				reordered++;
+			} else {
+				highest = seq;
+			}
+		}
+	}
+
+	/* Nothing gets lost or duplicated */
+	assert_int_equal(received, TORTURE_IMPAIR_COUNT);
+	for (i = 0; i < TORTURE_IMPAIR_COUNT; i++) {
+		assert_int_equal(count[i], 1);
+	}
+
+	/* 30% are held back and overtaken */
+	assert_true(reordered >= TORTURE_IMPAIR_COUNT / 10);
+	assert_true(reordered <= TORTURE_IMPAIR_COUNT / 2);
+
+	close(cli);
+	close(srv);
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest loss_tests[] = {
+		cmocka_unit_test_setup_teardown(test_loss_random,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_loss_gilbert_elliott,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_loss_duplicate,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_loss_reorder,
+						setup,
+						teardown),
+	};
+
+	setenv("SOCKET_WRAPPER_LOSS", TORTURE_LOSS_RULES, 1);
+	setenv("SOCKET_WRAPPER_DUPLICATE", TORTURE_DUPLICATE_RULES, 1);
+	setenv("SOCKET_WRAPPER_REORDER", TORTURE_REORDER_RULES, 1);
+	setenv("SOCKET_WRAPPER_SEED", "4711", 1);
+
+	rc = cmocka_run_group_tests(loss_tests, NULL, NULL);
+
+	return rc;
+}
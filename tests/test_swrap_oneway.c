@@ -0,0 +1,390 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_ONEWAY_PORT 7171
+/* Less than the queue of a unix datagram socket, delayed datagrams get lost */
+#define TORTURE_ONEWAY_COUNT 8
+#define TORTURE_ONEWAY_STREAM_SIZE 65536
+/* More than the table of the socket directory holds at the same time */
+#define TORTURE_ONEWAY_CONNECTIONS 300
+
+static char oneway_path[] = "/tmp/swrap_oneway_XXXXXX";
+static int ready_fd = -1;
+static int done_fd = -1;
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "20", 1);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+/* The line of the flow in the report of the process */
+static void oneway_line(pid_t pid, const char *flow, char *line, size_t size)
+{
+	char header[64];
+	char buf[1024];
+	bool in_report = false;
+	bool found = false;
+	FILE *fp;
+
+	snprintf(header, sizeof(header),
+		 "socket_wrapper one-way latency of pid %d,", (int)pid);
+
+	fp = fopen(oneway_path, "r");
+	assert_non_null(fp);
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if (strncmp(buf, "socket_wrapper one-way", 22) == 0) {
+			in_report = strncmp(buf, header, strlen(header)) == 0;
+			continue;
+		}
+		if (in_report && strstr(buf, flow) != NULL) {
+			snprintf(line, size, "%s", buf);
+			found = true;
+		}
+	}
+	fclose(fp);
+
+	assert_true(found);
+}
+
+/*
+ * Forks the receiver, which tells when it is ready. It waits for the
+ * sender before it exits, the time of the last send may be published
+ * after the data got read.
+ */
+static pid_t fork_receiver(void (*receiver)(void))
+{
+	char c;
+	ssize_t ret;
+	pid_t pid;
+	int pfd[2];
+	int dfd[2];
+	int rc;
+
+	rc = pipe(pfd);
+	assert_int_equal(rc, 0);
+	rc = pipe(dfd);
+	assert_int_equal(rc, 0);
+
+	fflush(stdout);
+	pid = fork();
+	assert_int_not_equal(pid, -1);
+
+	if (pid == 0) {
+		close(pfd[0]);
+		close(dfd[1]);
+		ready_fd = pfd[1];
+		receiver();
+		ret = read(dfd[0], &c, 1);
+		/* exit() runs the destructor which writes the report */
+		exit(ret == 0 ? 0 : 1);
+	}
+
+	close(pfd[1]);
+	close(dfd[0]);
+	done_fd = dfd[1];
+	ret = read(pfd[0], &c, 1);
+	assert_int_equal(ret, 1);
+	close(pfd[0]);
+
+	return pid;
+}
+
+static void receiver_ready(void)
+{
+	ssize_t ret;
+
+	ret = write(ready_fd, "x", 1);
+	close(ready_fd);
+	if (ret != 1) {
+		exit(1);
+	}
+}
+
+static void wait_receiver(pid_t pid)
+{
+	int status;
+	int rc;
+
+	close(done_fd);
+
+	rc = waitpid(pid, &status, 0);
+	assert_int_equal(rc, pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+}
+
+static void dgram_receiver(void)
+{
+	struct torture_address from = {
+		.sa_socklen = sizeof(struct sockaddr_storage),
+	};
+	char buf[64];
+	ssize_t ret;
+	int s;
+	int i;
+
+	s = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.22", TORTURE_ONEWAY_PORT);
+	receiver_ready();
+
+	for (i = 0; i < TORTURE_ONEWAY_COUNT; i++) {
+		ret = recvfrom(s, buf, sizeof(buf), 0,
+			       &from.sa.s, &from.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+	}
+}
+
+static void test_oneway_dgram(void **state)
+{
+	struct torture_address addr;
+	unsigned long long samples, missed, p50;
+	char buf[64];
+	char line[1024];
+	char *p;
+	ssize_t ret;
+	pid_t pid;
+	int rc;
+	int s;
+	int i;
+
+	(void) state; /* unused */
+
+	memset(buf, 'd', sizeof(buf));
+
+	pid = fork_receiver(dgram_receiver);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.22", TORTURE_ONEWAY_PORT);
+	for (i = 0; i < TORTURE_ONEWAY_COUNT; i++) {
+		ret = sendto(s, buf, sizeof(buf), 0,
+			     &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+	}
+
+	wait_receiver(pid);
+	close(s);
+
+	oneway_line(pid, "> 127.0.0.22:7171 ", line, sizeof(line));
+	rc = sscanf(line, "udp %*s > %*s samples %llu missed %llu",
+		    &samples, &missed);
+	assert_int_equal(rc, 2);
+	assert_int_equal(samples, TORTURE_ONEWAY_COUNT);
+	assert_int_equal(missed, 0);
+
+	/* At least the delay of the emulated link */
+	p = strstr(line, " latency ");
+	assert_non_null(p);
+	rc = sscanf(p, " latency p50 %llu", &p50);
+	assert_int_equal(rc, 1);
+	assert_true(p50 >= 2000000);
+}
+
+static void stream_receiver(void)
+{
+	char buf[4096];
+	size_t received = 0;
+	ssize_t ret;
+	int listener;
+	int s;
+
+	listener = torture_bind_ipv4(SOCK_STREAM,
+				     "127.0.0.21",
+				     TORTURE_ONEWAY_PORT);
+	ret = listen(listener, 5);
+	assert_int_equal(ret, 0);
+	receiver_ready();
+
+	s = accept(listener, NULL, NULL);
+	assert_int_not_equal(s, -1);
+
+	while (received < TORTURE_ONEWAY_STREAM_SIZE) {
+		/* Only a part of a send in some reads */
+		ret = read(s, buf, 1000);
+		assert_true(ret > 0);
+		received += ret;
+	}
+}
+
+static void test_oneway_stream(void **state)
+{
+	struct torture_address addr;
+	unsigned long long samples, missed;
+	char buf[TORTURE_ONEWAY_STREAM_SIZE];
+	char line[1024];
+	size_t sent = 0;
+	unsigned int sends = 0;
+	ssize_t ret;
+	pid_t pid;
+	int rc;
+	int s;
+
+	(void) state; /* unused */
+
+	memset(buf, 's', sizeof(buf));
+
+	pid = fork_receiver(stream_receiver);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_ONEWAY_PORT);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	/* Split at the MTU */
+	while (sent < sizeof(buf)) {
+		ret = write(s, buf + sent, sizeof(buf) - sent);
+		assert_true(ret > 0);
+		sent += ret;
+		sends++;
+	}
+	assert_true(sends > 1);
+
+	wait_receiver(pid);
+	close(s);
+
+	oneway_line(pid, "> 127.0.0.21:7171 ", line, sizeof(line));
+	rc = sscanf(line, "tcp %*s > %*s samples %llu missed %llu",
+		    &samples, &missed);
+	assert_int_equal(rc, 2);
+	assert_int_equal(samples, sends);
+	assert_int_equal(missed, 0);
+}
+
+/* Every connection frees its flow when the receiving end gets closed */
+static void test_oneway_reuse(void **state)
+{
+	struct torture_address addr;
+	unsigned long long samples;
+	char line[1024];
+	char c;
+	ssize_t ret;
+	pid_t pid;
+	int status;
+	int listener;
+	int rc;
+	int s;
+	int a;
+	int i;
+
+	(void) state; /* unused */
+
+	fflush(stdout);
+	pid = fork();
+	assert_int_not_equal(pid, -1);
+
+	if (pid == 0) {
+		listener = torture_bind_ipv4(SOCK_STREAM,
+					     "127.0.0.21",
+					     TORTURE_ONEWAY_PORT + 1);
+		rc = listen(listener, 5);
+		assert_int_equal(rc, 0);
+		torture_make_addr_ipv4(&addr,
+				       "127.0.0.21",
+				       TORTURE_ONEWAY_PORT + 1);
+
+		for (i = 0; i < TORTURE_ONEWAY_CONNECTIONS; i++) {
+			/* The last one is easy to find in the report */
+			if (i == TORTURE_ONEWAY_CONNECTIONS - 1) {
+				s = torture_bind_ipv4(SOCK_STREAM,
+						      "127.0.0.20",
+						      TORTURE_ONEWAY_PORT + 2);
+			} else {
+				s = socket(AF_INET, SOCK_STREAM, 0);
+				assert_int_not_equal(s, -1);
+			}
+			rc = connect(s, &addr.sa.s, addr.sa_socklen);
+			assert_int_equal(rc, 0);
+			a = accept(listener, NULL, NULL);
+			assert_int_not_equal(a, -1);
+
+			ret = write(s, "x", 1);
+			assert_int_equal(ret, 1);
+			ret = read(a, &c, 1);
+			assert_int_equal(ret, 1);
+
+			close(s);
+			close(a);
+		}
+		exit(0);
+	}
+
+	rc = waitpid(pid, &status, 0);
+	assert_int_equal(rc, pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+
+	oneway_line(pid,
+		    "127.0.0.20:7173 > 127.0.0.21:7172 ",
+		    line,
+		    sizeof(line));
+	rc = sscanf(line, "tcp %*s > %*s samples %llu", &samples);
+	assert_int_equal(rc, 1);
+	assert_int_equal(samples, 1);
+}
+
+int main(void) {
+	int rc;
+	int fd;
+
+	const struct CMUnitTest oneway_tests[] = {
+		cmocka_unit_test_setup_teardown(test_oneway_dgram,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_oneway_stream,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_oneway_reuse,
+						setup,
+						teardown),
+	};
+
+	fd = mkstemp(oneway_path);
+	if (fd == -1) {
+		return 1;
+	}
+
+	/* Before the first call into socket_wrapper */
+	setenv("SOCKET_WRAPPER_ONEWAY", oneway_path, 1);
+	setenv("SOCKET_WRAPPER_LATENCY", "20-22=2ms", 1);
+	close(fd);
+
+	rc = cmocka_run_group_tests(oneway_tests, NULL, NULL);
+
+	/* No report of this process at exit */
+	unsetenv("SOCKET_WRAPPER_ONEWAY");
+	unlink(oneway_path);
+
+	return rc;
+}
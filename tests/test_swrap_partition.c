@@ -0,0 +1,276 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_PARTITION_PORT 7111
+#define TORTURE_PARTITION_BENCH_COUNT 10000
+
+static void partition(const char *args)
+{
+	char cmd[1024];
+	int rc;
+
+	snprintf(cmd, sizeof(cmd), "%s/src/swrap_partition -d %s %s",
+		 BINARYDIR, getenv("SOCKET_WRAPPER_DIR"), args);
+
+	rc = system(cmd);
+	assert_int_equal(rc, 0);
+}
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "20", 1);
+
+	/* Create the table, so the processes find it right away */
+	partition("heal");
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static void test_partition_udp(void **state)
+{
+	struct torture_address addr;
+	char buf[] = "partition";
+	char rbuf[sizeof(buf)];
+	ssize_t ret;
+	int srv, s;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM,
+				"127.0.0.21",
+				TORTURE_PARTITION_PORT);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_PARTITION_PORT);
+
+	/* The datagram is sent, but never arrives */
+	partition("block 20 21-22");
+
+	ret = sendto(s, buf, sizeof(buf), 0, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(ret, sizeof(buf));
+
+	ret = recv(srv, rbuf, sizeof(rbuf), MSG_DONTWAIT);
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, EAGAIN);
+
+	/* Only the traffic from 21 to 20 is blocked */
+	partition("heal");
+	partition("-o block 21 20");
+
+	ret = sendto(s, buf, sizeof(buf), 0, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(ret, sizeof(buf));
+
+	ret = recv(srv, rbuf, sizeof(rbuf), 0);
+	assert_int_equal(ret, sizeof(buf));
+	assert_memory_equal(buf, rbuf, sizeof(buf));
+
+	partition("unblock 20 21");
+
+	close(s);
+	close(srv);
+}
+
+static void test_partition_tcp(void **state)
+{
+	struct torture_address addr;
+	struct pollfd pfd;
+	char buf[] = "partition";
+	char rbuf[sizeof(buf)];
+	struct timeval tv = {
+		.tv_usec = 20000,
+	};
+	uint64_t start;
+	ssize_t ret;
+	int listener, srv, s;
+	pid_t pid;
+	int status;
+	int rc;
+
+	(void) state; /* unused */
+
+	listener = torture_bind_ipv4(SOCK_STREAM,
+				     "127.0.0.21",
+				     TORTURE_PARTITION_PORT);
+	rc = listen(listener, 1);
+	assert_int_equal(rc, 0);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_PARTITION_PORT);
+
+	/* A connect() across the partition times out */
+	partition("block 20 21");
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, ETIMEDOUT);
+	close(s);
+
+	partition("heal");
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	srv = accept(listener, NULL, NULL);
+	assert_int_not_equal(srv, -1);
+
+	/* An established stream stalls */
+	partition("block 20 21");
+
+	/* Until the timeout of the socket */
+	rc = setsockopt(srv, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	assert_int_equal(rc, 0);
+
+	start = torture_now_usec();
+	ret = read(srv, rbuf, sizeof(rbuf));
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, EAGAIN);
+	assert_true(torture_now_usec() - start >= 20000);
+
+	rc = fcntl(s, F_SETFL, O_NONBLOCK);
+	assert_int_equal(rc, 0);
+
+	ret = write(s, buf, sizeof(buf));
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, EAGAIN);
+
+	pfd = (struct pollfd) {
+		.fd = s,
+		.events = POLLOUT,
+	};
+	rc = poll(&pfd, 1, 10);
+	assert_int_equal(rc, 0);
+
+	rc = fcntl(s, F_SETFL, 0);
+	assert_int_equal(rc, 0);
+
+	/* A blocking write waits until the partition is healed */
+	pid = fork();
+	assert_int_not_equal(pid, -1);
+
+	if (pid == 0) {
+		usleep(50000);
+		partition("heal");
+		_exit(0);
+	}
+
+	start = torture_now_usec();
+	ret = write(s, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+	assert_true(torture_now_usec() - start >= 40000);
+
+	rc = waitpid(pid, &status, 0);
+	assert_int_equal(rc, pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+
+	ret = read(srv, rbuf, sizeof(rbuf));
+	assert_int_equal(ret, sizeof(buf));
+	assert_memory_equal(buf, rbuf, sizeof(buf));
+
+	close(srv);
+	close(s);
+	close(listener);
+}
+
+static void test_partition_benchmark(void **state)
+{
+	struct torture_address addr;
+	char buf[] = "bench";
+	char rbuf[sizeof(buf)];
+	uint64_t start, in_update, in_send;
+	ssize_t ret;
+	int srv, s;
+	int i;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM,
+				"127.0.0.21",
+				TORTURE_PARTITION_PORT);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_PARTITION_PORT);
+
+	/* 20000 blocked pairs, but not the one we use */
+	start = torture_now_usec();
+	partition("block 1000-1099 2000-2099");
+	in_update = torture_now_usec() - start;
+
+	start = torture_now_usec();
+	for (i = 0; i < TORTURE_PARTITION_BENCH_COUNT; i++) {
+		ret = sendto(s, buf, sizeof(buf), 0,
+			     &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+
+		ret = recv(srv, rbuf, sizeof(rbuf), 0);
+		assert_int_equal(ret, sizeof(buf));
+	}
+	in_send = torture_now_usec() - start;
+
+	printf("Partition: %llu us to run swrap_partition, %.2f us per "
+	       "sendto() and recv() with 20000 blocked pairs\n",
+	       (unsigned long long)in_update,
+	       (double)in_send / TORTURE_PARTITION_BENCH_COUNT);
+
+	close(s);
+	close(srv);
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest partition_tests[] = {
+		cmocka_unit_test_setup_teardown(test_partition_udp,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_partition_tcp,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_partition_benchmark,
+						setup,
+						teardown),
+	};
+
+	setenv("SOCKET_WRAPPER_PARTITIONS", "1", 1);
+
+	rc = cmocka_run_group_tests(partition_tests, NULL, NULL);
+
+	return rc;
+}
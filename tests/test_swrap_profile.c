@@ -0,0 +1,280 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_PROFILE_PORT 7131
+#define TORTURE_PROFILE_COUNT 100
+#define TORTURE_PROFILE_BENCH_COUNT 10000
+
+static char profile_path[] = "/tmp/swrap_profile_XXXXXX";
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "20", 1);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static void send_recv(int count)
+{
+	struct torture_address addr;
+	char buf[] = "profile";
+	char rbuf[sizeof(buf)];
+	ssize_t ret;
+	int srv, s;
+	int i;
+
+	srv = torture_bind_ipv4(SOCK_DGRAM,
+				"127.0.0.21",
+				TORTURE_PROFILE_PORT);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_PROFILE_PORT);
+
+	for (i = 0; i < count; i++) {
+		ret = sendto(s, buf, sizeof(buf), 0,
+			     &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+
+		ret = recv(srv, rbuf, sizeof(rbuf), 0);
+		assert_int_equal(ret, sizeof(buf));
+	}
+
+	close(s);
+	close(srv);
+}
+
+/* The line of the function in the last report of the process */
+static void profile_line(pid_t pid, const char *func, char *line, size_t size)
+{
+	char header[64];
+	char buf[1024];
+	bool in_report = false;
+	bool found = false;
+	FILE *fp;
+
+	snprintf(header, sizeof(header),
+		 "socket_wrapper profile of pid %d,", (int)pid);
+
+	fp = fopen(profile_path, "r");
+	assert_non_null(fp);
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if (strncmp(buf, "socket_wrapper profile", 22) == 0) {
+			in_report = strncmp(buf, header, strlen(header)) == 0;
+			continue;
+		}
+		if (in_report &&
+		    strncmp(buf, func, strlen(func)) == 0 &&
+		    buf[strlen(func)] == ' ') {
+			snprintf(line, size, "%s", buf);
+			found = true;
+		}
+	}
+	fclose(fp);
+
+	assert_true(found);
+}
+
+static void test_profile_dump(void **state)
+{
+	void (*profile_dump)(void);
+	unsigned long long calls;
+	unsigned long long p50, p90, p99, p999, max;
+	char line[1024];
+	char *libc;
+	int rc;
+
+	(void) state; /* unused */
+
+	send_recv(TORTURE_PROFILE_COUNT);
+
+	profile_dump = (void (*)(void))dlsym(RTLD_DEFAULT,
+					     "socket_wrapper_profile_dump");
+	assert_non_null(profile_dump);
+	profile_dump();
+
+	profile_line(getpid(), "sendto", line, sizeof(line));
+	rc = sscanf(line, "sendto calls %llu wrapper p50 %llu p90 %llu "
+		    "p99 %llu p99.9 %llu max %llu",
+		    &calls, &p50, &p90, &p99, &p999, &max);
+	assert_int_equal(rc, 6);
+	assert_int_equal(calls, TORTURE_PROFILE_COUNT);
+	assert_true(p50 > 0);
+	assert_true(p50 <= p90);
+	assert_true(p90 <= p99);
+	assert_true(p99 <= p999);
+	assert_true(p999 <= max);
+
+	/* sendto() ends up in libc sendto() */
+	libc = strstr(line, " libc ");
+	assert_non_null(libc);
+	rc = sscanf(libc, " libc p50 %llu", &p50);
+	assert_int_equal(rc, 1);
+	assert_true(p50 > 0);
+
+	profile_line(getpid(), "recv", line, sizeof(line));
+	rc = sscanf(line, "recv calls %llu", &calls);
+	assert_int_equal(rc, 1);
+	assert_int_equal(calls, TORTURE_PROFILE_COUNT);
+}
+
+static void test_profile_exit(void **state)
+{
+	unsigned long long calls;
+	char line[1024];
+	pid_t pid;
+	int status;
+	int rc;
+
+	(void) state; /* unused */
+
+	fflush(stdout);
+	pid = fork();
+	assert_int_not_equal(pid, -1);
+
+	if (pid == 0) {
+		send_recv(TORTURE_PROFILE_COUNT / 2);
+		/* exit() runs the destructor which writes the report */
+		exit(0);
+	}
+
+	rc = waitpid(pid, &status, 0);
+	assert_int_equal(rc, pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+
+	/* The child only counts its own calls */
+	profile_line(pid, "sendto", line, sizeof(line));
+	rc = sscanf(line, "sendto calls %llu", &calls);
+	assert_int_equal(rc, 1);
+	assert_int_equal(calls, TORTURE_PROFILE_COUNT / 2);
+}
+
+static void *send_recv_thread(void *arg)
+{
+	(void) arg; /* unused */
+
+	send_recv(TORTURE_PROFILE_COUNT / 4);
+
+	return NULL;
+}
+
+static void test_profile_thread_exit(void **state)
+{
+	unsigned long long calls;
+	char line[1024];
+	pthread_t thread;
+	pid_t pid;
+	int status;
+	int rc;
+
+	(void) state; /* unused */
+
+	fflush(stdout);
+	pid = fork();
+	assert_int_not_equal(pid, -1);
+
+	if (pid == 0) {
+		rc = pthread_create(&thread, NULL, send_recv_thread, NULL);
+		assert_int_equal(rc, 0);
+		rc = pthread_join(thread, NULL);
+		assert_int_equal(rc, 0);
+
+		send_recv(TORTURE_PROFILE_COUNT / 4);
+		exit(0);
+	}
+
+	rc = waitpid(pid, &status, 0);
+	assert_int_equal(rc, pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+
+	/* The calls of the thread which exited are still counted */
+	profile_line(pid, "sendto", line, sizeof(line));
+	rc = sscanf(line, "sendto calls %llu", &calls);
+	assert_int_equal(rc, 1);
+	assert_int_equal(calls, TORTURE_PROFILE_COUNT / 2);
+}
+
+static void test_profile_benchmark(void **state)
+{
+	uint64_t start, elapsed;
+
+	(void) state; /* unused */
+
+	start = torture_now_usec();
+	send_recv(TORTURE_PROFILE_BENCH_COUNT);
+	elapsed = torture_now_usec() - start;
+
+	printf("Profile: %.2f us per sendto() and recv()\n",
+	       (double)elapsed / TORTURE_PROFILE_BENCH_COUNT);
+}
+
+int main(void) {
+	int rc;
+	int fd;
+
+	const struct CMUnitTest profile_tests[] = {
+		cmocka_unit_test_setup_teardown(test_profile_dump,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_profile_exit,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_profile_thread_exit,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_profile_benchmark,
+						setup,
+						teardown),
+	};
+
+	fd = mkstemp(profile_path);
+	if (fd == -1) {
+		return 1;
+	}
+
+	/* Before the first call into socket_wrapper */
+	setenv("SOCKET_WRAPPER_PROFILE", profile_path, 1);
+	close(fd);
+
+	rc = cmocka_run_group_tests(profile_tests, NULL, NULL);
+
+	/* No report of this process at exit */
+	unsetenv("SOCKET_WRAPPER_PROFILE");
+	unlink(profile_path);
+
+	return rc;
+}
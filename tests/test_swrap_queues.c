@@ -0,0 +1,229 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#ifdef HAVE_LINUX_SOCKIOS_H
+#include <linux/sockios.h>
+#endif
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_QUEUES_PORT 7201
+#define TORTURE_QUEUES_SIZE 1000
+
+/* The link to 127.0.0.22 holds the data for a while */
+#define TORTURE_QUEUES_LATENCY "20-22=100ms"
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "20", 1);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static int queue_depth(int s, unsigned long int request)
+{
+	int value = -1;
+	int rc;
+
+	rc = ioctl(s, request, &value);
+	assert_int_equal(rc, 0);
+
+	return value;
+}
+
+static void stream_pair(const char *ip, int *listener, int *s, int *srv)
+{
+	struct torture_address addr;
+	int rc;
+
+	*listener = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(*listener, -1);
+	torture_make_addr_ipv4(&addr, ip, TORTURE_QUEUES_PORT);
+	rc = bind(*listener, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+	rc = listen(*listener, 5);
+	assert_int_equal(rc, 0);
+
+	*s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(*s, -1);
+	rc = connect(*s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	*srv = accept(*listener, NULL, NULL);
+	assert_int_not_equal(*srv, -1);
+}
+
+#if defined(SIOCOUTQ) && defined(SIOCOUTQNSD)
+static void test_queues_stream(void **state)
+{
+	char buf[TORTURE_QUEUES_SIZE];
+	ssize_t ret;
+	int listener, srv, s;
+	int value;
+	int rc;
+
+	(void) state; /* unused */
+
+	memset(buf, 'q', sizeof(buf));
+
+	stream_pair("127.0.0.21", &listener, &s, &srv);
+
+	assert_int_equal(queue_depth(s, SIOCOUTQ), 0);
+	assert_int_equal(queue_depth(s, SIOCOUTQNSD), 0);
+
+	ret = write(s, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	/* Nothing got read, the peer keeps its window closed */
+	assert_int_equal(queue_depth(s, SIOCOUTQ), sizeof(buf));
+	assert_int_equal(queue_depth(s, SIOCOUTQNSD), sizeof(buf));
+	assert_int_equal(queue_depth(srv, SIOCINQ), sizeof(buf));
+
+	ret = read(srv, buf, 400);
+	assert_int_equal(ret, 400);
+
+	assert_int_equal(queue_depth(s, SIOCOUTQ), sizeof(buf) - 400);
+	assert_int_equal(queue_depth(s, SIOCOUTQNSD), sizeof(buf) - 400);
+	assert_int_equal(queue_depth(srv, SIOCINQ), sizeof(buf) - 400);
+
+	ret = read(srv, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf) - 400);
+
+	assert_int_equal(queue_depth(s, SIOCOUTQ), 0);
+	assert_int_equal(queue_depth(s, SIOCOUTQNSD), 0);
+	assert_int_equal(queue_depth(srv, SIOCINQ), 0);
+
+	/* Not for a listening socket */
+	rc = ioctl(listener, SIOCOUTQ, &value);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, EINVAL);
+
+	close(s);
+	close(srv);
+	close(listener);
+}
+
+static void test_queues_stream_latency(void **state)
+{
+	char buf[TORTURE_QUEUES_SIZE];
+	ssize_t ret;
+	int listener, srv, s;
+
+	(void) state; /* unused */
+
+	memset(buf, 'l', sizeof(buf));
+
+	stream_pair("127.0.0.22", &listener, &s, &srv);
+
+	ret = write(s, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	/* Still on the link, so it's sent but not acknowledged */
+	assert_int_equal(queue_depth(s, SIOCOUTQ), sizeof(buf));
+	assert_int_equal(queue_depth(s, SIOCOUTQNSD), 0);
+
+	ret = read(srv, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	assert_int_equal(queue_depth(s, SIOCOUTQ), 0);
+	assert_int_equal(queue_depth(s, SIOCOUTQNSD), 0);
+
+	close(s);
+	close(srv);
+	close(listener);
+}
+
+static void test_queues_dgram(void **state)
+{
+	struct torture_address addr;
+	char buf[64];
+	ssize_t ret;
+	int value;
+	int rc;
+	int srv;
+	int s;
+
+	(void) state; /* unused */
+
+	memset(buf, 'd', sizeof(buf));
+
+	srv = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(srv, -1);
+	torture_make_addr_ipv4(&addr, "127.0.0.22", TORTURE_QUEUES_PORT);
+	rc = bind(srv, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	assert_int_equal(queue_depth(s, SIOCOUTQ), 0);
+
+	ret = sendto(s, buf, sizeof(buf), 0, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(ret, sizeof(buf));
+
+	/* The datagram is on the link */
+	assert_int_equal(queue_depth(s, SIOCOUTQ), sizeof(buf));
+
+	ret = recv(srv, buf, sizeof(buf), 0);
+	assert_int_equal(ret, sizeof(buf));
+
+	assert_int_equal(queue_depth(s, SIOCOUTQ), 0);
+
+	/* UDP doesn't know it */
+	rc = ioctl(s, SIOCOUTQNSD, &value);
+	assert_int_equal(rc, -1);
+
+	close(s);
+	close(srv);
+}
+#endif /* SIOCOUTQ && SIOCOUTQNSD */
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest queues_tests[] = {
+#if defined(SIOCOUTQ) && defined(SIOCOUTQNSD)
+		cmocka_unit_test_setup_teardown(test_queues_stream,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_queues_stream_latency,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_queues_dgram,
+						setup,
+						teardown),
+#endif
+	};
+
+	/* Before the first call into socket_wrapper */
+	setenv("SOCKET_WRAPPER_LATENCY", TORTURE_QUEUES_LATENCY, 1);
+
+	rc = cmocka_run_group_tests(queues_tests, NULL, NULL);
+
+	return rc;
+}
@@ -0,0 +1,528 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_RING_SIZE (64 * 1024)
+#define TORTURE_RING_STREAM_SIZE (16 * 1024 * 1024)
+#define TORTURE_RING_BENCH_SIZE (256 * 1024 * 1024)
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+struct torture_conn {
+	int listener;
+	int srv;
+	int cli;
+};
+
+struct torture_writer {
+	int fd;
+	size_t len;
+	size_t chunk;
+	bool pattern;
+};
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Capturing splits the stream into packets again */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+/* The ring size is read when the sockets get bound */
+static void open_conn(struct torture_conn *c,
+		      const char *srv_ring,
+		      const char *cli_ring,
+		      int port)
+{
+	int rc;
+
+	setenv("SOCKET_WRAPPER_SHM_RING", srv_ring, 1);
+	c->listener = torture_bind_ipv4(SOCK_STREAM, "127.0.0.62", port);
+	rc = listen(c->listener, 1);
+	assert_int_equal(rc, 0);
+
+	setenv("SOCKET_WRAPPER_SHM_RING", cli_ring, 1);
+	c->cli = torture_bind_ipv4(SOCK_STREAM, "127.0.0.61", 0);
+	torture_connect_ipv4(c->cli, "127.0.0.62", port);
+
+	c->srv = accept(c->listener, NULL, NULL);
+	assert_int_not_equal(c->srv, -1);
+}
+
+static void close_conn(struct torture_conn *c)
+{
+	close(c->cli);
+	close(c->srv);
+	close(c->listener);
+}
+
+static void set_nonblock(int s)
+{
+	int flags;
+	int rc;
+
+	flags = fcntl(s, F_GETFL);
+	rc = fcntl(s, F_SETFL, flags | O_NONBLOCK);
+	assert_int_equal(rc, 0);
+}
+
+/* Fill the socket until a non-blocking write fails */
+static size_t fill(int s)
+{
+	uint8_t buf[1000];
+	size_t total = 0;
+
+	memset(buf, 0x11, sizeof(buf));
+
+	for (;;) {
+		ssize_t ret;
+
+		ret = write(s, buf, sizeof(buf));
+		if (ret == -1) {
+			assert_int_equal(errno, EAGAIN);
+			break;
+		}
+		total += ret;
+	}
+
+	return total;
+}
+
+static uint8_t pattern(size_t ofs)
+{
+	return (ofs * 7 + ofs / 251) & 0xff;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct torture_writer *w = (struct torture_writer *)arg;
+	uint8_t buf[3 * 4096];
+	size_t ofs = 0;
+
+	while (ofs < w->len) {
+		struct iovec iov[3];
+		size_t len = MIN(w->chunk, w->len - ofs);
+		size_t i;
+		ssize_t ret;
+
+		len = MIN(len, sizeof(buf));
+		for (i = 0; w->pattern && i < len; i++) {
+			buf[i] = pattern(ofs + i);
+		}
+
+		/* Scatter over uneven pieces */
+		iov[0].iov_base = buf;
+		iov[0].iov_len = len / 3;
+		iov[1].iov_base = buf + len / 3;
+		iov[1].iov_len = 0;
+		iov[2].iov_base = buf + len / 3;
+		iov[2].iov_len = len - len / 3;
+
+		ret = writev(w->fd, iov, 3);
+		if (ret <= 0) {
+			break;
+		}
+		ofs += ret;
+	}
+
+	shutdown(w->fd, SHUT_WR);
+
+	return NULL;
+}
+
+static void test_ring_stream(void **state)
+{
+	struct torture_writer w = {
+		.len = TORTURE_RING_STREAM_SIZE,
+		.chunk = 3 * 4096,
+		.pattern = true,
+	};
+	struct torture_conn c;
+	pthread_t t;
+	uint8_t buf[5000];
+	size_t ofs = 0;
+	int chunk = 1;
+	ssize_t ret;
+	int rc;
+
+	(void) state; /* unused */
+
+	open_conn(&c, "64k", "64k", 7041);
+
+	w.fd = c.cli;
+	rc = pthread_create(&t, NULL, writer_thread, &w);
+	assert_int_equal(rc, 0);
+
+	for (;;) {
+		size_t i;
+
+		/* Vary the reads, every fourth one waits for all the data */
+		chunk = (chunk * 13 + 7) % sizeof(buf) + 1;
+		if (chunk % 4 == 0) {
+			ret = recv(c.srv, buf, chunk, MSG_WAITALL);
+		} else {
+			ret = read(c.srv, buf, chunk);
+		}
+		assert_true(ret >= 0);
+		if (ret == 0) {
+			break;
+		}
+
+		for (i = 0; i < (size_t)ret; i++) {
+			if (buf[i] != pattern(ofs + i)) {
+				fail_msg("Corrupted at offset %zu", ofs + i);
+			}
+		}
+		ofs += ret;
+	}
+
+	pthread_join(t, NULL);
+	assert_int_equal(ofs, TORTURE_RING_STREAM_SIZE);
+
+	close_conn(&c);
+}
+
+static void test_ring_nonblock(void **state)
+{
+	struct torture_conn c;
+	struct pollfd pfd;
+	uint8_t buf[1000];
+	size_t total;
+	ssize_t ret;
+	int value;
+	int rc;
+
+	(void) state; /* unused */
+
+	open_conn(&c, "64k", "64k", 7042);
+	set_nonblock(c.cli);
+	set_nonblock(c.srv);
+
+	/* Nothing to read yet */
+	ret = read(c.srv, buf, sizeof(buf));
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, EAGAIN);
+
+	/* The ring is the only buffer */
+	total = fill(c.cli);
+	assert_int_equal(total, TORTURE_RING_SIZE);
+
+	rc = ioctl(c.srv, FIONREAD, &value);
+	assert_int_equal(rc, 0);
+	assert_int_equal(value, TORTURE_RING_SIZE);
+
+	pfd.fd = c.cli;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	rc = poll(&pfd, 1, 0);
+	assert_int_equal(rc, 0);
+
+	pfd.fd = c.srv;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	rc = poll(&pfd, 1, 0);
+	assert_int_equal(rc, 1);
+	assert_true(pfd.revents & POLLIN);
+
+	/* Peeking doesn't make room */
+	ret = recv(c.srv, buf, sizeof(buf), MSG_PEEK);
+	assert_int_equal(ret, sizeof(buf));
+
+	pfd.fd = c.cli;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	rc = poll(&pfd, 1, 0);
+	assert_int_equal(rc, 0);
+
+	ret = read(c.srv, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	rc = poll(&pfd, 1, 1000);
+	assert_int_equal(rc, 1);
+	assert_true(pfd.revents & POLLOUT);
+
+	/* Drain it, the socket must not stay readable */
+	total = sizeof(buf);
+	for (;;) {
+		ret = read(c.srv, buf, sizeof(buf));
+		if (ret == -1) {
+			assert_int_equal(errno, EAGAIN);
+			break;
+		}
+		total += ret;
+	}
+	assert_int_equal(total, TORTURE_RING_SIZE);
+
+	pfd.fd = c.srv;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	rc = poll(&pfd, 1, 0);
+	assert_int_equal(rc, 0);
+
+	close_conn(&c);
+}
+
+static void test_ring_eof(void **state)
+{
+	struct torture_conn c;
+	uint8_t buf[100];
+	ssize_t ret;
+	int rc;
+
+	(void) state; /* unused */
+
+	memset(buf, 0x42, sizeof(buf));
+
+	open_conn(&c, "64k", "64k", 7043);
+
+	ret = write(c.cli, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	rc = shutdown(c.cli, SHUT_WR);
+	assert_int_equal(rc, 0);
+
+	ret = send(c.cli, buf, sizeof(buf), MSG_NOSIGNAL);
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, EPIPE);
+
+	/* The data arrives before the EOF */
+	ret = recv(c.srv, buf, sizeof(buf) * 2, MSG_WAITALL);
+	assert_int_equal(ret, sizeof(buf));
+
+	ret = read(c.srv, buf, sizeof(buf));
+	assert_int_equal(ret, 0);
+
+	/* The other direction still works */
+	ret = write(c.srv, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	ret = read(c.cli, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	/* Writing to a closed peer fails */
+	close(c.cli);
+
+	ret = send(c.srv, buf, sizeof(buf), MSG_NOSIGNAL);
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, EPIPE);
+
+	close(c.srv);
+	close(c.listener);
+}
+
+static void test_ring_fallback(void **state)
+{
+	struct torture_conn c;
+	uint8_t buf[100];
+	size_t total;
+	ssize_t ret;
+
+	(void) state; /* unused */
+
+	memset(buf, 0x23, sizeof(buf));
+
+	/* The server doesn't offer the ring, the client has to use the socket */
+	open_conn(&c, "0", "64k", 7044);
+
+	ret = write(c.cli, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	ret = read(c.srv, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	set_nonblock(c.cli);
+	total = fill(c.cli);
+	assert_int_not_equal(total, TORTURE_RING_SIZE);
+
+	close_conn(&c);
+
+	/* Nor the client */
+	open_conn(&c, "64k", "0", 7045);
+
+	ret = write(c.srv, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	ret = read(c.cli, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	set_nonblock(c.srv);
+	total = fill(c.srv);
+	assert_int_not_equal(total, TORTURE_RING_SIZE);
+
+	close_conn(&c);
+}
+
+/* A non-blocking listener doesn't wait for the hello of the client */
+static void test_ring_nonblock_listener(void **state)
+{
+	struct torture_conn c;
+	struct pollfd pfd;
+	uint8_t buf[100];
+	uint64_t start;
+	size_t total;
+	ssize_t ret;
+	int rc;
+
+	(void) state; /* unused */
+
+	memset(buf, 0x17, sizeof(buf));
+
+	setenv("SOCKET_WRAPPER_SHM_RING", "64k", 1);
+	c.listener = torture_bind_ipv4(SOCK_STREAM, "127.0.0.62", 7046);
+	rc = listen(c.listener, 1);
+	assert_int_equal(rc, 0);
+	set_nonblock(c.listener);
+
+	start = torture_now_usec();
+	c.srv = accept(c.listener, NULL, NULL);
+	assert_int_equal(c.srv, -1);
+	assert_int_equal(errno, EAGAIN);
+	assert_true(torture_now_usec() - start < 100000);
+
+	c.cli = torture_bind_ipv4(SOCK_STREAM, "127.0.0.61", 0);
+	torture_connect_ipv4(c.cli, "127.0.0.62", 7046);
+
+	pfd.fd = c.listener;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	rc = poll(&pfd, 1, 1000);
+	assert_int_equal(rc, 1);
+
+	c.srv = accept(c.listener, NULL, NULL);
+	assert_int_not_equal(c.srv, -1);
+
+	/* The server writes first, it has to know about the ring by now */
+	set_nonblock(c.srv);
+	total = fill(c.srv);
+	assert_int_equal(total, TORTURE_RING_SIZE);
+
+	ret = recv(c.cli, buf, sizeof(buf), MSG_WAITALL);
+	assert_int_equal(ret, sizeof(buf));
+
+	ret = write(c.cli, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	pfd.fd = c.srv;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	rc = poll(&pfd, 1, 1000);
+	assert_int_equal(rc, 1);
+
+	ret = read(c.srv, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	close_conn(&c);
+}
+
+static double bench(const char *ring, int port)
+{
+	struct torture_writer w = {
+		.len = TORTURE_RING_BENCH_SIZE,
+		.chunk = 3 * 4096,
+	};
+	struct torture_conn c;
+	uint8_t buf[64 * 1024];
+	size_t total = 0;
+	uint64_t start;
+	pthread_t t;
+	int rc;
+
+	open_conn(&c, ring, ring, port);
+
+	start = torture_now_usec();
+
+	w.fd = c.cli;
+	rc = pthread_create(&t, NULL, writer_thread, &w);
+	assert_int_equal(rc, 0);
+
+	for (;;) {
+		ssize_t ret;
+
+		ret = read(c.srv, buf, sizeof(buf));
+		assert_true(ret >= 0);
+		if (ret == 0) {
+			break;
+		}
+		total += ret;
+	}
+
+	pthread_join(t, NULL);
+	assert_int_equal(total, TORTURE_RING_BENCH_SIZE);
+
+	close_conn(&c);
+
+	return (double)total / (torture_now_usec() - start);
+}
+
+static void test_ring_throughput(void **state)
+{
+	double ring, unix_sock;
+
+	(void) state; /* unused */
+
+	unix_sock = bench("0", 7046);
+	ring = bench("1m", 7047);
+
+	printf("Throughput: unix socket %.0f MB/s, shm ring %.0f MB/s\n",
+	       unix_sock, ring);
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest ring_tests[] = {
+		cmocka_unit_test_setup_teardown(test_ring_stream,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_ring_nonblock,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_ring_eof,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_ring_fallback,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_ring_nonblock_listener,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_ring_throughput,
+						setup,
+						teardown),
+	};
+
+	rc = cmocka_run_group_tests(ring_tests, NULL, NULL);
+
+	return rc;
+}
@@ -0,0 +1,461 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_SOCKBUF_PORT 7211
+#define TORTURE_SOCKBUF_COUNT 10
+#define TORTURE_SOCKBUF_SIZE 1000
+
+/* More sockets than the table of the receive queues holds */
+#define TORTURE_SOCKBUF_SOCKETS 5000
+
+/* The datagrams to 127.0.0.22 arrive later */
+#define TORTURE_SOCKBUF_LATENCY "20-22=2ms"
+
+/* SOCK_MIN_SNDBUF and SOCK_MIN_RCVBUF of the kernel */
+#define TORTURE_MIN_SNDBUF 4608
+#define TORTURE_MIN_RCVBUF 2304
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "20", 1);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+/* The value with the given index of the sysctl file, -1 without one */
+static int sysctl_value(const char *path, int idx)
+{
+	int v[3] = { -1, -1, -1 };
+	FILE *fp;
+	int rc;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	rc = fscanf(fp, "%d %d %d", &v[0], &v[1], &v[2]);
+	fclose(fp);
+	if (rc <= idx) {
+		return -1;
+	}
+
+	return v[idx];
+}
+
+static int get_buf(int s, int optname)
+{
+	socklen_t len = sizeof(int);
+	int val = -1;
+	int rc;
+
+	rc = getsockopt(s, SOL_SOCKET, optname, &val, &len);
+	assert_int_equal(rc, 0);
+	assert_int_equal(len, sizeof(int));
+
+	return val;
+}
+
+static void set_buf(int s, int optname, int val)
+{
+	int rc;
+
+	rc = setsockopt(s, SOL_SOCKET, optname, &val, sizeof(val));
+	assert_int_equal(rc, 0);
+}
+
+static void test_sockbuf_defaults(void **state)
+{
+	int expected;
+	int s;
+
+	(void) state; /* unused */
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+
+	expected = sysctl_value("/proc/sys/net/ipv4/tcp_wmem", 1);
+	if (expected != -1) {
+		assert_int_equal(get_buf(s, SO_SNDBUF), expected);
+	}
+	expected = sysctl_value("/proc/sys/net/ipv4/tcp_rmem", 1);
+	if (expected != -1) {
+		assert_int_equal(get_buf(s, SO_RCVBUF), expected);
+	}
+
+	close(s);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	expected = sysctl_value("/proc/sys/net/core/wmem_default", 0);
+	if (expected != -1) {
+		assert_int_equal(get_buf(s, SO_SNDBUF), expected);
+	}
+	expected = sysctl_value("/proc/sys/net/core/rmem_default", 0);
+	if (expected != -1) {
+		assert_int_equal(get_buf(s, SO_RCVBUF), expected);
+	}
+
+	close(s);
+}
+
+static void test_sockbuf_doubling(void **state)
+{
+	int types[] = { SOCK_STREAM, SOCK_DGRAM };
+	socklen_t len;
+	int rmem_max;
+	size_t i;
+	char c;
+	int rc;
+	int s;
+
+	(void) state; /* unused */
+
+	rmem_max = sysctl_value("/proc/sys/net/core/rmem_max", 0);
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		s = socket(AF_INET, types[i], 0);
+		assert_int_not_equal(s, -1);
+
+		set_buf(s, SO_SNDBUF, 10000);
+		assert_int_equal(get_buf(s, SO_SNDBUF), 20000);
+		set_buf(s, SO_RCVBUF, 10000);
+		assert_int_equal(get_buf(s, SO_RCVBUF), 20000);
+
+		/* Not less than the kernel allows */
+		set_buf(s, SO_SNDBUF, 1);
+		assert_int_equal(get_buf(s, SO_SNDBUF), TORTURE_MIN_SNDBUF);
+		set_buf(s, SO_RCVBUF, 1);
+		assert_int_equal(get_buf(s, SO_RCVBUF), TORTURE_MIN_RCVBUF);
+
+		/* Not more than rmem_max */
+		set_buf(s, SO_RCVBUF, INT_MAX);
+		if (rmem_max != -1) {
+			assert_int_equal(get_buf(s, SO_RCVBUF), 2 * rmem_max);
+		}
+
+		rc = setsockopt(s, SOL_SOCKET, SO_RCVBUF, &c, sizeof(c));
+		assert_int_equal(rc, -1);
+		assert_int_equal(errno, EINVAL);
+
+		len = sizeof(c);
+		rc = getsockopt(s, SOL_SOCKET, SO_RCVBUF, &c, &len);
+		assert_int_equal(rc, -1);
+		assert_int_equal(errno, EINVAL);
+
+		close(s);
+	}
+}
+
+static void test_sockbuf_accept(void **state)
+{
+	struct torture_address addr;
+	int listener, srv, s;
+	int rc;
+
+	(void) state; /* unused */
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(listener, -1);
+	set_buf(listener, SO_SNDBUF, 20000);
+	set_buf(listener, SO_RCVBUF, 10000);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_SOCKBUF_PORT);
+	rc = bind(listener, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+	rc = listen(listener, 5);
+	assert_int_equal(rc, 0);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	srv = accept(listener, NULL, NULL);
+	assert_int_not_equal(srv, -1);
+
+	/* Inherited from the listener */
+	assert_int_equal(get_buf(srv, SO_SNDBUF), 40000);
+	assert_int_equal(get_buf(srv, SO_RCVBUF), 20000);
+
+	close(s);
+	close(srv);
+	close(listener);
+}
+
+static int drain(int s)
+{
+	char buf[TORTURE_SOCKBUF_SIZE];
+	ssize_t ret;
+	int count = 0;
+
+	for (;;) {
+		ret = recv(s, buf, sizeof(buf), MSG_DONTWAIT);
+		if (ret == -1) {
+			assert_int_equal(errno, EAGAIN);
+			break;
+		}
+		assert_int_equal(ret, sizeof(buf));
+		count++;
+	}
+
+	return count;
+}
+
+static void send_all(int s, const struct torture_address *addr)
+{
+	char buf[TORTURE_SOCKBUF_SIZE];
+	ssize_t ret;
+	int i;
+
+	memset(buf, 'b', sizeof(buf));
+
+	/* UDP doesn't tell about the drops */
+	for (i = 0; i < TORTURE_SOCKBUF_COUNT; i++) {
+		ret = sendto(s, buf, sizeof(buf), 0,
+			     &addr->sa.s, addr->sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+	}
+}
+
+static void test_sockbuf_udp_overflow(void **state)
+{
+	struct torture_address addr;
+	int count;
+	int rc;
+	int srv;
+	int s;
+
+	(void) state; /* unused */
+
+	srv = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(srv, -1);
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_SOCKBUF_PORT);
+	rc = bind(srv, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	/* Everything fits into the default */
+	send_all(s, &addr);
+	assert_int_equal(drain(srv), TORTURE_SOCKBUF_COUNT);
+
+	/* Only a part fits into 8k */
+	set_buf(srv, SO_RCVBUF, 4096);
+	send_all(s, &addr);
+	count = drain(srv);
+	assert_true(count > 0);
+	assert_true(count < TORTURE_SOCKBUF_COUNT);
+
+	/* The same again once it got read */
+	send_all(s, &addr);
+	assert_int_equal(drain(srv), count);
+
+	close(s);
+	close(srv);
+}
+
+static void test_sockbuf_udp_overflow_delayed(void **state)
+{
+	struct torture_address addr;
+	int count;
+	int rc;
+	int srv;
+	int s;
+
+	(void) state; /* unused */
+
+	srv = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(srv, -1);
+	set_buf(srv, SO_RCVBUF, 4096);
+	torture_make_addr_ipv4(&addr, "127.0.0.22", TORTURE_SOCKBUF_PORT);
+	rc = bind(srv, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	/* Dropped when they arrive */
+	send_all(s, &addr);
+	usleep(100 * 1000);
+
+	count = drain(srv);
+	assert_true(count > 0);
+	assert_true(count < TORTURE_SOCKBUF_COUNT);
+
+	close(s);
+	close(srv);
+}
+
+struct sender {
+	int fd;
+	struct torture_address addr;
+	ssize_t ret;
+};
+
+/* Sends once the reader waits in recv() */
+static void *sender_thread(void *arg)
+{
+	struct sender *snd = (struct sender *)arg;
+	char buf[TORTURE_SOCKBUF_SIZE];
+
+	memset(buf, 'b', sizeof(buf));
+	usleep(50 * 1000);
+
+	snd->ret = sendto(snd->fd, buf, sizeof(buf), 0,
+			  &snd->addr.sa.s, snd->addr.sa_socklen);
+
+	return NULL;
+}
+
+static void test_sockbuf_udp_truncated(void **state)
+{
+	struct sender snd;
+	pthread_t t;
+	ssize_t ret;
+	int count;
+	char c;
+	int rc;
+	int srv;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM,
+				"127.0.0.21",
+				TORTURE_SOCKBUF_PORT + 1);
+	set_buf(srv, SO_RCVBUF, 4096);
+	torture_make_addr_ipv4(&snd.addr,
+			       "127.0.0.21",
+			       TORTURE_SOCKBUF_PORT + 1);
+
+	snd.fd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(snd.fd, -1);
+
+	send_all(snd.fd, &snd.addr);
+	count = drain(srv);
+	assert_true(count > 0);
+	assert_true(count < TORTURE_SOCKBUF_COUNT);
+
+	/* The rest of a datagram read into a short buffer is gone too */
+	send_all(snd.fd, &snd.addr);
+	ret = recv(srv, &c, 1, MSG_TRUNC|MSG_DONTWAIT);
+	assert_int_equal(ret, TORTURE_SOCKBUF_SIZE);
+	ret = recv(srv, &c, 1, MSG_DONTWAIT);
+	assert_int_equal(ret, 1);
+	ret = read(srv, &c, 1);
+	assert_int_equal(ret, 1);
+	assert_int_equal(drain(srv), count - 3);
+
+	/* A read which waits for the datagram */
+	rc = pthread_create(&t, NULL, sender_thread, &snd);
+	assert_int_equal(rc, 0);
+	ret = recv(srv, &c, 1, 0);
+	assert_int_equal(ret, 1);
+	rc = pthread_join(t, NULL);
+	assert_int_equal(rc, 0);
+	assert_int_equal(snd.ret, TORTURE_SOCKBUF_SIZE);
+
+	send_all(snd.fd, &snd.addr);
+	assert_int_equal(drain(srv), count);
+
+	close(snd.fd);
+	close(srv);
+}
+
+static void test_sockbuf_udp_close(void **state)
+{
+	struct torture_address addr;
+	int count;
+	int srv;
+	int s;
+	int i;
+
+	(void) state; /* unused */
+
+	/* Every closed socket gives its slot back */
+	for (i = 0; i < TORTURE_SOCKBUF_SOCKETS; i++) {
+		srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.23", 10000 + i);
+		close(srv);
+	}
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.21", TORTURE_SOCKBUF_PORT);
+	set_buf(srv, SO_RCVBUF, 4096);
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_SOCKBUF_PORT);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	send_all(s, &addr);
+	count = drain(srv);
+	assert_true(count > 0);
+	assert_true(count < TORTURE_SOCKBUF_COUNT);
+
+	close(s);
+	close(srv);
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest sockbuf_tests[] = {
+		cmocka_unit_test_setup_teardown(test_sockbuf_defaults,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_sockbuf_doubling,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_sockbuf_accept,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_sockbuf_udp_overflow,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_sockbuf_udp_overflow_delayed,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_sockbuf_udp_truncated,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_sockbuf_udp_close,
+						setup,
+						teardown),
+	};
+
+	/* Before the first call into socket_wrapper */
+	setenv("SOCKET_WRAPPER_LATENCY", TORTURE_SOCKBUF_LATENCY, 1);
+	setenv("SOCKET_WRAPPER_RCVBUF", "1", 1);
+
+	rc = cmocka_run_group_tests(sockbuf_tests, NULL, NULL);
+
+	return rc;
+}
@@ -0,0 +1,238 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_SS_PORT 7161
+#define TORTURE_SS_BENCH_SOCKETS 500
+
+struct ss_line {
+	char netid[8];
+	char state[16];
+	char rqueue[16];
+	char wqueue[16];
+	char local[64];
+	char peer[64];
+	char pid[16];
+};
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "20", 1);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+/* Runs swrap_ss and returns the number of sockets it listed */
+static size_t swrap_ss(const char *args, struct ss_line *lines, size_t num)
+{
+	char cmd[1024];
+	char buf[512];
+	size_t count = 0;
+	FILE *fp;
+	int rc;
+
+	snprintf(cmd, sizeof(cmd), "%s/src/swrap_ss -d %s %s",
+		 BINARYDIR, getenv("SOCKET_WRAPPER_DIR"), args);
+
+	fp = popen(cmd, "r");
+	assert_non_null(fp);
+
+	/* The header */
+	assert_non_null(fgets(buf, sizeof(buf), fp));
+	assert_true(strncmp(buf, "Netid", 5) == 0);
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		if (count < num) {
+			struct ss_line *l = &lines[count];
+
+			rc = sscanf(buf, "%7s %15s %15s %15s %63s %63s %15s",
+				    l->netid, l->state, l->rqueue, l->wqueue,
+				    l->local, l->peer, l->pid);
+			assert_int_equal(rc, 7);
+		}
+		count++;
+	}
+
+	rc = pclose(fp);
+	assert_int_equal(rc, 0);
+
+	return count;
+}
+
+static const struct ss_line *find_line(const struct ss_line *lines,
+				       size_t num,
+				       const char *state,
+				       const char *local)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		if (strcmp(lines[i].state, state) == 0 &&
+		    strcmp(lines[i].local, local) == 0) {
+			return &lines[i];
+		}
+	}
+
+	fail_msg("No %s socket on %s", state, local);
+
+	return NULL;
+}
+
+static void test_ss_list(void **state)
+{
+	struct torture_address addr;
+	struct torture_address name = {
+		.sa_socklen = sizeof(struct sockaddr_storage),
+	};
+	const struct ss_line *l;
+	struct ss_line lines[16];
+	char buf[100];
+	char local[64];
+	char pid[16];
+	size_t num;
+	ssize_t ret;
+	int listener, srv, s, u;
+	int rc;
+
+	(void) state; /* unused */
+
+	memset(buf, 'x', sizeof(buf));
+	snprintf(pid, sizeof(pid), "%d", (int)getpid());
+
+	listener = torture_bind_ipv4(SOCK_STREAM, "127.0.0.21", TORTURE_SS_PORT);
+	rc = listen(listener, 5);
+	assert_int_equal(rc, 0);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_SS_PORT);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	rc = getsockname(s, &name.sa.s, &name.sa_socklen);
+	assert_int_equal(rc, 0);
+	snprintf(local, sizeof(local), "127.0.0.20:%u",
+		 ntohs(name.sa.in.sin_port));
+
+	srv = accept(listener, NULL, NULL);
+	assert_int_not_equal(srv, -1);
+
+	/* Nobody reads it */
+	ret = write(s, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	u = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.21", TORTURE_SS_PORT);
+
+	num = swrap_ss("", lines, 16);
+	assert_int_equal(num, 4);
+
+	l = find_line(lines, num, "LISTEN", "127.0.0.21:7161");
+	assert_string_equal(l->netid, "tcp");
+	assert_string_equal(l->peer, "*");
+	assert_string_equal(l->pid, pid);
+
+	/* Both ends of the connection, the data waits in the server */
+	l = find_line(lines, num, "ESTAB", "127.0.0.21:7161");
+	assert_string_equal(l->rqueue, "100");
+	assert_string_equal(l->peer, local);
+	assert_string_equal(l->pid, pid);
+
+	l = find_line(lines, num, "ESTAB", local);
+	assert_string_equal(l->peer, "127.0.0.21:7161");
+
+	l = find_line(lines, num, "UNCONN", "127.0.0.21:7161");
+	assert_string_equal(l->netid, "udp");
+
+	/* The filters */
+	num = swrap_ss("-l", lines, 16);
+	assert_int_equal(num, 1);
+
+	num = swrap_ss("-u -n", lines, 16);
+	assert_int_equal(num, 1);
+	assert_string_equal(lines[0].pid, "-");
+
+	close(u);
+	close(srv);
+	close(s);
+	close(listener);
+}
+
+static void test_ss_benchmark(void **state)
+{
+	int fds[TORTURE_SS_BENCH_SOCKETS];
+	struct ss_line line;
+	uint64_t start, in_list, in_pids;
+	size_t num;
+	int i;
+
+	(void) state; /* unused */
+
+	for (i = 0; i < TORTURE_SS_BENCH_SOCKETS; i++) {
+		fds[i] = torture_bind_ipv4(SOCK_DGRAM,
+					   "127.0.0.21",
+					   TORTURE_SS_PORT + i);
+	}
+
+	start = torture_now_usec();
+	num = swrap_ss("-n", &line, 1);
+	in_list = torture_now_usec() - start;
+	assert_int_equal(num, TORTURE_SS_BENCH_SOCKETS);
+
+	start = torture_now_usec();
+	num = swrap_ss("", &line, 1);
+	in_pids = torture_now_usec() - start;
+	assert_int_equal(num, TORTURE_SS_BENCH_SOCKETS);
+
+	printf("swrap_ss: %llu us to list %d sockets, %llu us with the pids\n",
+	       (unsigned long long)in_list,
+	       TORTURE_SS_BENCH_SOCKETS,
+	       (unsigned long long)in_pids);
+
+	for (i = 0; i < TORTURE_SS_BENCH_SOCKETS; i++) {
+		close(fds[i]);
+	}
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest ss_tests[] = {
+		cmocka_unit_test_setup_teardown(test_ss_list,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_ss_benchmark,
+						setup,
+						teardown),
+	};
+
+	rc = cmocka_run_group_tests(ss_tests, NULL, NULL);
+
+	return rc;
+}
@@ -0,0 +1,205 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_STALE_COUNT 20
+#define TORTURE_STALE_UDP_COUNT 5
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static int connect_udp_ipv4(const char *ip, int port)
+{
+	struct torture_address addr;
+	int rc;
+	int s;
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, ip, port);
+
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	return s;
+}
+
+/* The number of wrapped sockets in the socket directory */
+static int count_sockets(void)
+{
+	const char *dir = getenv("SOCKET_WRAPPER_DIR");
+	struct dirent *de;
+	int count = 0;
+	DIR *d;
+
+	d = opendir(dir);
+	assert_non_null(d);
+
+	while ((de = readdir(d)) != NULL) {
+		switch (de->d_name[0]) {
+		case 'Q': /* TCP */
+		case 'W': /* UDP */
+			count++;
+			break;
+		default:
+			break;
+		}
+	}
+	closedir(d);
+
+	return count;
+}
+
+static void test_stale_autobind(void **state)
+{
+	int tcp, udp, s;
+	pid_t pid;
+	int status;
+	int rc;
+
+	(void) state; /* unused */
+
+	/* A bound stream socket which isn't listening is still alive */
+	tcp = torture_bind_ipv4(SOCK_STREAM, "127.0.0.31", 7061);
+	udp = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.31", 7061);
+
+	/* Autobind once, so the child continues with the same ports */
+	s = connect_udp_ipv4("127.0.0.31", 7061);
+	close(s);
+
+	pid = fork();
+	assert_int_not_equal(pid, -1);
+
+	if (pid == 0) {
+		int i;
+
+		for (i = 0; i < TORTURE_STALE_COUNT; i++) {
+			s = socket(AF_INET, SOCK_STREAM, 0);
+			rc = listen(s, 1);
+			if (s == -1 || rc == -1) {
+				_exit(1);
+			}
+		}
+
+		for (i = 0; i < TORTURE_STALE_UDP_COUNT; i++) {
+			torture_bind_ipv4(SOCK_DGRAM, "127.0.0.33", 7063 + i);
+		}
+
+		/* Die without closing the sockets */
+		_exit(0);
+	}
+
+	rc = waitpid(pid, &status, 0);
+	assert_int_equal(rc, pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+
+	assert_int_equal(count_sockets(),
+			 2 + TORTURE_STALE_COUNT + TORTURE_STALE_UDP_COUNT);
+
+	/* Running into the ports of the child reclaims all stale sockets */
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+	rc = listen(s, 1);
+	assert_int_equal(rc, 0);
+
+	assert_int_equal(count_sockets(), 3);
+
+	close(s);
+	close(udp);
+	close(tcp);
+}
+
+static void test_stale_broadcast(void **state)
+{
+	char path[1024];
+	struct torture_address addr;
+	struct stat st;
+	char buf[] = "stale";
+	ssize_t ret;
+	pid_t pid;
+	int status;
+	int rc;
+	int s;
+
+	(void) state; /* unused */
+
+	snprintf(path, sizeof(path), "%s/W%08X%04X",
+		 getenv("SOCKET_WRAPPER_DIR"), 0x7F000020, 7062);
+
+	pid = fork();
+	assert_int_not_equal(pid, -1);
+
+	if (pid == 0) {
+		s = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.32", 7062);
+		_exit(s == -1 ? 1 : 0);
+	}
+
+	rc = waitpid(pid, &status, 0);
+	assert_int_equal(rc, pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+
+	rc = stat(path, &st);
+	assert_int_equal(rc, 0);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.255.255.255", 7062);
+
+	ret = sendto(s, buf, sizeof(buf), 0, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(ret, sizeof(buf));
+
+	/* The broadcast got refused and removed the path */
+	rc = stat(path, &st);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, ENOENT);
+
+	close(s);
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest stale_tests[] = {
+		cmocka_unit_test_setup_teardown(test_stale_autobind,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_stale_broadcast,
+						setup,
+						teardown),
+	};
+
+	rc = cmocka_run_group_tests(stale_tests, NULL, NULL);
+
+	return rc;
+}
@@ -0,0 +1,346 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+#include "swrap_shm.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_STATS_PORT 7121
+#define TORTURE_STATS_BENCH_COUNT 10000
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "20", 1);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static void stats_path(char *path, size_t size, pid_t pid)
+{
+	snprintf(path, size, "%s/%s%d",
+		 getenv("SOCKET_WRAPPER_DIR"), SWRAP_STATS_FILE_PREFIX, (int)pid);
+}
+
+static void *stats_map(size_t *size)
+{
+	const struct swrap_stats_header *hdr;
+	char path[1024];
+	struct stat st;
+	void *p;
+	int rc;
+	int fd;
+
+	stats_path(path, sizeof(path), getpid());
+
+	fd = open(path, O_RDONLY);
+	assert_int_not_equal(fd, -1);
+	rc = fstat(fd, &st);
+	assert_int_equal(rc, 0);
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	assert_true(p != MAP_FAILED);
+	close(fd);
+
+	hdr = (const struct swrap_stats_header *)p;
+	assert_int_equal(hdr->magic, SWRAP_STATS_MAGIC);
+	assert_int_equal(hdr->pid, getpid());
+	*size = st.st_size;
+
+	return p;
+}
+
+static void stats_sock(const struct swrap_stats_header *hdr,
+		       int fd,
+		       struct swrap_stats_sock *sock)
+{
+	const struct swrap_stats_sock *rows;
+	uint32_t i;
+
+	rows = (const struct swrap_stats_sock *)
+		(const void *)((const uint8_t *)hdr + hdr->sockets_offset);
+
+	for (i = 0; i < hdr->num_sockets; i++) {
+		if (rows[i].state == SWRAP_STATS_SOCK_OPEN && rows[i].fd == fd) {
+			swrap_stats_read(&rows[i], sock, sizeof(*sock));
+			return;
+		}
+	}
+
+	fail_msg("No statistics for fd %d", fd);
+}
+
+static void stats_iface(const struct swrap_stats_header *hdr,
+			unsigned int iface,
+			struct swrap_stats_iface *row)
+{
+	const struct swrap_stats_iface *rows;
+	uint32_t i;
+
+	rows = (const struct swrap_stats_iface *)
+		(const void *)((const uint8_t *)hdr + hdr->ifaces_offset);
+
+	for (i = 0; i < hdr->num_ifaces; i++) {
+		if (rows[i].key == iface + 1) {
+			swrap_stats_read(&rows[i], row, sizeof(*row));
+			return;
+		}
+	}
+
+	fail_msg("No statistics for interface %u", iface);
+}
+
+static void test_stats_counters(void **state)
+{
+	const struct swrap_stats_header *hdr;
+	struct swrap_stats_sock sock;
+	struct swrap_stats_iface iface;
+	struct torture_address addr;
+	char buf[] = "statistics";
+	char rbuf[sizeof(buf)];
+	char cmd[1024];
+	size_t size;
+	void *map;
+	ssize_t ret;
+	int srv, s;
+	int rc;
+	int i;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.21", TORTURE_STATS_PORT);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_STATS_PORT);
+
+	for (i = 0; i < 3; i++) {
+		ret = sendto(s, buf, sizeof(buf), 0,
+			     &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+
+		ret = recv(srv, rbuf, sizeof(rbuf), 0);
+		assert_int_equal(ret, sizeof(buf));
+	}
+
+	ret = recv(srv, rbuf, sizeof(rbuf), MSG_DONTWAIT);
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, EAGAIN);
+
+	map = stats_map(&size);
+	hdr = (const struct swrap_stats_header *)map;
+
+	/* The client got bound to the default interface on the first send */
+	stats_sock(hdr, s, &sock);
+	assert_int_equal(sock.type, SOCK_DGRAM);
+	assert_int_equal(sock.local_iface, 20);
+	assert_int_equal(sock.counters[SWRAP_STATS_SOCKET], 1);
+	assert_int_equal(sock.counters[SWRAP_STATS_SEND], 3);
+	assert_int_equal(sock.counters[SWRAP_STATS_PACKETS_OUT], 3);
+	assert_int_equal(sock.counters[SWRAP_STATS_BYTES_OUT], 3 * sizeof(buf));
+	assert_true(sock.counters[SWRAP_STATS_AUTOBIND_PROBES] >= 1);
+
+	stats_sock(hdr, srv, &sock);
+	assert_int_equal(sock.local_iface, 21);
+	assert_int_equal(sock.local_port, TORTURE_STATS_PORT);
+	assert_int_equal(sock.counters[SWRAP_STATS_BIND], 1);
+	assert_int_equal(sock.counters[SWRAP_STATS_RECV], 4);
+	assert_int_equal(sock.counters[SWRAP_STATS_PACKETS_IN], 3);
+	assert_int_equal(sock.counters[SWRAP_STATS_EAGAIN], 1);
+
+	stats_iface(hdr, 21, &iface);
+	assert_int_equal(iface.counters[SWRAP_STATS_BYTES_IN], 3 * sizeof(buf));
+
+	/* The reader finds the process */
+	snprintf(cmd, sizeof(cmd), "%s/src/swrap_stats -d %s | grep -q '^pid %d'",
+		 BINARYDIR, getenv("SOCKET_WRAPPER_DIR"), (int)getpid());
+	rc = system(cmd);
+	assert_int_equal(rc, 0);
+
+	munmap(map, size);
+	close(s);
+	close(srv);
+}
+
+#ifdef HAVE_SENDFILE
+static void test_stats_sendfile(void **state)
+{
+	const struct swrap_stats_header *hdr;
+	struct swrap_stats_sock sock;
+	struct torture_address addr;
+	char path[] = "/tmp/swrap_stats_XXXXXX";
+	char buf[] = "sendfile statistics";
+	char rbuf[sizeof(buf)];
+	int listener, srv, s;
+	off_t offset = 0;
+	size_t size;
+	void *map;
+	ssize_t ret;
+	int fd;
+	int rc;
+
+	(void) state; /* unused */
+
+	fd = mkstemp(path);
+	assert_int_not_equal(fd, -1);
+	unlink(path);
+	ret = write(fd, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	listener = torture_bind_ipv4(SOCK_STREAM,
+				     "127.0.0.21",
+				     TORTURE_STATS_PORT + 1);
+	rc = listen(listener, 1);
+	assert_int_equal(rc, 0);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_STATS_PORT + 1);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	srv = accept(listener, NULL, NULL);
+	assert_int_not_equal(srv, -1);
+
+	/* The zero-copy path is counted like a write() */
+	ret = sendfile(s, fd, &offset, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+	ret = recv(srv, rbuf, sizeof(rbuf), MSG_WAITALL);
+	assert_int_equal(ret, sizeof(buf));
+
+	map = stats_map(&size);
+	hdr = (const struct swrap_stats_header *)map;
+
+	stats_sock(hdr, s, &sock);
+	assert_int_equal(sock.counters[SWRAP_STATS_SEND], 1);
+	assert_int_equal(sock.counters[SWRAP_STATS_BYTES_OUT], sizeof(buf));
+
+	munmap(map, size);
+	close(s);
+	close(srv);
+	close(listener);
+	close(fd);
+}
+#endif /* HAVE_SENDFILE */
+
+static void test_stats_exit(void **state)
+{
+	char path[1024];
+	struct stat st;
+	pid_t pid;
+	int status;
+	int rc;
+
+	(void) state; /* unused */
+
+	fflush(stdout);
+	pid = fork();
+	assert_int_not_equal(pid, -1);
+
+	if (pid == 0) {
+		int s = socket(AF_INET, SOCK_DGRAM, 0);
+
+		stats_path(path, sizeof(path), getpid());
+		rc = stat(path, &st);
+		/* exit() runs the destructor */
+		exit(s != -1 && rc == 0 ? 0 : 1);
+	}
+
+	rc = waitpid(pid, &status, 0);
+	assert_int_equal(rc, pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+
+	/* The file is gone with the process */
+	stats_path(path, sizeof(path), pid);
+	rc = stat(path, &st);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, ENOENT);
+}
+
+static void test_stats_benchmark(void **state)
+{
+	struct torture_address addr;
+	char buf[] = "bench";
+	char rbuf[sizeof(buf)];
+	uint64_t start, elapsed;
+	ssize_t ret;
+	int srv, s;
+	int i;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.21", TORTURE_STATS_PORT);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_STATS_PORT);
+
+	start = torture_now_usec();
+	for (i = 0; i < TORTURE_STATS_BENCH_COUNT; i++) {
+		ret = sendto(s, buf, sizeof(buf), 0,
+			     &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+
+		ret = recv(srv, rbuf, sizeof(rbuf), 0);
+		assert_int_equal(ret, sizeof(buf));
+	}
+	elapsed = torture_now_usec() - start;
+
+	printf("Statistics: %.2f us per sendto() and recv()\n",
+	       (double)elapsed / TORTURE_STATS_BENCH_COUNT);
+
+	close(s);
+	close(srv);
+}
+
+int main(void) {
+	int rc;
+
+	/* The file is created in the directory of the first test */
+	const struct CMUnitTest stats_tests[] = {
+		cmocka_unit_test(test_stats_counters),
+#ifdef HAVE_SENDFILE
+		cmocka_unit_test(test_stats_sendfile),
+#endif
+		cmocka_unit_test(test_stats_exit),
+		cmocka_unit_test(test_stats_benchmark),
+	};
+
+	setenv("SOCKET_WRAPPER_STATS", "1", 1);
+
+	rc = cmocka_run_group_tests(stats_tests, setup, teardown);
+
+	return rc;
+}
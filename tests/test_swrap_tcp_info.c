@@ -0,0 +1,215 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef HAVE_LINUX_TCP_H
+/* The full struct tcp_info */
+#include <linux/tcp.h>
+#else
+#include <netinet/tcp.h>
+#endif
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The values of tcpi_state, only netinet/tcp.h has them */
+#ifndef TCP_ESTABLISHED
+#define TCP_ESTABLISHED 1
+#define TCP_CLOSE 7
+#define TCP_LISTEN 10
+#endif
+
+#define TORTURE_TCP_INFO_PORT 7191
+#define TORTURE_TCP_INFO_SIZE 65536
+
+/* 1 MB/s, so the 64k take a while on the link */
+#define TORTURE_TCP_INFO_LATENCY "20-21=5ms~1ms,21-20=3ms"
+#define TORTURE_TCP_INFO_BANDWIDTH "20-21=8mbit@4k"
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "20", 1);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static void get_tcp_info(int s, struct tcp_info *ti)
+{
+	socklen_t len = sizeof(*ti);
+	int rc;
+
+	memset(ti, 0xff, sizeof(*ti));
+
+	rc = getsockopt(s, IPPROTO_TCP, TCP_INFO, ti, &len);
+	assert_int_equal(rc, 0);
+	assert_int_equal(len, sizeof(*ti));
+}
+
+static void test_tcp_info(void **state)
+{
+	struct torture_address addr;
+	struct tcp_info ti;
+	char buf[TORTURE_TCP_INFO_SIZE];
+	size_t sent = 0;
+	size_t received = 0;
+	unsigned int sends = 0;
+	ssize_t ret;
+	int listener, srv, s;
+	int rc;
+
+	(void) state; /* unused */
+
+	memset(buf, 'i', sizeof(buf));
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(listener, -1);
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_TCP_INFO_PORT);
+	rc = bind(listener, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+	rc = listen(listener, 5);
+	assert_int_equal(rc, 0);
+
+	get_tcp_info(listener, &ti);
+	assert_int_equal(ti.tcpi_state, TCP_LISTEN);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	srv = accept(listener, NULL, NULL);
+	assert_int_not_equal(srv, -1);
+
+	/* The latency of both directions */
+	get_tcp_info(s, &ti);
+	assert_int_equal(ti.tcpi_state, TCP_ESTABLISHED);
+	assert_int_equal(ti.tcpi_rtt, 8000);
+	assert_int_equal(ti.tcpi_rttvar, 1000);
+	assert_int_equal(ti.tcpi_snd_cwnd, 10);
+	assert_int_equal(ti.tcpi_unacked, 0);
+	assert_true(ti.tcpi_snd_mss > 0);
+
+	get_tcp_info(srv, &ti);
+	assert_int_equal(ti.tcpi_state, TCP_ESTABLISHED);
+	assert_int_equal(ti.tcpi_rtt, 8000);
+
+	/*
+	 * Split at the MTU. A blocking writer is paced by the bucket, so send
+	 * without waiting to keep the whole buffer in flight.
+	 */
+	while (sent < sizeof(buf)) {
+		ret = send(s, buf + sent, sizeof(buf) - sent, MSG_DONTWAIT);
+		assert_true(ret > 0);
+		sent += ret;
+		sends++;
+	}
+
+	/* The link is still busy with the data */
+	get_tcp_info(s, &ti);
+	assert_true(ti.tcpi_unacked > 0);
+#ifdef HAVE_LINUX_TCP_H
+	assert_int_equal(ti.tcpi_bytes_sent, sizeof(buf));
+	assert_true(ti.tcpi_bytes_acked < sizeof(buf));
+	assert_int_equal(ti.tcpi_pacing_rate, 1000000);
+	assert_int_equal(ti.tcpi_segs_out, sends);
+#endif
+
+	while (received < sizeof(buf)) {
+		ret = read(srv, buf, sizeof(buf));
+		assert_true(ret > 0);
+		received += ret;
+	}
+
+	get_tcp_info(s, &ti);
+	assert_int_equal(ti.tcpi_unacked, 0);
+#ifdef HAVE_LINUX_TCP_H
+	assert_int_equal(ti.tcpi_bytes_acked, sizeof(buf));
+#endif
+
+	get_tcp_info(srv, &ti);
+#ifdef HAVE_LINUX_TCP_H
+	assert_int_equal(ti.tcpi_bytes_received, sizeof(buf));
+	assert_int_equal(ti.tcpi_bytes_sent, 0);
+	assert_true(ti.tcpi_segs_in > 0);
+#endif
+
+	close(s);
+	close(srv);
+	close(listener);
+}
+
+static void test_tcp_info_short(void **state)
+{
+	struct tcp_info ti;
+	socklen_t len;
+	int rc;
+	int s;
+
+	(void) state; /* unused */
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+
+	/* Only the start of the struct */
+	len = 1;
+	rc = getsockopt(s, IPPROTO_TCP, TCP_INFO, &ti, &len);
+	assert_int_equal(rc, 0);
+	assert_int_equal(len, 1);
+	assert_int_equal(ti.tcpi_state, TCP_CLOSE);
+
+	close(s);
+
+	/* Not for datagrams */
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	len = sizeof(ti);
+	rc = getsockopt(s, IPPROTO_TCP, TCP_INFO, &ti, &len);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, ENOPROTOOPT);
+
+	close(s);
+}
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest tcp_info_tests[] = {
+		cmocka_unit_test_setup_teardown(test_tcp_info,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_tcp_info_short,
+						setup,
+						teardown),
+	};
+
+	/* Before the first call into socket_wrapper */
+	setenv("SOCKET_WRAPPER_LATENCY", TORTURE_TCP_INFO_LATENCY, 1);
+	setenv("SOCKET_WRAPPER_BANDWIDTH", TORTURE_TCP_INFO_BANDWIDTH, 1);
+
+	rc = cmocka_run_group_tests(tcp_info_tests, NULL, NULL);
+
+	return rc;
+}
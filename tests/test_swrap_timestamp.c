@@ -0,0 +1,363 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+#include <linux/net_tstamp.h>
+#endif
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#endif
+
+#define TORTURE_TIMESTAMP_PORT 7181
+/* Longer than the emulated latency */
+#define TORTURE_TIMESTAMP_SLEEP_USEC 50000
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "20", 1);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t ts_nsec(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static void set_option(int s, int optname, int value)
+{
+	int rc;
+
+	rc = setsockopt(s, SOL_SOCKET, optname, &value, sizeof(value));
+	assert_int_equal(rc, 0);
+}
+
+static int get_option(int s, int optname)
+{
+	socklen_t len = sizeof(int);
+	int value = -1;
+	int rc;
+
+	rc = getsockopt(s, SOL_SOCKET, optname, &value, &len);
+	assert_int_equal(rc, 0);
+	assert_int_equal(len, sizeof(int));
+
+	return value;
+}
+
+/* Receives one message and returns the data of the cmsg */
+static ssize_t recv_cmsg(int s,
+			 int flags,
+			 int level,
+			 int type,
+			 void *data,
+			 size_t size)
+{
+	union {
+		struct cmsghdr cm;
+		uint8_t buf[256];
+	} control;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	struct iovec iov;
+	char buf[64];
+	bool found = false;
+	ssize_t ret;
+
+	iov = (struct iovec) {
+		.iov_base = buf,
+		.iov_len = sizeof(buf),
+	};
+	msg = (struct msghdr) {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	ret = recvmsg(s, &msg, flags);
+	if (ret == -1) {
+		return -1;
+	}
+	assert_false(msg.msg_flags & MSG_CTRUNC);
+
+	for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level == level && cm->cmsg_type == type) {
+			assert_true(cm->cmsg_len >= CMSG_LEN(size));
+			memcpy(data, CMSG_DATA(cm), size);
+			found = true;
+		}
+	}
+	assert_true(found);
+
+	return ret;
+}
+
+static void test_timestamp_dgram(void **state)
+{
+	struct torture_address addr;
+	struct timespec ts;
+	uint64_t sent, received;
+	char buf[] = "stamp";
+	ssize_t ret;
+	int srv, s;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM,
+				"127.0.0.22",
+				TORTURE_TIMESTAMP_PORT);
+
+	set_option(srv, SO_TIMESTAMPNS, 1);
+	assert_int_equal(get_option(srv, SO_TIMESTAMPNS), 1);
+	assert_int_equal(get_option(srv, SO_TIMESTAMP), 0);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.22", TORTURE_TIMESTAMP_PORT);
+
+	sent = now_nsec();
+	ret = sendto(s, buf, sizeof(buf), 0, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(ret, sizeof(buf));
+
+	/* The stamp is the arrival, not the read */
+	usleep(TORTURE_TIMESTAMP_SLEEP_USEC);
+
+	received = now_nsec();
+	ret = recv_cmsg(srv, 0, SOL_SOCKET, SCM_TIMESTAMPNS, &ts, sizeof(ts));
+	assert_int_equal(ret, sizeof(buf));
+
+	/* After the emulated latency */
+	assert_true(ts_nsec(&ts) >= sent + 2000000);
+	assert_true(ts_nsec(&ts) < received);
+
+	close(s);
+	close(srv);
+}
+
+static void test_timestamp_stream(void **state)
+{
+	struct torture_address addr;
+	struct timeval tv;
+	uint64_t before, after, stamp;
+	char buf[] = "stamp";
+	ssize_t ret;
+	int listener, srv, s;
+	int rc;
+
+	(void) state; /* unused */
+
+	listener = torture_bind_ipv4(SOCK_STREAM,
+				     "127.0.0.21",
+				     TORTURE_TIMESTAMP_PORT);
+	rc = listen(listener, 5);
+	assert_int_equal(rc, 0);
+
+	/* Inherited by the accepted socket */
+	set_option(listener, SO_TIMESTAMP, 1);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_TIMESTAMP_PORT);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	srv = accept(listener, NULL, NULL);
+	assert_int_not_equal(srv, -1);
+	assert_int_equal(get_option(srv, SO_TIMESTAMP), 1);
+
+	ret = write(s, buf, sizeof(buf));
+	assert_int_equal(ret, sizeof(buf));
+
+	before = now_nsec();
+	ret = recv_cmsg(srv, 0, SOL_SOCKET, SCM_TIMESTAMP, &tv, sizeof(tv));
+	after = now_nsec();
+	assert_int_equal(ret, sizeof(buf));
+
+	stamp = (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+	assert_true(stamp + 1000 >= before);
+	assert_true(stamp <= after);
+
+	close(s);
+	close(srv);
+	close(listener);
+}
+
+#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(HAVE_LINUX_ERRQUEUE_H)
+/* A transmit stamp comes with the error which carries its key */
+static ssize_t recv_errqueue(int s,
+			     struct scm_timestamping *tss,
+			     struct sock_extended_err *ee)
+{
+	union {
+		struct cmsghdr cm;
+		uint8_t buf[256];
+	} control;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	struct iovec iov;
+	char buf[64];
+	int found = 0;
+	ssize_t ret;
+
+	iov = (struct iovec) {
+		.iov_base = buf,
+		.iov_len = sizeof(buf),
+	};
+	msg = (struct msghdr) {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	ret = recvmsg(s, &msg, MSG_ERRQUEUE);
+	if (ret == -1) {
+		return -1;
+	}
+	assert_true(msg.msg_flags & MSG_ERRQUEUE);
+
+	for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET &&
+		    cm->cmsg_type == SCM_TIMESTAMPING) {
+			memcpy(tss, CMSG_DATA(cm), sizeof(*tss));
+			found++;
+		}
+		if (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) {
+			memcpy(ee, CMSG_DATA(cm), sizeof(*ee));
+			found++;
+		}
+	}
+	assert_int_equal(found, 2);
+
+	return ret;
+}
+
+static void test_timestamping(void **state)
+{
+	struct torture_address addr;
+	struct scm_timestamping tss;
+	struct sock_extended_err ee;
+	char buf[] = "stamp";
+	uint64_t sent;
+	ssize_t ret;
+	int flags;
+	int srv, s;
+	int i;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM,
+				"127.0.0.21",
+				TORTURE_TIMESTAMP_PORT);
+	set_option(srv,
+		   SO_TIMESTAMPING,
+		   SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	flags = SOF_TIMESTAMPING_TX_SOFTWARE |
+		SOF_TIMESTAMPING_SOFTWARE |
+		SOF_TIMESTAMPING_OPT_ID |
+		SOF_TIMESTAMPING_OPT_TSONLY;
+	set_option(s, SO_TIMESTAMPING, flags);
+	assert_int_equal(get_option(s, SO_TIMESTAMPING), flags);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_TIMESTAMP_PORT);
+
+	sent = now_nsec();
+	for (i = 0; i < 2; i++) {
+		ret = sendto(s, buf, sizeof(buf), 0,
+			     &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+
+		ret = recv_cmsg(srv, 0, SOL_SOCKET, SCM_TIMESTAMPING,
+				&tss, sizeof(tss));
+		assert_int_equal(ret, sizeof(buf));
+		assert_true(ts_nsec(&tss.ts[0]) >= sent);
+		assert_int_equal(tss.ts[2].tv_sec, 0);
+	}
+
+	/* The transmit stamps in the error queue, keyed by datagram */
+	for (i = 0; i < 2; i++) {
+		ret = recv_errqueue(s, &tss, &ee);
+		assert_int_equal(ret, 0);
+		assert_true(ts_nsec(&tss.ts[0]) >= sent);
+		assert_true(ts_nsec(&tss.ts[0]) <= now_nsec());
+
+		assert_int_equal(ee.ee_errno, ENOMSG);
+		assert_int_equal(ee.ee_origin, SO_EE_ORIGIN_TIMESTAMPING);
+		assert_int_equal(ee.ee_info, SCM_TSTAMP_SND);
+		assert_int_equal(ee.ee_data, i);
+	}
+
+	ret = recv_errqueue(s, &tss, &ee);
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, EAGAIN);
+
+	close(s);
+	close(srv);
+}
+#endif /* HAVE_LINUX_NET_TSTAMP_H && HAVE_LINUX_ERRQUEUE_H */
+
+int main(void) {
+	int rc;
+
+	const struct CMUnitTest timestamp_tests[] = {
+		cmocka_unit_test_setup_teardown(test_timestamp_dgram,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_timestamp_stream,
+						setup,
+						teardown),
+#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(HAVE_LINUX_ERRQUEUE_H)
+		cmocka_unit_test_setup_teardown(test_timestamping,
+						setup,
+						teardown),
+#endif
+	};
+
+	/* Before the first call into socket_wrapper */
+	setenv("SOCKET_WRAPPER_LATENCY", "20-22=2ms", 1);
+
+	rc = cmocka_run_group_tests(timestamp_tests, NULL, NULL);
+
+	return rc;
+}
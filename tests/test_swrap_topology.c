@@ -0,0 +1,333 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TORTURE_TOPOLOGY_PORT 7101
+#define TORTURE_TOPOLOGY_BENCH_COUNT 10000
+
+static const char *topology =
+	"# Two sites with a slow link in between\n"
+	"host alpha 10\n"
+	"host beta 127.0.0.11\n"
+	"host gamma 20\n"
+	"host delta 21\n"
+	"host far 70000\n"
+	"\n"
+	"subnet site1 alpha beta\n"
+	"subnet site2 gamma\n"
+	"subnet site2 delta\n"
+	"\n"
+	"link site1 site2 latency=20ms\n"
+	"link alpha > gamma latency=50ms\n"
+	"link site2 site2 loss=0%\n"
+	"\n"
+	"deny * far # nobody reaches far\n"
+	"allow alpha far # but alpha\n"
+	"\n"
+	"host broken\n";
+
+static int setup(void **state)
+{
+	torture_setup_socket_dir(state);
+
+	/* Don't measure the pcap file */
+	unsetenv("SOCKET_WRAPPER_PCAP_FILE");
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	unsetenv("SOCKET_WRAPPER_DEFAULT_IFACE");
+	torture_teardown_socket_dir(state);
+
+	return 0;
+}
+
+static bool compiled_topology_exists(void)
+{
+	const char *dir = getenv("SOCKET_WRAPPER_DIR");
+	struct dirent *de;
+	bool found = false;
+	DIR *d;
+
+	d = opendir(dir);
+	assert_non_null(d);
+
+	while ((de = readdir(d)) != NULL) {
+		if (strncmp(de->d_name, ".topology-", 10) == 0) {
+			found = true;
+		}
+	}
+	closedir(d);
+
+	return found;
+}
+
+/* The time it takes a datagram from the host to the address */
+static uint64_t send_usec(const char *host, const char *ip)
+{
+	struct torture_address addr;
+	char buf[] = "topology";
+	char rbuf[sizeof(buf)];
+	uint64_t start;
+	ssize_t ret;
+	int srv, s;
+
+	srv = torture_bind_ipv4(SOCK_DGRAM, ip, TORTURE_TOPOLOGY_PORT);
+
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", host, 1);
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, ip, TORTURE_TOPOLOGY_PORT);
+
+	start = torture_now_usec();
+	ret = sendto(s, buf, sizeof(buf), 0, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(ret, sizeof(buf));
+
+	ret = recv(srv, rbuf, sizeof(rbuf), 0);
+	assert_int_equal(ret, sizeof(buf));
+
+	close(s);
+	close(srv);
+
+	return torture_now_usec() - start;
+}
+
+static void test_topology_names(void **state)
+{
+	struct torture_address addr;
+	struct torture_address name = {
+		.sa_socklen = sizeof(struct sockaddr_storage),
+	};
+	char ip[INET_ADDRSTRLEN];
+	int rc;
+	int s;
+
+	(void) state; /* unused */
+
+	/* The default interface can be the name of a host */
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "beta", 1);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.10", TORTURE_TOPOLOGY_PORT);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	rc = getsockname(s, &name.sa.s, &name.sa_socklen);
+	assert_int_equal(rc, 0);
+	inet_ntop(AF_INET, &name.sa.in.sin_addr, ip, sizeof(ip));
+	assert_string_equal(ip, "127.0.0.11");
+
+	close(s);
+
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "far", 1);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	name.sa_socklen = sizeof(struct sockaddr_storage);
+	rc = getsockname(s, &name.sa.s, &name.sa_socklen);
+	assert_int_equal(rc, 0);
+	inet_ntop(AF_INET, &name.sa.in.sin_addr, ip, sizeof(ip));
+	assert_string_equal(ip, "127.1.17.112");
+
+	close(s);
+
+	/* The compiled topology is kept for the other processes */
+	assert_true(compiled_topology_exists());
+}
+
+static void test_topology_acl(void **state)
+{
+	struct torture_address addr;
+	char buf[] = "acl";
+	char rbuf[sizeof(buf)];
+	ssize_t ret;
+	int srv, listener;
+	int rc;
+	int s;
+
+	(void) state; /* unused */
+
+	srv = torture_bind_ipv4(SOCK_DGRAM,
+				"127.1.17.112",
+				TORTURE_TOPOLOGY_PORT);
+	listener = torture_bind_ipv4(SOCK_STREAM,
+				     "127.1.17.112",
+				     TORTURE_TOPOLOGY_PORT);
+	rc = listen(listener, 1);
+	assert_int_equal(rc, 0);
+
+	torture_make_addr_ipv4(&addr, "127.1.17.112", TORTURE_TOPOLOGY_PORT);
+
+	/* beta can't reach far */
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "beta", 1);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+	ret = sendto(s, buf, sizeof(buf), 0, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(ret, -1);
+	assert_int_equal(errno, ENETUNREACH);
+	close(s);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, ENETUNREACH);
+	close(s);
+
+	/* A datagram socket can't connect() either */
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, -1);
+	assert_int_equal(errno, ENETUNREACH);
+	close(s);
+
+	/* alpha is allowed */
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "alpha", 1);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+	ret = sendto(s, buf, sizeof(buf), 0, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(ret, sizeof(buf));
+	ret = recv(srv, rbuf, sizeof(rbuf), 0);
+	assert_int_equal(ret, sizeof(buf));
+	close(s);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	assert_int_not_equal(s, -1);
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+	close(s);
+
+	close(listener);
+	close(srv);
+}
+
+static void test_topology_links(void **state)
+{
+	uint64_t alpha_gamma;
+	uint64_t gamma_alpha;
+	uint64_t usec;
+
+	(void) state; /* unused */
+
+	/* The rule of the environment wins over the one of the topology */
+	usec = send_usec("beta", "127.0.0.20");
+	assert_true(usec >= 30000);
+
+	/* The host rule wins over the subnet rule */
+	alpha_gamma = send_usec("alpha", "127.0.0.20");
+	assert_true(alpha_gamma >= 50000);
+
+	/* It only applies to one direction */
+	gamma_alpha = send_usec("gamma", "127.0.0.10");
+	assert_true(gamma_alpha >= 20000);
+	assert_true(gamma_alpha < alpha_gamma);
+
+	/* Within a site there is no latency */
+	usec = send_usec("alpha", "127.0.0.11");
+	assert_true(usec < gamma_alpha);
+}
+
+static void test_topology_benchmark(void **state)
+{
+	struct torture_address addr;
+	char buf[] = "bench";
+	char rbuf[sizeof(buf)];
+	uint64_t start, elapsed;
+	ssize_t ret;
+	int srv, s;
+	int i;
+
+	(void) state; /* unused */
+
+	/* Passes the loss and the ACL rules, the subnet key hits */
+	srv = torture_bind_ipv4(SOCK_DGRAM, "127.0.0.21", TORTURE_TOPOLOGY_PORT);
+
+	setenv("SOCKET_WRAPPER_DEFAULT_IFACE", "gamma", 1);
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, "127.0.0.21", TORTURE_TOPOLOGY_PORT);
+
+	start = torture_now_usec();
+	for (i = 0; i < TORTURE_TOPOLOGY_BENCH_COUNT; i++) {
+		ret = sendto(s, buf, sizeof(buf), 0,
+			     &addr.sa.s, addr.sa_socklen);
+		assert_int_equal(ret, sizeof(buf));
+
+		ret = recv(srv, rbuf, sizeof(rbuf), 0);
+		assert_int_equal(ret, sizeof(buf));
+	}
+	elapsed = torture_now_usec() - start;
+
+	printf("Topology: %.2f us per sendto() and recv() within a subnet\n",
+	       (double)elapsed / TORTURE_TOPOLOGY_BENCH_COUNT);
+
+	close(s);
+	close(srv);
+}
+
+int main(void) {
+	char path[] = "/tmp/swrap_topology_XXXXXX";
+	FILE *fp;
+	int rc;
+	int fd;
+
+	const struct CMUnitTest topology_tests[] = {
+		cmocka_unit_test_setup_teardown(test_topology_names,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_topology_acl,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_topology_links,
+						setup,
+						teardown),
+		cmocka_unit_test_setup_teardown(test_topology_benchmark,
+						setup,
+						teardown),
+	};
+
+	fd = mkstemp(path);
+	assert_int_not_equal(fd, -1);
+	fp = fdopen(fd, "w");
+	assert_non_null(fp);
+	fputs(topology, fp);
+	fclose(fp);
+
+	setenv("SOCKET_WRAPPER_TOPOLOGY", path, 1);
+	setenv("SOCKET_WRAPPER_LATENCY", "site1-site2=30ms", 1);
+
+	rc = cmocka_run_group_tests(topology_tests, NULL, NULL);
+
+	unlink(path);
+
+	return rc;
+}
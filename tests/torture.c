@@ -40,6 +40,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
 #include <signal.h>
 #include <fcntl.h>
 
@@ -104,6 +105,60 @@ int torture_server_port(void)
 	return TORTURE_ECHO_SRV_PORT;
 }
 
+void torture_make_addr_ipv4(struct torture_address *addr,
+			    const char *ip,
+			    int port)
+{
+	int rc;
+
+	*addr = (struct torture_address) {
+		.sa_socklen = sizeof(struct sockaddr_in),
+	};
+
+	addr->sa.in.sin_family = AF_INET;
+	addr->sa.in.sin_port = htons(port);
+
+	rc = inet_pton(AF_INET, ip, &addr->sa.in.sin_addr);
+	assert_int_equal(rc, 1);
+}
+
+int torture_bind_ipv4(int type, const char *ip, int port)
+{
+	struct torture_address addr;
+	int rc;
+	int s;
+
+	s = socket(AF_INET, type, 0);
+	assert_int_not_equal(s, -1);
+
+	torture_make_addr_ipv4(&addr, ip, port);
+
+	rc = bind(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+
+	return s;
+}
+
+void torture_connect_ipv4(int s, const char *ip, int port)
+{
+	struct torture_address addr;
+	int rc;
+
+	torture_make_addr_ipv4(&addr, ip, port);
+
+	rc = connect(s, &addr.sa.s, addr.sa_socklen);
+	assert_int_equal(rc, 0);
+}
+
+uint64_t torture_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 void torture_setup_socket_dir(void **state)
 {
 	struct torture_state *s;
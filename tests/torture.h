@@ -74,6 +74,15 @@ struct torture_state {
 const char *torture_server_address(int domain);
 int torture_server_port(void);
 
+void torture_make_addr_ipv4(struct torture_address *addr,
+			    const char *ip,
+			    int port);
+int torture_bind_ipv4(int type, const char *ip, int port);
+void torture_connect_ipv4(int s, const char *ip, int port);
+
+/* CLOCK_MONOTONIC in microseconds */
+uint64_t torture_now_usec(void);
+
 void torture_setup_socket_dir(void **state);
 void torture_setup_echo_srv_udp_ipv4(void **state);
 void torture_setup_echo_srv_udp_ipv6(void **state);